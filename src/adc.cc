@@ -24,12 +24,22 @@
 
 #include "adc.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "common/logging.h"
 
 static const char kSysNode[] = "/sys/bus/iio/devices/iio:device0";
+static const char kDevNode[] = "/dev/iio:device0";
+
+// Scan element format of the AM335x ADC in buffered mode.
+static const char kScanType[] = "le:u12/16>>0";
+#define ADC_BUFFER_RECORDS 64
 
 int arc_read_raw(int chan) {
   if (chan < 0 || chan > 7) {
@@ -54,3 +64,151 @@ int arc_read_raw(int chan) {
 
   return atoi(buf);
 }
+
+// Background sampling. Each value is written as a whole 32 bit word, so
+// readers always see a consistent value per channel without locking.
+static volatile int adc_values[ADC_NUM_CHANNELS];
+static volatile bool adc_sampling = false;
+static pthread_t adc_thread;
+static int adc_interval_ms;
+static int adc_buffer_fd = -1;       // Buffered mode if >= 0.
+static int adc_sysfs_fd[ADC_NUM_CHANNELS];
+
+static bool write_sysfs(const char *name, const char *value) {
+  char node[256];
+  snprintf(node, sizeof(node), "%s/%s", kSysNode, name);
+  const int fd = open(node, O_WRONLY);
+  if (fd < 0) return false;
+  const bool success = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+  close(fd);
+  return success;
+}
+
+static bool read_sysfs(const char *name, char *buf, size_t len) {
+  char node[256];
+  snprintf(node, sizeof(node), "%s/%s", kSysNode, name);
+  const int fd = open(node, O_RDONLY);
+  if (fd < 0) return false;
+  const ssize_t r = read(fd, buf, len - 1);
+  close(fd);
+  if (r <= 0) return false;
+  buf[r] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  return true;
+}
+
+// Enable all channels in the continuous IIO buffer and open it. Returns
+// file descriptor or -1 if not available or in a format we don't know.
+static int open_adc_buffer() {
+  char name[64], type[32];
+  write_sysfs("buffer/enable", "0");
+  for (int chan = 0; chan < ADC_NUM_CHANNELS; ++chan) {
+    snprintf(name, sizeof(name), "scan_elements/in_voltage%d_type", chan);
+    if (!read_sysfs(name, type, sizeof(type)) || strcmp(type, kScanType) != 0)
+      return -1;
+    snprintf(name, sizeof(name), "scan_elements/in_voltage%d_en", chan);
+    if (!write_sysfs(name, "1"))
+      return -1;
+  }
+  write_sysfs("scan_elements/in_timestamp_en", "0");
+  snprintf(name, sizeof(name), "%d", ADC_BUFFER_RECORDS);
+  if (!write_sysfs("buffer/length", name) || !write_sysfs("buffer/enable", "1"))
+    return -1;
+  const int fd = open(kDevNode, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) write_sysfs("buffer/enable", "0");
+  return fd;
+}
+
+// Drain the buffer and take the latest record. The buffer only fills up
+// to its length while we sleep, so the value is at most one interval old.
+static void sample_buffer() {
+  uint16_t records[ADC_BUFFER_RECORDS][ADC_NUM_CHANNELS];
+  ssize_t r;
+  while ((r = read(adc_buffer_fd, records, sizeof(records))) > 0) {
+    const int last = r / sizeof(records[0]) - 1;
+    if (last < 0) continue;
+    for (int chan = 0; chan < ADC_NUM_CHANNELS; ++chan)
+      adc_values[chan] = records[last][chan] & 0xfff;
+  }
+}
+
+static void sample_sysfs() {
+  char buf[32];
+  for (int chan = 0; chan < ADC_NUM_CHANNELS; ++chan) {
+    // sysfs values are updated on each read from the start.
+    const ssize_t r = pread(adc_sysfs_fd[chan], buf, sizeof(buf) - 1, 0);
+    if (r <= 0) {
+      adc_values[chan] = -1;
+      continue;
+    }
+    buf[r] = '\0';
+    adc_values[chan] = atoi(buf);
+  }
+}
+
+static void *adc_sample_thread(void *) {
+  while (adc_sampling) {
+    if (adc_buffer_fd >= 0)
+      sample_buffer();
+    else
+      sample_sysfs();
+    usleep(adc_interval_ms * 1000);
+  }
+  return NULL;
+}
+
+bool adc_start_sampling(int interval_ms) {
+  if (adc_sampling) return true;
+  for (int chan = 0; chan < ADC_NUM_CHANNELS; ++chan) {
+    adc_values[chan] = -1;
+    adc_sysfs_fd[chan] = -1;
+  }
+  adc_interval_ms = interval_ms;
+  adc_buffer_fd = open_adc_buffer();
+  if (adc_buffer_fd < 0) {
+    for (int chan = 0; chan < ADC_NUM_CHANNELS; ++chan) {
+      char node[256];
+      snprintf(node, sizeof(node), "%s/in_voltage%d_raw", kSysNode, chan);
+      adc_sysfs_fd[chan] = open(node, O_RDONLY);
+      if (adc_sysfs_fd[chan] < 0) {
+        Log_info("ADC not available; no background sampling.");
+        adc_stop_sampling();
+        return false;
+      }
+    }
+    sample_sysfs();
+  }
+  Log_debug("ADC sampled every %dms in %s mode.", interval_ms,
+            adc_buffer_fd >= 0 ? "buffered" : "sysfs");
+  adc_sampling = true;
+  if (pthread_create(&adc_thread, NULL, adc_sample_thread, NULL) != 0) {
+    adc_sampling = false;
+    adc_stop_sampling();
+    return false;
+  }
+  return true;
+}
+
+void adc_stop_sampling() {
+  if (adc_sampling) {
+    adc_sampling = false;
+    pthread_join(adc_thread, NULL);
+  }
+  if (adc_buffer_fd >= 0) {
+    close(adc_buffer_fd);
+    write_sysfs("buffer/enable", "0");
+    adc_buffer_fd = -1;
+  }
+  for (int chan = 0; chan < ADC_NUM_CHANNELS; ++chan) {
+    if (adc_sysfs_fd[chan] >= 0) close(adc_sysfs_fd[chan]);
+    adc_sysfs_fd[chan] = -1;
+  }
+}
+
+int adc_read_cached(int chan) {
+  if (!adc_sampling)
+    return arc_read_raw(chan);
+  if (chan < 0 || chan >= ADC_NUM_CHANNELS)
+    return -1;
+  return adc_values[chan];
+}
@@ -20,6 +20,24 @@
 #ifndef BEAGLEG_ADC_
 #define BEAGLEG_ADC_
 
+enum { ADC_NUM_CHANNELS = 8 };
+
+// Read ADC channel 0..7 right away; opens and reads the sysfs file, so this
+// takes a while. Returns -1 on error.
 int arc_read_raw(int chan);
 
+// Sample all ADC channels in a background thread, so that reading them
+// with adc_read_cached() does not need to go to the kernel. Uses the
+// continuous (buffered) IIO interface if available, otherwise reads the
+// sysfs values; either way, new values are taken every "interval_ms".
+// Needs to be started while we still have permissions to set up the ADC.
+// Returns false if the ADC can't be read.
+bool adc_start_sampling(int interval_ms);
+void adc_stop_sampling();
+
+// Latest value of ADC channel 0..7 sampled in the background, -1 if not
+// available. If the background sampling is not running, this is the same
+// as arc_read_raw().
+int adc_read_cached(int chan);
+
 #endif  // BEAGLEG_ADC_
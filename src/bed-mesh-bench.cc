@@ -0,0 +1,90 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measure what bed mesh compensation costs the planner per move: the height
+// lookup and splitting moves along the mesh, for short moves (as typical for
+// CAM output and curves) and long ones crossing many cells.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include "bed-mesh.h"
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static float random_between(float lo, float hi) {
+  return lo + (hi - lo) * random() / RAND_MAX;
+}
+
+static void bench_moves(const BedMesh &mesh, float move_len, int count) {
+  std::vector<float> split;
+  float x = 100, y = 100;
+  long pieces = 0;
+  const double start = now_seconds();
+  for (int i = 0; i < count; ++i) {
+    float to_x = x + random_between(-move_len, move_len);
+    float to_y = y + random_between(-move_len, move_len);
+    if (to_x < 0 || to_x > 200) to_x = 100;
+    if (to_y < 0 || to_y > 200) to_y = 100;
+    mesh.Subdivide(x, y, to_x, to_y, 0.01, &split);
+    pieces += split.size();
+    x = to_x;
+    y = to_y;
+  }
+  const double duration = now_seconds() - start;
+  printf("%6.1fmm moves: %8.0f ns/move, %5.2f pieces/move\n", move_len,
+         1e9 * duration / count, 1.0 * pieces / count);
+}
+
+int main(int argc, char *argv[]) {
+  const int kCount = (argc > 1) ? atoi(argv[1]) : 200000;
+  if (kCount <= 0) {
+    fprintf(stderr, "Usage: %s [<moves>]\n", argv[0]);
+    return 1;
+  }
+
+  // A somewhat warped 200x200mm bed, probed on 7x7 points.
+  BedMesh mesh(0, 0, 200, 200, 7, 7);
+  for (int row = 0; row < mesh.rows(); ++row) {
+    for (int col = 0; col < mesh.columns(); ++col) {
+      mesh.set_height(col, row, random_between(-0.2, 0.2));
+    }
+  }
+
+  float sum = 0;
+  const double start = now_seconds();
+  for (int i = 0; i < kCount; ++i) {
+    sum += mesh.ZOffset(random_between(0, 200), random_between(0, 200));
+  }
+  const double duration = now_seconds() - start;
+  printf("ZOffset(): %8.0f ns/lookup (incl. random(); checksum %.1f)\n",
+         1e9 * duration / kCount, sum);
+
+  bench_moves(mesh, 0.5, kCount);
+  bench_moves(mesh, 5, kCount);
+  bench_moves(mesh, 50, kCount);
+  return 0;
+}
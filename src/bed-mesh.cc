@@ -0,0 +1,148 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bed-mesh.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+
+static inline float clampf(float v, float lo, float hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+BedMesh::BedMesh(float x0, float y0, float x1, float y1, int columns, int rows)
+  : x0_(x0), y0_(y0), columns_(columns), rows_(rows),
+    cell_width_((x1 - x0) / (columns - 1)),
+    cell_height_((y1 - y0) / (rows - 1)),
+    inv_cell_width_(1.0f / cell_width_), inv_cell_height_(1.0f / cell_height_),
+    heights_(columns * rows, 0.0f) {
+  assert(columns >= 2 && rows >= 2);
+  assert(x1 > x0 && y1 > y0);
+}
+
+float BedMesh::ZOffset(float x, float y) const {
+  // Position in grid units; clamped, so outside we continue the edge.
+  const float u = clampf((x - x0_) * inv_cell_width_, 0, columns_ - 1);
+  const float v = clampf((y - y0_) * inv_cell_height_, 0, rows_ - 1);
+  const int col = std::min((int)u, columns_ - 2);
+  const int row = std::min((int)v, rows_ - 2);
+  const float fu = u - col;
+  const float fv = v - row;
+  const float *z = &heights_[row * columns_ + col];
+  const float bottom = z[0] + fu * (z[1] - z[0]);
+  const float top = z[columns_] + fu * (z[columns_ + 1] - z[columns_]);
+  return bottom + fv * (top - bottom);
+}
+
+void BedMesh::Subdivide(float x0, float y0, float x1, float y1,
+                        float tolerance, std::vector<float> *split) const {
+  split->clear();
+  const float dx = x1 - x0;
+  const float dy = y1 - y0;
+  const float u0 = (x0 - x0_) * inv_cell_width_;
+  const float v0 = (y0 - y0_) * inv_cell_height_;
+  const float du = dx * inv_cell_width_;
+  const float dv = dy * inv_cell_height_;
+
+  // Along the line, the interpolated height is a parabola within each cell
+  // and changes its slope where the line crosses a grid line. So these
+  // crossings are where we might have to split ...
+  if (du != 0) {
+    for (int col = 0; col < columns_; ++col) {
+      const float t = (col - u0) / du;
+      if (t > 0 && t < 1) split->push_back(t);
+    }
+  }
+  if (dv != 0) {
+    for (int row = 0; row < rows_; ++row) {
+      const float t = (row - v0) / dv;
+      if (t > 0 && t < 1) split->push_back(t);
+    }
+  }
+  split->push_back(1);
+  std::sort(split->begin(), split->end());
+
+  // ... and, if the cell is twisted, points in between, so that the chords
+  // of the parabola stay within the tolerance. Its quadratic coefficient is
+  // twist * du * dv; a chord over a fraction "len" is off by that * len^2/4.
+  const size_t crossings = split->size();
+  float start = 0;
+  for (size_t i = 0; i < crossings; ++i) {
+    const float end = (*split)[i];
+    const float mid = (start + end) / 2;
+    const float u = u0 + mid * du;
+    const float v = v0 + mid * dv;
+    // Outside the grid, the height only changes along one direction.
+    if (u > 0 && u < columns_ - 1 && v > 0 && v < rows_ - 1) {
+      const int col = std::min((int)u, columns_ - 2);
+      const int row = std::min((int)v, rows_ - 2);
+      const float *z = &heights_[row * columns_ + col];
+      const float twist = z[0] - z[1] - z[columns_] + z[columns_ + 1];
+      const float curvature = fabsf(twist * du * dv);
+      const int pieces = (int)ceilf((end - start)
+                                    * sqrtf(curvature / (4 * tolerance)));
+      for (int p = 1; p < pieces; ++p) {
+        split->push_back(start + (end - start) * p / pieces);
+      }
+    }
+    start = end;
+  }
+  if (split->size() > crossings) {
+    std::sort(split->begin(), split->end());
+  }
+
+  // Of all these candidates, only keep the ones where a straight line
+  // across would deviate too much. Everything before "kept" is the result;
+  // it never overtakes the candidates still to look at.
+  const size_t candidates = split->size();
+  size_t kept = 0;
+  size_t anchor = 0;      // First candidate after the start of this piece.
+  float anchor_t = 0;
+  float anchor_z = ZOffset(x0, y0);
+  for (size_t end = 0; end + 1 < candidates; ++end) {
+    // Can the piece reach the next candidate? Test all the candidates and
+    // midpoints on the way.
+    const float try_t = (*split)[end + 1];
+    const float slope = (ZOffset(x0 + try_t * dx, y0 + try_t * dy) - anchor_z)
+      / (try_t - anchor_t);
+    bool fits = true;
+    float prev_t = anchor_t;
+    for (size_t i = anchor; i <= end + 1 && fits; ++i) {
+      const float t = (*split)[i];
+      const float tm = (prev_t + t) / 2;
+      fits = (fabsf(ZOffset(x0 + tm * dx, y0 + tm * dy)
+                    - (anchor_z + slope * (tm - anchor_t))) <= tolerance);
+      if (fits && i <= end) {
+        fits = (fabsf(ZOffset(x0 + t * dx, y0 + t * dy)
+                      - (anchor_z + slope * (t - anchor_t))) <= tolerance);
+      }
+      prev_t = t;
+    }
+    if (!fits) {
+      anchor_t = (*split)[end];
+      anchor_z = ZOffset(x0 + anchor_t * dx, y0 + anchor_t * dy);
+      anchor = end + 1;
+      (*split)[kept++] = anchor_t;
+    }
+  }
+  (*split)[kept++] = 1;
+  split->resize(kept);
+}
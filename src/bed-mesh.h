@@ -0,0 +1,67 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_BED_MESH_H_
+#define _BEAGLEG_BED_MESH_H_
+
+#include <vector>
+
+// Height map of the bed: Z offsets measured on a regular grid of
+// "columns" x "rows" points spanning (x0, y0)..(x1, y1). In between, the
+// offset is interpolated bilinearly; outside, the nearest edge value is
+// continued.
+//
+// The heights are kept in one flat row-major array and the cell sizes are
+// precomputed, so a lookup is a handful of multiplications.
+class BedMesh {
+public:
+  // Needs at least 2 columns and 2 rows and a non-empty area. All heights
+  // start at zero.
+  BedMesh(float x0, float y0, float x1, float y1, int columns, int rows);
+
+  int columns() const { return columns_; }
+  int rows() const { return rows_; }
+
+  // Position of grid column "col" and row "row".
+  float x(int col) const { return x0_ + col * cell_width_; }
+  float y(int row) const { return y0_ + row * cell_height_; }
+
+  void set_height(int col, int row, float z) { heights_[row*columns_+col] = z; }
+  float height(int col, int row) const { return heights_[row*columns_+col]; }
+
+  // Interpolated Z offset at the given position.
+  float ZOffset(float x, float y) const;
+
+  // Split the straight XY move from (x0, y0) to (x1, y1) into pieces that
+  // can each be compensated with a single linear Z change that stays
+  // within "tolerance" of the interpolated mesh.
+  // Writes the end of each piece, as fraction of the move, into "split";
+  // the last one is always 1. A flat or evenly tilted area needs no
+  // split at all, so most moves result in a single piece.
+  void Subdivide(float x0, float y0, float x1, float y1, float tolerance,
+                 std::vector<float> *split) const;
+
+private:
+  const float x0_, y0_;
+  const int columns_, rows_;
+  const float cell_width_, cell_height_;
+  const float inv_cell_width_, inv_cell_height_;
+  std::vector<float> heights_;
+};
+
+#endif  // _BEAGLEG_BED_MESH_H_
@@ -0,0 +1,117 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bed-mesh.h"
+
+#include <math.h>
+
+#include <gtest/gtest.h>
+
+TEST(BedMeshTest, BilinearBetweenPointsEdgesContinued) {
+  BedMesh mesh(10, 20, 110, 70, 3, 2);   // Cells: 50 x 50
+  EXPECT_FLOAT_EQ(60, mesh.x(1));
+  EXPECT_FLOAT_EQ(70, mesh.y(1));
+  mesh.set_height(0, 0, 0);
+  mesh.set_height(1, 0, 1);
+  mesh.set_height(0, 1, 2);
+  mesh.set_height(1, 1, 5);
+  mesh.set_height(2, 1, -1);
+
+  EXPECT_FLOAT_EQ(1, mesh.ZOffset(60, 20));      // Grid points.
+  EXPECT_FLOAT_EQ(5, mesh.ZOffset(60, 70));
+  EXPECT_FLOAT_EQ(0.5, mesh.ZOffset(35, 20));    // On the edge between.
+  EXPECT_FLOAT_EQ(2, mesh.ZOffset(35, 45));      // Center: average.
+  EXPECT_FLOAT_EQ(-1, mesh.ZOffset(110, 70));    // Last point.
+
+  // Outside: continued from the closest edge.
+  EXPECT_FLOAT_EQ(0, mesh.ZOffset(-100, -100));
+  EXPECT_FLOAT_EQ(-1, mesh.ZOffset(500, 500));
+  EXPECT_FLOAT_EQ(1, mesh.ZOffset(0, 45));
+}
+
+TEST(BedMeshTest, FlatOrTiltedNeedsNoSplit) {
+  BedMesh mesh(0, 0, 100, 100, 5, 5);
+  std::vector<float> split;
+  mesh.Subdivide(-10, 3, 110, 97, 0.01, &split);
+  ASSERT_EQ(1u, split.size());
+  EXPECT_EQ(1, split[0]);
+
+  // A tilted plane is linear along any line.
+  for (int row = 0; row < 5; ++row) {
+    for (int col = 0; col < 5; ++col) {
+      mesh.set_height(col, row, 0.1 * col - 0.05 * row);
+    }
+  }
+  mesh.Subdivide(5, 3, 95, 97, 0.001, &split);
+  EXPECT_EQ(1u, split.size());
+
+  // ... but beyond its edge, it stops rising.
+  mesh.Subdivide(50, 50, 150, 50, 0.001, &split);
+  ASSERT_EQ(2u, split.size());
+  EXPECT_FLOAT_EQ(0.5, split[0]);
+}
+
+// Maximum deviation of the linear interpolation between the split points
+// from the mesh, sampled along the move.
+static float MaxDeviation(const BedMesh &mesh, float x0, float y0,
+                          float x1, float y1, const std::vector<float> &split) {
+  float worst = 0;
+  float start = 0;
+  for (float end : split) {
+    const float z0 = mesh.ZOffset(x0 + start * (x1 - x0), y0 + start * (y1 - y0));
+    const float z1 = mesh.ZOffset(x0 + end * (x1 - x0), y0 + end * (y1 - y0));
+    for (int i = 0; i <= 100; ++i) {
+      const float t = start + (end - start) * i / 100;
+      const float z = mesh.ZOffset(x0 + t * (x1 - x0), y0 + t * (y1 - y0));
+      worst = std::max(worst, fabsf(z - (z0 + (z1 - z0) * i / 100)));
+    }
+    start = end;
+  }
+  return worst;
+}
+
+TEST(BedMeshTest, WarpedBedSplitWithinTolerance) {
+  BedMesh mesh(0, 0, 100, 100, 5, 5);
+  for (int row = 0; row < 5; ++row) {
+    for (int col = 0; col < 5; ++col) {
+      mesh.set_height(col, row, 0.3 * sinf(col * 1.3f) * cosf(row * 0.7f));
+    }
+  }
+  std::vector<float> split;
+  const float kTolerance = 0.01;
+  mesh.Subdivide(3, 7, 97, 88, kTolerance, &split);
+  EXPECT_GT(split.size(), 4u);
+  EXPECT_EQ(1, split.back());
+  for (size_t i = 1; i < split.size(); ++i) EXPECT_LT(split[i-1], split[i]);
+  EXPECT_LE(MaxDeviation(mesh, 3, 7, 97, 88, split), 2 * kTolerance);
+
+  // A looser tolerance takes fewer pieces.
+  std::vector<float> coarse;
+  mesh.Subdivide(3, 7, 97, 88, 10 * kTolerance, &coarse);
+  EXPECT_LT(coarse.size(), split.size());
+
+  // Short moves within a cell mostly don't need any split.
+  mesh.Subdivide(30, 30, 30.5, 30.2, kTolerance, &split);
+  EXPECT_EQ(1u, split.size());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -49,7 +49,7 @@ public:
   }
   T &operator[] (IDX i) { assert(i < N); return data_[i]; }
   const T & operator[] (IDX i) const { assert(i < N); return data_[i]; }
-  bool operator== (const FixedArray<T,N> &other) const {
+  bool operator== (const FixedArray &other) const {
     return memcmp(data_, other.data_, sizeof(data_)) == 0;
   }
 
@@ -121,6 +121,71 @@ private:
   T buffer_[CAPACITY];
 };
 
+// Like RingDeque, but on the heap, and when full, it doubles its capacity
+// instead of running out of space. So it only allocates until it reached the
+// largest size needed. Elements are moved with memcpy(): POD types only.
+template <typename T>
+class GrowingRingDeque {
+public:
+  explicit GrowingRingDeque(size_t initial_capacity)
+    : capacity_(initial_capacity), read_pos_(0), size_(0),
+      buffer_(new T[initial_capacity]) {}
+  ~GrowingRingDeque() { delete [] buffer_; }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+  // Add a new element and return pointer to it.
+  // Element is not initialized.
+  T* append() {
+    if (size_ == capacity_) Grow();
+    return &buffer_[(read_pos_ + size_++) % capacity_];
+  }
+
+  // Return the content relative to the read position.
+  T* operator [] (size_t pos) {
+    assert(size_ > pos);
+    return &buffer_[(read_pos_ + pos) % capacity_];
+  }
+
+  // Return last inserted position
+  T* back() {
+    assert(size_ > 0);
+    return (*this)[size_ - 1];
+  }
+
+  void pop_front() {
+    assert(size_ > 0);
+    read_pos_ = (read_pos_ + 1) % capacity_;
+    --size_;
+  }
+
+  void pop_back() {
+    assert(size_ > 0);
+    --size_;
+  }
+
+private:
+  GrowingRingDeque(const GrowingRingDeque &);  // Not implemented.
+  GrowingRingDeque &operator= (const GrowingRingDeque &);
+
+  void Grow() {
+    T *bigger = new T[2 * capacity_];
+    for (size_t i = 0; i < size_; ++i) {
+      memcpy(&bigger[i], (*this)[i], sizeof(T));
+    }
+    delete [] buffer_;
+    buffer_ = bigger;
+    read_pos_ = 0;
+    capacity_ *= 2;
+  }
+
+  size_t capacity_;
+  size_t read_pos_;
+  size_t size_;
+  T *buffer_;
+};
+
 
 // This class provides a way to iterate over enumeration values. Assumes enum
 // values to be contiguous.
@@ -19,6 +19,7 @@
 #include "logging.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -64,45 +65,211 @@ void Log_init(const char *filename) {
   }
 }
 
-static void Log_internal(int fd, const char *markup_start,
-                         const char *format, va_list ap) {
-  struct timeval now;
-  gettimeofday(&now, NULL);
+static void WriteLine(int fd, const char *markup_start,
+                      const struct timeval &time, const char *text,
+                      int len) {
   struct tm time_breakdown;
-  localtime_r(&now.tv_sec, &time_breakdown);
+  localtime_r(&time.tv_sec, &time_breakdown);
   char fmt_buf[128];
   strftime(fmt_buf, sizeof(fmt_buf), "%F %T", &time_breakdown);
+  char prefix[192];
   struct iovec parts[3];
-  parts[0].iov_len = asprintf((char**) &parts[0].iov_base,
-                              "%s[%s.%06ld]%s ",
-                              markup_start, fmt_buf, now.tv_usec,
+  parts[0].iov_base = prefix;
+  parts[0].iov_len = snprintf(prefix, sizeof(prefix), "%s[%s.%06ld]%s ",
+                              markup_start, fmt_buf, (long) time.tv_usec,
                               markup_end_);
-  parts[1].iov_len = vasprintf((char**) &parts[1].iov_base, format, ap);
+  parts[1].iov_base = (void*) text;
+  parts[1].iov_len = len;
   parts[2].iov_base = (void*) "\n";
   parts[2].iov_len = 1;
-  int already_newline
-    = (parts[1].iov_len > 0 &&
-       ((const char*)parts[1].iov_base)[parts[1].iov_len-1] == '\n');
+  int already_newline = (len > 0 && text[len-1] == '\n');
   if (writev(fd, parts, already_newline ? 2 : 3) < 0) {
     // Logging trouble. Ignore.
   }
+}
 
-  free(parts[0].iov_base);
-  free(parts[1].iov_base);
+static void Log_internal(int fd, const char *markup_start,
+                         const char *format, va_list ap) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  char *text = NULL;
+  const int len = vasprintf(&text, format, ap);
+  if (len < 0) return;
+  WriteLine(fd, markup_start, now, text, len);
+  free(text);
+}
+
+// -- Background writer.
+//
+// A bounded ring that any number of threads can append to without locks: a
+// producer claims the next write position with a compare-and-swap and fills
+// the slot; the slot's sequence number tells the single consumer when it is
+// ready and tells producers when it is free again.
+enum LogLevel { LEVEL_DEBUG, LEVEL_INFO, LEVEL_ERROR };
+
+#define LOG_RING_SIZE     256   // Power of two.
+#define LOG_MAX_TEXT      256   // Longer messages are truncated.
+#define LOG_IDLE_POLL_MS  20
+
+struct LogSlot {
+  volatile unsigned int sequence;
+  LogLevel level;
+  struct timeval time;
+  int len;
+  char text[LOG_MAX_TEXT];
+};
+
+static LogSlot log_ring[LOG_RING_SIZE];
+static volatile unsigned int log_write_pos = 0;
+static unsigned int log_read_pos = 0;        // Only used by writer thread.
+static volatile unsigned int log_dropped = 0;
+static volatile bool log_background = false;
+static volatile bool log_writer_running = false;
+static pthread_t log_writer_thread;
+
+// Message and number of identical messages following it that we swallowed.
+static LogSlot log_last;
+static int log_repeated = 0;
+
+static void EmitLine(LogLevel level, const struct timeval &time,
+                     const char *text, int len) {
+  if (log_fd < 0) {
+    syslog(level == LEVEL_ERROR ? LOG_ERR : LOG_INFO, "%.*s", len, text);
+    return;
+  }
+  const char *markup = (level == LEVEL_DEBUG ? debug_markup_start_
+                        : level == LEVEL_INFO ? info_markup_start_
+                        : error_markup_start_);
+  WriteLine(log_fd, markup, time, text, len);
+}
+
+static void FlushRepeated() {
+  if (log_repeated == 0) return;
+  char msg[64];
+  const int len = snprintf(msg, sizeof(msg),
+                           "(last message repeated %d times)", log_repeated);
+  EmitLine(log_last.level, log_last.time, msg, len);
+  log_repeated = 0;
+}
+
+// Write out all messages that are ready. Returns number of messages.
+static int DrainRing() {
+  int count = 0;
+  for (;;) {
+    LogSlot *slot = &log_ring[log_read_pos % LOG_RING_SIZE];
+    if (slot->sequence != log_read_pos + 1) break;  // Not written yet.
+    __sync_synchronize();
+    if (slot->len == log_last.len && slot->level == log_last.level
+        && memcmp(slot->text, log_last.text, slot->len) == 0) {
+      log_last.time = slot->time;
+      ++log_repeated;
+    } else {
+      FlushRepeated();
+      EmitLine(slot->level, slot->time, slot->text, slot->len);
+      log_last.level = slot->level;
+      log_last.time = slot->time;
+      log_last.len = slot->len;
+      memcpy(log_last.text, slot->text, slot->len);
+    }
+    __sync_synchronize();
+    slot->sequence = log_read_pos + LOG_RING_SIZE;  // Free for next round.
+    ++log_read_pos;
+    ++count;
+  }
+  const unsigned int dropped = __sync_lock_test_and_set(&log_dropped, 0);
+  if (dropped) {
+    FlushRepeated();
+    char msg[64];
+    const int len = snprintf(msg, sizeof(msg),
+                             "(%u log messages dropped)", dropped);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    EmitLine(LEVEL_ERROR, now, msg, len);
+    log_last.len = -1;
+  }
+  return count;
+}
+
+static void *LogWriterThread(void *) {
+  const struct timespec idle = { 0, LOG_IDLE_POLL_MS * 1000000L };
+  while (log_writer_running) {
+    if (DrainRing() == 0) {
+      nanosleep(&idle, NULL);
+      if (DrainRing() == 0)
+        FlushRepeated();  // Quiet for a while; don't sit on a count forever.
+    }
+  }
+  return NULL;
+}
+
+static void StopBackgroundWriter() {
+  if (!log_background) return;
+  log_background = false;
+  log_writer_running = false;
+  pthread_join(log_writer_thread, NULL);
+  DrainRing();
+  FlushRepeated();
+}
+
+void Log_start_background_writer() {
+  if (log_background) return;
+  for (unsigned int i = 0; i < LOG_RING_SIZE; ++i) {
+    log_ring[i].sequence = log_write_pos + i;
+  }
+  log_read_pos = log_write_pos;
+  log_last.len = -1;
+  log_writer_running = true;
+  if (pthread_create(&log_writer_thread, NULL, &LogWriterThread, NULL) != 0) {
+    log_writer_running = false;
+    return;  // Stay synchronous.
+  }
+  log_background = true;
+  atexit(&StopBackgroundWriter);
+}
+
+// Format message into the next free slot. Does not block.
+static void Log_enqueue(LogLevel level, const char *format, va_list ap) {
+  unsigned int pos = log_write_pos;
+  LogSlot *slot;
+  for (;;) {
+    slot = &log_ring[pos % LOG_RING_SIZE];
+    const int diff = (int) (slot->sequence - pos);
+    if (diff < 0) {  // Writer did not get to this slot yet: full.
+      __sync_fetch_and_add(&log_dropped, 1);
+      return;
+    }
+    if (diff == 0
+        && __sync_bool_compare_and_swap(&log_write_pos, pos, pos + 1)) {
+      break;
+    }
+    pos = log_write_pos;  // Someone else was faster. Retry.
+  }
+  gettimeofday(&slot->time, NULL);
+  slot->level = level;
+  const int len = vsnprintf(slot->text, LOG_MAX_TEXT, format, ap);
+  slot->len = (len < 0) ? 0 : (len >= LOG_MAX_TEXT ? LOG_MAX_TEXT - 1 : len);
+  __sync_synchronize();
+  slot->sequence = pos + 1;  // Ready for writer.
 }
 
 void Log_debug(const char *format, ...) {
   if (log_fd < 0) return;
   va_list ap;
   va_start(ap, format);
-  Log_internal(log_fd, debug_markup_start_, format, ap);
+  if (log_background) {
+    Log_enqueue(LEVEL_DEBUG, format, ap);
+  } else {
+    Log_internal(log_fd, debug_markup_start_, format, ap);
+  }
   va_end(ap);
 }
 
 void Log_info(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
-  if (log_fd < 0) {
+  if (log_background) {
+    Log_enqueue(LEVEL_INFO, format, ap);
+  } else if (log_fd < 0) {
     vsyslog(LOG_INFO, format, ap);
   } else {
     Log_internal(log_fd, info_markup_start_, format, ap);
@@ -113,7 +280,9 @@ void Log_info(const char *format, ...) {
 void Log_error(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
-  if (log_fd < 0) {
+  if (log_background) {
+    Log_enqueue(LEVEL_ERROR, format, ap);
+  } else if (log_fd < 0) {
     vsyslog(LOG_ERR, format, ap);
   } else {
     Log_internal(log_fd, error_markup_start_, format, ap);
@@ -26,6 +26,16 @@
 // If filename is NULL, info and errors are logged to syslog.
 void Log_init(const char *filename);
 
+// From now on, log messages are only formatted into a preallocated ring
+// buffer by the calling thread; a background thread writes them out. So a
+// slow syslogd or disk does not stall the caller, in particular the motion
+// path. If the ring is full, messages are dropped (and counted), and
+// repeated identical messages are collapsed into one line with a count.
+// Pending messages are written at exit.
+//
+// Call after any fork()/daemon(), as threads do not survive these.
+void Log_start_background_writer();
+
 // Define this with empty, if you're not using gcc.
 #define PRINTF_FMT_CHECK(fmt_pos, args_pos)             \
   __attribute__ ((format (printf, fmt_pos, args_pos)))
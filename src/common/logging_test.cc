@@ -0,0 +1,120 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+static std::string TempFilename() {
+  char name[] = "/tmp/logging_test.XXXXXX";
+  close(mkstemp(name));
+  return name;
+}
+
+static std::string ReadFile(const std::string &filename) {
+  std::string result;
+  FILE *f = fopen(filename.c_str(), "r");
+  char buf[1024];
+  size_t r;
+  while ((r = fread(buf, 1, sizeof(buf), f)) > 0) result.append(buf, r);
+  fclose(f);
+  return result;
+}
+
+static int CountOccurrences(const std::string &haystack, const char *needle) {
+  int count = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos;
+       pos = haystack.find(needle, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+// The background writer is global state and only stops at exit, so run it
+// in a child process and look at what ended up in the file.
+TEST(LoggingTest, BackgroundWriterCollapsesRepeatsAndFlushesAtExit) {
+  const std::string filename = TempFilename();
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    Log_init(filename.c_str());
+    Log_start_background_writer();
+    Log_info("first %d", 1);
+    for (int i = 0; i < 5; ++i) Log_error("INSUFFICIENT LOOKAHEAD");
+    Log_debug("done");
+    exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  const std::string content = ReadFile(filename);
+  unlink(filename.c_str());
+  EXPECT_EQ(1, CountOccurrences(content, "first 1"));
+  EXPECT_EQ(1, CountOccurrences(content, "INSUFFICIENT LOOKAHEAD"));
+  EXPECT_EQ(1, CountOccurrences(content, "repeated 4 times"));
+  EXPECT_EQ(1, CountOccurrences(content, "done"));
+  EXPECT_LT(content.find("repeated"), content.find("done"));
+}
+
+// Many more messages than fit in the ring at once: none are lost
+// unnoticed, they are either written or reported as dropped.
+TEST(LoggingTest, FullRingDropsAndReports) {
+  const std::string filename = TempFilename();
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    Log_init(filename.c_str());
+    Log_start_background_writer();
+    for (int i = 0; i < 10000; ++i) Log_info("message %d", i);
+    exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  const std::string content = ReadFile(filename);
+  unlink(filename.c_str());
+  const int written = CountOccurrences(content, "message ");
+  int dropped = 0;
+  int reports = 0;
+  for (size_t pos = content.find("("); pos != std::string::npos;
+       pos = content.find("(", pos + 1)) {
+    unsigned int count;
+    int end = 0;
+    if (sscanf(content.c_str() + pos, "(%u log messages dropped)%n",
+               &count, &end) == 1 && end > 0) {
+      dropped += count;
+      ++reports;
+    }
+  }
+  if (written < 10000) {
+    EXPECT_GT(reports, 0);
+  }
+  EXPECT_EQ(10000, written + dropped);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
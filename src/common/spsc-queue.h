@@ -0,0 +1,86 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BEAGLEG_SPSC_QUEUE_H_
+#define _BEAGLEG_SPSC_QUEUE_H_
+
+#include <errno.h>
+#include <semaphore.h>
+
+// Fixed capacity queue between exactly one producer and one consumer thread.
+//
+// The producer only ever touches the write position, the consumer only the
+// read position, so there are no locks. Two counting semaphores keep track
+// of filled and free slots; they provide the memory barriers and let the
+// other side sleep if the queue is full or empty. As long as neither side
+// has to wait, these are just atomic operations without a system call.
+template <typename T, int N>
+class SpscQueue {
+public:
+  SpscQueue() : write_pos_(0), read_pos_(0) {
+    sem_init(&filled_, 0, 0);
+    sem_init(&free_, 0, N);
+  }
+  ~SpscQueue() {
+    sem_destroy(&filled_);
+    sem_destroy(&free_);
+  }
+
+  // Producer: add element. Blocks while the queue is full.
+  void Push(const T &value) {
+    Wait(&free_);
+    buffer_[write_pos_] = value;
+    write_pos_ = (write_pos_ + 1) % N;
+    sem_post(&filled_);
+  }
+
+  // Consumer: remove oldest element. Blocks while the queue is empty.
+  void Pop(T *value) {
+    Wait(&filled_);
+    *value = buffer_[read_pos_];
+    read_pos_ = (read_pos_ + 1) % N;
+    sem_post(&free_);
+  }
+
+  // Producer: number of Push() calls that won't block.
+  int free_slots() {
+    int free_slots = 0;
+    sem_getvalue(&free_, &free_slots);
+    return free_slots;
+  }
+
+  static int capacity() { return N; }
+
+private:
+  static void Wait(sem_t *sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR)
+      ;
+  }
+
+  T buffer_[N];
+  int write_pos_;   // Only accessed by producer.
+  int read_pos_;    // Only accessed by consumer.
+  sem_t filled_;
+  sem_t free_;
+
+  SpscQueue(const SpscQueue&);             // No copy.
+  SpscQueue &operator=(const SpscQueue&);
+};
+
+#endif  // _BEAGLEG_SPSC_QUEUE_H_
@@ -76,10 +76,21 @@ long ParseDecimal(const StringPiece &s, long fallback) {
 }
 
 static void vAppendf(std::string *str, const char *format, va_list ap) {
+  // Typically short: format on the stack, so that results that fit the
+  // string's small buffer don't touch the heap.
+  char buffer[256];
+  va_list ap_copy;
+  va_copy(ap_copy, ap);
+  const int written = vsnprintf(buffer, sizeof(buffer), format, ap_copy);
+  va_end(ap_copy);
+  if (written < 0) return;
+  if ((size_t) written < sizeof(buffer)) {
+    str->append(buffer, written);
+    return;
+  }
   const size_t orig_len = str->length();
-  const size_t space = 1024;   // there should be better ways to do this...
-  str->resize(orig_len + space);
-  int written = vsnprintf((char*)str->data() + orig_len, space, format, ap);
+  str->resize(orig_len + written + 1);
+  vsnprintf((char*)str->data() + orig_len, written + 1, format, ap);
   str->resize(orig_len + written);
 }
 
@@ -61,6 +61,13 @@ TEST(StringUtilTest, ParseDecimal) {
     EXPECT_EQ(42, ParseDecimal(longer_string.substr(0, 2), -1));
 }
 
+TEST(StringUtilTest, StringPrintf) {
+    EXPECT_EQ("42 foo", StringPrintf("%d %s", 42, "foo"));
+    // Longer than what is formatted on the stack.
+    const std::string long_string(2000, 'x');
+    EXPECT_EQ("<" + long_string + ">", StringPrintf("<%s>", long_string.c_str()));
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,152 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "logging.h"
+
+#define TRACE_DUMP_MAGIC "BGTRACE1"
+
+namespace {
+struct TraceDumpHeader {
+  char magic[8];
+  uint32_t event_size;
+  uint32_t buffer_size;
+  uint64_t next_seq;
+};
+
+// Slot i is written by the event with seq % TRACE_BUFFER_SIZE == i. The seq
+// is written last, so a reader can tell incomplete or overwritten slots.
+TraceEvent trace_buffer[TRACE_BUFFER_SIZE];
+uint64_t trace_next_seq = 1;
+
+__thread int32_t trace_thread_id = 0;
+}
+
+volatile bool trace_enabled_ = false;
+
+const char *Trace_stage_name(int stage) {
+  switch (stage) {
+  case TRACE_PARSE_LINE:           return "parse-line";
+  case TRACE_PLANNER_ENQUEUE:      return "planner-enqueue";
+  case TRACE_MOTOR_OPS_ENQUEUE:    return "motor-ops-enqueue";
+  case TRACE_MOTION_QUEUE_ENQUEUE: return "motion-queue-enqueue";
+  case TRACE_MOTION_QUEUE_WAIT:    return "motion-queue-wait";
+  }
+  return "unknown";
+}
+
+void Trace_enable(bool on) { trace_enabled_ = on; }
+
+uint64_t Trace_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Trace_record(TraceStage stage, uint64_t begin_ns, int32_t arg) {
+  const uint64_t end_ns = Trace_now_ns();
+  if (trace_thread_id == 0) trace_thread_id = syscall(SYS_gettid);
+  const uint64_t seq = __sync_fetch_and_add(&trace_next_seq, 1);
+  TraceEvent *event = &trace_buffer[seq % TRACE_BUFFER_SIZE];
+  event->seq = 0;  // Mark as in progress.
+  __sync_synchronize();
+  event->begin_ns = begin_ns;
+  const uint64_t duration = end_ns - begin_ns;
+  event->duration_ns = (duration > 0xffffffff ? 0xffffffff : duration);
+  event->stage = stage;
+  event->reserved = 0;
+  event->thread = trace_thread_id;
+  event->arg = arg;
+  __sync_synchronize();
+  event->seq = seq;
+}
+
+static bool WriteFully(int fd, const void *data, size_t len) {
+  const char *pos = (const char *) data;
+  while (len > 0) {
+    const ssize_t w = write(fd, pos, len);
+    if (w < 0) return false;
+    pos += w;
+    len -= w;
+  }
+  return true;
+}
+
+bool Trace_dump(const char *filename) {
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  TraceDumpHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_DUMP_MAGIC, sizeof(header.magic));
+  header.event_size = sizeof(TraceEvent);
+  header.buffer_size = TRACE_BUFFER_SIZE;
+  header.next_seq = trace_next_seq;
+  const bool success = (WriteFully(fd, &header, sizeof(header))
+                        && WriteFully(fd, trace_buffer, sizeof(trace_buffer)));
+  return close(fd) == 0 && success;
+}
+
+static bool CompareBegin(const TraceEvent &a, const TraceEvent &b) {
+  return a.begin_ns < b.begin_ns;
+}
+
+bool Trace_read_dump(const char *filename, std::vector<TraceEvent> *events) {
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) {
+    Log_error("Can't open trace %s", filename);
+    return false;
+  }
+  TraceDumpHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1
+      || memcmp(header.magic, TRACE_DUMP_MAGIC, sizeof(header.magic)) != 0
+      || header.event_size != sizeof(TraceEvent)) {
+    Log_error("%s: not a trace dump of this version.", filename);
+    fclose(in);
+    return false;
+  }
+  const size_t start = events->size();
+  TraceEvent event;
+  for (uint32_t slot = 0; slot < header.buffer_size; ++slot) {
+    if (fread(&event, sizeof(event), 1, in) != 1) {
+      Log_error("%s: truncated trace dump.", filename);
+      fclose(in);
+      return false;
+    }
+    // Empty, in progress, or written while we were dumping.
+    if (event.seq == 0 || event.seq % header.buffer_size != slot
+        || event.seq >= header.next_seq
+        || event.stage >= TRACE_STAGE_COUNT) {
+      continue;
+    }
+    events->push_back(event);
+  }
+  fclose(in);
+  std::sort(events->begin() + start, events->end(), CompareBegin);
+  return true;
+}
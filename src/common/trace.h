@@ -0,0 +1,101 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEAGLEG_TRACE_H
+#define BEAGLEG_TRACE_H
+
+#include <stdint.h>
+
+#include <vector>
+
+// Low overhead tracing of the stages a line of GCode goes through until it
+// ends up in the motion queue. Events go into a fixed size ring buffer in
+// memory, that can be dumped at any time (also from a signal handler) and
+// converted into a Chrome trace with trace2json.
+//
+// Writers only do an atomic increment to claim a slot, so this can be
+// used from multiple threads without locks. While disabled, a TraceScope
+// costs a single load of a global.
+
+enum TraceStage {
+  TRACE_PARSE_LINE,            // GCodeParser: one line.
+  TRACE_PLANNER_ENQUEUE,       // Planner::Enqueue()
+  TRACE_MOTOR_OPS_ENQUEUE,     // MotionQueueMotorOperations::Enqueue()
+  TRACE_MOTION_QUEUE_ENQUEUE,  // Hardware motion queue: one segment.
+  TRACE_MOTION_QUEUE_WAIT,     // Blocked waiting for a free queue slot.
+
+  TRACE_STAGE_COUNT
+};
+
+// Human readable name of stage.
+const char *Trace_stage_name(int stage);
+
+// Number of events kept in the ring buffer; older ones are overwritten.
+#define TRACE_BUFFER_SIZE 65536
+
+// An event as stored in the buffer and dump.
+struct TraceEvent {
+  uint64_t seq;            // 1 + index of the event since start.
+  uint64_t begin_ns;       // CLOCK_MONOTONIC
+  uint32_t duration_ns;
+  uint16_t stage;          // TraceStage
+  uint16_t reserved;
+  int32_t thread;          // Linux thread id.
+  int32_t arg;             // Stage specific, e.g. the line number.
+};
+
+extern volatile bool trace_enabled_;
+
+// Enable or disable recording of events.
+void Trace_enable(bool on);
+inline bool Trace_enabled() { return trace_enabled_; }
+
+// Current CLOCK_MONOTONIC time in nanoseconds.
+uint64_t Trace_now_ns();
+
+// Record an event that started at "begin_ns" and ends now.
+void Trace_record(TraceStage stage, uint64_t begin_ns, int32_t arg);
+
+// Write the current content of the ring buffer to "filename". Only uses
+// async-signal-safe functions, so can be called from a signal handler.
+// Returns true on success.
+bool Trace_dump(const char *filename);
+
+// Read the dump written by Trace_dump() and append the valid events,
+// ordered by time, to "events".
+bool Trace_read_dump(const char *filename, std::vector<TraceEvent> *events);
+
+// Records an event for the lifetime of this object.
+class TraceScope {
+public:
+  explicit TraceScope(TraceStage stage, int32_t arg = 0)
+    : stage_(stage), arg_(arg),
+      begin_ns_(trace_enabled_ ? Trace_now_ns() : 0) {
+  }
+  ~TraceScope() {
+    if (begin_ns_) Trace_record(stage_, begin_ns_, arg_);
+  }
+
+private:
+  const TraceStage stage_;
+  const int32_t arg_;
+  const uint64_t begin_ns_;
+};
+
+#endif  // BEAGLEG_TRACE_H
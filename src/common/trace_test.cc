@@ -0,0 +1,89 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+static std::string TempFilename() {
+  char name[] = "/tmp/trace_test.XXXXXX";
+  close(mkstemp(name));
+  return name;
+}
+
+// Tests run in order; the ring buffer is global.
+TEST(TraceTest, DisabledRecordsNothingEnabledRecordsScopes) {
+  const std::string filename = TempFilename();
+  { TraceScope scope(TRACE_PARSE_LINE, 1); }  // Not enabled yet.
+
+  Trace_enable(true);
+  {
+    TraceScope outer(TRACE_PARSE_LINE, 2);
+    TraceScope inner(TRACE_PLANNER_ENQUEUE, 3);
+    usleep(1000);
+  }
+  Trace_enable(false);
+  { TraceScope scope(TRACE_PARSE_LINE, 4); }
+
+  ASSERT_TRUE(Trace_dump(filename.c_str()));
+  std::vector<TraceEvent> events;
+  ASSERT_TRUE(Trace_read_dump(filename.c_str(), &events));
+  unlink(filename.c_str());
+
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ(TRACE_PARSE_LINE, events[0].stage);   // Ordered by begin.
+  EXPECT_EQ(2, events[0].arg);
+  EXPECT_EQ(TRACE_PLANNER_ENQUEUE, events[1].stage);
+  EXPECT_EQ(3, events[1].arg);
+  EXPECT_GE(events[1].duration_ns, 1000000u);
+  EXPECT_GE(events[0].duration_ns, events[1].duration_ns);
+  EXPECT_EQ(events[0].thread, events[1].thread);
+}
+
+TEST(TraceTest, RingBufferKeepsNewest) {
+  const std::string filename = TempFilename();
+  Trace_enable(true);
+  for (int i = 0; i < TRACE_BUFFER_SIZE + 10; ++i) {
+    TraceScope scope(TRACE_MOTION_QUEUE_ENQUEUE, i);
+  }
+  Trace_enable(false);
+
+  ASSERT_TRUE(Trace_dump(filename.c_str()));
+  std::vector<TraceEvent> events;
+  ASSERT_TRUE(Trace_read_dump(filename.c_str(), &events));
+  unlink(filename.c_str());
+
+  ASSERT_EQ((size_t)TRACE_BUFFER_SIZE, events.size());
+  EXPECT_EQ(10, events.front().arg);
+  EXPECT_EQ(TRACE_BUFFER_SIZE + 9, events.back().arg);
+}
+
+TEST(TraceTest, StageNames) {
+  EXPECT_STREQ("parse-line", Trace_stage_name(TRACE_PARSE_LINE));
+  EXPECT_STREQ("motion-queue-wait", Trace_stage_name(TRACE_MOTION_QUEUE_WAIT));
+  EXPECT_STREQ("unknown", Trace_stage_name(TRACE_STAGE_COUNT));
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -110,9 +110,10 @@ void ConfigParser::Reader::ReportError(int line_no, const std::string &msg) {
   std::cerr << line_no << ":" << msg << std::endl;
 }
 
-ConfigParser::ConfigParser() : parse_success_(true) {}
+ConfigParser::ConfigParser() : is_tokenized_(false), parse_success_(true) {}
 
 bool ConfigParser::SetContentFromFile(const char *filename) {
+  is_tokenized_ = false;
   parse_success_ = true;
   std::ifstream file_stream(filename, std::ios::binary);
   content_.assign(std::istreambuf_iterator<char>(file_stream),
@@ -121,6 +122,7 @@ bool ConfigParser::SetContentFromFile(const char *filename) {
 }
 
 void ConfigParser::SetContent(const std::string &content) {
+  is_tokenized_ = false;
   parse_success_ = true;
   content_ = content;
 }
@@ -154,14 +156,8 @@ static std::string CanonicalizeName(const StringPiece &s) {
   return ToLower(TrimWhitespace(s));
 }
 
-bool ConfigParser::EmitConfigValues(Reader *reader) {
-  // The first pass collects all the parse errors and emits them. Later on,
-  // we refuse to run another time.
-  if (!parse_success_)
-    return false;
-  bool success = true;
-  bool current_section_interested = false;
-  std::string current_section;
+void ConfigParser::Tokenize() {
+  entries_.clear();
   int line_no = 0;
   StringPiece content_data(content_.data(), content_.length());
   StringPiece line = NextLine(&content_data);
@@ -171,41 +167,79 @@ bool ConfigParser::EmitConfigValues(Reader *reader) {
     if (line.empty())
       continue;
 
+    Entry entry;
+    entry.line_no = line_no;
     // Sections start with '['
     if (line[0] == '[') {
       if (line[line.length() - 1] != ']') {
-        reader->ReportError(line_no, "Section line does not end in ']'");
-        parse_success_ = false;
-        current_section_interested = false;  // rest is probably bogus.
-        continue;
+        entry.type = Entry::BAD_SECTION;
+      } else {
+        entry.type = Entry::SECTION;
+        entry.name = CanonicalizeName(line.substr(1, line.length() - 2));
       }
-
-      StringPiece section = line.substr(1, line.length() - 2);
-      current_section = CanonicalizeName(section);
-      current_section_interested = reader->SeenSection(line_no, current_section);
     }
     else {
       StringPiece::iterator eq_pos = std::find(line.begin(), line.end(), '=');
       if (eq_pos == line.end()) {
-        reader->ReportError(line_no, "name=value pair expected.");
-        parse_success_ = false;
-        continue;
+        entry.type = Entry::BAD_NAME_VALUE;
+      } else {
+        entry.type = Entry::NAME_VALUE;
+        entry.name = CanonicalizeName(StringPiece(line.begin(),
+                                                  eq_pos - line.begin()));
+        entry.value = TrimWhitespace(StringPiece(eq_pos + 1,
+                                                 line.end() - eq_pos - 1))
+          .ToString();
       }
+    }
+    entries_.push_back(entry);
+  }
+  is_tokenized_ = true;
+}
+
+bool ConfigParser::EmitConfigValues(Reader *reader) {
+  // The first pass collects all the parse errors and emits them. Later on,
+  // we refuse to run another time.
+  if (!parse_success_)
+    return false;
+  if (!is_tokenized_)
+    Tokenize();
+  bool success = true;
+  bool current_section_interested = false;
+  const std::string *current_section = NULL;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    const Entry &entry = entries_[i];
+    switch (entry.type) {
+    case Entry::BAD_SECTION:
+      reader->ReportError(entry.line_no, "Section line does not end in ']'");
+      parse_success_ = false;
+      current_section_interested = false;  // rest is probably bogus.
+      break;
+
+    case Entry::BAD_NAME_VALUE:
+      reader->ReportError(entry.line_no, "name=value pair expected.");
+      parse_success_ = false;
+      break;
+
+    case Entry::SECTION:
+      current_section = &entry.name;
+      current_section_interested = reader->SeenSection(entry.line_no,
+                                                       entry.name);
+      break;
+
+    case Entry::NAME_VALUE:
       if (current_section_interested) {
-        std::string name = CanonicalizeName(StringPiece(line.begin(),
-                                                        eq_pos - line.begin()));
-        StringPiece value_piece
-          = TrimWhitespace(StringPiece(eq_pos + 1, line.end() - eq_pos - 1));
-        std::string value = value_piece.ToString();
-        bool could_parse = reader->SeenNameValue(line_no, name, value);
+        bool could_parse = reader->SeenNameValue(entry.line_no,
+                                                 entry.name, entry.value);
         if (!could_parse) {
-          reader->ReportError(line_no,
+          reader->ReportError(entry.line_no,
                               StringPrintf("In section [%s]: Couldn't handle '%s = %s'",
-                                           current_section.c_str(),
-                                           name.c_str(), value.c_str()));
+                                           current_section->c_str(),
+                                           entry.name.c_str(),
+                                           entry.value.c_str()));
         }
         success &= could_parse;
       }
+      break;
     }
   }
   return parse_success_ && success;
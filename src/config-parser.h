@@ -70,14 +70,32 @@ public:
   // Overwrites any previous content.
   void SetContent(const std::string &content);
 
+  // The current content of the configuration.
+  const std::string &content() const { return content_; }
+
   // Emit configuration values to the Reader. Returns 'true' if
   // configuration file could be parsed (no syntax errors, and all calls to
   // SeenNameValue() returned true).
+  // The content is only tokenized once, with the first call; subsequent
+  // Readers are served from that.
   // Reader is not taken over.
   bool EmitConfigValues(Reader *reader);
 
 private:
+  // One meaningful line of the configuration.
+  struct Entry {
+    enum Type { SECTION, NAME_VALUE, BAD_SECTION, BAD_NAME_VALUE };
+    Type type;
+    int line_no;
+    std::string name;   // Section name or name of name/value pair.
+    std::string value;
+  };
+
+  void Tokenize();
+
   std::string content_;
+  std::vector<Entry> entries_;
+  bool is_tokenized_;
   bool parse_success_;
   std::map<std::string, bool> claimed_sections_;
 };
@@ -69,6 +69,31 @@ TEST(ConfigParserTest, ErrorReporting) {
   EXPECT_FALSE(p.EmitConfigValues(&events));
 }
 
+TEST(ConfigParserTest, MultipleReadersSeeSameContent) {
+  ConfigParser p;
+  p.SetContent("[first]\n"
+               "a = 1\n"
+               "[second]\n"
+               "b = 2\n");
+  MockConfigReader first_reader;
+  EXPECT_CALL(first_reader, SeenSection(1, "first")).WillOnce(Return(true));
+  EXPECT_CALL(first_reader, SeenNameValue(2, "a", "1")).WillOnce(Return(true));
+  EXPECT_CALL(first_reader, SeenSection(3, "second")).WillOnce(Return(false));
+  EXPECT_TRUE(p.EmitConfigValues(&first_reader));
+
+  MockConfigReader second_reader;
+  EXPECT_CALL(second_reader, SeenSection(1, "first")).WillOnce(Return(false));
+  EXPECT_CALL(second_reader, SeenSection(3, "second")).WillOnce(Return(true));
+  EXPECT_CALL(second_reader, SeenNameValue(4, "b", "2")).WillOnce(Return(true));
+  EXPECT_TRUE(p.EmitConfigValues(&second_reader));
+
+  // New content replaces what we have seen before.
+  p.SetContent("[third]\n");
+  MockConfigReader third_reader;
+  EXPECT_CALL(third_reader, SeenSection(1, "third")).WillOnce(Return(true));
+  EXPECT_TRUE(p.EmitConfigValues(&third_reader));
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -24,11 +24,15 @@
 #include <stdlib.h>
 #include <strings.h>
 
+#include <algorithm>
+
 #include "gcode-parser/gcode-parser.h"
 
 #include "gcode-machine-control.h"
 #include "motor-operations.h"
 #include "hardware-mapping.h"
+#include "input-shaping.h"
+#include "sim-firmware.h"
 #include "spindle-control.h"
 
 namespace {
@@ -78,6 +82,12 @@ public:
 
 private:
   void update_coordinate_stats(const AxesRegister &axis) {
+    stats_->min_x = std::min(stats_->min_x, axis[AXIS_X]);
+    stats_->min_y = std::min(stats_->min_y, axis[AXIS_Y]);
+    stats_->min_z = std::min(stats_->min_z, axis[AXIS_Z]);
+    stats_->max_x = std::max(stats_->max_x, axis[AXIS_X]);
+    stats_->max_y = std::max(stats_->max_y, axis[AXIS_Y]);
+    stats_->max_z = std::max(stats_->max_z, axis[AXIS_Z]);
     stats_->last_x = axis[AXIS_X];
     stats_->last_y = axis[AXIS_Y];
     stats_->last_z = axis[AXIS_Z];
@@ -90,49 +100,33 @@ private:
   struct BeagleGPrintStats *const stats_;
   GCodeParser::EventReceiver *const delegatee_;
 };
-
-class StatsMotorOperations : public MotorOperations {
-public:
-  StatsMotorOperations(BeagleGPrintStats *stats) : print_stats_(stats) {}
-
-  virtual void Enqueue(const LinearSegmentSteps &param) {
-    int max_steps = 0;
-    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
-      int steps = abs(param.steps[i]);
-      if (steps > max_steps)
-        max_steps = steps;
-    }
-
-    // max_steps = a/2*t^2 + v0*t; a = (v1-v0)/t
-    print_stats_->total_time_seconds += 2 * max_steps / (param.v0 + param.v1);
-    //printf("HZ:v0=%7.1f v1=%7.1f steps=%d\n", param.v0, param.v1, max_steps);
-  }
-
-  virtual void MotorEnable(bool on) {}
-  virtual void WaitQueueEmpty() {}
-
-private:
-  BeagleGPrintStats *const print_stats_;
-};
 }
 
 bool determine_print_stats(int input_fd, const MachineControlConfig &config,
                            FILE *msg_out,
                            struct BeagleGPrintStats *result) {
   bzero(result, sizeof(*result));
+  result->min_x = result->min_y = result->min_z = HUGE_VALF;
+  result->max_x = result->max_y = result->max_z = -HUGE_VALF;
 
   HardwareMapping hardware;  // We never initialize, just sim mode.
   Spindle spindle;
 
-  // Motor control that just determines the time spent turning the motor.
-  // We do that by intercepting the motor operations by replacing the
-  // implementation with our own.
-  StatsMotorOperations stats_motor_ops(result);
+  // The regular motor operations create the same segments the hardware
+  // would get; the timing queue adds up how long executing them takes.
+  TimingMotionQueue timing_queue;
+  MotionQueueMotorOperations motor_ops(&timing_queue,
+                                       config.max_step_frequency);
+  InputShapingMotorOperations shaping_ops(&motor_ops);
   GCodeMachineControl *machine_control
-    = GCodeMachineControl::Create(config, &stats_motor_ops,
+    = GCodeMachineControl::Create(config, &shaping_ops,
                                   &hardware, &spindle, NULL);
   if (!machine_control)
     return false;
+  if (!shaping_ops.Configure(config, &hardware)) {
+    delete machine_control;
+    return false;
+  }
 
   // We intercept gcode events to update some stats, then pass on to
   // machine event receiver.
@@ -145,5 +139,11 @@ bool determine_print_stats(int input_fd, const MachineControlConfig &config,
   const bool success = parser.ParseStream(input_fd, msg_out) == 0
     && parser.error_count() == 0;
   delete machine_control;
+  result->total_time_seconds += timing_queue.total_time();
+  result->segment_count = timing_queue.segment_count();
+  if (result->min_x > result->max_x) {  // Never moved.
+    result->min_x = result->min_y = result->min_z = 0;
+    result->max_x = result->max_y = result->max_z = 0;
+  }
   return success;
 }
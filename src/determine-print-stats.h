@@ -29,6 +29,11 @@ struct BeagleGPrintStats {
   float last_z_extruding;        // Last z with extrusion = printed height.
   float filament_len;            // total filament length
 
+  // Bounding box of all positions the machine moves to.
+  float min_x, min_y, min_z;
+  float max_x, max_y, max_z;
+
+  int segment_count;             // Number of motion segments for hardware.
 };
 
 // Given the input file-descriptor (which is read to EOF and then closed)
@@ -0,0 +1,247 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Throughput of the whole path from G-code to motion segments: parser,
+// machine control, planner and MotionQueueMotorOperations, with a motion
+// queue at the end that only counts. Runs the given G-code files and a few
+// synthetic stress programs and reports lines/s, segments/s, allocations
+// and peak RSS, so that regressions in the hot path show up before they
+// reach a machine.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <new>
+#include <string>
+
+#include "common/logging.h"
+#include "common/trace.h"
+#include "gcode-parser/gcode-parser.h"
+
+#include "config-parser.h"
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motion-queue.h"
+#include "motor-operations.h"
+#include "spindle-control.h"
+
+// Count all allocations going through operator new in this binary.
+static long allocation_count = 0;
+
+void *operator new(size_t size) {
+  ++allocation_count;
+  void *result = malloc(size ? size : 1);
+  if (!result) throw std::bad_alloc();
+  return result;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+namespace {
+// Like DummyMotionQueue, but keeps track of what arrives.
+class CountingMotionQueue : public MotionQueue {
+public:
+  CountingMotionQueue() : segments(0) {}
+  void Enqueue(MotionSegment *segment) { ++segments; }
+  void WaitQueueEmpty() {}
+  void MotorEnable(bool on) {}
+  void Shutdown(bool flush_queue) {}
+  void GetMotorsLoops(MotorsRegister *absolute_pos_loops) {}
+
+  long segments;
+};
+}  // namespace
+
+static long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Run one G-code program through a fresh machine; returns success.
+static bool bench(const char *name, const char *data, size_t len,
+                  const MachineControlConfig &config,
+                  HardwareMapping *hardware, Spindle *spindle) {
+  CountingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue, config.max_step_frequency);
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &motor_ops, hardware, spindle,
+                                  NULL);
+  if (!machine_control)
+    return false;
+
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  machine_control->GetHomePos(&parser_cfg.machine_origin);
+  GCodeParser *parser
+    = new GCodeParser(parser_cfg, machine_control->ParseEventReceiver(),
+                      false);
+
+  // Only count what happens while parsing, not the setup.
+  const long allocations_before = allocation_count;
+  const uint64_t start = Trace_now_ns();
+  const bool success = (parser->ParseBuffer(data, len, stderr) == 0
+                        && parser->error_count() == 0);
+  const long lines = parser->line_count();
+  delete parser;
+  delete machine_control;   // Flushes the planner.
+  const double duration = (Trace_now_ns() - start) / 1e9;
+  const long allocations = allocation_count - allocations_before;
+
+  printf("%-36s %8ld lines %10.0f lines/s %9ld segs %10.0f segs/s "
+         "%9ld allocs %7ld kB RSS%s\n",
+         name, lines, lines / duration, queue.segments,
+         queue.segments / duration, allocations, peak_rss_kb(),
+         success ? "" : " (errors)");
+  return success;
+}
+
+// Lots of tiny moves, as from CAM output or a finely sampled curve.
+static std::string tiny_segments(int count) {
+  std::string result = "G1 F6000\n";
+  char buffer[64];
+  for (int i = 0; i < count; ++i) {
+    snprintf(buffer, sizeof(buffer), "X%.3f Y%.3f\n",
+             10 + 0.01 * (i % 1000), 10 + 0.02 * ((i / 1000) % 100));
+    result.append(buffer);
+  }
+  return result;
+}
+
+// A long while loop; all moves and their coordinates are computed by the
+// parser. (Loops don't nest, so "deep" means many iterations.)
+static std::string while_loop(int iterations) {
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer),
+           "G1 F6000\n"
+           "#i=0\n"
+           "while [ #i < %d ] DO\n"
+           "  #row=[FIX[#i / 300]]\n"
+           "  #col=[#i - #row * 300]\n"
+           "  X[10 + #col * 0.1] Y[10 + #row * 0.1 + #col * 0.01]\n"
+           "  #i+=1\n"
+           "END\n", iterations);
+  return buffer;
+}
+
+// Full circles of large radius, linearized by the parser.
+static std::string huge_arcs(int count) {
+  std::string result = "G1 F6000 X10 Y200\n";
+  for (int i = 0; i < count; ++i) {
+    result.append(i % 2 ? "G3 X10 Y200 I190 J0\n" : "G2 X10 Y200 I190 J0\n");
+  }
+  return result;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] [<gcode-file>...]\n"
+          "Options:\n"
+          "\t-c <config>       : Machine config (Required).\n"
+          "\t-s                : Also run synthetic stress programs.\n"
+          "\t-t <angle>        : Threshold angle (Default: 10).\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  MachineControlConfig config;
+  config.threshold_angle = 10;  // Same default as machine-control.
+  const char *config_file = NULL;
+  bool synthetic = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:st:")) != -1) {
+    switch (opt) {
+    case 'c':
+      config_file = optarg;
+      break;
+    case 's':
+      synthetic = true;
+      break;
+    case 't':
+      config.threshold_angle = (float)atof(optarg);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (!config_file || (optind == argc && !synthetic))
+    return usage(argv[0]);
+
+  Log_init("/dev/null");
+
+  ConfigParser config_parser;
+  if (!config_parser.SetContentFromFile(config_file)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+    return 1;
+  }
+  HardwareMapping hardware;  // Configured, but never initialized: sim mode.
+  if (!config.ConfigureFromFile(&config_parser)
+      || !hardware.ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
+            config_file);
+    return 1;
+  }
+  config.require_homing = false;
+  config.range_check = false;   // Stress programs don't care about the bed.
+  Spindle spindle;
+
+  bool success = true;
+  for (int i = optind; i < argc; ++i) {
+    const int fd = open(argv[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      fprintf(stderr, "Can't read %s\n", argv[i]);
+      return 1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      perror("mmap()");
+      return 1;
+    }
+    const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1
+      : argv[i];
+    success &= bench(name, (const char*) data, st.st_size,
+                     config, &hardware, &spindle);
+    munmap(data, st.st_size);
+  }
+
+  if (synthetic) {
+    std::string program = tiny_segments(100000);
+    success &= bench("(100k tiny segments)", program.data(), program.size(),
+                     config, &hardware, &spindle);
+    program = while_loop(100000);
+    success &= bench("(while loop, 100k moves)", program.data(),
+                     program.size(), config, &hardware, &spindle);
+    program = huge_arcs(20);
+    success &= bench("(20 huge arcs)", program.data(), program.size(),
+                     config, &hardware, &spindle);
+  }
+  return success ? 0 : 1;
+}
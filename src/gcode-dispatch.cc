@@ -0,0 +1,165 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Send a batch of G-code files to a fleet of machine-control instances,
+// each job to the machine predicted to finish it first.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+
+#include "common/logging.h"
+
+#include "config-parser.h"
+#include "gcode-machine-control.h"
+#include "job-dispatcher.h"
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <gcode-file> [<gcode-file> ..]\n"
+          "Options:\n"
+          "\t-c <config>              : Default machine config.\n"
+          "\t-m <host:port[,config]>  : Machine to send jobs to; with its own "
+          "config if it differs\n"
+          "\t                           from the default. Repeat for each "
+          "machine.\n"
+          "\t-p <port>                : Serve binary fleet status on this "
+          "port.\n", prog);
+  return 1;
+}
+
+// Read and prepare config for estimation. Returns false on failure.
+static bool read_config(const char *filename, MachineControlConfig *config) {
+  ConfigParser config_parser;
+  if (!config_parser.SetContentFromFile(filename)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", filename);
+    return false;
+  }
+  if (!config->ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Parse error in configuration file '%s'\n", filename);
+    return false;
+  }
+  config->range_check = false;  // The machine itself will complain.
+
+  // Estimating only. Whatever the machine does for homing is not part of it.
+  config->require_homing = false;
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    config->homing_trigger[i] = HardwareMapping::TRIGGER_NONE;
+  }
+  return true;
+}
+
+static int open_status_socket(int port) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) {
+    Log_error("creating socket: %s", strerror(errno));
+    return -1;
+  }
+  struct sockaddr_in serv_addr = {};
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = INADDR_ANY;
+  serv_addr.sin_port = htons(port);
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(s, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+    Log_error("Trouble binding to port %d: %s", port, strerror(errno));
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  const char *default_config = NULL;
+  std::vector<std::string> machine_specs;
+  int status_port = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:m:p:")) != -1) {
+    switch (opt) {
+    case 'c':
+      default_config = optarg;
+      break;
+    case 'm':
+      machine_specs.push_back(optarg);
+      break;
+    case 'p':
+      status_port = atoi(optarg);
+      if (status_port <= 0 || status_port > 65535) return usage(argv[0]);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc || machine_specs.empty())
+    return usage(argv[0]);
+
+  Log_init("/dev/stderr");
+
+  JobDispatcher dispatcher;
+  std::map<std::string, int> config_index;  // Each file estimated once.
+  for (const std::string &spec : machine_specs) {
+    const size_t colon = spec.find(':');
+    const size_t comma = spec.find(',', colon);
+    if (colon == std::string::npos) {
+      fprintf(stderr, "Expected host:port in '%s'\n", spec.c_str());
+      return usage(argv[0]);
+    }
+    const std::string host = spec.substr(0, colon);
+    const int port = atoi(spec.c_str() + colon + 1);
+    std::string config_file;
+    if (comma != std::string::npos) {
+      config_file = spec.substr(comma + 1);
+    } else if (default_config) {
+      config_file = default_config;
+    } else {
+      fprintf(stderr, "No config for '%s'; need -c <config>\n", spec.c_str());
+      return 1;
+    }
+    if (config_index.find(config_file) == config_index.end()) {
+      MachineControlConfig config;
+      if (!read_config(config_file.c_str(), &config))
+        return 1;
+      config_index[config_file] = dispatcher.AddConfig(config);
+    }
+    if (!dispatcher.AddMachine(host, port, config_index[config_file]))
+      return 1;
+  }
+
+  for (int i = optind; i < argc; ++i) {
+    if (!dispatcher.AddJob(argv[i]))
+      return 1;
+  }
+
+  int status_socket = -1;
+  if (status_port > 0) {
+    status_socket = open_status_socket(status_port);
+    if (status_socket < 0)
+      return 1;
+  }
+  return dispatcher.Run(status_socket);
+}
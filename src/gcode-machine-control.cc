@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <math.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,12 +41,16 @@
 #include "gcode-parser/gcode-parser.h"
 
 #include "adc.h"
+#include "bed-mesh.h"
+#include "config-parser.h"
 #include "generic-gpio.h"
 #include "hardware-mapping.h"
+#include "machine-metrics.h"
 #include "motor-operations.h"
 #include "planner.h"
 #include "pwm-timer.h"
 #include "spindle-control.h"
+#include "temperature-control.h"
 
 // In case we get a zero feedrate, send this frequency to motors instead.
 #define ZERO_FEEDRATE_OVERRIDE_HZ 5
@@ -79,10 +84,33 @@ public:
 
   ~Impl() {
     delete planner_;
+    delete bed_mesh_;
   }
 
   const MachineControlConfig &config() const { return cfg_; }
   void set_msg_stream(FILE *msg) { msg_stream_ = msg; }
+  bool report_status(int m_code, FILE *out);
+  bool set_realtime_speed_factor(float factor);
+  bool set_feed_hold(bool hold);
+  void update_speed_override_ramp();
+  void update_line_queue_operations();
+  bool motion_queue_full() {
+    return motor_ops_->QueueFull(line_queue_operations_);
+  }
+  bool update_config(const MachineControlConfig &config);
+  void set_config_file(const std::string &file) { config_file_ = file; }
+  void request_config_reload() { config_reload_requested_ = 1; }
+  int config_reload_count(std::string *content) const {
+    if (content) *content = reloaded_config_content_;
+    return config_reload_count_;
+  }
+  void set_temperature_control(TemperatureControl *t) {
+    temperature_control_ = t;
+  }
+  bool needs_homing() const {
+    return cfg_.require_homing && homing_state_ == HOMING_STATE_NEVER_HOMED;
+  }
+  void get_motor_steps_from_home(int steps[BEAGLEG_NUM_MOTORS]);
 
   // -- GCodeParser::Events interface implementation --
   virtual void gcode_start(GCodeParser *parser);
@@ -103,13 +131,26 @@ public:
   virtual void dwell(float time_ms);              // G4: dwell for milliseconds.
   virtual void motors_enable(bool enable);        // M17,M84,M18: Switch on/off motors
   virtual bool coordinated_move(float feed_mm_p_sec, const AxesRegister &target);
+  virtual void arc_move(float feed_mm_p_sec,
+                        GCodeParserAxis normal_axis, bool clockwise,
+                        const AxesRegister &start,
+                        const AxesRegister &center,
+                        const AxesRegister &end);
+  virtual void spline_move(float feed_mm_p_sec,
+                           const AxesRegister &start,
+                           const AxesRegister &cp1, const AxesRegister &cp2,
+                           const AxesRegister &end);
   virtual bool rapid_move(float feed_mm_p_sec, const AxesRegister &target);
+  virtual bool raster_move(float feed_mm_p_sec,
+                           const AxesRegister &start, const AxesRegister &end,
+                           const uint8_t *pixels, int count);
   virtual const char *unprocessed(char letter, float value, const char *);
 
 private:
   bool check_for_pause();
   void issue_motor_move_if_possible();
   bool test_homing_status_ok();
+  void wait_spindle_ready();
   bool test_within_machine_limits(const AxesRegister &axes);
   void get_endstop_status();
   void get_current_position();
@@ -117,22 +158,33 @@ private:
   const char *special_commands(char letter, float value, const char *);
   float acceleration_for_move(const int *axis_steps,
                               enum GCodeParserAxis defining_axis);
-  int move_to_endstop(enum GCodeParserAxis axis,
-                      float feedrate, bool backoff,
-                      HardwareMapping::AxisTrigger trigger, int max_steps=0);
-  void home_axis(enum GCodeParserAxis axis);
+  int move_to_endstop(enum GCodeParserAxis axis, float feedrate, bool backoff,
+                      HardwareMapping::AxisTrigger trigger,
+                      float max_distance, bool *triggered);
+  bool home_axis(enum GCodeParserAxis axis);
+  bool probe_to_switch(float feedrate, enum GCodeParserAxis axis,
+                       float *probed_position, bool *triggered);
+  bool probe_bed_mesh();
+  const char *bed_mesh_command(const char *);
   void set_output_flags(HardwareMapping::LogicOutput out, bool is_on);
+  void laser_on(bool by_speed, int s_value);
+  void laser_off();
+  void laser_for_move(bool is_cutting);
   void handle_M105();
+  bool reload_config();
+  void reload_config_if_requested();
 
   // Print to msg_stream.
   void mprintf(const char *format, ...);
 
 private:
-  const struct MachineControlConfig cfg_;
+  struct MachineControlConfig cfg_;     // Limits change with update_config()
   MotorOperations *const motor_ops_;
   Planner *planner_;
+  BedMesh *bed_mesh_;                    // Last probed with G29, or NULL.
   HardwareMapping *const hardware_mapping_;
   Spindle *const spindle_;
+  TemperatureControl *temperature_control_;  // NULL if not available.
   FILE *msg_stream_;
   GCodeParser *parser_;
 
@@ -143,9 +195,22 @@ private:
   AxesRegister coordinate_display_origin_; // parser tells us
   float current_feedrate_mm_per_sec_;    // Set via Fxxx and remembered
   float prog_speed_factor_;              // Speed factor set by program (M220)
+  float realtime_speed_factor_;          // Applied by hardware to the queue.
+  bool feed_hold_;                       // Hardware holds the queue.
   time_t next_auto_disable_motor_;
   time_t next_auto_disable_fan_;
   bool pause_enabled_;                  // Enabled via M120, disabled via M121
+  int curve_segments_;                  // >= 0 while linearizing G2/G3/G5.
+  bool spindle_changing_;               // Until first move after M3/M4/M5.
+  bool laser_on_;                       // Laser mode: between M3/M4 and M5.
+  bool laser_by_speed_;                 // Laser mode: M4 power follows speed.
+  float laser_power_;                   // Laser mode: last S as duty cycle.
+  bool laser_motion_pwm_;               // Hardware syncs power with moves.
+  std::string config_file_;             // Re-read on M501 or request.
+  volatile sig_atomic_t config_reload_requested_;
+  int config_reload_count_;             // Successful reloads so far.
+  int line_queue_operations_;           // Most one line can enqueue at once.
+  std::string reloaded_config_content_; // Of the last successful reload.
 
   enum HomingState homing_state_;
 };
@@ -159,17 +224,31 @@ GCodeMachineControl::Impl::Impl(const MachineControlConfig &config,
                                 FILE *msg_stream)
   : cfg_(config),
     motor_ops_(motor_ops),
+    planner_(NULL),
+    bed_mesh_(NULL),
     hardware_mapping_(hardware_mapping),
     spindle_(spindle),
+    temperature_control_(NULL),
     msg_stream_(msg_stream),
     parser_(NULL),
     g0_feedrate_mm_per_sec_(-1),
     current_feedrate_mm_per_sec_(-1),
     prog_speed_factor_(1),
+    realtime_speed_factor_(1),
+    feed_hold_(false),
+    curve_segments_(-1),
+    spindle_changing_(false),
+    laser_on_(false), laser_by_speed_(false), laser_power_(0),
+    laser_motion_pwm_(false),
+    config_reload_requested_(0), config_reload_count_(0),
+    line_queue_operations_(1),
     homing_state_(HOMING_STATE_NEVER_HOMED) {
     pause_enabled_ = cfg_.enable_pause;
     next_auto_disable_motor_ = -1;
     next_auto_disable_fan_ = -1;
+    set_arc_tolerance(
+      cfg_.arc_tolerance > 0 ? cfg_.arc_tolerance : arc_tolerance(),
+      cfg_.arc_min_segment > 0 ? cfg_.arc_min_segment : arc_min_segment());
 }
 
 // The actual initialization. Can fail, hence we make it a separate method.
@@ -182,10 +261,7 @@ bool GCodeMachineControl::Impl::Init() {
                 gcodep_axis2letter(axis));
       return false;
     }
-    // Permissible hard override. We want to keep cfg_ const for most of the
-    // places, so writing here in Init() is permissible.
-    const_cast<MachineControlConfig&>(cfg_).steps_per_mm[axis]
-                                           = fabsf(cfg_.steps_per_mm[axis]);
+    cfg_.steps_per_mm[axis] = fabsf(cfg_.steps_per_mm[axis]);
     if (cfg_.max_feedrate[axis] < 0) {
       Log_error("Invalid negative feedrate %.1f for axis %c\n",
                 cfg_.max_feedrate[axis], gcodep_axis2letter(axis));
@@ -283,6 +359,24 @@ bool GCodeMachineControl::Impl::Init() {
     return false;
 
   planner_ = new Planner(&cfg_, hardware_mapping_, motor_ops_);
+  update_speed_override_ramp();
+  update_line_queue_operations();
+
+  if (cfg_.laser_mode) {
+    if (cfg_.laser_max_s <= 0) {
+      Log_error("laser-max-s needs to be positive.");
+      return false;
+    }
+    uint32_t gpio_def;
+    laser_motion_pwm_ =
+      (hardware_mapping_->GetPWMOutputGPIO(HardwareMapping::OUT_SPINDLE_SPEED,
+                                           &gpio_def)
+       && motor_ops_->SetMotionPWMOutput(gpio_def));
+    if (!laser_motion_pwm_) {
+      Log_info("Laser mode: power not synchronized with motion; "
+               "only set on M3/M4.");
+    }
+  }
   return true;
 }
 
@@ -294,12 +388,38 @@ void GCodeMachineControl::Impl::mprintf(const char *format, ...) {
   va_end(ap);
 }
 
-// Dummy implementations of callbacks not yet handled.
 void GCodeMachineControl::Impl::set_temperature(float f) {
-  mprintf("// BeagleG: set_temperature(%.1f) not implemented.\n", f);
+  if (!temperature_control_) {
+    mprintf("// BeagleG: set_temperature(%.1f) not implemented.\n", f);
+    return;
+  }
+  if (!temperature_control_->SetTarget(f))
+    mprintf("// ERROR: temperature %.1f above configured maximum.\n", f);
 }
+
+// Only the gcode stream waits; moves that are already queued keep running.
 void GCodeMachineControl::Impl::wait_temperature() {
-  mprintf("// BeagleG: wait_temperature() not implemented.\n");
+  if (!temperature_control_) {
+    mprintf("// BeagleG: wait_temperature() not implemented.\n");
+    return;
+  }
+  const int kPollMs = 100;
+  for (int i = 0; !temperature_control_->IsAtTarget(); ++i) {
+    if (isnan(temperature_control_->current())) {
+      mprintf("// ERROR: can't read hotend temperature.\n");
+      return;
+    }
+    if (temperature_control_->runaway()) {
+      mprintf("// ERROR: thermal runaway; hotend heater switched off.\n");
+      return;
+    }
+    if (i % (1000 / kPollMs) == 0) {
+      mprintf("T:%.1f /%.1f\n", temperature_control_->current(),
+              temperature_control_->target());
+      if (msg_stream_) fflush(msg_stream_);
+    }
+    usleep(kPollMs * 1000);
+  }
 }
 void GCodeMachineControl::Impl::motors_enable(bool b) {
   planner_->BringPathToHalt();
@@ -341,16 +461,25 @@ bool GCodeMachineControl::Impl::check_for_pause() {
 
 void GCodeMachineControl::Impl::handle_M105() {
   mprintf("// ");
-  for (int chan = 0; chan < 8; chan++) {
-    int raw = arc_read_raw(chan);
+  for (int chan = 0; chan < ADC_NUM_CHANNELS; chan++) {
+    int raw = adc_read_cached(chan);
     mprintf("RAW%d:%d ", chan, raw);
   }
   mprintf("\n");
-  mprintf("T-300\n");
+  if (temperature_control_) {
+    mprintf("T:%.1f /%.1f\n", temperature_control_->current(),
+            temperature_control_->target());
+  } else {
+    mprintf("T-300\n");
+  }
 }
 
 const char *GCodeMachineControl::Impl::unprocessed(char letter, float value,
                                                    const char *remaining) {
+  if (letter == 'G' && (int)value == 29) {
+    probe_bed_mesh();
+    return remaining;
+  }
   return special_commands(letter, value, remaining);
 }
 
@@ -391,7 +520,17 @@ const char *GCodeMachineControl::Impl::special_commands(char letter, float value
     break;
   case 119: get_endstop_status(); break;
   case 120: pause_enabled_ = true; break;
+  case 122:
+    if (msg_stream_) Metrics_print_summary(msg_stream_);
+    break;
   case 121: pause_enabled_ = false; break;
+  case 420: remaining = bed_mesh_command(remaining); break;
+  case 501:
+    if (reload_config())
+      mprintf("// Configuration limits reloaded.\n");
+    else
+      mprintf("// ERROR: configuration not reloaded; see log.\n");
+    break;
   default:
     mprintf("// BeagleG: didn't understand ('%c', %d, '%s')\n",
             letter, code, remaining);
@@ -416,10 +555,20 @@ const char *GCodeMachineControl::Impl::aux_bit_commands(char letter, float value
       else break;
       remaining = after_pair;
     }
-    if (spindle_rpm >= 0) spindle_->On(m_code == 4, spindle_rpm);
+    if (cfg_.laser_mode) {
+      laser_on(m_code == 4, spindle_rpm);
+    } else if (spindle_rpm >= 0) {
+      spindle_->On(m_code == 4, spindle_rpm);
+      spindle_changing_ = true;
+    }
     break;
   case 5:
-    spindle_->Off();
+    if (cfg_.laser_mode) {
+      laser_off();
+    } else {
+      spindle_->Off();
+      spindle_changing_ = true;
+    }
     break;
   case 7: set_output_flags(HardwareMapping::OUT_MIST, true); break;
   case 8: set_output_flags(HardwareMapping::OUT_FLOOD, true); break;
@@ -484,6 +633,40 @@ void GCodeMachineControl::Impl::set_output_flags(HardwareMapping::LogicOutput ou
   hardware_mapping_->UpdateAuxBitmap(out, is_on);
 }
 
+// In laser mode, M3/M4 don't start a spindle, but set the laser power for
+// the following G1/G2/G3 moves; the spindle output switches the laser on
+// during these moves only. With M4, the power is scaled down with the speed
+// while accelerating and decelerating. A missing S keeps the previous power.
+void GCodeMachineControl::Impl::laser_on(bool by_speed, int s_value) {
+  if (s_value >= 0) {
+    laser_power_ = fminf(1.0f, s_value / cfg_.laser_max_s);
+  }
+  laser_on_ = true;
+  laser_by_speed_ = by_speed;
+  if (!laser_motion_pwm_) {
+    hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_SPINDLE_SPEED,
+                                    laser_power_);
+  }
+}
+
+void GCodeMachineControl::Impl::laser_off() {
+  laser_on_ = false;
+  planner_->SetMotionPWM(0, false);
+  set_output_flags(HardwareMapping::OUT_SPINDLE, false);
+  if (!laser_motion_pwm_) {
+    planner_->BringPathToHalt();
+    motor_ops_->WaitQueueEmpty();
+    hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_SPINDLE_SPEED, 0);
+  }
+}
+
+// Laser mode: the laser is only on in cutting moves.
+void GCodeMachineControl::Impl::laser_for_move(bool is_cutting) {
+  const bool on = is_cutting && laser_on_;
+  planner_->SetMotionPWM(on ? laser_power_ : 0, laser_by_speed_);
+  set_output_flags(HardwareMapping::OUT_SPINDLE, on);
+}
+
 void GCodeMachineControl::Impl::get_current_position() {
   AxesRegister current_pos;
   planner_->GetCurrentPosition(&current_pos);
@@ -508,6 +691,174 @@ void GCodeMachineControl::Impl::get_current_position() {
   }
 }
 
+bool GCodeMachineControl::Impl::report_status(int m_code, FILE *out) {
+  FILE *const program_stream = msg_stream_;
+  msg_stream_ = out;
+  bool known = true;
+  switch (m_code) {
+  case 105: handle_M105(); break;
+  case 114: get_current_position(); break;
+  case 115: mprintf("%s\n", VERSION_STRING); break;
+  case 119: get_endstop_status(); break;
+  case 122: Metrics_print_summary(out); break;
+  default: known = false;
+  }
+  msg_stream_ = program_stream;
+  return known;
+}
+
+bool GCodeMachineControl::Impl::set_realtime_speed_factor(float factor) {
+  if (factor <= 0 || factor > 1) return false;
+  // While on hold, the override is known to work; it applies on release.
+  if (!feed_hold_ && !motor_ops_->SetSpeedOverride(factor)) return false;
+  realtime_speed_factor_ = factor;
+  return true;
+}
+
+bool GCodeMachineControl::Impl::set_feed_hold(bool hold) {
+  if (!motor_ops_->SetSpeedOverride(hold ? 0 : realtime_speed_factor_))
+    return false;
+  feed_hold_ = hold;
+  return true;
+}
+
+// The override ramps the speed of everything in the queue at once, so it
+// must not change faster than the slowest axis can stop from its maximum
+// feedrate.
+void GCodeMachineControl::Impl::update_speed_override_ramp() {
+  float stop_seconds = 0;
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (!hardware_mapping_->HasMotorFor(axis) || cfg_.acceleration[axis] <= 0)
+      continue;  // Zero acceleration: no limit.
+    stop_seconds = fmaxf(stop_seconds,
+                         cfg_.max_feedrate[axis] / cfg_.acceleration[axis]);
+  }
+  motor_ops_->SetSpeedOverrideRamp(stop_seconds);
+}
+
+// A single line can bring the path to a halt, which sends all moves planned
+// ahead, and linearize a curve. The largest curve is a full circle as big as
+// the machine, in chords within the arc tolerance (at most 1/16 turn each).
+void GCodeMachineControl::Impl::update_line_queue_operations() {
+  const float size = fmaxf(cfg_.move_range_mm[AXIS_X],
+                           fmaxf(cfg_.move_range_mm[AXIS_Y],
+                                 cfg_.move_range_mm[AXIS_Z]));
+  float curve_moves = 1e6;  // No range: no limit; the queue caps it anyway.
+  if (size > 0) {
+    const float radius = size / 2;
+    float radians_per_move = M_PI / 8;
+    if (arc_tolerance() < radius) {
+      radians_per_move = fminf(radians_per_move,
+                               2 * acosf(1 - arc_tolerance() / radius));
+    }
+    curve_moves = ceilf(2 * M_PI / radians_per_move);
+    if (arc_min_segment() > 0) {
+      curve_moves = fminf(curve_moves,
+                          ceilf(2 * M_PI * radius / arc_min_segment()));
+    }
+  }
+  const float operations = (cfg_.lookahead_segments + 1 + curve_moves)
+    * planner_->MaxOperationsPerMove();
+  line_queue_operations_ = (operations < 1e6) ? (int) operations : 1000000;
+}
+
+bool GCodeMachineControl::Impl::update_config(const MachineControlConfig &c) {
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (c.max_feedrate[axis] < 0 || c.acceleration[axis] < 0
+        || (hardware_mapping_->HasMotorFor(axis) && c.max_feedrate[axis] <= 0)) {
+      Log_error("Config update: invalid feedrate or acceleration for axis %c",
+                gcodep_axis2letter(axis));
+      return false;
+    }
+    if (c.steps_per_mm[axis] != cfg_.steps_per_mm[axis]
+        || c.move_range_mm[axis] != cfg_.move_range_mm[axis]
+        || c.homing_trigger[axis] != cfg_.homing_trigger[axis]
+        || c.input_shaper[axis] != cfg_.input_shaper[axis]
+        || c.input_shaper_frequency[axis] != cfg_.input_shaper_frequency[axis]
+        || c.input_shaper_damping[axis] != cfg_.input_shaper_damping[axis]) {
+      Log_error("Config update: steps, range, homing or input shaper of "
+                "axis %c changed; this needs a restart.",
+                gcodep_axis2letter(axis));
+      return false;
+    }
+  }
+  if (c.home_order != cfg_.home_order
+      || c.lookahead_segments != cfg_.lookahead_segments
+      || c.max_step_frequency != cfg_.max_step_frequency
+      || c.laser_mode != cfg_.laser_mode) {
+    Log_error("Config update: home-order, lookahead-segments, "
+              "max-step-frequency or laser-mode changed; this needs a "
+              "restart.");
+    return false;
+  }
+  if (c.laser_mode && c.laser_max_s <= 0) {
+    Log_error("Config update: laser-max-s needs to be positive.");
+    return false;
+  }
+
+  planner_->BringPathToHalt();
+  cfg_.max_feedrate = c.max_feedrate;
+  cfg_.acceleration = c.acceleration;
+  cfg_.speed_factor = c.speed_factor;
+  cfg_.threshold_angle = c.threshold_angle;
+  cfg_.junction_deviation = c.junction_deviation;
+  cfg_.s_curve_acceleration = c.s_curve_acceleration;
+  cfg_.arc_tolerance = c.arc_tolerance;
+  cfg_.arc_min_segment = c.arc_min_segment;
+  cfg_.merge_deviation = c.merge_deviation;
+  cfg_.merge_feed_tolerance = c.merge_feed_tolerance;
+  cfg_.bed_mesh_points = c.bed_mesh_points;
+  cfg_.bed_mesh_margin = c.bed_mesh_margin;
+  cfg_.bed_mesh_tolerance = c.bed_mesh_tolerance;
+  cfg_.auto_motor_disable_seconds = c.auto_motor_disable_seconds;
+  cfg_.auto_fan_disable_seconds = c.auto_fan_disable_seconds;
+  cfg_.auto_fan_pwm = c.auto_fan_pwm;
+  cfg_.laser_max_s = c.laser_max_s;
+
+  g0_feedrate_mm_per_sec_ = -1;
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (cfg_.max_feedrate[axis] > g0_feedrate_mm_per_sec_) {
+      g0_feedrate_mm_per_sec_ = cfg_.max_feedrate[axis];
+    }
+  }
+  set_arc_tolerance(
+    cfg_.arc_tolerance > 0 ? cfg_.arc_tolerance : arc_tolerance(),
+    cfg_.arc_min_segment > 0 ? cfg_.arc_min_segment : arc_min_segment());
+  planner_->UpdateLimits();
+  update_speed_override_ramp();
+  update_line_queue_operations();
+  return true;
+}
+
+bool GCodeMachineControl::Impl::reload_config() {
+  if (config_file_.empty()) {
+    Log_error("Config reload: no configuration file known.");
+    return false;
+  }
+  ConfigParser parser;
+  if (!parser.SetContentFromFile(config_file_.c_str())) {
+    Log_error("Config reload: cannot read '%s'", config_file_.c_str());
+    return false;
+  }
+  MachineControlConfig config;
+  if (!config.ConfigureFromFile(&parser)) {
+    Log_error("Config reload: parse error in '%s'", config_file_.c_str());
+    return false;
+  }
+  if (!update_config(config))
+    return false;
+  reloaded_config_content_ = parser.content();
+  ++config_reload_count_;
+  Log_info("Reloaded limits from %s", config_file_.c_str());
+  return true;
+}
+
+void GCodeMachineControl::Impl::reload_config_if_requested() {
+  if (!config_reload_requested_) return;
+  config_reload_requested_ = 0;
+  reload_config();
+}
+
 void GCodeMachineControl::Impl::get_endstop_status() {
   bool any_endstops_found = false;
   for (const GCodeParserAxis axis : AllAxes()) {
@@ -546,7 +897,13 @@ void GCodeMachineControl::Impl::gcode_start(GCodeParser *parser) {
 
 void GCodeMachineControl::Impl::gcode_finished(bool end_of_stream) {
   planner_->BringPathToHalt();
-  spindle_->Off();
+  reload_config_if_requested();
+  if (cfg_.laser_mode) {
+    laser_off();
+    planner_->BringPathToHalt();
+  } else {
+    spindle_->Off();
+  }
   if (end_of_stream && cfg_.auto_motor_disable_seconds > 0)
     motors_enable(false);
 }
@@ -561,6 +918,24 @@ bool GCodeMachineControl::Impl::test_homing_status_ok() {
   return false;
 }
 
+void GCodeMachineControl::Impl::get_motor_steps_from_home(
+  int steps[BEAGLEG_NUM_MOTORS]) {
+  AxesRegister pos;
+  pos.zero();
+  planner_->GetCurrentPosition(&pos);
+  int axis_steps[GCODE_NUM_AXES];
+  for (const GCodeParserAxis axis : AllAxes()) {
+    const bool home_max
+      = cfg_.homing_trigger[axis] & HardwareMapping::TRIGGER_MAX;
+    const float home_pos = home_max ? cfg_.move_range_mm[axis] : 0;
+    axis_steps[axis] = round2int(pos[axis] * cfg_.steps_per_mm[axis])
+      - round2int(home_pos * cfg_.steps_per_mm[axis]);
+  }
+  LinearSegmentSteps motors = {};
+  hardware_mapping_->AssignAllMotorSteps(axis_steps, &motors);
+  memcpy(steps, motors.steps, sizeof(motors.steps));
+}
+
 bool GCodeMachineControl::Impl::test_within_machine_limits(const AxesRegister &axes) {
   if (!cfg_.range_check)
     return true;
@@ -621,11 +996,41 @@ bool GCodeMachineControl::Impl::coordinated_move(float feed,
     return false;
   }
 
+  wait_spindle_ready();
+  if (cfg_.laser_mode) laser_for_move(true);
   float feedrate = prog_speed_factor_ * current_feedrate_mm_per_sec_;
-  planner_->Enqueue(axis, feedrate);
+  // All but the first segment of a curve continue it smoothly.
+  if (curve_segments_ >= 0 && curve_segments_++ > 0)
+    planner_->EnqueueCurve(axis, feedrate);
+  else
+    planner_->Enqueue(axis, feedrate);
   return true;
 }
 
+// Arcs and splines are linearized by the default implementation, but we let
+// the planner know that the segments are part of one curve.
+void GCodeMachineControl::Impl::arc_move(float feed_mm_p_sec,
+                                         GCodeParserAxis normal_axis,
+                                         bool clockwise,
+                                         const AxesRegister &start,
+                                         const AxesRegister &center,
+                                         const AxesRegister &end) {
+  curve_segments_ = 0;
+  EventReceiver::arc_move(feed_mm_p_sec, normal_axis, clockwise,
+                          start, center, end);
+  curve_segments_ = -1;
+}
+
+void GCodeMachineControl::Impl::spline_move(float feed_mm_p_sec,
+                                            const AxesRegister &start,
+                                            const AxesRegister &cp1,
+                                            const AxesRegister &cp2,
+                                            const AxesRegister &end) {
+  curve_segments_ = 0;
+  EventReceiver::spline_move(feed_mm_p_sec, start, cp1, cp2, end);
+  curve_segments_ = -1;
+}
+
 bool GCodeMachineControl::Impl::rapid_move(float feed,
                                            const AxesRegister &axis) {
   if (!test_homing_status_ok())
@@ -637,13 +1042,51 @@ bool GCodeMachineControl::Impl::rapid_move(float feed,
   if (given > 0 && current_feedrate_mm_per_sec_ <= 0) {
     current_feedrate_mm_per_sec_ = given;  // At least something for G1.
   }
+  wait_spindle_ready();
+  if (cfg_.laser_mode) laser_for_move(false);
   planner_->Enqueue(axis, given > 0 ? given : rapid_feed);
   return true;
 }
 
+// G7 raster lines modulate the laser power set with M3/M4 with their pixels.
+// Without laser mode, they are just moves.
+bool GCodeMachineControl::Impl::raster_move(float feed,
+                                            const AxesRegister &start,
+                                            const AxesRegister &end,
+                                            const uint8_t *pixels, int count) {
+  if (!cfg_.laser_mode)
+    return coordinated_move(feed, end);
+  if (!test_homing_status_ok())
+    return false;
+  if (!test_within_machine_limits(end))
+    return false;
+  if (feed > 0) {
+    current_feedrate_mm_per_sec_ = cfg_.speed_factor * feed;
+  }
+  if (current_feedrate_mm_per_sec_ <= 0) {
+    mprintf("// Error: No feedrate set yet.\n");
+    return false;
+  }
+  wait_spindle_ready();
+  laser_for_move(true);
+  const float feedrate = prog_speed_factor_ * current_feedrate_mm_per_sec_;
+  planner_->EnqueueRaster(end, feedrate, pixels, count);
+  return true;
+}
+
+// Spindle changes don't stop the G-code processing; only the next move
+// (or dwell) waits until the spindle is at speed or stopped. Until then,
+// already queued moves keep running.
+void GCodeMachineControl::Impl::wait_spindle_ready() {
+  if (!spindle_changing_) return;
+  spindle_->WaitReady();
+  spindle_changing_ = false;
+}
+
 void GCodeMachineControl::Impl::dwell(float value) {
   planner_->BringPathToHalt();
   motor_ops_->WaitQueueEmpty();
+  wait_spindle_ready();
   usleep((int) (value * 1000));
 
   if (pause_enabled_ && check_for_pause()) {
@@ -654,6 +1097,7 @@ void GCodeMachineControl::Impl::dwell(float value) {
 
 void GCodeMachineControl::Impl::input_idle(bool is_first) {
   planner_->BringPathToHalt();
+  reload_config_if_requested();
   if (cfg_.auto_motor_disable_seconds > 0) {
     if (is_first) {
       next_auto_disable_motor_ = time(NULL) + cfg_.auto_motor_disable_seconds;
@@ -686,18 +1130,22 @@ void GCodeMachineControl::Impl::set_speed_factor(float value) {
 }
 
 // Moves to endstop and returns how many steps it moved in the process.
+// Gives up after "max_distance"; "*triggered" tells if the switch was seen.
 int GCodeMachineControl::Impl::move_to_endstop(enum GCodeParserAxis axis,
                                                float feedrate, bool backoff,
                                                HardwareMapping::AxisTrigger trigger,
-                                               int max_steps) {
+                                               float max_distance,
+                                               bool *triggered) {
+  *triggered = true;
   if (hardware_mapping_->IsHardwareSimulated()) {
     return 0;  // There are no switches to trigger, so pretend we stopped.
   }
-
+#ifndef BEAGLEG_PRU_PROBE
   // This is a G30 probe if there is no backoff, use a smaller move for the
   // probe to increase accuracy.
   const float kHomingMM = (backoff) ? 0.5 : 0.05; // TODO: make configurable?
   const float kBackoffMM = kHomingMM / 10.0;      // TODO: make configurable?
+  const int max_steps = abs(max_distance * cfg_.steps_per_mm[axis]);
 
   int total_movement = 0;
   const int dir = trigger == HardwareMapping::TRIGGER_MIN ? -1 : 1;
@@ -706,8 +1154,8 @@ int GCodeMachineControl::Impl::move_to_endstop(enum GCodeParserAxis axis,
   while (!hardware_mapping_->TestAxisSwitch(axis, trigger)) {
     total_movement += planner_->DirectDrive(axis, dir * kHomingMM, v0, v1);
     v0 = v1;  // TODO: possibly acceleration over multiple segments.
-    if (max_steps && abs(total_movement) > max_steps) {
-      mprintf("// G30: max probe reached\n");
+    if (abs(total_movement) > max_steps) {
+      *triggered = false;
       return total_movement;
     }
   }
@@ -719,13 +1167,34 @@ int GCodeMachineControl::Impl::move_to_endstop(enum GCodeParserAxis axis,
   }
 
   return total_movement;
+#else
+  // Approach, a short retract and the slow touch are done by the hardware;
+  // it stops the moves towards the switch as soon as it triggers, so we
+  // don't have to test it between small moves. The touch takes the place of
+  // the backoff.
+  uint32_t gpio_def;
+  bool trigger_level;
+  if (!hardware_mapping_->GetAxisSwitchGPIO(axis, trigger,
+                                            &gpio_def, &trigger_level)) {
+    *triggered = false;
+    return 0;
+  }
+  motor_ops_->SetProbeSwitch(gpio_def, trigger_level);
+
+  const float kRetractMM = 1.0;        // TODO: make configurable?
+  const float kTouchSpeedFactor = 0.2;
+  const int dir = trigger == HardwareMapping::TRIGGER_MIN ? -1 : 1;
+  return planner_->DriveToSwitch(axis, dir * max_distance, kRetractMM,
+                                 feedrate, kTouchSpeedFactor * feedrate,
+                                 triggered);
+#endif
 }
 
 // TODO(hzeller): Should planner provide homing features ?
-void GCodeMachineControl::Impl::home_axis(enum GCodeParserAxis axis) {
+bool GCodeMachineControl::Impl::home_axis(enum GCodeParserAxis axis) {
   const HardwareMapping::AxisTrigger trigger = cfg_.homing_trigger[axis];
   if (trigger == HardwareMapping::TRIGGER_NONE)
-    return;  // TODO: warn that there is no swich ? Should we pretend go back?
+    return true;  // TODO: warn that there is no swich ? Should we pretend go back?
   const float home_pos = ((trigger == HardwareMapping::TRIGGER_MAX)
                           ? cfg_.move_range_mm[axis]
                           : 0.0f);
@@ -741,21 +1210,35 @@ void GCodeMachineControl::Impl::home_axis(enum GCodeParserAxis axis) {
     planner_->Enqueue(current, kHomingSpeed);
     planner_->BringPathToHalt();
   } else {
-    move_to_endstop(axis, kHomingSpeed, true, trigger);
+    // We might be anywhere, so go a bit more than the whole range.
+    const float kUnknownRangeMM = 1000;
+    const float max_distance = (cfg_.move_range_mm[axis] > 0)
+      ? 1.5 * cfg_.move_range_mm[axis] : kUnknownRangeMM;
+    bool triggered;
+    move_to_endstop(axis, kHomingSpeed, true, trigger, max_distance,
+                    &triggered);
+    if (!triggered) {
+      mprintf("// BeagleG: Homing %c did not reach the endstop.\n",
+              gcodep_axis2letter(axis));
+      return false;
+    }
     planner_->SetExternalPosition(axis, home_pos);
     AxesRegister current;
     planner_->GetCurrentPosition(&current);
     Log_debug("Axis %i homed to: %f\n", axis, current[axis]); // TODO: why does it refuse to go to say Y100 after homing to Y140?
   }
+  return true;
 }
 
 void GCodeMachineControl::Impl::go_home(AxisBitmap_t axes_bitmap) {
   planner_->BringPathToHalt();
+  wait_spindle_ready();
   for (const char axis_letter : cfg_.home_order) {
     const enum GCodeParserAxis axis = gcodep_letter2axis(axis_letter);
     if (axis == GCODE_NUM_AXES || !(axes_bitmap & (1 << axis)))
       continue;
-    home_axis(axis);
+    if (!home_axis(axis))
+      return;  // Position unknown; we are not homed.
   }
   homing_state_ = HOMING_STATE_HOMED;
 }
@@ -763,6 +1246,20 @@ void GCodeMachineControl::Impl::go_home(AxisBitmap_t axes_bitmap) {
 bool GCodeMachineControl::Impl::probe_axis(float feedrate,
                                            enum GCodeParserAxis axis,
                                            float *probe_result) {
+  wait_spindle_ready();
+  bool triggered;
+  if (!probe_to_switch(feedrate, axis, probe_result, &triggered))
+    return false;
+  if (!triggered) {
+    mprintf("// G30: max probe reached\n");
+  }
+  return true;
+}
+
+bool GCodeMachineControl::Impl::probe_to_switch(float feedrate,
+                                                enum GCodeParserAxis axis,
+                                                float *probe_result,
+                                                bool *triggered) {
   if (!test_homing_status_ok())
     return false;
 
@@ -788,8 +1285,8 @@ bool GCodeMachineControl::Impl::probe_axis(float feedrate,
   }
 
   if (feedrate <= 0) feedrate = 20;
-  int max_steps = abs(cfg_.move_range_mm[axis] * cfg_.steps_per_mm[axis]);
-  int total_steps = move_to_endstop(axis, feedrate, false, probe_trigger, max_steps);
+  int total_steps = move_to_endstop(axis, feedrate, false, probe_trigger,
+                                    cfg_.move_range_mm[axis], triggered);
   float distance_moved = total_steps / cfg_.steps_per_mm[axis];
   AxesRegister machine_pos;
   planner_->GetCurrentPosition(&machine_pos);
@@ -799,6 +1296,99 @@ bool GCodeMachineControl::Impl::probe_axis(float feedrate,
   return true;
 }
 
+// G29: probe Z on a grid over the bed and compensate all following moves
+// for the measured heights, relative to their average. We start at the
+// current Z height and go back up to it to travel between the points.
+bool GCodeMachineControl::Impl::probe_bed_mesh() {
+  if (!test_homing_status_ok())
+    return false;
+  const int points = cfg_.bed_mesh_points;
+  const float margin = cfg_.bed_mesh_margin;
+  const float x0 = margin, x1 = cfg_.move_range_mm[AXIS_X] - margin;
+  const float y0 = margin, y1 = cfg_.move_range_mm[AXIS_Y] - margin;
+  if (points < 2 || x1 <= x0 || y1 <= y0) {
+    mprintf("// BeagleG: G29 needs bed-mesh-points >= 2 and X/Y ranges "
+            "larger than twice the bed-mesh-margin.\n");
+    return false;
+  }
+
+  // Measure without the old compensation.
+  planner_->SetBedMesh(NULL);
+  delete bed_mesh_;
+  bed_mesh_ = NULL;
+
+  BedMesh *mesh = new BedMesh(x0, y0, x1, y1, points, points);
+  AxesRegister pos;
+  planner_->GetCurrentPosition(&pos);
+  const float clearance_z = pos[AXIS_Z];
+  float sum = 0;
+  for (int row = 0; row < points; ++row) {
+    for (int i = 0; i < points; ++i) {
+      // Back and forth, so that we never travel across the whole bed.
+      const int col = (row % 2 == 0) ? i : points - 1 - i;
+      planner_->GetCurrentPosition(&pos);
+      pos[AXIS_Z] = clearance_z;
+      planner_->Enqueue(pos, g0_feedrate_mm_per_sec_);
+      pos[AXIS_X] = mesh->x(col);
+      pos[AXIS_Y] = mesh->y(row);
+      planner_->Enqueue(pos, g0_feedrate_mm_per_sec_);
+      float z;
+      bool triggered;
+      if (!probe_to_switch(0, AXIS_Z, &z, &triggered) || !triggered) {
+        mprintf("// G29: no probe contact at X%.3f Y%.3f\n",
+                pos[AXIS_X], pos[AXIS_Y]);
+        delete mesh;
+        return false;
+      }
+      mprintf("// G29: X%.3f Y%.3f Z%.3f\n", pos[AXIS_X], pos[AXIS_Y], z);
+      mesh->set_height(col, row, z);
+      sum += z;
+    }
+  }
+  planner_->GetCurrentPosition(&pos);
+  pos[AXIS_Z] = clearance_z;
+  planner_->Enqueue(pos, g0_feedrate_mm_per_sec_);
+
+  const float average = sum / (points * points);
+  for (int row = 0; row < points; ++row) {
+    for (int col = 0; col < points; ++col) {
+      mesh->set_height(col, row, mesh->height(col, row) - average);
+    }
+  }
+  bed_mesh_ = mesh;
+  planner_->SetBedMesh(bed_mesh_);
+  return true;
+}
+
+// M420 S0 switches the bed mesh compensation off, S1 on again. Without
+// parameter, prints the mesh.
+const char *GCodeMachineControl::Impl::bed_mesh_command(const char *remaining) {
+  char letter;
+  float value;
+  const char *after_pair = parser_->ParsePair(remaining, &letter, &value,
+                                              msg_stream_);
+  if (after_pair != NULL && letter == 'S') {
+    if (bed_mesh_ == NULL) {
+      mprintf("// BeagleG: no bed mesh; probe it with G29 first.\n");
+    } else {
+      planner_->SetBedMesh(value != 0 ? bed_mesh_ : NULL);
+    }
+    return after_pair;
+  }
+  if (bed_mesh_ == NULL) {
+    mprintf("// Bed mesh: none\n");
+    return remaining;
+  }
+  for (int row = bed_mesh_->rows() - 1; row >= 0; --row) {
+    mprintf("// Y%8.3f:", bed_mesh_->y(row));
+    for (int col = 0; col < bed_mesh_->columns(); ++col) {
+      mprintf(" %7.3f", bed_mesh_->height(col, row));
+    }
+    mprintf("\n");
+  }
+  return remaining;
+}
+
 GCodeMachineControl::GCodeMachineControl(Impl *impl) : impl_(impl) {
 }
 GCodeMachineControl::~GCodeMachineControl() {
@@ -830,6 +1420,14 @@ void GCodeMachineControl::GetHomePos(AxesRegister *home_pos) {
   }
 }
 
+bool GCodeMachineControl::NeedsHoming() const {
+  return impl_->needs_homing();
+}
+
+void GCodeMachineControl::GetMotorStepsFromHome(int steps[BEAGLEG_NUM_MOTORS]) {
+  impl_->get_motor_steps_from_home(steps);
+}
+
 GCodeParser::EventReceiver *GCodeMachineControl::ParseEventReceiver() {
   return impl_;
 }
@@ -837,3 +1435,39 @@ GCodeParser::EventReceiver *GCodeMachineControl::ParseEventReceiver() {
 void GCodeMachineControl::SetMsgOut(FILE *msg_stream) {
   impl_->set_msg_stream(msg_stream);
 }
+
+bool GCodeMachineControl::ReportStatus(int m_code, FILE *out) {
+  return impl_->report_status(m_code, out);
+}
+
+bool GCodeMachineControl::SetRealtimeSpeedFactor(float factor) {
+  return impl_->set_realtime_speed_factor(factor);
+}
+
+bool GCodeMachineControl::SetFeedHold(bool hold) {
+  return impl_->set_feed_hold(hold);
+}
+
+bool GCodeMachineControl::IsMotionQueueFull() {
+  return impl_->motion_queue_full();
+}
+
+bool GCodeMachineControl::UpdateConfig(const MachineControlConfig &config) {
+  return impl_->update_config(config);
+}
+
+void GCodeMachineControl::SetConfigFile(const std::string &filename) {
+  impl_->set_config_file(filename);
+}
+
+void GCodeMachineControl::RequestConfigReload() {
+  impl_->request_config_reload();
+}
+
+int GCodeMachineControl::ConfigReloadCount(std::string *content) const {
+  return impl_->config_reload_count(content);
+}
+
+void GCodeMachineControl::SetTemperatureControl(TemperatureControl *t) {
+  impl_->set_temperature_control(t);
+}
@@ -22,12 +22,14 @@
 #include "gcode-parser/gcode-parser.h"
 #include "common/container.h"
 #include "hardware-mapping.h"
+#include "input-shaping.h"
 
 #include <string>
 
 class MotorOperations;
 class ConfigParser;
 class Spindle;
+class TemperatureControl;
 typedef FixedArray<float, GCODE_NUM_AXES> FloatAxisConfig;
 
 /* Configuration constants for the controller.
@@ -47,8 +49,29 @@ struct MachineControlConfig {
   FloatAxisConfig max_feedrate;   // Max feedrate for axis (mm/s)
   FloatAxisConfig acceleration;   // Max acceleration for axis (mm/s^2)
 
+  // Resonance compensation applied to the motors of each axis; see
+  // InputShapingMotorOperations.
+  FixedArray<InputShaperType, GCODE_NUM_AXES> input_shaper;
+  FloatAxisConfig input_shaper_frequency;  // Resonance frequency (Hz).
+  FloatAxisConfig input_shaper_damping;    // Damping ratio. Default 0.1
+
   float speed_factor;         // Multiply feed with. Should be 1.0 by default.
   float threshold_angle;      // Threshold angle to ignore speed changes
+  float junction_deviation;   // If > 0: cornering tolerance in mm. Used
+                              // instead of threshold_angle.
+  int lookahead_segments;     // Number of upcoming segments to plan speed with.
+  bool s_curve_acceleration;  // Jerk-limited speed changes instead of
+                              // constant acceleration.
+  float arc_tolerance;        // If > 0: max deviation of arc segments in mm.
+  float arc_min_segment;      // If > 0: min arc segment length in mm.
+  float merge_deviation;      // If > 0: merge collinear moves that deviate
+                              // at most this many mm from the merged line.
+  float merge_feed_tolerance; // Relative feedrate difference still merged.
+  float max_step_frequency;   // Fastest step rate the hardware does (steps/s)
+  int bed_mesh_points;        // If >= 2: G29 probes this many points per
+                              // X and Y to compensate for the bed height.
+  float bed_mesh_margin;      // Distance of probe points from X/Y range ends.
+  float bed_mesh_tolerance;   // Max deviation from the mesh in mm.
 
   std::string home_order;        // Order in which axes are homed.
 
@@ -63,6 +86,8 @@ struct MachineControlConfig {
   bool debug_print;             // Print step-tuples to output_fd if 1.
   bool synchronous;             // Don't queue, wait for command to finish if 1.
   bool enable_pause;            // Enable pause switch detection. Default 0.
+  bool laser_mode;              // M3/M4 S set laser power during G1 moves.
+  float laser_max_s;            // S value for full laser power.
 };
 
 // A class that controls a machine via gcode.
@@ -88,6 +113,69 @@ class GCodeMachineControl {
   // return in *pos register.
   void GetHomePos(AxesRegister *pos);
 
+  // Whether moves are refused until the machine is homed (G28), as
+  // require-homing is set and it was never homed.
+  bool NeedsHoming() const;
+
+  // Position of the motors in steps relative to the home position, which is
+  // where the machine is assumed to start. Segment files record their start
+  // and end in the same way (see SegmentFileHeader).
+  void GetMotorStepsFromHome(int steps[BEAGLEG_NUM_MOTORS]);
+
+  // Print the status as requested by M-code "m_code" to "out", without
+  // interfering with the running program. Supported are the queries
+  // M105 (temperature), M114 (position), M115 (version), M119 (endstops),
+  // M122 (queue and planner metrics).
+  // Returns false for other codes.
+  bool ReportStatus(int m_code, FILE *out);
+
+  // Real-time overrides, applied by the hardware to moves that are already
+  // queued, so they take effect right away instead of after the queue drained.
+  // Speed factor relative to the programmed speed (including M220), ramped
+  // in as fast as the acceleration allows. Returns false for factors <= 0 or
+  // above 1: faster than planned would exceed the axis limits; also if the
+  // motion backend has no real-time override (e.g. the original PRU
+  // firmware).
+  bool SetRealtimeSpeedFactor(float factor);
+
+  // Decelerate to a stop and hold (true) or continue (false). While held,
+  // the motion queue does not drain, so nothing must wait for it; callers
+  // feeding the parser should stop processing input until released.
+  // Returns false if the motion backend can't hold.
+  bool SetFeedHold(bool hold);
+
+  // Whether the motion queue has less room right now than the next line can
+  // need in the worst case (bringing all moves planned ahead to a halt and
+  // a curve across the machine), so that it might wait until the machine
+  // made room. Lets an event loop feeding the parser serve other things
+  // meanwhile instead of blocking in the next line.
+  bool IsMotionQueueFull();
+
+  // Take over the speed, acceleration and cornering limits (max_feedrate,
+  // acceleration, threshold_angle, ...) from "config", while keeping the
+  // machine position and homing state. Halts the path first.
+  // Settings that need a restart, such as steps_per_mm, ranges or homing,
+  // need to be unchanged; returns false if they are not or if the new values
+  // are invalid.
+  bool UpdateConfig(const MachineControlConfig &config);
+
+  // Configuration file to re-read with M501 or RequestConfigReload().
+  void SetConfigFile(const std::string &filename);
+
+  // Re-read the configuration file and UpdateConfig() with it the next time
+  // the machine is halted anyway (input idle or end of program). Only sets a
+  // flag, so this can be called from a signal handler.
+  void RequestConfigReload();
+
+  // Number of successful configuration reloads so far. If "content" is
+  // non-NULL, it receives the configuration file content last taken over, so
+  // that callers deriving something from the configuration can follow along.
+  int ConfigReloadCount(std::string *content = NULL) const;
+
+  // Temperature control used for M104/M109 and reported with M105.
+  // Without it, these commands are ignored. Not taken over.
+  void SetTemperatureControl(TemperatureControl *temperature_control);
+
   // Return the receiver for parse events. The caller must not assume ownership
   // of the returned pointer.
   GCodeParser::EventReceiver *ParseEventReceiver();
@@ -10,7 +10,9 @@
 #include "gcode-machine-control.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 
@@ -18,6 +20,7 @@
 #include "common/logging.h"
 
 #include "hardware-mapping.h"
+#include "motion-queue.h"
 #include "motor-operations.h"
 
 #define END_SENTINEL 0x42
@@ -38,7 +41,8 @@ namespace {
 class MockMotorOps : public MotorOperations {
 public:
   MockMotorOps(const LinearSegmentSteps *expected)
-    : expect_(expected), current_(expected), errors_(0) {}
+    : override_stop_seconds(-1), queue_full_operations(-1),
+      expect_(expected), current_(expected), errors_(0) {}
 
   ~MockMotorOps() {
     EXPECT_EQ(0, errors_);
@@ -55,6 +59,16 @@ public:
 
   virtual void MotorEnable(bool on) {}
   virtual void WaitQueueEmpty(){}
+  virtual void SetSpeedOverrideRamp(float stop_seconds) {
+    override_stop_seconds = stop_seconds;
+  }
+  virtual bool QueueFull(int operations) {
+    queue_full_operations = operations;
+    return false;
+  }
+
+  float override_stop_seconds;
+  int queue_full_operations;
 
 private:
   // Helpers to compare and print MotorMovements.
@@ -212,6 +226,190 @@ TEST(GCodeMachineControlTest, straight_segments_speed_change) {
   harness.gcode_emit()->motors_enable(false);  // finish movement.
 }
 
+// New limits are taken over between moves; settings that need a
+// restart are refused.
+TEST(GCodeMachineControlTest, update_config_limits) {
+  static const struct LinearSegmentSteps expected[] = {
+    { /*v0*/     0.0, /*v1*/ 10000.0, 0, /*steps*/ { 500}},  // accel
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9000}},  // move @100mm/s
+    { /*v0*/ 10000.0, /*v1*/     0.0, 0, /*steps*/ { 500}},  // decel
+    { /*v0*/     0.0, /*v1*/ 10000.0, 0, /*steps*/ { 250}},  // accel doubled
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9500}},
+    { /*v0*/ 10000.0, /*v1*/     0.0, 0, /*steps*/ { 250}},
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  Harness harness(expected);
+  // The speed override ramps like the slowest axis stops: Z, 3000mm/s.
+  EXPECT_FLOAT_EQ(3.0, harness.expect_motor_ops_.override_stop_seconds);
+
+  AxesRegister coordinates;
+  coordinates[AXIS_X] = 100;
+  harness.gcode_emit()->coordinated_move(100, coordinates);
+
+  struct MachineControlConfig config;
+  init_test_config(&config, &harness.hardware_);
+  config.acceleration[AXIS_X] = 2000;
+  config.acceleration[AXIS_Z] = 2000;
+  EXPECT_TRUE(harness.machine_control->UpdateConfig(config));
+  EXPECT_FLOAT_EQ(2.0, harness.expect_motor_ops_.override_stop_seconds);
+
+  coordinates[AXIS_X] = 200;
+  harness.gcode_emit()->coordinated_move(100, coordinates);
+
+  config.steps_per_mm[AXIS_X] = 50;
+  EXPECT_FALSE(harness.machine_control->UpdateConfig(config));
+  config.steps_per_mm[AXIS_X] = 100;
+  config.acceleration[AXIS_Y] = -1;
+  EXPECT_FALSE(harness.machine_control->UpdateConfig(config));
+  config.acceleration[AXIS_Y] = 1000;
+  config.laser_mode = true;
+  EXPECT_FALSE(harness.machine_control->UpdateConfig(config));
+
+  harness.gcode_emit()->motors_enable(false);  // finish movement.
+}
+
+TEST(GCodeMachineControlTest, queue_room_for_worst_case_line) {
+  static const struct LinearSegmentSteps expected[] = {
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  struct MachineControlConfig config;
+  init_test_config(&config, NULL);
+  config.lookahead_segments = 10;
+  config.move_range_mm[AXIS_X] = 100;
+  config.arc_tolerance = 100;  // Only limited by 1/16 turn per chord.
+  MockMotorOps motor_ops(expected);
+  HardwareMapping hardware;
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &motor_ops, &hardware, NULL, NULL);
+  ASSERT_TRUE(machine_control != NULL);
+  EXPECT_FALSE(machine_control->IsMotionQueueFull());
+  // Flush of the lookahead, the next move and a circle in 16 moves; each
+  // move is sent as one trapezoid of up to three parts.
+  EXPECT_EQ((10 + 1 + 16) * 3, motor_ops.queue_full_operations);
+  delete machine_control;
+}
+
+// Replaying a segment file bypasses the machine control, which then only
+// tells if it needs homing first and where the motors are.
+TEST(GCodeMachineControlTest, homing_state_and_motor_steps_for_replay) {
+  static const struct LinearSegmentSteps expected[] = {
+    { /*v0*/     0.0, /*v1*/ 10000.0, 0, /*steps*/ {0,  -500}},
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {0, -9000}},
+    { /*v0*/ 10000.0, /*v1*/     0.0, 0, /*steps*/ {0,  -500}},
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  struct MachineControlConfig config;
+  init_test_config(&config, NULL);
+  config.require_homing = true;
+  MockMotorOps motor_ops(expected);
+  HardwareMapping hardware;
+  hardware.AddMotorMapping(AXIS_X, 2, true);
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &motor_ops, &hardware, NULL, NULL);
+  ASSERT_TRUE(machine_control != NULL);
+  GCodeParser::EventReceiver *events = machine_control->ParseEventReceiver();
+
+  int steps[BEAGLEG_NUM_MOTORS];
+  machine_control->GetMotorStepsFromHome(steps);
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) EXPECT_EQ(0, steps[i]);
+  EXPECT_TRUE(machine_control->NeedsHoming());
+  events->go_home(1 << AXIS_X);  // Nothing to move without endswitch.
+  EXPECT_FALSE(machine_control->NeedsHoming());
+
+  AxesRegister coordinates;
+  coordinates[AXIS_X] = 100;
+  events->coordinated_move(100, coordinates);
+  events->motors_enable(false);
+  machine_control->GetMotorStepsFromHome(steps);
+  EXPECT_EQ(0, steps[0]);
+  EXPECT_EQ(-10000, steps[1]);  // Mirrored motor.
+  EXPECT_FALSE(machine_control->NeedsHoming());  // Still knows its position.
+  delete machine_control;
+}
+
+TEST(GCodeMachineControlTest, config_reload_reports_new_content) {
+  static const struct LinearSegmentSteps expected[] = {
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  Harness harness(expected);
+  char name[] = "/tmp/gcode-machine-control_test.XXXXXX";
+  const int fd = mkstemp(name);
+  ASSERT_GE(fd, 0);
+  const std::string content =
+    "[ x-axis ]\nsteps-per-mm = 100\nmax-feedrate = 1000\n"
+    "max-acceleration = 2000\n"
+    "[ y-axis ]\nsteps-per-mm = 100\nmax-feedrate = 2000\n"
+    "max-acceleration = 2000\n"
+    "[ z-axis ]\nsteps-per-mm = 100\nmax-feedrate = 3000\n"
+    "max-acceleration = 2000\n";
+  ASSERT_EQ((ssize_t) content.size(),
+            write(fd, content.data(), content.size()));
+  close(fd);
+
+  // Nothing reloaded yet: users of the configuration can keep theirs.
+  EXPECT_EQ(0, harness.machine_control->ConfigReloadCount());
+  harness.machine_control->SetConfigFile(name);
+  harness.gcode_emit()->unprocessed('M', 501, "");
+  std::string reloaded;
+  EXPECT_EQ(1, harness.machine_control->ConfigReloadCount(&reloaded));
+  EXPECT_EQ(content, reloaded);
+  EXPECT_FLOAT_EQ(1.5, harness.expect_motor_ops_.override_stop_seconds);
+
+  // A failed reload does not count.
+  unlink(name);
+  harness.gcode_emit()->unprocessed('M', 501, "");
+  EXPECT_EQ(1, harness.machine_control->ConfigReloadCount());
+}
+
+// Count allocations while counting is on, to check that the steady state
+// of the motion path does not touch the heap.
+static volatile bool count_allocations = false;
+static int allocation_count = 0;
+
+void *operator new(size_t size) {
+  if (count_allocations) ++allocation_count;
+  void *result = malloc(size ? size : 1);
+  if (!result) throw std::bad_alloc();
+  return result;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+TEST(GCodeMachineControlTest, no_allocations_in_steady_state) {
+  struct MachineControlConfig config;
+  HardwareMapping hardware;
+  init_test_config(&config, &hardware);
+  config.range_check = false;
+  DummyMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &motor_ops, &hardware, NULL, NULL);
+  ASSERT_TRUE(machine_control != NULL);
+
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  GCodeParser parser(parser_cfg, machine_control->ParseEventReceiver(), false);
+
+  // Plain moves and arcs, and the parameters generated programs use.
+  static const char *const kProgram[] = {
+    "G1 X10 Y10 F3000", "X20 Y15", "G0 X30", "G2 X40 Y15 I5 J0",
+    "G3 X30 Y15 I-5 J0", "G1 X10 Y10 Z1", "X0 Y0 Z0",
+    "#1 = [#1 + 1]", "#<ypos> = [#1 / 10]", "G1 X[10 + #1 / 100] Y#<ypos>",
+    "G1 X#<_x> Y[#<_y> + 1]", "#5000 = #5000 + 1",
+  };
+  for (int round = 0; round < 20; ++round) {
+    if (round == 10) count_allocations = true;  // Warmed up.
+    for (const char *line : kProgram) parser.ParseLine(line, stderr);
+  }
+  count_allocations = false;
+  EXPECT_EQ(0, allocation_count);
+  delete machine_control;
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
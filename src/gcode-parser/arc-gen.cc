@@ -21,7 +21,7 @@
 #include <math.h>
 #include <stdio.h>
 
-#include <functional>
+#include <algorithm>
 
 #if 0
 #  include "logging.h"
@@ -33,24 +33,35 @@
 // https://github.com/Smoothieware/Smoothieware.git
 // src/modules/robot/Robot.cpp - Robot::append_arc()
 //
-// Simplified: we don't care about using trigonometric optimization
-// tricks (CPU fast enough) but rather have readable code.
+// Instead of calling sin() and cos() for each segment, the radius vector is
+// rotated by the constant segment angle; every ARC_CORRECTION_SEGMENTS, we
+// calculate the exact position to not accumulate rounding errors.
+//
+// The segment output is a template parameter, so that the compiler can
+// inline it into the loop instead of an indirect call per segment.
 //
 // Normal axis is the axis perpendicular to the plane the arc is
 // created in.
 
-// Small arc segments increase accuracy, though might create some
-// CPU load. With 0.1mm arc segments, we can generate about 90 meter/second
-// of arcs with the BeagleBone Black CPU. Sufficient :)
-#define MM_PER_ARC_SEGMENT      0.1
+// Number of segments is chosen so that the chord of each segment deviates
+// at most a given tolerance from the arc. Then large radii don't explode
+// into lots of tiny segments that just keep the planner busy.
+// Even with tiny radii, we never go beyond this angle per segment.
+#define MAX_RADIANS_PER_ARC_SEGMENT (M_PI / 8)
+
+// Incremental rotations between exact calculations.
+#define ARC_CORRECTION_SEGMENTS 16
 
 // Generate an arc. Input is the
+template <typename SegmentOutput>
 static void arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
                     bool is_cw,                        // 0 CCW, 1 CW
                     AxesRegister *position_out,   // start position. Will be updated.
                     const AxesRegister &center,     // Offset to center.
                     const AxesRegister &target,     // Target position.
-                    std::function<void(const AxesRegister&)> segment_output) {
+                    float tolerance_mm,             // Max chord error.
+                    float min_segment_mm,           // Min segment length.
+                    SegmentOutput segment_output) {
   // Depending on the normal vector, pre-calc plane
   enum GCodeParserAxis plane[3];
   switch (normal_axis) {
@@ -101,17 +112,35 @@ static void arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
   if (mm_of_travel < 0.00001)
     return;
 
-  // Figure out how many segments for this gcode
-  const int segments = floorf(mm_of_travel / MM_PER_ARC_SEGMENT);
+  // Figure out how many segments for this gcode. The chord of angle theta
+  // is off by radius * (1 - cos(theta/2)) in the middle.
+  float radians_per_segment = MAX_RADIANS_PER_ARC_SEGMENT;
+  if (tolerance_mm < radius) {
+    radians_per_segment = std::min(radians_per_segment,
+                                   2 * acosf(1 - tolerance_mm / radius));
+  }
+  int segments = ceilf(fabsf(angular_travel) / radians_per_segment);
+  const int max_segments = floorf(mm_of_travel / min_segment_mm);
+  if (segments > max_segments) segments = max_segments;
+  if (segments < 1) segments = 1;
 
   const float theta_per_segment = angular_travel / segments;
   const float linear_per_segment = linear_travel / segments;
 
+  const float cos_T = cosf(theta_per_segment);
+  const float sin_T = sinf(theta_per_segment);
+
   for (int i = 1; i < segments; i++) { // Increment (segments-1)
-    const float cos_Ti = cosf(i * theta_per_segment);
-    const float sin_Ti = sinf(i * theta_per_segment);
-    r_0 = -offset[plane[0]] * cos_Ti + offset[plane[1]] * sin_Ti;
-    r_1 = -offset[plane[0]] * sin_Ti - offset[plane[1]] * cos_Ti;
+    if (i % ARC_CORRECTION_SEGMENTS != 0) {
+      const float rotated_0 = r_0 * cos_T - r_1 * sin_T;
+      r_1 = r_0 * sin_T + r_1 * cos_T;
+      r_0 = rotated_0;
+    } else {
+      const float cos_Ti = cosf(i * theta_per_segment);
+      const float sin_Ti = sinf(i * theta_per_segment);
+      r_0 = -offset[plane[0]] * cos_Ti + offset[plane[1]] * sin_Ti;
+      r_1 = -offset[plane[0]] * sin_Ti - offset[plane[1]] * cos_Ti;
+    }
 
     // Update arc_target location
     position[plane[0]] = center_0 + r_0;
@@ -129,46 +158,94 @@ static void arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
   segment_output(position);
 }
 
-static AxesRegister calc_bezier_point(float t,
-                                      const AxesRegister &p0,
-                                      const AxesRegister &p1,
-                                      const AxesRegister &p2,
-                                      const AxesRegister &p3) {
-  const float u = 1.0f - t;
-  const float uu = u * u;
-  const float tt = t * t;
-  const float uuu = uu * u;
-  const float ttt = tt * t;
-
-  AxesRegister p = p0;
-  p[AXIS_X] = uuu * p0[AXIS_X];               // first term
-  p[AXIS_Y] = uuu * p0[AXIS_Y];
-  p[AXIS_X] += (3.0f * uu * t * p1[AXIS_X]);  // second term
-  p[AXIS_Y] += (3.0f * uu * t * p1[AXIS_Y]);
-  p[AXIS_X] += (3.0f * u * tt * p2[AXIS_X]);  // third term
-  p[AXIS_Y] += (3.0f * u * tt * p2[AXIS_Y]);
-  p[AXIS_X] += (ttt * p3[AXIS_X]);            // forth term
-  p[AXIS_Y] += (ttt * p3[AXIS_Y]);
-  return p;
+// Maximum recursion depth of the spline subdivision; at most 2^depth segments.
+#define MAX_SPLINE_SUBDIVISION_DEPTH 12
+
+// A cubic bezier curve in the XY plane.
+struct Bezier {
+  float x[4];
+  float y[4];
+};
+
+// The curve deviates at most "tolerance" from the straight line between its
+// end points (Willcocks' flatness criterion, using the control points).
+static bool is_flat_enough(const Bezier &b, float tolerance) {
+  const float ux = 3.0f * b.x[1] - 2.0f * b.x[0] - b.x[3];
+  const float uy = 3.0f * b.y[1] - 2.0f * b.y[0] - b.y[3];
+  const float vx = 3.0f * b.x[2] - b.x[0] - 2.0f * b.x[3];
+  const float vy = 3.0f * b.y[2] - b.y[0] - 2.0f * b.y[3];
+  return (std::max(ux*ux, vx*vx) + std::max(uy*uy, vy*vy)
+          <= 16.0f * tolerance * tolerance);
+}
+
+// Split at t=0.5 (de Casteljau).
+static void split_bezier(const float p[4], float left[4], float right[4]) {
+  const float p01 = (p[0] + p[1]) / 2;
+  const float p12 = (p[1] + p[2]) / 2;
+  const float p23 = (p[2] + p[3]) / 2;
+  const float p012 = (p01 + p12) / 2;
+  const float p123 = (p12 + p23) / 2;
+  const float mid = (p012 + p123) / 2;
+  left[0] = p[0];  left[1] = p01;  left[2] = p012;  left[3] = mid;
+  right[0] = mid;  right[1] = p123; right[2] = p23; right[3] = p[3];
 }
 
+// Subdivide the curve until segments are flat enough or too short to be
+// worth splitting; emit the end point of each such piece. If this is the
+// last piece of the curve, "target" is non-NULL and emitted instead.
+template <typename SegmentOutput>
+static void subdivide_bezier(const Bezier &b, int depth,
+                             float tolerance_mm, float min_segment_mm,
+                             AxesRegister *position,
+                             const AxesRegister *target,
+                             SegmentOutput &segment_output) {
+  const float chord = hypotf(b.x[3] - b.x[0], b.y[3] - b.y[0]);
+  if (depth >= MAX_SPLINE_SUBDIVISION_DEPTH || is_flat_enough(b, tolerance_mm)
+      || (chord < min_segment_mm && is_flat_enough(b, min_segment_mm))) {
+    if (target) {
+      segment_output(*target);
+      return;
+    }
+    (*position)[AXIS_X] = b.x[3];
+    (*position)[AXIS_Y] = b.y[3];
+    segment_output(*position);
+    return;
+  }
+  Bezier left, right;
+  split_bezier(b.x, left.x, right.x);
+  split_bezier(b.y, left.y, right.y);
+  subdivide_bezier(left, depth + 1, tolerance_mm, min_segment_mm,
+                   position, NULL, segment_output);
+  subdivide_bezier(right, depth + 1, tolerance_mm, min_segment_mm,
+                   position, target, segment_output);
+}
+
+// Generate a cubic spline in the XY plane. It is split into line segments
+// that are off by at most "tolerance_mm" from the curve; so straight parts
+// result in few, tight curves in many segments. Pieces shorter than
+// "min_segment_mm" are only split if they are off by more than that.
+template <typename SegmentOutput>
 static void spline_gen(const AxesRegister &start,
                        const AxesRegister &cp1,
                        const AxesRegister &cp2,
                        const AxesRegister &target,
-                std::function<void (const AxesRegister& pos)> segment_output) {
+                       float tolerance_mm, float min_segment_mm,
+                       SegmentOutput segment_output) {
 #if 0
   Log_debug("spline_gen: start:%.3f,%.3f cp1:%.3f,%.3f cp2:%.3f,%.3f end:%.3f,%.3f\n",
-            position[AXIS_X], position[AXIS_Y],
+            start[AXIS_X], start[AXIS_Y],
             cp1[AXIS_X], cp1[AXIS_Y],
             cp2[AXIS_X], cp2[AXIS_Y],
             target[AXIS_X], target[AXIS_Y]);
 #endif
-
-  for (float t = 0; t < 1; t += 0.01f) {
-    segment_output(calc_bezier_point(t, start, cp1, cp2, target));
-  }
-  segment_output(target);
+  const Bezier curve = {
+    { start[AXIS_X], cp1[AXIS_X], cp2[AXIS_X], target[AXIS_X] },
+    { start[AXIS_Y], cp1[AXIS_Y], cp2[AXIS_Y], target[AXIS_Y] },
+  };
+  AxesRegister position = start;
+  // The other axes stay at start, only arriving at target in the last segment.
+  subdivide_bezier(curve, 0, tolerance_mm, min_segment_mm,
+                   &position, &target, segment_output);
 }
 
 void GCodeParser::EventReceiver::arc_move(float feed_mm_p_sec,
@@ -178,8 +255,9 @@ void GCodeParser::EventReceiver::arc_move(float feed_mm_p_sec,
                                           const AxesRegister &center,
                                           const AxesRegister &end) {
   AxesRegister position = start;
-  arc_gen(normal_axis, clockwise, &position,
-          center, end, [this, feed_mm_p_sec](const AxesRegister &pos) {
+  arc_gen(normal_axis, clockwise, &position, center, end,
+          arc_tolerance_mm_, arc_min_segment_mm_,
+          [this, feed_mm_p_sec](const AxesRegister &pos) {
             coordinated_move(feed_mm_p_sec, pos);
           });
 }
@@ -189,7 +267,7 @@ void GCodeParser::EventReceiver::spline_move(float feed_mm_p_sec,
                                              const AxesRegister &cp1,
                                              const AxesRegister &cp2,
                                              const AxesRegister &end) {
-  spline_gen(start, cp1, cp2, end,
+  spline_gen(start, cp1, cp2, end, arc_tolerance_mm_, arc_min_segment_mm_,
              [this, feed_mm_p_sec](const AxesRegister &pos) {
                coordinated_move(feed_mm_p_sec, pos);
              });
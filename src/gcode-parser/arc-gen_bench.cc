@@ -0,0 +1,88 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmark for the arc generator: full circles of various radii.
+//
+// Usage: ./arc-gen_bench [circles]
+
+#include "gcode-parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/logging.h"
+
+namespace {
+// Receiver only counting the segments, so that we measure arc generation.
+class SegmentCounter : public GCodeParser::EventReceiver {
+public:
+  SegmentCounter() : segments(0), sum_x(0) {}
+  virtual void gcode_start(GCodeParser *) {}
+  virtual void go_home(AxisBitmap_t) {}
+  virtual void set_speed_factor(float) {}
+  virtual void set_fanspeed(float) {}
+  virtual void set_temperature(float) {}
+  virtual void wait_temperature() {}
+  virtual void dwell(float) {}
+  virtual void motors_enable(bool) {}
+  virtual bool coordinated_move(float, const AxesRegister &pos) {
+    ++segments;
+    sum_x += pos[AXIS_X];   // Make sure nothing is optimized away.
+    return true;
+  }
+  virtual bool rapid_move(float, const AxesRegister &) { return true; }
+  virtual const char *unprocessed(char, float, const char *) { return NULL; }
+
+  long segments;
+  double sum_x;
+};
+}  // namespace
+
+static double Seconds(const struct timespec &start,
+                      const struct timespec &end) {
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  const int circles = (argc > 1) ? atoi(argv[1]) : 20000;
+  Log_init("/dev/null");
+
+  static const float kRadii[] = { 1, 10, 100 };
+  for (float radius : kRadii) {
+    SegmentCounter receiver;
+    AxesRegister start, center;
+    start[AXIS_X] = radius;
+    start[AXIS_Z] = 0;
+    AxesRegister end = start;
+    end[AXIS_Z] = 1;  // Helix, so that all axes are computed.
+
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (int i = 0; i < circles; ++i) {
+      receiver.arc_move(100, AXIS_Z, (i % 2) == 0, start, center, end);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    const double duration = Seconds(t_start, t_end);
+    printf("r=%5.1fmm: %d circles (%ld segments) in %.3fs: "
+           "%.0f segments/s\n", radius, circles, receiver.segments,
+           duration, receiver.segments / duration);
+  }
+  return 0;
+}
@@ -19,7 +19,10 @@
 #include "gcode-parser.h"
 
 #include <math.h>
+
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <gtest/gtest.h>
 
 // Going around the circle for start-points with this step.
@@ -35,7 +38,14 @@
 
 class TestArcAccumulator : public GCodeParser::EventReceiver {
 public:
-  TestArcAccumulator(const AxesRegister &start) : last_(start), total_len_(0) {}
+  TestArcAccumulator(const AxesRegister &start)
+    : last_(start), total_len_(0), segments_(0), max_chord_error_(0) {}
+
+  // Keep track of how far chords are off from the circle around "center".
+  void set_center(const AxesRegister &center, float radius) {
+    center_ = center;
+    radius_ = radius;
+  }
 
   virtual void gcode_start(GCodeParser *parser) {}
   virtual void go_home(AxisBitmap_t axis_bitmap) {}
@@ -48,11 +58,20 @@ public:
   virtual bool coordinated_move(float feed_mm_p_sec, const AxesRegister &pos) {
     total_len_ += hypotf(pos[AXIS_X] - last_[AXIS_X],
                          pos[AXIS_Y] - last_[AXIS_Y]);
+    const double mid_x = (pos[AXIS_X] + last_[AXIS_X]) / 2 - center_[AXIS_X];
+    const double mid_y = (pos[AXIS_Y] + last_[AXIS_Y]) / 2 - center_[AXIS_Y];
+    max_chord_error_ = std::max(max_chord_error_,
+                                radius_ - hypot(mid_x, mid_y));
+    ++segments_;
     last_ = pos;
+    points_.push_back(pos);
     return true;
   }
 
   float total_len() const { return total_len_; }
+  int segments() const { return segments_; }
+  double max_chord_error() const { return max_chord_error_; }
+  const std::vector<AxesRegister> &points() const { return points_; }
 
   virtual bool rapid_move(float feed_mm_p_sec,
                           const AxesRegister &absolute_pos) { return true; }
@@ -61,6 +80,11 @@ public:
 private:
   AxesRegister last_;
   float total_len_;
+  int segments_;
+  AxesRegister center_;
+  float radius_;
+  double max_chord_error_;
+  std::vector<AxesRegister> points_;
 };
 
 static void testHalfTurnAnyStartPosition(bool clockwise) {
@@ -184,6 +208,100 @@ TEST(ArcGenerator, FullTurn_CCW) {
   testFullTurn(false);
 }
 
+// Number of segments depends on the radius, not on the arc length.
+TEST(ArcGenerator, SegmentsFollowChordTolerance) {
+  const float kTolerance = 0.01;
+  int previous_segments = -1;
+  for (float radius = 10; radius <= 1000; radius *= 10) {
+    AxesRegister start, center, target;
+    start[AXIS_X] = radius;
+    target[AXIS_X] = -radius;   // Half a turn.
+
+    TestArcAccumulator collect(start);
+    collect.set_center(center, radius);
+    collect.set_arc_tolerance(kTolerance, 0.01);
+    collect.arc_move(100, AXIS_Z, false, start, center, target);
+    EXPECT_LE(collect.max_chord_error(), kTolerance * 1.01) << radius;
+    EXPECT_NEAR(collect.total_len(), M_PI * radius, kTolerance * radius);
+    // Ten times the radius: only sqrt(10) more segments.
+    if (previous_segments > 0) {
+      EXPECT_NEAR(1.0 * collect.segments() / previous_segments, sqrt(10), 0.1);
+    }
+    previous_segments = collect.segments();
+  }
+  EXPECT_LT(previous_segments, 1000 * M_PI / 0.1 / 50);  // Fixed 0.1mm
+}
+
+TEST(ArcGenerator, MinimumSegmentLength) {
+  AxesRegister start, center, target;
+  start[AXIS_X] = 1;
+  target[AXIS_X] = -1;
+  TestArcAccumulator collect(start);
+  collect.set_arc_tolerance(0.00001, 0.5);  // Asks for very fine chords,
+  collect.arc_move(100, AXIS_Z, false, start, center, target);
+  EXPECT_EQ(6, collect.segments());         // .. but PI mm / 0.5mm max.
+}
+
+static double DistanceToSegment(double px, double py,
+                                const AxesRegister &a, const AxesRegister &b) {
+  const double dx = b[AXIS_X] - a[AXIS_X], dy = b[AXIS_Y] - a[AXIS_Y];
+  const double len2 = dx*dx + dy*dy;
+  double t = (len2 == 0) ? 0
+    : ((px - a[AXIS_X]) * dx + (py - a[AXIS_Y]) * dy) / len2;
+  t = std::max(0.0, std::min(1.0, t));
+  return hypot(px - (a[AXIS_X] + t * dx), py - (a[AXIS_Y] + t * dy));
+}
+
+// Sample the exact curve and see how far it is off the emitted polyline.
+static double MaxSplineDeviation(const AxesRegister &p0,
+                                 const AxesRegister &p1,
+                                 const AxesRegister &p2,
+                                 const AxesRegister &p3,
+                                 const std::vector<AxesRegister> &points) {
+  double max_deviation = 0;
+  for (int i = 0; i <= 2000; ++i) {
+    const double t = i / 2000.0, u = 1 - t;
+    const double b0 = u*u*u, b1 = 3*u*u*t, b2 = 3*u*t*t, b3 = t*t*t;
+    const double x = b0*p0[AXIS_X] + b1*p1[AXIS_X] + b2*p2[AXIS_X] + b3*p3[AXIS_X];
+    const double y = b0*p0[AXIS_Y] + b1*p1[AXIS_Y] + b2*p2[AXIS_Y] + b3*p3[AXIS_Y];
+    double closest = DistanceToSegment(x, y, p0, points[0]);
+    for (size_t s = 1; s < points.size(); ++s) {
+      closest = std::min(closest, DistanceToSegment(x, y, points[s-1], points[s]));
+    }
+    max_deviation = std::max(max_deviation, closest);
+  }
+  return max_deviation;
+}
+
+TEST(SplineGenerator, SegmentsWithinTolerance) {
+  AxesRegister start, cp1, cp2, target;
+  start[AXIS_X] = 0;   start[AXIS_Y] = 0;     // S-shaped curve.
+  cp1[AXIS_X] = 40;    cp1[AXIS_Y] = 30;
+  cp2[AXIS_X] = -10;   cp2[AXIS_Y] = 30;
+  target[AXIS_X] = 50; target[AXIS_Y] = 0;
+  int previous_segments = 1 << 30;
+  for (float tolerance : { 0.001f, 0.01f, 0.1f }) {
+    TestArcAccumulator collect(start);
+    collect.set_arc_tolerance(tolerance, 0.001);
+    collect.spline_move(100, start, cp1, cp2, target);
+    EXPECT_LE(MaxSplineDeviation(start, cp1, cp2, target, collect.points()),
+              tolerance * 1.01) << tolerance;
+    EXPECT_LT(collect.segments(), previous_segments);
+    previous_segments = collect.segments();
+    EXPECT_TRUE(target == collect.points().back());
+  }
+}
+
+TEST(SplineGenerator, StraightSplineIsOneSegment) {
+  AxesRegister start, cp1, cp2, target;
+  cp1[AXIS_X] = 10; cp2[AXIS_X] = 20; target[AXIS_X] = 30;
+  target[AXIS_Z] = 5;
+  TestArcAccumulator collect(start);
+  collect.spline_move(100, start, cp1, cp2, target);
+  ASSERT_EQ(1, collect.segments());
+  EXPECT_TRUE(target == collect.points()[0]);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
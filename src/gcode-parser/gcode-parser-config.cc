@@ -19,12 +19,45 @@
 
 #include "gcode-parser.h"
 
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "common/logging.h"
 
+const int GCodeParser::Config::ParamMap::kNumberedParameters;
+
+GCodeParser::Config::ParamMap::ParamMap()
+  : values_(kNumberedParameters, 0.0f) {
+}
+
+int GCodeParser::Config::ParamMap::Slot(StringPiece name) {
+  bool all_digits = !name.empty() && name.length() <= 4;
+  int number = 0;
+  for (const char c : name) {
+    all_digits &= (isdigit(c) != 0);
+    number = 10 * number + (c - '0');
+  }
+  if (all_digits && number < kNumberedParameters)
+    return number;
+
+  lookup_name_.assign(name.data(), name.length());
+  for (char &c : lookup_name_) {
+    c = tolower(c);
+  }
+  std::map<std::string, int>::const_iterator found
+    = named_slots_.find(lookup_name_);
+  if (found != named_slots_.end())
+    return found->second;
+
+  const int slot = values_.size();
+  values_.push_back(0.0f);
+  named_slots_[lookup_name_] = slot;
+  return slot;
+}
+
 bool GCodeParser::Config::LoadParams(const std::string &filename) {
   if (parameters == NULL) {
     Log_error("No parameters to load into.");
@@ -80,22 +113,25 @@ bool GCodeParser::Config::SaveParams(const std::string &filename) {
   }
 
   int pcount = 0;
-  // We have to go through the list twice. The numeric parameters need to be
-  // stored in numerical order, followed by all the alphanumeric fields.
-  //
-  // Given that we are using a string-key in the map, the numeric fields are
-  // sorted alphanumerically, which is not the same as numerically. So we
-  // simply copy them to a temporary structure that sorts them numerically.
-  std::map<int, float> numeric_params;
-  for (const auto name_value : *parameters) {
-    if (!isdigit(name_value.first[0]))
-      break;
-    numeric_params[atoi(name_value.first.c_str())] = name_value.second;
+  // The numeric parameters need to be stored in numerical order, followed by
+  // all the alphanumeric fields.
+  for (int i = 1; i < ParamMap::kNumberedParameters; ++i) {
+    // Parameter 0 is never written. It should always be zero.
+    const float value = parameters->at(i);
+    if (value != 0) {
+      fprintf(fp, "%i\t%f\n", i, value);
+      ++pcount;
+    }
   }
-
-  for (const auto num_value : numeric_params) {
-    if (num_value.first == 0)
-      continue;  // Never write this parameter. It should always be zero
+  // Numbers beyond the array are interned like names.
+  std::map<int, float> large_numeric_params;
+  for (const auto &name_slot : parameters->named_slots()) {
+    if (isdigit(name_slot.first[0])) {
+      large_numeric_params[atoi(name_slot.first.c_str())]
+        = parameters->at(name_slot.second);
+    }
+  }
+  for (const auto num_value : large_numeric_params) {
     if (num_value.second != 0) {
       fprintf(fp, "%i\t%f\n", num_value.first, num_value.second);
       ++pcount;
@@ -104,14 +140,15 @@ bool GCodeParser::Config::SaveParams(const std::string &filename) {
 
   // Now, all the non-numeric parmeters
   int start_alpha = pcount;
-  for (const auto name_value : *parameters) {
-    if (isdigit(name_value.first[0])) continue;  // Numeric: already written
-    if (name_value.first[0] != '_') continue;    // Only write global parameters
-    if (name_value.second == 0) continue;        // Don't write boring zeroes.
+  for (const auto &name_slot : parameters->named_slots()) {
+    const float value = parameters->at(name_slot.second);
+    if (isdigit(name_slot.first[0])) continue;  // Numeric beyond range.
+    if (name_slot.first[0] != '_') continue;    // Only write global parameters
+    if (value == 0) continue;                   // Don't write boring zeroes.
     if (pcount == start_alpha) {
       fprintf(fp, "\n# Alphanumeric global parameters\n");
     }
-    fprintf(fp, "%s\t%f\n", name_value.first.c_str(), name_value.second);
+    fprintf(fp, "%s\t%f\n", name_slot.first.c_str(), value);
     ++pcount;
   }
   Log_debug("Saving %d parameters to %s", pcount, filename.c_str());
@@ -39,8 +39,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
 #include "common/logging.h"
 #include "common/string-util.h"
+#include "common/trace.h"
 
 #include "simple-lexer.h"
 
@@ -94,12 +100,23 @@ public:
 
   void ParseLine(GCodeParser *owner, const char *line, FILE *err_stream);
   int ParseStream(GCodeParser *owner, int input_fd, FILE *err_stream);
+  // Parse a line handed to us from the outside; loops need to know where
+  // to send their body lines.
+  void ParseSingleLine(GCodeParser *owner, const char *line, FILE *err_stream) {
+    while_owner_ = owner;
+    while_err_stream_ = err_stream;
+    ParseLine(owner, line, err_stream);
+  }
+
+  int ParseBuffer(GCodeParser *owner, const char *data, size_t len,
+                  FILE *err_stream);
   const char *gcodep_parse_pair_with_linenumber(int line_num,
                                                 const char *line,
                                                 char *letter,
                                                 float *value,
                                                 FILE *err_stream);
   int error_count() const { return error_count_; }
+  int line_count() const { return line_number_; }
 
 private:
   enum DebugLevel {
@@ -196,15 +213,56 @@ private:
     return 4;
   }
 
+  // Expressions are compiled into a small stack program that is evaluated
+  // afterwards. In while loops, the programs are kept around, so that
+  // each iteration only needs to evaluate them instead of parsing the
+  // same text again.
+  struct ExprInstruction {
+    enum Type {
+      PUSH_CONST,          // push "value"
+      LOAD_PARAM,          // push value of parameter in "slot"
+      LOAD_INDEXED_PARAM,  // replace top with value of parameter #top
+      UNARY,               // replace top with "op"(top)
+      ATAN2,               // pop right, top = atan[top]/[right]
+      BINARY               // pop right, top = top "op" right
+    };
+    Type type;
+    Operation op;
+    float value;
+    int slot;
+  };
+  typedef std::vector<ExprInstruction> ExprProgram;
+
+  // Compiled value with the position in the text right after it.
+  struct CompiledValue {
+    CompiledValue() : end(NULL) {}
+    ExprProgram program;
+    const char *end;
+  };
+  // Compiled values by their position in the (unchanging) source text.
+  typedef std::map<const char *, CompiledValue> ExpressionCache;
+
+  void emit(ExprProgram *program, ExprInstruction::Type type,
+            Operation op, float value) {
+    ExprInstruction instruction;
+    instruction.type = type;
+    instruction.op = op;
+    instruction.value = value;
+    instruction.slot = -1;
+    program->push_back(instruction);
+  }
+  bool eval_program(const ExprProgram &program, float *value);
+
   bool execute_unary(float *value, Operation op);
-  const char *gcodep_atan(const char *line, float *value);
+  const char *compile_atan(const char *line, ExprProgram *program);
   const char *gcodep_operation_unary(const char *line, Operation *op);
-  const char *gcodep_unary(const char *line, float *value);
+  const char *compile_unary(const char *line, ExprProgram *program);
 
   bool execute_binary(float *left, Operation op, float *right);
   const char *gcodep_operation(const char *line, Operation *op);
 
-  const char *gcodep_expression(const char *line, float *value);
+  const char *compile_expression(const char *line, ExprProgram *program);
+  const char *compile_value(const char *line, ExprProgram *program);
 
   const char *gcodep_value(const char *line, float *value);
 
@@ -235,6 +293,7 @@ private:
   const char *handle_G92(float sub_command, const char *line);
   const char *handle_move(const char *line, bool force_change);
   const char *handle_arc(const char *line, bool is_cw);
+  const char *handle_raster(const char *line);
   const char *handle_spline(float sub_command, const char *line);
   const char *handle_z_probe(const char *line);
   const char *handle_M111(const char *line);
@@ -246,19 +305,41 @@ private:
   const char *set_param(char param_letter, EventValueSetter setter,
                         float factor, const char *line);
 
-  const char *gcodep_parameter(const char *line, float *value);
+  const char *compile_parameter(const char *line, ExprProgram *program);
 
   // Read name of parameter (after #) which is either a number or a
   // non-alphanumeric character.
-  const char *read_param_name(const char *line, std::string *result);
+  // If "index_program" is given, a numeric parameter index that is not a
+  // constant is compiled into it instead of being evaluated right away;
+  // the "result" is empty then.
+  const char *read_param_name(const char *line, std::string *result,
+                              ExprProgram *index_program = NULL);
+
+  // Slot of the parameter in the parameter store; -1 if we have none.
+  int param_slot(StringPiece param_name) {
+    if (config.parameters == NULL)
+      return -1;
+    return config.parameters->Slot(TrimWhitespace(param_name));
+  }
+  // Slot of numbered parameter, typically the result of an expression.
+  int param_slot(int number) {
+    if (config.parameters == NULL)
+      return -1;
+    if (number >= 0 && number < Config::ParamMap::kNumberedParameters)
+      return number;
+    return param_slot(StringPrintf("%d", number));
+  }
+  float read_slot(int slot) {
+    // TODO: should we provide an error if a value is not assigned yet ?
+    return (slot < 0) ? 0.0f : config.parameters->at(slot);
+  }
 
   // Read parameter. Do range check.
   bool read_parameter(StringPiece param_name, float *result) {
-    if (config.parameters == NULL)
+    const int slot = param_slot(param_name);
+    if (slot < 0)
       return false;
-    param_name = TrimWhitespace(param_name);
-    // TODO: should we provide an error if a value is not assigned yet ?
-    *result = (*config.parameters)[ToLower(param_name)];
+    *result = read_slot(slot);
     return true;
   }
 
@@ -273,7 +354,7 @@ private:
               param_name.ToString().c_str());
       return false;
     }
-    (*config.parameters)[ToLower(param_name)] = value;
+    config.parameters->at(param_slot(param_name)) = value;
     return true;
   }
 
@@ -350,6 +431,30 @@ private:
   std::string while_condition_;
   std::string while_loop_;
 
+  ExpressionCache *expression_cache_;  // Non-NULL while executing loops.
+  std::vector<float> eval_stack_;
+
+  // Programs that are only needed while parsing the current line come from
+  // this pool and keep their capacity, so once warmed up, evaluating
+  // expressions does not allocate. Compiling nests, so it is a stack; a
+  // deque as references must stay valid while it grows.
+  std::deque<ExprProgram> scratch_programs_;
+  size_t scratch_in_use_;
+  class ScratchProgram {
+  public:
+    explicit ScratchProgram(Impl *impl) : impl_(impl) {
+      if (impl_->scratch_in_use_ == impl_->scratch_programs_.size())
+        impl_->scratch_programs_.push_back(ExprProgram());
+      program_ = &impl_->scratch_programs_[impl_->scratch_in_use_++];
+      program_->clear();
+    }
+    ~ScratchProgram() { --impl_->scratch_in_use_; }
+    ExprProgram *get() { return program_; }
+  private:
+    Impl *const impl_;
+    ExprProgram *program_;
+  };
+
   unsigned int debug_level_;  // OR-ed bits from DebugLevel enum
   bool allow_m111_;
 
@@ -378,8 +483,8 @@ GCodeParser::Impl::Impl(const GCodeParser::Config &parse_config,
     home_position_(config.machine_origin),
     current_origin_(&home_position_), current_global_offset_(&kZeroOffset),
     arc_normal_(AXIS_Z),
-    while_err_stream_(NULL), do_while_(false),
-    debug_level_(DEBUG_NONE), allow_m111_(allow_m111), error_count_(0)
+    while_err_stream_(NULL), do_while_(false), expression_cache_(NULL),
+    scratch_in_use_(0), debug_level_(DEBUG_NONE), allow_m111_(allow_m111), error_count_(0)
 {
   assert(callbacks);  // otherwise, this is not very useful.
   reset_G92();
@@ -464,11 +569,9 @@ static const char *skip_white(const char *line) {
   return line;
 }
 
-// Parse number from "line" and store in "value". Returns the position in the
-// string after the value had been parsed; if there was an error parsing,
-// returns the beginning of the line.
-static const char *ParseGcodeNumber(const char *line, float *value) {
-  line = skip_white(line);
+// Slow path of ParseGcodeNumber() using strtof(). Only needed for numbers
+// with too many digits to be represented exactly in the fast path.
+static const char *ParseGcodeNumberStrtof(const char *line, float *value) {
   // We need to copy the number into a temporary buffer as strtof() does
   // not accept an end-limiter.
   char buffer[40];
@@ -494,12 +597,59 @@ static const char *ParseGcodeNumber(const char *line, float *value) {
   return (parsed_end == dst) ? src : line;
 }
 
+// Parse number from "line" and store in "value". Returns the position in the
+// string after the value had been parsed; if there was an error parsing,
+// returns the beginning of the line.
+//
+// Numbers in GCode are always in the simple [+-]ddd.ddd format, so we can
+// parse them directly without copying and without the locale overhead
+// of strtof(). As long as the mantissa fits in a double exactly, dividing
+// by an exact power of ten gives a correctly rounded result.
+static const char *ParseGcodeNumber(const char *line, float *value) {
+  static const double kPowerOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+  };
+  const int kMaxDigits = 15;  // Well within the 53 bit mantissa of double.
+
+  line = skip_white(line);
+  const char *src = line;
+  const bool negative = (*src == '-');
+  if (*src == '+' || *src == '-')
+    ++src;
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int fraction_digits = 0;
+  while (isdigit(*src)) {
+    mantissa = 10 * mantissa + (*src++ - '0');
+    ++digits;
+  }
+  if (*src == '.') {
+    ++src;
+    while (isdigit(*src)) {
+      mantissa = 10 * mantissa + (*src++ - '0');
+      ++digits;
+      ++fraction_digits;
+    }
+  }
+  if (digits == 0)
+    return line;   // Nothing to see here, possibly just a sign or dot.
+  if (digits > kMaxDigits)
+    return ParseGcodeNumberStrtof(line, value);
+
+  const double result = mantissa / kPowerOfTen[fraction_digits];
+  *value = negative ? -result : result;
+  return src;
+}
+
 // Parameter/variable names can be simple integers (traditional NIST), or
 // a named one.
 // Returns the remainder of the line or NULL if parameter name could not
 // be parsed.
 const char* GCodeParser::Impl::read_param_name(const char *line,
-                                               std::string *result) {
+                                               std::string *result,
+                                               ExprProgram *index_program) {
   line = skip_white(line);
   if (*line == '\0') {
     gprintf(GLOG_SYNTAX_ERR, "expected value after '#'\n");
@@ -518,7 +668,22 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
   }
 
   // if (!numeric_parameter && strict_nist) warn("using extension");
-  if (numeric_parameter) {
+  if (numeric_parameter && index_program != NULL) {
+    const char *endptr = compile_value(line, index_program);
+    if (endptr == NULL) {
+      gprintf(GLOG_SYNTAX_ERR,
+              "'#' is not followed by a number but '%s'\n", line);
+      return NULL;
+    }
+    line = endptr;
+    if (index_program->size() != 1 ||
+        (*index_program)[0].type != ExprInstruction::PUSH_CONST) {
+      result->clear();
+      return skip_white(line);  // Only known once evaluated.
+    }
+    *result = StringPrintf("%d", (int) (*index_program)[0].value);
+    index_program->clear();
+  } else if (numeric_parameter) {
     float index;
     const char *endptr = gcodep_value(line, &index);
     if (endptr == NULL) {
@@ -556,12 +721,22 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
   return result->empty() ? NULL : skip_white(line);
 }
 
-const char *GCodeParser::Impl::gcodep_parameter(const char *line, float *value) {
+const char *GCodeParser::Impl::compile_parameter(const char *line,
+                                                 ExprProgram *program) {
   std::string param_name;
-  line = read_param_name(line, &param_name);
+  ScratchProgram scratch(this);
+  ExprProgram &index_program = *scratch.get();
+  line = read_param_name(line, &param_name, &index_program);
   if (line == NULL) return NULL;
 
-  read_parameter(param_name, value);
+  if (index_program.empty()) {
+    emit(program, ExprInstruction::LOAD_PARAM, NO_OPERATION, 0);
+    program->back().slot = param_slot(param_name);
+  } else {
+    program->insert(program->end(),
+                    index_program.begin(), index_program.end());
+    emit(program, ExprInstruction::LOAD_INDEXED_PARAM, NO_OPERATION, 0);
+  }
 
   return line;  // We parsed something; return whatever is remaining.
 }
@@ -631,7 +806,8 @@ bool GCodeParser::Impl::execute_unary(float *value, Operation op) {
   return true;
 }
 
-const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value) {
+const char *GCodeParser::Impl::compile_atan(const char *line,
+                                            ExprProgram *program) {
   if (*line != '/') {
     gprintf(GLOG_SYNTAX_ERR, "expected '/' after ATAN got '%s'\n", line);
     return NULL;
@@ -644,19 +820,15 @@ const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value) {
   }
   line++;
 
-  float value2;
   const char *endptr;
-  endptr = gcodep_expression(line, &value2);
+  endptr = compile_expression(line, program);
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
     return NULL;
   }
   line = endptr;
 
-  float val = (atan2f(*value, value2) * 180.0f) / M_PI;
-  gprintf(GLOG_EXPRESSION, "%s[%f]/[%f] -> %f\n",
-          op_parse_.AsString(ATAN), *value, value2, val);
-  *value = val;
+  emit(program, ExprInstruction::ATAN2, ATAN, 0);
   return line;
 }
 
@@ -671,15 +843,17 @@ const char *GCodeParser::Impl::gcodep_operation_unary(const char *line,
   }
 }
 
-const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
+const char *GCodeParser::Impl::compile_unary(const char *line,
+                                             ExprProgram *program) {
   Operation op;
   const char *endptr;
 
-  line = gcodep_operation_unary(line, &op);
-  if (line == NULL) {
+  endptr = gcodep_operation_unary(line, &op);
+  if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR, "unknown unary got '%s'\n", line);
     return NULL;
   }
+  line = endptr;
 
   if (*line != '[') {
     gprintf(GLOG_SYNTAX_ERR, "expected '[' got '%s'\n", line);
@@ -687,7 +861,7 @@ const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
   }
   line = skip_white(line + 1);
 
-  endptr = gcodep_expression(line, value);
+  endptr = compile_expression(line, program);
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
     return NULL;
@@ -695,17 +869,14 @@ const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
   line = skip_white(endptr);
 
   if (op == ATAN) {
-    endptr = gcodep_atan(line, value);
+    endptr = compile_atan(line, program);
     if (endptr == NULL) {
       gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
       return NULL;
     }
     line = skip_white(endptr);
   } else {
-    if (!execute_unary(value, op)) {
-      gprintf(GLOG_SYNTAX_ERR, "unary operation failed\n");
-      return NULL;
-    }
+    emit(program, ExprInstruction::UNARY, op, 0);
   }
 
   return line;
@@ -795,15 +966,18 @@ const char *GCodeParser::Impl::gcodep_operation(const char *line,
 // the expression stack needs to be at least one greater than the max precedence
 #define MAX_STACK   6
 
-const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value) {
-  float vals[MAX_STACK];
+const char *GCodeParser::Impl::compile_expression(const char *line,
+                                                  ExprProgram *program) {
+  // Values are pushed on the evaluation stack in the order they appear;
+  // operations are emitted once all operands with higher precedence are
+  // on the stack.
   Operation ops[MAX_STACK];
   int stack = 0;
   const char *endptr;
   line = skip_white(line);
 
   for (ops[0] = NO_OPERATION; ops[0] != RIGHT_BRACKET; ) {
-    endptr = gcodep_value(line, &vals[stack]);
+    endptr = compile_value(line, program);
     if (endptr == NULL) {
       if (*line == '-') {
         line = skip_white(line+1);
@@ -812,7 +986,7 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
           return NULL;
         }
         // make [-expression] work like [-1 * expression]
-        vals[stack] = -1.0f;
+        emit(program, ExprInstruction::PUSH_CONST, NO_OPERATION, -1.0f);
         ops[stack] = TIMES;
         stack++;
         continue;
@@ -845,8 +1019,7 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
       }
     } else {  // precedence of latest operator is <= previous precedence
       for ( ; precedence(ops[stack]) <= precedence(ops[stack - 1]); ) {
-        if (!execute_binary(&vals[stack - 1], ops[stack - 1], &vals[stack]))
-          return NULL;
+        emit(program, ExprInstruction::BINARY, ops[stack - 1], 0);
 
         ops[stack - 1] = ops[stack];
         if (stack > 1 && precedence(ops[stack - 1]) <= precedence(ops[stack - 2]))
@@ -856,15 +1029,14 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
       }
     }
   }
-  *value = vals[0];
-
   return line;
 }
 
-// Parse a value out of the line.
+// Compile a value out of the line.
 // The value may be a number, a parameter value, a unary function, or an
 // expression.
-const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
+const char *GCodeParser::Impl::compile_value(const char *line,
+                                             ExprProgram *program) {
   char c = toupper(*line);
   if (isalpha(c)) c = 'U';  // indicates a unary in the switch below
 
@@ -874,18 +1046,22 @@ const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
     endptr = NULL;
     break;
   case '[':
-    endptr = gcodep_expression(line + 1, value);
+    endptr = compile_expression(line + 1, program);
     break;
   case '#':
-    endptr = gcodep_parameter(line + 1, value);
+    endptr = compile_parameter(line + 1, program);
     break;
   case 'U':
-    endptr = gcodep_unary(line, value);
+    endptr = compile_unary(line, program);
     break;
-  default:
-    endptr = ParseGcodeNumber(line, value);
+  default: {
+    float value;
+    endptr = ParseGcodeNumber(line, &value);
+    if (endptr != line)
+      emit(program, ExprInstruction::PUSH_CONST, NO_OPERATION, value);
     break;
   }
+  }
   if (line == endptr || endptr == NULL)
     return NULL;
 
@@ -893,6 +1069,89 @@ const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
   return line;
 }
 
+bool GCodeParser::Impl::eval_program(const ExprProgram &program,
+                                     float *value) {
+  std::vector<float> &stack = eval_stack_;
+  stack.clear();
+  for (const ExprInstruction &instruction : program) {
+    switch (instruction.type) {
+    case ExprInstruction::PUSH_CONST:
+      stack.push_back(instruction.value);
+      break;
+    case ExprInstruction::LOAD_PARAM:
+      stack.push_back(read_slot(instruction.slot));
+      break;
+    case ExprInstruction::LOAD_INDEXED_PARAM:
+      stack.back() = read_slot(param_slot((int) stack.back()));
+      break;
+    case ExprInstruction::UNARY:
+      if (!execute_unary(&stack.back(), instruction.op)) {
+        gprintf(GLOG_SYNTAX_ERR, "unary operation failed\n");
+        return false;
+      }
+      break;
+    case ExprInstruction::ATAN2: {
+      const float right = stack.back();
+      stack.pop_back();
+      const float val = (atan2f(stack.back(), right) * 180.0f) / M_PI;
+      gprintf(GLOG_EXPRESSION, "%s[%f]/[%f] -> %f\n",
+              op_parse_.AsString(ATAN), stack.back(), right, val);
+      stack.back() = val;
+      break;
+    }
+    case ExprInstruction::BINARY: {
+      float right = stack.back();
+      stack.pop_back();
+      if (!execute_binary(&stack.back(), instruction.op, &right))
+        return false;
+      break;
+    }
+    }
+  }
+  assert(stack.size() == 1);
+  *value = stack.back();
+  return true;
+}
+
+// Parse a value out of the line.
+// The value may be a number, a parameter value, a unary function, or an
+// expression.
+const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
+  const char c = *line;
+  if (c != '[' && c != '#' && !isalpha(c)) {
+    // Plain numbers are by far the most common; no need to compile.
+    const char *endptr = ParseGcodeNumber(line, value);
+    if (line == endptr)
+      return NULL;
+    return skip_white(endptr);
+  }
+
+  const ExprProgram *program;
+  const char *endptr;
+  ScratchProgram local_program(this);
+  if (expression_cache_ != NULL) {
+    CompiledValue &compiled = (*expression_cache_)[line];
+    if (compiled.end == NULL) {
+      compiled.end = compile_value(line, &compiled.program);
+      if (compiled.end == NULL) {
+        expression_cache_->erase(line);
+        return NULL;
+      }
+    }
+    program = &compiled.program;
+    endptr = compiled.end;
+  } else {
+    endptr = compile_value(line, local_program.get());
+    if (endptr == NULL)
+      return NULL;
+    program = local_program.get();
+  }
+
+  if (!eval_program(*program, value))
+    return NULL;
+  return endptr;
+}
+
 const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
   std::string param_name;
   line = read_param_name(line, &param_name);
@@ -1015,8 +1274,8 @@ void GCodeParser::Impl::gcodep_conditional(const char *line) {
 
   float value = 0.0f;
   const char *endptr;
-  endptr = gcodep_expression(line + 1, &value);
-  if (line == endptr || endptr == NULL)
+  endptr = gcodep_value(line, &value);
+  if (endptr == NULL)
     return;
 
   const bool condition = (value == 1.0f) ? true : false;
@@ -1075,33 +1334,50 @@ void GCodeParser::Impl::gcodep_conditional(const char *line) {
 }
 
 void GCodeParser::Impl::gcodep_while_end() {
-    int loops = 0;
-    while (1) {
-      const char *line = while_condition_.c_str();
-      const char *endptr;
-      float value;
-      // the '[' was already parsed
-      endptr = gcodep_expression(line, &value);
-      if (endptr == NULL) {
-        gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
-        return;
-      }
-      if (value == 0.0f)
-        break;
+  // Compile the condition once and split the body into lines once. While
+  // executing the body, the compiled expressions are kept in the cache, so
+  // only the first iteration has to parse them.
+  const std::string condition_text = while_condition_;
+  const char *line = condition_text.c_str();
+  ExprProgram condition;
+  // the '[' was already parsed
+  const char *endptr = compile_expression(line, &condition);
+  if (endptr == NULL) {
+    gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
+    return;
+  }
+  line = skip_white(endptr);
+  const bool have_do = control_parse_.ExpectNext(&line, CK_DO);
 
-      line = skip_white(endptr);
-      if (control_parse_.ExpectNext(&line, CK_DO)) {
-        std::vector<StringPiece> piece = SplitString(while_loop_, "\n");
-        for (size_t i=0; i < piece.size(); i++)
-          ParseLine(while_owner_, piece[i].ToString().c_str(),
-                    while_err_stream_);
-      } else {
-        gprintf(GLOG_SYNTAX_ERR, "expected DO got '%s'\n", line);
-        return;
-      }
-      loops++;
+  std::vector<std::string> body;
+  for (StringPiece piece : SplitString(while_loop_, "\n")) {
+    if (!piece.empty()) body.push_back(piece.ToString());
+  }
+
+  ExpressionCache cache;
+  ExpressionCache *const outer_cache = expression_cache_;
+  int loops = 0;
+  while (1) {
+    float value;
+    if (!eval_program(condition, &value)) {
+      gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n",
+              condition_text.c_str());
+      return;
+    }
+    if (value == 0.0f)
+      break;
+
+    if (!have_do) {
+      gprintf(GLOG_SYNTAX_ERR, "expected DO got '%s'\n", line);
+      return;
     }
-    gprintf(GLOG_INFO, "Executed %d loops\n", loops);
+    expression_cache_ = &cache;
+    for (const std::string &body_line : body)
+      ParseLine(while_owner_, body_line.c_str(), while_err_stream_);
+    expression_cache_ = outer_cache;
+    loops++;
+  }
+  gprintf(GLOG_INFO, "Executed %d loops\n", loops);
 }
 
 void GCodeParser::Impl::gcodep_while_do(const char *line) {
@@ -1438,6 +1714,73 @@ const char *GCodeParser::Impl::handle_move(const char *line, bool force_change)
   return line;
 }
 
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// G7 raster line. X, Y, Z, ...: end position (optional); F: feedrate;
+// P: pixel pitch along X, used if no end position is given (negative to
+// go towards -X); D: pixel power values, two hex digits each (00..FF).
+// This needs to be the last parameter, it consumes the rest of the line.
+const char *GCodeParser::Impl::handle_raster(const char *line) {
+  AxesRegister new_pos = axes_pos_;
+  bool have_position = false;
+  float feedrate = -1;
+  float pitch = 0;
+  std::vector<uint8_t> pixels;
+  char letter;
+  float value;
+  const char *remaining_line;
+  for (;;) {
+    line = skip_white(line);
+    if (*line == 'D' || *line == 'd') {
+      const char *hex = skip_white(line + 1);
+      int hi, lo;
+      while ((hi = hex_digit(hex[0])) >= 0 && (lo = hex_digit(hex[1])) >= 0) {
+        pixels.push_back(hi << 4 | lo);
+        hex += 2;
+      }
+      line = skip_white(hex);
+      break;
+    }
+    if ((remaining_line = gparse_pair(line, &letter, &value)) == NULL)
+      break;
+    const float unit_value = value * unit_to_mm_factor_;
+    if (letter == 'F') {
+      feedrate = f_param_to_feedrate(unit_value);
+    } else if (letter == 'P') {
+      pitch = unit_value;
+    } else {
+      const enum GCodeParserAxis axis = gcodep_letter2axis(letter);
+      if (axis == GCODE_NUM_AXES)
+        break;  // Invalid axis: possibly start of new command.
+      new_pos[axis] = abs_axis_pos(axis, unit_value);
+      have_position = true;
+    }
+    line = remaining_line;
+  }
+
+  if (pixels.empty()) {
+    gprintf(GLOG_SYNTAX_ERR, "G7: missing D pixel data\n");
+    return line;
+  }
+  if (!have_position) {
+    if (pitch == 0) {
+      gprintf(GLOG_SYNTAX_ERR, "G7: need end position or P pixel pitch\n");
+      return line;
+    }
+    new_pos[AXIS_X] += pitch * pixels.size();
+  }
+  if (callbacks->raster_move(feedrate, axes_pos_, new_pos,
+                             pixels.data(), pixels.size())) {
+    axes_pos_ = new_pos;
+  }
+  return line;
+}
+
 // The algorithm used here is based on finding the midpoint M of the line
 // L between the current point and the end point of the arc. The center
 // of the arc lies on a line through M perpendicular to L.
@@ -1798,6 +2141,7 @@ void GCodeParser::Impl::ParseLine(GCodeParser *owner,
   }
 
   ++line_number_;
+  TraceScope trace(TRACE_PARSE_LINE, line_number_);
   err_msg_ = err_stream;  // remember as 'instance' variable.
   char letter;
   float value;
@@ -1822,6 +2166,7 @@ void GCodeParser::Impl::ParseLine(GCodeParser *owner,
         have_first_spline_ = last_spline;
         line = handle_spline(value, line);
         break;
+      case  7: line = handle_raster(line); break;
       case 10: line = handle_G10(line); break;
       case 17: arc_normal_ = AXIS_Z; break;
       case 18: arc_normal_ = AXIS_Y; break;
@@ -1974,6 +2319,7 @@ int GCodeParser::Impl::ParseStream(GCodeParser *owner,
     wait_time.tv_usec = 50 * 1000;
     select_ret = select(input_fd + 1, &read_fds, NULL, NULL, &wait_time);
     if (select_ret < 0)  { // Broken stream.
+      if (errno == EINTR) continue;  // Signal we don't stop for.
       Log_error("select(): %s", strerror(errno));
       break;
     }
@@ -2008,6 +2354,50 @@ int GCodeParser::Impl::ParseStream(GCodeParser *owner,
   return 0;
 }
 
+int GCodeParser::Impl::ParseBuffer(GCodeParser *owner,
+                                   const char *data, size_t len,
+                                   FILE *err_stream) {
+  if (err_stream) {
+    // Output needs to be unbuffered, otherwise they'll never make it.
+    setvbuf(err_stream, NULL, _IONBF, 0);
+  }
+
+  while_owner_ = owner;
+  while_err_stream_ = err_stream;
+
+  arm_signal_handler();
+  // The line parsing needs a nul-terminated string, so we copy each line
+  // into this buffer. Lines longer than that are split, same as with
+  // ParseStream().
+  char buffer[8192];
+  const char *const end = data + len;
+  while (data < end && !caught_signal) {
+    const size_t remaining = end - data;
+    const size_t max_len = (remaining < sizeof(buffer) - 1
+                            ? remaining : sizeof(buffer) - 1);
+    const char *eol = (const char*) memchr(data, '\n', max_len);
+    const size_t line_len = eol ? eol - data + 1 : max_len;
+    memcpy(buffer, data, line_len);
+    buffer[line_len] = '\0';
+    data += line_len;
+
+    ParseLine(owner, buffer, err_stream);
+  }
+  disarm_signal_handler();
+
+  if (caught_signal)
+    return 2;
+
+  if (err_stream) {
+    fflush(err_stream);
+  }
+
+  // always call gcode_finished() to disable motors at end of stream
+  callbacks->gcode_finished(true);
+
+  return 0;
+}
+
 GCodeParser::GCodeParser(const Config &config, EventReceiver *parse_events,
                          bool allow_m111)
   : impl_(new Impl(config, parse_events, allow_m111)) {
@@ -2016,12 +2406,16 @@ GCodeParser::~GCodeParser() {
   delete impl_;
 }
 void GCodeParser::ParseLine(const char *line, FILE *err_stream) {
-  impl_->ParseLine(this, line, err_stream);
+  impl_->ParseSingleLine(this, line, err_stream);
 }
 int GCodeParser::ParseStream(int input_fd, FILE *err_stream) {
   return impl_->ParseStream(this, input_fd, err_stream);
 }
+int GCodeParser::ParseBuffer(const char *data, size_t len, FILE *err_stream) {
+  return impl_->ParseBuffer(this, data, len, err_stream);
+}
 int GCodeParser::error_count() const { return impl_->error_count(); }
+int GCodeParser::line_count() const { return impl_->line_count(); }
 
 const char *GCodeParser::ParsePair(const char *line,
                                    char *letter, float *value,
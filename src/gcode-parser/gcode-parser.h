@@ -32,8 +32,10 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "common/container.h"
+#include "common/string-util.h"
 
 // Axis supported by this parser.
 enum GCodeParserAxis {
@@ -74,6 +76,7 @@ public:
   // Also see ../G-code.md
   class EventReceiver {
   public:
+    EventReceiver() : arc_tolerance_mm_(0.001f), arc_min_segment_mm_(0.05f) {}
     virtual ~EventReceiver() {}
     // Start program. Use for initialization. Informs about gcode parser so that
     // it is possible to call ParsePair().
@@ -147,7 +150,7 @@ public:
     // interpolated from their current position (e.g. creating a spiral).
     //
     // The default implementation linearlizes it and calls coordinated_move()
-    // with small line segments.
+    // with small line segments, see set_arc_tolerance().
     //
     // TODO(hzeller): We could probably generalize this by having a
     //  'normal vector' instead of normal_axis + clockwise. This would allow for
@@ -162,12 +165,24 @@ public:
     // Move in a cubic spine from absolute "start" to "end" given the absolute
     // control points "cp1" and "cp2".
     // The default implementation linearlizes curve and calls coordinated_move()
-    // with the segments.
+    // with segments that are within the tolerance of set_arc_tolerance().
     virtual void spline_move(float feed_mm_p_sec,
                              const AxesRegister &start,
                              const AxesRegister &cp1, const AxesRegister &cp2,
                              const AxesRegister &end);
 
+    // G7 (BeagleG specific)
+    // Raster line for engraving: a coordinated move from "start" to "end"
+    // with the tool power following the "count" pixels 0..255, evenly
+    // spaced along the way. Returns true if the move was successful.
+    // The default implementation ignores the pixels and just moves.
+    virtual bool raster_move(float feed_mm_p_sec,
+                             const AxesRegister &start,
+                             const AxesRegister &end,
+                             const uint8_t *pixels, int count) {
+      return coordinated_move(feed_mm_p_sec, end);
+    }
+
     // Hand out G-code command that could not be interpreted.
     // Parameters: letter + value of the command that was not understood,
     // string of rest of line (the letter is always upper-case).
@@ -178,11 +193,57 @@ public:
     // to read G-code words from the remaining line.
     virtual const char *unprocessed(char letter, float value,
                                     const char *rest_of_line) = 0;
+
+    // Accuracy of the line segments the default arc_move() creates: they
+    // deviate at most "tolerance_mm" from the exact arc, so large radii
+    // need much fewer segments than small ones. Segments are not shorter
+    // than "min_segment_mm" though. Default: 0.001mm, 0.05mm.
+    // Same for the default spline_move().
+    void set_arc_tolerance(float tolerance_mm, float min_segment_mm) {
+      arc_tolerance_mm_ = tolerance_mm;
+      arc_min_segment_mm_ = min_segment_mm;
+    }
+    float arc_tolerance() const { return arc_tolerance_mm_; }
+    float arc_min_segment() const { return arc_min_segment_mm_; }
+
+  private:
+    float arc_tolerance_mm_;
+    float arc_min_segment_mm_;
   };
 
   // Configuration for the parser.
   struct Config {
-    typedef std::map<std::string, float> ParamMap;
+    // Store for the parameter values. Numbered parameters are kept in a
+    // flat array, indexed by their number. Named parameters (and numbers
+    // beyond the range) are interned: they get a slot assigned on first use.
+    // So once the slot of a parameter is known, access is just an index.
+    class ParamMap {
+    public:
+      static const int kNumberedParameters = 5400;
+
+      ParamMap();
+
+      // Return slot for the parameter with the given name. Names are case
+      // insensitive. A new slot, initialized to zero, is created if needed.
+      // Looking up an existing slot does not allocate.
+      int Slot(StringPiece name);
+
+      float &at(int slot) { return values_[slot]; }
+      float at(int slot) const { return values_[slot]; }
+
+      float &operator[](const std::string &name) { return at(Slot(name)); }
+
+      // Named parameters (lower case) and their slot.
+      const std::map<std::string, int> &named_slots() const {
+        return named_slots_;
+      }
+
+    private:
+      std::vector<float> values_;
+      std::map<std::string, int> named_slots_;
+      std::string lookup_name_;  // Lower-cased name; reused for lookups.
+    };
+
     Config() : parameters(NULL) {}
 
     bool LoadParams(const std::string &filename);
@@ -215,6 +276,13 @@ public:
   // The input file descriptor is closed.
   int ParseStream(int input_fd, FILE *err_stream);
 
+  // Parse GCode in memory block "data" of "len" bytes, e.g. a memory mapped
+  // file. Unlike ParseStream(), does not wait for input, so this is for
+  // complete files, not interactive streams.
+  // Error messages are sent to "err_stream" if non-NULL.
+  // Returns 0 at the end of the data or 2 if a signal occured.
+  int ParseBuffer(const char *data, size_t len, FILE *err_stream);
+
   // Utility function: Parses next pair in the line of G-code (e.g. 'P123' is
   // a pair of the letter 'P' and the value '123').
   // Takes care of skipping whitespace, comments etc.
@@ -238,6 +306,10 @@ public:
   // Number of errors seen.
   int error_count() const;
 
+  // Number of lines parsed so far; lines in while loops count every time
+  // they are executed.
+  int line_count() const;
+
 private:
   class Impl;
   Impl *impl_;
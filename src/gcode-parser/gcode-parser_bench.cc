@@ -0,0 +1,142 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmark for the gcode parser: parse a typical mix of GCode lines.
+//
+// Usage: ./gcode-parser_bench [repetitions]
+
+#include "gcode-parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include "common/logging.h"
+
+namespace {
+// Receiver that doesn't do anything but counting moves, so that we only
+// measure the parser itself.
+class NullReceiver : public GCodeParser::EventReceiver {
+public:
+  NullReceiver() : moves(0) {}
+  virtual void gcode_start(GCodeParser *) {}
+  virtual void go_home(AxisBitmap_t) {}
+  virtual void set_speed_factor(float) {}
+  virtual void set_fanspeed(float) {}
+  virtual void set_temperature(float) {}
+  virtual void wait_temperature() {}
+  virtual void dwell(float) {}
+  virtual void motors_enable(bool) {}
+  virtual bool coordinated_move(float, const AxesRegister &) {
+    ++moves;
+    return true;
+  }
+  virtual bool rapid_move(float, const AxesRegister &) {
+    ++moves;
+    return true;
+  }
+  virtual const char *unprocessed(char, float, const char *) { return NULL; }
+
+  long moves;
+};
+}  // namespace
+
+// Same kind of lines we have in gcode-parser_test.cc, with emphasis on
+// the moves that are the bulk of real-world files.
+static const char *const kCorpus[] = {
+  "G1 X100 Y-12.5 Z0.3 F3000\n",
+  "G1 X10.125 Y10.25 E0.03125\n",
+  "G1Y0010Z0011X0012\n",
+  "G0 X-1.5 Y2.75 ; rapid\n",
+  "G1 X10 (This is some comment) Y11 Z12 ; end of line\n",
+  "G1 X12.3456 Y78.9012 Z3.4567 E12.34567\n",
+  "G90\n",
+  "G91 G1 X1 Y-1\n",
+  "G90\n",
+  "#1=42.5\n",
+  "G1 X#1 Y[#1 * 2]\n",
+  "M106 S255\n",
+  "G1 X0 Y0 Z0 F600\n",
+};
+
+// Parametrized program, similar to testdata/polygon-24-vs-arc.gcode; the
+// loop count is filled in.
+static const char kLoopProgram[] =
+  "#faces=36 #poly_r=40 #angle=[360 / #faces]\n"
+  "#i=0\n"
+  "WHILE [#i < %d] DO\n"
+  "  G1 X[#poly_r * cos[#i * #angle]] Y[#poly_r * sin[#i * #angle]]\n"
+  "  IF [#i MOD 2 == 0] THEN #even=[#even + 1]\n"
+  "  #i++\n"
+  "END\n";
+
+static double Seconds(const struct timespec &start,
+                      const struct timespec &end) {
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  const int repetitions = (argc > 1) ? atoi(argv[1]) : 100000;
+  Log_init("/dev/null");
+
+  std::string data;
+  int line_count = 0;
+  for (int i = 0; i < repetitions; ++i) {
+    for (const char *line : kCorpus) {
+      data.append(line);
+      ++line_count;
+    }
+  }
+
+  struct timespec start, end;
+  {
+    NullReceiver receiver;
+    GCodeParser parser(GCodeParser::Config(), &receiver, false);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    parser.ParseBuffer(data.data(), data.size(), NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double duration = Seconds(start, end);
+    printf("%d lines (%ld moves, %.1f MiB) in %.3fs: %.0f lines/s, "
+           "%.1f MiB/s\n", line_count, receiver.moves,
+           data.size() / (1024.0 * 1024), duration, line_count / duration,
+           data.size() / (1024.0 * 1024) / duration);
+  }
+
+  {
+    const int loops = repetitions;
+    char program[sizeof(kLoopProgram) + 16];
+    snprintf(program, sizeof(program), kLoopProgram, loops);
+    GCodeParser::Config::ParamMap parameters;
+    GCodeParser::Config config;
+    config.parameters = &parameters;
+    NullReceiver receiver;
+    GCodeParser parser(config, &receiver, false);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    parser.ParseBuffer(program, strlen(program), NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double duration = Seconds(start, end);
+    printf("%d while-loop iterations (%ld moves) in %.3fs: "
+           "%.0f iterations/s\n", loops, receiver.moves, duration,
+           loops / duration);
+  }
+  return 0;
+}
@@ -4,9 +4,13 @@
 #include "gcode-parser.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <math.h>
+#include <unistd.h>
+
+#include <string>
 
 #include <gtest/gtest.h>
 
@@ -62,6 +66,12 @@ public:
     return parser_->error_count() == errors_before;
   }
 
+  int TestParseBuffer(const char *data, size_t len) {
+    return parser_->ParseBuffer(data, len, stderr);
+  }
+
+  int line_count() const { return parser_->line_count(); }
+
   virtual void gcode_start(GCodeParser *)     { Count(CALL_gcode_start); }
   virtual void gcode_finished(bool)  { Count(CALL_gcode_finished); }
   virtual void inform_origin_offset(const AxesRegister &offset) {
@@ -152,6 +162,17 @@ TEST(GCodeParserTest, simple_move) {
   EXPECT_EQ(HOME_Z - 20,  counter.abs_pos[AXIS_Z]);
 }
 
+TEST(GCodeParserTest, parse_buffer) {
+  ParseTester counter;
+  // Mixed line endings and no newline at the end of the data. Only use
+  // a prefix of the string to make sure we don't look beyond.
+  const char data[] = "G1 X10\nG1 X20\r\n\nG1 X30G1 X40";
+  EXPECT_EQ(0, counter.TestParseBuffer(data, strlen(data) - 5));
+  EXPECT_EQ(3, counter.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(HOME_X + 30, counter.abs_pos[AXIS_X]);
+  EXPECT_EQ(1, counter.call_count[CALL_gcode_finished]);
+}
+
 TEST(GCodeParserTest, setting_feedrate) {
   ParseTester counter;
 
@@ -172,6 +193,26 @@ TEST(GCodeParserTest, ParsingCompactNumbers) {
   EXPECT_EQ(HOME_Z + 11, counter.abs_pos[AXIS_Z]);
 }
 
+TEST(GCodeParserTest, ParsingNumbersSameAsStrtof) {
+  const char *const numbers[] = {
+    "0", "-0", "+1", "1.", ".5", "-.5", "0.1", "-0.3", "123.456", "0010.0100",
+    "3.14159265", "-2.718281828", "16777217", "0.000001", "99999.99999",
+    "1234567890123456789.5",   // Too long for the fast path.
+  };
+  for (const char *number : numbers) {
+    ParseTester counter;
+    const std::string line = std::string("G1 X") + number;
+    EXPECT_TRUE(counter.TestParseLine(line.c_str())) << number;
+    EXPECT_FLOAT_EQ(HOME_X + strtof(number, NULL), counter.abs_pos[AXIS_X])
+      << number;
+  }
+
+  // Just a sign or a dot is not a number.
+  ParseTester counter;
+  EXPECT_FALSE(counter.TestParseLine("G1 X-"));
+  EXPECT_FALSE(counter.TestParseLine("G1 X."));
+}
+
 TEST(GCodeParserTest, ParsingComments) {
   ParseTester counter;
 
@@ -465,6 +506,43 @@ TEST(GCodeParserTest, alphanumeric_parameters) {
   EXPECT_FALSE(counter.TestParseLine("#<3>=42"));
 }
 
+TEST(GCodeParserTest, parameter_slots) {
+  GCodeParser::Config::ParamMap params;
+  EXPECT_EQ(42, params.Slot("42"));     // Numbered: slot is the number.
+  const int foo = params.Slot("foo");
+  EXPECT_GE(foo, GCodeParser::Config::ParamMap::kNumberedParameters);
+  EXPECT_EQ(foo, params.Slot("FOO"));
+  EXPECT_NE(foo, params.Slot("6000"));  // Beyond range: interned as well.
+  params["Foo"] = 3;
+  EXPECT_EQ(3, params.at(foo));
+}
+
+TEST(GCodeParserTest, save_and_load_parameters) {
+  char filename[] = "/tmp/gcode-parser-params-XXXXXX";
+  close(mkstemp(filename));
+
+  GCodeParser::Config::ParamMap params;
+  GCodeParser::Config config;
+  config.parameters = &params;
+  params["5221"] = 12.5;
+  params["_global"] = 42;
+  params["local"] = 7;      // Not global: not written.
+  params["6000"] = 1;
+  ASSERT_TRUE(config.SaveParams(filename));
+
+  GCodeParser::Config::ParamMap loaded;
+  config.parameters = &loaded;
+  ASSERT_TRUE(config.LoadParams(filename));
+  EXPECT_EQ(12.5, loaded["5221"]);
+  EXPECT_EQ(1, loaded["5220"]);   // default.
+  EXPECT_EQ(42, loaded["_global"]);
+  EXPECT_EQ(0, loaded["local"]);
+  EXPECT_EQ(1, loaded["6000"]);
+
+  unlink(filename);
+  unlink((std::string(filename) + ".bak").c_str());
+}
+
 TEST(GCodeParserTest, set_system_origin) {
   ParseTester counter;
 
@@ -611,6 +689,48 @@ TEST(GCodeParserTest, arc_generation) {
   }
 }
 
+class RasterTester : public ParseTester {
+public:
+  virtual bool raster_move(float feed_mm_p_sec,
+                           const AxesRegister &start, const AxesRegister &end,
+                           const uint8_t *pixels, int count) {
+    raster_start = start;
+    abs_pos = end;
+    feedrate = feed_mm_p_sec;
+    raster_pixels.assign(pixels, pixels + count);
+    return true;
+  }
+
+  AxesRegister raster_start;
+  std::vector<uint8_t> raster_pixels;
+};
+
+TEST(GCodeParserTest, raster_line) {
+  RasterTester counter;
+  EXPECT_TRUE(counter.TestParseLine("G1 X10 Y5"));
+  EXPECT_TRUE(counter.TestParseLine("G7 F600 X20 D00ff8040"));
+  EXPECT_EQ(HOME_X + 10, counter.raster_start[AXIS_X]);
+  EXPECT_EQ(HOME_X + 20, counter.abs_pos[AXIS_X]);
+  EXPECT_EQ(HOME_Y + 5, counter.abs_pos[AXIS_Y]);
+  EXPECT_EQ(10, counter.feedrate);
+  EXPECT_EQ(std::vector<uint8_t>({0x00, 0xff, 0x80, 0x40}),
+            counter.raster_pixels);
+
+  // Without position, the pitch tells how far to go along X.
+  EXPECT_TRUE(counter.TestParseLine("G7 P-0.5 D 0A0B0C0D"));
+  EXPECT_EQ(HOME_X + 18, counter.abs_pos[AXIS_X]);
+  EXPECT_EQ(4u, counter.raster_pixels.size());
+  EXPECT_EQ(0x0d, counter.raster_pixels[3]);
+
+  // The parser continues from the end of the raster line.
+  EXPECT_TRUE(counter.TestParseLine("G1 X1"));
+  EXPECT_EQ(HOME_X + 1, counter.abs_pos[AXIS_X]);
+
+  EXPECT_FALSE(counter.TestParseLine("G7 X10"));  // No pixels.
+  EXPECT_FALSE(counter.TestParseLine("G7 D0102"));  // Nowhere to go.
+  EXPECT_EQ(0, counter.call_count[CALL_unprocessed]);
+}
+
 TEST(GCodeParserTest, expressions) {
   ParseTester counter;
 
@@ -883,6 +1003,33 @@ TEST(GCodeParserTest, WhileLoop) {
   EXPECT_EQ(1024, counter.get_parameter(2));
 }
 
+TEST(GCodeParserTest, WhileLoopWithExpressions) {
+  ParseTester counter;
+
+  EXPECT_TRUE(counter.TestParseLine("#1=0"));
+  EXPECT_TRUE(counter.TestParseLine("#2=0"));
+  EXPECT_TRUE(counter.TestParseLine("#5=3"));   // Index of parameter to sum.
+  EXPECT_TRUE(counter.TestParseLine("#3=0"));
+  EXPECT_TRUE(counter.TestParseLine("WHILE [#1 < 100] DO\n"));
+  EXPECT_TRUE(counter.TestParseLine("G1 X[#1 * 2] Y[sqrt[#1]] Z[atan[#1]/[1]]\n"));
+  EXPECT_TRUE(counter.TestParseLine("IF [#1 MOD 2 == 0] THEN #2=[#2+1]\n"));
+  EXPECT_TRUE(counter.TestParseLine("##5 += #1\n"));
+  EXPECT_TRUE(counter.TestParseLine("#1++\n"));
+  EXPECT_TRUE(counter.TestParseLine("END\n"));
+
+  EXPECT_EQ(100, counter.get_parameter(1));
+  EXPECT_EQ(50, counter.get_parameter(2));
+  EXPECT_EQ(4950, counter.get_parameter(3));
+  EXPECT_EQ(100, counter.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(HOME_X + 2 * 99, counter.abs_pos[AXIS_X]);
+  EXPECT_FLOAT_EQ(HOME_Y + sqrtf(99), counter.abs_pos[AXIS_Y]);
+  EXPECT_FLOAT_EQ(HOME_Z + atan2f(99, 1) * 180 / M_PI,
+                  counter.abs_pos[AXIS_Z]);
+
+  // The ten lines given, and the four body lines executed 100 times.
+  EXPECT_EQ(10 + 100 * 4, counter.line_count());
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
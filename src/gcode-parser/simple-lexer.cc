@@ -30,68 +30,98 @@ static const char *skip_white(const char *line) {
   return line;
 }
 
-class SimpleLexerBase::Node {
-public:
-  Node() : value(0) {
-    memset(&next_character, 0, 256*sizeof(Node*));
-  }
-
-  Node *next_character[256];
-  int value;
-};
-
-SimpleLexerBase::SimpleLexerBase() : root_(new Node()) {
+SimpleLexerBase::SimpleLexerBase() {
+  RebuildTable();
 }
 
-SimpleLexerBase::~SimpleLexerBase() {
-  for (size_t i = 0; i < to_delete_.size(); ++i) {
-    delete to_delete_[i];
-  }
-  delete root_;
-}
+SimpleLexerBase::~SimpleLexerBase() {}
 
 void SimpleLexerBase::AddKeywordIntValue(const char *keyword, int value) {
   assert(value > 0);
-  AddKeywordAtNode(root_, keyword, value);
-  if (keyword_mappings_.find(value) == keyword_mappings_.end()) {
-    keyword_mappings_[value] = keyword;
+  std::string upper_keyword;
+  for (const char *c = keyword; *c; ++c) {
+    assert(!isspace(*c));  // Keywords cannot have spaces.
+    upper_keyword.append(1, toupper(*c));
+  }
+  for (size_t i = 0; i < keywords_.size(); ++i) {
+    // otherwise, the same keyword is already there.
+    assert(keywords_[i].first != upper_keyword);
   }
+  keywords_.push_back(std::make_pair(upper_keyword, value));
+
+  if ((int)value_to_keyword_.size() <= value) {
+    value_to_keyword_.resize(value + 1, NULL);
+  }
+  if (value_to_keyword_[value] == NULL) {
+    value_to_keyword_[value] = keyword;
+  }
+
+  // Keywords are only registered on setup, so rebuilding each time is cheap
+  // enough and keeps the table always ready to use.
+  RebuildTable();
 }
 
-const char *SimpleLexerBase::ReverseMapToString(int value) {
+const char *SimpleLexerBase::ReverseMapToString(int value) const {
   if (value == 0) return "?";
-  KeywordMap::const_iterator found = keyword_mappings_.find(value);
-  if (found == keyword_mappings_.end())
+  if (value < 0 || value >= (int)value_to_keyword_.size())
     return NULL;
-  return found->second;
+  return value_to_keyword_[value];
 }
 
-void SimpleLexerBase::AddKeywordAtNode(Node *node, const char *keyword,
-                                       int value) {
-  if (*keyword == '\0') {
-    assert(node->value == 0);  // otherwise, the same keyword is already there.
-    node->value = value;
-  } else {
-    assert(!isspace(*keyword));  // Keywords cannot have spaces.
-    const int up = toupper(*keyword);
-    if (node->next_character[up] == NULL) {
-      node->next_character[up] = new Node();
-      to_delete_.push_back(node->next_character[up]);
+void SimpleLexerBase::RebuildTable() {
+  // Assign a column to each distinct character, matching both cases.
+  memset(char_column_, 0, sizeof(char_column_));
+  columns_ = 1;
+  for (size_t i = 0; i < keywords_.size(); ++i) {
+    for (const char c : keywords_[i].first) {
+      const uint8_t up = c;
+      if (char_column_[up] == 0) {
+        assert(columns_ < 256);
+        char_column_[up] = columns_;
+        char_column_[(uint8_t)tolower(up)] = columns_;
+        ++columns_;
+      }
+    }
+  }
+
+  // Node 0 is the root; as nothing ever transitions back to the root,
+  // a zero transition means there is no further match.
+  transitions_.assign(columns_, 0);
+  node_value_.assign(1, 0);
+  for (size_t i = 0; i < keywords_.size(); ++i) {
+    int node = 0;
+    for (const char c : keywords_[i].first) {
+      uint16_t &next = transitions_[node * columns_ + char_column_[(uint8_t)c]];
+      if (next == 0) {
+        assert(node_value_.size() < 65536);
+        next = node_value_.size();
+        node_value_.push_back(0);
+        transitions_.resize(transitions_.size() + columns_, 0);
+      }
+      // The vector might have been resized, so index again.
+      node = transitions_[node * columns_ + char_column_[(uint8_t)c]];
     }
-    AddKeywordAtNode(node->next_character[up], keyword + 1, value);
+    node_value_[node] = keywords_[i].second;
   }
 }
 
-int SimpleLexerBase::ConsumeKeyword(const char **input) {
+int SimpleLexerBase::ConsumeKeyword(const char **input) const {
   int result = 0;
   const char *word = *input;
   word = skip_white(word);
-  for (const Node *node = root_; node; ++word) {
-    if (node->value > 0) {
+  int node = 0;
+  for (;;) {
+    if (node_value_[node] > 0) {
       *input = skip_white(word);
-      result = node->value;
+      result = node_value_[node];
     }
-    node = node->next_character[toupper(*word)];
+    const int column = char_column_[(uint8_t)*word];
+    if (column == 0)
+      break;
+    node = transitions_[node * columns_ + column];
+    if (node == 0)
+      break;
+    ++word;
   }
   return result;
 }
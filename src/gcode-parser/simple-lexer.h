@@ -16,7 +16,10 @@
  * You should have received a copy of the GNU General Public License
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <map>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
 #include <vector>
 
 class SimpleLexerBase {
@@ -28,18 +31,24 @@ protected:
   // Add a keyword and the corresponding value it should be associated with.
   // "value" needs to be > 0.
   void AddKeywordIntValue(const char *keyword, int value);
-  int ConsumeKeyword(const char **input);
-  const char *ReverseMapToString(int value);
+  int ConsumeKeyword(const char **input) const;
+  const char *ReverseMapToString(int value) const;
 
 private:
-  class Node;
-  typedef std::map<int, const char*> KeywordMap;
+  void RebuildTable();
+
+  // All keywords (upper case) and their values as they were added.
+  std::vector<std::pair<std::string, int> > keywords_;
 
-  void AddKeywordAtNode(Node *node, const char *keyword, int value);
+  // The keywords are compiled into a flat trie. Only the few characters
+  // that occur in keywords have a column in the transition table; all
+  // others map to column 0 which is never a valid transition.
+  uint8_t char_column_[256];
+  int columns_;
+  std::vector<uint16_t> transitions_;  // node * columns_ + column -> node
+  std::vector<int> node_value_;        // value of keyword ending in node.
 
-  Node *root_;
-  std::vector<Node*> to_delete_;
-  KeywordMap keyword_mappings_;
+  std::vector<const char *> value_to_keyword_;
 };
 
 // A simple keyword matcher that can deal with ambiguous prefixes
@@ -59,7 +68,7 @@ public:
   }
 
   // Get string respresentation of keyword enum or NULL if it does not exist.
-  const char *AsString(Enum e) { return ReverseMapToString(e); }
+  const char *AsString(Enum e) const { return ReverseMapToString(e); }
 
   // Attempts to consume next keyword greedily (longer match wins).
   // Advances the input the number of consumed characters if there was
@@ -67,12 +76,12 @@ public:
   // The "input" pointer is modified to point to the first non-whitespace
   // character after the matched keyword on success.
   // Returns value of matched keyword or 0 if there was no match.
-  Enum MatchNext(const char **input) {
+  Enum MatchNext(const char **input) const {
     return static_cast<Enum>(ConsumeKeyword(input));
   }
 
   // Expect and consume a particular keyword, otherwise return false.
-  bool ExpectNext(const char **input, Enum e) {
+  bool ExpectNext(const char **input, Enum e) const {
     const char *end = *input;
     if (MatchNext(&end) == e) {
       *input = end;
@@ -0,0 +1,95 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark for the SimpleLexer with the operator keywords of the
+// gcode parser.
+//
+// Usage: ./simple-lexer_bench [repetitions]
+
+#include "simple-lexer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum Operation {
+  NO_OPERATION,
+  PLUS, MINUS, DIVIDED_BY, MODULO, TIMES, POWER, EQ, NE, GT, GE, LT, LE,
+  AND2, NON_EXCLUSIVE_OR, EXCLUSIVE_OR, RIGHT_BRACKET,
+  ABS, TAN, ATAN, SIN, ASIN, COS, ACOS, EXP, LN, FIX, FUP, ROUND, SQRT
+};
+
+// Tokens as they show up in expressions, including the speculative
+// lookups that don't match anything.
+static const char *const kInput[] = {
+  "+ 3]", "**2]", "* #1", "/ 2", "MOD 360", "]", "<= #2", "< 5", "== 0",
+  "AND [", "OR [", "XOR", "sin[", "cos[", "atan[", "abs[", "sqrt[", "round[",
+  "#5", "12.5", "X10", "fup[", "ln[", "LE 0", "ge 1", "!= 3",
+};
+
+int main(int argc, char *argv[]) {
+  const int repetitions = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+  SimpleLexer<Operation> lexer;
+  lexer.AddKeyword("+",  PLUS);
+  lexer.AddKeyword("-",  MINUS);
+  lexer.AddKeyword("/",  DIVIDED_BY);
+  lexer.AddKeyword("MOD", MODULO);
+  lexer.AddKeyword("*",  TIMES);
+  lexer.AddKeyword("**", POWER);
+  lexer.AddKeyword("==", EQ); lexer.AddKeyword("EQ", EQ);
+  lexer.AddKeyword("!=", NE); lexer.AddKeyword("NE", NE);
+  lexer.AddKeyword(">",  GT); lexer.AddKeyword("GT", GT);
+  lexer.AddKeyword(">=", GE); lexer.AddKeyword("GE", GE);
+  lexer.AddKeyword("<",  LT); lexer.AddKeyword("LT", LT);
+  lexer.AddKeyword("<=", LE); lexer.AddKeyword("LE", LE);
+  lexer.AddKeyword("AND", AND2); lexer.AddKeyword("&&",  AND2);
+  lexer.AddKeyword("OR", NON_EXCLUSIVE_OR);
+  lexer.AddKeyword("||", NON_EXCLUSIVE_OR);
+  lexer.AddKeyword("XOR", EXCLUSIVE_OR);
+  lexer.AddKeyword("]",  RIGHT_BRACKET);
+  lexer.AddKeyword("abs",  ABS);
+  lexer.AddKeyword("tan",  TAN); lexer.AddKeyword("atan", ATAN);
+  lexer.AddKeyword("sin",  SIN); lexer.AddKeyword("asin", ASIN);
+  lexer.AddKeyword("cos",  COS); lexer.AddKeyword("acos", ACOS);
+  lexer.AddKeyword("exp",  EXP); lexer.AddKeyword("ln",   LN);
+  lexer.AddKeyword("fix",  FIX);
+  lexer.AddKeyword("fup",  FUP);
+  lexer.AddKeyword("round", ROUND);
+  lexer.AddKeyword("sqrt", SQRT);
+
+  const int kInputCount = sizeof(kInput) / sizeof(kInput[0]);
+  long matches = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < repetitions; ++r) {
+    for (int i = 0; i < kInputCount; ++i) {
+      const char *input = kInput[i];
+      matches += (lexer.MatchNext(&input) != NO_OPERATION);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  const double duration = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  const double lookups = 1.0 * repetitions * kInputCount;
+  printf("%.0f lookups (%ld matches) in %.3fs: %.1fns/lookup\n",
+         lookups, matches, duration, 1e9 * duration / lookups);
+  return 0;
+}
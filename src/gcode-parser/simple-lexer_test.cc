@@ -96,6 +96,32 @@ TEST(SimpleLexerTest, ReverseMapping) {
     EXPECT_EQ(std::string("?"), lexer.AsString(NO_KEYWORD));
 }
 
+TEST(SimpleLexerTest, CaseInsensitiveAndLongestMatch) {
+    SimpleLexer<MyKeywords> lexer;
+    lexer.AddKeyword("else",   KEYWORD_ELSE);
+    lexer.AddKeyword("ELSEIF", KEYWORD_ELSEIF);
+    lexer.AddKeyword("<",      KEYWORD_LT);
+    lexer.AddKeyword("<=",     KEYWORD_LE);
+
+    const char *word = "ElseIf[";
+    EXPECT_EQ(KEYWORD_ELSEIF, lexer.MatchNext(&word));
+    EXPECT_EQ(std::string("["), word);
+
+    word = "ELSEI";   // Falls back to the last complete keyword.
+    EXPECT_EQ(KEYWORD_ELSE, lexer.MatchNext(&word));
+    EXPECT_EQ(std::string("I"), word);
+
+    word = "< = 3";   // Whitespace is not part of a keyword.
+    EXPECT_EQ(KEYWORD_LT, lexer.MatchNext(&word));
+    EXPECT_EQ(std::string("= 3"), word);
+
+    word = "";
+    EXPECT_EQ(NO_KEYWORD, lexer.MatchNext(&word));
+
+    word = "\xe9lse";  // Characters beyond ASCII are never part of a match.
+    EXPECT_EQ(NO_KEYWORD, lexer.MatchNext(&word));
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
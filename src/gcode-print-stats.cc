@@ -17,8 +17,10 @@
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,37 +28,183 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "common/logging.h"
 
 #include "determine-print-stats.h"
 #include "gcode-machine-control.h"
 #include "config-parser.h"
 
+enum OutputFormat { FORMAT_TABLE, FORMAT_CSV, FORMAT_JSON };
+
 int usage(const char *prog) {
-  fprintf(stderr, "Usage: %s [options] <gcode-file> [<gcode-file> ..]\n"
+  fprintf(stderr, "Usage: %s [options] <gcode-file|directory> "
+          "[<gcode-file|directory> ..]\n"
           "Options:\n"
           "\t-c <config>       : Machine config\n"
           "\t-f <factor>       : Speedup-factor for feedrate.\n"
           "\t-H                : Toggle print header line\n"
-          "Use filename '-' for stdin.\n", prog);
+          "\t-F <format>       : Output format: table (default), csv, json\n"
+          "\t-j <jobs>         : Number of files to process in parallel. "
+          "Default: number of CPUs.\n"
+          "Use filename '-' for stdin. Directories are expanded to the "
+          "files they contain.\n", prog);
   return 1;
 }
 
-static void print_file_stats(const char *filename, int indentation,
-                             FILE *msg_out,
-                             const MachineControlConfig &config) {
-  struct BeagleGPrintStats result;
-  int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
-  if (determine_print_stats(fd, config, msg_out, &result)) {
-    // Filament length looks a bit high, is this input or extruded ?
-    printf("%-*s %10.0f %12.1f %14.1f",
-           indentation, filename,
-           result.total_time_seconds, result.last_z_extruding,
-           result.filament_len);
-    printf("\n");
-  } else {
-    printf("#%s not-processed\n", filename);
+namespace {
+struct FileJob {
+  std::string filename;
+  bool success;
+  BeagleGPrintStats stats;
+};
+
+// Files are handed out to the worker threads in order.
+struct JobList {
+  std::vector<FileJob> jobs;
+  int next_job;
+  const MachineControlConfig *config;
+};
+}
+
+static void *process_jobs(void *arg) {
+  JobList *job_list = reinterpret_cast<JobList*>(arg);
+  FILE *msg_out = fopen("/dev/null", "w");
+  for (;;) {
+    const int i = __sync_fetch_and_add(&job_list->next_job, 1);
+    if (i >= (int)job_list->jobs.size())
+      break;
+    FileJob *job = &job_list->jobs[i];
+    const char *filename = job->filename.c_str();
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    job->success = fd >= 0 && determine_print_stats(fd, *job_list->config,
+                                                    msg_out, &job->stats);
+  }
+  fclose(msg_out);
+  return NULL;
+}
+
+// Add filename or, if this is a directory, all the files in there.
+static void add_files(const char *name, std::vector<FileJob> *jobs) {
+  struct stat st;
+  DIR *dir;
+  if (stat(name, &st) != 0 || !S_ISDIR(st.st_mode)
+      || (dir = opendir(name)) == NULL) {
+    FileJob job;
+    job.filename = name;
+    jobs->push_back(job);
+    return;
+  }
+  std::vector<std::string> files;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    std::string path = std::string(name) + "/" + entry->d_name;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      files.push_back(path);
+  }
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+  for (const std::string &f : files) {
+    FileJob job;
+    job.filename = f;
+    jobs->push_back(job);
+  }
+}
+
+static std::string escape_json(const std::string &s) {
+  std::string result;
+  for (const char c : s) {
+    if (c == '"' || c == '\\') {
+      result.append(1, '\\');
+      result.append(1, c);
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      result.append(buf);
+    } else {
+      result.append(1, c);
+    }
+  }
+  return result;
+}
+
+static std::string escape_csv(const std::string &s) {
+  if (s.find_first_of(",\"\n") == std::string::npos)
+    return s;
+  std::string result = "\"";
+  for (const char c : s) {
+    if (c == '"') result.append(1, '"');
+    result.append(1, c);
+  }
+  return result + "\"";
+}
+
+static void print_table(const std::vector<FileJob> &jobs, bool print_header) {
+  int longest_filename = strlen("#[filename]"); // table header
+  for (const FileJob &job : jobs) {
+    int len = job.filename.length();
+    if (len > longest_filename) longest_filename = len;
+  }
+  if (print_header) {
+    printf("%-*s %10s %12s %14s\n", longest_filename,
+           "#[filename]", "[time{s}]", "[height{mm}]",
+           "[filament{mm}]");
+  }
+  for (const FileJob &job : jobs) {
+    if (job.success) {
+      // Filament length looks a bit high, is this input or extruded ?
+      printf("%-*s %10.0f %12.1f %14.1f",
+             longest_filename, job.filename.c_str(),
+             job.stats.total_time_seconds, job.stats.last_z_extruding,
+             job.stats.filament_len);
+      printf("\n");
+    } else {
+      printf("#%s not-processed\n", job.filename.c_str());
+    }
+  }
+}
+
+static void print_csv(const std::vector<FileJob> &jobs, bool print_header) {
+  if (print_header) {
+    printf("filename,success,time_s,height_mm,filament_mm,"
+           "min_x,min_y,min_z,max_x,max_y,max_z,segments\n");
+  }
+  for (const FileJob &job : jobs) {
+    const BeagleGPrintStats &r = job.stats;
+    if (job.success) {
+      printf("%s,1,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d\n",
+             escape_csv(job.filename).c_str(), r.total_time_seconds,
+             r.last_z_extruding, r.filament_len,
+             r.min_x, r.min_y, r.min_z, r.max_x, r.max_y, r.max_z,
+             r.segment_count);
+    } else {
+      printf("%s,0,,,,,,,,,,\n", escape_csv(job.filename).c_str());
+    }
+  }
+}
+
+static void print_json(const std::vector<FileJob> &jobs) {
+  printf("[");
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const FileJob &job = jobs[i];
+    const BeagleGPrintStats &r = job.stats;
+    printf("%s\n  {\"filename\": \"%s\", \"success\": %s",
+           i == 0 ? "" : ",", escape_json(job.filename).c_str(),
+           job.success ? "true" : "false");
+    if (job.success) {
+      printf(", \"time_s\": %.3f, \"height_mm\": %.3f, \"filament_mm\": %.3f,"
+             " \"min\": [%.3f, %.3f, %.3f], \"max\": [%.3f, %.3f, %.3f],"
+             " \"segments\": %d",
+             r.total_time_seconds, r.last_z_extruding, r.filament_len,
+             r.min_x, r.min_y, r.min_z, r.max_x, r.max_y, r.max_z,
+             r.segment_count);
+    }
+    printf("}");
   }
+  printf("\n]\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -65,9 +213,11 @@ int main(int argc, char *argv[]) {
   float factor = 1.0;        // print speed factor.
   char print_header = 1;
   const char *config_file = NULL;
+  OutputFormat format = FORMAT_TABLE;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
   int opt;
-  while ((opt = getopt(argc, argv, "c:f:H")) != -1) {
+  while ((opt = getopt(argc, argv, "c:f:HF:j:")) != -1) {
     switch (opt) {
     case 'c':
       config_file = strdup(optarg);
@@ -79,6 +229,19 @@ int main(int argc, char *argv[]) {
     case 'H':
       print_header = !print_header;
       break;
+    case 'F':
+      if (strcasecmp(optarg, "table") == 0) format = FORMAT_TABLE;
+      else if (strcasecmp(optarg, "csv") == 0) format = FORMAT_CSV;
+      else if (strcasecmp(optarg, "json") == 0) format = FORMAT_JSON;
+      else {
+        fprintf(stderr, "Unknown output format '%s'\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs <= 0) return usage(argv[0]);
+      break;
     default:
       return usage(argv[0]);
     }
@@ -92,7 +255,6 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  FILE *msg_out = fopen("/dev/null", "w");
   Log_init("/dev/null");
 
   ConfigParser config_parser;
@@ -114,19 +276,28 @@ int main(int argc, char *argv[]) {
     config.homing_trigger[i] = HardwareMapping::TRIGGER_NONE;
   }
 
-  int longest_filename = strlen("#[filename]"); // table header
+  JobList job_list;
+  job_list.next_job = 0;
+  job_list.config = &config;
   for (int i = optind; i < argc; ++i) {
-    int len = strlen(argv[i]);
-    if (len > longest_filename) longest_filename = len;
+    add_files(argv[i], &job_list.jobs);
   }
-  if (print_header) {
-    printf("%-*s %10s %12s %14s\n", longest_filename,
-           "#[filename]", "[time{s}]", "[height{mm}]",
-           "[filament{mm}]");
+
+  // Each file is independent, so we can simply process them in parallel.
+  jobs = std::max(1, std::min(jobs, (int)job_list.jobs.size()));
+  std::vector<pthread_t> threads(jobs - 1);
+  for (pthread_t &t : threads) {
+    pthread_create(&t, NULL, &process_jobs, &job_list);
   }
-  for (int i = optind; i < argc; ++i) {
-    print_file_stats(argv[i], longest_filename, msg_out, config);
+  process_jobs(&job_list);
+  for (pthread_t &t : threads) {
+    pthread_join(t, NULL);
+  }
+
+  switch (format) {
+  case FORMAT_TABLE: print_table(job_list.jobs, print_header); break;
+  case FORMAT_CSV:   print_csv(job_list.jobs, print_header); break;
+  case FORMAT_JSON:  print_json(job_list.jobs); break;
   }
-  fclose(msg_out);
   return 0;
 }
@@ -0,0 +1,564 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcode-server.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "common/logging.h"
+#include "gcode-parser/gcode-parser.h"
+
+#include "gcode-machine-control.h"
+#include "machine-metrics.h"
+
+// A client not reading its responses is disconnected once this much output
+// is pending.
+#define MAX_PENDING_OUTPUT (1 << 20)
+
+// Same as the GCode parser: lines longer than this are split.
+#define MAX_LINE_LENGTH 8191
+
+// If there is no input on the GCode stream for this time, we tell the
+// machine that we're idle.
+#define IDLE_INTERVAL_MS 50
+
+// While lines of the GCode stream wait for room in the motion queue, we
+// check this often if they can go.
+#define QUEUE_FULL_POLL_MS 2
+
+// Responses are collected and sent together once we've processed what we
+// have read, so that a fast streaming client doesn't cost a write() per
+// acknowledged line. They are sent earlier if this much is collected...
+#define REPLY_FLUSH_BYTES 4096
+
+// ... or if the oldest unsent response is this old, e.g. because a line is
+// waiting for space in the motion queue.
+#define REPLY_FLUSH_DELAY_MS 10
+
+static volatile sig_atomic_t caught_signal = 0;
+static void receive_signal(int sig) { caught_signal = 1; }
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// A client connection. Everything written to stream() is buffered and sent
+// with the next Flush() or whenever the socket is ready to receive.
+class GCodeServer::Connection {
+public:
+  Connection(int fd, const std::string &peer)
+    : peer_(peer), fd_(fd), broken_(false), watched_events_(EPOLLIN),
+      close_when_flushed_(false), lines_seen_(0),
+      unflushed_lines_(0), unflushed_since_(0) {
+    cookie_io_functions_t io_functions = {};
+    io_functions.write = &Connection::CookieWrite;
+    stream_ = fopencookie(this, "w", io_functions);
+    setvbuf(stream_, NULL, _IONBF, 0);
+  }
+
+  ~Connection() {
+    fclose(stream_);
+    close(fd_);
+  }
+
+  int fd() const { return fd_; }
+  FILE *stream() const { return stream_; }
+  const std::string &peer() const { return peer_; }
+
+  // Input that is not processed yet: an incomplete line, or lines held
+  // back while the motion queue is full.
+  std::string *pending_input() { return &input_; }
+  bool has_unprocessed_lines() const {
+    return input_.find('\n') != std::string::npos
+      || input_.size() >= MAX_LINE_LENGTH;
+  }
+
+  // Connection had an error or client doesn't read what we send.
+  bool broken() const { return broken_; }
+  void set_broken() { broken_ = true; }
+
+  bool has_pending_output() const { return !output_.empty(); }
+  void DiscardOutput() { output_.clear(); }
+
+  // Once everything is sent, we close this connection; input is ignored.
+  bool close_when_flushed() const { return close_when_flushed_; }
+  void set_close_when_flushed() { close_when_flushed_ = true; }
+
+  // Number of lines received so far.
+  int lines_seen() const { return lines_seen_; }
+  void add_line_seen() { ++lines_seen_; }
+
+  // Count a processed line, whose response is not sent yet.
+  void AddUnflushedLine() { ++unflushed_lines_; }
+  int unflushed_lines() const { return unflushed_lines_; }
+
+  // Whether collected output should go out now, without waiting for the
+  // end of the current batch of input.
+  bool NeedsEarlyFlush(int64_t now) const {
+    return output_.size() >= REPLY_FLUSH_BYTES
+      || (unflushed_since_ != 0
+          && now - unflushed_since_ >= REPLY_FLUSH_DELAY_MS);
+  }
+
+  // The epoll events we are registered for.
+  uint32_t watched_events() const { return watched_events_; }
+  void set_watched_events(uint32_t events) { watched_events_ = events; }
+
+  // Send as much of the pending output as the socket takes right now.
+  void Flush() {
+    unflushed_lines_ = 0;
+    unflushed_since_ = 0;
+    while (!output_.empty() && !broken_) {
+      const ssize_t w = write(fd_, output_.data(), output_.size());
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) broken_ = true;
+        return;
+      }
+      output_.erase(0, w);
+    }
+  }
+
+private:
+  static ssize_t CookieWrite(void *cookie, const char *buf, size_t size) {
+    Connection *self = (Connection *) cookie;
+    if (self->output_.size() + size > MAX_PENDING_OUTPUT) {
+      if (!self->broken_) {
+        Log_error("%s does not read its responses; disconnecting.",
+                  self->peer_.c_str());
+      }
+      self->broken_ = true;
+    }
+    if (!self->broken_) {
+      if (self->unflushed_since_ == 0) self->unflushed_since_ = now_ms();
+      self->output_.append(buf, size);
+    }
+    return size;  // Never report an error, we don't want stdio to retry.
+  }
+
+  const std::string peer_;
+  const int fd_;
+  FILE *stream_;
+  bool broken_;
+  uint32_t watched_events_;
+  bool close_when_flushed_;
+  int lines_seen_;
+  int unflushed_lines_;
+  int64_t unflushed_since_;   // now_ms() of oldest unsent output; 0 if none.
+  std::string input_;
+  std::string output_;
+};
+
+GCodeServer::GCodeServer(GCodeMachineControl *machine, GCodeParser *parser,
+                         int ack_window)
+  : machine_(machine), parser_(parser), ack_window_(ack_window),
+    epoll_fd_(-1), listen_fd_(-1), feed_hold_(false),
+    gcode_connection_(NULL) {
+  if (pipe2(exit_pipe_, O_NONBLOCK | O_CLOEXEC) != 0) {
+    Log_error("pipe2(): %s", strerror(errno));
+    exit_pipe_[0] = exit_pipe_[1] = -1;
+  }
+}
+
+GCodeServer::~GCodeServer() {
+  if (exit_pipe_[0] >= 0) close(exit_pipe_[0]);
+  if (exit_pipe_[1] >= 0) close(exit_pipe_[1]);
+}
+
+void GCodeServer::RequestExit() {
+  const char c = 0;
+  if (write(exit_pipe_[1], &c, 1) < 0) {
+    // Nothing we can do; pipe full means exit already requested.
+  }
+}
+
+bool GCodeServer::Accept() {
+  struct sockaddr_in client;
+  socklen_t socklen = sizeof(client);
+  const int fd = accept4(listen_fd_, (struct sockaddr*) &client, &socklen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return true;  // Someone gave up before we got to it.
+    Log_error("accept(): %s", strerror(errno));
+    return false;
+  }
+
+  char ip_buffer[INET_ADDRSTRLEN];
+  const char *print_ip = inet_ntop(AF_INET, &client.sin_addr,
+                                   ip_buffer, sizeof(ip_buffer));
+  Connection *connection = new Connection(fd, print_ip ? print_ip : "?");
+  const bool is_gcode_stream = (gcode_connection_ == NULL);
+  // A new GCode stream during feed hold is only registered once released.
+  if (!(is_gcode_stream && feed_hold_) && !WatchConnection(connection)) {
+    delete connection;
+    return false;
+  }
+  connections_.push_back(connection);
+
+  if (is_gcode_stream) {
+    Log_info("Accepting new connection from %s\n", print_ip);
+    gcode_connection_ = connection;
+    machine_->SetMsgOut(connection->stream());
+    if (ack_window_ > 0) {
+      fprintf(connection->stream(), "// BeagleG: ack-window %d\n",
+              ack_window_);
+    }
+  } else {
+    Log_info("Accepting status connection from %s\n", print_ip);
+    fprintf(connection->stream(),
+            "// BeagleG: GCode stream busy. Status queries only "
+            "(M105, M114, M115, M119, M122) and overrides "
+            "(M24, M25, M220).\n");
+  }
+  return true;
+}
+
+bool GCodeServer::WatchConnection(Connection *connection) {
+  struct epoll_event ev = {};
+  ev.events = connection->watched_events();
+  ev.data.ptr = connection;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, connection->fd(), &ev) != 0) {
+    Log_error("epoll_ctl(): %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool GCodeServer::SetFeedHold(bool hold) {
+  if (hold == feed_hold_)
+    return true;
+  if (!machine_->SetFeedHold(hold))
+    return false;
+  feed_hold_ = hold;
+  // The next GCode line might wait for space in the motion queue, which
+  // would block us forever while on hold. So stop listening to the GCode
+  // stream until released; it stays buffered in the socket.
+  if (gcode_connection_ == NULL)
+    return true;
+  if (hold) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, gcode_connection_->fd(), NULL);
+  } else if (!WatchConnection(gcode_connection_)) {
+    gcode_connection_->set_broken();
+  }
+  return true;
+}
+
+void GCodeServer::CloseConnection(Connection *connection,
+                                  bool finish_program) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd(), NULL);
+  connections_.erase(std::find(connections_.begin(), connections_.end(),
+                               connection));
+  if (connection == gcode_connection_) {
+    // Same as at the end of ParseStream(): finish up the program.
+    if (finish_program) machine_->ParseEventReceiver()->gcode_finished(true);
+    machine_->SetMsgOut(NULL);
+    gcode_connection_ = NULL;
+    Log_info("Connection to %s closed.\n", connection->peer().c_str());
+  } else {
+    Log_info("Status connection to %s closed.\n", connection->peer().c_str());
+  }
+  delete connection;
+}
+
+void GCodeServer::HandleGCodeLine(const char *line) {
+  parser_->ParseLine(line, gcode_connection_->stream());
+}
+
+void GCodeServer::HandleStatusLine(Connection *connection, const char *line) {
+  while (isspace(*line)) ++line;
+  if (*line == '\0')
+    return;
+  FILE *out = connection->stream();
+  char *end = NULL;
+  const long code = (toupper(*line) == 'M') ? strtol(line + 1, &end, 10) : -1;
+  bool known = (end && end != line + 1);
+  if (!known) {
+    // Not an M-code.
+  } else if (code == 25 || code == 24) {
+    if (!SetFeedHold(code == 25)) {
+      fprintf(out, "// BeagleG: no real-time overrides with this motion "
+              "backend.\n");
+    }
+  } else if (code == 220) {
+    while (*end && toupper(*end) != 'S') ++end;
+    char *value_end = NULL;
+    const float percent = *end ? strtof(end + 1, &value_end) : 0;
+    if (!value_end || value_end == end + 1 || percent <= 0 || percent > 100) {
+      fprintf(out, "// BeagleG: M220 needs S<percent> in 1..100.\n");
+    } else if (!machine_->SetRealtimeSpeedFactor(percent / 100.0f)) {
+      fprintf(out, "// BeagleG: no real-time overrides with this motion "
+              "backend.\n");
+    }
+  } else {
+    known = machine_->ReportStatus(code, out);
+  }
+  if (!known) {
+    fprintf(out, "// BeagleG: status connection only accepts "
+            "M105, M114, M115, M119, M122 or the real-time overrides "
+            "M25 (feed hold), M24 (resume) and M220 S<percent>.\n");
+  }
+  fprintf(out, "ok\n");
+}
+
+void GCodeServer::HandleHttpRequest(Connection *connection,
+                                    const char *line) {
+  if (connection == gcode_connection_) {
+    // Not a GCode sender after all.
+    machine_->SetMsgOut(NULL);
+    gcode_connection_ = NULL;
+  }
+  connection->DiscardOutput();  // Greetings meant for GCode senders.
+  FILE *out = connection->stream();
+  if (strncmp(line, "GET /metrics ", 13) == 0) {
+    fprintf(out, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Connection: close\r\n\r\n");
+    Metrics_print_prometheus(out);
+  } else {
+    fprintf(out, "HTTP/1.0 404 Not Found\r\n"
+            "Content-Type: text/plain\r\n"
+            "Connection: close\r\n\r\n"
+            "Only /metrics here.\n");
+  }
+  connection->set_close_when_flushed();
+}
+
+void GCodeServer::HandleReadable(Connection *connection) {
+  char buffer[4096];
+  const ssize_t r = read(connection->fd(), buffer, sizeof(buffer));
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (r > 0 && connection->close_when_flushed())
+    return;  // Remaining HTTP headers; we already answered.
+
+  std::string *input = connection->pending_input();
+  if (r <= 0) {   // End of stream or error. Process what is left.
+    ProcessLines(connection, true);
+    if (!input->empty()) {
+      if (connection == gcode_connection_) HandleGCodeLine(input->c_str());
+      else HandleStatusLine(connection, input->c_str());
+    }
+    connection->Flush();
+    connection->set_broken();
+    return;
+  }
+
+  input->append(buffer, r);
+  ProcessLines(connection, false);
+}
+
+void GCodeServer::ProcessLines(Connection *connection, bool wait_for_queue) {
+  std::string *input = connection->pending_input();
+  size_t start = 0;
+  for (;;) {
+    size_t eol = input->find('\n', start);
+    if (eol == std::string::npos) {
+      if (input->size() - start < MAX_LINE_LENGTH)
+        break;
+      eol = start + MAX_LINE_LENGTH - 1;
+    }
+    if (connection == gcode_connection_ && !wait_for_queue
+        && machine_->IsMotionQueueFull()) {
+      break;  // Would block in the parser; try again in the next round.
+    }
+    const std::string line = input->substr(start, eol + 1 - start);
+    start = eol + 1;
+    connection->add_line_seen();
+    if (connection->lines_seen() == 1 && line.compare(0, 4, "GET ") == 0) {
+      HandleHttpRequest(connection, line.c_str());
+      break;
+    }
+    if (connection == gcode_connection_) HandleGCodeLine(line.c_str());
+    else HandleStatusLine(connection, line.c_str());
+    if (connection->broken()) break;
+
+    // A windowed client stalls once all its lines are in flight, so don't
+    // hold back more than half of the window.
+    connection->AddUnflushedLine();
+    if ((ack_window_ > 0 && connection->unflushed_lines() >= ack_window_ / 2)
+        || connection->NeedsEarlyFlush(now_ms())) {
+      connection->Flush();
+    }
+  }
+  input->erase(0, start);
+  connection->Flush();  // Responses to everything we processed.
+}
+
+int GCodeServer::Run(int listen_socket) {
+  signal(SIGPIPE, SIG_IGN);  // Pesky clients, closing connections...
+
+  listen_fd_ = listen_socket;
+  if (listen(listen_fd_, 8) < 0) {
+    Log_error("listen() failed: %s", strerror(errno));
+    return 1;
+  }
+  fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) | O_NONBLOCK);
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    Log_error("epoll_create1(): %s", strerror(errno));
+    return 1;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // Listen socket.
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+  ev.data.ptr = &exit_pipe_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, exit_pipe_[0], &ev);
+
+  struct sigaction sa = {};
+  sa.sa_handler = receive_signal;
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;  // oneshot, no restart
+  caught_signal = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int result = 0;
+  bool exit_requested = false;
+  bool is_processing = true;
+  int64_t last_gcode_activity = now_ms();
+  const int kMaxEvents = 16;
+  struct epoll_event events[kMaxEvents];
+  while (!caught_signal && !exit_requested && result == 0) {
+    const bool lines_waiting = (gcode_connection_ && !feed_hold_
+                                && gcode_connection_->has_unprocessed_lines());
+    const int count = epoll_wait(epoll_fd_, events, kMaxEvents,
+                                 lines_waiting
+                                 ? QUEUE_FULL_POLL_MS : IDLE_INTERVAL_MS);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      Log_error("epoll_wait(): %s", strerror(errno));
+      result = 1;
+      break;
+    }
+
+    bool had_gcode_input = false;
+    for (int i = 0; i < count; ++i) {
+      void *const source = events[i].data.ptr;
+      if (source == NULL) {
+        if (!Accept()) result = 1;
+        continue;
+      }
+      if (source == &exit_pipe_) {
+        exit_requested = true;
+        continue;
+      }
+      Connection *connection = (Connection *) source;
+      if (feed_hold_ && connection == gcode_connection_)
+        continue;  // Status line in this batch just asked for a hold.
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        had_gcode_input |= (connection == gcode_connection_);
+        HandleReadable(connection);
+      }
+      if (events[i].events & EPOLLOUT) {
+        connection->Flush();
+      }
+    }
+
+    // Lines of the GCode stream waiting for room in the motion queue. We
+    // are busy with them, not idle.
+    if (gcode_connection_ && !feed_hold_ && !gcode_connection_->broken()
+        && gcode_connection_->has_unprocessed_lines()) {
+      ProcessLines(gcode_connection_, false);
+      had_gcode_input = true;
+    }
+
+    // Outstanding output and cleanup. The list is short, so just go
+    // through all of them.
+    for (size_t i = 0; i < connections_.size(); /**/) {
+      Connection *connection = connections_[i];
+      if (feed_hold_ && connection == gcode_connection_) {
+        ++i;  // Not watched and can't finish the program while on hold.
+        continue;
+      }
+      if (connection->broken()) {
+        CloseConnection(connection, true);
+        continue;
+      }
+      if (connection->close_when_flushed()
+          && !connection->has_pending_output()) {
+        CloseConnection(connection, false);
+        continue;
+      }
+      if (connection->has_pending_output()
+          && !(connection->watched_events() & EPOLLOUT)) {
+        connection->Flush();  // Output not in response to input, e.g. idle.
+      }
+      // Lines held back for the motion queue are enough input for now; the
+      // rest stays buffered in the socket, so the client is slowed down.
+      const uint32_t wanted_events =
+        (connection->has_unprocessed_lines() ? 0 : EPOLLIN)
+        | (connection->has_pending_output() ? EPOLLOUT : 0);
+      if (wanted_events != connection->watched_events()) {
+        connection->set_watched_events(wanted_events);
+        struct epoll_event mod = {};
+        mod.events = wanted_events;
+        mod.data.ptr = connection;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection->fd(), &mod);
+      }
+      ++i;
+    }
+
+    // Same as ParseStream(): let the machine know if we're waiting for input.
+    const int64_t now = now_ms();
+    if (had_gcode_input) {
+      is_processing = true;
+      last_gcode_activity = now;
+    } else if (gcode_connection_ && !feed_hold_
+               && now - last_gcode_activity >= IDLE_INTERVAL_MS) {
+      machine_->ParseEventReceiver()->input_idle(is_processing);
+      is_processing = false;
+      last_gcode_activity = now;
+    }
+  }
+
+  // Otherwise, finishing the program would never end. On a signal, we stay
+  // on hold: the caller stops the machine without flushing the queue.
+  if (!caught_signal) SetFeedHold(false);
+  while (!connections_.empty()) {
+    CloseConnection(connections_.back(), !caught_signal);
+  }
+  close(epoll_fd_);
+  epoll_fd_ = -1;
+  close(listen_fd_);
+  listen_fd_ = -1;
+
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  return caught_signal ? 2 : result;
+}
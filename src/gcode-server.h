@@ -0,0 +1,105 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_GCODE_SERVER_H_
+#define _BEAGLEG_GCODE_SERVER_H_
+
+#include <stdio.h>
+
+#include <vector>
+
+class GCodeMachineControl;
+class GCodeParser;
+
+// Event loop serving GCode connections on a listening socket.
+//
+// The first connection is the GCode stream: its lines go to the parser
+// and operate the machine. While it is active, it stays exclusive: further
+// connections are status clients, that can only query with the M-codes
+// supported by GCodeMachineControl::ReportStatus(), such as M114 or M119.
+// Once the GCode stream closes, the next new connection takes over.
+//
+// Status clients can also override the running program in real time, applied
+// to what is already in the motion queue: M25 decelerates to a feed hold,
+// M24 resumes and M220 S<percent> scales the speed.
+//
+// A connection starting with an HTTP "GET /metrics" request is answered
+// with the machine metrics in Prometheus text format and closed, so that
+// monitoring can scrape the same port.
+//
+// All sockets are non-blocking; output is buffered per connection and sent
+// whenever the client is ready, so a slow client never stalls motion.
+// Responses to lines that arrived together are coalesced and sent together
+// once all of them are processed (or after a short delay, if processing
+// takes long), instead of one write() per "ok".
+// Likewise, the GCode stream is neither processed nor read further while
+// the motion queue is full, so that status clients are still served.
+//
+// With an "ack_window" > 0, the GCode stream is told on connect
+//   // BeagleG: ack-window <n>
+// meaning that the client may keep up to <n> unacknowledged lines in flight.
+// Acknowledgements are then sent at the latest after half the window.
+class GCodeServer {
+public:
+  GCodeServer(GCodeMachineControl *machine, GCodeParser *parser,
+              int ack_window = 0);
+  ~GCodeServer();
+
+  // Serve connections on the already bound "listen_socket" until a signal
+  // is received (returns 2), RequestExit() is called (returns 0) or there
+  // is an error (returns 1). Closes the listen socket.
+  int Run(int listen_socket);
+
+  // Make Run() return. Can be called from another thread or signal handler.
+  void RequestExit();
+
+private:
+  class Connection;
+
+  bool Accept();
+  // Register connection with epoll; for input and pending output.
+  bool WatchConnection(Connection *connection);
+  // Real-time feed hold of the machine; the GCode stream is not read
+  // while on hold. Returns false if the machine can't hold.
+  bool SetFeedHold(bool hold);
+  // Close connection. If it is the GCode stream and "finish_program" is
+  // set, the machine finishes the program as if the stream ended.
+  void CloseConnection(Connection *connection, bool finish_program);
+  void HandleReadable(Connection *connection);
+  // Process the complete lines received on "connection". Unless
+  // "wait_for_queue" is set, the GCode stream stops before a line while the
+  // motion queue is full, so that we don't block serving the other
+  // connections; the rest stays pending.
+  void ProcessLines(Connection *connection, bool wait_for_queue);
+  void HandleGCodeLine(const char *line);
+  void HandleStatusLine(Connection *connection, const char *line);
+  // Answer HTTP request; we only know the Prometheus /metrics endpoint.
+  void HandleHttpRequest(Connection *connection, const char *line);
+
+  GCodeMachineControl *const machine_;
+  GCodeParser *const parser_;
+  const int ack_window_;
+  int epoll_fd_;
+  int listen_fd_;
+  int exit_pipe_[2];
+  bool feed_hold_;
+  Connection *gcode_connection_;
+  std::vector<Connection*> connections_;
+};
+
+#endif  // _BEAGLEG_GCODE_SERVER_H_
@@ -0,0 +1,364 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcode-server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "gcode-machine-control.h"
+#include "gcode-parser/gcode-parser.h"
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+#include "spindle-control.h"
+
+namespace {
+class CountingMotorOps : public MotorOperations {
+public:
+  CountingMotorOps()
+    : steps(0), speed_override(1), full(false), has_override(true) {}
+  virtual void Enqueue(const LinearSegmentSteps &param) {
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) steps += param.steps[i];
+  }
+  virtual void MotorEnable(bool on) {}
+  virtual void WaitQueueEmpty() {}
+  virtual bool SetSpeedOverride(float factor) {
+    if (!has_override) return false;
+    speed_override = factor;
+    return true;
+  }
+  virtual bool QueueFull(int operations) { return full; }
+
+  int steps;  // Sum of all motor steps.
+  float speed_override;
+  volatile bool full;  // Set by the test thread.
+  volatile bool has_override;
+};
+
+// Machine and server running in a separate thread.
+class ServerHarness {
+public:
+  explicit ServerHarness(int ack_window = 0) : port_(0) {
+    MachineControlConfig config;
+    for (int i = 0; i <= AXIS_Z; ++i) {
+      config.steps_per_mm[i] = 100;
+      config.acceleration[i] = 1000;
+      config.max_feedrate[i] = 1000;
+    }
+    config.require_homing = false;
+    config.acknowledge_lines = true;
+    machine_ = GCodeMachineControl::Create(config, &motor_ops_, &hardware_,
+                                           &spindle_, NULL);
+    GCodeParser::Config parser_cfg;
+    parser_cfg.parameters = &parameters_;
+    parser_ = new GCodeParser(parser_cfg, machine_->ParseEventReceiver(),
+                              false);
+    server_ = new GCodeServer(machine_, parser_, ack_window);
+
+    const int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;  // Any free port.
+    bind(listen_socket, (struct sockaddr*) &addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(listen_socket, (struct sockaddr*) &addr, &len);
+    port_ = ntohs(addr.sin_port);
+    listen(listen_socket, 8);  // Already now, so that we can connect.
+    listen_socket_ = listen_socket;
+    pthread_create(&thread_, NULL, &RunServer, this);
+  }
+
+  ~ServerHarness() {
+    delete server_;
+    delete parser_;
+    delete machine_;
+  }
+
+  // Stop server; returns the result of GCodeServer::Run().
+  int Stop() {
+    server_->RequestExit();
+    pthread_join(thread_, NULL);
+    return result_;
+  }
+
+  int Connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port_);
+    EXPECT_EQ(0, connect(fd, (struct sockaddr*) &addr, sizeof(addr)));
+    return fd;
+  }
+
+  void set_queue_full(bool full) { motor_ops_.full = full; }
+  void set_has_override(bool has) { motor_ops_.has_override = has; }
+
+  // Only to be looked at after Stop().
+  int steps() const { return motor_ops_.steps; }
+  float speed_override() const { return motor_ops_.speed_override; }
+
+private:
+  static void *RunServer(void *arg) {
+    ServerHarness *self = (ServerHarness *) arg;
+    self->result_ = self->server_->Run(self->listen_socket_);
+    return NULL;
+  }
+
+  CountingMotorOps motor_ops_;
+  HardwareMapping hardware_;
+  Spindle spindle_;
+  GCodeParser::Config::ParamMap parameters_;
+  GCodeMachineControl *machine_;
+  GCodeParser *parser_;
+  GCodeServer *server_;
+  int port_;
+  int listen_socket_;
+  int result_;
+  pthread_t thread_;
+};
+}  // namespace
+
+static void Send(int fd, const char *str) {
+  ASSERT_EQ((ssize_t)strlen(str), write(fd, str, strlen(str)));
+}
+
+// Read from "fd" until we have seen "count" times "ok\n" or time out.
+static std::string ReadAcks(int fd, int count) {
+  std::string result;
+  char buffer[1024];
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  for (;;) {
+    size_t seen = 0;
+    int acks = 0;
+    while ((seen = result.find("ok\n", seen)) != std::string::npos) {
+      ++acks;
+      seen += 3;
+    }
+    if (acks >= count || poll(&pfd, 1, 2000) <= 0)
+      break;
+    const ssize_t r = read(fd, buffer, sizeof(buffer));
+    if (r <= 0)
+      break;
+    result.append(buffer, r);
+  }
+  return result;
+}
+
+TEST(GCodeServer, GCodeStreamAndStatusClient) {
+  ServerHarness harness;
+  const int gcode_client = harness.Connect();
+  Send(gcode_client, "G1 X10 F1000\nG1 X20\n");
+  EXPECT_EQ("ok\nok\n", ReadAcks(gcode_client, 2));
+
+  // While the first stream is active, a second connection can only ask.
+  const int status_client = harness.Connect();
+  Send(status_client, "M114\n");
+  const std::string status = ReadAcks(status_client, 1);
+  EXPECT_NE(std::string::npos, status.find("busy")) << status;
+  EXPECT_NE(std::string::npos, status.find("X:")) << status;
+
+  Send(status_client, "G1 X100\n");
+  const std::string refused = ReadAcks(status_client, 1);
+  EXPECT_NE(std::string::npos, refused.find("only accepts")) << refused;
+
+  close(gcode_client);
+  close(status_client);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(20 * 100, harness.steps());  // The status client did not move.
+}
+
+TEST(GCodeServer, NextConnectionTakesOverStream) {
+  ServerHarness harness;
+  int client = harness.Connect();
+  Send(client, "G1 X10 F1000\n");
+  EXPECT_EQ("ok\n", ReadAcks(client, 1));
+  close(client);
+
+  // Once the first is gone, the next connection gets to send GCode. Pending
+  // connections might be status clients until the server saw the close,
+  // so retry a couple of times.
+  std::string response;
+  for (int i = 0; i < 100; ++i) {
+    client = harness.Connect();
+    Send(client, "G1 X20\n");
+    response = ReadAcks(client, 1);
+    close(client);
+    if (response == "ok\n") break;
+    usleep(10000);
+  }
+  EXPECT_EQ("ok\n", response);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(20 * 100, harness.steps());
+}
+
+TEST(GCodeServer, WindowedStreamGetsAllAcks) {
+  ServerHarness harness(16);
+  const int client = harness.Connect();
+  std::string window_full;
+  for (int i = 1; i <= 16; ++i) {
+    char line[32];
+    snprintf(line, sizeof(line), "G1 X%d F1000\n", i);
+    window_full.append(line);
+  }
+  Send(client, window_full.c_str());   // All in flight at once.
+  const std::string response = ReadAcks(client, 16);
+  EXPECT_EQ(0u, response.find("// BeagleG: ack-window 16\n")) << response;
+  std::string expected_acks;
+  for (int i = 0; i < 16; ++i) expected_acks.append("ok\n");
+  EXPECT_EQ(expected_acks, response.substr(response.find('\n') + 1));
+  close(client);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(16 * 100, harness.steps());
+}
+
+TEST(GCodeServer, MetricsQueryAndHttpEndpoint) {
+  ServerHarness harness;
+  // An HTTP scraper connecting first does not take the GCode stream.
+  int scraper = harness.Connect();
+  Send(scraper, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  std::string http;
+  char buffer[1024];
+  ssize_t r;
+  while ((r = read(scraper, buffer, sizeof(buffer))) > 0)  // Until close.
+    http.append(buffer, r);
+  close(scraper);
+  EXPECT_EQ(0u, http.find("HTTP/1.0 200 OK\r\n")) << http;
+  EXPECT_NE(std::string::npos, http.find("\nbeagleg_segments_total ")) << http;
+  EXPECT_NE(std::string::npos,
+            http.find("beagleg_queue_fill_bucket{le=\"+Inf\"}")) << http;
+
+  const int gcode_client = harness.Connect();
+  Send(gcode_client, "G1 X10 F1000\nM122\n");
+  const std::string response = ReadAcks(gcode_client, 2);
+  EXPECT_NE(std::string::npos, response.find("Planner halts:")) << response;
+  close(gcode_client);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(10 * 100, harness.steps());
+}
+
+// Whether "fd" has something to read within "timeout_ms".
+static bool HasInput(int fd, int timeout_ms) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+TEST(GCodeServer, StatusClientOverridesAndHolds) {
+  ServerHarness harness;
+  const int gcode_client = harness.Connect();
+  Send(gcode_client, "G1 X10 F1000\n");
+  EXPECT_EQ("ok\n", ReadAcks(gcode_client, 1));
+
+  const int status_client = harness.Connect();
+  Send(status_client, "M220 S50\n");
+  const std::string greeting = ReadAcks(status_client, 1);
+  EXPECT_EQ(std::string::npos, greeting.find("M220 needs")) << greeting;
+  Send(status_client, "M220\n");
+  EXPECT_NE(std::string::npos,
+            ReadAcks(status_client, 1).find("M220 needs"));
+  Send(status_client, "M220 S150\n");  // Faster than planned: refused.
+  EXPECT_NE(std::string::npos,
+            ReadAcks(status_client, 1).find("M220 needs"));
+
+  // On hold, the GCode stream is not processed ...
+  Send(status_client, "M25\n");
+  EXPECT_EQ("ok\n", ReadAcks(status_client, 1));
+  Send(gcode_client, "G1 X20\n");
+  EXPECT_FALSE(HasInput(gcode_client, 200));
+
+  // ... until resumed.
+  Send(status_client, "M24\n");
+  EXPECT_EQ("ok\n", ReadAcks(status_client, 1));
+  EXPECT_EQ("ok\n", ReadAcks(gcode_client, 1));
+
+  close(gcode_client);
+  close(status_client);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(20 * 100, harness.steps());
+  EXPECT_FLOAT_EQ(0.5, harness.speed_override());  // Back from hold.
+}
+
+TEST(GCodeServer, StatusClientOverridesNotSupported) {
+  ServerHarness harness;
+  harness.set_has_override(false);
+  const int gcode_client = harness.Connect();
+  Send(gcode_client, "G1 X10 F1000\n");
+  EXPECT_EQ("ok\n", ReadAcks(gcode_client, 1));
+
+  const int status_client = harness.Connect();
+  Send(status_client, "M220 S50\n");
+  EXPECT_NE(std::string::npos,
+            ReadAcks(status_client, 1).find("no real-time overrides"));
+
+  // Not on hold: the GCode stream keeps going.
+  Send(status_client, "M25\n");
+  EXPECT_NE(std::string::npos,
+            ReadAcks(status_client, 1).find("no real-time overrides"));
+  Send(gcode_client, "G1 X20\n");
+  EXPECT_EQ("ok\n", ReadAcks(gcode_client, 1));
+
+  close(gcode_client);
+  close(status_client);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(20 * 100, harness.steps());
+}
+
+TEST(GCodeServer, FullMotionQueueDoesNotBlockStatusClients) {
+  ServerHarness harness;
+  const int gcode_client = harness.Connect();
+  Send(gcode_client, "G1 X10 F1000\n");
+  EXPECT_EQ("ok\n", ReadAcks(gcode_client, 1));
+
+  // Lines are held back while the motion queue is full ...
+  harness.set_queue_full(true);
+  Send(gcode_client, "G1 X20\nG1 X30\n");
+  EXPECT_FALSE(HasInput(gcode_client, 200));
+
+  // ... without blocking the status clients.
+  const int status_client = harness.Connect();
+  Send(status_client, "M114\n");
+  const std::string status = ReadAcks(status_client, 1);
+  EXPECT_NE(std::string::npos, status.find("X:")) << status;
+
+  harness.set_queue_full(false);
+  EXPECT_EQ("ok\nok\n", ReadAcks(gcode_client, 2));
+
+  close(gcode_client);
+  close(status_client);
+  EXPECT_EQ(0, harness.Stop());
+  EXPECT_EQ(30 * 100, harness.steps());
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/null");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -29,8 +29,10 @@
 
 #include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -50,21 +52,72 @@ extern const char *viridis_colors[];
 extern const char *measureLinePS;
 }
 
+// Writes "value" with four decimals to "out", which is plenty for a preview
+// and a lot faster than going through printf() for every coordinate.
+// Returns the position after the last character written.
+static char *AppendNumber(char *out, float value) {
+  int64_t fixed = llroundf(value * 10000);
+  if (fixed < 0) {
+    *out++ = '-';
+    fixed = -fixed;
+  }
+  char digits[20];
+  int digit_count = 0;
+  int64_t integer_part = fixed / 10000;
+  do {
+    digits[digit_count++] = '0' + integer_part % 10;
+    integer_part /= 10;
+  } while (integer_part);
+  while (digit_count) *out++ = digits[--digit_count];
+  *out++ = '.';
+  int fraction = fixed % 10000;
+  for (int i = 3; i >= 0; --i) {
+    out[i] = '0' + fraction % 10;
+    fraction /= 10;
+  }
+  return out + 4;
+}
+
+// Print "<x> <y> <op>", e.g. op = "lineto\n".
+static void PrintCoordinates(FILE *out, float x, float y, const char *op) {
+  char buffer[64];
+  char *pos = AppendNumber(buffer, x);
+  *pos++ = ' ';
+  pos = AppendNumber(pos, y);
+  *pos++ = ' ';
+  fwrite(buffer, 1, pos - buffer, out);
+  fputs(op, out);
+}
+
 // Simple gcode visualizer. Takes the gcode and shows its range.
 // Takes two passes: first determines the bounding box to show axes, second
-// draws within these.
+// draws within these. Alternatively, a single pass does both; the bounding
+// box is then only known at the end.
 class GCodePrintVisualizer : public GCodeParser::EventReceiver {
 public:
   GCodePrintVisualizer(FILE *file, bool show_ijk, float scale)
     : file_(file), show_ijk_(show_ijk), scale_(scale),
-      segment_count_(0), pass_(1),
-      prefer_inch_display_(false) {
+      segment_count_(0), pass_(1), fixed_box_(false), resolution_(0),
+      last_x_(0), last_y_(0), pending_line_(false),
+      prefer_inch_display_(false), spindle_change_(0) {
   }
 
   // We have multiple passes to determine ranges first.
-  // Pass 1 - preparation, pass 2 - writing.
+  // Pass 1 - preparation, pass 2 - writing; pass 0 - both at once.
   void SetPass(int p) { pass_ = p; }
 
+  // Use this box instead of the range seen in the G-code.
+  void SetBoundingBox(float min_x, float min_y, float max_x, float max_y) {
+    min_[AXIS_X] = min_x;
+    min_[AXIS_Y] = min_y;
+    max_[AXIS_X] = max_x;
+    max_[AXIS_Y] = max_y;
+    fixed_box_ = true;
+  }
+
+  // Lines shorter than "mm" are merged with the following ones.
+  void SetResolution(float mm) { resolution_ = mm; }
+
   virtual void set_speed_factor(float f) {}
   virtual void set_temperature(float f) {}
   virtual void set_fanspeed(float speed) {}
@@ -72,7 +125,11 @@ public:
   virtual void motors_enable(bool b) {}
   virtual void go_home(AxisBitmap_t axes) {
     // TODO: this might actually be a different corner of machine.
-    if (pass_ == 2) fprintf(file_, "stroke 0 0 moveto  %% G28\n");
+    if (printing()) {
+      FlushPendingLine();
+      fprintf(file_, "stroke 0 0 moveto  %% G28\n");
+      last_x_ = last_y_ = 0;
+    }
   }
   virtual void inform_origin_offset(const AxesRegister& axes) {}
   virtual void dwell(float value) { }
@@ -80,23 +137,28 @@ public:
     return coordinated_move(feed, axes);
   }
   virtual bool coordinated_move(float feed, const AxesRegister &axes) {
-    if (pass_ == 1) {
+    if (pass_ != 2) {
       RememberMinMax(axes);
-    } else {
-      ++segment_count_;
-      if(spindle_change_) {
+    }
+    if (printing()) {
+      const float x = axes[AXIS_X], y = axes[AXIS_Y];
+      if (spindle_change_) {
         // Change path color when the spindle goes up or down
+        FlushPendingLine();
         fprintf(file_, "stroke\n"
-                "0.1 setlinewidth %i 0 0 setrgbcolor\n"
-                "%f %f moveto\n",
-                spindle_change_ > 1 ? 0 : 1, axes[AXIS_X], axes[AXIS_Y]);
+                "0.1 setlinewidth %i 0 0 setrgbcolor\n",
+                spindle_change_ > 1 ? 0 : 1);
+        PrintCoordinates(file_, x, y, "moveto\n");
         spindle_change_ = 0;
+      } else if (resolution_ > 0
+                 && hypotf(x - last_x_, y - last_y_) < resolution_) {
+        // Too small to see; the next line will take us here.
+        pending_x_ = x;
+        pending_y_ = y;
+        pending_line_ = true;
+        return true;
       }
-      fprintf(file_, "%f %f lineto\n", axes[AXIS_X], axes[AXIS_Y]);
-      if (segment_count_ % 256 == 0) {
-        // Flush graphic context.
-        fprintf(file_, "currentpoint\nstroke\nmoveto\n");
-      }
+      PrintLine(x, y);
     }
     return true;
   }
@@ -106,7 +168,8 @@ public:
                         const AxesRegister &start,
                         const AxesRegister &center,
                         const AxesRegister &end) {
-    if (pass_ == 2 && show_ijk_) {
+    if (printing() && show_ijk_) {
+      FlushPendingLine();
       fprintf(file_, "currentpoint currentpoint stroke\n"
               "gsave\n\tmoveto [0.5] 0 setdash 0.1 setlinewidth 0 0 0.9 setrgbcolor\n"
               "\t%f %f lineto %f %f lineto stroke\n"
@@ -121,7 +184,8 @@ public:
                            const AxesRegister &start,
                            const AxesRegister &cp1, const AxesRegister &cp2,
                            const AxesRegister &end) {
-    if (pass_ == 2 && show_ijk_) {
+    if (printing() && show_ijk_) {
+      FlushPendingLine();
       fprintf(file_, "currentpoint stroke\n"
               "gsave\n\t[0.5] 0 setdash 0.1 setlinewidth 0 0 0.9 setrgbcolor\n"
               "\t%f %f moveto %f %f lineto stroke\n"
@@ -158,14 +222,15 @@ public:
   }
 
   virtual void gcode_start(GCodeParser *parser) {
-    if (pass_ == 2) {
+    if (printing()) {
       fprintf(file_, "\n%% -- Path generated from GCode.\n");
       fprintf(file_, "0.1 setlinewidth 0 0 0 setrgbcolor\n0 0 moveto\n");
     }
   }
 
   virtual void gcode_finished(bool end_of_stream) {
-    if (pass_ == 2 && end_of_stream) {
+    if (printing() && end_of_stream) {
+      FlushPendingLine();
       fprintf(file_, "stroke\n");
     }
   }
@@ -181,43 +246,43 @@ public:
     return hypotf(max_[AXIS_X] - min_[AXIS_X], max_[AXIS_Y] - min_[AXIS_Y]);
   }
 
-  void PrintShowRange(float margin) {
-    fprintf(file_, "\n%% -- Print Dimensions\n");
-    fprintf(file_, "%s", measureLinePS);
-    fprintf(file_, "0 0 0.8 setrgbcolor 0.2 setlinewidth\n");
+  void PrintShowRange(FILE *out, float margin) {
+    fprintf(out, "\n%% -- Print Dimensions\n");
+    fprintf(out, "%s", measureLinePS);
+    fprintf(out, "0 0 0.8 setrgbcolor 0.2 setlinewidth\n");
     // Font-size dependent on overall drawing size.
-    fprintf(file_, "/Helvetica findfont %.1f scalefont setfont\n",
+    fprintf(out, "/Helvetica findfont %.1f scalefont setfont\n",
             std::max(1.0f, 0.015f * GetDiagonalLength()));
-    fprintf(file_, "\n%% -- Dotted box around item\n");
-    fprintf(file_, "%f %f moveto "
+    fprintf(out, "\n%% -- Dotted box around item\n");
+    fprintf(out, "%f %f moveto "
             "%f %f lineto stroke %% width\n",
             min_[AXIS_X], max_[AXIS_Y] + margin,
             max_[AXIS_X], max_[AXIS_Y] + margin);
-    fprintf(file_, "gsave 0.5 setgray 0.1 setlinewidth [1] 0 setdash\n");
-    fprintf(file_, "%f %f moveto %f %f lineto stroke\n",
+    fprintf(out, "gsave 0.5 setgray 0.1 setlinewidth [1] 0 setdash\n");
+    fprintf(out, "%f %f moveto %f %f lineto stroke\n",
             min_[AXIS_X], min_[AXIS_Y],
             min_[AXIS_X], max_[AXIS_Y]);
-    fprintf(file_, "%f %f moveto %f %f lineto stroke\n",
+    fprintf(out, "%f %f moveto %f %f lineto stroke\n",
             max_[AXIS_X], min_[AXIS_Y],
             max_[AXIS_X], max_[AXIS_Y]);
-    fprintf(file_, "%f %f moveto %f %f lineto stroke\n",
+    fprintf(out, "%f %f moveto %f %f lineto stroke\n",
             min_[AXIS_X], min_[AXIS_Y],
             max_[AXIS_X], min_[AXIS_Y]);
-    fprintf(file_, "%f %f moveto %f %f lineto stroke\n",
+    fprintf(out, "%f %f moveto %f %f lineto stroke\n",
             min_[AXIS_X], max_[AXIS_Y],
             max_[AXIS_X], max_[AXIS_Y]);
-    fprintf(file_, "stroke grestore\n");
+    fprintf(out, "stroke grestore\n");
     const float df = prefer_inch_display_ ? 25.4f : 1.0f;  // display factor
     const int resolution = prefer_inch_display_ ? 3 : 2;
     const char *measure_unit = prefer_inch_display_ ? "\"" : "mm";
-    fprintf(file_, "%f %f moveto (%.*f) (%.*f%s) (%.*f) %f MeasureLine\n",
+    fprintf(out, "%f %f moveto (%.*f) (%.*f%s) (%.*f) %f MeasureLine\n",
             min_[AXIS_X], max_[AXIS_Y] + margin,
             resolution, min_[AXIS_X]/df,
             resolution, (max_[AXIS_X]-min_[AXIS_X])/df, measure_unit,
             resolution, max_[AXIS_X]/df,
             (max_[AXIS_X]-min_[AXIS_X]));
 
-    fprintf(file_, "gsave %f %f translate -90 rotate 0 0 moveto (%.*f) (%.*f%s) (%.*f) %f MeasureLine grestore\n",
+    fprintf(out, "gsave %f %f translate -90 rotate 0 0 moveto (%.*f) (%.*f%s) (%.*f) %f MeasureLine grestore\n",
             max_[AXIS_X] + margin, max_[AXIS_Y],
             resolution, max_[AXIS_Y]/df,
             resolution, (max_[AXIS_Y]-min_[AXIS_Y])/df, measure_unit,
@@ -225,14 +290,14 @@ public:
             (max_[AXIS_Y]-min_[AXIS_Y]));
   }
 
-  void ShowHomePos() {
-    fprintf(file_, "0 1 1 setrgbcolor 0.4 setlinewidth\n");
-    fprintf(file_, "0 0 moveto 0 0 0.5 0 360 arc closepath "
+  void ShowHomePos(FILE *out) {
+    fprintf(out, "0 1 1 setrgbcolor 0.4 setlinewidth\n");
+    fprintf(out, "0 0 moveto 0 0 0.5 0 360 arc closepath "
             "gsave 0 setgray fill grestore stroke %% This is the home pos.\n");
   }
 
-  void PrintPostscriptBoundingBox(float margin_x, float margin_y) {
-    fprintf(file_, "%%!PS-Adobe-3.0 EPSF-3.0\n"
+  void PrintPostscriptBoundingBox(FILE *out, float margin_x, float margin_y) {
+    fprintf(out, "%%!PS-Adobe-3.0 EPSF-3.0\n"
             "%%%%BoundingBox: %d %d %d %d\n",
             ToPoint(scale_ * (min_[AXIS_X] - 10)),
             ToPoint(scale_ * (min_[AXIS_Y] - 10)),
@@ -241,7 +306,25 @@ public:
   }
 
 private:
+  bool printing() const { return pass_ != 1; }
+
+  void PrintLine(float x, float y) {
+    PrintCoordinates(file_, x, y, "lineto\n");
+    last_x_ = x;
+    last_y_ = y;
+    pending_line_ = false;
+    if (++segment_count_ % 256 == 0) {
+      // Flush graphic context.
+      fputs("currentpoint\nstroke\nmoveto\n", file_);
+    }
+  }
+
+  void FlushPendingLine() {
+    if (pending_line_) PrintLine(pending_x_, pending_y_);
+  }
+
   void RememberMinMax(const AxesRegister &axes) {
+    if (fixed_box_) return;
     if (axes[AXIS_X] < min_[AXIS_X]) min_[AXIS_X] = axes[AXIS_X];
     if (axes[AXIS_Y] < min_[AXIS_Y]) min_[AXIS_Y] = axes[AXIS_Y];
     if (axes[AXIS_Z] < min_[AXIS_Z]) min_[AXIS_Z] = axes[AXIS_Z];
@@ -262,6 +345,11 @@ private:
   AxesRegister max_;
   unsigned int segment_count_;
   int pass_;
+  bool fixed_box_;
+  float resolution_;
+  float last_x_, last_y_;      // Last point we drew a line to.
+  float pending_x_, pending_y_;
+  bool pending_line_;          // Skipped a short line to pending_x_/y_
   bool prefer_inch_display_;
 
   int spindle_change_; // 0 = no change, 1 = up, 
@@ -269,7 +357,9 @@ private:
 
 // Taking the low-level motor operations and visualize them. Uses color
 // to visualize speed. Needs two passes - first pass determines available
-// speed range, second outputs PostScript with colored segments.
+// speed range, second outputs PostScript with colored segments. In a single
+// pass, the colors are looked up by the PostScript interpreter in the
+// table PrintSpeedColorDefinitions() writes once the range is known.
 // This also helps do determine if things line up properly with what the gcode
 // parser spits out.
 class MotorOperationsPrinter : public MotorOperations {
@@ -278,7 +368,8 @@ public:
                          float tool_dia, bool show_speeds)
     : file_(file), config_(config), show_speeds_(show_speeds), segment_count_(0),
       min_v_(1e6), max_v_(-1e6), pass_(0), color_segment_length_(1),
-      last_color_index_(-1) {
+      last_color_index_(-1), resolution_(0),
+      pending_dx_(0), pending_dy_(0), pending_v_(0) {
     fprintf(file_, "\n%% -- Machine path. %s\n",
             show_speeds ? "Visualizing travel speeds" : "Simple.");
     fprintf(file_, "%% Note, larger tool diameters slow down "
@@ -293,19 +384,37 @@ public:
   }
 
   ~MotorOperationsPrinter() {
+    FlushPendingMove();
     fprintf(file_, "stroke %% Finished Machine Pathstroke\n");
   }
 
+  // Pass 1 - determine speed range, pass 2 - writing; pass 0 - both at once.
   void SetPass(int p) {
     pass_ = p;
     if (pass_ == 2) {
-      min_color_range_ = min_v_ + 0.1 * (max_v_ - min_v_);
-      max_color_range_ = max_v_ - 0.1 * (max_v_ - min_v_);
-      fprintf(stderr, "Speed: [%.2f..%.2f]; Coloring span [%.2f..%.2f]\n",
-              min_v_, max_v_, min_color_range_, max_color_range_);
+      DetermineColorRange();
     }
   }
 
+  // Lines shorter than "mm" are merged with the following ones.
+  void SetResolution(float mm) { resolution_ = mm; }
+
+  // Single pass: now that all speeds are seen, define the "speedcolor"
+  // PostScript procedure used in the path. To be printed before the path.
+  void PrintSpeedColorDefinitions(FILE *out) {
+    DetermineColorRange();
+    fprintf(out, "\n%% -- Speed to color\n/viridis [\n");
+    for (int i = 0; i < 256; ++i) {
+      fprintf(out, "[%s]\n", viridis_colors[i]);
+    }
+    fprintf(out, "] def\n");
+    const float span = std::max(max_color_range_ - min_color_range_, 1e-6f);
+    fprintf(out, "/speedcolor { %f sub %f div 255 mul round cvi "
+            "dup 0 lt { pop 0 } if dup 255 gt { pop 255 } if "
+            "viridis exch get aload pop setrgbcolor } def\n",
+            min_color_range_, span);
+  }
+
   void RememberMinMax(float v) {
     if (v > max_v_) max_v_ = v;
     if (v < min_v_) min_v_ = v;
@@ -322,33 +431,11 @@ public:
       return;  // Nothing really to do.
     }
 
-    switch (pass_) {
-    case 1: {
-      // A very short diagnoal move, quantized to steps has a speed of sqrt(2);
-      // let's not include these in the min/max calculation.
-      if (abs(param.steps[AXIS_X])
-          + abs(param.steps[AXIS_Y])
-          + abs(param.steps[AXIS_Z]) <= 3)
-        break;  // don't include super-short segments in the MinMax
-
-      const float dx_mm = param.steps[AXIS_X] / config_.steps_per_mm[AXIS_X];
-      const float dy_mm = param.steps[AXIS_Y] / config_.steps_per_mm[AXIS_Y];
-      const float dz_mm = param.steps[AXIS_Z] / config_.steps_per_mm[AXIS_Z];
-      const float segment_len = sqrtf(dx_mm*dx_mm + dy_mm*dy_mm + dz_mm*dz_mm);
-      // The step speed is given by the dominant axis; however the actual
-      // segment speed depends on the actual travel in euclidian space.
-      const float segment_speed_factor = segment_len /
-        (abs(param.steps[dominant_axis]) / config_.steps_per_mm[dominant_axis]);
-
-      RememberMinMax(segment_speed_factor *
-                     (param.v0 / config_.steps_per_mm[dominant_axis]));
-      RememberMinMax(segment_speed_factor *
-                     (param.v1 / config_.steps_per_mm[dominant_axis]));
+    if (pass_ != 2) {
+      CollectSpeeds(param, dominant_axis);
     }
-      break;
-    case 2:
+    if (pass_ != 1) {
       PrintSegment(param, dominant_axis);
-      break;
     }
   }
 
@@ -363,11 +450,6 @@ public:
     const float dz_mm = param.steps[AXIS_Z] / config_.steps_per_mm[AXIS_Z];
 
     if (show_speeds_) {
-      fprintf(file_, "%% dx: %f dy: %f %s (speed: %.1f->%.1f)\n", dx_mm, dy_mm,
-              param.v0 == param.v1 ? "; steady move" :
-              ((param.v0 < param.v1) ? "; accel" : "; decel"),
-              param.v0/config_.steps_per_mm[dominant_axis],
-              param.v1/config_.steps_per_mm[dominant_axis]);
       const float segment_len = sqrtf(dx_mm*dx_mm + dy_mm*dy_mm + dz_mm*dz_mm);
       if (segment_len == 0)
         return;  // If not in x/y plane.
@@ -375,6 +457,17 @@ public:
       // physical speed depends on the actual travel in euclidian space.
       const float segment_speed_factor = segment_len /
         (abs(param.steps[dominant_axis]) / config_.steps_per_mm[dominant_axis]);
+      if (segment_len < resolution_) {
+        AddPendingMove(dx_mm, dy_mm, segment_speed_factor * param.v1
+                       / config_.steps_per_mm[dominant_axis]);
+        return;
+      }
+      FlushPendingMove();
+      fprintf(file_, "%% dx: %f dy: %f %s (speed: %.1f->%.1f)\n", dx_mm, dy_mm,
+              param.v0 == param.v1 ? "; steady move" :
+              ((param.v0 < param.v1) ? "; accel" : "; decel"),
+              param.v0/config_.steps_per_mm[dominant_axis],
+              param.v1/config_.steps_per_mm[dominant_axis]);
       int segments = 1;
       if (param.v0 != param.v1) {
         segments = segment_len / color_segment_length_;
@@ -384,20 +477,8 @@ public:
         float v = param.v0 + i * (param.v1 - param.v0)/segments;
         v /= config_.steps_per_mm[dominant_axis];
         v *= segment_speed_factor;
-        int col_idx;
-        if (v < min_color_range_) col_idx = 0;
-        else if (v > max_color_range_) col_idx = 255;
-        else {
-          col_idx = roundf(255.0 * (v - min_color_range_)
-                           / (max_color_range_-min_color_range_));
-        }
-        assert(col_idx >= 0 && col_idx < 256);
-        if (col_idx != last_color_index_) {
-          fprintf(file_, "%s setrgbcolor ", viridis_colors[col_idx]);
-          last_color_index_ = col_idx;
-        }
-        fprintf(file_, "%f %f rlineto ",
-                dx_mm/segments, dy_mm/segments);
+        SetSpeedColor(v);
+        PrintCoordinates(file_, dx_mm/segments, dy_mm/segments, "rlineto ");
         fprintf(file_, "currentpoint stroke moveto");
         fprintf(file_, " %% %.1f mm/s [%s]", v,
                 param.v0 == param.v1 ? "=" : (param.v0 < param.v1 ? "^" : "v"));
@@ -407,11 +488,7 @@ public:
         fprintf(file_, "\n");
       }
     } else {
-      fprintf(file_, "%f %f rlineto\n", dx_mm, dy_mm);
-      ++segment_count_;
-      if (segment_count_ % 256 == 0) {
-        fprintf(file_, "currentpoint\nstroke\nmoveto\n");
-      }
+      AddPendingMove(dx_mm, dy_mm, 0);
     }
   }
 
@@ -468,6 +545,86 @@ public:
   }
 
 private:
+  void CollectSpeeds(const LinearSegmentSteps &param, int dominant_axis) {
+    // A very short diagnoal move, quantized to steps has a speed of sqrt(2);
+    // let's not include these in the min/max calculation.
+    if (abs(param.steps[AXIS_X])
+        + abs(param.steps[AXIS_Y])
+        + abs(param.steps[AXIS_Z]) <= 3)
+      return;  // don't include super-short segments in the MinMax
+
+    const float dx_mm = param.steps[AXIS_X] / config_.steps_per_mm[AXIS_X];
+    const float dy_mm = param.steps[AXIS_Y] / config_.steps_per_mm[AXIS_Y];
+    const float dz_mm = param.steps[AXIS_Z] / config_.steps_per_mm[AXIS_Z];
+    const float segment_len = sqrtf(dx_mm*dx_mm + dy_mm*dy_mm + dz_mm*dz_mm);
+    // The step speed is given by the dominant axis; however the actual
+    // segment speed depends on the actual travel in euclidian space.
+    const float segment_speed_factor = segment_len /
+      (abs(param.steps[dominant_axis]) / config_.steps_per_mm[dominant_axis]);
+
+    RememberMinMax(segment_speed_factor *
+                   (param.v0 / config_.steps_per_mm[dominant_axis]));
+    RememberMinMax(segment_speed_factor *
+                   (param.v1 / config_.steps_per_mm[dominant_axis]));
+  }
+
+  void DetermineColorRange() {
+    min_color_range_ = min_v_ + 0.1 * (max_v_ - min_v_);
+    max_color_range_ = max_v_ - 0.1 * (max_v_ - min_v_);
+    fprintf(stderr, "Speed: [%.2f..%.2f]; Coloring span [%.2f..%.2f]\n",
+            min_v_, max_v_, min_color_range_, max_color_range_);
+  }
+
+  void SetSpeedColor(float v) {
+    if (pass_ == 0) {
+      // Range not known yet; the PostScript interpreter looks it up.
+      const int col_idx = roundf(v * 10);  // Don't repeat for the same speed.
+      if (col_idx != last_color_index_) {
+        fprintf(file_, "%.1f speedcolor ", v);
+        last_color_index_ = col_idx;
+      }
+      return;
+    }
+    int col_idx;
+    if (v < min_color_range_) col_idx = 0;
+    else if (v > max_color_range_) col_idx = 255;
+    else {
+      col_idx = roundf(255.0 * (v - min_color_range_)
+                       / (max_color_range_-min_color_range_));
+    }
+    assert(col_idx >= 0 && col_idx < 256);
+    if (col_idx != last_color_index_) {
+      fprintf(file_, "%s setrgbcolor ", viridis_colors[col_idx]);
+      last_color_index_ = col_idx;
+    }
+  }
+
+  // Moves shorter than the resolution are collected until they add up.
+  void AddPendingMove(float dx_mm, float dy_mm, float v) {
+    pending_dx_ += dx_mm;
+    pending_dy_ += dy_mm;
+    pending_v_ = v;
+    if (hypotf(pending_dx_, pending_dy_) >= resolution_) {
+      FlushPendingMove();
+    }
+  }
+
+  void FlushPendingMove() {
+    if (pending_dx_ == 0 && pending_dy_ == 0)
+      return;
+    if (show_speeds_) {
+      SetSpeedColor(pending_v_);
+      PrintCoordinates(file_, pending_dx_, pending_dy_,
+                       "rlineto currentpoint stroke moveto\n");
+    } else {
+      PrintCoordinates(file_, pending_dx_, pending_dy_, "rlineto\n");
+      if (++segment_count_ % 256 == 0) {
+        fputs("currentpoint\nstroke\nmoveto\n", file_);
+      }
+    }
+    pending_dx_ = pending_dy_ = 0;
+  }
+
   FILE *const file_;
   const MachineControlConfig &config_;
   const bool show_speeds_;
@@ -477,10 +634,148 @@ private:
   int pass_;
   float color_segment_length_;
   int last_color_index_;
+  float resolution_;
+  float pending_dx_, pending_dy_;  // Moves not printed yet.
+  float pending_v_;
 
   MotorOperationsPrinter(const MotorOperationsPrinter &);
 };
 
+// Draws the planned machine path into a raster, colored by the speed the
+// planner gives each segment; a single pass, as the area to show is known
+// in advance. Where paths overlap, the slower one wins, so that slow spots
+// don't get painted over.
+class MotorOperationsRasterizer : public MotorOperations {
+public:
+  // Shows the area from (min_x, min_y) to (max_x, max_y), in mm, with
+  // "width" pixels; the machine starts at (start_x, start_y).
+  MotorOperationsRasterizer(const MachineControlConfig &config, int width,
+                            float min_x, float min_y, float max_x, float max_y,
+                            float start_x, float start_y)
+    : config_(config), width_(width),
+      height_(std::max(1, (int) roundf(width * (max_y - min_y)
+                                        / (max_x - min_x)))),
+      min_x_(min_x), min_y_(min_y),
+      pixel_per_mm_(width / (max_x - min_x)),
+      x_(start_x), y_(start_y),
+      min_v_(1e6), max_v_(-1e6),
+      speed_(new float[width_ * height_]) {
+    std::fill(speed_, speed_ + width_ * height_, -1.0f);  // Not visited.
+  }
+  ~MotorOperationsRasterizer() { delete [] speed_; }
+
+  virtual void Enqueue(const LinearSegmentSteps &param) {
+    int dominant_axis = 0;
+    for (int i = 1; i < BEAGLEG_NUM_MOTORS; ++i) {
+      if (abs(param.steps[i]) > abs(param.steps[dominant_axis]))
+        dominant_axis = i;
+    }
+    if (config_.steps_per_mm[dominant_axis] == 0 ||
+        param.steps[dominant_axis] == 0) {
+      return;  // Nothing really to do.
+    }
+    const float dx_mm = param.steps[AXIS_X] / config_.steps_per_mm[AXIS_X];
+    const float dy_mm = param.steps[AXIS_Y] / config_.steps_per_mm[AXIS_Y];
+    const float dz_mm = param.steps[AXIS_Z] / config_.steps_per_mm[AXIS_Z];
+    const float segment_len = sqrtf(dx_mm*dx_mm + dy_mm*dy_mm + dz_mm*dz_mm);
+    // The step speed is given by the dominant axis; however the actual
+    // physical speed depends on the actual travel in euclidian space.
+    const float speed_factor = segment_len /
+      (abs(param.steps[dominant_axis]) / config_.steps_per_mm[dominant_axis]);
+    const float v0 = speed_factor * param.v0
+      / config_.steps_per_mm[dominant_axis];
+    const float v1 = speed_factor * param.v1
+      / config_.steps_per_mm[dominant_axis];
+    // Same as in MotorOperationsPrinter: quantized super-short segments
+    // have bogus speeds.
+    if (abs(param.steps[AXIS_X]) + abs(param.steps[AXIS_Y])
+        + abs(param.steps[AXIS_Z]) > 3) {
+      RememberMinMax(v0);
+      RememberMinMax(v1);
+    }
+    DrawLine(x_, y_, x_ + dx_mm, y_ + dy_mm, v0, v1);
+    x_ += dx_mm;
+    y_ += dy_mm;
+  }
+
+  virtual void MotorEnable(bool on) {}
+  virtual void WaitQueueEmpty() {}
+
+  // Write binary PPM. Speeds are mapped to the viridis colors over the same
+  // span as the PostScript output; the background is white.
+  bool WritePPM(FILE *out) {
+    const float min_color = min_v_ + 0.1 * (max_v_ - min_v_);
+    const float max_color = max_v_ - 0.1 * (max_v_ - min_v_);
+    fprintf(stderr, "Speed: [%.2f..%.2f]; Coloring span [%.2f..%.2f]\n",
+            min_v_, max_v_, min_color, max_color);
+    uint8_t palette[256][3];
+    for (int i = 0; i < 256; ++i) {
+      float r, g, b;
+      sscanf(viridis_colors[i], "%f %f %f", &r, &g, &b);
+      palette[i][0] = roundf(255 * r);
+      palette[i][1] = roundf(255 * g);
+      palette[i][2] = roundf(255 * b);
+    }
+    fprintf(out, "P6\n%d %d\n255\n", width_, height_);
+    uint8_t *row = new uint8_t[3 * width_];
+    for (int y = height_ - 1; y >= 0; --y) {  // PPM goes top to bottom.
+      for (int x = 0; x < width_; ++x) {
+        const float v = speed_[y * width_ + x];
+        uint8_t *const pixel = row + 3 * x;
+        if (v < 0) {
+          pixel[0] = pixel[1] = pixel[2] = 255;
+          continue;
+        }
+        int col_idx;
+        if (v <= min_color || max_color <= min_color) col_idx = 0;
+        else if (v >= max_color) col_idx = 255;
+        else col_idx = roundf(255.0 * (v - min_color) / (max_color - min_color));
+        memcpy(pixel, palette[col_idx], 3);
+      }
+      fwrite(row, 3, width_, out);
+    }
+    delete [] row;
+    return !ferror(out);
+  }
+
+private:
+  void RememberMinMax(float v) {
+    if (v > max_v_) max_v_ = v;
+    if (v < min_v_) min_v_ = v;
+  }
+
+  // Line in mm, with the speed changing linearly from v0 to v1.
+  void DrawLine(float x0, float y0, float x1, float y1, float v0, float v1) {
+    const float px0 = (x0 - min_x_) * pixel_per_mm_;
+    const float py0 = (y0 - min_y_) * pixel_per_mm_;
+    const float px1 = (x1 - min_x_) * pixel_per_mm_;
+    const float py1 = (y1 - min_y_) * pixel_per_mm_;
+    const int steps = std::max(1, (int) ceilf(std::max(fabsf(px1 - px0),
+                                                       fabsf(py1 - py0))));
+    for (int i = 0; i <= steps; ++i) {
+      const float t = (float) i / steps;
+      const int x = (int) floorf(px0 + t * (px1 - px0));
+      const int y = (int) floorf(py0 + t * (py1 - py0));
+      if (x < 0 || x >= width_ || y < 0 || y >= height_)
+        continue;
+      const float v = v0 + t * (v1 - v0);
+      float *const pixel = &speed_[y * width_ + x];
+      if (*pixel < 0 || v < *pixel) *pixel = v;
+    }
+  }
+
+  const MachineControlConfig &config_;
+  const int width_;
+  const int height_;
+  const float min_x_, min_y_;
+  const float pixel_per_mm_;
+  float x_, y_;                 // Current position in mm.
+  float min_v_, max_v_;
+  float *const speed_;          // Per pixel; negative: not visited.
+
+  MotorOperationsRasterizer(const MotorOperationsRasterizer &);
+};
+
 static int usage(const char *progname) {
   fprintf(stderr, "Usage: %s [options] <gcode-file>\n"
           "Options:\n"
@@ -492,13 +787,24 @@ static int usage(const char *progname) {
           "\t-D                : show dimensions\n"
           "\t-S<factor>        : Scale the output (e.g. to fit on page)\n"
           "\t-i                : Toggle show IJK control lines\n"
+          "\t-1                : Parse only once, buffering the output in\n"
+          "\t                    temporary files. Allows '-' for stdin.\n"
+          "\t-B <x0,y0,x1,y1>  : Bounding box in mm to show, instead of\n"
+          "\t                    the range of the G-code.\n"
+          "\t-R <mm>           : Merge lines shorter than this; speeds up\n"
+          "\t                    rendering of huge files (Default: 0).\n"
+          "\t-P <width>        : Instead of PostScript, write a PPM image\n"
+          "\t                    <width> pixels wide, of the machine path\n"
+          "\t                    colored by planned speed. Needs -c; shows\n"
+          "\t                    the -B box or the machine range.\n"
           "Without config, only GCode path is shown; with config also the\n"
           "actual machine path.\n", progname);
   return 1;
 }
 
 static bool ParseFile(GCodeParser *parser, const char *filename, bool do_reset) {
-  const int fd = open(filename, O_RDONLY);
+  const bool is_stdin = (strcmp(filename, "-") == 0);
+  const int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
   if (fd < 0) {
     fprintf(stderr, "Cannot open %s\n", filename);
     return false;
@@ -508,118 +814,226 @@ static bool ParseFile(GCodeParser *parser, const char *filename, bool do_reset)
   // Make sure to reset parser properly.
   if (do_reset) parser->ParseLine("G28 M02", stderr);  // M02 needs to be last.
 
-  close(fd);
+  if (!is_stdin) close(fd);
   return true;
 }
 
-int main(int argc, char *argv[]) {
-  const char *config_file = NULL;
-  FILE *output_file = stdout;
-  float tool_diameter_mm = 2;
-  bool show_dimensions = true;
-  float threshold_angle = 0;
-  bool show_speeds = false;
-  bool range_check = false;
-  bool show_ijk = true;
-  float scale = 1.0f;
-
-  int opt;
-  while ((opt = getopt(argc, argv, "o:c:T:Dt:srS:i")) != -1) {
-    switch (opt) {
-    case 'o':
-      output_file = fopen(optarg, "w");
-      break;
-    case 't':
-      threshold_angle = (float)atof(optarg);
-      break;
-    case 'c':
-      config_file = strdup(optarg);
-      break;
-    case 'D':
-      show_dimensions = true;
-      break;
-    case 'T':
-      tool_diameter_mm = atof(optarg);
-      break;
-    case 's':
-      show_speeds = true;
-      break;
-    case 'S':
-      scale = atof(optarg);
-      break;
-    case 'i':
-      show_ijk = !show_ijk;
-      break;
-    case 'r':
-      range_check = true;
-      break;
-    default:
-      return usage(argv[0]);
-    }
+namespace {
+struct RenderOptions {
+  RenderOptions()
+    : config_file(NULL), tool_diameter_mm(2), show_dimensions(true),
+      threshold_angle(0), show_speeds(false), range_check(false),
+      show_ijk(true), scale(1.0f), resolution_mm(0), fixed_box(false),
+      raster_width(0) {}
+
+  const char *config_file;
+  float tool_diameter_mm;
+  bool show_dimensions;
+  float threshold_angle;
+  bool show_speeds;
+  bool range_check;
+  bool show_ijk;
+  float scale;
+  float resolution_mm;
+  bool fixed_box;
+  float box[4];  // min x, min y, max x, max y
+  int raster_width;  // If non-zero: PPM speed heatmap instead of PostScript.
+};
+
+// Single pass: hands every event to the G-code visualizer as well as to
+// the machine control.
+class TeeEventReceiver : public GCodeParser::EventReceiver {
+public:
+  TeeEventReceiver(GCodeParser::EventReceiver *gcode,
+                   GCodeParser::EventReceiver *machine)
+    : gcode_(gcode), machine_(machine) {}
+
+  virtual void gcode_start(GCodeParser *parser) {
+    gcode_->gcode_start(parser);
+    machine_->gcode_start(parser);
+  }
+  virtual void gcode_finished(bool end_of_stream) {
+    gcode_->gcode_finished(end_of_stream);
+    machine_->gcode_finished(end_of_stream);
+  }
+  virtual void inform_origin_offset(const AxesRegister& offset) {
+    gcode_->inform_origin_offset(offset);
+    machine_->inform_origin_offset(offset);
+  }
+  virtual void gcode_command_done(char letter, float val) {
+    gcode_->gcode_command_done(letter, val);
+    machine_->gcode_command_done(letter, val);
+  }
+  virtual void go_home(AxisBitmap_t axes) {
+    gcode_->go_home(axes);
+    machine_->go_home(axes);
+  }
+  virtual bool probe_axis(float feed, enum GCodeParserAxis axis,
+                          float *probed_position) {
+    return machine_->probe_axis(feed, axis, probed_position);
+  }
+  virtual void set_speed_factor(float f) {
+    gcode_->set_speed_factor(f);
+    machine_->set_speed_factor(f);
+  }
+  virtual void set_fanspeed(float speed) {
+    gcode_->set_fanspeed(speed);
+    machine_->set_fanspeed(speed);
+  }
+  virtual void set_temperature(float degrees_c) {
+    gcode_->set_temperature(degrees_c);
+    machine_->set_temperature(degrees_c);
+  }
+  virtual void wait_temperature() {
+    gcode_->wait_temperature();
+    machine_->wait_temperature();
+  }
+  virtual void dwell(float time_ms) {
+    gcode_->dwell(time_ms);
+    machine_->dwell(time_ms);
+  }
+  virtual void motors_enable(bool enable) {
+    gcode_->motors_enable(enable);
+    machine_->motors_enable(enable);
+  }
+  virtual bool coordinated_move(float feed, const AxesRegister &axes) {
+    gcode_->coordinated_move(feed, axes);
+    return machine_->coordinated_move(feed, axes);
+  }
+  virtual bool rapid_move(float feed, const AxesRegister &axes) {
+    gcode_->rapid_move(feed, axes);
+    return machine_->rapid_move(feed, axes);
+  }
+  virtual void arc_move(float feed_mm_p_sec,
+                        GCodeParserAxis normal_axis, bool clockwise,
+                        const AxesRegister &start,
+                        const AxesRegister &center,
+                        const AxesRegister &end) {
+    gcode_->arc_move(feed_mm_p_sec, normal_axis, clockwise, start, center, end);
+    machine_->arc_move(feed_mm_p_sec, normal_axis, clockwise,
+                       start, center, end);
+  }
+  virtual void spline_move(float feed_mm_p_sec,
+                           const AxesRegister &start,
+                           const AxesRegister &cp1, const AxesRegister &cp2,
+                           const AxesRegister &end) {
+    gcode_->spline_move(feed_mm_p_sec, start, cp1, cp2, end);
+    machine_->spline_move(feed_mm_p_sec, start, cp1, cp2, end);
+  }
+  virtual const char *unprocessed(char letter, float value,
+                                  const char *rest_of_line) {
+    // The visualizer only looks at the letter; the machine gets the rest.
+    gcode_->unprocessed(letter, value, rest_of_line);
+    return machine_->unprocessed(letter, value, rest_of_line);
   }
 
-  if (optind >= argc)
-    return usage(argv[0]);
+private:
+  GCodeParser::EventReceiver *const gcode_;
+  GCodeParser::EventReceiver *const machine_;
+};
+}  // namespace
+
+// Read the machine configuration and set up the parser to start at its
+// home position.
+static bool ReadMachineConfig(const RenderOptions &opt,
+                              MachineControlConfig *machine_config,
+                              GCodeParser::Config *parser_cfg) {
+  ConfigParser config_parser;
+  if (!config_parser.SetContentFromFile(opt.config_file)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", opt.config_file);
+    return false;
+  }
+  if (!machine_config->ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
+            opt.config_file);
+    return false;
+  }
+  machine_config->threshold_angle = opt.threshold_angle;
+
+  // This is not connected to any machine. Don't assume homing, but
+  // at least extract the home position from the config.
+  machine_config->require_homing = false;
+  for (const GCodeParserAxis axis : AllAxes()) {
+    HardwareMapping::AxisTrigger trigger = machine_config->homing_trigger[axis];
+    parser_cfg->machine_origin[axis] =
+      (trigger & HardwareMapping::TRIGGER_MAX)
+      ? machine_config->move_range_mm[axis]
+      : 0;
+  }
 
-  if (output_file == NULL) {
-    fprintf(stderr, "Could not create output file.\n");
-    return 1;
+  machine_config->acknowledge_lines = false;
+  machine_config->range_check = opt.range_check;
+  return true;
+}
+
+static GCodeMachineControl *CreateMachineControl(
+  const MachineControlConfig &machine_config, MotorOperations *motor_ops,
+  HardwareMapping *hardware, Spindle *spindle) {
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(machine_config, motor_ops,
+                                  hardware, spindle, stderr);
+  if (!machine_control) {
+    // Ups, let's do it again with logging enabled.
+    Log_init("/dev/stderr");
+    Log_error("Cannot initialize machine:");
+    GCodeMachineControl::Create(machine_config, motor_ops,
+                                hardware, spindle, stderr);
   }
+  return machine_control;
+}
 
-  const float printMargin = 2 + tool_diameter_mm/2;
+static void PrintPageSetup(FILE *output_file, const RenderOptions &opt,
+                           GCodePrintVisualizer *gcode_printer) {
+  const float printMargin = 2 + opt.tool_diameter_mm/2;
+  gcode_printer->PrintPostscriptBoundingBox(output_file,
+    printMargin, printMargin + (opt.show_speeds ? 15 : 0));
 
-  Log_init("/dev/null");
+  fprintf(output_file, "72 25.4 div dup scale  %% Numbers mean millimeter\n");
+  if (opt.scale != 1.0f) {
+    fprintf(output_file, "%f %f scale  %% Scale for page fit\n",
+            opt.scale, opt.scale);
+  }
+  if (opt.show_dimensions) {
+    gcode_printer->PrintShowRange(output_file, printMargin);
+  }
+}
 
-  // TODO(hzeller): only parse the file once, so that we can read from stdin.
-  const char *filename = argv[optind];
+// Copy everything written to the temporary file "from" to "to".
+static void AppendFile(FILE *from, FILE *to) {
+  char buffer[65536];
+  size_t len;
+  fflush(from);
+  rewind(from);
+  while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+    fwrite(buffer, 1, len, to);
+  }
+}
 
+// Parse the file once to determine the ranges, then again to draw; first
+// the machine path, then the G-code on top.
+static int RenderTwoPass(const char *filename, FILE *output_file,
+                         const RenderOptions &opt) {
   GCodeParser::Config parser_cfg;
   GCodeParser::Config::ParamMap parameters;  // TODO: read from file ?
   parser_cfg.parameters = &parameters;
 
-  GCodePrintVisualizer gcode_printer(output_file, show_ijk, scale);
+  GCodePrintVisualizer gcode_printer(output_file, opt.show_ijk, opt.scale);
+  gcode_printer.SetResolution(opt.resolution_mm);
+  if (opt.fixed_box) {
+    gcode_printer.SetBoundingBox(opt.box[0], opt.box[1],
+                                 opt.box[2], opt.box[3]);
+  }
   gcode_printer.SetPass(1);
   GCodeParser gcode_viz_parser(parser_cfg, &gcode_printer, false);
-  ParseFile(&gcode_viz_parser, filename, true);
-
-  gcode_printer.PrintPostscriptBoundingBox(printMargin,
-                                           printMargin + (show_speeds ? 15 : 0));
+  if (!ParseFile(&gcode_viz_parser, filename, true))
+    return 1;
 
-  fprintf(output_file, "72 25.4 div dup scale  %% Numbers mean millimeter\n");
-  if (scale != 1.0f) {
-    fprintf(output_file, "%f %f scale  %% Scale for page fit\n", scale, scale);
-  }
-  if (show_dimensions) {
-    gcode_printer.PrintShowRange(printMargin);
-  }
+  PrintPageSetup(output_file, opt, &gcode_printer);
 
-  if (config_file) {
+  if (opt.config_file) {
     struct MachineControlConfig machine_config;
-    ConfigParser config_parser;
-    if (!config_parser.SetContentFromFile(config_file)) {
-      fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+    if (!ReadMachineConfig(opt, &machine_config, &parser_cfg))
       return 1;
-    }
-    if (!machine_config.ConfigureFromFile(&config_parser)) {
-      fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
-              config_file);
-      return 1;
-    }
-    machine_config.threshold_angle = threshold_angle;
-
-    // This is not connected to any machine. Don't assume homing, but
-    // at least extract the home position from the config.
-    machine_config.require_homing = false;
-    for (const GCodeParserAxis axis : AllAxes()) {
-      HardwareMapping::AxisTrigger trigger = machine_config.homing_trigger[axis];
-      parser_cfg.machine_origin[axis] =
-        (trigger & HardwareMapping::TRIGGER_MAX)
-        ? machine_config.move_range_mm[axis]
-        : 0;
-    }
-
-    machine_config.acknowledge_lines = false;
-    machine_config.range_check = range_check;
 
     // We never initialize the hardware mapping from the config file, so
     // we have a convenient mapping of gcode-axis == motor-number
@@ -628,18 +1042,13 @@ int main(int argc, char *argv[]) {
     Spindle spindle;
 
     MotorOperationsPrinter motor_printer(output_file,
-                                         machine_config, tool_diameter_mm,
-                                         show_speeds);
+                                         machine_config, opt.tool_diameter_mm,
+                                         opt.show_speeds);
+    motor_printer.SetResolution(opt.resolution_mm);
     GCodeMachineControl *machine_control
-      = GCodeMachineControl::Create(machine_config, &motor_printer,
-                                    &hardware, &spindle, stderr);
-    if (!machine_control) {
-      // Ups, let's do it again with logging enabled.
-      Log_init("/dev/stderr");
-      Log_error("Cannot initialize machine:");
-      GCodeMachineControl::Create(machine_config, &motor_printer,
-                                  &hardware, &spindle, stderr);
-    } else {
+      = CreateMachineControl(machine_config, &motor_printer,
+                             &hardware, &spindle);
+    if (machine_control) {
       machine_control->SetMsgOut(NULL);
       motor_printer.SetPass(1);
       GCodeParser parser(parser_cfg, machine_control->ParseEventReceiver(),
@@ -654,7 +1063,7 @@ int main(int argc, char *argv[]) {
       motor_printer.SetPass(2);
       ParseFile(&parser, filename, false);
 
-      if (show_speeds) {
+      if (opt.show_speeds) {
         float x, y, w, h;
         gcode_printer.GetDimensions(&x, &y, &w, &h);
         motor_printer.PrintColorLegend(x, y + h + 15, w);
@@ -663,16 +1072,253 @@ int main(int argc, char *argv[]) {
     delete machine_control;
   }
 
-  gcode_printer.ShowHomePos();  // On top of machine path to be visible.
+  gcode_printer.ShowHomePos(output_file);  // On top of machine path to be visible.
   // We print the gcode on top of the colored machine visualization.
   gcode_printer.SetPass(2);
   ParseFile(&gcode_viz_parser, filename, false);
 
   fprintf(output_file, "\nshowpage\n");
 
+  return gcode_viz_parser.error_count() == 0 ? 0 : 1;
+}
+
+// Parse the file only once. The machine path and the G-code path are
+// written to temporary files while the ranges are collected; the
+// PostScript header is written last, followed by the buffered paths.
+static int RenderSinglePass(const char *filename, FILE *output_file,
+                            const RenderOptions &opt) {
+  FILE *gcode_out = tmpfile();
+  FILE *machine_out = tmpfile();
+  if (!gcode_out || !machine_out) {
+    perror("Creating temporary file");
+    return 1;
+  }
+
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+
+  struct MachineControlConfig machine_config;
+  if (opt.config_file
+      && !ReadMachineConfig(opt, &machine_config, &parser_cfg))
+    return 1;
+
+  GCodePrintVisualizer gcode_printer(gcode_out, opt.show_ijk, opt.scale);
+  gcode_printer.SetResolution(opt.resolution_mm);
+  if (opt.fixed_box) {
+    gcode_printer.SetBoundingBox(opt.box[0], opt.box[1],
+                                 opt.box[2], opt.box[3]);
+  }
+  gcode_printer.SetPass(0);
+
+  HardwareMapping hardware;
+  Spindle spindle;
+  MotorOperationsPrinter *motor_printer = NULL;
+  GCodeMachineControl *machine_control = NULL;
+  if (opt.config_file) {
+    motor_printer = new MotorOperationsPrinter(machine_out, machine_config,
+                                               opt.tool_diameter_mm,
+                                               opt.show_speeds);
+    motor_printer->SetResolution(opt.resolution_mm);
+    motor_printer->SetPass(0);
+    // We don't know the extent of the G-code yet; relate the colored
+    // segments to the given box or the machine instead.
+    float w, h;
+    if (opt.fixed_box) {
+      w = opt.box[2] - opt.box[0];
+      h = opt.box[3] - opt.box[1];
+    } else {
+      w = std::max(0.0f, machine_config.move_range_mm[AXIS_X]);
+      h = std::max(0.0f, machine_config.move_range_mm[AXIS_Y]);
+    }
+    motor_printer->SetColorSegmentLength(hypotf(w, h) > 0
+                                         ? hypotf(w, h) / 100 : 1);
+    machine_control = CreateMachineControl(machine_config, motor_printer,
+                                           &hardware, &spindle);
+  }
+
+  int error_count;
+  {
+    TeeEventReceiver tee(&gcode_printer, machine_control
+                         ? machine_control->ParseEventReceiver()
+                         : NULL);
+    GCodeParser parser(parser_cfg,
+                       machine_control ? (GCodeParser::EventReceiver*) &tee
+                       : &gcode_printer,
+                       false);
+    if (!ParseFile(&parser, filename, false))
+      return 1;
+    error_count = parser.error_count();
+  }
+  delete machine_control;  // Flushes remaining moves to the printer.
+
+  PrintPageSetup(output_file, opt, &gcode_printer);
+  if (motor_printer) {
+    if (opt.show_speeds) {
+      motor_printer->PrintSpeedColorDefinitions(output_file);
+      float x, y, w, h;
+      gcode_printer.GetDimensions(&x, &y, &w, &h);
+      motor_printer->PrintColorLegend(x, y + h + 15, w);
+    }
+    delete motor_printer;  // Finishes the path.
+    AppendFile(machine_out, output_file);
+  }
+  gcode_printer.ShowHomePos(output_file);  // On top of machine path to be visible.
+  AppendFile(gcode_out, output_file);
+  fclose(gcode_out);
+  fclose(machine_out);
+
+  fprintf(output_file, "\nshowpage\n");
+
+  return error_count == 0 ? 0 : 1;
+}
+
+// Speed heatmap of the planned path; only the machine path, parsed once.
+static int RenderSpeedRaster(const char *filename, FILE *output_file,
+                             const RenderOptions &opt) {
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+
+  struct MachineControlConfig machine_config;
+  if (!ReadMachineConfig(opt, &machine_config, &parser_cfg))
+    return 1;
+
+  float box[4];
+  if (opt.fixed_box) {
+    std::copy(opt.box, opt.box + 4, box);
+  } else {
+    box[0] = box[1] = 0;
+    box[2] = machine_config.move_range_mm[AXIS_X];
+    box[3] = machine_config.move_range_mm[AXIS_Y];
+    if (box[2] <= 0 || box[3] <= 0) {
+      fprintf(stderr, "Machine has no limited X/Y range; "
+              "provide the area to show with -B\n");
+      return 1;
+    }
+  }
+
+  HardwareMapping hardware;
+  Spindle spindle;
+  MotorOperationsRasterizer rasterizer(machine_config, opt.raster_width,
+                                       box[0], box[1], box[2], box[3],
+                                       parser_cfg.machine_origin[AXIS_X],
+                                       parser_cfg.machine_origin[AXIS_Y]);
+  GCodeMachineControl *machine_control
+    = CreateMachineControl(machine_config, &rasterizer, &hardware, &spindle);
+  if (!machine_control)
+    return 1;
+  int error_count;
+  {
+    GCodeParser parser(parser_cfg, machine_control->ParseEventReceiver(),
+                       false);
+    if (!ParseFile(&parser, filename, false))
+      return 1;
+    error_count = parser.error_count();
+  }
+  delete machine_control;  // Flushes remaining moves.
+
+  if (!rasterizer.WritePPM(output_file)) {
+    perror("Writing image");
+    return 1;
+  }
+  return error_count == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  RenderOptions opt;
+  FILE *output_file = stdout;
+  bool single_pass = false;
+
+  int opt_char;
+  while ((opt_char = getopt(argc, argv, "o:c:T:Dt:srS:i1B:R:P:")) != -1) {
+    switch (opt_char) {
+    case 'o':
+      output_file = fopen(optarg, "w");
+      break;
+    case 't':
+      opt.threshold_angle = (float)atof(optarg);
+      break;
+    case 'c':
+      opt.config_file = strdup(optarg);
+      break;
+    case 'D':
+      opt.show_dimensions = true;
+      break;
+    case 'T':
+      opt.tool_diameter_mm = atof(optarg);
+      break;
+    case 's':
+      opt.show_speeds = true;
+      break;
+    case 'S':
+      opt.scale = atof(optarg);
+      break;
+    case 'i':
+      opt.show_ijk = !opt.show_ijk;
+      break;
+    case 'r':
+      opt.range_check = true;
+      break;
+    case '1':
+      single_pass = true;
+      break;
+    case 'B':
+      if (sscanf(optarg, "%f,%f,%f,%f", &opt.box[0], &opt.box[1],
+                 &opt.box[2], &opt.box[3]) != 4
+          || opt.box[0] >= opt.box[2] || opt.box[1] >= opt.box[3]) {
+        fprintf(stderr, "-B: expected <x0>,<y0>,<x1>,<y1> with x0 < x1 "
+                "and y0 < y1\n");
+        return usage(argv[0]);
+      }
+      opt.fixed_box = true;
+      break;
+    case 'R':
+      opt.resolution_mm = atof(optarg);
+      break;
+    case 'P':
+      opt.raster_width = atoi(optarg);
+      if (opt.raster_width <= 0) {
+        fprintf(stderr, "-P: width needs to be positive.\n");
+        return usage(argv[0]);
+      }
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc)
+    return usage(argv[0]);
+
+  if (output_file == NULL) {
+    fprintf(stderr, "Could not create output file.\n");
+    return 1;
+  }
+
+  Log_init("/dev/null");
+
+  const char *filename = argv[optind];
+  if (opt.raster_width > 0 && !opt.config_file) {
+    fprintf(stderr, "The speed heatmap (-P) needs a machine config (-c).\n");
+    return usage(argv[0]);
+  }
+  if (!single_pass && opt.raster_width == 0 && strcmp(filename, "-") == 0) {
+    fprintf(stderr, "Reading from stdin needs single pass (-1).\n");
+    return usage(argv[0]);
+  }
+
+  int result;
+  if (opt.raster_width > 0)
+    result = RenderSpeedRaster(filename, output_file, opt);
+  else if (single_pass)
+    result = RenderSinglePass(filename, output_file, opt);
+  else
+    result = RenderTwoPass(filename, output_file, opt);
+
   fclose(output_file);
 
-  return gcode_viz_parser.error_count() == 0 ? 0 : 1;
+  return result;
 }
 
 namespace {
@@ -958,3 +1604,4 @@ const char *measureLinePS =
   "    stroke\n"
   "} def\n";
 }
+
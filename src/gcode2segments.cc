@@ -0,0 +1,153 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Plan a GCode file offline and write the resulting motion segments to a
+// segment file, that can be sent to the machine with
+//   machine-control --replay <segment-file>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+#include "gcode-parser/gcode-parser.h"
+
+#include "config-parser.h"
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "input-shaping.h"
+#include "motion-queue.h"
+#include "motor-operations.h"
+#include "segment-file.h"
+#include "spindle-control.h"
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <gcode-file>\n"
+          "Options:\n"
+          "\t-c <config>       : Machine config (Required).\n"
+          "\t-o <segfile>      : Output segment file (Required).\n"
+          "\t-f <factor>       : Speedup-factor for feedrate.\n"
+          "\t-t <angle>        : Threshold angle, same as machine-control "
+          "--threshold-angle (Default: 10).\n"
+          "Use the same configuration and options as with machine-control, "
+          "otherwise it refuses to --replay the file.\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  MachineControlConfig config;
+  config.threshold_angle = 10;  // Same default as machine-control.
+  const char *config_file = NULL;
+  const char *output_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:o:f:t:")) != -1) {
+    switch (opt) {
+    case 'c':
+      config_file = optarg;
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'f':
+      config.speed_factor = (float)atof(optarg);
+      if (config.speed_factor <= 0) return usage(argv[0]);
+      break;
+    case 't':
+      config.threshold_angle = (float)atof(optarg);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || !config_file || !output_file)
+    return usage(argv[0]);
+  const char *gcode_file = argv[optind];
+
+  Log_init("/dev/stderr");
+
+  ConfigParser config_parser;
+  if (!config_parser.SetContentFromFile(config_file)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+    return 1;
+  }
+  if (!config.ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
+            config_file);
+    return 1;
+  }
+  config.require_homing = false;  // Nothing to home while planning.
+
+  const int fd = open(gcode_file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "Can't read %s\n", gcode_file);
+    return 1;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap()");
+    return 1;
+  }
+
+  HardwareMapping hardware;  // We never initialize, just sim mode.
+  Spindle spindle;
+  DummyMotionQueue dummy_queue;
+  RecordingMotionQueue recorder(&dummy_queue);
+  MotionQueueMotorOperations motor_ops(&recorder, config.max_step_frequency);
+  InputShapingMotorOperations shaping_ops(&motor_ops);
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &shaping_ops,
+                                  &hardware, &spindle, stderr);
+  if (!machine_control || !shaping_ops.Configure(config, &hardware))
+    return 1;
+
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  machine_control->GetHomePos(&parser_cfg.machine_origin);
+  GCodeParser parser(parser_cfg, machine_control->ParseEventReceiver(), false);
+
+  recorder.StartRecording();
+  const bool success = (parser.ParseBuffer((const char*) data, st.st_size,
+                                           stderr) == 0
+                        && parser.error_count() == 0);
+  recorder.StopRecording();
+  delete machine_control;
+  const uint64_t config_key = SegmentFileConfigKey(config_parser, config);
+  const uint64_t key = SegmentFileKey(data, st.st_size, config_key);
+  munmap(data, st.st_size);
+
+  if (!success) {
+    fprintf(stderr, "Errors in %s; no segment file written.\n", gcode_file);
+    return 1;
+  }
+  if (!recorder.WriteFile(output_file, key, config_key)) {
+    return 1;
+  }
+  fprintf(stderr, "Wrote %d segments to %s\n", recorder.recorded_count(),
+          output_file);
+  return 0;
+}
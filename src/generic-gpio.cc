@@ -18,47 +18,37 @@
  */
 
 #include <stdint.h>
-#include <stdio.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <unistd.h>
-
-#include "common/logging.h"
 
 #include "motor-interface-constants.h"
+#include "register-map.h"
 #include "generic-gpio.h"
 
-// Memory space mapped to the Clock Module registers
-#define CM_BASE                 0x44e00000
-#define CM_SIZE                 0x4000
-
 // Clock Module Peripheral and Wakeup registers
 #define CM_WKUP_GPIO0_CLKCTRL   (0x400 + 0x008)
 #define CM_PER_GPIO1_CLKCTRL    (0x000 + 0x0ac)
 #define CM_PER_GPIO2_CLKCTRL    (0x000 + 0x0b0)
 #define CM_PER_GPIO3_CLKCTRL    (0x000 + 0x0b4)
 
-#define IDLEST_MASK             (0x03 << 16)
-#define MODULEMODE_ENABLE       (0x02 << 0)
-
 #define GPIO_MMAP_SIZE 0x2000
 
-// GPIO registers.
-static volatile uint32_t *gpio_0 = NULL;
-static volatile uint32_t *gpio_1 = NULL;
-static volatile uint32_t *gpio_2 = NULL;
-static volatile uint32_t *gpio_3 = NULL;
+// GPIO registers, per bank.
+static volatile uint32_t *gpio_bank_regs[GPIO_NUM_BANKS] = { NULL };
 
-static volatile uint32_t *get_gpio_base(uint32_t gpio_def) {
+int get_gpio_bank(uint32_t gpio_def) {
   switch (gpio_def & 0xfffff000) {
-  case GPIO_0_BASE: return gpio_0;
-  case GPIO_1_BASE: return gpio_1;
-  case GPIO_2_BASE: return gpio_2;
-  case GPIO_3_BASE: return gpio_3;
-  default: return NULL;
+  case GPIO_0_BASE: return 0;
+  case GPIO_1_BASE: return 1;
+  case GPIO_2_BASE: return 2;
+  case GPIO_3_BASE: return 3;
+  default: return -1;
   }
 }
 
+static volatile uint32_t *get_gpio_base(uint32_t gpio_def) {
+  const int bank = get_gpio_bank(gpio_def);
+  return bank < 0 ? NULL : gpio_bank_regs[bank];
+}
+
 int get_gpio(uint32_t gpio_def) {
   volatile uint32_t *gpio_port = get_gpio_base(gpio_def);
   uint32_t bitmask = 1 << (gpio_def & 0x1f);
@@ -85,18 +75,27 @@ void clr_gpio(uint32_t gpio_def) {
     gpio_port[GPIO_CLEARDATAOUT/4] = bitmask;
 }
 
-static void set_gpio_mask(uint32_t *mask, uint32_t gpio_def) {
-  const uint32_t bitmask = 1 << (gpio_def & 0x1f);
-  switch (gpio_def & 0xfffff000) {
-  case GPIO_0_BASE: mask[0] |= bitmask; break;
-  case GPIO_1_BASE: mask[1] |= bitmask; break;
-  case GPIO_2_BASE: mask[2] |= bitmask; break;
-  case GPIO_3_BASE: mask[3] |= bitmask; break;
+uint32_t read_gpio_bank(int bank) {
+  return gpio_bank_regs[bank] ? gpio_bank_regs[bank][GPIO_DATAIN/4] : 0;
+}
+
+void write_gpio_banks(const uint32_t set_mask[GPIO_NUM_BANKS],
+                      const uint32_t clr_mask[GPIO_NUM_BANKS]) {
+  for (int bank = 0; bank < GPIO_NUM_BANKS; ++bank) {
+    volatile uint32_t *gpio_port = gpio_bank_regs[bank];
+    if (!gpio_port) continue;
+    if (set_mask[bank]) gpio_port[GPIO_SETDATAOUT/4] = set_mask[bank];
+    if (clr_mask[bank]) gpio_port[GPIO_CLEARDATAOUT/4] = clr_mask[bank];
   }
 }
 
+static void set_gpio_mask(uint32_t *mask, uint32_t gpio_def) {
+  const int bank = get_gpio_bank(gpio_def);
+  if (bank >= 0) mask[bank] |= 1 << (gpio_def & 0x1f);
+}
+
 static void cfg_gpio_io() {
-  uint32_t output_mask[4] = { 0, 0, 0, 0 };
+  uint32_t output_mask[GPIO_NUM_BANKS] = { 0, 0, 0, 0 };
 
   // Motor Step signals
   set_gpio_mask(output_mask, MOTOR_1_STEP_GPIO);
@@ -143,7 +142,7 @@ static void cfg_gpio_io() {
   set_gpio_mask(output_mask, PWM_3_GPIO);
   set_gpio_mask(output_mask, PWM_4_GPIO);
 
-  uint32_t input_mask[4] = { 0, 0, 0, 0 };
+  uint32_t input_mask[GPIO_NUM_BANKS] = { 0, 0, 0, 0 };
   set_gpio_mask(input_mask, IN_1_GPIO);
   set_gpio_mask(input_mask, IN_2_GPIO);
   set_gpio_mask(input_mask, IN_3_GPIO);
@@ -159,84 +158,40 @@ static void cfg_gpio_io() {
 
   // Set the output enable register for each GPIO bank.
   // Output direction is signified with a zero.
-  gpio_0[GPIO_OE/4] &= ~output_mask[0];
-  gpio_1[GPIO_OE/4] &= ~output_mask[1];
-  gpio_2[GPIO_OE/4] &= ~output_mask[2];
-  gpio_3[GPIO_OE/4] &= ~output_mask[3];
-
-  // All the inputs we need. Inputs are signified with a one.
-  gpio_0[GPIO_OE/4] |= input_mask[0];
-  gpio_1[GPIO_OE/4] |= input_mask[1];
-  gpio_2[GPIO_OE/4] |= input_mask[2];
-  gpio_3[GPIO_OE/4] |= input_mask[3];
-}
-
-static volatile uint32_t *map_port(int fd, size_t length, off_t offset) {
-  return (volatile uint32_t*) mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-}
-
-static void ena_gpio_clk(volatile uint32_t *cm, uint32_t reg, int bank) {
-  uint32_t val;
-
-  val = cm[reg/4];
-  if (val & IDLEST_MASK) {
-    Log_debug("Enabling GPIO-%d clock", bank);
-    val |= MODULEMODE_ENABLE;
-    cm[reg/4] = val;
-    do {
-      val = cm[reg/4];
-    } while (val & IDLEST_MASK);
+  // All the inputs we need are signified with a one.
+  for (int bank = 0; bank < GPIO_NUM_BANKS; ++bank) {
+    gpio_bank_regs[bank][GPIO_OE/4] &= ~output_mask[bank];
+    gpio_bank_regs[bank][GPIO_OE/4] |= input_mask[bank];
   }
 }
 
-static int enable_gpio_clocks(int fd) {
-  volatile uint32_t *cm;
-
-  cm = map_port(fd, CM_SIZE, CM_BASE);
-  if (cm == MAP_FAILED) { perror("mmap() CM"); return 0; }
-
-  ena_gpio_clk(cm, CM_WKUP_GPIO0_CLKCTRL, 0);
-  ena_gpio_clk(cm, CM_PER_GPIO1_CLKCTRL, 1);
-  ena_gpio_clk(cm, CM_PER_GPIO2_CLKCTRL, 2);
-  ena_gpio_clk(cm, CM_PER_GPIO3_CLKCTRL, 3);
-
-  munmap((void*)cm, CM_SIZE);
-  return 1;
-}
-
 bool map_gpio() {
-  bool ret = false;
-  int fd;
-
-  fd = open("/dev/mem", O_RDWR);
-  if (fd == -1) { perror("open()"); return ret; }
-
-  if (!enable_gpio_clocks(fd))  goto exit;
-
-  gpio_0 = map_port(fd, GPIO_MMAP_SIZE, GPIO_0_BASE);
-  if (gpio_0 == MAP_FAILED) { perror("mmap() GPIO-0"); goto exit; }
-  gpio_1 = map_port(fd, GPIO_MMAP_SIZE, GPIO_1_BASE);
-  if (gpio_1 == MAP_FAILED) { perror("mmap() GPIO-1"); goto exit; }
-  gpio_2 = map_port(fd, GPIO_MMAP_SIZE, GPIO_2_BASE);
-  if (gpio_2 == MAP_FAILED) { perror("mmap() GPIO-2"); goto exit; }
-  gpio_3 = map_port(fd, GPIO_MMAP_SIZE, GPIO_3_BASE);
-  if (gpio_3 == MAP_FAILED) { perror("mmap() GPIO-3"); goto exit; }
+  static const uint32_t bank_base[GPIO_NUM_BANKS] = {
+    GPIO_0_BASE, GPIO_1_BASE, GPIO_2_BASE, GPIO_3_BASE
+  };
+
+  if (!enable_module_clock(CM_WKUP_GPIO0_CLKCTRL, "GPIO-0")
+      || !enable_module_clock(CM_PER_GPIO1_CLKCTRL, "GPIO-1")
+      || !enable_module_clock(CM_PER_GPIO2_CLKCTRL, "GPIO-2")
+      || !enable_module_clock(CM_PER_GPIO3_CLKCTRL, "GPIO-3"))
+    return false;
+
+  for (int bank = 0; bank < GPIO_NUM_BANKS; ++bank) {
+    gpio_bank_regs[bank] = map_registers(bank_base[bank], GPIO_MMAP_SIZE);
+    if (gpio_bank_regs[bank] == NULL) {
+      unmap_gpio();
+      return false;
+    }
+  }
 
   // Set all the pins we need to the respective input/output mode.
   cfg_gpio_io();
-
-  ret = true;
-
-exit:
-  close(fd);
-  if (!ret)
-    unmap_gpio();
-  return ret;
+  return true;
 }
 
 void unmap_gpio() {
-  if (gpio_0) { munmap((void*)gpio_0, GPIO_MMAP_SIZE); gpio_0 = NULL; }
-  if (gpio_1) { munmap((void*)gpio_1, GPIO_MMAP_SIZE); gpio_1 = NULL; }
-  if (gpio_2) { munmap((void*)gpio_2, GPIO_MMAP_SIZE); gpio_2 = NULL; }
-  if (gpio_3) { munmap((void*)gpio_3, GPIO_MMAP_SIZE); gpio_3 = NULL; }
+  for (int bank = 0; bank < GPIO_NUM_BANKS; ++bank) {
+    unmap_registers(gpio_bank_regs[bank], GPIO_MMAP_SIZE);
+    gpio_bank_regs[bank] = NULL;
+  }
 }
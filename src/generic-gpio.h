@@ -27,6 +27,21 @@ int get_gpio(uint32_t gpio_def);
 void set_gpio(uint32_t gpio_def);
 void clr_gpio(uint32_t gpio_def);
 
+// GPIO banks 0..3, for operations on all pins of a bank at once.
+#define GPIO_NUM_BANKS 4
+
+// Bank of the given gpio_def, -1 if it is not a GPIO. The bit within the
+// bank is (gpio_def & 0x1f).
+int get_gpio_bank(uint32_t gpio_def);
+
+// Input levels of all pins of the given bank.
+uint32_t read_gpio_bank(int bank);
+
+// Set and clear the pins given in the masks, one register write per bank
+// with any bits to change.
+void write_gpio_banks(const uint32_t set_mask[GPIO_NUM_BANKS],
+                      const uint32_t clr_mask[GPIO_NUM_BANKS]);
+
 bool map_gpio();
 void unmap_gpio();
 
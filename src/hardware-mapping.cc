@@ -29,10 +29,16 @@
 #include "generic-gpio.h"
 #include "pwm-timer.h"
 #include "motor-operations.h"  // LinearSegmentSteps
+#include "pru-hardware-interface.h"
 
 HardwareMapping::HardwareMapping()
-  : estop_input_(0), pause_input_(0), start_input_(0), aux_bits_(0),
-    is_hardware_initialized_(false) {
+  : num_motor_assignments_(0),
+    estop_input_(0), pause_input_(0), start_input_(0), aux_bits_(0),
+    io_processor_(NULL), is_hardware_initialized_(false) {
+  for (int i = 0; i < NUM_BOOL_OUTPUTS; ++i)
+    aux_gpio_[i] = ToGPIOBit(get_aux_bit_gpio_descriptor(i + 1));
+  for (int i = 0; i < NUM_SWITCHES; ++i)
+    switch_gpio_[i] = ToGPIOBit(get_endstop_gpio_descriptor(i + 1));
 }
 
 HardwareMapping::~HardwareMapping() {
@@ -99,6 +105,10 @@ bool HardwareMapping::AddMotorMapping(LogicAxis axis, int motor,
   }
   axis_to_driver_[axis] |= 1 << (motor-1);
   driver_flip_[motor-1] = mirrored ? -1 : 1;
+  MotorAssignment &assignment = motor_assignments_[num_motor_assignments_++];
+  assignment.motor = motor - 1;
+  assignment.direction = driver_flip_[motor-1];
+  assignment.axis = axis;
   return true;
 }
 
@@ -119,27 +129,30 @@ bool HardwareMapping::InitializeHardware() {
     Log_error("Couldn't mmap() GPIO ranges.\n");
     return false;
   }
-  if (!pwm_timers_map()) {
-    Log_error("Couldn't mmap() TIMER ranges.\n");
-    return false;
-  }
 
   // The PWM_*_GPIO pins can produce PWM signals if they are mapped to one
   // of the TIMER pins and the dts set the pins to the correct mode (0x02).
   // If they are mapped to other pins, or the mode is wrong (0x07), they will
   // only work as GPIO outputs. Either way the pwm_timer_*() calls are safe.
   //
-  // Make sure all the PWM timers are stopped and set the default base frequency.
-  // (TODO: only initialize PWMs that are actually needed according to the
-  // configuration).
-  pwm_timer_start(PWM_1_GPIO, 0);
-  pwm_timer_start(PWM_2_GPIO, 0);
-  pwm_timer_start(PWM_3_GPIO, 0);
-  pwm_timer_start(PWM_4_GPIO, 0);
-  pwm_timer_set_freq(PWM_1_GPIO, 0);
-  pwm_timer_set_freq(PWM_2_GPIO, 0);
-  pwm_timer_set_freq(PWM_3_GPIO, 0);
-  pwm_timer_set_freq(PWM_4_GPIO, 0);
+  // Only the timers of PWM outputs in use according to the configuration are
+  // initialized: stopped and set to the default base frequency. If there are
+  // none, we don't need to map the timers at all.
+  bool any_pwm_mapped = false;
+  for (GPIODefinition gpio : output_to_pwm_gpio_) {
+    any_pwm_mapped |= (gpio != GPIO_NOT_MAPPED);
+  }
+  if (any_pwm_mapped) {
+    if (!pwm_timers_map()) {
+      Log_error("Couldn't mmap() TIMER ranges.\n");
+      return false;
+    }
+    for (GPIODefinition gpio : output_to_pwm_gpio_) {
+      if (gpio == GPIO_NOT_MAPPED) continue;
+      pwm_timer_start(gpio, 0);
+      pwm_timer_set_freq(gpio, 0);
+    }
+  }
 
   is_hardware_initialized_ = true;
   ResetHardware();
@@ -194,21 +207,32 @@ int HardwareMapping::GetAuxBit(int pin) {
 }
 
 void HardwareMapping::UpdateAuxBits(int pin, bool is_on) {
-  if (is_on) aux_bits_ |= (1 << (pin - 1));
-  else       aux_bits_ &= ~(1 << (pin - 1));
+  if (is_on) __sync_fetch_and_or(&aux_bits_, 1 << (pin - 1));
+  else       __sync_fetch_and_and(&aux_bits_, ~(1 << (pin - 1)));
 }
 
 void HardwareMapping::UpdateAuxBitmap(LogicOutput type, bool is_on) {
-  if (is_on) aux_bits_ |= output_to_aux_bits_[type];
-  else       aux_bits_ &= ~output_to_aux_bits_[type];
+  // Atomic, as the spindle sets its bits from its own thread.
+  if (is_on) __sync_fetch_and_or(&aux_bits_, output_to_aux_bits_[type]);
+  else       __sync_fetch_and_and(&aux_bits_, ~output_to_aux_bits_[type]);
 }
 
 void HardwareMapping::SetAuxOutputs() {
   if (!is_hardware_initialized_) return;
+  if (io_processor_ != NULL) {
+    io_processor_->aux_bits = aux_bits_;
+    return;
+  }
+  const AuxBitmap bits = aux_bits_;
+  uint32_t set_mask[GPIO_NUM_BANKS] = { 0, 0, 0, 0 };
+  uint32_t clr_mask[GPIO_NUM_BANKS] = { 0, 0, 0, 0 };
   for (int i = 0; i < NUM_BOOL_OUTPUTS; ++i) {
-    if (aux_bits_ & (1 << i)) set_gpio(get_aux_bit_gpio_descriptor(i + 1));
-    else                      clr_gpio(get_aux_bit_gpio_descriptor(i + 1));
+    const GPIOBit &out = aux_gpio_[i];
+    if (out.bank < 0) continue;
+    if (bits & (1 << i)) set_mask[out.bank] |= out.mask;
+    else                 clr_mask[out.bank] |= out.mask;
   }
+  write_gpio_banks(set_mask, clr_mask);
 }
 
 void HardwareMapping::SetPWMOutput(LogicOutput type, float value) {
@@ -229,6 +253,12 @@ void HardwareMapping::SetPWMFrequency(LogicOutput type, float value) {
   pwm_timer_set_freq(gpio, value);
 }
 
+bool HardwareMapping::GetPWMOutputGPIO(LogicOutput type, uint32_t *gpio_def) {
+  if (!is_hardware_initialized_) return false;
+  *gpio_def = output_to_pwm_gpio_[type];
+  return *gpio_def != GPIO_NOT_MAPPED;
+}
+
 std::string HardwareMapping::DebugMotorString(LogicAxis axis) {
   const MotorBitmap motormap_for_axis = axis_to_driver_[axis];
   std::string result;
@@ -252,6 +282,14 @@ void HardwareMapping::AssignMotorSteps(LogicAxis axis, int steps,
   }
 }
 
+void HardwareMapping::AssignAllMotorSteps(const int *axis_steps,
+                                          LinearSegmentSteps *out) const {
+  for (int i = 0; i < num_motor_assignments_; ++i) {
+    const MotorAssignment &m = motor_assignments_[i];
+    out->steps[m.motor] = m.direction * axis_steps[m.axis];
+  }
+}
+
 HardwareMapping::AxisTrigger HardwareMapping::AvailableAxisSwitch(LogicAxis axis) {
   if (!is_hardware_initialized_) {
     // Pretend we have all the switches.
@@ -263,52 +301,59 @@ HardwareMapping::AxisTrigger HardwareMapping::AvailableAxisSwitch(LogicAxis axis
   return (AxisTrigger) result;  // Safe to cast: all within range.
 }
 
+int HardwareMapping::ReadSwitch(int switch_number) {
+  if (io_processor_ != NULL)
+    return (io_processor_->input_bits >> (switch_number - 1)) & 1;
+  const GPIOBit &in = switch_gpio_[switch_number - 1];
+  return (read_gpio_bank(in.bank) & in.mask) ? 1 : 0;
+}
+
+bool HardwareMapping::IsSwitchTriggered(int switch_number) {
+  if (switch_number < 1 || switch_number > NUM_SWITCHES) return false;
+  if (switch_gpio_[switch_number - 1].bank < 0) return false;
+  return ReadSwitch(switch_number) == trigger_level_[switch_number - 1];
+}
+
 bool HardwareMapping::TestAxisSwitch(LogicAxis axis, AxisTrigger requested_trigger) {
   if (!is_hardware_initialized_) return false;
   bool result = false;
-  GPIODefinition gpio_def;
-  if (requested_trigger & TRIGGER_MIN) {
-    const int switch_number = axis_to_min_endstop_[axis];
-    gpio_def = get_endstop_gpio_descriptor(switch_number);
-    if (gpio_def != GPIO_NOT_MAPPED)
-      result |= (get_gpio(gpio_def) == trigger_level_[switch_number-1]);
-  }
-  if (requested_trigger & TRIGGER_MAX) {
-    const int switch_number = axis_to_max_endstop_[axis];
-    gpio_def = get_endstop_gpio_descriptor(switch_number);
-    if (gpio_def != GPIO_NOT_MAPPED)
-      result |= (get_gpio(gpio_def) == trigger_level_[switch_number-1]);
-  }
+  if (requested_trigger & TRIGGER_MIN)
+    result |= IsSwitchTriggered(axis_to_min_endstop_[axis]);
+  if (requested_trigger & TRIGGER_MAX)
+    result |= IsSwitchTriggered(axis_to_max_endstop_[axis]);
   return result;
 }
 
+bool HardwareMapping::GetAxisSwitchGPIO(LogicAxis axis, AxisTrigger trigger,
+                                        uint32_t *gpio_def,
+                                        bool *trigger_level) {
+  if (!is_hardware_initialized_) return false;
+  int switch_number = 0;
+  if (trigger == TRIGGER_MIN) switch_number = axis_to_min_endstop_[axis];
+  if (trigger == TRIGGER_MAX) switch_number = axis_to_max_endstop_[axis];
+  if (switch_number == 0) return false;
+  const GPIODefinition gpio = get_endstop_gpio_descriptor(switch_number);
+  if (gpio == GPIO_NOT_MAPPED) return false;
+  *gpio_def = gpio;
+  *trigger_level = trigger_level_[switch_number-1];
+  return true;
+}
+
 bool HardwareMapping::TestEStopSwitch() {
   if (!is_hardware_initialized_) return false;
-  bool result = false;
-  const int switch_number = estop_input_;
-  GPIODefinition gpio_def = get_endstop_gpio_descriptor(switch_number);
-  if (gpio_def != GPIO_NOT_MAPPED)
-    result |= (get_gpio(gpio_def) == trigger_level_[switch_number-1]);
-  return result;
+  return IsSwitchTriggered(estop_input_);
 }
 
 bool HardwareMapping::TestPauseSwitch() {
   if (!is_hardware_initialized_) return false;
-  bool result = false;
-  const int switch_number = pause_input_;
-  GPIODefinition gpio_def = get_endstop_gpio_descriptor(switch_number);
-  if (gpio_def != GPIO_NOT_MAPPED)
-    result |= (get_gpio(gpio_def) == trigger_level_[switch_number-1]);
-  return result;
+  return IsSwitchTriggered(pause_input_);
 }
 
 bool HardwareMapping::TestStartSwitch() {
   if (!is_hardware_initialized_) return true;
-  const int switch_number = start_input_;
-  GPIODefinition gpio_def = get_endstop_gpio_descriptor(switch_number);
-  if (gpio_def != GPIO_NOT_MAPPED)
-    return (get_gpio(gpio_def) == trigger_level_[switch_number-1]);
-  return true;
+  if (get_endstop_gpio_descriptor(start_input_) == GPIO_NOT_MAPPED)
+    return true;
+  return IsSwitchTriggered(start_input_);
 }
 
 class HardwareMapping::ConfigReader : public ConfigParser::Reader {
@@ -552,6 +597,13 @@ bool HardwareMapping::NameToOutput(StringPiece str, LogicOutput *result) {
   return false;
 }
 
+HardwareMapping::GPIOBit HardwareMapping::ToGPIOBit(GPIODefinition gpio_def) {
+  GPIOBit result;
+  result.bank = (gpio_def == GPIO_NOT_MAPPED) ? -1 : get_gpio_bank(gpio_def);
+  result.mask = (result.bank < 0) ? 0 : 1 << (gpio_def & 0x1f);
+  return result;
+}
+
 // Mapping of numbered IO pins to GPIO definition. The *_GPIO macros
 // are defined in the cape specific header files.
 HardwareMapping::GPIODefinition
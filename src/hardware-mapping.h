@@ -26,6 +26,7 @@
 #include "common/string-util.h"
 
 class ConfigParser;
+struct PruIOCommunication;
 struct LinearSegmentSteps;
 
 // The hardware connected to the BeagleBone typically has a number of universal
@@ -153,6 +154,10 @@ public:
   // This returns if we are in hardware simulation mode.
   bool IsHardwareSimulated() { return !is_hardware_initialized_; }
 
+  // Let the I/O firmware running on the second PRU set the aux outputs and
+  // sample the inputs. NULL: access the GPIOs directly.
+  void SetIOProcessor(PruIOCommunication *io) { io_processor_ = io; }
+
   // -- Boolean and PWM outputs.
 
   // Enable motors.
@@ -186,12 +191,22 @@ public:
   // Set PWM base frequency
   void SetPWMFrequency(LogicOutput type, float value);
 
+  // For hardware that sets the PWM output itself in sync with the motion:
+  // set the GPIO definition of the given PWM output. Returns false if it is
+  // not mapped.
+  bool GetPWMOutputGPIO(LogicOutput type, uint32_t *gpio_def);
+
   // -- Motor outputs
 
   // Given the logic axis and number of steps, assign these steps to the mapped
   // motors in the LinearSegmentSteps
   void AssignMotorSteps(LogicAxis axis, int steps, LinearSegmentSteps *out);
 
+  // Assign the steps of all axes at once; "axis_steps" is indexed by logic
+  // axis, only the ones with a motor are read. This is a single pass over
+  // the mapped motors, whichever axis they belong to or if they are mirrored.
+  void AssignAllMotorSteps(const int *axis_steps, LinearSegmentSteps *out) const;
+
   // -- Switch access
 
   // Returns which endstop trigger are available. Possible values are
@@ -207,6 +222,12 @@ public:
   // this will always return false.
   bool TestAxisSwitch(LogicAxis axis, AxisTrigger requested_trigger);
 
+  // For hardware that tests the switch itself: set GPIO definition and the
+  // level the MIN or MAX switch of the axis triggers on. Returns false if
+  // there is no such switch.
+  bool GetAxisSwitchGPIO(LogicAxis axis, AxisTrigger trigger,
+                         uint32_t *gpio_def, bool *trigger_level);
+
   // Returns true if the E-Stop input is active.
   bool TestEStopSwitch();
 
@@ -241,6 +262,23 @@ private:
 
   void ResetHardware();  // Initialize to a safe state.
 
+  // Level of the given input switch; read from the I/O processor if there.
+  int ReadSwitch(int switch_number);
+
+  // If the input switch is connected and at its trigger level.
+  bool IsSwitchTriggered(int switch_number);
+
+  // GPIO bank and bit of the aux outputs and input switches, looked up once
+  // so that setting all outputs or reading a switch is a register access per
+  // bank. A bank of -1 is not connected on this cape.
+  struct GPIOBit {
+    int bank;
+    uint32_t mask;
+  };
+  static GPIOBit ToGPIOBit(GPIODefinition gpio_def);
+  GPIOBit aux_gpio_[NUM_BOOL_OUTPUTS];
+  GPIOBit switch_gpio_[NUM_SWITCHES];
+
   // Mapping of logical outputs to hardware outputs.
   FixedArray<AuxBitmap, NUM_OUTPUTS> output_to_aux_bits_;
   FixedArray<GPIODefinition, NUM_OUTPUTS> output_to_pwm_gpio_;
@@ -252,6 +290,15 @@ private:
   FixedArray<MotorBitmap, GCODE_NUM_AXES> axis_to_driver_;
   FixedArray<int, NUM_MOTORS> driver_flip_;  // 1 or -1 for for individual driver
 
+  // The same mapping, but per mapped driver; for AssignAllMotorSteps().
+  struct MotorAssignment {
+    int motor;       // 0-based driver.
+    int direction;   // 1 or -1
+    LogicAxis axis;
+  };
+  MotorAssignment motor_assignments_[NUM_MOTORS];
+  int num_motor_assignments_;
+
   FixedArray<int, GCODE_NUM_AXES> axis_to_min_endstop_;
   FixedArray<int, GCODE_NUM_AXES> axis_to_max_endstop_;
   FixedArray<bool, NUM_SWITCHES> trigger_level_;
@@ -261,6 +308,8 @@ private:
 
   AuxBitmap aux_bits_;       // Set via M42 or various other settings.
 
+  PruIOCommunication *io_processor_;
+
   bool is_hardware_initialized_;
 };
 
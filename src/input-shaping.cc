@@ -0,0 +1,449 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "input-shaping.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+
+// Output pieces shorter than this are skipped (their steps are carried over
+// to the next one); they only come from rounding of the break points.
+#define MIN_PIECE_SECONDS 1e-9
+
+// Within a segment, the hardware moves all motors proportionally. Where the
+// shaped speeds are not, pieces are made short enough to stay within this
+// many steps of the shaped path.
+#define MAX_BLEND_ERROR_STEPS 0.5
+
+// Room for received pieces to start with; e.g. with a delay of 50ms, for
+// 10000 segments per second. Grows if more are within the longest delay.
+#define INITIAL_PIECES 512
+
+// Pieces with fewer steps are merged with the following ones; at low speeds,
+// they'd otherwise mostly be rounding noise.
+#define MIN_SEGMENT_STEPS 4
+
+// The speeds of pieces are those of the shaped motion, unless rounding to
+// whole steps changes the number of steps by more than this fraction; then
+// they're scaled to take the same time.
+#define MAX_ROUNDING_FRACTION 0.1
+
+bool ParseInputShaperType(const std::string &value, InputShaperType *type) {
+  const std::string choice = ToLower(value);
+  if (choice == "none") *type = SHAPER_NONE;
+  else if (choice == "zv") *type = SHAPER_ZV;
+  else if (choice == "zvd") *type = SHAPER_ZVD;
+  else if (choice == "ei") *type = SHAPER_EI;
+  else return false;
+  return true;
+}
+
+InputShaper MakeInputShaper(InputShaperType type, float frequency,
+                            float damping) {
+  InputShaper result = {};
+  result.count = 1;
+  result.amplitude[0] = 1;
+  if (type == SHAPER_NONE || frequency <= 0)
+    return result;
+
+  // Damped period and the decay of the oscillation within half of it.
+  const double df = sqrt(1.0 - damping * damping);
+  const double k = exp(-damping * M_PI / df);
+  const double period = 1.0 / (frequency * df);
+  double a[InputShaper::MAX_IMPULSES] = {};
+  switch (type) {
+  case SHAPER_ZV:
+    result.count = 2;
+    a[0] = 1; a[1] = k;
+    break;
+  case SHAPER_ZVD:
+    result.count = 3;
+    a[0] = 1; a[1] = 2 * k; a[2] = k * k;
+    break;
+  case SHAPER_EI: {
+    const double tolerance = 0.05;  // Remaining vibration allowed.
+    result.count = 3;
+    a[0] = 0.25 * (1 + tolerance);
+    a[1] = 0.5 * (1 - tolerance) * k;
+    a[2] = a[0] * k * k;
+    break;
+  }
+  case SHAPER_NONE:
+    break;
+  }
+  double sum = 0;
+  for (int i = 0; i < result.count; ++i) sum += a[i];
+  for (int i = 0; i < result.count; ++i) {
+    result.amplitude[i] = a[i] / sum;
+    result.delay[i] = 0.5 * period * i;
+  }
+  return result;
+}
+
+InputShapingMotorOperations::InputShapingMotorOperations(
+  MotorOperations *delegate)
+  : delegate_(delegate), active_(false), num_delays_(1), max_delay_(0),
+    pieces_(INITIAL_PIECES), in_time_(0), out_time_(0), merging_(false), merge_start_(0),
+    pending_state_(false) {
+  const InputShaper none = MakeInputShaper(SHAPER_NONE, 0, 0);
+  for (InputShaper &shaper : shapers_) shaper = none;
+  delays_[0] = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    position_[i] = 0;
+    sent_steps_[i] = 0;
+    merge_speed_[i] = end_speed_[i] = 0;
+  }
+  sent_state_.aux_bits = 0;
+  sent_state_.pwm = sent_state_.pwm_full_speed = 0;
+  next_state_ = sent_state_;
+}
+
+bool InputShapingMotorOperations::Configure(const MachineControlConfig &config,
+                                            HardwareMapping *hardware) {
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (config.input_shaper[axis] == SHAPER_NONE) continue;
+    if (config.input_shaper_frequency[axis] <= 0
+        || config.input_shaper_damping[axis] < 0
+        || config.input_shaper_damping[axis] >= 1) {
+      Log_error("Input shaper of axis %c needs a frequency > 0 and a "
+                "damping ratio in [0..1)", gcodep_axis2letter(axis));
+      return false;
+    }
+    LinearSegmentSteps motors = {};
+    hardware->AssignMotorSteps(axis, 1, &motors);
+    const InputShaper shaper
+      = MakeInputShaper(config.input_shaper[axis],
+                        config.input_shaper_frequency[axis],
+                        config.input_shaper_damping[axis]);
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      if (motors.steps[m] != 0) SetMotorShaper(m, shaper);
+    }
+    Log_debug("Input shaper for axis %c at %.1fHz; delays motion up to %.1fms",
+              gcodep_axis2letter(axis), config.input_shaper_frequency[axis],
+              1000.0 * shaper.delay[shaper.count - 1]);
+  }
+  return true;
+}
+
+void InputShapingMotorOperations::SetMotorShaper(int motor,
+                                                 const InputShaper &shaper) {
+  shapers_[motor] = shaper;
+  active_ = false;
+  num_delays_ = 0;
+  max_delay_ = 0;
+  for (const InputShaper &s : shapers_) {
+    active_ |= (s.count > 1);
+    for (int i = 0; i < s.count; ++i) {
+      if (std::find(delays_, delays_ + num_delays_, s.delay[i])
+          == delays_ + num_delays_) {
+        delays_[num_delays_++] = s.delay[i];
+      }
+      max_delay_ = std::max(max_delay_, (double)s.delay[i]);
+    }
+  }
+}
+
+int InputShapingMotorOperations::FindPiece(double t) {
+  int lo = 0, hi = (int)pieces_.size() - 1;
+  if (hi < 0 || t < pieces_[0]->start || t >= in_time_) return -1;
+  while (lo < hi) {   // Last piece starting at or before t.
+    const int mid = (lo + hi + 1) / 2;
+    if (pieces_[mid]->start <= t) lo = mid; else hi = mid - 1;
+  }
+  return lo;
+}
+
+double InputShapingMotorOperations::NextBreak(double t, double limit) {
+  double result = limit;
+  const int n = pieces_.size();
+  for (int d = 0; d < num_delays_; ++d) {
+    // First piece boundary after t in the copy delayed by delays_[d].
+    const double local = t - delays_[d];
+    int lo = 0, hi = n;
+    while (lo < hi) {   // First piece ending after "local".
+      const int mid = (lo + hi) / 2;
+      Piece *p = pieces_[mid];
+      if (p->start + p->duration <= local + MIN_PIECE_SECONDS) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo == n) continue;
+    Piece *p = pieces_[lo];
+    const double boundary = (p->start > local + MIN_PIECE_SECONDS)
+      ? p->start : p->start + p->duration;
+    result = std::min(result, boundary + delays_[d]);
+  }
+  return result;
+}
+
+void InputShapingMotorOperations::ShapedSpeeds(double a, double b,
+                                               double *va, double *vb) {
+  const double mid = (a + b) / 2;
+  const double half = (b - a) / 2;
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    const InputShaper &shaper = shapers_[m];
+    double v = 0, slope = 0;
+    for (int i = 0; i < shaper.count; ++i) {
+      const double t = mid - shaper.delay[i];
+      const int index = FindPiece(t);
+      if (index < 0) continue;
+      const Piece *p = pieces_[index];
+      const double piece_slope = (p->v1[m] - p->v0[m]) / p->duration;
+      v += shaper.amplitude[i] * (p->v0[m] + piece_slope * (t - p->start));
+      slope += shaper.amplitude[i] * piece_slope;
+    }
+    va[m] = v - slope * half;
+    vb[m] = v + slope * half;
+  }
+}
+
+void InputShapingMotorOperations::EmitUntil(double until) {
+  while (out_time_ < until - MIN_PIECE_SECONDS) {
+    const double next = NextBreak(out_time_, until);
+    EmitSpan(out_time_, next);
+    out_time_ = next;
+  }
+  // Forget what no delayed copy reaches anymore.
+  while (pieces_.size() > 1) {
+    const Piece *p = pieces_[0];
+    if (p->start + p->duration > out_time_ - max_delay_) break;
+    pieces_.pop_front();
+  }
+}
+
+void InputShapingMotorOperations::EmitSpan(double a, double b) {
+  double va[BEAGLEG_NUM_MOTORS], vb[BEAGLEG_NUM_MOTORS];
+  ShapedSpeeds(a, b, va, vb);
+
+  // Cut where motors change direction; each segment has one per motor.
+  for (;;) {
+    double cut = b;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      if ((va[m] < 0 && vb[m] > 0) || (va[m] > 0 && vb[m] < 0)) {
+        cut = std::min(cut, a + (b - a) * va[m] / (va[m] - vb[m]));
+      }
+    }
+    if (cut >= b - MIN_PIECE_SECONDS) break;
+    double vcut[BEAGLEG_NUM_MOTORS];
+    const double f = (cut - a) / (b - a);
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      vcut[m] = va[m] + f * (vb[m] - va[m]);
+    }
+    if (cut > a + MIN_PIECE_SECONDS) EmitLinear(a, cut, va, vcut, false);
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      va[m] = (vcut[m] == 0 || (vcut[m] > 0) == (vb[m] > 0)) ? vcut[m] : 0;
+    }
+    a = cut;
+  }
+
+  // If the motors don't move proportionally, send shorter pieces. Halfway
+  // through a piece of duration T, the proportional motion is off by
+  // T * (va[m] * vb[d] - vb[m] * va[d]) / (4 * (va[d] + vb[d])) steps; that
+  // goes down with the square of the number of pieces.
+  int fastest = 0;
+  for (int m = 1; m < BEAGLEG_NUM_MOTORS; ++m) {
+    if (fabs(va[m]) + fabs(vb[m]) > fabs(va[fastest]) + fabs(vb[fastest]))
+      fastest = m;
+  }
+  const double fastest_sum = fabs(va[fastest]) + fabs(vb[fastest]);
+  double error = 0;
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS && fastest_sum > 0; ++m) {
+    const double cross = va[m] * vb[fastest] - vb[m] * va[fastest];
+    error = std::max(error, fabs((b - a) * cross / (4 * fastest_sum)));
+  }
+  const int pieces = (error > MAX_BLEND_ERROR_STEPS)
+    ? (int) ceil(sqrt(error / MAX_BLEND_ERROR_STEPS)) : 1;
+  double from[BEAGLEG_NUM_MOTORS], to[BEAGLEG_NUM_MOTORS];
+  for (int i = 0; i < pieces; ++i) {
+    const double f0 = (double) i / pieces, f1 = (double) (i + 1) / pieces;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      from[m] = va[m] + f0 * (vb[m] - va[m]);
+      to[m] = va[m] + f1 * (vb[m] - va[m]);
+    }
+    EmitLinear(a + f0 * (b - a), a + f1 * (b - a), from, to, false);
+  }
+}
+
+void InputShapingMotorOperations::EmitLinear(double a, double b,
+                                             const double *va,
+                                             const double *vb,
+                                             bool last) {
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    position_[m] += (va[m] + vb[m]) / 2 * (b - a);
+    end_speed_[m] = vb[m];
+  }
+  if (!merging_) {
+    merging_ = true;
+    merge_start_ = a;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) merge_speed_[m] = va[m];
+  }
+  const double dt = b - merge_start_;
+  if (dt < MIN_PIECE_SECONDS && !last) return;
+
+  LinearSegmentSteps out = {};
+  int defining = 0;
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    out.steps[m] = llround(position_[m]) - sent_steps_[m];
+    if (abs(out.steps[m]) > abs(out.steps[defining])) defining = m;
+  }
+  const int steps = abs(out.steps[defining]);
+  if (steps < MIN_SEGMENT_STEPS && !last) return;
+  merging_ = false;
+
+  // Bits and PWM of the segment the undelayed motion is in.
+  OutputState state = sent_state_;
+  const int index = FindPiece(merge_start_ + dt / 2);
+  if (index >= 0) {
+    const Piece *p = pieces_[index];
+    state.aux_bits = p->aux_bits;
+    state.pwm = p->pwm;
+    state.pwm_full_speed = p->pwm_full_speed;
+  }
+  out.aux_bits = state.aux_bits;
+  out.pwm = state.pwm;
+  out.pwm_full_speed = state.pwm_full_speed;
+
+  if (steps == 0) {
+    if (state != sent_state_) delegate_->Enqueue(out);
+    sent_state_ = state;
+    return;
+  }
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) sent_steps_[m] += out.steps[m];
+  out.v0 = fabs(merge_speed_[defining]);
+  out.v1 = fabs(vb[defining]);
+  const double exact_steps = (out.v0 + out.v1) / 2 * dt;
+  if (exact_steps < 0.5 * steps) {
+    // Only here because of rounding to whole steps; spread them evenly.
+    out.v0 = out.v1 = steps / dt;
+  } else if (fabs(exact_steps - steps) > MAX_ROUNDING_FRACTION * steps) {
+    // Few steps; keep the timing instead of the speed.
+    out.v0 *= steps / exact_steps;
+    out.v1 *= steps / exact_steps;
+  }
+  sent_state_ = state;
+  delegate_->Enqueue(out);
+}
+
+void InputShapingMotorOperations::Flush() {
+  if (pieces_.size() > 0) {
+    EmitUntil(in_time_ + max_delay_);
+    if (merging_) EmitLinear(out_time_, out_time_, end_speed_, end_speed_, true);
+    while (pieces_.size() > 0) pieces_.pop_front();
+  }
+  if (pending_state_ && next_state_ != sent_state_) {
+    LinearSegmentSteps out = {};
+    out.aux_bits = next_state_.aux_bits;
+    out.pwm = next_state_.pwm;
+    out.pwm_full_speed = next_state_.pwm_full_speed;
+    delegate_->Enqueue(out);
+    sent_state_ = next_state_;
+  }
+  pending_state_ = false;
+  in_time_ = out_time_ = 0;
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    position_[m] = 0;
+    sent_steps_[m] = 0;
+  }
+}
+
+void InputShapingMotorOperations::Enqueue(const LinearSegmentSteps &segment) {
+  if (!active_) {
+    delegate_->Enqueue(segment);
+    return;
+  }
+  int defining_steps = 0;
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    defining_steps = std::max(defining_steps, abs(segment.steps[m]));
+  }
+  OutputState state;
+  state.aux_bits = segment.aux_bits;
+  state.pwm = segment.pwm;
+  state.pwm_full_speed = segment.pwm_full_speed;
+
+  if (defining_steps == 0) {
+    if (pieces_.size() == 0) {
+      delegate_->Enqueue(segment);
+      sent_state_ = state;
+    } else {
+      // Takes effect with the next segment or once we stop.
+      next_state_ = state;
+      pending_state_ = true;
+    }
+    return;
+  }
+  if (segment.stop_on_probe || segment.v0 + segment.v1 <= 0) {
+    // Probing needs to stop exactly where the switch triggers.
+    Flush();
+    delegate_->Enqueue(segment);
+    sent_state_ = state;
+    return;
+  }
+  Piece *piece = pieces_.append();
+  piece->start = in_time_;
+  piece->duration = 2.0 * defining_steps / (segment.v0 + segment.v1);
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    const double ratio = (double) segment.steps[m] / defining_steps;
+    piece->v0[m] = ratio * segment.v0;
+    piece->v1[m] = ratio * segment.v1;
+  }
+  piece->aux_bits = segment.aux_bits;
+  piece->pwm = segment.pwm;
+  piece->pwm_full_speed = segment.pwm_full_speed;
+  pending_state_ = false;
+  in_time_ += piece->duration;
+
+  EmitUntil(in_time_);
+  if (segment.v1 == 0) Flush();
+}
+
+void InputShapingMotorOperations::EnqueueTrapezoid(
+  const LinearSegmentSteps &accel, const LinearSegmentSteps &travel,
+  const LinearSegmentSteps &decel) {
+  if (!active_) {
+    delegate_->EnqueueTrapezoid(accel, travel, decel);
+  } else {
+    MotorOperations::EnqueueTrapezoid(accel, travel, decel);
+  }
+}
+
+void InputShapingMotorOperations::EnqueueRaster(
+  const LinearSegmentSteps &segment, const uint8_t *pixels, int count) {
+  Flush();
+  delegate_->EnqueueRaster(segment, pixels, count);
+  sent_state_.aux_bits = segment.aux_bits;
+  sent_state_.pwm = segment.pwm;
+  sent_state_.pwm_full_speed = segment.pwm_full_speed;
+}
+
+void InputShapingMotorOperations::MotorEnable(bool on) {
+  Flush();
+  delegate_->MotorEnable(on);
+}
+
+void InputShapingMotorOperations::WaitQueueEmpty() {
+  Flush();
+  delegate_->WaitQueueEmpty();
+}
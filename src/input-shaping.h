@@ -0,0 +1,184 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_INPUT_SHAPING_H_
+#define _BEAGLEG_INPUT_SHAPING_H_
+
+#include <string>
+
+#include "common/container.h"
+#include "motor-operations.h"
+
+struct MachineControlConfig;
+class HardwareMapping;
+
+enum InputShaperType {
+  SHAPER_NONE = 0,
+  SHAPER_ZV,      // Zero vibration: two impulses, delay of half a period.
+  SHAPER_ZVD,     // Zero vibration and derivative: more robust, full period.
+  SHAPER_EI,      // Extra insensitive: 5% vibration allowed, full period.
+};
+
+// Parse "none", "zv", "zvd" or "ei". Returns false for anything else.
+bool ParseInputShaperType(const std::string &value, InputShaperType *type);
+
+// The impulses the motion is convolved with: every move is done as the sum
+// of copies of itself, delayed by "delay" seconds and scaled by "amplitude";
+// the amplitudes add up to 1, so the resulting positions are the same.
+struct InputShaper {
+  enum { MAX_IMPULSES = 3 };
+  int count;
+  float amplitude[MAX_IMPULSES];
+  float delay[MAX_IMPULSES];   // Increasing, starting with zero.
+};
+
+// Shaper cancelling a resonance at "frequency" Hz with the given "damping"
+// ratio. SHAPER_NONE is a single impulse without delay.
+InputShaper MakeInputShaper(InputShaperType type, float frequency,
+                            float damping);
+
+// MotorOperations that shape the steps of each motor with the input shaper
+// of its axis before passing them on to the "delegate", so that moves don't
+// excite the resonance of the machine frame.
+//
+// The shaped motion of all motors is cut at the start and end of every
+// delayed copy of the incoming segments (and where a motor changes
+// direction); within these pieces, the speed of each motor changes
+// linearly, which the segments sent to the delegate describe. Where motors
+// of different axes blend, e.g. around corners, or have different shapers,
+// their speeds are not proportional anymore; these parts are sent in pieces
+// short enough to stay within half a step of the shaped path.
+//
+// Output up to the end of what was received is sent right away, the delayed
+// rest once the motion comes to a stop. So each stop takes the longest
+// shaper delay longer, which is usually more than made up for by the higher
+// acceleration the machine can do without ringing.
+//
+// Raster lines and probing moves are passed on unshaped, after the shaped
+// motion so far is finished. Shapers are tuned for the programmed speed, so
+// a real-time speed override detunes them a bit.
+class InputShapingMotorOperations : public MotorOperations {
+public:
+  explicit InputShapingMotorOperations(MotorOperations *delegate);
+
+  // Set the input shapers of the motors from the per axis configuration in
+  // "config" and the motor mapping of "hardware". Call once the motor
+  // mapping is complete (i.e. after GCodeMachineControl::Create()) and
+  // before anything is enqueued.
+  // Returns false if the configuration is invalid.
+  bool Configure(const MachineControlConfig &config,
+                 HardwareMapping *hardware);
+
+  // Set the shaper of a single motor.
+  void SetMotorShaper(int motor, const InputShaper &shaper);
+
+  virtual void Enqueue(const LinearSegmentSteps &segment);
+  virtual void EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                                const LinearSegmentSteps &travel,
+                                const LinearSegmentSteps &decel);
+  virtual void EnqueueRaster(const LinearSegmentSteps &segment,
+                             const uint8_t *pixels, int count);
+  virtual void MotorEnable(bool on);
+  virtual void WaitQueueEmpty();
+  // The (up to three) segments of an operation are cut at the start and end
+  // of each delayed copy.
+  virtual bool QueueFull(int operations = 1) {
+    return delegate_->QueueFull(active_ ? operations * 3 * 2 * num_delays_
+                                : operations);
+  }
+  virtual bool SetSpeedOverride(float factor) {
+    return delegate_->SetSpeedOverride(factor);
+  }
+  virtual void SetSpeedOverrideRamp(float stop_seconds) {
+    delegate_->SetSpeedOverrideRamp(stop_seconds);
+  }
+  virtual void SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {
+    delegate_->SetProbeSwitch(gpio_def, trigger_level);
+  }
+  virtual bool GetProbeStepsSkipped(int skipped[BEAGLEG_NUM_MOTORS]) {
+    return delegate_->GetProbeStepsSkipped(skipped);
+  }
+  virtual bool SetMotionPWMOutput(uint32_t gpio_def) {
+    return delegate_->SetMotionPWMOutput(gpio_def);
+  }
+
+private:
+  // A received segment with the signed speed of each motor in steps/s.
+  struct Piece {
+    double start, duration;     // Seconds since the motion started.
+    double v0[BEAGLEG_NUM_MOTORS], v1[BEAGLEG_NUM_MOTORS];
+    unsigned short aux_bits;
+    float pwm, pwm_full_speed;
+  };
+
+  // Bits and PWM to send along with the motion.
+  struct OutputState {
+    unsigned short aux_bits;
+    float pwm, pwm_full_speed;
+    bool operator!=(const OutputState &o) const {
+      return aux_bits != o.aux_bits || pwm != o.pwm
+        || pwm_full_speed != o.pwm_full_speed;
+    }
+  };
+
+  // Index of the piece that covers time "t" or -1 if none; "t" is not on a
+  // piece boundary.
+  int FindPiece(double t);
+
+  // End of the next output piece after "t", at most "limit".
+  double NextBreak(double t, double limit);
+
+  // Shaped speed of each motor at "a" and "b", between which they change
+  // linearly.
+  void ShapedSpeeds(double a, double b, double *va, double *vb);
+
+  // Send out the shaped motion until "until".
+  void EmitUntil(double until);
+  void EmitSpan(double a, double b);
+  // Send the piece from "a" to "b", merged with previous ones that had too
+  // few steps; unless it is the "last" one, it might be merged with the next.
+  void EmitLinear(double a, double b, const double *va, const double *vb,
+                  bool last);
+
+  // Send out everything received; assumes motion stops there.
+  void Flush();
+
+  MotorOperations *const delegate_;
+  FixedArray<InputShaper, BEAGLEG_NUM_MOTORS> shapers_;
+  bool active_;                    // Any motor shaped.
+  double delays_[BEAGLEG_NUM_MOTORS * InputShaper::MAX_IMPULSES];
+  int num_delays_;                 // Distinct delays of all shapers.
+  double max_delay_;
+
+  // Received pieces the delayed copies still reach; many tiny segments
+  // within the longest delay make it grow.
+  GrowingRingDeque<Piece> pieces_;
+  double in_time_;                 // End of what was received.
+  double out_time_;                // End of what was sent.
+  double position_[BEAGLEG_NUM_MOTORS];  // Shaped position until out_time_.
+  int64_t sent_steps_[BEAGLEG_NUM_MOTORS];
+  double end_speed_[BEAGLEG_NUM_MOTORS];  // Shaped speed at out_time_.
+  bool merging_;                   // Piece(s) not sent yet since...
+  double merge_start_;             // ... this time, with ...
+  double merge_speed_[BEAGLEG_NUM_MOTORS];  // ... these speeds.
+  OutputState sent_state_;
+  bool pending_state_;             // Zero-step segment not sent yet.
+  OutputState next_state_;
+};
+
+#endif  // _BEAGLEG_INPUT_SHAPING_H_
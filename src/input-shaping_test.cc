@@ -0,0 +1,294 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "input-shaping.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <complex>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "motion-queue.h"
+#include "sim-firmware.h"
+
+// Motor operations that just collect what they get.
+class CollectingMotorOps : public MotorOperations {
+public:
+  CollectingMotorOps() : trapezoids(0), waits(0) {}
+  void Enqueue(const LinearSegmentSteps &segment) {
+    segments.push_back(segment);
+  }
+  void EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                        const LinearSegmentSteps &travel,
+                        const LinearSegmentSteps &decel) {
+    ++trapezoids;
+    MotorOperations::EnqueueTrapezoid(accel, travel, decel);
+  }
+  void MotorEnable(bool on) {}
+  void WaitQueueEmpty() { ++waits; }
+
+  std::vector<LinearSegmentSteps> segments;
+  int trapezoids;
+  int waits;
+};
+
+static int TotalSteps(const std::vector<LinearSegmentSteps> &segments,
+                      int motor) {
+  int result = 0;
+  for (const LinearSegmentSteps &s : segments) result += s.steps[motor];
+  return result;
+}
+
+static double Duration(const LinearSegmentSteps &s) {
+  int steps = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    steps = std::max(steps, abs(s.steps[i]));
+  }
+  return steps == 0 ? 0 : 2.0 * steps / (s.v0 + s.v1);
+}
+
+// Amplitude of the vibration an undamped resonance at "frequency" is left
+// with after "segments" of the given motor.
+static double ResidualVibration(const std::vector<LinearSegmentSteps> &segments,
+                                int motor, double frequency) {
+  const double w = 2 * M_PI * frequency;
+  const std::complex<double> i(0, 1);
+  std::complex<double> sum = 0;
+  double t = 0, v = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    int steps = 0;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      steps = std::max(steps, abs(s.steps[m]));
+    }
+    if (steps == 0) continue;
+    const double ratio = 1.0 * s.steps[motor] / steps;
+    const double v0 = ratio * s.v0, v1 = ratio * s.v1;
+    const double dt = Duration(s);
+    sum += (v0 - v) * std::exp(i * w * t);  // Jump in speed.
+    sum += (v1 - v0) / dt * (std::exp(i * w * (t + dt)) - std::exp(i * w * t))
+      / (i * w);
+    t += dt;
+    v = v1;
+  }
+  sum -= v * std::exp(i * w * t);  // Coming to a stop.
+  return std::abs(sum) / w;
+}
+
+// Accelerate to 10000 steps/s within 1000 steps, travel, then stop.
+static void EnqueueMove(MotorOperations *ops, int motor, int direction) {
+  LinearSegmentSteps accel = {0, 10000, 0, {}};
+  LinearSegmentSteps travel = {10000, 10000, 0, {}};
+  LinearSegmentSteps decel = {10000, 0, 0, {}};
+  accel.steps[motor] = direction * 500;
+  travel.steps[motor] = direction * 3000;
+  decel.steps[motor] = direction * 500;
+  ops->EnqueueTrapezoid(accel, travel, decel);
+}
+
+TEST(InputShaper, Impulses) {
+  const InputShaper none = MakeInputShaper(SHAPER_NONE, 40, 0.1);
+  EXPECT_EQ(1, none.count);
+  EXPECT_FLOAT_EQ(1, none.amplitude[0]);
+
+  const InputShaper zv = MakeInputShaper(SHAPER_ZV, 50, 0);
+  ASSERT_EQ(2, zv.count);
+  EXPECT_FLOAT_EQ(0.5, zv.amplitude[0]);
+  EXPECT_FLOAT_EQ(0.5, zv.amplitude[1]);
+  EXPECT_FLOAT_EQ(0, zv.delay[0]);
+  EXPECT_FLOAT_EQ(0.01, zv.delay[1]);  // Half a period.
+
+  for (InputShaperType type : { SHAPER_ZV, SHAPER_ZVD, SHAPER_EI }) {
+    const InputShaper s = MakeInputShaper(type, 40, 0.1);
+    float sum = 0;
+    for (int i = 0; i < s.count; ++i) sum += s.amplitude[i];
+    EXPECT_FLOAT_EQ(1, sum);
+    // Damping makes the period a bit longer than 1/f.
+    EXPECT_GT(s.delay[s.count - 1], (s.count - 1) * 0.5 / 40);
+  }
+
+  InputShaperType type;
+  EXPECT_TRUE(ParseInputShaperType("ZVD", &type));
+  EXPECT_EQ(SHAPER_ZVD, type);
+  EXPECT_FALSE(ParseInputShaperType("mzv", &type));
+}
+
+TEST(InputShapingMotorOperations, PassThroughWithoutShapers) {
+  CollectingMotorOps collect;
+  InputShapingMotorOperations shaping(&collect);
+  EnqueueMove(&shaping, 0, 1);
+  EXPECT_EQ(1, collect.trapezoids);  // Not broken up.
+  EXPECT_EQ(3, (int)collect.segments.size());
+}
+
+TEST(InputShapingMotorOperations, KeepsStepsAndDelaysStop) {
+  CollectingMotorOps collect;
+  InputShapingMotorOperations shaping(&collect);
+  const InputShaper shaper = MakeInputShaper(SHAPER_ZVD, 40, 0.1);
+  shaping.SetMotorShaper(0, shaper);
+  shaping.SetMotorShaper(1, shaper);
+
+  // Corner without stopping: X, then Y; then a move back on X.
+  LinearSegmentSteps x = {0, 10000, 0, {2000}};
+  shaping.Enqueue(x);
+  LinearSegmentSteps y = {10000, 0, 0, {0, 3000}};
+  shaping.Enqueue(y);
+  EnqueueMove(&shaping, 0, -1);
+  shaping.WaitQueueEmpty();
+  EXPECT_EQ(1, collect.waits);
+
+  EXPECT_EQ(2000 - 4000, TotalSteps(collect.segments, 0));
+  EXPECT_EQ(3000, TotalSteps(collect.segments, 1));
+
+  // Each time the motion stops, the shaper adds its delay.
+  const double unshaped = (2000 + 3000) / 5000.0 + 2 * 500 / 5000.0
+    + 3000 / 10000.0;
+  double shaped = 0;
+  for (const LinearSegmentSteps &s : collect.segments) {
+    EXPECT_GE(s.v0, 0);
+    EXPECT_GE(s.v1, 0);
+    shaped += Duration(s);
+  }
+  EXPECT_NEAR(unshaped + 2 * shaper.delay[2], shaped, 0.01);
+
+  // Blending around the corner moves both at the same time.
+  bool blended = false;
+  for (const LinearSegmentSteps &s : collect.segments) {
+    blended |= (s.steps[0] != 0 && s.steps[1] != 0);
+  }
+  EXPECT_TRUE(blended);
+}
+
+TEST(InputShapingMotorOperations, LongContinuousPathWithoutStops) {
+  CollectingMotorOps collect;
+  InputShapingMotorOperations shaping(&collect);
+  const InputShaper shaper = MakeInputShaper(SHAPER_ZVD, 5, 0.1);
+  shaping.SetMotorShaper(0, shaper);
+  shaping.SetMotorShaper(1, shaper);
+
+  // A finely segmented path, with about 1000 segments within the delay of
+  // the shaper. It only stops at the end.
+  const int kSegments = 20000;
+  double unshaped = 0;
+  for (int i = 0; i < kSegments; ++i) {
+    LinearSegmentSteps s = {10000, 10000, 0, {2, (i % 4 < 2) ? 1 : -1}};
+    if (i == 0) s.v0 = 0;
+    if (i == kSegments - 1) s.v1 = 0;
+    unshaped += Duration(s);
+    shaping.Enqueue(s);
+  }
+  shaping.WaitQueueEmpty();
+  EXPECT_EQ(2 * kSegments, TotalSteps(collect.segments, 0));
+  EXPECT_EQ(0, TotalSteps(collect.segments, 1));
+
+  double shaped = 0;
+  for (size_t i = 0; i < collect.segments.size(); ++i) {
+    const LinearSegmentSteps &s = collect.segments[i];
+    if (i + 1 < collect.segments.size()) {
+      ASSERT_GT(s.v1, 0) << "Stopped at segment " << i;
+    }
+    shaped += Duration(s);
+  }
+  EXPECT_NEAR(unshaped + shaper.delay[2], shaped, 0.01);
+}
+
+TEST(InputShapingMotorOperations, CancelsResonance) {
+  const double resonance = 17;  // Not a multiple of the move phases.
+  for (InputShaperType type : { SHAPER_ZV, SHAPER_ZVD, SHAPER_EI }) {
+    CollectingMotorOps unshaped;
+    EnqueueMove(&unshaped, 0, 1);
+    const double before = ResidualVibration(unshaped.segments, 0, resonance);
+
+    CollectingMotorOps collect;
+    InputShapingMotorOperations shaping(&collect);
+    shaping.SetMotorShaper(0, MakeInputShaper(type, resonance, 0));
+    EnqueueMove(&shaping, 0, 1);
+    shaping.WaitQueueEmpty();
+    const double after = ResidualVibration(collect.segments, 0, resonance);
+    EXPECT_EQ(4000, TotalSteps(collect.segments, 0));
+    // Whole steps shift the timing a little. EI deliberately leaves 5% to
+    // be less sensitive to the exact frequency.
+    EXPECT_LT(after, (type == SHAPER_EI ? 0.1 : 0.05) * before)
+      << "shaper " << type;
+  }
+}
+
+TEST(InputShapingMotorOperations, ProbingAndAuxBitsInOrder) {
+  CollectingMotorOps collect;
+  InputShapingMotorOperations shaping(&collect);
+  shaping.SetMotorShaper(0, MakeInputShaper(SHAPER_ZV, 40, 0.1));
+
+  LinearSegmentSteps move = {0, 10000, 0, {1000}};
+  shaping.Enqueue(move);
+  LinearSegmentSteps aux = {};
+  aux.aux_bits = 0x4;
+  shaping.Enqueue(aux);  // Mid-motion: sent once the motion stops.
+  LinearSegmentSteps probe = {10000, 10000, 0x4, {800}};
+  probe.stop_on_probe = true;
+  shaping.Enqueue(probe);
+
+  ASSERT_GE(collect.segments.size(), 3u);
+  const LinearSegmentSteps &last = collect.segments.back();
+  EXPECT_TRUE(last.stop_on_probe);  // Passed on as is.
+  EXPECT_EQ(800, last.steps[0]);
+  const LinearSegmentSteps &before = collect.segments[collect.segments.size()-2];
+  EXPECT_EQ(0x4, before.aux_bits);
+  EXPECT_EQ(1000 + 800, TotalSteps(collect.segments, 0));
+}
+
+TEST(InputShapingMotorOperations, SimulatedQueueSeesAllSteps) {
+  // Through the regular motor operations into the simulation, the motors
+  // end up at the same position with and without shaping.
+  FILE *trace = tmpfile();
+  SimFirmwareQueue sim(trace, 2, SimFirmwareQueue::FORMAT_CSV);
+  MotionQueueMotorOperations motor_ops(&sim);
+  InputShapingMotorOperations shaping(&motor_ops);
+  shaping.SetMotorShaper(0, MakeInputShaper(SHAPER_EI, 30, 0.1));
+  shaping.SetMotorShaper(1, MakeInputShaper(SHAPER_ZV, 50, 0.1));
+  LinearSegmentSteps x = {0, 8000, 0, {1000, 300}};
+  shaping.Enqueue(x);
+  LinearSegmentSteps y = {8000, 0, 0, {-200, 1200}};
+  shaping.Enqueue(y);
+  shaping.WaitQueueEmpty();
+
+  rewind(trace);
+  char line[1024];
+  char last[1024] = "";
+  while (fgets(line, sizeof(line), trace)) {
+    if (line[0] != '#') strcpy(last, line);
+  }
+  fclose(trace);
+  double time, speed, accel;
+  char phase;
+  int steps0, steps1;
+  ASSERT_EQ(6, sscanf(last, "%lf,%c,%lf,%lf,%d,%d", &time, &phase,
+                      &speed, &accel, &steps0, &steps1)) << last;
+  EXPECT_EQ(800, steps0);
+  EXPECT_EQ(1500, steps1);
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/null");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,523 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job-dispatcher.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+
+#include "determine-print-stats.h"
+
+// Wait this long before reconnecting to a machine that went away.
+#define RECONNECT_MS 5000
+
+// Chunks in which the job files are read and sent.
+#define SEND_CHUNK (16 << 10)
+
+// Status clients not reading their snapshots are disconnected.
+#define MAX_STATUS_OUTPUT (1 << 20)
+
+// Echoed back by M117 ("// Msg: ...") on the G-code connection.
+#define HELLO_MARKER "beagleg-dispatch hello"
+#define DONE_MARKER  "beagleg-dispatch done "
+
+// A second connection while someone else streams G-code is only a status
+// connection; machine-control tells us so.
+#define NOT_GCODE_STREAM "status connection only accepts"
+
+static volatile sig_atomic_t caught_signal = 0;
+static void receive_signal(int signo) { caught_signal = 1; }
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void append_u8(std::string *out, uint8_t v) { out->append(1, (char)v); }
+static void append_u16(std::string *out, uint16_t v) {
+  append_u8(out, v & 0xff);
+  append_u8(out, v >> 8);
+}
+static void append_u32(std::string *out, uint32_t v) {
+  append_u16(out, v & 0xffff);
+  append_u16(out, v >> 16);
+}
+
+std::vector<int> PlanJobs(const std::vector<std::vector<float> > &seconds,
+                          std::vector<float> busy_seconds,
+                          std::vector<int> *order) {
+  const int num_jobs = seconds.size();
+  const int num_machines = busy_seconds.size();
+  std::vector<int> result(num_jobs, -1);
+
+  // Longest first; a job counts with its duration on the fastest machine.
+  std::vector<int> by_length(num_jobs);
+  std::vector<float> shortest(num_jobs, INFINITY);
+  for (int j = 0; j < num_jobs; ++j) {
+    by_length[j] = j;
+    for (float s : seconds[j]) shortest[j] = std::min(shortest[j], s);
+  }
+  std::stable_sort(by_length.begin(), by_length.end(),
+                   [&shortest](int a, int b) {
+                     return shortest[a] > shortest[b];
+                   });
+
+  if (order) order->clear();
+  for (int job : by_length) {
+    int best = -1;
+    float best_finish = INFINITY;
+    for (int m = 0; m < num_machines; ++m) {
+      const float finish = busy_seconds[m] + seconds[job][m];
+      if (finish < best_finish) {
+        best_finish = finish;
+        best = m;
+      }
+    }
+    if (best < 0) continue;
+    result[job] = best;
+    busy_seconds[best] = best_finish;
+    if (order) order->push_back(job);
+  }
+  return result;
+}
+
+JobDispatcher::JobDispatcher() {}
+
+JobDispatcher::~JobDispatcher() {
+  for (Machine &machine : machines_) {
+    if (machine.fd >= 0) close(machine.fd);
+    if (machine.job_fd >= 0) close(machine.job_fd);
+  }
+}
+
+int JobDispatcher::AddConfig(const MachineControlConfig &config) {
+  configs_.push_back(config);
+  return configs_.size() - 1;
+}
+
+bool JobDispatcher::AddMachine(const std::string &host, int port,
+                               int config) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = NULL;
+  const int err = getaddrinfo(host.c_str(), NULL, &hints, &addresses);
+  if (err != 0 || addresses == NULL) {
+    Log_error("Can't resolve %s: %s", host.c_str(), gai_strerror(err));
+    return false;
+  }
+  Machine machine;
+  machine.name = StringPrintf("%s:%d", host.c_str(), port);
+  machine.address = *(struct sockaddr_in*) addresses->ai_addr;
+  machine.address.sin_port = htons(port);
+  freeaddrinfo(addresses);
+  machine.config = config;
+  machine.state = MACHINE_DISCONNECTED;
+  machine.handshake_done = false;
+  machine.fd = -1;
+  machine.job = -1;
+  machine.job_fd = -1;
+  machine.job_start_ms = 0;
+  machine.retry_ms = 0;
+  machine.jobs_done = 0;
+  machine.planned_seconds = 0;
+  machines_.push_back(machine);
+  return true;
+}
+
+bool JobDispatcher::AddJob(const std::string &filename) {
+  Job job;
+  job.filename = filename;
+  job.state = JOB_QUEUED;
+  FILE *msg_out = fopen("/dev/null", "w");
+  bool success = true;
+  for (const MachineControlConfig &config : configs_) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      Log_error("Can't open %s: %s", filename.c_str(), strerror(errno));
+      success = false;
+      break;
+    }
+    struct BeagleGPrintStats stats;
+    if (!determine_print_stats(fd, config, msg_out, &stats)) {
+      Log_error("Can't estimate %s", filename.c_str());
+      success = false;
+      break;
+    }
+    job.seconds.push_back(stats.total_time_seconds);
+  }
+  if (msg_out) fclose(msg_out);
+  if (success) jobs_.push_back(job);
+  return success;
+}
+
+float JobDispatcher::EstimatedSeconds(int job, int machine) const {
+  return jobs_[job].seconds[machines_[machine].config];
+}
+
+int JobDispatcher::CountJobs(JobState state) const {
+  int count = 0;
+  for (const Job &job : jobs_) count += (job.state == state);
+  return count;
+}
+
+// What the machine is still busy with, as far as we know.
+float JobDispatcher::RemainingSeconds(const Machine &machine,
+                                      int64_t now) const {
+  switch (machine.state) {
+  case MACHINE_DISCONNECTED:
+  case MACHINE_CONNECTING:
+    return INFINITY;
+  case MACHINE_IDLE:
+    return 0;
+  case MACHINE_RUNNING: {
+    const float elapsed = (now - machine.job_start_ms) / 1000.0f;
+    return std::max(0.0f, jobs_[machine.job].seconds[machine.config]
+                    - elapsed);
+  }
+  }
+  return INFINITY;
+}
+
+void JobDispatcher::StartJobs(int64_t now) {
+  std::vector<int> queued;
+  std::vector<std::vector<float> > seconds;
+  for (int j = 0; j < (int)jobs_.size(); ++j) {
+    if (jobs_[j].state != JOB_QUEUED) continue;
+    queued.push_back(j);
+    seconds.push_back(std::vector<float>());
+    for (const Machine &machine : machines_)
+      seconds.back().push_back(jobs_[j].seconds[machine.config]);
+  }
+  std::vector<float> busy;
+  for (const Machine &machine : machines_)
+    busy.push_back(RemainingSeconds(machine, now));
+
+  std::vector<int> order;
+  const std::vector<int> plan = PlanJobs(seconds, busy, &order);
+
+  // The first job planned on an idle machine is started right away.
+  std::vector<bool> first_seen(machines_.size(), false);
+  for (size_t m = 0; m < machines_.size(); ++m)
+    machines_[m].planned_seconds = busy[m];
+  for (int q : order) {
+    const int m = plan[q];
+    Machine &machine = machines_[m];
+    machine.planned_seconds += seconds[q][m];
+    if (first_seen[m]) continue;
+    first_seen[m] = true;
+    if (machine.state != MACHINE_IDLE) continue;
+
+    Job &job = jobs_[queued[q]];
+    machine.job_fd = open(job.filename.c_str(), O_RDONLY);
+    if (machine.job_fd < 0) {
+      Log_error("Can't open %s: %s", job.filename.c_str(), strerror(errno));
+      job.state = JOB_FAILED;
+      continue;
+    }
+    Log_info("%s: starting %s (estimated %.0fs)", machine.name.c_str(),
+             job.filename.c_str(), seconds[q][m]);
+    job.state = JOB_RUNNING;
+    machine.job = queued[q];
+    machine.job_start_ms = now;
+    machine.state = MACHINE_RUNNING;
+  }
+}
+
+void JobDispatcher::Connect(Machine *machine, int64_t now) {
+  machine->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (machine->fd < 0) {
+    Log_error("socket(): %s", strerror(errno));
+    machine->retry_ms = now + RECONNECT_MS;
+    return;
+  }
+  if (connect(machine->fd, (struct sockaddr*) &machine->address,
+              sizeof(machine->address)) < 0 && errno != EINPROGRESS) {
+    Disconnect(machine, now);
+    return;
+  }
+  machine->state = MACHINE_CONNECTING;
+  machine->handshake_done = false;
+  machine->input.clear();
+  machine->output = "M117 " HELLO_MARKER "\n";
+}
+
+void JobDispatcher::Disconnect(Machine *machine, int64_t now) {
+  if (machine->fd >= 0) close(machine->fd);
+  machine->fd = -1;
+  if (machine->job >= 0) {
+    // We don't know how far it got; not safe to just start over.
+    Log_error("%s: lost connection while running %s", machine->name.c_str(),
+              jobs_[machine->job].filename.c_str());
+    jobs_[machine->job].state = JOB_FAILED;
+    machine->job = -1;
+  }
+  if (machine->job_fd >= 0) close(machine->job_fd);
+  machine->job_fd = -1;
+  machine->output.clear();
+  machine->state = MACHINE_DISCONNECTED;
+  machine->retry_ms = now + RECONNECT_MS;
+}
+
+void JobDispatcher::HandleWritable(Machine *machine, int64_t now) {
+  if (machine->state == MACHINE_CONNECTING && !machine->handshake_done) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(machine->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      Log_debug("%s: %s", machine->name.c_str(), strerror(err));
+      Disconnect(machine, now);
+      return;
+    }
+  }
+  if (machine->output.empty() && machine->job_fd >= 0
+      && machine->state == MACHINE_RUNNING) {
+    char buffer[SEND_CHUNK];
+    const ssize_t r = read(machine->job_fd, buffer, sizeof(buffer));
+    if (r > 0) {
+      machine->output.assign(buffer, r);
+    } else {
+      // All sent. Make sure the last line is terminated, then wait for the
+      // motion to finish and tell us.
+      close(machine->job_fd);
+      machine->job_fd = -1;
+      machine->output = StringPrintf("\nM400\nM117 " DONE_MARKER "%d\n",
+                                     machine->job);
+    }
+  }
+  if (machine->output.empty()) return;
+  const ssize_t written = send(machine->fd, machine->output.data(),
+                               machine->output.size(), MSG_NOSIGNAL);
+  if (written < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      Log_error("%s: %s", machine->name.c_str(), strerror(errno));
+      Disconnect(machine, now);
+    }
+    return;
+  }
+  machine->output.erase(0, written);
+}
+
+void JobDispatcher::HandleReadable(Machine *machine, int64_t now) {
+  char buffer[4096];
+  const ssize_t r = recv(machine->fd, buffer, sizeof(buffer), 0);
+  if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+    Log_info("%s: disconnected", machine->name.c_str());
+    Disconnect(machine, now);
+    return;
+  }
+  if (r < 0) return;
+  machine->input.append(buffer, r);
+  size_t eol;
+  while (machine->fd >= 0
+         && (eol = machine->input.find('\n')) != std::string::npos) {
+    const std::string line = machine->input.substr(0, eol);
+    machine->input.erase(0, eol + 1);
+    HandleLine(machine, line, now);
+  }
+}
+
+void JobDispatcher::HandleLine(Machine *machine, const std::string &line,
+                               int64_t now) {
+  if (line == "ok") return;  // Flow control is done by TCP.
+  if (line.find(NOT_GCODE_STREAM) != std::string::npos) {
+    Log_info("%s: busy with another G-code stream; retrying later",
+             machine->name.c_str());
+    Disconnect(machine, now);
+    return;
+  }
+  if (line.find(HELLO_MARKER) != std::string::npos) {
+    if (machine->state == MACHINE_CONNECTING) {
+      Log_info("%s: connected", machine->name.c_str());
+      machine->handshake_done = true;
+      machine->state = MACHINE_IDLE;
+    }
+    return;
+  }
+  const size_t marker = line.find(DONE_MARKER);
+  if (marker != std::string::npos) {
+    const int job = atoi(line.c_str() + marker + strlen(DONE_MARKER));
+    if (job != machine->job) return;
+    Log_info("%s: finished %s in %.0fs (estimated %.0fs)",
+             machine->name.c_str(), jobs_[job].filename.c_str(),
+             (now - machine->job_start_ms) / 1000.0,
+             jobs_[job].seconds[machine->config]);
+    jobs_[job].state = JOB_DONE;
+    machine->job = -1;
+    machine->jobs_done++;
+    machine->state = MACHINE_IDLE;
+    return;
+  }
+  Log_debug("%s: %s", machine->name.c_str(), line.c_str());
+}
+
+void JobDispatcher::AppendStatus(std::string *out) const {
+  out->append("BGDS");
+  append_u8(out, 1);    // version
+  append_u8(out, 20);   // record size
+  append_u16(out, machines_.size());
+  append_u32(out, CountJobs(JOB_QUEUED));
+  append_u32(out, CountJobs(JOB_DONE));
+  for (const Machine &machine : machines_) {
+    append_u8(out, machine.state);
+    append_u8(out, 0);
+    append_u16(out, ntohs(machine.address.sin_port));
+    out->append((const char*) &machine.address.sin_addr.s_addr, 4);
+    append_u32(out, machine.job < 0 ? 0xffffffff : machine.job);
+    append_u32(out, machine.jobs_done);
+    append_u32(out, isinf(machine.planned_seconds)
+               ? 0xffffffff : (uint32_t) machine.planned_seconds);
+  }
+}
+
+int JobDispatcher::Run(int status_socket) {
+  if (status_socket >= 0 && listen(status_socket, 16) < 0) {
+    Log_error("listen(): %s", strerror(errno));
+    return 1;
+  }
+  struct sigaction sa = {};
+  sa.sa_handler = receive_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  caught_signal = 0;
+
+  struct StatusClient {
+    int fd;
+    std::string output;
+  };
+  std::vector<StatusClient> status_clients;
+  std::vector<struct pollfd> fds;
+  int result = 0;
+  for (;;) {
+    const int64_t now = now_ms();
+    for (Machine &machine : machines_) {
+      if (machine.state == MACHINE_DISCONNECTED && now >= machine.retry_ms)
+        Connect(&machine, now);
+    }
+    StartJobs(now);
+    if (CountJobs(JOB_QUEUED) + CountJobs(JOB_RUNNING) == 0) {
+      result = CountJobs(JOB_FAILED) > 0 ? 1 : 0;
+      break;
+    }
+
+    fds.clear();
+    for (const Machine &machine : machines_) {
+      struct pollfd p = { machine.fd, 0, 0 };
+      if (machine.fd >= 0) {
+        p.events = POLLIN;
+        const bool connecting = (machine.state == MACHINE_CONNECTING
+                                 && !machine.handshake_done);
+        if (connecting || !machine.output.empty()
+            || (machine.state == MACHINE_RUNNING && machine.job_fd >= 0))
+          p.events |= POLLOUT;
+      }
+      fds.push_back(p);
+    }
+    for (const StatusClient &client : status_clients) {
+      struct pollfd p = { client.fd, POLLIN, 0 };
+      if (!client.output.empty()) p.events |= POLLOUT;
+      fds.push_back(p);
+    }
+    if (status_socket >= 0) {
+      struct pollfd p = { status_socket, POLLIN, 0 };
+      fds.push_back(p);
+    }
+
+    if (poll(fds.data(), fds.size(), 1000) < 0) {
+      if (errno == EINTR && caught_signal) {
+        result = 2;
+        break;
+      }
+      if (errno != EINTR) {
+        Log_error("poll(): %s", strerror(errno));
+        result = 1;
+        break;
+      }
+      continue;
+    }
+    const int64_t after_poll = now_ms();
+    size_t i = 0;
+    for (Machine &machine : machines_) {
+      const short revents = fds[i++].revents;
+      if (machine.fd < 0 || revents == 0) continue;
+      if (revents & (POLLIN | POLLERR | POLLHUP))
+        HandleReadable(&machine, after_poll);
+      if (machine.fd >= 0 && (revents & POLLOUT))
+        HandleWritable(&machine, after_poll);
+    }
+    for (StatusClient &client : status_clients) {
+      const short revents = fds[i++].revents;
+      if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        char buffer[256];
+        const ssize_t r = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (r <= 0) {
+          close(client.fd);
+          client.fd = -1;
+          continue;
+        }
+        for (ssize_t b = 0; b < r; ++b) AppendStatus(&client.output);
+      }
+      if (!client.output.empty()) {
+        const ssize_t w = send(client.fd, client.output.data(),
+                               client.output.size(),
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w > 0) client.output.erase(0, w);
+        if ((w < 0 && errno != EAGAIN)
+            || client.output.size() > MAX_STATUS_OUTPUT) {
+          close(client.fd);
+          client.fd = -1;
+        }
+      }
+    }
+    status_clients.erase(std::remove_if(status_clients.begin(),
+                                        status_clients.end(),
+                                        [](const StatusClient &c) {
+                                          return c.fd < 0;
+                                        }),
+                         status_clients.end());
+    if (status_socket >= 0 && (fds[i].revents & POLLIN)) {
+      StatusClient client;
+      client.fd = accept4(status_socket, NULL, NULL, SOCK_NONBLOCK);
+      if (client.fd >= 0) {
+        AppendStatus(&client.output);
+        status_clients.push_back(client);
+      }
+    }
+  }
+
+  for (StatusClient &client : status_clients) close(client.fd);
+  if (status_socket >= 0) close(status_socket);
+  return result;
+}
@@ -0,0 +1,139 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_JOB_DISPATCHER_H_
+#define _BEAGLEG_JOB_DISPATCHER_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "gcode-machine-control.h"
+
+// Greedy longest-job-first planning: every job, in order of decreasing
+// duration, goes to the machine it would finish on first, given the seconds
+// each machine is still busy with ("busy_seconds"; infinite for machines not
+// available) and the estimated "seconds[job][machine]".
+// Returns the machine for each job, in the order they are planned on it
+// (*order, if given), or -1 if there is no machine available at all.
+std::vector<int> PlanJobs(const std::vector<std::vector<float> > &seconds,
+                          std::vector<float> busy_seconds,
+                          std::vector<int> *order = NULL);
+
+// Distributes G-code jobs over a fleet of machine-control instances, each
+// reached via its TCP port.
+//
+// The duration of each job is estimated up front with
+// determine_print_stats() for the configuration of each machine, and jobs
+// are assigned to the machine that is predicted to finish them first
+// (see PlanJobs()). A job is only started once its machine is idle;
+// the plan is redone whenever a machine finishes or drops out, so faster
+// or slower than predicted machines are taken into account.
+//
+// The connection to each machine is kept open between jobs. After each job,
+// the dispatcher sends M400 (wait for the motion to finish) and an M117 with
+// a marker that is echoed back once the job is done.
+//
+// With a status socket, clients get a compact binary snapshot of the fleet on
+// connect and then again for every byte they send. All numbers are little
+// endian:
+//   header, 16 bytes:
+//     char[4] magic "BGDS"; u8 version (1); u8 record size (20);
+//     u16 number of machines; u32 jobs queued; u32 jobs done.
+//   followed by one 20 byte record per machine:
+//     u8 state (MachineState); u8 reserved; u16 port;
+//     u8[4] IPv4 address; u32 current job (0xffffffff if none);
+//     u32 jobs done; u32 predicted seconds until all planned work is done.
+class JobDispatcher {
+public:
+  enum MachineState {
+    MACHINE_DISCONNECTED = 0,
+    MACHINE_CONNECTING   = 1,  // TCP connect and handshake.
+    MACHINE_IDLE         = 2,
+    MACHINE_RUNNING      = 3,  // Sending a job or waiting for it to finish.
+  };
+
+  JobDispatcher();
+  ~JobDispatcher();
+
+  // Add a machine configuration to estimate jobs with; returns its index.
+  // Machines of the same kind should share one, as each job is estimated
+  // once per configuration.
+  int AddConfig(const MachineControlConfig &config);
+
+  // Add machine reachable at "host":"port", running with the configuration
+  // of the given index. Returns false if the host can't be resolved.
+  bool AddMachine(const std::string &host, int port, int config);
+
+  // Add a G-code file as job and estimate how long it takes on each machine.
+  // Add all machines first. Returns false if the file can't be read.
+  bool AddJob(const std::string &filename);
+
+  // Estimated seconds of "job" on "machine".
+  float EstimatedSeconds(int job, int machine) const;
+
+  // Run until all jobs are done or failed (returns 0 if all succeeded,
+  // 1 otherwise) or a signal is received (returns 2). If "status_socket"
+  // is >= 0, it is a bound socket on which status clients are served.
+  int Run(int status_socket);
+
+  // Append the binary status snapshot described above to "out".
+  void AppendStatus(std::string *out) const;
+
+private:
+  enum JobState { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED };
+  struct Job {
+    std::string filename;
+    std::vector<float> seconds;  // Estimate per config.
+    JobState state;
+  };
+
+  struct Machine {
+    std::string name;            // host:port for messages.
+    struct sockaddr_in address;
+    int config;                  // Index into configs_.
+    MachineState state;
+    bool handshake_done;
+    int fd;
+    int job;                     // Current job or -1.
+    int job_fd;                  // File of the job being sent; -1 once sent.
+    int64_t job_start_ms;
+    int64_t retry_ms;            // When to reconnect if disconnected.
+    int jobs_done;
+    float planned_seconds;       // Until all work planned for it is done.
+    std::string output;          // Not yet sent.
+    std::string input;           // Incomplete line received.
+  };
+
+  float RemainingSeconds(const Machine &machine, int64_t now_ms) const;
+  void StartJobs(int64_t now_ms);
+  void Connect(Machine *machine, int64_t now_ms);
+  void Disconnect(Machine *machine, int64_t now_ms);
+  void HandleWritable(Machine *machine, int64_t now_ms);
+  void HandleReadable(Machine *machine, int64_t now_ms);
+  void HandleLine(Machine *machine, const std::string &line, int64_t now_ms);
+  int CountJobs(JobState state) const;
+
+  std::vector<MachineControlConfig> configs_;
+  std::vector<Machine> machines_;
+  std::vector<Job> jobs_;
+};
+
+#endif  // _BEAGLEG_JOB_DISPATCHER_H_
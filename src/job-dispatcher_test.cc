@@ -0,0 +1,216 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job-dispatcher.h"
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+
+namespace {
+// Speaks just enough of the machine-control protocol: acknowledges lines
+// and echoes M117 messages. Records all G-code received.
+class FakeMachine {
+public:
+  FakeMachine() : port_(0) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd_, (struct sockaddr*) &addr, &len);
+    port_ = ntohs(addr.sin_port);
+    listen(listen_fd_, 2);
+    pthread_create(&thread_, NULL, &Serve, this);
+  }
+
+  ~FakeMachine() {
+    pthread_join(thread_, NULL);
+    close(listen_fd_);
+  }
+
+  int port() const { return port_; }
+
+  // Only valid after the dispatcher is done.
+  const std::string &received() const { return received_; }
+
+private:
+  static void *Serve(void *arg) {
+    FakeMachine *self = reinterpret_cast<FakeMachine*>(arg);
+    const int fd = accept(self->listen_fd_, NULL, NULL);
+    std::string line;
+    char c;
+    while (read(fd, &c, 1) == 1) {
+      if (c != '\n') {
+        line.append(1, c);
+        continue;
+      }
+      self->received_.append(line).append("\n");
+      std::string reply = "ok\n";
+      if (line.compare(0, 5, "M117 ") == 0)
+        reply = "// Msg: " + line.substr(5) + "\n" + reply;
+      if (write(fd, reply.data(), reply.size()) < 0) break;
+      line.clear();
+    }
+    close(fd);
+    return NULL;
+  }
+
+  int listen_fd_;
+  int port_;
+  pthread_t thread_;
+  std::string received_;
+};
+
+class TempFile {
+public:
+  explicit TempFile(const std::string &content) {
+    char name[] = "/tmp/job-dispatcher_test.XXXXXX";
+    const int fd = mkstemp(name);
+    EXPECT_EQ((ssize_t)content.size(),
+              write(fd, content.data(), content.size()));
+    close(fd);
+    filename_ = name;
+  }
+  ~TempFile() { unlink(filename_.c_str()); }
+  const std::string &filename() const { return filename_; }
+
+private:
+  std::string filename_;
+};
+
+MachineControlConfig TestConfig(float feedrate) {
+  MachineControlConfig config;
+  for (int i = 0; i <= AXIS_Z; ++i) {
+    config.steps_per_mm[i] = 100;
+    config.acceleration[i] = 1e6;  // Keeps the estimates simple.
+    config.max_feedrate[i] = feedrate;
+  }
+  config.require_homing = false;
+  config.range_check = false;
+  return config;
+}
+
+uint32_t ReadU32(const std::string &s, int pos) {
+  return (uint8_t)s[pos] | (uint8_t)s[pos+1] << 8
+    | (uint8_t)s[pos+2] << 16 | (uint32_t)(uint8_t)s[pos+3] << 24;
+}
+}  // namespace
+
+TEST(PlanJobs, LongestJobFirstOnEarliestFinishingMachine) {
+  // Two identical machines. Longest first: 5 -> m0, 4 -> m1, 3 -> m1 (7),
+  // 2 -> m0 (7).
+  const std::vector<std::vector<float> > seconds = {
+    {2, 2}, {5, 5}, {3, 3}, {4, 4} };
+  std::vector<int> order;
+  const std::vector<int> plan = PlanJobs(seconds, {0, 0}, &order);
+  EXPECT_EQ(std::vector<int>({0, 0, 1, 1}), plan);
+  EXPECT_EQ(std::vector<int>({1, 3, 2, 0}), order);
+}
+
+TEST(PlanJobs, BusyAndFasterMachinesAreAccountedFor) {
+  // Machine 1 is more than twice as fast, but might still be busy.
+  const std::vector<std::vector<float> > seconds = { {10, 4}, {10, 4} };
+  EXPECT_EQ(std::vector<int>({0, 1}), PlanJobs(seconds, {0, 7}));
+  EXPECT_EQ(std::vector<int>({1, 1}), PlanJobs(seconds, {0, 0}));
+}
+
+TEST(PlanJobs, NoMachineAvailable) {
+  const std::vector<std::vector<float> > seconds = { {1} };
+  EXPECT_EQ(std::vector<int>({-1}), PlanJobs(seconds, {INFINITY}));
+}
+
+TEST(JobDispatcher, EstimatesPerConfigAndStatusFormat) {
+  TempFile job("G1 X100 F6000\n");  // 100mm at 100mm/s
+  JobDispatcher dispatcher;
+  const int slow = dispatcher.AddConfig(TestConfig(50));
+  const int fast = dispatcher.AddConfig(TestConfig(1000));
+  ASSERT_TRUE(dispatcher.AddMachine("127.0.0.1", 4444, slow));
+  ASSERT_TRUE(dispatcher.AddMachine("127.0.0.1", 4445, fast));
+  ASSERT_TRUE(dispatcher.AddJob(job.filename()));
+  EXPECT_NEAR(2.0, dispatcher.EstimatedSeconds(0, 0), 0.1);  // capped 50mm/s
+  EXPECT_NEAR(1.0, dispatcher.EstimatedSeconds(0, 1), 0.1);
+
+  std::string status;
+  dispatcher.AppendStatus(&status);
+  ASSERT_EQ(16u + 2 * 20, status.size());
+  EXPECT_EQ("BGDS", status.substr(0, 4));
+  EXPECT_EQ(1, status[4]);   // version
+  EXPECT_EQ(20, status[5]);  // record size
+  EXPECT_EQ(2, status[6]);   // machines
+  EXPECT_EQ(1u, ReadU32(status, 8));   // queued
+  EXPECT_EQ(0u, ReadU32(status, 12));  // done
+  EXPECT_EQ(JobDispatcher::MACHINE_DISCONNECTED, status[16]);
+  EXPECT_EQ(4444, (uint8_t)status[18] | (uint8_t)status[19] << 8);
+  EXPECT_EQ(std::string("\x7f\0\0\x01", 4), status.substr(20, 4));
+  EXPECT_EQ(0xffffffffu, ReadU32(status, 24));  // no current job
+  EXPECT_EQ(4445, (uint8_t)status[38] | (uint8_t)status[39] << 8);
+}
+
+TEST(JobDispatcher, RunsAllJobsOnMachines) {
+  TempFile job1("G1 X10 F6000\nG1 Y10\n");
+  TempFile job2("G1 X30 F6000");  // Longer. No final newline.
+  FakeMachine machine;
+  {
+    JobDispatcher dispatcher;
+    const int config = dispatcher.AddConfig(TestConfig(1000));
+    ASSERT_TRUE(dispatcher.AddMachine("127.0.0.1", machine.port(), config));
+    ASSERT_TRUE(dispatcher.AddJob(job1.filename()));
+    ASSERT_TRUE(dispatcher.AddJob(job2.filename()));
+    EXPECT_EQ(0, dispatcher.Run(-1));
+
+    std::string status;
+    dispatcher.AppendStatus(&status);
+    EXPECT_EQ(0u, ReadU32(status, 8));   // queued
+    EXPECT_EQ(2u, ReadU32(status, 12));  // done
+  }  // Dispatcher gone: connection closed, fake machine finishes.
+
+  // Longer job first, each followed by waiting for it to be finished.
+  const std::string &r = machine.received();
+  const size_t hello = r.find("M117 beagleg-dispatch hello\n");
+  const size_t second = r.find("G1 X30 F6000\nM400\n"
+                               "M117 beagleg-dispatch done 1\n");
+  const size_t first = r.find("G1 X10 F6000\nG1 Y10\n\nM400\n"
+                              "M117 beagleg-dispatch done 0\n");
+  ASSERT_NE(std::string::npos, hello);
+  ASSERT_NE(std::string::npos, first);
+  ASSERT_NE(std::string::npos, second);
+  EXPECT_LT(hello, second);
+  EXPECT_LT(second, first);
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/null");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -40,11 +40,27 @@ MachineControlConfig::MachineControlConfig() {
   range_check = true;
   require_homing = true;
   enable_pause = false;
+  laser_mode = false;
+  laser_max_s = 1000;
   home_order = kHomeOrder;
   threshold_angle = -1;
+  junction_deviation = -1;
+  lookahead_segments = 128;
+  s_curve_acceleration = false;
+  arc_tolerance = -1;
+  arc_min_segment = -1;
+  merge_deviation = -1;
+  merge_feed_tolerance = 0.05;
+  max_step_frequency = 1e6;
+  bed_mesh_points = 0;
+  bed_mesh_margin = 10;
+  bed_mesh_tolerance = 0.01;
   auto_motor_disable_seconds = -1;
   auto_fan_disable_seconds = -1;
   auto_fan_pwm = 0;
+  for (const GCodeParserAxis axis : AllAxes()) {
+    input_shaper_damping[axis] = 0.1;
+  }
 }
 
 namespace {
@@ -82,11 +98,24 @@ public:
       ACCEPT_VALUE("range-check",    Bool,   &config_->range_check);
       ACCEPT_VALUE("synchronous",    Bool,   &config_->synchronous);
       ACCEPT_VALUE("enable-pause",   Bool,   &config_->enable_pause);
+      ACCEPT_VALUE("laser-mode",     Bool,   &config_->laser_mode);
+      ACCEPT_EXPR("laser-max-s",     &config_->laser_max_s);
       ACCEPT_VALUE("auto-motor-disable-seconds",
                    Int,   &config_->auto_motor_disable_seconds);
       ACCEPT_VALUE("auto-fan-disable-seconds",
                    Int,  &config_->auto_fan_disable_seconds);
       ACCEPT_VALUE("auto-fan-pwm",   Int,    &config_->auto_fan_pwm);
+      ACCEPT_VALUE("lookahead-segments", Int, &config_->lookahead_segments);
+      ACCEPT_EXPR("junction-deviation", &config_->junction_deviation);
+      ACCEPT_VALUE("s-curve-acceleration", Bool, &config_->s_curve_acceleration);
+      ACCEPT_EXPR("arc-tolerance", &config_->arc_tolerance);
+      ACCEPT_EXPR("arc-min-segment", &config_->arc_min_segment);
+      ACCEPT_EXPR("merge-deviation", &config_->merge_deviation);
+      ACCEPT_EXPR("merge-feed-tolerance", &config_->merge_feed_tolerance);
+      ACCEPT_EXPR("max-step-frequency", &config_->max_step_frequency);
+      ACCEPT_VALUE("bed-mesh-points", Int, &config_->bed_mesh_points);
+      ACCEPT_EXPR("bed-mesh-margin", &config_->bed_mesh_margin);
+      ACCEPT_EXPR("bed-mesh-tolerance", &config_->bed_mesh_tolerance);
       return false;
     }
 
@@ -101,6 +130,21 @@ public:
 
       ACCEPT_EXPR("range",            &config_->move_range_mm[current_axis_]);
 
+      ACCEPT_EXPR("input-shaper-frequency",
+                  &config_->input_shaper_frequency[current_axis_]);
+      ACCEPT_EXPR("input-shaper-damping",
+                  &config_->input_shaper_damping[current_axis_]);
+      if (name == "input-shaper") {
+        if (ParseInputShaperType(value, &config_->input_shaper[current_axis_]))
+          return true;
+        ReportError(line_no, StringPrintf("input-shaper[%c]: valid values are "
+                                          "'none', 'zv', 'zvd' or 'ei', but "
+                                          "got '%s'",
+                                          gcodep_axis2letter(current_axis_),
+                                          value.c_str()));
+        return false;
+      }
+
       if (name == "home-pos")
         return SetHomePos(line_no, current_axis_, value);
     }
@@ -34,6 +34,9 @@ TEST(MachineControlConfig, GeneralMapping) {
                "range-check = no\n"      // .. to say ...
                "synchronous = false\n"   // 'NO'.
                "auto-motor-disable-seconds = 188 \n"
+               "lookahead-segments = 300\n"
+               "junction-deviation = 0.05\n"
+               "s-curve-acceleration = yes\n"
                );
   MachineControlConfig config;
   EXPECT_TRUE(config.ConfigureFromFile(&p));
@@ -43,6 +46,9 @@ TEST(MachineControlConfig, GeneralMapping) {
   EXPECT_FALSE(config.range_check);
   EXPECT_FALSE(config.synchronous);
   EXPECT_EQ(188, config.auto_motor_disable_seconds);
+  EXPECT_EQ(300, config.lookahead_segments);
+  EXPECT_FLOAT_EQ(0.05f, config.junction_deviation);
+  EXPECT_TRUE(config.s_curve_acceleration);
 }
 
 TEST(MachineControlConfig, AxisMapping) {
@@ -53,6 +59,8 @@ TEST(MachineControlConfig, AxisMapping) {
                "max-acceleration = 4242\n"
                "range = 987\n"
                "home-pos = max\n"
+               "input-shaper = ZVD\n"
+               "input-shaper-frequency = 42.5\n"
 
                "[ Y-Axis ]\n"
                "home-pos = min\n"       // Different home pos.
@@ -67,6 +75,10 @@ TEST(MachineControlConfig, AxisMapping) {
   EXPECT_FLOAT_EQ(987.0f, config.move_range_mm[AXIS_X]);
   EXPECT_EQ(HardwareMapping::TRIGGER_MAX, config.homing_trigger[AXIS_X]);
   EXPECT_EQ(HardwareMapping::TRIGGER_MIN, config.homing_trigger[AXIS_Y]);
+  EXPECT_EQ(SHAPER_ZVD, config.input_shaper[AXIS_X]);
+  EXPECT_FLOAT_EQ(42.5f, config.input_shaper_frequency[AXIS_X]);
+  EXPECT_FLOAT_EQ(0.1f, config.input_shaper_damping[AXIS_X]);  // Default.
+  EXPECT_EQ(SHAPER_NONE, config.input_shaper[AXIS_Y]);
 }
 
 #if 0
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -37,16 +38,23 @@
 
 #include "gcode-parser/gcode-parser.h"
 #include "common/logging.h"
+#include "common/trace.h"
 #include "common/string-util.h"
 
+#include "adc.h"
 #include "config-parser.h"
 #include "gcode-machine-control.h"
+#include "gcode-server.h"
 #include "hardware-mapping.h"
+#include "input-shaping.h"
 #include "pru-hardware-interface.h"
 #include "motion-queue.h"
 #include "motor-operations.h"
+#include "segment-file.h"
 #include "spindle-control.h"
+#include "temperature-control.h"
 #include "sim-firmware.h"
+#include "threaded-motor-operations.h"
 
 static int usage(const char *prog, const char *msg) {
   if (msg) {
@@ -58,6 +66,7 @@ static int usage(const char *prog, const char *msg) {
           "  -c, --config <config-file> : Configuration file. (Required)\n"
           "  -p, --port <port>          : Listen on this TCP port for GCode.\n"
           "  -b, --bind-addr <bind-ip>  : Bind to this IP (Default: 0.0.0.0).\n"
+          "      --ack-window <n>       : With --port: clients may keep <n> unacknowledged lines in flight (Default: 0, send-and-wait).\n"
           "  -l, --logfile <logfile>    : Logfile to use. If empty, messages go to syslog (Default: /dev/stderr).\n"
           "      --param <paramfile>    : Parameter file to use.\n"
           "  -d, --daemon               : Run as daemon.\n"
@@ -67,15 +76,25 @@ static int usage(const char *prog, const char *msg) {
           "  -f <factor>                : Feedrate speed factor (Default 1.0).\n"
           "  -n                         : Dryrun; don't send to motors, no GPIO or PRU needed (Default: off).\n"
           // -N dry-run with simulation output; mostly for development, so not mentioned here.
+          "      --sim-trace <format>   : Dryrun, writing a fast simulation trace to stdout; <format> is 'csv' or 'binary'.\n"
+          "      --sim-decimate <n>     : With --sim-trace: also sample every <n> loops between phase boundaries (Default: 0).\n"
           "  -P                         : Verbose: Show some more debug output (Default: off).\n"
           "  -S                         : Synchronous: don't queue (Default: off).\n"
           "      --loop[=count]         : Loop file number of times (no value: forever; equal sign with value important.)\n"
           "      --allow-m111           : Allow changing the debug level with M111 (Default: off).\n"
+          "      --queue-low-water <n>  : Refill motion queue once only <n> segments are left (Default: %d of %d).\n"
+          "      --motor-thread         : Feed motors from a separate thread, decoupled from parsing (Default: off).\n"
+          "      --motor-thread-cpu <n> : Pin motor thread to this CPU. Implies --motor-thread.\n"
+          "      --motor-thread-prio <p>: Run motor thread with SCHED_FIFO priority <p>. Implies --motor-thread.\n"
+          "      --segment-cache <dir>  : With --loop: replay planned segments from cache in <dir> instead of parsing again.\n"
+          "      --replay <segfile>     : Instead of GCode, send pre-planned segments created with gcode2segments. Homes first if homing is required.\n"
+          "      --trace <file>         : Trace time spent per stage; dumped to <file> on SIGUSR1 and exit. See trace2json.\n"
           // --threshold-angle specifies threshold angle used for arc segment acceleration.
           "\nConfiguration file overrides:\n"
           "     --homing-required       : Require homing before any moves (require-homing = yes).\n"
           "     --nohoming-required     : (Opposite of above^): Don't require homing before any moves (require-homing = no).\n"
-          "     --norange-check         : Disable machine limit checks. (range-check = no).\n");
+          "     --norange-check         : Disable machine limit checks. (range-check = no).\n",
+          QUEUE_LEN / 2, QUEUE_LEN);
   return 1;
 }
 
@@ -125,24 +144,312 @@ static bool drop_privileges(StringPiece privs) {
   return true;
 }
 
+// Passes the parser events on to the machine. Events with effects outside
+// the motion queue (dwell, spindle and aux outputs, fans, temperatures,
+// waiting for inputs, homing, probing, motor enable and all other M-codes)
+// mark the recording of the segment cache as not repeatable: a replay only
+// sends the segments, so it would skip them.
+class SegmentCacheEvents : public GCodeParser::EventReceiver {
+public:
+  SegmentCacheEvents(GCodeParser::EventReceiver *delegate,
+                     RecordingMotionQueue *segment_cache)
+    : delegate_(delegate), segment_cache_(segment_cache) {}
+
+  // Called around every run of the program, also when it is replayed.
+  void gcode_start(GCodeParser *parser) { delegate_->gcode_start(parser); }
+  void gcode_finished(bool end_of_stream) {
+    delegate_->gcode_finished(end_of_stream);
+  }
+
+  // Only informational or part of the planning.
+  void inform_origin_offset(const AxesRegister &offset) {
+    delegate_->inform_origin_offset(offset);
+  }
+  void gcode_command_done(char letter, float val) {
+    delegate_->gcode_command_done(letter, val);
+  }
+  void input_idle(bool is_first) { delegate_->input_idle(is_first); }
+  void set_speed_factor(float factor) { delegate_->set_speed_factor(factor); }
+
+  // Motion; rasters are refused by the recorder itself.
+  bool coordinated_move(float feed, const AxesRegister &pos) {
+    return delegate_->coordinated_move(feed, pos);
+  }
+  bool rapid_move(float feed, const AxesRegister &pos) {
+    return delegate_->rapid_move(feed, pos);
+  }
+  void arc_move(float feed, GCodeParserAxis normal_axis, bool clockwise,
+                const AxesRegister &start, const AxesRegister &center,
+                const AxesRegister &end) {
+    delegate_->arc_move(feed, normal_axis, clockwise, start, center, end);
+  }
+  void spline_move(float feed, const AxesRegister &start,
+                   const AxesRegister &cp1, const AxesRegister &cp2,
+                   const AxesRegister &end) {
+    delegate_->spline_move(feed, start, cp1, cp2, end);
+  }
+  bool raster_move(float feed, const AxesRegister &start,
+                   const AxesRegister &end, const uint8_t *pixels, int count) {
+    return delegate_->raster_move(feed, start, end, pixels, count);
+  }
+
+  // Everything else is not in the segments.
+  void wait_for_start() {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->wait_for_start();
+  }
+  void go_home(AxisBitmap_t axis_bitmap) {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->go_home(axis_bitmap);
+  }
+  bool probe_axis(float feed, enum GCodeParserAxis axis, float *probed) {
+    segment_cache_->MarkNotRepeatable();
+    return delegate_->probe_axis(feed, axis, probed);
+  }
+  void set_fanspeed(float value) {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->set_fanspeed(value);
+  }
+  void set_temperature(float degrees_c) {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->set_temperature(degrees_c);
+  }
+  void wait_temperature() {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->wait_temperature();
+  }
+  void dwell(float time_ms) {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->dwell(time_ms);
+  }
+  void motors_enable(bool enable) {
+    segment_cache_->MarkNotRepeatable();
+    delegate_->motors_enable(enable);
+  }
+  const char *unprocessed(char letter, float value, const char *rest) {
+    segment_cache_->MarkNotRepeatable();
+    return delegate_->unprocessed(letter, value, rest);
+  }
+
+private:
+  GCodeParser::EventReceiver *const delegate_;
+  RecordingMotionQueue *const segment_cache_;
+};
+
+// Parse the file once more, or, if there is a segment cache, replay the
+// segments from the cache file if possible. Otherwise record the segments,
+// so that the next iteration can replay them.
+static int run_buffer_once(GCodeParser *parser,
+                           GCodeParser::EventReceiver *events,
+                           const char *data, size_t len,
+                           MotorOperations *motor_ops,
+                           RecordingMotionQueue *segment_cache,
+                           const std::string &cache_file,
+                           uint64_t key, uint64_t config_key) {
+  if (!segment_cache)
+    return parser->ParseBuffer(data, len, stderr);
+
+  events->gcode_start(parser);  // Same as the parser would, for the replay.
+  if (segment_cache->Replay(cache_file.c_str(), key)) {
+    events->gcode_finished(true);
+    return 0;
+  }
+
+  segment_cache->StartRecording();
+  const int ret = parser->ParseBuffer(data, len, stderr);
+  motor_ops->WaitQueueEmpty();  // All segments went through the cache.
+  const bool repeatable = segment_cache->StopRecording();
+  if (ret == 0 && repeatable && segment_cache->recorded_count() > 0) {
+    if (segment_cache->WriteFile(cache_file.c_str(), key, config_key)) {
+      Log_info("Cached %d segments in %s", segment_cache->recorded_count(),
+               cache_file.c_str());
+    }
+  }
+  return ret;
+}
+
+// The configuration can be reloaded between iterations (SIGHUP, M501). Then
+// segments are planned differently, so return the key of the configuration
+// the machine runs with now. "range_check" is not reloaded, but might have
+// been overridden on the command line.
+static uint64_t current_config_key(GCodeMachineControl *machine,
+                                   bool range_check, int *reload_count,
+                                   uint64_t config_key) {
+  std::string content;
+  const int count = machine->ConfigReloadCount(&content);
+  if (count == *reload_count)
+    return config_key;
+  *reload_count = count;
+  ConfigParser config_parser;
+  config_parser.SetContent(content);
+  MachineControlConfig config;
+  config.ConfigureFromFile(&config_parser);  // Already parsed fine on reload.
+  config.range_check = range_check;
+  return SegmentFileConfigKey(config_parser, config);
+}
+
 // Reads the given "gcode_filename" with GCode and operates machine with it.
 // If "loop_count" is >= 0, repeats this number after the first execution.
+// If "segment_cache" is given, iterations ending where they started are
+// recorded in "cache_dir", keyed by the file content and "config_key", which
+// follows configuration reloads.
 static int send_file_to_machine(GCodeMachineControl *machine,
                                 GCodeParser *parser,
+                                MotorOperations *motor_ops,
+                                RecordingMotionQueue *segment_cache,
+                                const char *cache_dir, uint64_t config_key,
+                                bool range_check,
                                 const char *gcode_filename, int loop_count) {
-  int ret;
+  int ret = 0;
   machine->SetMsgOut(stderr);
+
+  // Regular files are mapped into memory and parsed in place; no need to
+  // wait for input with select() as with streams.
+  int fd = open(gcode_filename, O_RDONLY);
+  if (fd < 0) {
+    Log_error("Can't open %s: %s", gcode_filename, strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      Log_error("Can't mmap %s: %s", gcode_filename, strerror(errno));
+      return 1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    uint64_t key = 0;
+    std::string cache_file;
+    int reload_count = machine->ConfigReloadCount();
+    while (loop_count < 0 || loop_count-- > 0) {
+      const uint64_t previous_key = config_key;
+      if (segment_cache)
+        config_key = current_config_key(machine, range_check, &reload_count,
+                                        config_key);
+      if (segment_cache && (cache_file.empty() || config_key != previous_key)) {
+        key = SegmentFileKey(data, st.st_size, config_key);
+        cache_file = StringPrintf("%s/%016llx.bgseg", cache_dir,
+                                  (unsigned long long) key);
+      }
+      ret = run_buffer_once(parser, machine->ParseEventReceiver(),
+                            (const char*) data, st.st_size,
+                            motor_ops, segment_cache, cache_file,
+                            key, config_key);
+      if (ret != 0)
+        break;
+    }
+    munmap(data, st.st_size);
+    return ret;
+  }
+
+  // Something else, such as a named pipe.
   while (loop_count < 0 || loop_count-- > 0) {
-    int fd = open(gcode_filename, O_RDONLY);
-    ret = parser->ParseStream(fd, stderr);
+    if (fd < 0) fd = open(gcode_filename, O_RDONLY);
+    ret = parser->ParseStream(fd, stderr);  // closes fd.
+    fd = -1;
     if (ret != 0)
       break;
   }
+  if (fd >= 0) close(fd);
   return ret;
 }
 
+static volatile sig_atomic_t replay_interrupted = 0;
+static void interrupt_replay(int sig) { replay_interrupted = 1; }
+
+// Send the segments of a file created with gcode2segments to the motion
+// queue. The file needs to be planned with the same configuration, and
+// the machine be at the same position as assumed while planning (home).
+// As the segments bypass "machine_control", it is only asked whether the
+// machine is homed if needed, and where it is.
+// If "loop_count" is >= 0, repeats this number after the first execution.
+static int replay_segment_file(MotionQueue *motion_queue,
+                               GCodeMachineControl *machine_control,
+                               uint64_t config_key,
+                               bool verbose, const char *segment_filename,
+                               int loop_count) {
+  SegmentFile file;
+  if (!file.Open(segment_filename)) {
+    Log_error("Can't read segment file %s", segment_filename);
+    return 1;
+  }
+  const SegmentFileHeader &header = file.header();
+  if (header.config_key != config_key) {
+    Log_error("%s was planned with a different configuration.",
+              segment_filename);
+    return 1;
+  }
+  const bool returns_to_start = memcmp(header.start_position,
+                                       header.end_position,
+                                       sizeof(header.start_position)) == 0;
+  if (loop_count != 1 && !returns_to_start) {
+    Log_error("%s does not end where it started; can't loop.",
+              segment_filename);
+    return 1;
+  }
+  if (machine_control->NeedsHoming()) {
+    Log_error("Machine needs to be homed before replaying %s.",
+              segment_filename);
+    return 1;
+  }
+  int position[BEAGLEG_NUM_MOTORS];
+  machine_control->GetMotorStepsFromHome(position);
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (header.start_position[i] != position[i]) {
+      Log_error("%s starts at motor %d step %d, but the machine is at %d.",
+                segment_filename, i + 1, header.start_position[i],
+                position[i]);
+      return 1;
+    }
+  }
+
+  struct sigaction sa = {};
+  sa.sa_handler = interrupt_replay;
+  sa.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // Sent in chunks between checkpoints. They are copied, as queues might
+  // modify the segments, and we might need them again in the next loop.
+  MotionSegment *chunk = new MotionSegment[SEGMENT_FILE_CHECKPOINT_INTERVAL];
+  const SegmentFileCheckpoint *checkpoints = file.checkpoints();
+  motion_queue->MotorEnable(true);
+  while (!replay_interrupted && (loop_count < 0 || loop_count-- > 0)) {
+    for (uint32_t c = 0; c < header.checkpoint_count; ++c) {
+      if (replay_interrupted) break;
+      const uint32_t begin = checkpoints[c].segment_index;
+      const uint32_t end = (c + 1 < header.checkpoint_count)
+        ? checkpoints[c+1].segment_index
+        : header.segment_count;
+      if (verbose) {
+        Log_debug("Replay segment %u/%u; aux-bits 0x%04x; "
+                  "motor steps %d, %d, %d", begin, header.segment_count,
+                  checkpoints[c].aux_bits, checkpoints[c].position[0],
+                  checkpoints[c].position[1], checkpoints[c].position[2]);
+      }
+      memcpy(chunk, file.segments() + begin, (end - begin) * sizeof(*chunk));
+      motion_queue->EnqueueMany(chunk, end - begin);
+    }
+  }
+  delete [] chunk;
+  return replay_interrupted ? 2 : 0;
+}
+
 // Open server. Return file-descriptor or -1 if listen fails.
 // Bind to "bind_addr" (can be NULL, then it is 0.0.0.0) and "port".
+// Where to dump the trace buffer with --trace.
+static std::string trace_file;
+static void dump_trace(int sig) {
+  Trace_dump(trace_file.c_str());  // Only async-signal-safe calls.
+}
+
+// Machine control to re-read the configuration on SIGHUP.
+static GCodeMachineControl *reload_machine_control = NULL;
+static void request_config_reload(int sig) {
+  if (reload_machine_control) reload_machine_control->RequestConfigReload();
+}
+
 static int open_server(const char *bind_addr, int port) {
   if (port > 65535) {
     Log_error("Invalid port %d\n", port);
@@ -173,59 +480,22 @@ static int open_server(const char *bind_addr, int port) {
   return s;
 }
 
-static void eatsignal(int sig) {}
-
 // Accept connections and receive GCode.
-// Only one connection can be active at a time.
+// Only one connection can stream GCode at a time, others can query status.
 // Socket must already be opened by open_server(). "bind_addr" and "port"
 // are just FYI information for nicer log-messages.
 static int run_server(int listen_socket,
                       GCodeMachineControl *machine, GCodeParser *parser,
-                      const char *bind_addr, int port) {
-  signal(SIGPIPE, SIG_IGN);  // Pesky clients, closing connections...
-
-  if (listen(listen_socket, 2) < 0) {
-    Log_error("listen() failed: %s", strerror(errno));
-    return 1;
-  }
-
+                      const char *bind_addr, int port, int ack_window) {
   Log_info("Ready to accept GCode-connections on %s:%d",
            bind_addr ? bind_addr : "0.0.0.0", port);
 
-  int process_result;
-  do {
-    struct sockaddr_in client;
-    socklen_t socklen = sizeof(client);
-    struct sigaction sa = {};
-    sa.sa_handler = eatsignal;
-    sa.sa_flags = SA_RESETHAND | SA_NODEFER;  // oneshot, no restart
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
-    int connection = accept(listen_socket, (struct sockaddr*) &client, &socklen);
-    if (connection < 0) {
-      Log_error("accept(): %s", strerror(errno));
-      return (errno == EINTR) ? 2 : 1;
-    }
-    sa.sa_handler = SIG_DFL;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
-
-    char ip_buffer[INET_ADDRSTRLEN];
-    const char *print_ip = inet_ntop(AF_INET, &client.sin_addr,
-                                     ip_buffer, sizeof(ip_buffer));
-    Log_info("Accepting new connection from %s\n", print_ip);
-    FILE *msg_stream = fdopen(connection, "w");
-    machine->SetMsgOut(msg_stream);
-    process_result = parser->ParseStream(connection, msg_stream);
-
-    fclose(msg_stream);
-    Log_info("Connection to %s closed.\n", print_ip);
-  } while (process_result == 0);
-
-  close(listen_socket);
-  Log_error("Error gcode_machine_control_from_stream() == %d. Exiting\n",
-            process_result);
-
+  GCodeServer server(machine, parser, ack_window);
+  const int process_result = server.Run(listen_socket);
+  if (process_result != 0) {
+    Log_error("Error gcode_machine_control_from_stream() == %d. Exiting\n",
+              process_result);
+  }
   return process_result;
 }
 
@@ -242,6 +512,8 @@ int main(int argc, char *argv[]) {
   MachineControlConfig config;
   bool dry_run = false;
   bool simulation_output = false;
+  SimFirmwareQueue::Format simulation_format = SimFirmwareQueue::FORMAT_GNUPLOT;
+  int simulation_decimation = 0;
   const char *logfile = NULL;
   std::string paramfile;
   const char *config_file = NULL;
@@ -259,6 +531,16 @@ int main(int argc, char *argv[]) {
     OPT_PRIVS,
     OPT_ENABLE_M111,
     OPT_PARAM_FILE,
+    OPT_QUEUE_LOW_WATER,
+    OPT_MOTOR_THREAD,
+    OPT_MOTOR_THREAD_CPU,
+    OPT_MOTOR_THREAD_PRIO,
+    OPT_SEGMENT_CACHE,
+    OPT_REPLAY,
+    OPT_ACK_WINDOW,
+    OPT_TRACE,
+    OPT_SIM_TRACE,
+    OPT_SIM_DECIMATE,
   };
 
   static struct option long_options[] = {
@@ -275,6 +557,7 @@ int main(int argc, char *argv[]) {
     // Optional
     { "port",               required_argument, NULL, 'p'},
     { "bind-addr",          required_argument, NULL, 'b'},
+    { "ack-window",         required_argument, NULL, OPT_ACK_WINDOW },
     { "loop",               optional_argument, NULL, OPT_LOOP },
     { "logfile",            required_argument, NULL, 'l'},
     { "param",              required_argument, NULL, OPT_PARAM_FILE },
@@ -285,6 +568,17 @@ int main(int argc, char *argv[]) {
     // possibly deprecated soon.
     { "threshold-angle",    required_argument, NULL, OPT_SET_THRESHOLD_ANGLE },
 
+    // Tuning.
+    { "queue-low-water",    required_argument, NULL, OPT_QUEUE_LOW_WATER },
+    { "motor-thread",       no_argument,       NULL, OPT_MOTOR_THREAD },
+    { "motor-thread-cpu",   required_argument, NULL, OPT_MOTOR_THREAD_CPU },
+    { "motor-thread-prio",  required_argument, NULL, OPT_MOTOR_THREAD_PRIO },
+    { "segment-cache",      required_argument, NULL, OPT_SEGMENT_CACHE },
+    { "replay",             required_argument, NULL, OPT_REPLAY },
+    { "trace",              required_argument, NULL, OPT_TRACE },
+    { "sim-trace",          required_argument, NULL, OPT_SIM_TRACE },
+    { "sim-decimate",       required_argument, NULL, OPT_SIM_DECIMATE },
+
     { 0,                    0,                 0,    0  },
   };
 
@@ -295,6 +589,13 @@ int main(int argc, char *argv[]) {
   bool dont_require_homing = false;
   bool disable_range_check = false;
   bool allow_m111 = false;
+  int queue_low_water = QUEUE_LEN / 2;
+  bool motor_thread = false;
+  int motor_thread_cpu = -1;
+  int motor_thread_prio = 0;
+  const char *segment_cache_dir = NULL;
+  const char *replay_file = NULL;
+  int ack_window = 0;
   config.threshold_angle = 10;
   int opt;
   while ((opt = getopt_long(argc, argv, "p:b:SPnNf:l:dc:",
@@ -324,6 +625,21 @@ int main(int argc, char *argv[]) {
       dry_run = true;
       simulation_output = true;
       break;
+    case OPT_SIM_TRACE:
+      if (strcmp(optarg, "csv") == 0)
+        simulation_format = SimFirmwareQueue::FORMAT_CSV;
+      else if (strcmp(optarg, "binary") == 0)
+        simulation_format = SimFirmwareQueue::FORMAT_BINARY;
+      else
+        return usage(argv[0], "--sim-trace: format is 'csv' or 'binary'");
+      dry_run = true;
+      simulation_output = true;
+      break;
+    case OPT_SIM_DECIMATE:
+      simulation_decimation = atoi(optarg);
+      if (simulation_decimation < 0)
+        return usage(argv[0], "--sim-decimate: needs to be >= 0");
+      break;
     case 'P':
       config.debug_print = true;
       break;
@@ -359,6 +675,36 @@ int main(int argc, char *argv[]) {
     case OPT_ENABLE_M111:
       allow_m111 = true;
       break;
+    case OPT_QUEUE_LOW_WATER:
+      queue_low_water = atoi(optarg);
+      if (queue_low_water < 0 || queue_low_water >= QUEUE_LEN)
+        return usage(argv[0], "--queue-low-water out of range.");
+      break;
+    case OPT_MOTOR_THREAD:
+      motor_thread = true;
+      break;
+    case OPT_MOTOR_THREAD_CPU:
+      motor_thread = true;
+      motor_thread_cpu = atoi(optarg);
+      break;
+    case OPT_MOTOR_THREAD_PRIO:
+      motor_thread = true;
+      motor_thread_prio = atoi(optarg);
+      break;
+    case OPT_SEGMENT_CACHE:
+      segment_cache_dir = strdup(optarg);
+      break;
+    case OPT_REPLAY:
+      replay_file = strdup(optarg);
+      break;
+    case OPT_TRACE:
+      trace_file = MakeAbsoluteFile(optarg);  // We might chdir() as daemon.
+      break;
+    case OPT_ACK_WINDOW:
+      ack_window = atoi(optarg);
+      if (ack_window < 0)
+        return usage(argv[0], "--ack-window cannot be negative.");
+      break;
     case OPT_HELP:
       return usage(argv[0], NULL);
     default:
@@ -371,13 +717,21 @@ int main(int argc, char *argv[]) {
     return usage(argv[0], "Choose one: --homing-required or --nohoming-required.");
   }
 
-  const bool has_filename = (optind < argc);
-  if (! (has_filename ^ (listen_port > 0))) {
-    return usage(argv[0], "Choose one: <gcode-filename> or --port <port>.");
+  const bool has_filename = (optind < argc) || replay_file;
+  if (! (has_filename ^ (listen_port > 0))
+      || (replay_file && optind < argc)) {
+    return usage(argv[0], "Choose one: <gcode-filename>, --replay <segfile> "
+                 "or --port <port>.");
   }
   if (!has_filename && file_loop_count != 1) {
     return usage(argv[0], "--loop only makes sense with a filename.");
   }
+  if ((!has_filename || replay_file) && segment_cache_dir) {
+    return usage(argv[0], "--segment-cache only makes sense with a filename.");
+  }
+  if (has_filename && ack_window > 0) {
+    return usage(argv[0], "--ack-window only makes sense with --port.");
+  }
 
   // As daemon, we use whatever the use chose as logfile
   // (including nothing->syslog). Interactive, nothing means stderr.
@@ -420,6 +774,12 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  TemperatureControl temperature_control;
+  if (!temperature_control.ConfigureFromFile(&config_parser)) {
+    Log_error("Exiting. Parse error in configuration file '%s'", config_file);
+    return 1;
+  }
+
   // ... other configurations that read from that file.
 
   // Handle command line configuration overrides.
@@ -431,6 +791,16 @@ int main(int argc, char *argv[]) {
     Log_error("Can't become daemon: %s", strerror(errno));
   }
 
+  // From here on, logging must not stall the gcode and motion threads.
+  Log_start_background_writer();
+
+  if (!trace_file.empty()) {
+    Trace_enable(true);
+    signal(SIGUSR1, dump_trace);
+    Log_info("Tracing: kill -USR1 %d to dump to %s", getpid(),
+             trace_file.c_str());
+  }
+
   // Open socket early, so that we
   //  (a) can bail out early before messing with GPIO/PRU settings if
   //      someone is alrady listening (starting as daemon twice?).
@@ -451,7 +821,9 @@ int main(int argc, char *argv[]) {
   if (dry_run) {
     // The backend
     if (simulation_output) {
-      motion_backend = new SimFirmwareQueue(stdout, 3); // TODO: derive from cfg
+      motion_backend = new SimFirmwareQueue(stdout, 3, // TODO: derive from cfg
+                                            simulation_format,
+                                            simulation_decimation);
     } else {
       motion_backend = new DummyMotionQueue();
     }
@@ -462,8 +834,43 @@ int main(int argc, char *argv[]) {
       return 1;
     }
     pru_hw_interface = new UioPrussInterface();
-    motion_backend = new PRUMotionQueue(&hardware_mapping, pru_hw_interface);
+    motion_backend = new PRUMotionQueue(&hardware_mapping, pru_hw_interface,
+                                        queue_low_water);
+    // M105 reads the values sampled in the background, so that it does not
+    // stall the gcode processing with sysfs reads. Set up while we still
+    // have permission to do so; it's fine if there is no ADC.
+    adc_start_sampling(100);
+    if (temperature_control.is_configured()
+        && !temperature_control.Init(&hardware_mapping)) {
+      Log_error("Exiting. Unable to start temperature control.");
+      return 1;
+    }
+  }
+
+  // Optionally, segments go through a cache that can record and replay them.
+  RecordingMotionQueue *segment_cache = NULL;
+  uint64_t config_key = 0;
+  if (segment_cache_dir) {
+    segment_cache = new RecordingMotionQueue(motion_backend);
+    config_key = SegmentFileConfigKey(config_parser, config);
+  }
+
+  MotionQueueMotorOperations motion_queue_operations(
+    segment_cache ? segment_cache : motion_backend, config.max_step_frequency);
+  // Shaping is done in the motor thread as well; without configured shapers,
+  // it just passes everything on.
+  InputShapingMotorOperations shaping_operations(&motion_queue_operations);
+  // Create motor thread before we drop privileges, so that it still can
+  // get realtime priority.
+  ThreadedMotorOperations *threaded_operations = NULL;
+  if (motor_thread) {
+    threaded_operations =
+      new ThreadedMotorOperations(&shaping_operations,
+                                  motor_thread_cpu, motor_thread_prio);
   }
+  MotorOperations *motor_operations = threaded_operations
+    ? (MotorOperations*) threaded_operations
+    : (MotorOperations*) &shaping_operations;
 
   // Listen port bound, GPIO initialized. Ready to drop privileges.
   if (geteuid() == 0 && strlen(privs) > 0) {
@@ -476,49 +883,95 @@ int main(int argc, char *argv[]) {
   }
   Log_info("BeagleG running with PID %d", getpid());
 
-  MotionQueueMotorOperations motor_operations(motion_backend);
-
   GCodeMachineControl *machine_control
-    = GCodeMachineControl::Create(config, &motor_operations,
+    = GCodeMachineControl::Create(config, motor_operations,
                                   &hardware_mapping, &spindle,
                                   stderr);
   if (machine_control == NULL) {
     Log_error("Exiting. Cannot initialize machine control.");
     return 1;
   }
+  // The motor mapping is complete now, so we know which motors to shape.
+  if (!shaping_operations.Configure(config, &hardware_mapping)) {
+    Log_error("Exiting. Invalid input shaper configuration.");
+    return 1;
+  }
+  // New limits from the configuration file are taken over on SIGHUP or
+  // M501 without losing position and homing state.
+  machine_control->SetConfigFile(config_file);
+  if (temperature_control.is_configured() && !dry_run)
+    machine_control->SetTemperatureControl(&temperature_control);
+  reload_machine_control = machine_control;
+  signal(SIGHUP, request_config_reload);
   GCodeParser::Config parser_cfg;
   GCodeParser::Config::ParamMap parameters;
   parser_cfg.parameters = &parameters;
   if (!paramfile.empty()) parser_cfg.LoadParams(paramfile);
 
   machine_control->GetHomePos(&parser_cfg.machine_origin);
-  GCodeParser *parser = new GCodeParser(parser_cfg,
-                                        machine_control->ParseEventReceiver(),
-                                        allow_m111);
+  GCodeParser::EventReceiver *parse_events
+    = machine_control->ParseEventReceiver();
+  SegmentCacheEvents *segment_cache_events = NULL;
+  if (segment_cache) {
+    segment_cache_events = new SegmentCacheEvents(parse_events, segment_cache);
+    parse_events = segment_cache_events;
+  }
+  GCodeParser *parser = new GCodeParser(parser_cfg, parse_events, allow_m111);
 
   int ret = 0;
-  if (has_filename) {
+  if (replay_file) {
+    // Like a G-code program would need to, home first if required.
+    if (machine_control->NeedsHoming()) {
+      parser->ParseLine("G28", stderr);
+      motor_operations->WaitQueueEmpty();
+    }
+    ret = replay_segment_file(motion_backend, machine_control,
+                              SegmentFileConfigKey(config_parser, config),
+                              config.debug_print, replay_file,
+                              file_loop_count);
+  } else if (has_filename) {
     const char *filename = argv[optind];
-    ret = send_file_to_machine(machine_control, parser,
-                               filename, file_loop_count);
+    ret = send_file_to_machine(machine_control, parser, motor_operations,
+                               segment_cache, segment_cache_dir, config_key,
+                               config.range_check, filename, file_loop_count);
   } else {
     ret = run_server(listen_socket, machine_control, parser,
-                     bind_addr, listen_port);
+                     bind_addr, listen_port, ack_window);
   }
 
-  delete parser;
-  delete machine_control;
+  signal(SIGHUP, SIG_DFL);
+  reload_machine_control = NULL;
 
   const bool caught_signal = (ret == 2);
   if (caught_signal) {
     Log_info("Caught signal: immediate exit. "
              "Skipping potential remaining queue.");
+    // Possibly on feed hold: stop where we are, and let the flushes below
+    // go nowhere instead of moving the machine (or waiting forever).
+    motion_backend->Abort();
+    if (threaded_operations) threaded_operations->Abort();
   }
+  delete parser;
+  delete segment_cache_events;
+  delete machine_control;
+  delete threaded_operations;  // Flushes all remaining segments, unless aborted.
+
   motion_backend->Shutdown(!caught_signal);
+  adc_stop_sampling();
 
+  delete segment_cache;
   delete motion_backend;
   delete pru_hw_interface;
 
+  if (!trace_file.empty()) {
+    Trace_enable(false);
+    if (Trace_dump(trace_file.c_str())) {
+      Log_info("Wrote trace to %s", trace_file.c_str());
+    } else {
+      Log_error("Can't write trace to %s", trace_file.c_str());
+    }
+  }
+
   free(bind_addr);
 
   if (!paramfile.empty()) parser_cfg.SaveParams(paramfile);
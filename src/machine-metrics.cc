@@ -0,0 +1,127 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "machine-metrics.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "common/trace.h"
+#include "motor-interface-constants.h"
+
+static MachineMetrics metrics = {};
+static volatile bool moving = false;
+
+void Metrics_record_enqueue(int count, int fill_level) {
+  int bucket = (fill_level - 1) * METRICS_FILL_BUCKETS / QUEUE_LEN;
+  if (bucket < 0) bucket = 0;
+  if (bucket >= METRICS_FILL_BUCKETS) bucket = METRICS_FILL_BUCKETS - 1;
+  __sync_fetch_and_add(&metrics.fill_histogram[bucket], 1);
+  __sync_fetch_and_add(&metrics.fill_sum, fill_level);
+  __sync_fetch_and_add(&metrics.segments, count);
+}
+
+void Metrics_record_blocked(uint64_t ns) {
+  __sync_fetch_and_add(&metrics.blocked_ns, ns);
+}
+
+void Metrics_record_underrun() {
+  __sync_fetch_and_add(&metrics.underruns, 1);
+}
+
+void Metrics_record_planner_halt() {
+  __sync_fetch_and_add(&metrics.planner_halts, 1);
+}
+
+void Metrics_record_late_loops(uint32_t count) {
+  __sync_fetch_and_add(&metrics.late_loops, count);
+}
+
+void Metrics_set_moving(bool m) { moving = m; }
+bool Metrics_moving() { return moving; }
+
+void Metrics_get(MachineMetrics *result) {
+  __sync_synchronize();
+  memcpy(result, &metrics, sizeof(*result));
+}
+
+void Metrics_print_summary(FILE *out) {
+  // Rate since the previous summary; only called from the main thread.
+  static uint64_t last_ns = 0;
+  static uint64_t last_segments = 0;
+  MachineMetrics m;
+  Metrics_get(&m);
+  const uint64_t now = Trace_now_ns();
+  const double rate = (last_ns == 0)
+    ? 0 : (m.segments - last_segments) * 1e9 / (now - last_ns);
+  last_ns = now;
+  last_segments = m.segments;
+
+  fprintf(out, "// Segments: %" PRIu64 " (%.1f/s since last M122); "
+          "Underruns: %" PRIu64 "; Blocked in enqueue: %.3fs; "
+          "Planner halts: %" PRIu64 "; Late step loops: %" PRIu64 "\n",
+          m.segments, rate, m.underruns, m.blocked_ns / 1e9,
+          m.planner_halts, m.late_loops);
+  fprintf(out, "// Queue fill:");
+  for (int i = 0; i < METRICS_FILL_BUCKETS; ++i) {
+    fprintf(out, " <=%d:%" PRIu64, (i + 1) * QUEUE_LEN / METRICS_FILL_BUCKETS,
+            m.fill_histogram[i]);
+  }
+  fprintf(out, "\n");
+}
+
+void Metrics_print_prometheus(FILE *out) {
+  MachineMetrics m;
+  Metrics_get(&m);
+  fprintf(out,
+          "# HELP beagleg_segments_total Segments sent to the motion queue.\n"
+          "# TYPE beagleg_segments_total counter\n"
+          "beagleg_segments_total %" PRIu64 "\n"
+          "# HELP beagleg_queue_underruns_total Motion queue ran empty "
+          "while moving.\n"
+          "# TYPE beagleg_queue_underruns_total counter\n"
+          "beagleg_queue_underruns_total %" PRIu64 "\n"
+          "# HELP beagleg_enqueue_blocked_seconds_total Time waiting for "
+          "motion queue space.\n"
+          "# TYPE beagleg_enqueue_blocked_seconds_total counter\n"
+          "beagleg_enqueue_blocked_seconds_total %.6f\n"
+          "# HELP beagleg_planner_halts_total Planner stopped the path.\n"
+          "# TYPE beagleg_planner_halts_total counter\n"
+          "beagleg_planner_halts_total %" PRIu64 "\n"
+          "# HELP beagleg_late_step_loops_total Step loops the hardware "
+          "could not do at the requested rate.\n"
+          "# TYPE beagleg_late_step_loops_total counter\n"
+          "beagleg_late_step_loops_total %" PRIu64 "\n",
+          m.segments, m.underruns, m.blocked_ns / 1e9, m.planner_halts,
+          m.late_loops);
+  fprintf(out,
+          "# HELP beagleg_queue_fill Motion queue fill level when adding "
+          "segments.\n"
+          "# TYPE beagleg_queue_fill histogram\n");
+  uint64_t cumulative = 0;
+  for (int i = 0; i < METRICS_FILL_BUCKETS; ++i) {
+    cumulative += m.fill_histogram[i];
+    fprintf(out, "beagleg_queue_fill_bucket{le=\"%d\"} %" PRIu64 "\n",
+            (i + 1) * QUEUE_LEN / METRICS_FILL_BUCKETS, cumulative);
+  }
+  fprintf(out, "beagleg_queue_fill_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+          "beagleg_queue_fill_sum %" PRIu64 "\n"
+          "beagleg_queue_fill_count %" PRIu64 "\n",
+          cumulative, m.fill_sum, cumulative);
+}
@@ -0,0 +1,81 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_MACHINE_METRICS_H_
+#define _BEAGLEG_MACHINE_METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Process wide counters to tell, after the fact, whether a stutter came
+// from the host not keeping the motion queue fed or from the planner
+// slowing down on purpose.
+//
+// The counters are updated from whichever thread feeds the motion queue and
+// can be read at any time from another; they only ever increase, so readers
+// might just see a slightly older value.
+
+// Number of buckets the motion queue fill level is sorted into.
+#define METRICS_FILL_BUCKETS 8
+
+struct MachineMetrics {
+  uint64_t segments;            // Segments handed to the motion queue.
+  uint64_t underruns;           // Queue ran empty while still moving.
+  uint64_t blocked_ns;          // Time waiting for the queue to have space.
+  uint64_t planner_halts;       // Planner brought the path to a stop.
+  uint64_t late_loops;          // Step loops the hardware was too slow for.
+
+  // How full the queue was each time segments were added. Bucket i
+  // counts fill levels up to (i + 1) * QUEUE_LEN / METRICS_FILL_BUCKETS.
+  uint64_t fill_histogram[METRICS_FILL_BUCKETS];
+  uint64_t fill_sum;            // Sum of all fill levels seen.
+};
+
+// Motion queue: "count" segments are added; the queue had "fill_level"
+// segments pending.
+void Metrics_record_enqueue(int count, int fill_level);
+
+// Motion queue: spent "ns" waiting for a free slot.
+void Metrics_record_blocked(uint64_t ns);
+
+// Motion queue: the hardware ran out of segments while the machine was
+// not coming to a stop.
+void Metrics_record_underrun();
+
+// Planner: path is brought to a halt.
+void Metrics_record_planner_halt();
+
+// Motion queue: the hardware reported "count" more step loops in which it
+// could not keep up with the requested step rate.
+void Metrics_record_late_loops(uint32_t count);
+
+// Motor operations: whether the last segment ended at a non-zero speed,
+// so an empty queue now means an underrun.
+void Metrics_set_moving(bool moving);
+bool Metrics_moving();
+
+// Get a copy of the current values.
+void Metrics_get(MachineMetrics *metrics);
+
+// Print human readable summary, as response to M122.
+void Metrics_print_summary(FILE *out);
+
+// Print in Prometheus text exposition format.
+void Metrics_print_prometheus(FILE *out);
+
+#endif  // _BEAGLEG_MACHINE_METRICS_H_
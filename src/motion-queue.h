@@ -19,9 +19,11 @@
 #ifndef _BEAGLEG_MOTION_QUEUE_H_
 #define _BEAGLEG_MOTION_QUEUE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include "common/container.h"
 
+#include "motor-interface-constants.h"
 #include "pru-hardware-interface.h"
 
 // Number of motors handled by motion segment.
@@ -52,12 +54,15 @@ struct MotionSegment {
   uint8_t state;           // see motor-interface-constants.h STATE_* constants.
 
   uint8_t direction_bits;
-
-  // TravelParameters (needs to match TravelParameters in motor-interface-pru.p)
-  uint16_t loops_accel;    // Phase 1: loops spent in acceleration
-  uint16_t loops_travel;   // Phase 2: lops spent in travel
-  uint16_t loops_decel;    // Phase 3: loops spent in deceleration
   uint16_t aux;            // all 16 bits can be used
+
+  // TravelParameters (needs to match TravelParameters in
+  // motor-interface-pru-extended.p; converted for motor-interface-pru.p)
+  // The sum of all loops needs to fit in the 24 bit QueueStatus::counter,
+  // each at most MAX_SEGMENT_LOOPS.
+  uint32_t loops_accel;    // Phase 1: loops spent in acceleration
+  uint32_t loops_travel;   // Phase 2: lops spent in travel
+  uint32_t loops_decel;    // Phase 3: loops spent in deceleration
   uint32_t accel_series_index;  // index in taylor
 
   uint32_t hires_accel_cycles;  // acceleration delay cycles.
@@ -65,14 +70,23 @@ struct MotionSegment {
 
   uint32_t fractions[MOTION_MOTOR_COUNT]; // fixed point fractions to add each step.
 
-#if JERK_EXPERIMENT
-  /*
-   * The following not handled yet in PRU, just experimental in sim right now.
-   */
-  uint16_t jerk_start;
-  uint16_t jerk_stop;
-  float jerk_motion;
-#endif
+  // Duty cycle of the motion synchronized PWM output while this segment
+  // runs, 0..MOTION_PWM_MAX; see MotionQueue::SetMotionPWMOutput().
+  uint32_t pwm;
+} __attribute__((packed));
+
+#define MOTION_PWM_MAX 0xffff
+
+// A MotionSegment as it is in a ring buffer slot of the PRU: everything but
+// the pwm; there is no room in the PRU memory for it, so it goes into a
+// separate, smaller table.
+#define MOTION_SLOT_SIZE offsetof(MotionSegment, pwm)
+struct MotionSlot {
+  uint8_t state;
+  uint8_t direction_bits;
+  uint16_t aux;
+  uint32_t loops_accel;    // Probe segments: the loops not done.
+  uint8_t parameters[MOTION_SLOT_SIZE - 8];
 } __attribute__((packed));
 
 // Layout of the status register
@@ -96,18 +110,74 @@ public:
   // Might change values in MotionSegment.
   virtual void Enqueue(MotionSegment *segment) = 0;
 
+  // Enqueue "count" segments at once. Blocks until all are in the queue.
+  // Implementations might do this more efficiently than one by one.
+  virtual void EnqueueMany(MotionSegment *segments, int count) {
+    for (int i = 0; i < count; ++i) Enqueue(&segments[i]);
+  }
+
   // Block and wait for queue to be empty.
   virtual void WaitQueueEmpty() = 0;
 
+  // Whether enqueuing "slots" more segments could block right now, because
+  // there are fewer free slots. Queues with less capacity than that ask for
+  // half of it.
+  virtual bool IsFull(int slots = 1) { return false; }
+
   // Immediately enable motors, indepenent of queue.
   virtual void MotorEnable(bool on) = 0;
 
   // Shutdown. If !flush_queue: immediate, even if motors are still moving.
   virtual void Shutdown(bool flush_queue) = 0;
 
+  // Stop right away, even on a feed hold, e.g. when we got a signal. Wakes
+  // up a thread waiting in Enqueue() or WaitQueueEmpty(); from now on,
+  // these return without doing anything, so whatever the layers above still
+  // flush doesn't move the machine. Shutdown(false) once nobody else uses
+  // the queue anymore.
+  virtual void Abort() {}
+
   // Fill the argument with the current absolute position in loops
-  // for each motor.
+  // for each motor. Can be called from any thread.
   virtual void GetMotorsLoops(MotorsRegister *absolute_pos_loops) = 0;
+
+  // Real-time speed override, applied to everything that is already in the
+  // queue: moves go "factor" times the planned speed, at most 1, as faster
+  // would exceed the axis limits. A factor of zero decelerates to a hold,
+  // until a non-zero factor is set again. Changes are ramped, not instant.
+  // Can be called from any thread. Returns false if not supported.
+  virtual bool SetSpeedOverride(float factor) { return false; }
+
+  // The time the speed override ramps from full speed to a stop; smaller
+  // changes take proportionally less.
+  virtual void SetSpeedOverrideRamp(float stop_seconds) {}
+
+  // Segments with state STATE_PROBE stop early once the switch "gpio_def"
+  // reads "trigger_level". Only to be changed while none of these is queued.
+  virtual void SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {}
+
+  // Steps per motor (negative for reverse) the STATE_PROBE segments did not
+  // do since the last call, because the switch triggered; positions reported
+  // from now on take that into account. Returns true if the switch triggered.
+  // Once it did, following STATE_PROBE segments are skipped entirely until
+  // this is called. Call once the queue is empty, before enqueuing more.
+  virtual bool GetProbeStepsSkipped(MotorsRegister *skipped) {
+    skipped->zero();
+    return false;
+  }
+
+  // Let the hardware set the PWM output "gpio_def" to the pwm value of each
+  // segment as it starts executing it, e.g. for laser power that follows the
+  // motion. Returns false if not supported for that output.
+  virtual bool SetMotionPWMOutput(uint32_t gpio_def) { return false; }
+
+  // Enqueue a constant speed travel "segment" during which the motion PWM
+  // steps through the "count" values in "pwm" (0..MOTION_PWM_MAX), evenly
+  // spaced along the loops. Blocks until there is room.
+  // Returns false, without enqueuing anything, if not supported; callers
+  // then have to send a segment per value.
+  virtual bool EnqueueRaster(MotionSegment *segment,
+                             const uint16_t *pwm, int count) { return false; }
 };
 
 // Standard implementation.
@@ -120,26 +190,66 @@ struct PRUCommunication;
 struct HistorySegment;
 class PRUMotionQueue : public MotionQueue {
 public:
-  PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru);
+  // If the queue is full, we wait until the PRU has only "low_water_mark"
+  // elements left before we refill. Lower values mean less wakeups, but
+  // also less buffer left for the time it takes us to react.
+  // QUEUE_LEN - 1: wake up for every slot that got free.
+  PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru,
+                 int low_water_mark = QUEUE_LEN / 2);
   ~PRUMotionQueue();
 
   void Enqueue(MotionSegment *segment);
+  void EnqueueMany(MotionSegment *segments, int count);
   void WaitQueueEmpty();
+  bool IsFull(int slots = 1);
   void MotorEnable(bool on);
   void Shutdown(bool flush_queue);
+  void Abort();
   void GetMotorsLoops(MotorsRegister *absolute_pos_loops);
+  bool SetSpeedOverride(float factor);
+  void SetSpeedOverrideRamp(float stop_seconds);
+  void SetProbeSwitch(uint32_t gpio_def, bool trigger_level);
+  bool GetProbeStepsSkipped(MotorsRegister *skipped);
+  bool SetMotionPWMOutput(uint32_t gpio_def);
+  bool EnqueueRaster(MotionSegment *segment, const uint16_t *pwm, int count);
+
+  // For diagnostic tools: the slot the PRU is executing right now with the
+  // loops it has left in it, and the number of segments not finished yet.
+  void GetQueueStatus(QueueStatus *status, int *pending);
 
 private:
   bool Init();
 
+  // Copy segment into the ring buffer slot; everything but the state.
+  void CopyToSlot(unsigned int slot, const MotionSegment &segment);
+
+  // Hand the slot filled by CopyToSlot() over to the PRU: write its state.
+  void PublishSlot(unsigned int slot, const MotionSegment &segment);
+
+  // Block until the PRU is done with the given slot. Asks the PRU to only
+  // signal us once it has reached that slot.
+  void WaitSlotEmpty(unsigned int slot);
+
+  // Number of segments the PRU has not finished yet.
+  int FillLevel();
+
+  // Timer ticks of the motion PWM for "pwm" in 0..MOTION_PWM_MAX.
+  uint16_t MotionPWMTicks(uint32_t pwm) const;
+
   HardwareMapping *const hardware_mapping_;
   PruHardwareInterface *const pru_interface_;
+  int low_water_mark_;
 
   volatile struct PRUCommunication *pru_data_;
   unsigned int queue_pos_;
+  uint32_t last_late_loops_;  // PRU late loop count already in the metrics.
+  uint32_t motion_pwm_ticks_;  // Timer ticks of a PWM period; 0 if off.
+  volatile uint16_t *raster_;  // Ring in the PRU shared RAM; NULL if n/a.
+  uint32_t raster_written_;    // Ring index of the next value we write.
+  volatile bool aborted_;      // Set by Abort(), possibly in another thread.
 
   // Shadow Queue
-  void RegisterHistorySegment(const MotionSegment &element);
+  void RegisterHistorySegment(unsigned int slot, const MotionSegment &element);
 
   struct HistorySegment *const shadow_queue_;
 };
@@ -30,8 +30,77 @@
 #define STATE_EMPTY  0   // Queue element empty, ready to be filled by host
 #define STATE_FILLED 1   // Queue element filled by host, to be picked up by PRU
 #define STATE_EXIT   2   // Filled by host, no parameters; tells PRU to exit.
+#define STATE_PROBE  3   // Like STATE_FILLED, but stops once the probe
+                         // switch triggers. The PRU then writes the loops it
+                         // did not do in place of loops_accel.
+#define STATE_RASTER 4   // Constant speed travel that steps the motion PWM
+                         // through pixels in the raster ring (see below).
 
+// Number of MotionSegments in the ring buffer. With BEAGLEG_PRU_EXTENDED, the
+// PRU data RAM (8k) holds the status word, wakeup slot, late loop counter,
+// speed override, probe switch, motion PWM timer (40 bytes in total), the
+// queue with 60 bytes per element, 2 bytes per element for the motion PWM and
+// the raster progress. Otherwise, it is the status word and the queue with
+// 54 bytes per element.
+// Keep it a power of two and below 255 (the PRU reports the queue index
+// in 8 bits; NO_WAKEUP_SLOT is never a valid index).
+// Can be changed at build time, e.g. make BEAGLEG_QUEUE_LEN=64
+#ifndef QUEUE_LEN
+#ifdef BEAGLEG_PRU_EXTENDED
+#define QUEUE_LEN 128
+#else
 #define QUEUE_LEN 16
+#endif
+#endif
+
+// Most loops the firmware can do in one segment. The extended firmware counts
+// all of them in 24 bits (QueueStatus counter); otherwise, each of the
+// accel, travel and decel loops is a 16 bit value.
+#ifdef BEAGLEG_PRU_EXTENDED
+#define MAX_SEGMENT_LOOPS ((1 << 24) - 1)
+#else
+#define MAX_SEGMENT_LOOPS 0xffff
+#endif
+
+// Written to the wakeup slot if the host does not wait for any slot.
+#define NO_WAKEUP_SLOT 0xff
+
+// Real-time speed override. The host sets the target speed in
+// 1/OVERRIDE_UNITY of the planned speed; never faster than planned, as that
+// would exceed the speed and acceleration limits. The PRU ramps its speed
+// towards the target by one every override_ramp_loops delay loops, which the
+// host derives from the acceleration, and multiplies each delay with the
+// scale (OVERRIDE_UNITY << OVERRIDE_SHIFT) / speed. Target OVERRIDE_HOLD
+// ramps down to OVERRIDE_CREEP, then waits until it changes again.
+#define OVERRIDE_UNITY      256
+#define OVERRIDE_SHIFT      8     // log2(OVERRIDE_UNITY)
+#define OVERRIDE_CREEP      1     // Slowest before the hold: 1/256 speed.
+#define OVERRIDE_HOLD       0
+
+// The switch STATE_PROBE segments test: a GPIO definition (see below), with
+// PROBE_TRIGGER_HIGH set if the switch triggers on a high level.
+#define PROBE_TRIGGER_HIGH  (1 << 8)
+
+// Optional I/O firmware on the second PRU (pru1-io-interface.p, built with
+// make BEAGLEG_PRU1_IO=1). It samples the inputs at a fixed rate and sets the
+// aux outputs, so neither PRU0 nor the host need to touch these GPIOs.
+// PRU0, PRU1 and the host exchange the values in the PRU shared RAM.
+#define IO_SHARED_RAM          0x00010000  // Address as seen from the PRUs.
+#define IO_AUX_BITS_OFFSET     0   // Aux outputs to set; bit 0..15
+#define IO_INPUT_BITS_OFFSET   4   // Raw level of IN_1..IN_9; bit 0..8
+#define IO_SAMPLE_COUNT_OFFSET 8   // Incremented with every input sample.
+
+// Delay loops between two input samples, ~10usec.
+#define IO_SAMPLE_LOOPS (TIMER_FREQUENCY / 100000)
+
+// Raster engraving: ring of RASTER_LEN u16 motion PWM values (timer ticks
+// added to the base) in the shared RAM, after the I/O values. A STATE_RASTER
+// segment starts at ring index accel_series_index and advances by one each
+// time the 1.31 fraction in hires_accel_cycles, added every loop, overflows.
+// The PRU reports the index of the next value it reads in its data RAM.
+#define RASTER_SHARED_OFFSET   0x100
+#define RASTER_LEN_BITS        12
+#define RASTER_LEN             (1 << RASTER_LEN_BITS)
 
 // In calculation of delay cycles: number of bits shifted
 // for higher resolution.
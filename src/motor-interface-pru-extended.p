@@ -0,0 +1,551 @@
+;; -*- asm -*-
+;;
+;; (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+;;
+;; This file is part of BeagleG. http://github.com/hzeller/beagleg
+;;
+;; BeagleG is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; BeagleG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+
+;; Extended motor firmware, only built with make BEAGLEG_PRU_EXTENDED=1
+;; (see Makefile); otherwise motor-interface-pru.p is used. Same queue as that
+;; one, but with 32 bit loop counters, a wakeup slot, late loop reporting,
+;; speed override, probing, motion synchronized PWM and raster segments.
+;; Not verified on hardware yet.
+
+#include "motor-interface-constants.h"
+#include "idiv.hp"
+
+.origin 0
+.entrypoint INIT
+
+#define PRU0_ARM_INTERRUPT 19
+#define CONST_PRUDRAM	   C24
+
+#define QUEUE_ELEMENT_SIZE (SIZE(QueueHeader) + SIZE(TravelParameters))
+#define WAKEUP_OFFSET 4   // Host writes slot index it wants an interrupt for.
+#define LATE_LOOPS_OFFSET 8  // Loops we could not finish in time.
+#define OVERRIDE_OFFSET 12   // w0: target speed (host), w2: current speed.
+#define OVERRIDE_RAMP_OFFSET 16  // Delay loops until the next ramp step.
+#define PROBE_SWITCH_OFFSET 20   // Switch tested in STATE_PROBE segments.
+#define MOTION_PWM_OFFSET 24     // Timer match register (0: off), then base.
+#define OVERRIDE_RAMP_LOOPS_OFFSET 32  // Delay loops per ramp step (host).
+#define OVERRIDE_SCALE_OFFSET 36   // Delay scale of the current speed.
+#define PROBE_TRIGGERED_OFFSET 38  // Set once the probe switch triggered.
+#define QUEUE_OFFSET 40
+;; Per slot, the u16 timer ticks added to the motion PWM base.
+#define MOTION_PWM_TABLE_OFFSET (QUEUE_OFFSET + QUEUE_LEN * QUEUE_ELEMENT_SIZE)
+;; Index of the next value in the raster ring we read.
+#define RASTER_DONE_OFFSET (MOTION_PWM_TABLE_OFFSET + QUEUE_LEN * 2)
+
+#define PARAM_START r7
+#define PARAM_END  r20
+.struct TravelParameters
+	// The sum of all loops fits in 24 bits (see the status register below).
+	// Longer moves are split into separate requests by the host.
+	.u32 loops_accel	 // Phase 1: steps spent in acceleration.
+	.u32 loops_travel	 // Phase 2: steps spent in travel.
+	.u32 loops_decel         // Phase 3: steps spent in deceleration.
+
+	.u32 accel_series_index  // index into the taylor series.
+	.u32 hires_accel_cycles  // initial delay cycles, for acceleration
+	                         // shifted by DELAY_CYCLE_SHIFT
+	                         // Changes in the different phases.
+	.u32 travel_delay_cycles // Exact cycle value for travel (do not rely
+	                         // on accel approx to exactly reach that)
+
+	// 1.31 Fixed point increments for each motor
+	.u32 fraction_1
+	.u32 fraction_2
+	.u32 fraction_3
+	.u32 fraction_4
+	.u32 fraction_5
+	.u32 fraction_6
+	.u32 fraction_7
+	.u32 fraction_8
+.ends
+
+.struct QueueHeader
+	.u8 state
+	.u8 direction_bits
+	.u16 aux		 // all 16 bits can be used
+.ends
+
+;; counter states of the motors
+#define STATE_START r21   	; after PARAM_END
+#define STATE_END r28
+.struct MotorState
+	.u32 m1
+	.u32 m2
+	.u32 m3
+	.u32 m4
+	.u32 m5
+	.u32 m6
+	.u32 m7
+	.u32 m8
+.ends
+.assign MotorState, STATE_START, STATE_END, mstate
+
+;;; Subtract the loops spent in computation from the delay in 'reg'. If
+;;; the requested rate is faster than what we can do, we don't wrap around
+;;; but go as fast as possible; these loops are counted for the host to see.
+;;; Uses r0.
+.macro SubtractLoops
+.mparam reg, loops
+	QBLT in_time, reg, loops        ; enough time left ?
+	LBCO r0, CONST_PRUDRAM, LATE_LOOPS_OFFSET, 4
+	ADD r0, r0, 1
+	SBCO r0, CONST_PRUDRAM, LATE_LOOPS_OFFSET, 4
+	MOV reg, loops + 1              ; minimum delay
+in_time:
+	SUB reg, reg, loops
+.endm
+
+;;; Calculate the current delay depending on the phase (acceleration, travel,
+;;; deceleration). Modifies the values in params, which is of type
+;;; TravelParameters.
+;;; Needs one state_register to keep its own state and two scratch registers.
+;;; Outputs the resulting delay in output_reg.
+;;; Returns special value 0 when done.
+;;; Only used once, so just macro.
+;;;
+;;; We are approximating the needed sqrt() operation with a few terms
+;;; from an Taylor series which brings sufficient accuracy and boils down
+;;; to a single (somewhat expensive) division. I tried as well using an
+;;; integer sqrt directly, but the rounding errors were worse.
+;;; Thanks to this paper for inspiration:
+;;;   http://embedded.com/design/mcus-processors-and-socs/4006438/stepper
+.macro CalculateDelay
+.mparam output_reg, params, state_register, divident_tmp, divisor_tmp
+;;; We use the 'state_register' to store the remainder of the division
+;;; to carry it to the next division for higher accuracy.
+;;; Note, we are inlining the division macro twice here instead of wrapping it
+;;; in a function. There is no need, we have enough code-space.
+PHASE_1_ACCELERATION:	; ==================================================
+	QBEQ PHASE_2_TRAVEL, params.loops_accel, 0
+	QBEQ accel_calc_done, params.accel_series_index, 0 // first ? no calc.
+
+	;; divident = (hires_accel_cycles << 1) + remainder
+	LSL divident_tmp, params.hires_accel_cycles, 1
+	;; Add previous remainder for higher resolution.
+	ADD divident_tmp, divident_tmp, state_register
+
+	;; divisor = (accel_series_index << 2) + 1
+	LSL divisor_tmp, params.accel_series_index, 2
+	ADD divisor_tmp, divisor_tmp, 1
+
+	idiv_macro divident_tmp, divisor_tmp, state_register
+
+	;; params.hires_accel_cycles -= quotient (divident_tmp became quotient)
+	SUB params.hires_accel_cycles, params.hires_accel_cycles, divident_tmp
+accel_calc_done:
+	ADD params.accel_series_index, params.accel_series_index, 1 ; series++
+	SUB params.loops_accel, params.loops_accel, 1		; loops_accel--
+
+	;; The calculation is done in higher resolution with DELAY_CYCLE_SHIFT
+	;; more bits. Shift back: output_reg = hires_cycles >> DELAY_CYCLE_SHIFT
+	LSR output_reg, params.hires_accel_cycles, DELAY_CYCLE_SHIFT
+
+	;; Correct Timing: Substract the number of cycles we have spent in this
+	;; routine and UpdateQueueStatus. We take half, because the delay-loop
+	;; needs 2 cycles.
+	SubtractLoops output_reg, (IDIV_MACRO_CYCLE_COUNT + 12) / 2
+	JMP DONE_CALCULATE_DELAY
+
+PHASE_2_TRAVEL:		; ==================================================
+	QBEQ PHASE_3_DECELERATION, params.loops_travel, 0
+	SUB params.loops_travel, params.loops_travel, 1	        ; loops_travel--
+	MOV output_reg, params.travel_delay_cycles
+	SubtractLoops output_reg, (7 / 2) ; substract cycles spent here
+	JMP DONE_CALCULATE_DELAY
+
+PHASE_3_DECELERATION:	; ==================================================
+	QBNE calc_decel, params.loops_decel, 0
+	ZERO &output_reg, 4                // we are done. Special stop value 0
+	JMP DONE_CALCULATE_DELAY
+calc_decel:
+	;; divident = (hires_accel_cycles << 1) + remainder
+	LSL divident_tmp, params.hires_accel_cycles, 1
+	ADD divident_tmp, divident_tmp, state_register
+
+	;; divisor = (accel_series_index << 2) - 1
+	LSL divisor_tmp, params.accel_series_index, 2
+	SUB divisor_tmp, divisor_tmp, 1
+
+	idiv_macro divident_tmp, divisor_tmp, state_register
+
+	;; params.hires_accel_cycles += quotient (divident_tmp became quotient)
+	ADD params.hires_accel_cycles, params.hires_accel_cycles, divident_tmp
+
+	SUB params.accel_series_index, params.accel_series_index, 1 ; series--
+	SUB params.loops_decel, params.loops_decel, 1	        ; loops_decel--
+
+	;; The calculation is done in higher resolution with DELAY_CYCLE_SHIFT
+	;; more bits. Shift back: output_reg = hires_cycles >> DELAY_CYCLE_SHIFT
+	LSR output_reg, params.hires_accel_cycles, DELAY_CYCLE_SHIFT
+
+	;; Correct timing: Substract the number of cycles we have spent here.
+	SubtractLoops output_reg, (IDIV_MACRO_CYCLE_COUNT + 14) / 2
+
+DONE_CALCULATE_DELAY:
+.endm
+
+;;; Real-time speed override: scale the delay in 'reg' with the scale of the
+;;; current speed, and ramp that speed towards the target set by the host, one
+;;; step every override_ramp_loops loops of scaled delay. On hold, we ramp
+;;; down to OVERRIDE_CREEP, then wait for the host to let us continue.
+;;; Costs only a few cycles if there is no override, which is the usual case.
+;;; The cycles spent here are subtracted from the delay like in CalculateDelay.
+;;; Uses r0, r4..r6.
+.macro ApplySpeedOverride
+.mparam reg
+	LBCO r0, CONST_PRUDRAM, OVERRIDE_OFFSET, 4
+	QBNE override_active, r0.w0, OVERRIDE_UNITY
+	QBNE override_active, r0.w2, OVERRIDE_UNITY
+	SubtractLoops reg, (8 / 2)
+	QBA override_done
+override_active:
+	;; reg = (reg * scale) >> OVERRIDE_SHIFT with shift-and-add. The scale
+	;; has 16 bits, so delays beyond 16 bits are shifted first and capped
+	;; at 24 bits (steps slower than ~6Hz) to keep the product in 32 bits.
+	MOV r5, reg
+	MOV r4, OVERRIDE_SHIFT
+	QBEQ multiply, reg.w2, 0
+	QBEQ shift_first, reg.b3, 0
+	MOV r5, 0x00ffffff
+shift_first:
+	LSR r5, r5, OVERRIDE_SHIFT
+	MOV r4, 0
+multiply:
+	ZERO &reg, 4
+	LBCO r6.w0, CONST_PRUDRAM, OVERRIDE_SCALE_OFFSET, 2
+	MOV r6, r6.w0
+multiply_loop:
+	QBBC multiply_skip, r6, 0
+	ADD reg, reg, r5
+multiply_skip:
+	LSL r5, r5, 1
+	LSR r6, r6, 1
+	QBNE multiply_loop, r6, 0
+	LSR reg, reg, r4
+
+	;; The ramp counts the scaled delay, i.e. the time that really passes.
+	LBCO r4, CONST_PRUDRAM, OVERRIDE_RAMP_OFFSET, 4
+	QBLT ramp_wait, r4, reg         ; countdown not expired yet ?
+	LBCO r4, CONST_PRUDRAM, OVERRIDE_RAMP_LOOPS_OFFSET, 4
+	SBCO r4, CONST_PRUDRAM, OVERRIDE_RAMP_OFFSET, 4
+	MOV r5, r0.w0
+	QBNE ramp_to_target, r5, OVERRIDE_HOLD
+	MOV r5, OVERRIDE_CREEP          ; hold: slow down as far as we go.
+ramp_to_target:
+	QBEQ ramp_done, r0.w2, r5
+	QBLT ramp_faster, r5, r0.w2     ; current < target ?
+	SUB r0.w2, r0.w2, 1
+	QBA ramp_store
+ramp_faster:
+	ADD r0.w2, r0.w2, 1
+ramp_store:
+	SBCO r0.w2, CONST_PRUDRAM, OVERRIDE_OFFSET + 2, 2
+	CALL OverrideScale
+	SBCO r5, CONST_PRUDRAM, OVERRIDE_SCALE_OFFSET, 2
+	SubtractLoops reg, ((IDIV_MACRO_CYCLE_COUNT + 20) / 2)
+	LBCO r0, CONST_PRUDRAM, OVERRIDE_OFFSET, 4  ; SubtractLoops used r0.
+	QBA ramp_done
+ramp_wait:
+	SUB r4, r4, reg
+	SBCO r4, CONST_PRUDRAM, OVERRIDE_RAMP_OFFSET, 4
+ramp_done:
+	QBNE override_scaled, r0.w0, OVERRIDE_HOLD
+	QBNE override_scaled, r0.w2, OVERRIDE_CREEP
+hold:
+	LBCO r0.w0, CONST_PRUDRAM, OVERRIDE_OFFSET, 2
+	QBEQ hold, r0.w0, OVERRIDE_HOLD
+
+override_scaled:
+	;; About 40 cycles plus 4-5 for each bit of the scale, which has 9 bits
+	;; down to half the speed. Leaves at least one loop; 0 would mean: done
+	;; with this segment.
+	SubtractLoops reg, (90 / 2)
+override_done:
+.endm
+
+;;; In STATE_PROBE segments, test the probe switch and jump to 'triggered'
+;;; if it reads its trigger level. Only the state costs a memory access for
+;;; regular segments. Once triggered, PROBE_TRIGGERED_OFFSET is set and
+;;; further STATE_PROBE segments are skipped until the host clears it.
+;;; Only assembled with BEAGLEG_PRU_PROBE; otherwise they run like
+;;; STATE_FILLED.
+;;; Uses r0, r4, r5.
+.macro TestProbeSwitch
+.mparam triggered
+	LBCO r0, CONST_PRUDRAM, r2, 1   ; state of the current slot.
+	QBNE no_probe, r0.b0, STATE_PROBE
+	LBCO r0, CONST_PRUDRAM, PROBE_SWITCH_OFFSET, 4
+	QBEQ no_probe, r0.w2, GPIO_NOT_MAPPED
+	MOV r5, 0xfffff000
+	AND r4, r0, r5                  ; bank base
+	MOV r5, GPIO_DATAIN
+	ADD r4, r4, r5
+	LBBO r4, r4, 0, 4
+	AND r5, r0.b0, 0x1f             ; bit in the bank
+	LSR r4, r4, r5
+	AND r4, r4, 1                   ; level of the switch
+	LSR r0, r0, 8
+	AND r0, r0, 1                   ; PROBE_TRIGGER_HIGH
+	QBEQ triggered, r4, r0
+no_probe:
+.endm
+
+;;; This macro decrease the counter that holds the overall number of loops left
+;;; to be performed and then it push it in the PRU DRAM status register.
+.macro UpdateQueueStatus
+	;; Decrease the step counter
+	SUB r29, r29, 1 ; status_loops--
+	;; Push in DRAM. The cycles are accounted for in CalculateDelay.
+	SBCO r29, CONST_PRUDRAM, 0, 4
+.endm
+
+INIT:
+	;; Clear STANDBY_INIT in SYSCFG register.
+	LBCO r0, C4, 4, 4
+	CLR r0, r0, 4
+	SBCO r0, C4, 4, 4
+
+	MOV r2, QUEUE_OFFSET ; Queue address in PRU memory
+	MOV r29, 0           ; Status register in PRU memory,
+	                     ; r29.b3 for current queue position,
+	                     ; bottom three for the remaining steps of the current slot.
+QUEUE_READ:
+	;;
+	;; Read next element from ring-buffer
+	;;
+
+	;; Check queue header at our read-position until it contains something.
+	.assign QueueHeader, r1, r1, queue_header
+	LBCO queue_header, CONST_PRUDRAM, r2, SIZE(queue_header)
+	QBEQ QUEUE_READ, queue_header.state, STATE_EMPTY ; wait until got data.
+
+	QBEQ FINISH, queue_header.state, STATE_EXIT
+
+	;; Set direction bits
+	MOV r3, queue_header.direction_bits
+	CALL SetDirections
+
+	;; Set the Aux bits
+	MOV r3, queue_header.aux
+#ifdef BEAGLEG_PRU1_IO
+	;; Handed to the I/O firmware on PRU1 which sets the GPIOs.
+	MOV r4, IO_SHARED_RAM
+	SBBO r3, r4, IO_AUX_BITS_OFFSET, 4
+#else
+	CALL SetAuxBits
+#endif
+
+	;; Motion synchronized PWM: set the timer match value for this slot.
+	LBCO r4, CONST_PRUDRAM, MOTION_PWM_OFFSET, 8  ; r4 = register, r5 = base
+	QBEQ MOTION_PWM_DONE, r4, 0
+	LSL r0, r29.b3, 1
+	MOV r6, MOTION_PWM_TABLE_OFFSET
+	ADD r0, r0, r6
+	LBCO r6, CONST_PRUDRAM, r0, 2
+	ADD r6, r5, r6.w0
+	SBBO r6, r4, 0, 4
+MOTION_PWM_DONE:
+
+	;; queue_header processed, r1 is free to use
+	ADD r1, r2, SIZE(QueueHeader) ; r2 stays at queue pos
+	.assign TravelParameters, PARAM_START, PARAM_END, travel_params
+	LBCO travel_params, CONST_PRUDRAM, r1, SIZE(travel_params)
+
+	ZERO &mstate, SIZE(mstate)	; clear the motor states
+	ZERO &r3, 4			; initialize delay calculation state register.
+
+	;; STATUS REGISTER
+	;; ! We are assuming that writing the 4 bytes status register is atomic
+	;; and we guarantee that the bottom three bytes are all zero so we just need
+	;; to sum up the 3 loop counters. The host makes sure that this sum is
+	;; always less than 2^24, thus fits in the lower 24 bits allocated for it.
+	;; At each loop executed this counter is decreased of one unit.
+	ADD r29, r29, travel_params.loops_accel
+	ADD r29, r29, travel_params.loops_travel
+	ADD r29, r29, travel_params.loops_decel
+
+	MOV r0, 0 ; Status register address in PRU memory.
+	SBCO r29, CONST_PRUDRAM, r0, 4
+
+	;; Registers
+	;; r0, r1 free for calculation
+	;; r2 = queue pos
+	;; r3 = state for CalculateDelay
+	;; scratch:           r4..r6
+	;; parameter:         r7..r20
+	;; motor-state:       r21..r28
+	;; status-variable:   r29
+	;; call/ret:          r30
+
+	;; Raster segments have their own, simpler loop.
+	LBCO r0, CONST_PRUDRAM, r2, 1
+	QBEQ RASTER_GEN, r0.b0, STATE_RASTER
+
+#ifdef BEAGLEG_PRU_PROBE
+	;; Probe segments after the switch triggered don't move at all.
+	QBNE STEP_GEN, r0.b0, STATE_PROBE
+	LBCO r4, CONST_PRUDRAM, PROBE_TRIGGERED_OFFSET, 1
+	QBNE PROBE_TRIGGERED, r4.b0, 0
+#endif
+STEP_GEN:
+	;;
+	;; Generate motion profile configured by TravelParameters
+	;;
+
+	;;; Update the state registers with the 1.31 resolution fraction.
+	;;; The 31st bit contains the overflow that causes a step.
+	ADD mstate.m1, mstate.m1, travel_params.fraction_1
+	ADD mstate.m2, mstate.m2, travel_params.fraction_2
+	ADD mstate.m3, mstate.m3, travel_params.fraction_3
+	ADD mstate.m4, mstate.m4, travel_params.fraction_4
+	ADD mstate.m5, mstate.m5, travel_params.fraction_5
+	ADD mstate.m6, mstate.m6, travel_params.fraction_6
+	ADD mstate.m7, mstate.m7, travel_params.fraction_7
+	ADD mstate.m8, mstate.m8, travel_params.fraction_8
+
+	;; Set the step bits (Need to check timing)
+	CALL SetSteps
+
+	CalculateDelay r1, travel_params, r3, r5, r6
+	QBEQ DONE_STEP_GEN, r1, 0       ; special value 0: all steps consumed.
+	UpdateQueueStatus
+	ApplySpeedOverride r1
+#ifdef BEAGLEG_PRU_PROBE
+	TestProbeSwitch PROBE_TRIGGERED
+#endif
+STEP_DELAY:				; Create time delay between steps.
+	SUB r1, r1, 1                   ; two cycles per loop.
+	QBNE STEP_DELAY, r1, 0
+
+	JMP STEP_GEN
+
+	;;
+	;; Constant speed travel, stepping the motion PWM through the raster ring.
+	;; The first value was already set from the slot. accel_series_index is
+	;; the ring index of the next one, hires_accel_cycles the 1.31 fraction
+	;; of a value to advance each loop; r3 accumulates it.
+	;;
+RASTER_GEN:
+	ADD mstate.m1, mstate.m1, travel_params.fraction_1
+	ADD mstate.m2, mstate.m2, travel_params.fraction_2
+	ADD mstate.m3, mstate.m3, travel_params.fraction_3
+	ADD mstate.m4, mstate.m4, travel_params.fraction_4
+	ADD mstate.m5, mstate.m5, travel_params.fraction_5
+	ADD mstate.m6, mstate.m6, travel_params.fraction_6
+	ADD mstate.m7, mstate.m7, travel_params.fraction_7
+	ADD mstate.m8, mstate.m8, travel_params.fraction_8
+	CALL SetSteps
+
+	QBEQ DONE_STEP_GEN, travel_params.loops_travel, 0
+	SUB travel_params.loops_travel, travel_params.loops_travel, 1
+	MOV r1, travel_params.travel_delay_cycles
+	SubtractLoops r1, (9 / 2)
+	UpdateQueueStatus
+
+	ADD r3, r3, travel_params.hires_accel_cycles
+	QBBC RASTER_DELAY, r3, 31       ; no new value yet.
+	CLR r3, r3, 31
+	LBCO r4, CONST_PRUDRAM, MOTION_PWM_OFFSET, 8  ; r4 = register, r5 = base
+	LSL r0, travel_params.accel_series_index, 32 - RASTER_LEN_BITS
+	LSR r0, r0, 31 - RASTER_LEN_BITS  ; byte offset of the u16 in the ring.
+	MOV r6, IO_SHARED_RAM + RASTER_SHARED_OFFSET
+	ADD r0, r0, r6
+	LBBO r6, r0, 0, 2
+	ADD r6, r5, r6.w0
+	SBBO r6, r4, 0, 4
+	ADD travel_params.accel_series_index, travel_params.accel_series_index, 1
+	MOV r0, RASTER_DONE_OFFSET
+	SBCO travel_params.accel_series_index, CONST_PRUDRAM, r0, 4
+	SubtractLoops r1, (24 / 2)
+
+RASTER_DELAY:
+	ApplySpeedOverride r1
+RASTER_STEP_DELAY:
+	SUB r1, r1, 1
+	QBNE RASTER_STEP_DELAY, r1, 0
+
+	JMP RASTER_GEN
+
+#ifdef BEAGLEG_PRU_PROBE
+PROBE_TRIGGERED:			; Skip the rest of the segment.
+	MOV r0, 1
+	SBCO r0, CONST_PRUDRAM, PROBE_TRIGGERED_OFFSET, 1
+#endif
+DONE_STEP_GEN:
+#ifdef BEAGLEG_PRU_PROBE
+	;; Probe segments report the loops they did not do, so that the host
+	;; knows where the switch triggered. Zero, if it didn't.
+	LBCO r0, CONST_PRUDRAM, r2, 1
+	QBNE probe_reported, r0.b0, STATE_PROBE
+	MOV r0, r29
+	MOV r0.b3, 0                    ; loops left of this slot.
+	ADD r4, r2, SIZE(QueueHeader)   ; in place of loops_accel.
+	SBCO r0, CONST_PRUDRAM, r4, 4
+	MOV r29.w0, 0                   ; next slot starts from zero loops.
+	MOV r29.b2, 0
+	SBCO r29, CONST_PRUDRAM, 0, 4
+probe_reported:
+#endif
+	;; We are done with instruction. Mark slot as empty...
+	MOV queue_header.state, STATE_EMPTY
+	SBCO queue_header.state, CONST_PRUDRAM, r2, 1
+
+	;; Only signal the host if it is waiting for this slot to be done.
+	LBCO r0, CONST_PRUDRAM, WAKEUP_OFFSET, 1
+	QBNE NEXT_QUEUE_POS, r0.b0, r29.b3
+	MOV R31.b0, PRU0_ARM_INTERRUPT+16 ; signal host program free slot.
+
+NEXT_QUEUE_POS:
+	;; Next position in ring buffer
+	ADD r2, r2, QUEUE_ELEMENT_SIZE
+	ADD r29.b3, r29.b3, 1                  ; add + 1 to the MSB byte
+	MOV r1, QUEUE_OFFSET + QUEUE_LEN * QUEUE_ELEMENT_SIZE ; end-of-queue
+	QBLT QUEUE_READ, r1, r2
+	MOV r2, QUEUE_OFFSET
+	ZERO &r29, 4
+	JMP QUEUE_READ
+
+FINISH:
+	MOV queue_header.state, STATE_EMPTY
+	SBCO queue_header.state, CONST_PRUDRAM, r2, 1
+	MOV R31.b0, PRU0_ARM_INTERRUPT+16
+
+	HALT
+
+;;; Delay scale in r5 for the override speed in r0.w2:
+;;; (OVERRIDE_UNITY << OVERRIDE_SHIFT) / speed, capped to 16 bits. Only
+;;; called when the speed ramps, so the division is not done on every step.
+;;; Uses r4, r6.
+OverrideScale:
+	MOV r5, OVERRIDE_UNITY * OVERRIDE_UNITY
+	MOV r6, r0.w2
+	idiv_macro r5, r6, r4
+	QBEQ override_scale_fits, r5.w2, 0
+	MOV r5, 0xffff
+override_scale_fits:
+	RET
+
+;;; This include file needs to provide the subroutines
+;;;    SetAuxBits
+;;;    SetDirections
+;;;    SetSteps
+;;; There is one of these in each hardware directory. They can choose to just
+;;; include pru-generic-io-routines.hp that just uses the generic bits
+;;; or provide their own optimized version.
+#include <pru-io-routines.hp>
@@ -28,9 +28,13 @@
 #include <stdlib.h>
 #include <strings.h>
 
+#include <algorithm>
+
 #include "common/logging.h"
+#include "common/trace.h"
 
 #include "motor-interface-constants.h"
+#include "machine-metrics.h"
 #include "motion-queue.h"
 
 // We need two loops per motor step (edge up, edge down),
@@ -39,29 +43,50 @@
 // more than one bit output per step (probably only with hand-built drivers).
 #define LOOPS_PER_STEP (1 << 1)
 
-// If we do more than these number of steps, the fixed point fraction
-// accumulate too much error.
-#define MAX_STEPS_PER_SEGMENT (65535 / LOOPS_PER_STEP)
-
-// TODO: don't store this singleton like, but keep in user_data of the MotorOperations
-static float hardware_frequency_limit_ = 1e6;    // Don't go over 1 Mhz
+// Most loops the firmware can count in one segment; see
+// motor-interface-constants.h. Even at 2^24 loops, we can trust the fixed
+// point fractions: their error is below 1 in 2^31 per loop, so less than
+// 1/128 step.
+#define MAX_STEPS_PER_SEGMENT (MAX_SEGMENT_LOOPS / LOOPS_PER_STEP)
 
 static inline float sq(float x) { return x * x; }  // square a number
 static inline double sqd(double x) { return x * x; }  // square a number
 static inline int round2int(float x) { return (int) roundf(x); }
 
-// Clip speed to maximum we can reach with hardware.
-static float clip_hardware_frequency_limit(float v) {
-  return v < hardware_frequency_limit_ ? v : hardware_frequency_limit_;
-}
-
-static float calcAccelerationCurveValueAt(int index, float acceleration) {
+// Factor of the acceleration series that only depends on the acceleration.
+static float calcAccelerationFactor(float acceleration) {
   // counter_freq * sqrt(2 / accleration)
-  const float accel_factor = TIMER_FREQUENCY
+  return TIMER_FREQUENCY
     * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
+}
+
+// Values sqrt(n+1) - sqrt(n) needed for the acceleration series. The first
+// ones are by far the most used (starting from low speeds), so we keep these
+// in a table.
+#define SQRT_STEP_TABLE_SIZE 4096
+class SqrtStepTable {
+public:
+  SqrtStepTable() {
+    for (int i = 0; i < SQRT_STEP_TABLE_SIZE; ++i) {
+      values_[i] = sqrt(i + 1.0) - sqrt(i);
+    }
+  }
+
+  float operator[](int index) const {
+    if (index < SQRT_STEP_TABLE_SIZE) return values_[index];
+    // Avoid cancellation of subtracting two almost equal values.
+    return 1.0f / (sqrtf(index + 1) + sqrtf(index));
+  }
+
+private:
+  float values_[SQRT_STEP_TABLE_SIZE];
+};
+static const SqrtStepTable sqrt_step;
+
+static float calcAccelerationCurveValueAt(int index, float accel_factor) {
   // The approximation is pretty far off in the first step; adjust.
   const float c0 = (index == 0) ? accel_factor * 0.67605f : accel_factor;
-  return c0 * (sqrtf(index + 1) - sqrtf(index));
+  return c0 * sqrt_step[index];
 }
 
 #if 0
@@ -75,7 +100,7 @@ static char test_acceleration_ok(float acceleration) {
   // Also 2 additional bits headroom because we need to shift it by 2 in the
   // division.
   const float start_accel_cycle_value = (1 << (DELAY_CYCLE_SHIFT + 2))
-    * calcAccelerationCurveValueAt(0, acceleration);
+    * calcAccelerationCurveValueAt(0, calcAccelerationFactor(acceleration));
   if (start_accel_cycle_value > 0xFFFFFFFF) {
     Log_error("Too slow acceleration to deal with. If really needed, "
               "reduce value of #define DELAY_CYCLE_SHIFT\n");
@@ -85,8 +110,137 @@ static char test_acceleration_ok(float acceleration) {
 }
 #endif
 
-void MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
-                                                 int defining_axis_steps) {
+// Motion PWM duty cycle of a segment with the given average speed.
+static uint32_t motion_pwm(const LinearSegmentSteps &param, double speed) {
+  float duty = param.pwm;
+  if (param.pwm_full_speed > 0) {
+    duty *= speed / param.pwm_full_speed;
+  }
+  if (duty <= 0) return 0;
+  if (duty >= 1) return MOTION_PWM_MAX;
+  return round2int(duty * MOTION_PWM_MAX);
+}
+
+static bool has_steps(const LinearSegmentSteps &param) {
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (param.steps[i] != 0) return true;
+  }
+  return false;
+}
+
+static int get_defining_axis_steps(const LinearSegmentSteps &param) {
+  int defining_axis_steps = abs(param.steps[0]);
+  for (int i = 1; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (abs(param.steps[i]) > defining_axis_steps) {
+      defining_axis_steps = abs(param.steps[i]);
+    }
+  }
+  return defining_axis_steps;
+}
+
+static int get_defining_motor(const LinearSegmentSteps &param) {
+  int defining_motor = 0;
+  for (int i = 1; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (abs(param.steps[i]) > abs(param.steps[defining_motor]))
+      defining_motor = i;
+  }
+  return defining_motor;
+}
+
+// Steps of the raster "segment" up to the end of pixel "pixel_end".
+static int raster_steps_until(const LinearSegmentSteps &segment, int motor,
+                              int pixel_end, int count) {
+  return (int) llround((double) segment.steps[motor] * pixel_end / count);
+}
+
+void MotorOperations::EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                                       const LinearSegmentSteps &travel,
+                                       const LinearSegmentSteps &decel) {
+  if (has_steps(accel)) Enqueue(accel);
+  if (has_steps(travel)) Enqueue(travel);
+  if (has_steps(decel)) Enqueue(decel);
+}
+
+void MotorOperations::EnqueueRaster(const LinearSegmentSteps &segment,
+                                    const uint8_t *pixels, int count) {
+  const int defining_motor = get_defining_motor(segment);
+  const int defining_axis_steps = abs(segment.steps[defining_motor]);
+  if (count <= 0 || defining_axis_steps == 0) {
+    Enqueue(segment);
+    return;
+  }
+  // Same acceleration for all pieces: v^2 = v0^2 + 2 * a * steps
+  const double v0squared = sqd(segment.v0);
+  const double a = (sqd(segment.v1) - v0squared) / (2.0 * defining_axis_steps);
+  LinearSegmentSteps piece = segment;
+  int steps_done[BEAGLEG_NUM_MOTORS] = {0};
+  for (int begin = 0, end; begin < count; begin = end) {
+    for (end = begin + 1; end < count && pixels[end] == pixels[begin]; ++end)
+      ;
+    const int defining_before = abs(steps_done[defining_motor]);
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      const int until = raster_steps_until(segment, i, end, count);
+      piece.steps[i] = until - steps_done[i];
+      steps_done[i] = until;
+    }
+    const int defining_after = abs(steps_done[defining_motor]);
+    if (defining_after == defining_before) continue;  // Pixel below a step.
+    if (segment.v0 == segment.v1) {
+      piece.v0 = piece.v1 = segment.v0;
+    } else {
+      piece.v0 = sqrt(std::max(0.0, v0squared + 2.0 * a * defining_before));
+      piece.v1 = sqrt(std::max(0.0, v0squared + 2.0 * a * defining_after));
+    }
+    piece.pwm = segment.pwm * pixels[begin] / 255.0f;
+    Enqueue(piece);
+  }
+}
+
+bool MotorOperations::GetProbeStepsSkipped(int skipped[BEAGLEG_NUM_MOTORS]) {
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) skipped[i] = 0;
+  return false;
+}
+
+MotionQueueMotorOperations::MotionQueueMotorOperations(MotionQueue *backend,
+                                                       float max_step_frequency)
+  : backend_(backend), max_step_frequency_(max_step_frequency),
+    accel_cache_next_(0) {
+  for (int i = 0; i < ACCEL_CACHE_SIZE; ++i) {
+    accel_cache_[i].acceleration = -1;
+    accel_cache_[i].factor = 0;
+  }
+}
+
+float MotionQueueMotorOperations::AccelerationFactor(float acceleration) {
+  // The same acceleration, re-calculated from speeds and steps, differs in
+  // the last bits. Considering these the same changes the delay values by
+  // less than their resolution.
+  const float tolerance = 1e-5f * acceleration;
+  for (int i = 0; i < ACCEL_CACHE_SIZE; ++i) {
+    if (fabsf(accel_cache_[i].acceleration - acceleration) <= tolerance)
+      return accel_cache_[i].factor;
+  }
+  AccelCacheEntry *entry = &accel_cache_[accel_cache_next_];
+  accel_cache_next_ = (accel_cache_next_ + 1) % ACCEL_CACHE_SIZE;
+  entry->acceleration = acceleration;
+  entry->factor = calcAccelerationFactor(acceleration);
+  return entry->factor;
+}
+
+// Number of split segments we hand to the motion queue at once.
+#define SPLIT_ENQUEUE_BATCH 16
+
+// Most pixels we send in one raster segment; the motion queue might have
+// to wait for the previous one to be done before it has room for more.
+#define RASTER_CHUNK (RASTER_LEN / 2)
+
+// Speed changes with a motion PWM that follows the speed are split in at
+// least that many pieces, each with the duty cycle of its average speed.
+#define PWM_SPEED_DIVISIONS 8
+
+void MotionQueueMotorOperations::FillMotionSegment(
+  const LinearSegmentSteps &param, int defining_axis_steps,
+  double acceleration, double v0_squared, struct MotionSegment *out) {
   struct MotionSegment new_element = {};
   new_element.direction_bits = 0;
 
@@ -108,113 +262,230 @@ void MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param
   // TODO: clamp acceleration to be a minimum value.
   const int total_loops = LOOPS_PER_STEP * defining_axis_steps;
   // There are three cases: either we accelerate, travel or decelerate.
-  if (param.v0 == param.v1) {
+  if (acceleration == 0) {
     // Travel
     new_element.loops_accel = new_element.loops_decel = 0;
     new_element.loops_travel = total_loops;
-    const float travel_speed = clip_hardware_frequency_limit(param.v0);
+    const float travel_speed = ClipStepFrequency(param.v0);
     new_element.travel_delay_cycles = round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * travel_speed));
-  } else if (param.v0 < param.v1) {
-    // acclereate
-    new_element.loops_travel = new_element.loops_decel = new_element.travel_delay_cycles = 0;
-    new_element.loops_accel = total_loops;
-
-    // v1 = v0 + a*t -> t = (v1 - v0)/a
-    // s = a/2 * t^2 + v0 * t; subsitution t from above.
-    // a = (v1^2-v0^2)/(2*s)
-    float acceleration = (sq(param.v1) - sq(param.v0)) / (2.0f * defining_axis_steps);
-    //fprintf(stderr, "M-OP HZ: defining=%d ; accel=%.2f\n", defining_axis_steps, acceleration);
+    new_element.pwm = motion_pwm(param, travel_speed);
+  } else {
+    double v1_squared = v0_squared + 2.0 * acceleration * defining_axis_steps;
+    if (v1_squared < 0.0) v1_squared = 0.0;
+    new_element.pwm = motion_pwm(param, (sqrt(v0_squared) + sqrt(v1_squared)) / 2);
+    new_element.loops_travel = new_element.travel_delay_cycles = 0;
+    if (acceleration > 0) {
+      new_element.loops_accel = total_loops;
+      new_element.loops_decel = 0;
+    } else {
+      // Deceleration goes down the same taylor series; from the index
+      // of the start speed.
+      new_element.loops_decel = total_loops;
+      new_element.loops_accel = 0;
+      acceleration = -acceleration;
+    }
     // If we accelerated from zero to our first speed, this is how many steps
     // we needed. We need to go this index into our taylor series.
+    // Rounded as double: a float is off by a few loops beyond 2^24.
     const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
+      lround(LOOPS_PER_STEP * (v0_squared / (2.0 * acceleration)));
 
     new_element.accel_series_index = accel_loops_from_zero;
     new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
-  } else {  // v0 > v1
-    // decelerate
-    new_element.loops_travel = new_element.loops_accel = new_element.travel_delay_cycles = 0;
-    new_element.loops_decel = total_loops;
-
-    float acceleration = (sq(param.v0) - sq(param.v1)) / (2.0f * defining_axis_steps);
-    //fprintf(stderr, "M-OP HZ: defining=%d ; decel=%.2f\n", defining_axis_steps, acceleration);
-    // We are into the taylor sequence this value up and reduce from there.
-    const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
-
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
+      round2int((1 << DELAY_CYCLE_SHIFT)
+                * calcAccelerationCurveValueAt(new_element.accel_series_index,
+                                               AccelerationFactor(acceleration)));
   }
 
   new_element.aux = param.aux_bits;
-  new_element.state = STATE_FILLED;
-  backend_->MotorEnable(true);
-  backend_->Enqueue(&new_element);
+  new_element.state = param.stop_on_probe ? STATE_PROBE : STATE_FILLED;
+  *out = new_element;
 }
 
-static int get_defining_axis_steps(const LinearSegmentSteps &param) {
-  int defining_axis_steps = abs(param.steps[0]);
-  for (int i = 1; i < BEAGLEG_NUM_MOTORS; ++i) {
-    if (abs(param.steps[i]) > defining_axis_steps) {
-      defining_axis_steps = abs(param.steps[i]);
-    }
-  }
-  return defining_axis_steps;
+void MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
+                                                 int defining_axis_steps) {
+  // v1 = v0 + a*t -> t = (v1 - v0)/a
+  // s = a/2 * t^2 + v0 * t; subsitution t from above.
+  // a = (v1^2-v0^2)/(2*s)
+  const float acceleration = (param.v0 == param.v1)
+    ? 0
+    : (sq(param.v1) - sq(param.v0)) / (2.0f * defining_axis_steps);
+  //fprintf(stderr, "M-OP HZ: defining=%d ; accel=%.2f\n", defining_axis_steps, acceleration);
+  struct MotionSegment new_element;
+  FillMotionSegment(param, defining_axis_steps, acceleration, sq(param.v0),
+                    &new_element);
+  backend_->MotorEnable(true);
+  backend_->Enqueue(&new_element);
 }
 
 void MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
+  TraceScope trace(TRACE_MOTOR_OPS_ENQUEUE);
   const int defining_axis_steps = get_defining_axis_steps(param);
 
   if (defining_axis_steps == 0) {
     // No move, but we still have to set the bits.
     struct MotionSegment empty_element = {};
     empty_element.aux = param.aux_bits;
+    empty_element.pwm = motion_pwm(param, 0);
     empty_element.state = STATE_FILLED;
     backend_->Enqueue(&empty_element);
   }
-  else if (defining_axis_steps > MAX_STEPS_PER_SEGMENT) {
-    // We have more steps that we can enqueue in one chunk, so let's cut
-    // it in pieces.
-    const double a = (sqd(param.v1) - sqd(param.v0))/(2.0*defining_axis_steps);
-    const int divisions = (defining_axis_steps / MAX_STEPS_PER_SEGMENT) + 1;
+  else if (defining_axis_steps > MAX_STEPS_PER_SEGMENT
+           || (param.pwm_full_speed > 0 && param.v0 != param.v1
+               && defining_axis_steps > 1)) {
+    // We have more steps that we can enqueue in one chunk, or the PWM needs
+    // to follow the speed, so let's cut it in pieces.
+    // All pieces share the same acceleration; the speed at the beginning
+    // of each piece follows from the steps done so far:
+    // v^2 = v0^2 + 2 * a * steps, so we don't need any square roots.
+    // These squared values can get huge, lets not loose precision
+    // here and do calculations in double (otherwise our results can
+    // be a little bit off and fail to reach zero properly).
+    const double a = (param.v0 == param.v1)
+      ? 0
+      : (sqd(param.v1) - sqd(param.v0))/(2.0*defining_axis_steps);
+    const double v0squared = sqd(param.v0);
+    int divisions = (defining_axis_steps / MAX_STEPS_PER_SEGMENT) + 1;
+    if (param.pwm_full_speed > 0 && param.v0 != param.v1
+        && divisions < PWM_SPEED_DIVISIONS) {
+      divisions = std::min(defining_axis_steps, PWM_SPEED_DIVISIONS);
+    }
     int64_t hires_steps_per_div[BEAGLEG_NUM_MOTORS];
     for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
       // (+1 to fix rounding trouble in the LSB)
       hires_steps_per_div[i] = ((int64_t)param.steps[i] << 32)/divisions + 1;
     }
 
-    struct LinearSegmentSteps previous = {}, accumulator = {}, output;
     int64_t hires_step_accumulator[BEAGLEG_NUM_MOTORS] = {0};
-    double previous_speed = param.v0;   // speed calculation in double
+    int previous_steps[BEAGLEG_NUM_MOTORS] = {0};
+    int defining_steps_done = 0;
+    struct LinearSegmentSteps output = param;
+    struct MotionSegment batch[SPLIT_ENQUEUE_BATCH];
+    int batch_count = 0;
 
-    output.aux_bits = param.aux_bits;  // use the original Aux bits for all segments
+    backend_->MotorEnable(true);
     for (int d = 0; d < divisions; ++d) {
+      // Independent per motor; simple enough for the compiler to vectorize.
       for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
         hires_step_accumulator[i] += hires_steps_per_div[i];
-        accumulator.steps[i] = hires_step_accumulator[i] >> 32;
-        output.steps[i] = accumulator.steps[i] - previous.steps[i];
+        const int accumulated = hires_step_accumulator[i] >> 32;
+        output.steps[i] = accumulated - previous_steps[i];
+        previous_steps[i] = accumulated;
       }
       const int division_steps = get_defining_axis_steps(output);
-      // These squared values can get huge, lets not loose precision
-      // here and do calculations in double (otherwise our results can
-      // be a little bit off and fail to reach zero properly).
-      const double v0squared = sqd(previous_speed);
-      // v1 = v0 + a*t; t = (sqrt(v0^2 + 2 * a * steps) - v0) / a
-      // -> v1 = sqrt(v0^ + 2 * a * steps)
-      const double v1squared = v0squared + 2.0 * a * division_steps;
-      // Rounding errors can make v1squared slightly negative...
-      const double v1 = v1squared > 0.0 ? sqrt(v1squared) : 0;
-      output.v0 = previous_speed;
-      output.v1 = v1;
-      EnqueueInternal(output, division_steps);
-      previous = accumulator;
-      previous_speed = v1;
+      // Rounding errors can make the squared speed slightly negative...
+      double division_v0squared = v0squared + 2.0 * a * defining_steps_done;
+      if (division_v0squared < 0.0) division_v0squared = 0.0;
+      FillMotionSegment(output, division_steps, a, division_v0squared,
+                        &batch[batch_count++]);
+      defining_steps_done += division_steps;
+      if (batch_count == SPLIT_ENQUEUE_BATCH || d == divisions - 1) {
+        backend_->EnqueueMany(batch, batch_count);
+        batch_count = 0;
+      }
     }
   } else {
     EnqueueInternal(param, defining_axis_steps);
   }
+  Metrics_set_moving(defining_axis_steps > 0 && param.v1 > 0);
+}
+
+// The hardware runs acceleration, travel and deceleration of one segment in
+// sequence; the deceleration continues going down the acceleration series
+// from where the acceleration ended. So if both have the same acceleration,
+// the whole trapezoid only needs one slot in the queue.
+void MotionQueueMotorOperations::EnqueueTrapezoid(
+  const LinearSegmentSteps &accel, const LinearSegmentSteps &travel,
+  const LinearSegmentSteps &decel) {
+  TraceScope trace(TRACE_MOTOR_OPS_ENQUEUE);
+  LinearSegmentSteps total = travel;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    total.steps[i] = accel.steps[i] + travel.steps[i] + decel.steps[i];
+  }
+  const int defining_axis_steps = get_defining_axis_steps(total);
+  if (defining_axis_steps == 0 || defining_axis_steps > MAX_STEPS_PER_SEGMENT
+      || (travel.pwm_full_speed > 0 && (has_steps(accel) || has_steps(decel)))) {
+    MotorOperations::EnqueueTrapezoid(accel, travel, decel);
+    return;
+  }
+  const int defining_motor = get_defining_motor(total);
+  const int accel_steps = abs(accel.steps[defining_motor]);
+  const int travel_steps = abs(travel.steps[defining_motor]);
+  const int decel_steps = abs(decel.steps[defining_motor]);
+
+  const double a_accel = (accel_steps > 0 && accel.v1 > accel.v0)
+    ? (sqd(accel.v1) - sqd(accel.v0)) / (2.0 * accel_steps) : 0;
+  const double a_decel = (decel_steps > 0 && decel.v0 > decel.v1)
+    ? (sqd(decel.v0) - sqd(decel.v1)) / (2.0 * decel_steps) : 0;
+  if ((accel_steps > 0 && a_accel == 0) || (decel_steps > 0 && a_decel == 0)
+      || (a_accel > 0 && a_decel > 0
+          && fabs(a_accel - a_decel) > 1e-2 * a_accel)) {
+    MotorOperations::EnqueueTrapezoid(accel, travel, decel);
+    return;
+  }
+
+  // Direction bits and fractions from the full move, the speed change and
+  // travel parameters from the individual phases.
+  struct MotionSegment new_element;
+  if (a_accel > 0) {
+    FillMotionSegment(total, defining_axis_steps, a_accel, sqd(accel.v0),
+                      &new_element);
+  } else if (a_decel > 0) {
+    FillMotionSegment(total, defining_axis_steps, -a_decel, sqd(decel.v0),
+                      &new_element);
+  } else {
+    FillMotionSegment(total, defining_axis_steps, 0, 0, &new_element);
+  }
+  new_element.loops_accel = LOOPS_PER_STEP * accel_steps;
+  new_element.loops_travel = LOOPS_PER_STEP * travel_steps;
+  new_element.loops_decel = LOOPS_PER_STEP * decel_steps;
+  new_element.travel_delay_cycles = (travel_steps > 0)
+    ? round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * ClipStepFrequency(travel.v0)))
+    : 0;
+
+  backend_->MotorEnable(true);
+  backend_->Enqueue(&new_element);
+  const LinearSegmentSteps &last = has_steps(decel) ? decel
+    : has_steps(travel) ? travel : accel;
+  Metrics_set_moving(last.v1 > 0);
+}
+
+void MotionQueueMotorOperations::EnqueueRaster(const LinearSegmentSteps &param,
+                                               const uint8_t *pixels,
+                                               int count) {
+  TraceScope trace(TRACE_MOTOR_OPS_ENQUEUE);
+  const int defining_axis_steps = get_defining_axis_steps(param);
+  // The hardware changes the PWM at most every loop; only at constant speed.
+  int chunks = std::max((count + RASTER_CHUNK - 1) / RASTER_CHUNK,
+                        defining_axis_steps / MAX_STEPS_PER_SEGMENT + 1);
+  if (param.v0 != param.v1 || count < 2 || count > defining_axis_steps
+      || chunks > count) {
+    MotorOperations::EnqueueRaster(param, pixels, count);
+    return;
+  }
+  const uint32_t full_pwm = motion_pwm(param, ClipStepFrequency(param.v0));
+  uint16_t pwm[RASTER_CHUNK];
+  LinearSegmentSteps chunk = param;
+  int steps_done[BEAGLEG_NUM_MOTORS] = {0};
+  backend_->MotorEnable(true);
+  for (int c = 0; c < chunks; ++c) {
+    const int begin = (int64_t) count * c / chunks;
+    const int end = (int64_t) count * (c + 1) / chunks;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      const int until = raster_steps_until(param, i, end, count);
+      chunk.steps[i] = until - steps_done[i];
+      steps_done[i] = until;
+    }
+    for (int p = begin; p < end; ++p) {
+      pwm[p - begin] = full_pwm * pixels[p] / 255;
+    }
+    struct MotionSegment segment;
+    FillMotionSegment(chunk, get_defining_axis_steps(chunk), 0, 0, &segment);
+    if (!backend_->EnqueueRaster(&segment, pwm, end - begin)) {
+      MotorOperations::EnqueueRaster(chunk, pixels + begin, end - begin);
+    }
+  }
+  Metrics_set_moving(param.v1 > 0);
 }
 
 void MotionQueueMotorOperations::MotorEnable(bool on) {
@@ -225,3 +496,35 @@ void MotionQueueMotorOperations::MotorEnable(bool on) {
 void MotionQueueMotorOperations::WaitQueueEmpty() {
   backend_->WaitQueueEmpty();
 }
+
+bool MotionQueueMotorOperations::QueueFull(int operations) {
+  // A trapezoid or raster line takes up to three slots.
+  return backend_->IsFull(3 * operations);
+}
+
+bool MotionQueueMotorOperations::SetSpeedOverride(float factor) {
+  return backend_->SetSpeedOverride(factor);
+}
+
+void MotionQueueMotorOperations::SetSpeedOverrideRamp(float stop_seconds) {
+  backend_->SetSpeedOverrideRamp(stop_seconds);
+}
+
+void MotionQueueMotorOperations::SetProbeSwitch(uint32_t gpio_def,
+                                                bool trigger_level) {
+  backend_->SetProbeSwitch(gpio_def, trigger_level);
+}
+
+bool MotionQueueMotorOperations::SetMotionPWMOutput(uint32_t gpio_def) {
+  return backend_->SetMotionPWMOutput(gpio_def);
+}
+
+bool MotionQueueMotorOperations::GetProbeStepsSkipped(
+  int skipped[BEAGLEG_NUM_MOTORS]) {
+  MotorsRegister motor_steps;
+  const bool triggered = backend_->GetProbeStepsSkipped(&motor_steps);
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    skipped[i] = (i < MOTION_MOTOR_COUNT) ? motor_steps[i] : 0;
+  }
+  return triggered;
+}
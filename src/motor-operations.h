@@ -19,6 +19,7 @@
 #ifndef _BEAGLEG_MOTOR_OPERATIONS_H_
 #define _BEAGLEG_MOTOR_OPERATIONS_H_
 
+#include <stdint.h>
 #include <stdio.h>
 
 class MotionQueue;
@@ -33,8 +34,8 @@ struct LinearSegmentSteps {
   // Speed is steps/s. If initial speed and final speed differ, the motor will
   // accelerate or decelerate to reach the final speed within the given number of
   // alotted steps of the axis with the most number of steps; all other axes are
-  // scaled accordingly. Uses jerk-settings to increase/decrease acceleration;
-  // the acceleration is zero at the end of the move.
+  // scaled accordingly. Acceleration is constant within one segment; jerk-limited
+  // (S-curve) speed changes are sent by the planner as a sequence of segments.
   float v0;     // initial speed
   float v1;     // final speed
 
@@ -43,6 +44,17 @@ struct LinearSegmentSteps {
   unsigned short aux_bits;   // Aux-bits to switch.
 
   int steps[BEAGLEG_NUM_MOTORS]; // Steps for axis. Negative for reverse.
+
+  // Probing move: ends early as soon as the probe switch triggers; see
+  // MotorOperations::SetProbeSwitch().
+  bool stop_on_probe;
+
+  // Duty cycle 0..1 of the motion synchronized PWM output while moving; see
+  // MotorOperations::SetMotionPWMOutput(). If "pwm_full_speed" is positive,
+  // the duty cycle is scaled with the speed, reaching "pwm" at that speed
+  // (steps/s), e.g. for constant laser power per distance.
+  float pwm;
+  float pwm_full_speed;
 };
 
 class MotorOperations {  // Rename SegmentQueue ?
@@ -56,28 +68,117 @@ public:
   // Automatically enables motors if not already.
   virtual void Enqueue(const LinearSegmentSteps &segment) = 0;
 
+  // Enqueue a trapezoid move: acceleration, travel and deceleration with the
+  // same acceleration. Parts with no steps are skipped. Implementations can
+  // combine them into one hardware segment; by default, they are enqueued
+  // one after another.
+  virtual void EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                                const LinearSegmentSteps &travel,
+                                const LinearSegmentSteps &decel);
+
   // Waits for the queue to be empty and Enables/disables motors according to the
   // given boolean value (Right now, motors cannot be individually addressed).
   virtual void MotorEnable(bool on) = 0;
 
   // Wait, until all elements in the ring-buffer are consumed.
   virtual void WaitQueueEmpty() = 0;
+
+  // Whether enqueuing "operations" more operations (calls of Enqueue*())
+  // could block right now, because the queue has less room. Lets callers do
+  // something else meanwhile instead of waiting. Queues that can't hold that
+  // many ask for half their capacity; the other half keeps the machine busy
+  // while the caller waits for room for the rest.
+  virtual bool QueueFull(int operations = 1) { return false; }
+
+  // Real-time speed override of what is already queued; a factor of zero
+  // holds. Immediate, not queued. See MotionQueue::SetSpeedOverride().
+  // Returns false if not supported.
+  virtual bool SetSpeedOverride(float factor) { return false; }
+  virtual void SetSpeedOverrideRamp(float stop_seconds) {}
+
+  // The switch that ends "stop_on_probe" moves when it reads "trigger_level";
+  // "gpio_def" as in the hardware mapping. Only to be changed while no
+  // probing moves are queued.
+  virtual void SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {}
+
+  // Steps per motor (negative for reverse) the "stop_on_probe" moves did not
+  // do since the last call, because the switch triggered. Returns true if it
+  // triggered; following "stop_on_probe" moves are then skipped until this is
+  // called. To be called once the queue is empty, before enqueuing anything
+  // else. Without hardware support, probing moves always run to the end.
+  virtual bool GetProbeStepsSkipped(int skipped[BEAGLEG_NUM_MOTORS]);
+
+  // Let the hardware follow the "pwm" of the segments on the PWM output
+  // "gpio_def" (as in the hardware mapping), in sync with the motion.
+  // Returns false if not supported.
+  virtual bool SetMotionPWMOutput(uint32_t gpio_def) { return false; }
+
+  // Enqueue "segment" with the motion PWM following the "count" pixels of a
+  // raster line, evenly spaced along the steps of the defining axis. Each
+  // pixel 0..255 scales the "pwm" of the segment. By default, this enqueues
+  // a segment per run of equal pixels; implementations can do better.
+  virtual void EnqueueRaster(const LinearSegmentSteps &segment,
+                             const uint8_t *pixels, int count);
 };
 
 class MotionQueueMotorOperations : public MotorOperations {
 public:
   // Initialize motor operations, sending planned results into the motion backend.
-  MotionQueueMotorOperations(MotionQueue *backend) : backend_(backend) {}
+  // Travel speeds are clipped to "max_step_frequency" steps/s, the most the
+  // hardware can do.
+  MotionQueueMotorOperations(MotionQueue *backend,
+                             float max_step_frequency = 1e6);
 
   virtual void Enqueue(const LinearSegmentSteps &segment);
+  virtual void EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                                const LinearSegmentSteps &travel,
+                                const LinearSegmentSteps &decel);
   virtual void MotorEnable(bool on);
   virtual void WaitQueueEmpty();
+  virtual bool QueueFull(int operations = 1);
+  virtual bool SetSpeedOverride(float factor);
+  virtual void SetSpeedOverrideRamp(float stop_seconds);
+  virtual void SetProbeSwitch(uint32_t gpio_def, bool trigger_level);
+  virtual bool GetProbeStepsSkipped(int skipped[BEAGLEG_NUM_MOTORS]);
+  virtual bool SetMotionPWMOutput(uint32_t gpio_def);
+
+  // Constant speed raster lines are sent as one segment per chunk of pixels
+  // if the motion queue supports it.
+  virtual void EnqueueRaster(const LinearSegmentSteps &segment,
+                             const uint8_t *pixels, int count);
+
+  // Factor for the acceleration series for the given acceleration in
+  // steps/s^2. Axes have fixed accelerations, so we only have a handful of
+  // different values; these are cached.
+  float AccelerationFactor(float acceleration);
 
 private:
   void EnqueueInternal(const LinearSegmentSteps &param,
                        int defining_axis_steps);
 
+  // Fill motion segment. For a speed change, "acceleration" is the signed
+  // acceleration, "v0_squared" the square of the initial speed. With
+  // zero acceleration, we travel with param.v0.
+  void FillMotionSegment(const LinearSegmentSteps &param,
+                         int defining_axis_steps,
+                         double acceleration, double v0_squared,
+                         struct MotionSegment *out);
+
+  // Clip speed to maximum we can reach with hardware.
+  float ClipStepFrequency(float v) const {
+    return v < max_step_frequency_ ? v : max_step_frequency_;
+  }
+
   MotionQueue *backend_;
+  const float max_step_frequency_;
+
+  enum { ACCEL_CACHE_SIZE = 8 };
+  struct AccelCacheEntry {
+    float acceleration;
+    float factor;
+  };
+  AccelCacheEntry accel_cache_[ACCEL_CACHE_SIZE];
+  int accel_cache_next_;
 };
 
 #endif  // _BEAGLEG_MOTOR_OPERATIONS_H_
@@ -0,0 +1,409 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "motor-operations.h"
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "motion-queue.h"
+#include "motor-interface-constants.h"
+#include "sim-firmware.h"
+
+// Motion queue that just collects what it gets.
+class CollectingMotionQueue : public MotionQueue {
+public:
+  void Enqueue(MotionSegment *segment) { segments.push_back(*segment); }
+  void WaitQueueEmpty() {}
+  void MotorEnable(bool on) {}
+  void Shutdown(bool flush_queue) {}
+  void GetMotorsLoops(MotorsRegister *absolute_pos_loops) {}
+
+  std::vector<MotionSegment> segments;
+};
+
+static int TotalLoops(const std::vector<MotionSegment> &segments) {
+  int result = 0;
+  for (const MotionSegment &s : segments) {
+    result += s.loops_accel + s.loops_travel + s.loops_decel;
+  }
+  return result;
+}
+
+// The PRU counts down the loops of a segment in the 24 bits of the status
+// word, so each segment has to fit in there.
+static void ExpectLoopsFitFirmware(const std::vector<MotionSegment> &segments) {
+  for (const MotionSegment &s : segments) {
+    EXPECT_LT(s.loops_accel + s.loops_travel + s.loops_decel, 1u << 24);
+    EXPECT_LE(s.loops_accel, (uint32_t) MAX_SEGMENT_LOOPS);
+    EXPECT_LE(s.loops_travel, (uint32_t) MAX_SEGMENT_LOOPS);
+    EXPECT_LE(s.loops_decel, (uint32_t) MAX_SEGMENT_LOOPS);
+  }
+}
+
+TEST(MotorOperations, SimpleAcceleration) {
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  LinearSegmentSteps accel = { 0, 10000, 0, {5000} };
+  motor_ops.Enqueue(accel);
+  ASSERT_EQ(1, (int)queue.segments.size());
+  const MotionSegment &s = queue.segments[0];
+  EXPECT_EQ(10000u, s.loops_accel);
+  EXPECT_EQ(0u, s.loops_travel);
+  EXPECT_EQ(0, (int)s.accel_series_index);  // Starting from zero speed.
+
+  // c0 = 0.67605 * freq * sqrt(2 / a) with a = 10000^2 / (2 * 5000) in loops.
+  const double a = 10000.0 * 10000 / (2 * 5000);
+  const double expected_c0 = 0.67605 * TIMER_FREQUENCY * sqrt(4.0 / a) / 2;
+  EXPECT_NEAR(expected_c0, 1.0 * s.hires_accel_cycles / (1 << DELAY_CYCLE_SHIFT),
+              1e-4 * expected_c0);
+}
+
+// Long accelerations are split into multiple segments; these need to
+// continue where the previous left off in the acceleration series.
+TEST(MotorOperations, SplitAccelerationContinuesSeries) {
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  const int kSteps = 20000000;
+  LinearSegmentSteps accel = { 100, 50000, 0, {kSteps, kSteps / 3} };
+  motor_ops.Enqueue(accel);
+  ASSERT_GT((int)queue.segments.size(), 2);
+  EXPECT_EQ(2 * kSteps, TotalLoops(queue.segments));
+  ExpectLoopsFitFirmware(queue.segments);
+
+  for (size_t i = 1; i < queue.segments.size(); ++i) {
+    const MotionSegment &previous = queue.segments[i-1];
+    const MotionSegment &current = queue.segments[i];
+    EXPECT_NEAR(previous.accel_series_index + previous.loops_accel,
+                current.accel_series_index, 1) << "segment " << i;
+  }
+
+  // The same acceleration in one piece starting at the same speed as the
+  // last split segment yields the same timing.
+  const MotionSegment &last = queue.segments.back();
+  const int last_steps = last.loops_accel / 2;
+  const double a = (50000.0 * 50000 - 100 * 100) / (2.0 * kSteps);
+  const float v0 = sqrt(50000.0 * 50000 - 2 * a * last_steps);
+  CollectingMotionQueue single_queue;
+  MotionQueueMotorOperations single_ops(&single_queue);
+  LinearSegmentSteps single = { v0, 50000, 0, {last_steps} };
+  single_ops.Enqueue(single);
+  ASSERT_EQ(1, (int)single_queue.segments.size());
+  // The single move derives its acceleration from the difference of the
+  // squared speeds in float; the shorter it is, the less precise.
+  const double precision = 4.0 * 50000.0 * 50000 * FLT_EPSILON
+    / (50000.0 * 50000 - (double) v0 * v0);
+  EXPECT_NEAR(last.accel_series_index,
+              single_queue.segments[0].accel_series_index,
+              precision * last.accel_series_index);
+  EXPECT_NEAR(last.hires_accel_cycles,
+              single_queue.segments[0].hires_accel_cycles,
+              1e-3 * last.hires_accel_cycles);
+}
+
+TEST(MotorOperations, SplitTravelKeepsSpeed) {
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  LinearSegmentSteps travel = { 10000, 10000, 0, {20000000} };
+  motor_ops.Enqueue(travel);
+  ASSERT_GT((int)queue.segments.size(), 2);
+  EXPECT_EQ(40000000, TotalLoops(queue.segments));
+  ExpectLoopsFitFirmware(queue.segments);
+  for (const MotionSegment &s : queue.segments) {
+    EXPECT_EQ(TIMER_FREQUENCY / (2 * 10000), (int)s.travel_delay_cycles);
+  }
+}
+
+TEST(MotorOperations, AccelerationFactorCached) {
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  const float f1 = motor_ops.AccelerationFactor(1000);
+  const float f2 = motor_ops.AccelerationFactor(4000);
+  EXPECT_FLOAT_EQ(f1 / 2, f2);  // ~ 1/sqrt(a)
+
+  // Tiny rounding differences end up in the same entry.
+  EXPECT_EQ(f1, motor_ops.AccelerationFactor(1000.001));
+  EXPECT_EQ(f2, motor_ops.AccelerationFactor(4000));
+}
+
+TEST(MotorOperations, TimingQueueTravelTime) {
+  TimingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  LinearSegmentSteps travel = { 10000, 10000, 0, {20000000} };
+  motor_ops.Enqueue(travel);
+  EXPECT_GT(queue.segment_count(), 2);   // Split, but not affecting time.
+  EXPECT_NEAR(2000.0, queue.total_time(), 1e-6);
+
+  // Beyond what the hardware can do, we only go as fast as the limit.
+  TimingMotionQueue clipped_queue;
+  MotionQueueMotorOperations clipped_ops(&clipped_queue);
+  LinearSegmentSteps too_fast = { 4e6, 4e6, 0, {20000000} };
+  clipped_ops.Enqueue(too_fast);
+  EXPECT_NEAR(20.0, clipped_queue.total_time(), 1e-6);
+
+  // Each instance can be configured for its hardware.
+  TimingMotionQueue slow_queue;
+  MotionQueueMotorOperations slow_ops(&slow_queue, 5e5);
+  slow_ops.Enqueue(too_fast);
+  EXPECT_NEAR(40.0, slow_queue.total_time(), 1e-6);
+}
+
+TEST(MotorOperations, TimingQueueAccelerationTime) {
+  TimingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  const int kSteps = 100000;
+  LinearSegmentSteps accel = { 1000, 50000, 0, {kSteps} };
+  motor_ops.Enqueue(accel);
+  LinearSegmentSteps decel = { 50000, 1000, 0, {kSteps} };
+  motor_ops.Enqueue(decel);
+
+  // Constant acceleration:  steps = (v0 + v1) / 2 * t
+  const double expected = 2 * (2.0 * kSteps / (1000 + 50000));
+  EXPECT_NEAR(expected, queue.total_time(), 1e-2 * expected);
+}
+
+TEST(MotorOperations, TrapezoidInOneSegment) {
+  const LinearSegmentSteps accel = { 1000, 10000, 0, {4950, 1650} };
+  const LinearSegmentSteps travel = { 10000, 10000, 0, {5000, 1667} };
+  const LinearSegmentSteps decel = { 10000, 1000, 0, {4950, 1650} };
+
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  motor_ops.EnqueueTrapezoid(accel, travel, decel);
+  ASSERT_EQ(1, (int)queue.segments.size());
+  const MotionSegment &s = queue.segments[0];
+  EXPECT_EQ(2u * 4950, s.loops_accel);
+  EXPECT_EQ(2u * 5000, s.loops_travel);
+  EXPECT_EQ(2u * 4950, s.loops_decel);
+  EXPECT_EQ(TIMER_FREQUENCY / (2 * 10000), (int)s.travel_delay_cycles);
+
+  // Same timing as separate segments (up to the approximation of the
+  // series, which is restarted for the separate deceleration).
+  TimingMotionQueue combined_timing;
+  MotionQueueMotorOperations combined_ops(&combined_timing);
+  combined_ops.EnqueueTrapezoid(accel, travel, decel);
+  TimingMotionQueue separate_timing;
+  MotionQueueMotorOperations separate_ops(&separate_timing);
+  separate_ops.Enqueue(accel);
+  separate_ops.Enqueue(travel);
+  separate_ops.Enqueue(decel);
+  EXPECT_EQ(3, separate_timing.segment_count());
+  EXPECT_NEAR(separate_timing.total_time(), combined_timing.total_time(),
+              5e-3 * separate_timing.total_time());
+}
+
+TEST(MotorOperations, TrapezoidOnlyCombinedIfPossible) {
+  // Different acceleration in accel and decel.
+  const LinearSegmentSteps accel = { 0, 10000, 0, {5000} };
+  const LinearSegmentSteps travel = { 10000, 10000, 0, {5000} };
+  const LinearSegmentSteps decel = { 10000, 0, 0, {2500} };
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  motor_ops.EnqueueTrapezoid(accel, travel, decel);
+  EXPECT_EQ(3, (int)queue.segments.size());
+
+  // Too long for one segment.
+  const LinearSegmentSteps long_travel = { 10000, 10000, 0, {20000000} };
+  const LinearSegmentSteps short_decel = { 10000, 0, 0, {5000} };
+  CollectingMotionQueue long_queue;
+  MotionQueueMotorOperations long_ops(&long_queue);
+  long_ops.EnqueueTrapezoid(accel, long_travel, short_decel);
+  EXPECT_GT((int)long_queue.segments.size(), 3);
+  EXPECT_EQ(2 * 20010000, TotalLoops(long_queue.segments));
+  ExpectLoopsFitFirmware(long_queue.segments);
+
+  // Missing parts are fine.
+  const LinearSegmentSteps none = { 0, 0, 0, {} };
+  CollectingMotionQueue decel_queue;
+  MotionQueueMotorOperations decel_ops(&decel_queue);
+  decel_ops.EnqueueTrapezoid(none, travel, short_decel);
+  ASSERT_EQ(1, (int)decel_queue.segments.size());
+  EXPECT_EQ(0u, decel_queue.segments[0].loops_accel);
+  EXPECT_EQ(2u * 5000, decel_queue.segments[0].loops_decel);
+  EXPECT_EQ(2 * 5000, (int)decel_queue.segments[0].accel_series_index);
+}
+
+// Up to the loops the firmware can count, a trapezoid is still one segment.
+TEST(MotorOperations, TrapezoidUpToFirmwareLoopLimit) {
+  const int kMaxSteps = MAX_SEGMENT_LOOPS / 2;
+  const LinearSegmentSteps accel = { 1000, 10000, 0, {4950} };
+  const LinearSegmentSteps decel = { 10000, 1000, 0, {4950} };
+  LinearSegmentSteps travel = { 10000, 10000, 0, {kMaxSteps - 2 * 4950} };
+
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  motor_ops.EnqueueTrapezoid(accel, travel, decel);
+  ASSERT_EQ(1, (int)queue.segments.size());
+  EXPECT_EQ(2 * kMaxSteps, TotalLoops(queue.segments));
+  ExpectLoopsFitFirmware(queue.segments);
+
+  travel.steps[0] += 1;  // One step too many.
+  CollectingMotionQueue split_queue;
+  MotionQueueMotorOperations split_ops(&split_queue);
+  split_ops.EnqueueTrapezoid(accel, travel, decel);
+  EXPECT_GT((int)split_queue.segments.size(), 1);
+  EXPECT_EQ(2 * (kMaxSteps + 1), TotalLoops(split_queue.segments));
+  ExpectLoopsFitFirmware(split_queue.segments);
+}
+
+TEST(MotorOperations, FastSimulationMatchesTiming) {
+  const LinearSegmentSteps accel = { 1000, 50000, 0, {100000, 30000} };
+  const LinearSegmentSteps travel = { 50000, 50000, 0, {50000, 15000} };
+  const LinearSegmentSteps decel = { 50000, 1000, 0, {100000, 30000} };
+
+  TimingMotionQueue timing;
+  MotionQueueMotorOperations timing_ops(&timing);
+  timing_ops.EnqueueTrapezoid(accel, travel, decel);
+
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  {
+    SimFirmwareQueue sim(out, 2, SimFirmwareQueue::FORMAT_CSV, 1000);
+    MotionQueueMotorOperations sim_ops(&sim);
+    sim_ops.EnqueueTrapezoid(accel, travel, decel);
+  }
+  fclose(out);
+
+  // Last line: end of the deceleration.
+  std::string csv(buffer, size);
+  free(buffer);
+  const size_t last_line = csv.rfind('\n', csv.size() - 2) + 1;
+  double time;
+  char phase;
+  float speed, acceleration;
+  int steps_x, steps_y;
+  ASSERT_EQ(6, sscanf(csv.c_str() + last_line, "%lf,%c,%f,%f,%d,%d",
+                      &time, &phase, &speed, &acceleration,
+                      &steps_x, &steps_y));
+  EXPECT_EQ('d', phase);
+  EXPECT_EQ(250000, steps_x);
+  EXPECT_EQ(75000, steps_y);
+  EXPECT_NEAR(timing.total_time(), time, 1e-2 * timing.total_time());
+  // Decimation: a sample every 1000 loops, 2 loops per step.
+  EXPECT_GT(std::count(csv.begin(), csv.end(), '\n'), 2 * 250000 / 1000);
+}
+
+// A motion PWM that follows the speed is stepped up with the acceleration.
+TEST(MotorOperations, MotionPWMFollowsSpeed) {
+  CollectingMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  LinearSegmentSteps accel = { 0, 10000, 0, {5000} };
+  accel.pwm = 0.5;
+  accel.pwm_full_speed = 10000;
+  motor_ops.Enqueue(accel);
+  ASSERT_EQ(8, (int)queue.segments.size());
+  EXPECT_EQ(2 * 5000, TotalLoops(queue.segments));
+  for (size_t i = 1; i < queue.segments.size(); ++i) {
+    EXPECT_GT(queue.segments[i].pwm, queue.segments[i-1].pwm);
+  }
+  EXPECT_GT(queue.segments.back().pwm, 0.45 * MOTION_PWM_MAX);
+  EXPECT_LT(queue.segments.back().pwm, 0.5 * MOTION_PWM_MAX);
+
+  // Travel at half the speed: half the power.
+  queue.segments.clear();
+  LinearSegmentSteps travel = { 5000, 5000, 0, {5000} };
+  travel.pwm = 0.5;
+  travel.pwm_full_speed = 10000;
+  motor_ops.Enqueue(travel);
+  ASSERT_EQ(1, (int)queue.segments.size());
+  EXPECT_EQ(roundf(0.25 * MOTION_PWM_MAX), queue.segments[0].pwm);
+
+  // Constant power is not split.
+  queue.segments.clear();
+  accel.pwm_full_speed = 0;
+  motor_ops.Enqueue(accel);
+  ASSERT_EQ(1, (int)queue.segments.size());
+  EXPECT_EQ(roundf(0.5 * MOTION_PWM_MAX), queue.segments[0].pwm);
+}
+
+// Motion queue that takes raster lines as well.
+class RasterMotionQueue : public CollectingMotionQueue {
+public:
+  bool EnqueueRaster(MotionSegment *segment, const uint16_t *pwm, int count) {
+    Enqueue(segment);
+    raster_pwm.insert(raster_pwm.end(), pwm, pwm + count);
+    return true;
+  }
+
+  std::vector<uint16_t> raster_pwm;
+};
+
+TEST(MotorOperations, RasterSegmentPerRunOfPixels) {
+  const uint8_t pixels[] = { 0, 0, 255, 255, 128 };
+  LinearSegmentSteps travel = { 10000, 10000, 0, {1000, 500} };
+  travel.pwm = 1.0;
+
+  CollectingMotionQueue queue;  // No raster support.
+  MotionQueueMotorOperations motor_ops(&queue);
+  motor_ops.EnqueueRaster(travel, pixels, 5);
+  ASSERT_EQ(3, (int)queue.segments.size());
+  EXPECT_EQ(2u * 400, queue.segments[0].loops_travel);
+  EXPECT_EQ(2u * 400, queue.segments[1].loops_travel);
+  EXPECT_EQ(2u * 200, queue.segments[2].loops_travel);
+  EXPECT_EQ(0u, queue.segments[0].pwm);
+  EXPECT_EQ((uint32_t)MOTION_PWM_MAX, queue.segments[1].pwm);
+  EXPECT_EQ(roundf(128 / 255.0 * MOTION_PWM_MAX), queue.segments[2].pwm);
+
+  // Speed changes are split the same way, with speeds continuing.
+  queue.segments.clear();
+  LinearSegmentSteps accel = { 0, 10000, 0, {1000, 500} };
+  accel.pwm = 1.0;
+  motor_ops.EnqueueRaster(accel, pixels, 5);
+  ASSERT_EQ(3, (int)queue.segments.size());
+  EXPECT_EQ(2 * 1000, TotalLoops(queue.segments));
+  for (const MotionSegment &s : queue.segments) {
+    EXPECT_GT(s.loops_accel, 0u);
+  }
+}
+
+TEST(MotorOperations, RasterInOneSegment) {
+  const uint8_t pixels[] = { 0, 0, 255, 255, 128 };
+  LinearSegmentSteps travel = { 10000, 10000, 0, {1000, 500} };
+  travel.pwm = 0.5;
+
+  RasterMotionQueue queue;
+  MotionQueueMotorOperations motor_ops(&queue);
+  motor_ops.EnqueueRaster(travel, pixels, 5);
+  ASSERT_EQ(1, (int)queue.segments.size());
+  EXPECT_EQ(2u * 1000, queue.segments[0].loops_travel);
+  const uint16_t half = roundf(0.5 * MOTION_PWM_MAX);
+  const uint16_t dim = half * 128 / 255;
+  EXPECT_EQ(std::vector<uint16_t>({0, 0, half, half, dim}),
+            queue.raster_pwm);
+
+  // Not at constant speed: one segment per run.
+  queue.segments.clear();
+  LinearSegmentSteps accel = { 0, 10000, 0, {1000, 500} };
+  motor_ops.EnqueueRaster(accel, pixels, 5);
+  EXPECT_EQ(3, (int)queue.segments.size());
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
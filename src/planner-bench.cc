@@ -0,0 +1,108 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// How many segments per second the planner manages, without any motion
+// queue behind it. Run it on the BeagleBone to see what our per-segment
+// math costs on its FPU.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common/logging.h"
+#include "common/trace.h"
+
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+#include "planner.h"
+
+namespace {
+class CountingMotorOperations : public MotorOperations {
+public:
+  CountingMotorOperations() : segments(0) {}
+  virtual void Enqueue(const LinearSegmentSteps &segment) { ++segments; }
+  virtual void MotorEnable(bool on) {}
+  virtual void WaitQueueEmpty() {}
+
+  long segments;
+};
+}  // namespace
+
+enum Profile { ZIGZAG, CIRCLE, STRAIGHT };
+
+static void bench(const char *name, MachineControlConfig *config,
+                  Profile profile, int moves) {
+  HardwareMapping hardware;
+  hardware.AddMotorMapping(AXIS_X, 1, false);
+  hardware.AddMotorMapping(AXIS_Y, 2, false);
+  hardware.AddMotorMapping(AXIS_Z, 3, false);
+  CountingMotorOperations motor_ops;
+  Planner planner(config, &hardware, &motor_ops);
+
+  AxesRegister pos;
+  const uint64_t start = Trace_now_ns();
+  for (int i = 0; i < moves; ++i) {
+    switch (profile) {
+    case ZIGZAG:   // Short moves with corners, as in engraving.
+      pos[AXIS_X] = 100 + 0.5 * (i % 50);
+      pos[AXIS_Y] = 100 + ((i & 1) ? 0.3 : 0);
+      break;
+    case CIRCLE:   // Chords of a circle, as in arcs from CAM output.
+      pos[AXIS_X] = 100 + 50 * cosf(i * 2 * M_PI / 360);
+      pos[AXIS_Y] = 100 + 50 * sinf(i * 2 * M_PI / 360);
+      pos[AXIS_Z] = 10 + 0.001 * (i % 1000);
+      break;
+    case STRAIGHT:  // Back and forth; simple speed planning.
+      pos[AXIS_X] = (i & 1) ? 200 : 10;
+      break;
+    }
+    planner.Enqueue(pos, 100);
+  }
+  planner.BringPathToHalt();
+  const double duration = (Trace_now_ns() - start) / 1e9;
+  printf("%-10s %10.0f moves/s %10.0f segments/s\n", name,
+         moves / duration, motor_ops.segments / duration);
+}
+
+int main(int argc, char *argv[]) {
+  const int moves = (argc > 1) ? atoi(argv[1]) : 100000;
+  if (moves <= 0) {
+    fprintf(stderr, "Usage: %s [<moves-per-run>]\n", argv[0]);
+    return 1;
+  }
+  Log_init("/dev/null");
+
+  MachineControlConfig config;
+  for (int i = AXIS_X; i <= AXIS_Z; ++i) {
+    config.steps_per_mm[i] = 160;
+    config.max_feedrate[i] = 200;
+    config.acceleration[i] = 1000;
+  }
+  config.threshold_angle = 10;
+  config.require_homing = false;
+
+  bench("zigzag", &config, ZIGZAG, moves);
+  bench("circle", &config, CIRCLE, moves);
+  bench("straight", &config, STRAIGHT, moves);
+  config.junction_deviation = 0.02;
+  bench("zigzag-jd", &config, ZIGZAG, moves);
+  bench("circle-jd", &config, CIRCLE, moves);
+  return 0;
+}
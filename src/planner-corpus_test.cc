@@ -0,0 +1,310 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs all testdata/*.gcode files through the real machine control and
+// planner and compares the segments they emit and the time they take with
+// golden files in testdata/golden/.
+//
+// After an intended change of the planner output, regenerate them with
+//   make update-golden
+// and check the diff: it shows where the steps changed and how the time
+// of each job went up or down.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+#include "gcode-parser/gcode-parser.h"
+
+#include "config-parser.h"
+#include "determine-print-stats.h"
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+#include "spindle-control.h"
+
+#define TESTDATA_DIR "testdata/"
+#define GOLDEN_DIR TESTDATA_DIR "golden/"
+
+// Relative difference of the estimated time to the budget that is still
+// accepted. Faster beyond that also fails, so that gains get recorded.
+#define TIME_TOLERANCE 0.01
+
+// Relative difference of segment speeds still accepted, to not depend on
+// the last bits of floating point results of different compilers.
+#define SPEED_TOLERANCE 1e-4
+
+static bool update_golden = false;
+
+namespace {
+// One line per segment: steps of each motor, v0, v1 and aux bits.
+class RecordingMotorOperations : public MotorOperations {
+public:
+  void Enqueue(const LinearSegmentSteps &segment) {
+    std::string line;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      line.append(StringPrintf("%d ", segment.steps[i]));
+    }
+    line.append(StringPrintf("%.1f %.1f %x", segment.v0, segment.v1,
+                             segment.aux_bits));
+    lines.push_back(line);
+  }
+  void MotorEnable(bool on) {}
+  void WaitQueueEmpty() {}
+
+  std::vector<std::string> lines;
+};
+
+// Passes all events on, but doesn't spend the real time of dwells.
+class NoDwellEventReceiver : public GCodeParser::EventReceiver {
+public:
+  explicit NoDwellEventReceiver(GCodeParser::EventReceiver *delegatee)
+    : delegatee_(delegatee) {
+    set_arc_tolerance(delegatee->arc_tolerance(),
+                      delegatee->arc_min_segment());
+  }
+
+  void gcode_start(GCodeParser *p) { delegatee_->gcode_start(p); }
+  void gcode_finished(bool eos) { delegatee_->gcode_finished(eos); }
+  void inform_origin_offset(const AxesRegister &axes) {
+    delegatee_->inform_origin_offset(axes);
+  }
+  void gcode_command_done(char l, float v) {
+    delegatee_->gcode_command_done(l, v);
+  }
+  void input_idle(bool is_first) { delegatee_->input_idle(is_first); }
+  void go_home(AxisBitmap_t axes) { delegatee_->go_home(axes); }
+  bool probe_axis(float feed, GCodeParserAxis axis, float *probed) {
+    return delegatee_->probe_axis(feed, axis, probed);
+  }
+  void set_speed_factor(float f) { delegatee_->set_speed_factor(f); }
+  void set_fanspeed(float speed) { delegatee_->set_fanspeed(speed); }
+  void set_temperature(float f) { delegatee_->set_temperature(f); }
+  void wait_temperature() { delegatee_->wait_temperature(); }
+  void dwell(float value) { delegatee_->dwell(0); }
+  void motors_enable(bool b) { delegatee_->motors_enable(b); }
+  bool coordinated_move(float feed, const AxesRegister &axes) {
+    return delegatee_->coordinated_move(feed, axes);
+  }
+  bool rapid_move(float feed, const AxesRegister &axes) {
+    return delegatee_->rapid_move(feed, axes);
+  }
+  void arc_move(float feed, GCodeParserAxis normal_axis, bool clockwise,
+                const AxesRegister &start, const AxesRegister &center,
+                const AxesRegister &end) {
+    delegatee_->arc_move(feed, normal_axis, clockwise, start, center, end);
+  }
+  void spline_move(float feed, const AxesRegister &start,
+                   const AxesRegister &cp1, const AxesRegister &cp2,
+                   const AxesRegister &end) {
+    delegatee_->spline_move(feed, start, cp1, cp2, end);
+  }
+  bool raster_move(float feed, const AxesRegister &start,
+                   const AxesRegister &end, const uint8_t *pixels,
+                   int count) {
+    return delegatee_->raster_move(feed, start, end, pixels, count);
+  }
+  const char *unprocessed(char letter, float value, const char *rest) {
+    return delegatee_->unprocessed(letter, value, rest);
+  }
+
+private:
+  GCodeParser::EventReceiver *const delegatee_;
+};
+
+std::vector<std::string> GCodeFiles() {
+  std::vector<std::string> result;
+  DIR *dir = opendir(TESTDATA_DIR);
+  if (dir == NULL) return result;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const std::string name = entry->d_name;
+    const size_t suffix = name.rfind(".gcode");
+    if (suffix != std::string::npos && suffix + strlen(".gcode") == name.size())
+      result.push_back(name);
+  }
+  closedir(dir);
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+bool ReadConfig(const std::string &filename, MachineControlConfig *config) {
+  ConfigParser parser;
+  if (!parser.SetContentFromFile(filename.c_str())) return false;
+  config->threshold_angle = 10;  // Same default as machine-control.
+  if (!config->ConfigureFromFile(&parser)) return false;
+  config->require_homing = false;
+  return true;
+}
+
+bool ReadFile(const std::string &filename, std::string *content) {
+  FILE *f = fopen(filename.c_str(), "r");
+  if (f == NULL) return false;
+  char buffer[4096];
+  size_t len;
+  content->clear();
+  while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    content->append(buffer, len);
+  }
+  fclose(f);
+  return true;
+}
+
+// Segments the planner emits for "gcode".
+std::vector<std::string> PlannedSegments(const std::string &gcode,
+                                         const MachineControlConfig &config) {
+  HardwareMapping hardware;  // We never initialize, just sim mode.
+  Spindle spindle;
+  RecordingMotorOperations recorder;
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &recorder, &hardware, &spindle,
+                                  NULL);
+  EXPECT_TRUE(machine_control != NULL);
+  if (!machine_control) return recorder.lines;
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  machine_control->GetHomePos(&parser_cfg.machine_origin);
+  NoDwellEventReceiver receiver(machine_control->ParseEventReceiver());
+  GCodeParser parser(parser_cfg, &receiver, false);
+  FILE *msg_out = fopen("/dev/null", "w");
+  EXPECT_EQ(0, parser.ParseBuffer(gcode.data(), gcode.size(), msg_out));
+  fclose(msg_out);
+  EXPECT_EQ(0, parser.error_count());
+  delete machine_control;  // Flushes the planner.
+  return recorder.lines;
+}
+
+bool SameSegment(const std::string &a, const std::string &b) {
+  int steps_a[BEAGLEG_NUM_MOTORS], steps_b[BEAGLEG_NUM_MOTORS];
+  double v_a[2], v_b[2];
+  unsigned aux_a, aux_b;
+  const char *pa = a.c_str(), *pb = b.c_str();
+  int n;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (sscanf(pa, "%d%n", &steps_a[i], &n) != 1) return false;
+    pa += n;
+    if (sscanf(pb, "%d%n", &steps_b[i], &n) != 1) return false;
+    pb += n;
+    if (steps_a[i] != steps_b[i]) return false;
+  }
+  if (sscanf(pa, "%lf %lf %x", &v_a[0], &v_a[1], &aux_a) != 3
+      || sscanf(pb, "%lf %lf %x", &v_b[0], &v_b[1], &aux_b) != 3)
+    return false;
+  for (int i = 0; i < 2; ++i) {
+    if (fabs(v_a[i] - v_b[i]) > 0.1 + SPEED_TOLERANCE * fabs(v_a[i]))
+      return false;
+  }
+  return aux_a == aux_b;
+}
+
+void CheckCorpus(const std::string &config_name) {
+  MachineControlConfig config;
+  ASSERT_TRUE(ReadConfig(TESTDATA_DIR + config_name + ".config", &config));
+  const std::vector<std::string> files = GCodeFiles();
+  ASSERT_FALSE(files.empty()) << "Run from the src/ directory.";
+  for (const std::string &file : files) {
+    SCOPED_TRACE(file);
+    std::string gcode;
+    ASSERT_TRUE(ReadFile(TESTDATA_DIR + file, &gcode));
+    const std::vector<std::string> segments = PlannedSegments(gcode, config);
+
+    BeagleGPrintStats stats;
+    const int fd = open((TESTDATA_DIR + file).c_str(), O_RDONLY);
+    FILE *msg_out = fopen("/dev/null", "w");
+    const bool stats_ok = determine_print_stats(fd, config, msg_out, &stats);
+    fclose(msg_out);
+    ASSERT_TRUE(stats_ok);
+
+    const std::string golden_file = GOLDEN_DIR
+      + file.substr(0, file.length() - strlen(".gcode"))
+      + "." + config_name + ".segments";
+    if (update_golden) {
+      FILE *out = fopen(golden_file.c_str(), "w");
+      ASSERT_TRUE(out != NULL) << golden_file;
+      fprintf(out, "# Planner output for %s with %s.config.\n"
+              "# Regenerate with 'make update-golden'.\n"
+              "time-budget %.3f\n"
+              "# steps of motor 1..%d, v0, v1, aux-bits\n",
+              file.c_str(), config_name.c_str(), stats.total_time_seconds,
+              BEAGLEG_NUM_MOTORS);
+      for (const std::string &line : segments) {
+        fprintf(out, "%s\n", line.c_str());
+      }
+      fclose(out);
+      continue;
+    }
+
+    std::string golden;
+    ASSERT_TRUE(ReadFile(golden_file, &golden))
+      << "Missing " << golden_file << "; run 'make update-golden'.";
+    double budget = -1;
+    std::vector<std::string> expected;
+    for (const StringPiece line : SplitString(golden, "\n")) {
+      if (line.empty() || line[0] == '#') continue;
+      if (HasPrefix(line, "time-budget ")) {
+        budget = atof(line.ToString().c_str() + strlen("time-budget "));
+      } else {
+        expected.push_back(line.ToString());
+      }
+    }
+    EXPECT_NEAR(budget, stats.total_time_seconds, TIME_TOLERANCE * budget)
+      << "Estimated time changed from the budget.";
+
+    const size_t common = std::min(expected.size(), segments.size());
+    size_t i = 0;
+    while (i < common && SameSegment(expected[i], segments[i])) ++i;
+    if (i < common) {
+      ADD_FAILURE() << "Segment " << i << " differs:\n"
+                    << "  expected: " << expected[i] << "\n"
+                    << "  actual:   " << segments[i];
+    }
+    EXPECT_EQ(expected.size(), segments.size()) << "Number of segments.";
+  }
+}
+}  // namespace
+
+TEST(PlannerCorpus, SameStepSpeed) {
+  CheckCorpus("step-speed-same");
+}
+
+TEST(PlannerCorpus, DifferentStepSpeed) {
+  CheckCorpus("step-speed-different");
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/null");
+  ::testing::InitGoogleTest(&argc, argv);
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--update-golden") == 0) update_golden = true;
+  }
+  return RUN_ALL_TESTS();
+}
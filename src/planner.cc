@@ -19,10 +19,17 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <deque>
+#include <vector>
+
 #include "common/logging.h"
 #include "common/container.h"
+#include "common/trace.h"
 
 #include "planner.h"
+#include "bed-mesh.h"
+#include "machine-metrics.h"
 #include "hardware-mapping.h"
 #include "gcode-machine-control.h"
 #include "motor-operations.h"
@@ -44,10 +51,48 @@ struct AxisTarget {
   enum GCodeParserAxis defining_axis;  // index into defining axis.
   float speed;                         // (desired) speed in steps/s on defining axis.
   unsigned short aux_bits;             // Auxillary bits in this segment; set with M42
+  float pwm;                           // Motion PWM duty cycle.
+  bool pwm_by_speed;                   // Motion PWM scaled with speed.
+  const uint8_t *raster;               // Pixels of a raster line, or NULL.
+  int raster_count;
   float dx, dy, dz;                    // 3D delta_steps in real units
   float len;                           // 3D length
+  float accel;                         // acceleration in steps/s^2 on defining axis.
+  float ramp_accel;                    // average of it in speed changes.
+  float path_steps_per_mm;             // defining axis steps per mm of path.
+
+  // Lookahead planning state. All speeds in mm/s along the path, so that
+  // they compare between segments with different defining axes.
+  float max_exit_speed;   // Junction speed limit towards the next segment.
+  float exit_limit;       // Reverse pass: highest exit speed to still stop in time.
+  float exit_speed;       // Forward pass: planned speed at end of segment.
+};
+
+// The axes that have steps_per_mm or a motor configured, in order. The others
+// can never move, so the per-segment loops only look at these; their entries
+// in AxisTarget are not even kept up to date.
+class ActiveAxes {
+public:
+  ActiveAxes() : count_(0) {}
+  void Add(GCodeParserAxis axis) { axes_[count_++] = axis; }
+  const GCodeParserAxis *begin() const { return axes_; }
+  const GCodeParserAxis *end() const { return axes_ + count_; }
+
+private:
+  GCodeParserAxis axes_[GCODE_NUM_AXES];
+  int count_;
 };
 
+// Merging collinear moves: never merge more than this many moves into one.
+#define MAX_MERGED_MOVES 64
+
+// We can't keep more segments than this in the lookahead planning buffer.
+// The effective depth is configured in MachineControlConfig::lookahead_segments
+#define PLANNING_BUFFER_CAPACITY 1024
+
+// Bed mesh compensation never splits moves finer than this many mm in Z.
+#define MIN_BED_MESH_TOLERANCE 0.001f
+
 class Planner::Impl {
 public:
   Impl(const MachineControlConfig *config,
@@ -57,22 +102,42 @@ public:
 
   void move_machine_steps(const struct AxisTarget *last_pos,
                           struct AxisTarget *target_pos,
-                          const struct AxisTarget *upcoming);
+                          float next_speed);
 
   void assign_steps_to_motors(struct LinearSegmentSteps *command,
                               enum GCodeParserAxis axis,
                               int steps);
 
+  void enqueue_speed_change(const LinearSegmentSteps &command);
+  void enqueue_raster(const AxisTarget *target,
+                      const LinearSegmentSteps *parts[3]);
+
+  void plan_lookahead(int first_changed);
+  void plan_forward(int start);
+  void issue_motor_move();
   void issue_motor_move_if_possible();
-  void machine_move(const AxesRegister &axis, float feedrate);
+  // Move to the target, with bed mesh compensation applied if enabled.
+  void machine_move(const AxesRegister &axis, float feedrate, bool on_curve,
+                    HardwareMapping::AuxBitmap aux_bits);
+  // Plan a single segment to the machine position "axis".
+  void plan_segment(const AxesRegister &axis, float feedrate, bool on_curve,
+                    HardwareMapping::AuxBitmap aux_bits);
+
+  // Collinear move merging stage in front of machine_move(). The last move
+  // is held back until we know if it can be merged with the next one.
+  void merge_or_move(const AxesRegister &axis, float feedrate);
+  bool can_merge(const AxesRegister &axis, float feedrate,
+                 HardwareMapping::AuxBitmap aux_bits) const;
+  void flush_pending_move();
+  void curve_move(const AxesRegister &axis, float feedrate);
+  void raster_move(const AxesRegister &axis, float feedrate,
+                   const uint8_t *pixels, int count);
   void bring_path_to_halt();
 
+  // Acceleration of the defining axis for a move with the given steps, scaled
+  // down so that none of the participating axes exceeds its own limit.
   float acceleration_for_move(const int *axis_steps,
-                              enum GCodeParserAxis defining_axis) {
-    return max_axis_accel_[defining_axis];
-    // TODO: we need to scale the acceleration if one of the other axes could't
-    // deal with it. Look at axis steps for that.
-  }
+                              enum GCodeParserAxis defining_axis);
 
   // Avoid division by zero if there is no config defined for axis.
   float axis_delta_to_mm(const AxisTarget *pos, enum GCodeParserAxis axis) {
@@ -85,7 +150,16 @@ public:
 
   void GetCurrentPosition(AxesRegister *pos);
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
+  int DriveToSwitch(GCodeParserAxis axis, float distance, float retract,
+                    float fast_speed, float slow_speed, bool *triggered);
+  // Wait for the probing moves to finish; return the steps of "axis" they
+  // did not do and set "*triggered" if the switch was seen.
+  int wait_probe_steps_skipped(GCodeParserAxis axis, bool *triggered);
   void SetExternalPosition(GCodeParserAxis axis, float pos);
+  void SetBedMesh(const BedMesh *mesh);
+  void UpdateLimits();
+  void SetMotionPWM(float duty, bool scale_with_speed);
+  bool s_curve_acceleration() const { return cfg_->s_curve_acceleration; }
 
   // Given the desired target speed of the defining axis and the steps to be
   // performed on all axes, determine if we need to scale down as to not exceed
@@ -101,22 +175,54 @@ private:
   MotorOperations *const motor_ops_;
 
   // Next buffered positions. Written by incoming gcode, read by outgoing
-  // motor movements.
-  RingDeque<AxisTarget, 4> planning_buffer_;
+  // motor movements. Element [0] is the position last sent to the motors,
+  // all following elements are still subject to speed planning.
+  RingDeque<AxisTarget, PLANNING_BUFFER_CAPACITY> planning_buffer_;
+  int lookahead_segments_;        // Planning depth before we emit motor moves.
 
   // Pre-calculated per axis limits in steps, steps/s, steps/s^2
   // All arrays are indexed by axis.
   AxesRegister max_axis_speed_;   // max travel speed hz
   AxesRegister max_axis_accel_;   // acceleration hz/s
   float highest_accel_;           // hightest accel of all axes.
+  float threshold_cos_;           // Cosine of the configured threshold_angle
+  ActiveAxes active_axes_;
 
   HardwareMapping::AuxBitmap last_aux_bits_;  // last enqueued aux bits.
+  float motion_pwm_;              // For upcoming moves.
+  bool motion_pwm_by_speed_;
+  float last_pwm_;                // Last enqueued motion PWM.
+
+  // Pixels of the raster lines in the planning buffer, oldest first.
+  std::deque<std::vector<uint8_t> > raster_lines_;
+  const uint8_t *next_raster_;    // For the segment planned next.
+  int next_raster_count_;
+
+  // Merging state; only used with merge_deviation > 0.
+  bool has_pending_;
+  AxesRegister merge_start_;                  // Where the merged move starts.
+  std::vector<AxesRegister> merged_points_;   // Points merged on the way.
+  AxesRegister pending_pos_;                  // Current end of merged move.
+  float pending_feedrate_;
+  HardwareMapping::AuxBitmap pending_aux_bits_;
+
+  // Bed mesh compensation; NULL if disabled.
+  const BedMesh *bed_mesh_;
+  std::vector<float> mesh_split_;             // Reused for each move.
 
   bool path_halted_;
   bool position_known_;
 };
 
-static inline int round2int(float x) { return (int) roundf(x); }
+// Same as (int) roundf(x), but without the library call that roundf() is
+// on ARM: truncating and the remaining fraction are both exact.
+static inline int round2int(float x) {
+  int result = (int) x;
+  const float fraction = x - result;
+  if (fraction >= 0.5f) ++result;
+  else if (fraction <= -0.5f) --result;
+  return result;
+}
 
 // Speed relative to defining axis
 static float get_speed_factor_for_axis(const struct AxisTarget *t,
@@ -139,6 +245,17 @@ static float get_peak_speed(float s, float v0, float v2, float a) {
   return sqrtf(v2*v2 + v0*v0 + 2 * a * s) / sqrtf(2);
 }
 
+// Highest speed we can reach after "s" steps starting at "v0" with
+// acceleration "a".
+static float get_reachable_speed(float v0, float a, float s) {
+  return sqrtf(v0*v0 + 2 * a * s);
+}
+
+// Speed of "t" (steps/s on its defining axis) in mm/s along the path.
+static float path_speed(const struct AxisTarget *t) {
+  return t->speed > 0 ? t->speed / t->path_steps_per_mm : 0;
+}
+
 static float euclid_distance(float x, float y, float z) {
   return sqrtf(x*x + y*y + z*z);
 }
@@ -160,6 +277,28 @@ static float steps_for_speed_change(float a, float v0, float *v1, int max_steps)
   return max_steps;
 }
 
+// S-curve speed profile. The speed follows the 'smootherstep' polynomial
+//   v(u) = v0 + (v1 - v0) * (10u^3 - 15u^4 + 6u^5)  with u = t/T in [0..1]
+// so acceleration and jerk are zero at both ends of the speed change. The
+// path covered is the same as with constant acceleration in the same time T,
+// so the planner can keep working with the simpler trapezoid math.
+// Peak acceleration is 15/8 of the average, so we plan speed changes with
+// 8/15 of the acceleration limit; they take 15/8 the time of a trapezoid.
+#define S_CURVE_AVERAGE_ACCEL (8.0f / 15.0f)
+#define S_CURVE_MAX_SUBSEGMENTS 8
+#define S_CURVE_MIN_SUBSEGMENT_STEPS 8
+
+static float s_curve_speed_fraction(float u) {
+  return u*u*u * (10 + u * (-15 + u * 6));
+}
+
+// Fraction of the total distance covered at time fraction "u".
+static float s_curve_distance_fraction(float u, float v0, float v1) {
+  const float dv = v1 - v0;
+  const float s = v0 * u + dv * u*u*u*u * (2.5f + u * (-3 + u));
+  return s / ((v0 + v1) / 2);
+}
+
 // Returns true, if all results in zero movement
 static bool subtract_steps(struct LinearSegmentSteps *value,
                            const struct LinearSegmentSteps &subtract) {
@@ -178,27 +317,37 @@ static bool within_acceptable_range(float new_val, float old_val, float fraction
   return true;
 }
 
+// Cosine of the threshold angle in degrees; angles are compared by their
+// cosine, so that we don't need acosf() for every junction. A negative
+// threshold never matches.
+static float threshold_cosine(float threshold_angle) {
+  if (threshold_angle < 0) return 2.0f;
+  return cosf(threshold_angle * M_PI / 180.0);
+}
+
 // Determine the fraction of the speed that "from" should decelerate
 // to at the end of its travel.
 // The way trapezoidal moves work, be still have to decelerate to zero in
 // most times, which is inconvenient. TODO(hzeller): speed matching is not
 // cutting it :)
+// Returns the speed in mm/s along the path.
 static float determine_joining_speed(const struct AxisTarget *from,
                                      const struct AxisTarget *to,
-                                     const float threshold) {
+                                     const ActiveAxes &axes,
+                                     const float threshold_cos) {
   // the dot product of the vectors
   const float dot = from->dx*to->dx + from->dy*to->dy + from->dz*to->dz;
   const float mag = from->len * to->len;
   if (dot == 0) return 0.0f;        // orthogonal 90 degree, full stop
-  if (dot == mag) return to->speed; // codirectional 0 degree, keep accelerating
+  if (dot == mag) return path_speed(to);  // codirectional 0 degree, keep accelerating
 
-  // the angle between the vectors
-  const float rad2deg = 180.0 / M_PI;
-  const float angle = fabsf(acosf(dot / mag) * rad2deg);
+  // the cosine of the angle between the vectors
+  const float kCos45Degrees = M_SQRT1_2;
+  const float cos_angle = dot / mag;
 
-  if (angle <= threshold)
-    return to->speed;               // in tolerance, keep accelerating
-  if (angle >= 45.0f)
+  if (cos_angle >= threshold_cos)
+    return path_speed(to);          // in tolerance, keep accelerating
+  if (cos_angle <= kCos45Degrees)
     return 0.0f;                    // angle to large, come to full stop
 
   // The angle between the from and to segments is < 45 degrees but greater
@@ -209,7 +358,7 @@ static float determine_joining_speed(const struct AxisTarget *from,
   bool is_first = true;
   float from_defining_speed = from->speed;
   const int from_defining_steps = from->delta_steps[from->defining_axis];
-  for (const GCodeParserAxis axis : AllAxes()) {
+  for (const GCodeParserAxis axis : axes) {
     const int from_delta = from->delta_steps[axis];
     const int to_delta = to->delta_steps[axis];
 
@@ -232,7 +381,63 @@ static float determine_joining_speed(const struct AxisTarget *from,
     }
   }
 
-  return from_defining_speed;
+  return from_defining_speed / from->path_steps_per_mm;
+}
+
+// Junction deviation cornering: we model the corner as if we'd travel
+// on a circle touching both segments, and whose closest distance to the
+// actual corner is "deviation" mm. The speed through the junction is then
+// the one that keeps centripetal acceleration on this circle within the
+// acceleration limits of the segments. Unlike a fixed threshold angle, speed
+// is reduced smoothly the sharper the corner gets.
+//
+// Returns the speed in mm/s along the path at the end of the travel of "from".
+static float determine_junction_deviation_speed(const struct AxisTarget *from,
+                                                const struct AxisTarget *to,
+                                                const ActiveAxes &axes,
+                                                const float deviation) {
+  // Only works in euclidian space. Segments with no XYZ movement (e.g. only
+  // extruder or rotational axes) need to fall back to the old logic.
+  if (from->len <= 0 || to->len <= 0)
+    return determine_joining_speed(from, to, axes, 1.0f);
+
+  // Cosine of the angle between the two directions vectors, with "from"
+  // reversed: straight on is -1, turning around is +1
+  const float cos_theta = -(from->dx*to->dx + from->dy*to->dy + from->dz*to->dz)
+    / (from->len * to->len);
+  if (cos_theta < -0.9999f)
+    return path_speed(to);  // Practically straight. No reason to slow down.
+  if (cos_theta > 0.9999f)
+    return 0.0f;       // Turning around.
+
+  const float sin_theta_half = sqrtf(0.5f * (1.0f - cos_theta));
+  const float radius = deviation * sin_theta_half / (1.0f - sin_theta_half);
+
+  // The acceleration in mm/s^2 along the path.
+  const float path_accel = std::min(from->accel / from->path_steps_per_mm,
+                                    to->accel / to->path_steps_per_mm);
+  return sqrtf(path_accel * radius);
+}
+
+// Speed in mm/s we can go along a smooth curve through "from" and "to", so
+// that the centripetal acceleration stays within the acceleration limits of
+// the segments. The radius is the one of the circle through the three points
+// defining the two chords. Returns a negative value if the segments are
+// (practically) on a straight line.
+static float determine_curve_speed(const struct AxisTarget *from,
+                                   const struct AxisTarget *to) {
+  const float cx = from->dy*to->dz - from->dz*to->dy;
+  const float cy = from->dz*to->dx - from->dx*to->dz;
+  const float cz = from->dx*to->dy - from->dy*to->dx;
+  const float cross = euclid_distance(cx, cy, cz);
+  if (cross <= 1e-6f * from->len * to->len)
+    return -1;
+  const float chord = euclid_distance(from->dx + to->dx, from->dy + to->dy,
+                                      from->dz + to->dz);
+  const float radius = from->len * to->len * chord / (2 * cross);
+  const float path_accel = std::min(from->accel / from->path_steps_per_mm,
+                                    to->accel / to->path_steps_per_mm);
+  return sqrtf(path_accel * radius);
 }
 
 Planner::Impl::Impl(const MachineControlConfig *config,
@@ -240,7 +445,21 @@ Planner::Impl::Impl(const MachineControlConfig *config,
                     MotorOperations *motor_backend)
   : cfg_(config), hardware_mapping_(hardware_mapping),
     motor_ops_(motor_backend),
-    highest_accel_(-1), path_halted_(true), position_known_(true) {
+    lookahead_segments_(config->lookahead_segments),
+    highest_accel_(-1),
+    threshold_cos_(1),
+    last_aux_bits_(0), motion_pwm_(0), motion_pwm_by_speed_(false),
+    last_pwm_(0), next_raster_(NULL), next_raster_count_(0),
+    has_pending_(false),
+    pending_feedrate_(0), pending_aux_bits_(0),
+    bed_mesh_(NULL), path_halted_(true), position_known_(true) {
+  // We need at least one segment to look ahead to, and have to leave room
+  // for the current position and the newly incoming segment in the buffer.
+  if (lookahead_segments_ < 1)
+    lookahead_segments_ = 1;
+  if (lookahead_segments_ > PLANNING_BUFFER_CAPACITY - 3)
+    lookahead_segments_ = PLANNING_BUFFER_CAPACITY - 3;
+
   // Initial machine position. We assume the homed position here, which is
   // wherever the endswitch is for each axis.
   struct AxisTarget *init_axis = planning_buffer_.append();
@@ -257,17 +476,26 @@ Planner::Impl::Impl(const MachineControlConfig *config,
     }
   }
   position_known_ = true;
+  GetCurrentPosition(&merge_start_);
 
-  float lowest_accel = cfg_->max_feedrate[AXIS_X] * cfg_->steps_per_mm[AXIS_X];
+  for (const GCodeParserAxis i : AllAxes()) {
+    if (cfg_->steps_per_mm[i] != 0 || hardware_mapping_->HasMotorFor(i))
+      active_axes_.Add(i);
+  }
+  UpdateLimits();
+}
+
+// Pre-calculate the limits in steps from the configuration.
+void Planner::Impl::UpdateLimits() {
+  highest_accel_ = -1;
   for (const GCodeParserAxis i : AllAxes()) {
     max_axis_speed_[i] = cfg_->max_feedrate[i] * cfg_->steps_per_mm[i];
     const float accel = cfg_->acceleration[i] * cfg_->steps_per_mm[i];
     max_axis_accel_[i] = accel;
     if (accel > highest_accel_)
       highest_accel_ = accel;
-    if (accel < lowest_accel)
-      lowest_accel = accel;
   }
+  threshold_cos_ = threshold_cosine(cfg_->threshold_angle);
 }
 
 Planner::Impl::~Impl() {
@@ -281,6 +509,22 @@ void Planner::Impl::assign_steps_to_motors(struct LinearSegmentSteps *command,
   hardware_mapping_->AssignMotorSteps(axis, steps, command);
 }
 
+// Acceleration of the defining axis, limited by all participating axes.
+float Planner::Impl::acceleration_for_move(const int *axis_steps,
+                                           enum GCodeParserAxis defining_axis) {
+  // Each axis accelerates proportionally to its share of the defining
+  // axis steps. Axes without configured acceleration don't limit.
+  const float defining_steps = abs(axis_steps[defining_axis]);
+  float accel = max_axis_accel_[defining_axis];
+  for (const GCodeParserAxis i : active_axes_) {
+    if (i == defining_axis || axis_steps[i] == 0 || max_axis_accel_[i] <= 0)
+      continue;
+    const float axis_limit = max_axis_accel_[i] * defining_steps / abs(axis_steps[i]);
+    if (axis_limit < accel) accel = axis_limit;
+  }
+  return accel;
+}
+
 // Example with speed: given i the axis with the highest (relative) out of bounds
 // speed, what's the speed of the defining_axis so that every speed respects i's
 // bounds? The defining axis should be rescaled with this maximum offset.
@@ -291,7 +535,8 @@ float Planner::Impl::clamp_to_limits(enum GCodeParserAxis defining_axis,
   float ratio, max_offset = 1, offset;
   const FloatAxisConfig &max_axis_speed = cfg_->max_feedrate;
   const FloatAxisConfig &steps_per_mm = cfg_->steps_per_mm;
-  for (const GCodeParserAxis i : AllAxes()) {
+  for (const GCodeParserAxis i : active_axes_) {
+    if (axis_steps[i] == 0) continue;  // No speed, would not limit.
     ratio = fabs(((float) axis_steps[i] * steps_per_mm[defining_axis])
             / (axis_steps[defining_axis] * steps_per_mm[i]));
     offset = ratio > 0 ? max_axis_speed[i] / (target_speed * ratio) : 1;
@@ -312,8 +557,9 @@ float Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
 // Move the given number of machine steps for each axis.
 //
 // This will be up to three segments: accelerating from last_pos speed to
-// target speed, regular travel, and decelerating to the speed that the
-// next segment is never forced to decelerate, but stays at speed or accelerate.
+// target speed, regular travel, and decelerating to the speed "next_speed"
+// which has been determined by the lookahead planner so that the upcoming
+// segments are never forced to decelerate faster than they can.
 //
 // The segments are sent to the motor operations backend.
 //
@@ -321,17 +567,7 @@ float Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
 // to reflect what the last speed was at the end of the move.
 void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
                                        struct AxisTarget *target_pos,
-                                       const struct AxisTarget *upcoming) {
-  if (target_pos->delta_steps[target_pos->defining_axis] == 0) {
-    if (last_aux_bits_ != target_pos->aux_bits) {
-      // Special treatment: bits changed since last time, let's push them through.
-      struct LinearSegmentSteps bit_set_command = {};
-      bit_set_command.aux_bits = target_pos->aux_bits;
-      motor_ops_->Enqueue(bit_set_command);
-      last_aux_bits_ = target_pos->aux_bits;
-    }
-    return;
-  }
+                                       float next_speed) {
   struct LinearSegmentSteps accel_command = {};
   struct LinearSegmentSteps move_command = {};
   struct LinearSegmentSteps decel_command = {};
@@ -342,27 +578,28 @@ void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
   move_command.aux_bits = target_pos->aux_bits;
   const enum GCodeParserAxis defining_axis = target_pos->defining_axis;
 
+  // Relative to the requested speed, before we know what we reach.
+  move_command.pwm = target_pos->pwm;
+  if (target_pos->pwm_by_speed) move_command.pwm_full_speed = target_pos->speed;
+
   // Common settings.
   memcpy(&accel_command, &move_command, sizeof(accel_command));
   memcpy(&decel_command, &move_command, sizeof(decel_command));
 
-  // Always start from the last steps/sec speed to avoid motion glitches.
+  // Always start from the last speed to avoid motion glitches; in steps/sec
+  // of our defining axis, which might not be the one of the last move.
   // The planner will use that speed to determine what the peak speed for
   // this move is and if we need to accel to reach the desired target speed.
-  const float last_speed = last_pos->speed;
+  const float last_speed
+    = path_speed(last_pos) * target_pos->path_steps_per_mm;
 
-  // We need to arrive at a speed that the upcoming move does not have
-  // to decelerate further (after all, it has a fixed feed-rate it should not
-  // go over).
-  float next_speed = determine_joining_speed(target_pos, upcoming,
-                                             cfg_->threshold_angle);
   // Clamp the next speed to insure that this segment does not go over.
   if (next_speed > target_pos->speed)
     next_speed = target_pos->speed;
 
   const int *axis_steps = target_pos->delta_steps;  // shortcut.
   const int abs_defining_axis_steps = abs(axis_steps[defining_axis]);
-  const float a = acceleration_for_move(axis_steps, defining_axis);
+  const float a = target_pos->ramp_accel;
   const float peak_speed = get_peak_speed(abs_defining_axis_steps,
                                           last_speed, next_speed, a);
   assert(peak_speed > 0);
@@ -374,12 +611,6 @@ void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
     target_pos->speed = peak_speed;  // Don't manage to accelerate to desired v
   }
 
-  // Make sure the target feedrate for the move is clamped to what all the
-  // moving axes can reach.
-  float target_feedrate = target_pos->speed / cfg_->steps_per_mm[defining_axis];
-  target_feedrate = clamp_to_limits(defining_axis, target_feedrate, axis_steps);
-  target_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
-
   const float accel_fraction =
     (last_speed < target_pos->speed)
     ? steps_for_speed_change(a, last_speed, &target_pos->speed,
@@ -422,20 +653,22 @@ void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
   const char do_accel = 1;
 #endif
 
+  // Speed changes that would round to zero steps are not done at all.
   bool has_accel = false;
   bool has_move = false;
   bool has_decel = false;
 
-  if (do_accel && accel_fraction * abs_defining_axis_steps > 0) {
+  if (do_accel && round2int(accel_fraction * abs_defining_axis_steps) > 0) {
     has_accel = true;
     accel_command.v0 = last_speed;           // Last speed of defining axis
     accel_command.v1 = target_pos->speed;    // New speed of defining axis
 
     // Now map axis steps to actual motor driver
-    for (const GCodeParserAxis a : AllAxes()) {
-      const int accel_steps = round2int(accel_fraction * axis_steps[a]);
-      assign_steps_to_motors(&accel_command, a, accel_steps);
+    int accel_steps[GCODE_NUM_AXES];
+    for (const GCodeParserAxis a : active_axes_) {
+      accel_steps[a] = round2int(accel_fraction * axis_steps[a]);
     }
+    hardware_mapping_->AssignAllMotorSteps(accel_steps, &accel_command);
   } else {
     if (last_speed) target_pos->speed = last_speed; // No accel so use the last speed
   }
@@ -443,48 +676,315 @@ void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
   move_command.v0 = target_pos->speed;
   move_command.v1 = target_pos->speed;
 
-  if (do_accel && decel_fraction * abs_defining_axis_steps > 0) {
+  if (do_accel && round2int(decel_fraction * abs_defining_axis_steps) > 0) {
     has_decel = true;
     decel_command.v0 = target_pos->speed;
     decel_command.v1 = next_speed;
     target_pos->speed = next_speed;
 
     // Now map axis steps to actual motor driver
-    for (const GCodeParserAxis a : AllAxes()) {
-      const int decel_steps = round2int(decel_fraction * axis_steps[a]);
-      assign_steps_to_motors(&decel_command, a, decel_steps);
+    int decel_steps[GCODE_NUM_AXES];
+    for (const GCodeParserAxis a : active_axes_) {
+      decel_steps[a] = round2int(decel_fraction * axis_steps[a]);
     }
+    hardware_mapping_->AssignAllMotorSteps(decel_steps, &decel_command);
   }
 
   // Move is everything that hasn't been covered in speed changes.
   // So we start with all steps and subtract steps done in acceleration and
   // deceleration.
-  for (const GCodeParserAxis a : AllAxes()) {
-    assign_steps_to_motors(&move_command, a, axis_steps[a]);
-  }
+  hardware_mapping_->AssignAllMotorSteps(axis_steps, &move_command);
   subtract_steps(&move_command, accel_command);
   has_move = subtract_steps(&move_command, decel_command);
 
   if (cfg_->synchronous) motor_ops_->WaitQueueEmpty();
 
-  if (has_accel) motor_ops_->Enqueue(accel_command);
-  if (has_move) motor_ops_->Enqueue(move_command);
-  if (has_decel) motor_ops_->Enqueue(decel_command);
+  if (target_pos->raster_count > 0) {
+    const LinearSegmentSteps *parts[3] = { has_accel ? &accel_command : NULL,
+                                           has_move ? &move_command : NULL,
+                                           has_decel ? &decel_command : NULL };
+    enqueue_raster(target_pos, parts);
+    raster_lines_.pop_front();
+  } else if (cfg_->s_curve_acceleration) {
+    if (has_accel) enqueue_speed_change(accel_command);
+    if (has_move) motor_ops_->Enqueue(move_command);
+    if (has_decel) enqueue_speed_change(decel_command);
+  } else {
+    // Parts we don't have don't have steps.
+    motor_ops_->EnqueueTrapezoid(accel_command, move_command, decel_command);
+  }
 
   last_aux_bits_ = target_pos->aux_bits;
+  last_pwm_ = target_pos->pwm;
+}
+
+// Send an acceleration or deceleration to the motors. With S-curve
+// acceleration, the speed change is broken into a sequence of shorter
+// constant acceleration segments closely following the S-curve; these are
+// executed exactly by the motion queue, so no jerk calculation is needed
+// in the (time critical) firmware.
+void Planner::Impl::enqueue_speed_change(const LinearSegmentSteps &command) {
+  int defining_steps = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    defining_steps = std::max(defining_steps, abs(command.steps[i]));
+  }
+  const int subsegments = std::min(S_CURVE_MAX_SUBSEGMENTS,
+                                   defining_steps / S_CURVE_MIN_SUBSEGMENT_STEPS);
+  if (!cfg_->s_curve_acceleration || subsegments < 2) {
+    motor_ops_->Enqueue(command);
+    return;
+  }
+
+  // We always hold back one part, so that the last one we send is
+  // guaranteed to end with the exact final speed.
+  LinearSegmentSteps pending = command;
+  bool have_pending = false;
+  int steps_done[BEAGLEG_NUM_MOTORS] = {0};
+  for (int k = 1; k <= subsegments; ++k) {
+    const float u = 1.0f * k / subsegments;
+    const float fraction = (k == subsegments)
+      ? 1.0f
+      : s_curve_distance_fraction(u, command.v0, command.v1);
+    LinearSegmentSteps part = command;
+    bool has_steps = false;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      const int target = round2int(fraction * command.steps[i]);
+      part.steps[i] = target - steps_done[i];
+      has_steps |= (part.steps[i] != 0);
+    }
+    // Too short to have any step: merge with the following part.
+    if (!has_steps) continue;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      steps_done[i] += part.steps[i];
+    }
+    part.v0 = have_pending ? pending.v1 : command.v0;
+    part.v1 = command.v0 + (command.v1 - command.v0) * s_curve_speed_fraction(u);
+    if (have_pending) motor_ops_->Enqueue(pending);
+    pending = part;
+    have_pending = true;
+  }
+  pending.v1 = command.v1;
+  motor_ops_->Enqueue(pending);
+}
+
+// Plan the speeds of all segments in the planning buffer.
+//
+// Reverse pass: starting with the assumption that we have to come to a full
+// stop at the end of the last segment, determine for each segment the highest
+// speed it may have at its end so that all following segments can still slow
+// down in time. Adding a segment only ever relaxes these limits, so we can
+// stop as soon as a limit doesn't change anymore; everything before that
+// is already planned.
+//
+// Forward pass: starting at the current speed, determine how fast we actually
+// get at the end of each segment given our acceleration.
+//
+// "first_changed" is the first index in the planning buffer whose junction
+// has been modified.
+void Planner::Impl::plan_lookahead(int first_changed) {
+  const int last = planning_buffer_.size() - 1;
+  float next_entry_limit = 0.0f;  // We always need to be able to stop.
+  int forward_start = last;
+  for (int i = last; i > 0; --i) {
+    AxisTarget *const target = planning_buffer_[i];
+    const float limit = std::min(target->max_exit_speed, next_entry_limit);
+    if (i < first_changed && limit == target->exit_limit)
+      break;  // Nothing changes further back.
+    target->exit_limit = limit;
+    forward_start = i;
+    // The speed change is calculated in steps of the defining axis.
+    const float steps_per_mm = target->path_steps_per_mm;
+    next_entry_limit = std::min(target->speed,
+                                get_reachable_speed(
+                                  limit * steps_per_mm, target->ramp_accel,
+                                  abs(target->delta_steps[target->defining_axis])))
+      / steps_per_mm;
+  }
+  plan_forward(forward_start);
+}
+
+void Planner::Impl::plan_forward(int start) {
+  const int size = planning_buffer_.size();
+  float entry_speed = (start <= 1)
+    ? path_speed(planning_buffer_[0])      // realized speed of last move.
+    : planning_buffer_[start - 1]->exit_speed;
+  for (int i = std::max(start, 1); i < size; ++i) {
+    AxisTarget *const target = planning_buffer_[i];
+    const float steps_per_mm = target->path_steps_per_mm;
+    const float reachable = get_reachable_speed(
+      entry_speed * steps_per_mm, target->ramp_accel,
+      abs(target->delta_steps[target->defining_axis])) / steps_per_mm;
+    target->exit_speed = std::min(target->exit_limit, reachable);
+    entry_speed = target->exit_speed;
+  }
+}
+
+// Send the oldest planned segment to the motors.
+void Planner::Impl::issue_motor_move() {
+  AxisTarget *const target = planning_buffer_[1];
+  const float planned_exit_speed
+    = target->exit_speed * target->path_steps_per_mm;
+  move_machine_steps(planning_buffer_[0],  // Current established position.
+                     target,               // Position we want to move to.
+                     planned_exit_speed);
+  planning_buffer_.pop_front();
+
+  // Rounding in the speed calculation might have us end up a tiny bit below
+  // than what we planned. Let the remaining plan start from reality.
+  if (planning_buffer_[0]->speed != planned_exit_speed)
+    plan_forward(1);
+}
+
+// Send the parts of a raster line with steps. The pixels are divided between
+// them by the steps they do; each part gets at least one.
+void Planner::Impl::enqueue_raster(const AxisTarget *target,
+                                   const LinearSegmentSteps *parts[3]) {
+  const int total_steps = abs(target->delta_steps[target->defining_axis]);
+  const int count = target->raster_count;
+  int steps_done = 0;
+  for (int p = 0; p < 3; ++p) {
+    if (parts[p] == NULL) continue;
+    int part_steps = 0;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      part_steps = std::max(part_steps, abs(parts[p]->steps[i]));
+    }
+    int begin = round2int(1.0f * count * steps_done / total_steps);
+    steps_done += part_steps;
+    int end = round2int(1.0f * count * steps_done / total_steps);
+    if (end > count) end = count;
+    if (begin >= end) {
+      if (end < count) end = begin + 1;
+      else begin = end - 1;
+    }
+    motor_ops_->EnqueueRaster(*parts[p], target->raster + begin, end - begin);
+  }
 }
 
 // If we have enough data in the queue, issue motor move.
 void Planner::Impl::issue_motor_move_if_possible() {
-  if (planning_buffer_.size() >= 3) {
-    move_machine_steps(planning_buffer_[0],  // Current established position.
-                       planning_buffer_[1],  // Position we want to move to.
-                       planning_buffer_[2]); // Next upcoming.
-    planning_buffer_.pop_front();
+  // Element zero is the current position, all others are waiting to be
+  // sent to the motors.
+  while ((int)planning_buffer_.size() - 1 > lookahead_segments_) {
+    issue_motor_move();
   }
 }
 
-void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
+// Distance of "p" to the line segment from "a" to "b", in all axes. Returns a
+// negative value if "p" is not between "a" and "b".
+static float distance_to_line(const AxesRegister &p, const AxesRegister &a,
+                              const AxesRegister &b) {
+  float len2 = 0, dot = 0;
+  for (const GCodeParserAxis i : AllAxes()) {
+    len2 += (b[i] - a[i]) * (b[i] - a[i]);
+    dot += (p[i] - a[i]) * (b[i] - a[i]);
+  }
+  if (len2 <= 0 || dot <= 0 || dot >= len2) return -1;
+  const float t = dot / len2;
+  float dist2 = 0;
+  for (const GCodeParserAxis i : AllAxes()) {
+    const float d = p[i] - (a[i] + t * (b[i] - a[i]));
+    dist2 += d * d;
+  }
+  return sqrtf(dist2);
+}
+
+bool Planner::Impl::can_merge(const AxesRegister &axis, float feedrate,
+                              HardwareMapping::AuxBitmap aux_bits) const {
+  if (aux_bits != pending_aux_bits_) return false;
+  if (merged_points_.size() >= MAX_MERGED_MOVES) return false;
+  if (fabsf(feedrate - pending_feedrate_)
+      > cfg_->merge_feed_tolerance * pending_feedrate_)
+    return false;
+  const float deviation = distance_to_line(pending_pos_, merge_start_, axis);
+  if (deviation < 0 || deviation > cfg_->merge_deviation) return false;
+  for (const AxesRegister &p : merged_points_) {
+    const float d = distance_to_line(p, merge_start_, axis);
+    if (d < 0 || d > cfg_->merge_deviation) return false;
+  }
+  return true;
+}
+
+void Planner::Impl::merge_or_move(const AxesRegister &axis, float feedrate) {
+  const HardwareMapping::AuxBitmap aux_bits = hardware_mapping_->GetAuxBits();
+  if (cfg_->merge_deviation <= 0) {
+    machine_move(axis, feedrate, false, aux_bits);
+    return;
+  }
+  if (has_pending_ && can_merge(axis, feedrate, aux_bits)) {
+    merged_points_.push_back(pending_pos_);
+    pending_feedrate_ = std::min(pending_feedrate_, feedrate);
+  } else {
+    flush_pending_move();
+    pending_feedrate_ = feedrate;
+    pending_aux_bits_ = aux_bits;
+    has_pending_ = true;
+  }
+  pending_pos_ = axis;
+}
+
+void Planner::Impl::flush_pending_move() {
+  if (!has_pending_) return;
+  has_pending_ = false;
+  machine_move(pending_pos_, pending_feedrate_, false, pending_aux_bits_);
+  merge_start_ = pending_pos_;
+  merged_points_.clear();
+}
+
+void Planner::Impl::curve_move(const AxesRegister &axis, float feedrate) {
+  flush_pending_move();
+  machine_move(axis, feedrate, true, hardware_mapping_->GetAuxBits());
+  merge_start_ = axis;
+}
+
+void Planner::Impl::raster_move(const AxesRegister &axis, float feedrate,
+                                const uint8_t *pixels, int count) {
+  flush_pending_move();
+  AxesRegister target = axis;
+  if (bed_mesh_ != NULL) {
+    target[AXIS_Z] += bed_mesh_->ZOffset(axis[AXIS_X], axis[AXIS_Y]);
+  }
+  next_raster_ = pixels;
+  next_raster_count_ = count;
+  plan_segment(target, feedrate, false, hardware_mapping_->GetAuxBits());
+  next_raster_count_ = 0;
+  merge_start_ = axis;
+}
+
+void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate,
+                                 bool on_curve,
+                                 HardwareMapping::AuxBitmap aux_bits) {
+  if (bed_mesh_ == NULL) {
+    plan_segment(axis, feedrate, on_curve, aux_bits);
+    return;
+  }
+  assert(position_known_);   // call SetExternalPosition() after DirectDrive()
+
+  // Where we are, without the compensation that got us there.
+  AxesRegister start = axis;
+  const int *mpos = planning_buffer_.back()->position_steps;
+  for (const GCodeParserAxis a : active_axes_) {
+    if (cfg_->steps_per_mm[a] != 0) start[a] = mpos[a] / cfg_->steps_per_mm[a];
+  }
+  start[AXIS_Z] -= bed_mesh_->ZOffset(start[AXIS_X], start[AXIS_Y]);
+
+  // The pieces are all on the same line, so they are joined as a curve.
+  bed_mesh_->Subdivide(start[AXIS_X], start[AXIS_Y], axis[AXIS_X], axis[AXIS_Y],
+                       std::max(cfg_->bed_mesh_tolerance, MIN_BED_MESH_TOLERANCE),
+                       &mesh_split_);
+  AxesRegister piece;
+  for (size_t i = 0; i < mesh_split_.size(); ++i) {
+    const float t = mesh_split_[i];
+    for (const GCodeParserAxis a : AllAxes()) {
+      piece[a] = (t < 1) ? start[a] + t * (axis[a] - start[a]) : axis[a];
+    }
+    piece[AXIS_Z] += bed_mesh_->ZOffset(piece[AXIS_X], piece[AXIS_Y]);
+    plan_segment(piece, feedrate, on_curve || i > 0, aux_bits);
+  }
+}
+
+void Planner::Impl::plan_segment(const AxesRegister &axis, float feedrate,
+                                 bool on_curve,
+                                 HardwareMapping::AuxBitmap aux_bits) {
   assert(position_known_);   // call SetExternalPosition() after DirectDrive()
   // We always have a previous position.
   struct AxisTarget *previous = planning_buffer_.back();
@@ -495,7 +995,7 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   // Real world -> machine coordinates. Here, we are rounding to the next full
   // step, but we never accumulate the error, as we always use the absolute
   // position as reference.
-  for (const GCodeParserAxis a : AllAxes()) {
+  for (const GCodeParserAxis a : active_axes_) {
     new_pos->position_steps[a] = round2int(axis[a] * cfg_->steps_per_mm[a]);
     new_pos->delta_steps[a] = new_pos->position_steps[a] - previous->position_steps[a];
 
@@ -508,7 +1008,7 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
     }
   }
 
-  if (max_steps == 0) {
+  if (max_steps <= 0) {
     // Nothing to do, ignore this move.
     planning_buffer_.pop_back();
     return;
@@ -516,7 +1016,17 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
 
   assert(max_steps > 0);
 
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
+  new_pos->aux_bits = aux_bits;
+  new_pos->pwm = motion_pwm_;
+  new_pos->pwm_by_speed = motion_pwm_by_speed_;
+  new_pos->raster = NULL;
+  new_pos->raster_count = next_raster_count_;
+  if (next_raster_count_ > 0) {
+    const uint8_t *const pixels = next_raster_;
+    raster_lines_.push_back(std::vector<uint8_t>(pixels,
+                                                 pixels + next_raster_count_));
+    new_pos->raster = raster_lines_.back().data();
+  }
   new_pos->defining_axis = defining_axis;
 
   // Work out the real units values for the euclidian axes now to avoid
@@ -525,6 +1035,10 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   new_pos->dy = axis_delta_to_mm(new_pos, AXIS_Y);
   new_pos->dz = axis_delta_to_mm(new_pos, AXIS_Z);
   new_pos->len = euclid_distance(new_pos->dx, new_pos->dy, new_pos->dz);
+  // Without XYZ travel, the path is the one of the defining axis.
+  new_pos->path_steps_per_mm = (new_pos->len > 0)
+    ? max_steps / new_pos->len
+    : cfg_->steps_per_mm[defining_axis];
 
   // Work out the desired euclidian travel speed in steps/s on the defining axis.
   new_pos->speed = feedrate * cfg_->steps_per_mm[defining_axis];
@@ -532,26 +1046,81 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   if (new_pos->speed > max_axis_speed_[defining_axis])
     new_pos->speed = max_axis_speed_[defining_axis];
 
+  // Make sure the target feedrate for the move is clamped to what all the
+  // moving axes can reach.
+  float target_feedrate = new_pos->speed / cfg_->steps_per_mm[defining_axis];
+  target_feedrate = clamp_to_limits(defining_axis, target_feedrate,
+                                    new_pos->delta_steps);
+  new_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
+
+  new_pos->accel = acceleration_for_move(new_pos->delta_steps, defining_axis);
+  new_pos->ramp_accel = cfg_->s_curve_acceleration
+    ? S_CURVE_AVERAGE_ACCEL * new_pos->accel
+    : new_pos->accel;
+
+  // Unknown future: we have to be able to stop at the end of this segment.
+  new_pos->max_exit_speed = 0;
+
+  const int new_index = planning_buffer_.size() - 1;
+  int first_changed = new_index;
+  if (new_index > 1) {
+    // The previous segment is still being planned. Now that we know what
+    // comes next, we know how fast we can go through the junction (mm/s).
+    float junction_speed;
+    if (on_curve && previous->len > 0 && new_pos->len > 0) {
+      // Not a corner, but the same curve continuing: both segments travel
+      // with at most the centripetal speed limit, so there is no reason to
+      // slow down between them.
+      const float curve_speed = determine_curve_speed(previous, new_pos);
+      if (curve_speed > 0) {
+        new_pos->speed = std::min(new_pos->speed,
+                                  curve_speed * new_pos->path_steps_per_mm);
+        previous->speed = std::min(previous->speed,
+                                   curve_speed * previous->path_steps_per_mm);
+        junction_speed = curve_speed;
+      } else {
+        junction_speed = path_speed(previous);  // Straight.
+      }
+    } else {
+      junction_speed = (cfg_->junction_deviation > 0)
+        ? determine_junction_deviation_speed(previous, new_pos, active_axes_,
+                                             cfg_->junction_deviation)
+        : determine_joining_speed(previous, new_pos, active_axes_,
+                                  threshold_cos_);
+    }
+    junction_speed = std::min(junction_speed, path_speed(previous));
+    junction_speed = std::min(junction_speed, path_speed(new_pos));
+    previous->max_exit_speed = junction_speed;
+    first_changed = new_index - 1;
+  }
+  plan_lookahead(first_changed);
+
   issue_motor_move_if_possible();
   path_halted_ = false;
 }
 
 void Planner::Impl::bring_path_to_halt() {
+  flush_pending_move();
   if (path_halted_) return;
-  // Enqueue a new position that is the same position as the last
-  // one seen, but zero speed. That will allow the previous segment to
-  // slow down. Enqueue.
-  struct AxisTarget *previous = planning_buffer_.back();
-  struct AxisTarget *new_pos = planning_buffer_.append();
-  for (const GCodeParserAxis a : AllAxes()) {
-    new_pos->position_steps[a] = previous->position_steps[a];
-    new_pos->delta_steps[a] = 0;
+  Metrics_record_planner_halt();
+  // The last segment in the planning buffer is always planned to stop at
+  // its end, so we can just send everything we have to the motors.
+  while (planning_buffer_.size() > 1) {
+    issue_motor_move();
+  }
+  AxisTarget *const current = planning_buffer_[0];
+  current->speed = 0;
+
+  // Aux-bits might have changed without any movement. Send them along; the
+  // motion PWM is off while standing still.
+  const HardwareMapping::AuxBitmap aux_bits = hardware_mapping_->GetAuxBits();
+  if (last_aux_bits_ != aux_bits || last_pwm_ != 0) {
+    struct LinearSegmentSteps bit_set_command = {};
+    bit_set_command.aux_bits = aux_bits;
+    motor_ops_->Enqueue(bit_set_command);
+    last_aux_bits_ = aux_bits;
+    last_pwm_ = 0;
   }
-  new_pos->defining_axis = AXIS_X;
-  new_pos->speed = 0;
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
-  new_pos->dx = new_pos->dy = new_pos->dz = new_pos->len = 0.0;
-  issue_motor_move_if_possible();
   path_halted_ = true;
 }
 
@@ -592,6 +1161,71 @@ int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
   return segment_move_steps;
 }
 
+int Planner::Impl::wait_probe_steps_skipped(GCodeParserAxis axis,
+                                            bool *triggered) {
+  motor_ops_->WaitQueueEmpty();
+  // Steps are assigned the same to all motors of an axis; any of them tells.
+  struct LinearSegmentSteps probe = {};
+  assign_steps_to_motors(&probe, axis, 1);
+  int skipped[BEAGLEG_NUM_MOTORS];
+  *triggered = motor_ops_->GetProbeStepsSkipped(skipped);
+  int axis_skipped = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (probe.steps[i] != 0) axis_skipped = skipped[i] * probe.steps[i];
+  }
+  return axis_skipped;
+}
+
+int Planner::Impl::DriveToSwitch(GCodeParserAxis axis, float distance,
+                                 float retract, float fast_speed,
+                                 float slow_speed, bool *triggered) {
+  bring_path_to_halt();
+  position_known_ = false;
+
+  const float steps_per_mm = cfg_->steps_per_mm[axis];
+  const int dir = distance < 0 ? -1 : 1;
+  float fast = fast_speed * steps_per_mm;
+  if (fast > max_axis_speed_[axis]) fast = max_axis_speed_[axis];
+  float slow = slow_speed * steps_per_mm;
+  if (slow > fast) slow = fast;
+
+  // Approach: accelerate, then travel. Once the switch triggers, the rest of
+  // the approach is skipped by the hardware.
+  const int approach_steps = abs(round2int(distance * steps_per_mm));
+  int accel_steps = approach_steps;
+  if (max_axis_accel_[axis] > 0) {
+    accel_steps = round2int(fast * fast / (2 * max_axis_accel_[axis]));
+    if (accel_steps > approach_steps) accel_steps = approach_steps;
+  }
+  const int retract_steps = round2int(retract * steps_per_mm);
+
+  struct LinearSegmentSteps move = {};
+  move.aux_bits = hardware_mapping_->GetAuxBits();
+  move.stop_on_probe = true;
+  move.v0 = 0;
+  move.v1 = fast;
+  assign_steps_to_motors(&move, axis, dir * accel_steps);
+  motor_ops_->Enqueue(move);
+  move.v0 = fast;
+  assign_steps_to_motors(&move, axis, dir * (approach_steps - accel_steps));
+  motor_ops_->Enqueue(move);
+  int moved = dir * approach_steps - wait_probe_steps_skipped(axis, triggered);
+  if (!*triggered || retract_steps == 0)
+    return moved;  // Never reached the switch, or no touch wanted.
+
+  // Back off a bit and touch the switch again slowly. It is within the
+  // retract distance; allow for the same again as slack.
+  move.stop_on_probe = false;
+  move.v0 = move.v1 = slow;
+  assign_steps_to_motors(&move, axis, -dir * retract_steps);
+  motor_ops_->Enqueue(move);
+  move.stop_on_probe = true;
+  assign_steps_to_motors(&move, axis, dir * 2 * retract_steps);
+  motor_ops_->Enqueue(move);
+  moved += dir * retract_steps - wait_probe_steps_skipped(axis, triggered);
+  return moved;
+}
+
 void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
   assert(path_halted_);   // Precondition.
   position_known_ = true;
@@ -599,6 +1233,22 @@ void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
   const int motor_position = pos * cfg_->steps_per_mm[axis];
   planning_buffer_.back()->position_steps[axis] = motor_position;
   planning_buffer_[0]->position_steps[axis] = motor_position;
+  merge_start_[axis] = pos;
+}
+
+void Planner::Impl::SetBedMesh(const BedMesh *mesh) {
+  bring_path_to_halt();
+  bed_mesh_ = mesh;
+}
+
+void Planner::Impl::SetMotionPWM(float duty, bool scale_with_speed) {
+  if (duty < 0) duty = 0;
+  if (duty > 1) duty = 1;
+  if (duty == motion_pwm_ && scale_with_speed == motion_pwm_by_speed_)
+    return;
+  flush_pending_move();  // Don't merge moves with different power.
+  motion_pwm_ = duty;
+  motion_pwm_by_speed_ = scale_with_speed;
 }
 
 // -- public interface
@@ -612,7 +1262,19 @@ Planner::Planner(const MachineControlConfig *config,
 Planner::~Planner() { delete impl_; }
 
 void Planner::Enqueue(const AxesRegister &target_pos, float speed) {
-  impl_->machine_move(target_pos, speed);
+  TraceScope trace(TRACE_PLANNER_ENQUEUE);
+  impl_->merge_or_move(target_pos, speed);
+}
+
+void Planner::EnqueueCurve(const AxesRegister &target_pos, float speed) {
+  TraceScope trace(TRACE_PLANNER_ENQUEUE);
+  impl_->curve_move(target_pos, speed);
+}
+
+void Planner::EnqueueRaster(const AxesRegister &target_pos, float speed,
+                            const uint8_t *pixels, int count) {
+  TraceScope trace(TRACE_PLANNER_ENQUEUE);
+  impl_->raster_move(target_pos, speed, pixels, count);
 }
 
 void Planner::BringPathToHalt() {
@@ -628,6 +1290,31 @@ int Planner::DirectDrive(GCodeParserAxis axis, float distance,
   return impl_->DirectDrive(axis, distance, v0, v1);
 }
 
+int Planner::DriveToSwitch(GCodeParserAxis axis, float distance,
+                           float retract, float fast_speed, float slow_speed,
+                           bool *triggered) {
+  return impl_->DriveToSwitch(axis, distance, retract, fast_speed, slow_speed,
+                              triggered);
+}
+
 void Planner::SetExternalPosition(GCodeParserAxis axis, float pos) {
   impl_->SetExternalPosition(axis, pos);
 }
+
+void Planner::SetBedMesh(const BedMesh *mesh) {
+  impl_->SetBedMesh(mesh);
+}
+
+void Planner::UpdateLimits() {
+  impl_->bring_path_to_halt();
+  impl_->UpdateLimits();
+}
+
+void Planner::SetMotionPWM(float duty, bool scale_with_speed) {
+  impl_->SetMotionPWM(duty, scale_with_speed);
+}
+
+int Planner::MaxOperationsPerMove() const {
+  // S-curve speed changes are split; raster lines send each part by itself.
+  return impl_->s_curve_acceleration() ? 2 * S_CURVE_MAX_SUBSEGMENTS + 1 : 3;
+}
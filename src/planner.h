@@ -22,6 +22,7 @@
 #include "gcode-parser/gcode-parser.h"  // AxesRegister
 
 struct MachineControlConfig;
+class BedMesh;
 class HardwareMapping;
 class MotorOperations;
 
@@ -31,6 +32,7 @@ class MotorOperations;
 class Planner {
 public:
   // The planner writes out motor operations to the backend.
+  // The motor mapping in "hardware_mapping" needs to be complete already.
   Planner(const MachineControlConfig *config,
           HardwareMapping *hardware_mapping,
           MotorOperations *motor_backend);
@@ -40,6 +42,19 @@ public:
   // the current position.
   void Enqueue(const AxesRegister &target_pos, float speed);
 
+  // Like Enqueue(), but the new segment is the next chord of a smooth curve
+  // (such as an arc or spline) that the previous segment is part of as well.
+  // The junction between them is then not treated as corner; the speed is
+  // only limited by the centripetal acceleration along the curve.
+  void EnqueueCurve(const AxesRegister &target_pos, float speed);
+
+  // Like Enqueue(), but a raster line: the motion PWM (see SetMotionPWM())
+  // is scaled by the "count" pixels 0..255, evenly spaced along the move.
+  // Raster lines are never merged; with a bed mesh, they follow the
+  // straight line between the compensated start and end.
+  void EnqueueRaster(const AxesRegister &target_pos, float speed,
+                     const uint8_t *pixels, int count);
+
   // Flush the queue and wait until all remaining motor
   // operations have been flushed.
   void BringPathToHalt();
@@ -59,11 +74,47 @@ public:
   // Returns the number of steps the stepmotor for that axis did.
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
 
+  // Drive an axis towards a switch, as one queued sequence: fast approach
+  // with "fast_speed" for up to "distance" (signed), a short "retract" and
+  // a slow touch with "slow_speed". The moves towards the switch end as soon
+  // as the hardware sees it trigger (see MotorOperations::SetProbeSwitch()),
+  // so this leaves the axis at the point it triggered during the touch.
+  //
+  // Same preconditions as DirectDrive(). Returns the number of steps the
+  // stepmotor for that axis did; "*triggered" tells if the switch was seen.
+  int DriveToSwitch(GCodeParserAxis axis, float distance, float retract,
+                    float fast_speed, float slow_speed, bool *triggered);
+
   // Set the current absolute position of the given axis from an
   // machine move outside of the control of the Planner.
   // Precondition: BringPathToHalt() had been called before.
   void SetExternalPosition(GCodeParserAxis axis, float pos);
 
+  // Compensate all following moves for the bed height "mesh": its Z offset
+  // at the XY position is added, and moves are split where needed to follow
+  // it within MachineControlConfig::bed_mesh_tolerance. NULL switches the
+  // compensation off. Positions reported are the compensated ones.
+  // The mesh is not owned and needs to outlive its use. Halts the path.
+  void SetBedMesh(const BedMesh *mesh);
+
+  // Take over changed speed, acceleration and cornering limits from the
+  // configuration passed in the constructor. Halts the path, so that
+  // nothing planned with the old limits is still pending.
+  // Steps per mm, ranges and homing can not be changed this way.
+  void UpdateLimits();
+
+  // Duty cycle 0..1 of the motion synchronized PWM output for the following
+  // moves (see MotorOperations::SetMotionPWMOutput()). With
+  // "scale_with_speed", it is scaled down with the speed during acceleration
+  // and deceleration, relative to the requested speed of each move.
+  // The PWM is zero while the path is halted.
+  void SetMotionPWM(float duty, bool scale_with_speed);
+
+  // Most motor operations one planned move is sent as. Together with the
+  // configured lookahead, this limits what bringing the path to a halt
+  // sends at once.
+  int MaxOperationsPerMove() const;
+
 private:
   class Impl;
   Impl *const impl_;
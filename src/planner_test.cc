@@ -6,11 +6,15 @@
 #include <string.h>
 #include <math.h>
 
+#include <algorithm>
+#include <deque>
+
 #include <gtest/gtest.h>
 
 #include "gcode-parser/gcode-parser.h"
 #include "common/logging.h"
 
+#include "bed-mesh.h"
 #include "gcode-machine-control.h"
 #include "hardware-mapping.h"
 #include "motor-operations.h"
@@ -80,11 +84,37 @@ public:
     collected_.push_back(segment);
   }
 
+  virtual void EnqueueRaster(const LinearSegmentSteps &segment,
+                             const uint8_t *pixels, int count) {
+    raster_pixels.push_back(count);
+    collected_.push_back(segment);
+  }
+
   virtual void MotorEnable(bool on)  {}
   virtual void WaitQueueEmpty() {}
+  virtual bool GetProbeStepsSkipped(int skipped[BEAGLEG_NUM_MOTORS]) {
+    ProbeReport report = {};
+    if (!probe_reports.empty()) {
+      report = probe_reports.front();
+      probe_reports.pop_front();
+    }
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) skipped[i] = report.skipped[i];
+    probe_reported_after.push_back(collected_.size());
+    return report.triggered;
+  }
 
   const std::vector<LinearSegmentSteps> &segments() { return collected_; }
 
+  // What the hardware would report for probing moves, one per call.
+  struct ProbeReport {
+    bool triggered;
+    int skipped[BEAGLEG_NUM_MOTORS];
+  };
+  std::deque<ProbeReport> probe_reports;
+  std::vector<size_t> probe_reported_after;  // Segments sent at each report.
+
+  std::vector<int> raster_pixels;  // Pixels per EnqueueRaster() call.
+
 private:
   // Convert speeds in segments back to speed in euklidian space to have
   // something useful to relate to.
@@ -148,6 +178,15 @@ public:
     planner_->Enqueue(target, feed);
   }
 
+  void EnqueueCurve(const AxesRegister &target, float feed) {
+    assert(!finished_);
+    planner_->EnqueueCurve(target, feed);
+  }
+
+  Planner *planner() { return planner_; }
+  const MachineControlConfig &config() const { return *config_; }
+  FakeMotorOperations *motor_ops() { return &motor_ops_; }
+
   const std::vector<LinearSegmentSteps> &segments() {
     if (!finished_) {
       planner_->BringPathToHalt();
@@ -164,9 +203,26 @@ private:
   Planner *planner_;
 };
 
+// Speed "v" of "segment" in steps/s of its defining axis as mm/s along the
+// path, the unit the planner joins segments in.
+static float PathSpeed(const LinearSegmentSteps &segment, float v,
+                       const MachineControlConfig &config) {
+  int defining_axis = AXIS_X;
+  float len = 0;
+  for (int i = AXIS_X; i <= AXIS_Z; ++i) {
+    if (abs(segment.steps[i]) > abs(segment.steps[defining_axis]))
+      defining_axis = i;
+    const float mm = segment.steps[i] / config.steps_per_mm[i];
+    len += mm * mm;
+  }
+  if (segment.steps[defining_axis] == 0) return v;
+  return v * sqrtf(len) / abs(segment.steps[defining_axis]);
+}
+
 // Conditions that we expect in all moves.
 static void VerifyCommonExpectations(
-      const std::vector<LinearSegmentSteps> &segments) {
+      const std::vector<LinearSegmentSteps> &segments,
+      const MachineControlConfig &config) {
   ASSERT_GT((int)segments.size(), 1) << "Expected more than one segment";
 
   // Some basic assumption: something is moving.
@@ -176,13 +232,24 @@ static void VerifyCommonExpectations(
   EXPECT_EQ(0, segments[0].v0);
   EXPECT_EQ(0, segments[segments.size()-1].v1);
 
-  // The joining speeds between segments match.
+  // The joining speeds between segments match. Parts of the same move share
+  // the speed in steps/s; between moves, it is the same in euclidian space.
+  // Parts are rounded to full steps on each axis, which changes their
+  // direction by up to half a step per axis.
   for (size_t i = 0; i < segments.size()-1; ++i) {
-    // Let's determine the speed in euclidian space.
-#if 1
-    EXPECT_EQ(segments[i].v1, segments[i+1].v0)
+    const LinearSegmentSteps &from = segments[i];
+    const LinearSegmentSteps &to = segments[i+1];
+    if (from.v1 == to.v0) continue;
+    const float v = PathSpeed(from, from.v1, config);
+    float rounding = 1e-5;
+    for (const LinearSegmentSteps *s : { &from, &to }) {
+      int max_steps = 0;
+      for (int a = AXIS_X; a <= AXIS_Z; ++a)
+        max_steps = std::max(max_steps, abs(s->steps[a]));
+      if (max_steps > 0) rounding += 1.5f / max_steps;
+    }
+    EXPECT_NEAR(v, PathSpeed(to, to.v0, config), rounding * v)
       << "Joining speed between " << i << " and " << (i+1);
-#endif
   }
 }
 
@@ -198,7 +265,7 @@ TEST(PlannerTest, SimpleMove_NeverReachingFullSpeed) {
   // reach, then decelerating.
   EXPECT_EQ(2, (int)plantest.segments().size());
 
-  VerifyCommonExpectations(plantest.segments());
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
 }
 
 TEST(PlannerTest, SimpleMove_ReachesFullSpeed) {
@@ -212,7 +279,7 @@ TEST(PlannerTest, SimpleMove_ReachesFullSpeed) {
   // We expect three segments: accelerating, plateau and decelerating.
   EXPECT_EQ(3, (int)plantest.segments().size());
 
-  VerifyCommonExpectations(plantest.segments());
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
 }
 
 // When we move axes, they should try to reach the speed the user requested
@@ -330,7 +397,7 @@ static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
   pos[AXIS_Y] = kSegmentLen * sin(radangle) + pos[AXIS_Y];
   plantest.Enqueue(pos, kFeedrate);
   std::vector<LinearSegmentSteps> segments = plantest.segments();
-  VerifyCommonExpectations(segments);
+  VerifyCommonExpectations(segments, plantest.config());
   return segments;
 }
 
@@ -392,6 +459,519 @@ TEST(PlannerTest, CornerMove_Shallow_NegativeAngle) {
   testShallowAngleAllStartingPoints(kThresholdAngle, kTestingAngle);
 }
 
+// At this corner, the defining axis changes from X to Y, which has more
+// steps/mm. The speed through it is the same in euclidian space, not in
+// steps/s.
+TEST(PlannerTest, CornerMove_DefiningAxisChanges) {
+  PlannerHarness plantest(20);
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  plantest.Enqueue(pos, 1000);
+  pos[AXIS_X] = 200;
+  pos[AXIS_Y] = 30;
+  plantest.Enqueue(pos, 1000);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  const MachineControlConfig &config = plantest.config();
+  VerifyCommonExpectations(segments, config);
+  const int corner_x_steps = 100 * config.steps_per_mm[AXIS_X];
+  int x_steps = 0;
+  size_t i = 0;
+  while (i < segments.size() - 1 && x_steps != corner_x_steps)
+    x_steps += segments[i++].steps[AXIS_X];
+  ASSERT_EQ(corner_x_steps, x_steps) << "Didn't find corner";
+  const LinearSegmentSteps &before = segments[i-1];
+  const LinearSegmentSteps &after = segments[i];
+  ASSERT_GT(abs(after.steps[AXIS_Y]), abs(after.steps[AXIS_X]));
+  const float corner_speed = before.v1 / config.steps_per_mm[AXIS_X];
+  EXPECT_GT(corner_speed, 10);
+  EXPECT_NEAR(corner_speed, PathSpeed(after, after.v0, config),
+              1e-3 * corner_speed);
+}
+
+// Do a corner move with junction deviation cornering and return the speed
+// in the corner, in mm/s.
+static float JunctionDeviationCornerSpeed(float deviation, float delta_angle) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->junction_deviation = deviation;
+  PlannerHarness plantest(0, config);
+  const float kSegmentLen = 100;
+  AxesRegister pos;
+  pos[AXIS_X] = kSegmentLen;
+  plantest.Enqueue(pos, 1000);
+  const int corner_x_steps = kSegmentLen * config->steps_per_mm[AXIS_X];
+  const float radangle = 2 * M_PI * delta_angle / 360;
+  pos[AXIS_X] += kSegmentLen * cos(radangle);
+  pos[AXIS_Y] += kSegmentLen * sin(radangle);
+  plantest.Enqueue(pos, 1000);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments, plantest.config());
+  int x_steps = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    x_steps += s.steps[AXIS_X];
+    if (x_steps == corner_x_steps)
+      return s.v1 / config->steps_per_mm[AXIS_X];
+  }
+  ADD_FAILURE() << "Didn't find corner";
+  return -1;
+}
+
+TEST(PlannerTest, JunctionDeviation_SpeedDecreasesWithSharperCorners) {
+  const float kDeviation = 0.05;
+  float last_speed = JunctionDeviationCornerSpeed(kDeviation, 0);
+  EXPECT_GT(last_speed, 10);
+  for (float angle = 15; angle < 180; angle += 15) {
+    const float corner_speed = JunctionDeviationCornerSpeed(kDeviation, angle);
+    EXPECT_GT(corner_speed, 0) << angle;
+    EXPECT_LT(corner_speed, last_speed) << angle;
+    last_speed = corner_speed;
+  }
+  // Turning around: full stop.
+  EXPECT_EQ(0, JunctionDeviationCornerSpeed(kDeviation, 180));
+}
+
+TEST(PlannerTest, JunctionDeviation_LargerToleranceAllowsFasterCorners) {
+  EXPECT_LT(JunctionDeviationCornerSpeed(0.01, 90),
+            JunctionDeviationCornerSpeed(0.1, 90));
+}
+
+// Moving along a straight line in many tiny segments. Returns the highest
+// speed reached.
+static float DoManySmallSegments(int lookahead_segments) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = lookahead_segments;
+  PlannerHarness plantest(0, config);
+  const float kSegmentLen = 0.1;
+  AxesRegister pos;
+  for (int i = 1; i <= 1000; ++i) {
+    pos[AXIS_X] = i * kSegmentLen;
+    plantest.Enqueue(pos, 100);
+  }
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
+  float max_speed = 0;
+  int total_steps = 0;
+  for (const LinearSegmentSteps &s : plantest.segments()) {
+    max_speed = std::max(max_speed, std::max(s.v0, s.v1));
+    total_steps += s.steps[AXIS_X];
+  }
+  EXPECT_EQ(1000 * kSegmentLen * 1000, total_steps);  // 1000 steps/mm
+  return max_speed;
+}
+
+TEST(PlannerTest, DeepLookaheadReachesSpeedOnSmallSegments) {
+  // With only one segment lookahead, we have to be able to stop within 0.1mm
+  // at any time. With 100mm/s^2, that is sqrt(2 * 100 * 0.1 * 2) = ~6mm/s.
+  const float shallow_speed = DoManySmallSegments(1);
+  EXPECT_LT(shallow_speed, 10 * 1000);
+
+  // Deep lookahead: we reach the requested 100mm/s
+  const float deep_speed = DoManySmallSegments(1000);
+  EXPECT_NEAR(100 * 1000, deep_speed, 1);
+}
+
+// Acceleration of the given axis in the first (accelerating) segment.
+static float FirstSegmentAccel(const std::vector<LinearSegmentSteps> &segments,
+                               GCodeParserAxis defining_axis,
+                               GCodeParserAxis axis) {
+  const LinearSegmentSteps &s = segments[0];
+  const float accel = (s.v1*s.v1 - s.v0*s.v0) / (2 * abs(s.steps[defining_axis]));
+  return accel * abs(s.steps[axis]) / abs(s.steps[defining_axis]);
+}
+
+TEST(PlannerTest, AccelerationLimitedByWeakestParticipatingAxis) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->acceleration[AXIS_Y] = 10;   // mm/s^2: weak axis.
+  PlannerHarness plantest(0, config);
+
+  // X is the defining axis with 100'000 steps, Y does 80'000 steps.
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  pos[AXIS_Y] = 20;
+  plantest.Enqueue(pos, 10);
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
+
+  const float y_accel_limit = 10 * 4000;  // steps/s^2 on Y
+  EXPECT_NEAR(y_accel_limit,
+              FirstSegmentAccel(plantest.segments(), AXIS_X, AXIS_Y),
+              0.01 * y_accel_limit);
+
+  // A move with only X is not slowed down.
+  MachineControlConfig *x_config = new MachineControlConfig();
+  InitTestConfig(x_config);
+  x_config->acceleration[AXIS_Y] = 10;
+  PlannerHarness x_only(0, x_config);
+  pos[AXIS_Y] = 0;
+  x_only.Enqueue(pos, 10);
+  const float x_accel_limit = 100 * 1000;
+  EXPECT_NEAR(x_accel_limit,
+              FirstSegmentAccel(x_only.segments(), AXIS_X, AXIS_X),
+              0.01 * x_accel_limit);
+}
+
+// Total time it takes to execute the segments.
+static double SegmentsTime(const std::vector<LinearSegmentSteps> &segments) {
+  double t = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    t += 2.0 * abs(s.steps[AXIS_X]) / (s.v0 + s.v1);
+  }
+  return t;
+}
+
+// Many short moves along a line with a small zig-zag of "wiggle" mm.
+static std::vector<LinearSegmentSteps> DoWigglyLine(float merge_deviation,
+                                                    float wiggle,
+                                                    float feed_change) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->merge_deviation = merge_deviation;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 50; ++i) {  // Ending on the line.
+    pos[AXIS_X] = i;
+    pos[AXIS_Y] = (i % 2) ? wiggle : 0;
+    plantest.Enqueue(pos, (i % 2) ? 10 : 10 * (1 + feed_change));
+  }
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
+  int x_steps = 0;
+  for (const LinearSegmentSteps &s : plantest.segments())
+    x_steps += s.steps[AXIS_X];
+  EXPECT_EQ(50 * 1000, x_steps);
+  return plantest.segments();
+}
+
+TEST(PlannerTest, MergeCollinearMoves) {
+  // Without merging, each 1mm segment is planned separately.
+  EXPECT_GT(DoWigglyLine(-1, 0, 0).size(), 50u);
+
+  // All merged into one long move: accel, travel, decel
+  EXPECT_EQ(3u, DoWigglyLine(0.01, 0, 0).size());
+  EXPECT_EQ(3u, DoWigglyLine(0.01, 0.005, 0).size());
+  EXPECT_EQ(3u, DoWigglyLine(0.01, 0, 0.01).size());
+
+  // Too far off the line or different speeds: not merged.
+  EXPECT_GT(DoWigglyLine(0.01, 0.02, 0).size(), 50u);
+  EXPECT_GT(DoWigglyLine(0.01, 0, 0.5).size(), 25u);
+}
+
+TEST(PlannerTest, MotionPWMFollowsMoves) {
+  PlannerHarness plantest;
+  AxesRegister pos;
+  plantest.planner()->SetMotionPWM(0.5, true);
+  pos[AXIS_X] = 100;
+  plantest.Enqueue(pos, 100);
+  plantest.planner()->SetMotionPWM(0, false);
+  pos[AXIS_Y] = 100;
+  plantest.Enqueue(pos, 100);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments, plantest.config());
+  for (const LinearSegmentSteps &s : segments) {
+    if (s.steps[AXIS_X] != 0) {
+      EXPECT_EQ(0.5, s.pwm);
+      // Full power at the requested speed.
+      EXPECT_NEAR(100 * 1000, s.pwm_full_speed, 1);
+      EXPECT_LE(std::max(s.v0, s.v1), s.pwm_full_speed);
+    } else {
+      EXPECT_EQ(0, s.pwm);
+      EXPECT_EQ(0, s.pwm_full_speed);
+    }
+  }
+}
+
+TEST(PlannerTest, RasterPixelsSplitBySteps) {
+  PlannerHarness plantest;
+  AxesRegister pos;
+  plantest.planner()->SetMotionPWM(1.0, false);
+  std::vector<uint8_t> pixels(200, 255);
+  pos[AXIS_X] = 100;
+  plantest.planner()->EnqueueRaster(pos, 50, pixels.data(), pixels.size());
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  const std::vector<int> &raster = plantest.motor_ops()->raster_pixels;
+  ASSERT_EQ(3u, raster.size());  // Acceleration, travel, deceleration.
+  int total_pixels = 0;
+  for (size_t i = 0; i < raster.size(); ++i) {
+    // Pixels spread evenly over the steps.
+    EXPECT_NEAR(segments[i].steps[AXIS_X] * 200.0 / (100 * 1000), raster[i], 1);
+    total_pixels += raster[i];
+  }
+  EXPECT_EQ(200, total_pixels);
+}
+
+TEST(PlannerTest, MotionPWMOffAtHalt) {
+  PlannerHarness plantest;
+  AxesRegister pos;
+  plantest.planner()->SetMotionPWM(0.3, false);
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 100);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_GT(segments.size(), 1u);
+  for (size_t i = 0; i < segments.size() - 1; ++i) {
+    EXPECT_FLOAT_EQ(0.3, segments[i].pwm);
+    EXPECT_EQ(0, segments[i].pwm_full_speed);
+  }
+  const LinearSegmentSteps &last = segments.back();
+  EXPECT_EQ(0, last.steps[AXIS_X]);
+  EXPECT_EQ(0, last.pwm);
+}
+
+// Time for arbitrary moves: speeds are given for the defining axis, which is
+// the one with the most steps.
+static double DefiningAxisTime(const std::vector<LinearSegmentSteps> &segments) {
+  double t = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    int steps = 0;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i)
+      steps = std::max(steps, abs(s.steps[i]));
+    t += 2.0 * steps / (s.v0 + s.v1);
+  }
+  return t;
+}
+
+// Half a circle with "radius", starting at the origin, in one degree chords.
+// Returns the time it takes.
+static double DoHalfCircle(float radius, float feed, bool as_curve) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = 500;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 180; ++i) {
+    pos[AXIS_X] = radius * cos(i * M_PI / 180) - radius;
+    pos[AXIS_Y] = radius * sin(i * M_PI / 180);
+    if (as_curve && i > 1)
+      plantest.EnqueueCurve(pos, feed);
+    else
+      plantest.Enqueue(pos, feed);
+  }
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
+  return DefiningAxisTime(plantest.segments());
+}
+
+TEST(PlannerTest, CurvesOnlyLimitedByCentripetalAcceleration) {
+  const float kRadius = 10;
+  const float kFeed = 1000;
+  // With 100mm/s^2, the highest speed on the circle is sqrt(100 * 10) mm/s.
+  const double min_time = M_PI * kRadius / sqrt(100 * kRadius);
+  const double curve_time = DoHalfCircle(kRadius, kFeed, true);
+  EXPECT_GT(curve_time, min_time);
+  EXPECT_LT(curve_time, min_time * 1.5);  // Accel from/to zero at the ends.
+
+  // As individual segments, each chord junction is a corner to slow down for.
+  const double corner_time = DoHalfCircle(kRadius, kFeed, false);
+  EXPECT_GT(corner_time, 1.5 * curve_time);
+
+  // Slow feed, below the limit: full speed along the whole curve; only
+  // the acceleration and deceleration at the ends take longer (0.1s each,
+  // half of which is travel at full speed).
+  EXPECT_NEAR(M_PI * kRadius / 10 + 0.1, DoHalfCircle(kRadius, 10, true), 0.01);
+}
+
+// Highest acceleration in steps/s^2 of the X axis in "segments".
+static float PeakAcceleration(const std::vector<LinearSegmentSteps> &segments) {
+  float peak_accel = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    if (s.steps[AXIS_X] == 0) continue;
+    peak_accel = std::max(peak_accel,
+                          fabsf(s.v1*s.v1 - s.v0*s.v0)
+                          / (2 * abs(s.steps[AXIS_X])));
+  }
+  return peak_accel;
+}
+
+TEST(PlannerTest, SCurveAcceleration_SmoothSpeedChange) {
+  PlannerHarness trapezoid;
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->s_curve_acceleration = true;
+  PlannerHarness s_curve(0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  trapezoid.Enqueue(pos, 10);
+  s_curve.Enqueue(pos, 10);
+
+  ASSERT_EQ(3, (int)trapezoid.segments().size());
+  VerifyCommonExpectations(s_curve.segments(), s_curve.config());
+  ASSERT_GT(s_curve.segments().size(), trapezoid.segments().size());
+
+  // Same steps. Accel + decel take 0.2s with a trapezoid; the S-curve
+  // takes 15/8 of that, as it keeps the peak acceleration within the limit
+  // (a bit less, as it is approximated with constant acceleration parts).
+  int total_steps = 0;
+  for (const LinearSegmentSteps &s : s_curve.segments()) {
+    total_steps += s.steps[AXIS_X];
+  }
+  EXPECT_EQ(100 * 1000, total_steps);
+  EXPECT_NEAR(SegmentsTime(trapezoid.segments()) + 7.0 / 8 * 0.1,
+              SegmentsTime(s_curve.segments()), 0.04);
+
+  // Acceleration starts gently, and goes up to the configured value.
+  const float config_accel = 100 * 1000;  // steps/s^2
+  const LinearSegmentSteps &first = s_curve.segments()[0];
+  EXPECT_LT((first.v1*first.v1 - first.v0*first.v0) / (2 * first.steps[AXIS_X]),
+            config_accel / 4);
+  EXPECT_GT(PeakAcceleration(s_curve.segments()), 0.9 * config_accel);
+}
+
+// Also between moves with different speeds, the S-curve never accelerates
+// harder than configured.
+TEST(PlannerTest, SCurveAcceleration_PeakWithinLimit) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->s_curve_acceleration = true;
+  PlannerHarness plantest(0, config);
+
+  AxesRegister pos;
+  const float feeds[] = { 10, 3, 20, 7 };
+  for (const float feed : feeds) {
+    pos[AXIS_X] += 50;
+    plantest.Enqueue(pos, feed);
+  }
+  VerifyCommonExpectations(plantest.segments(), plantest.config());
+  const float config_accel = 100 * 1000;  // steps/s^2
+  EXPECT_LE(PeakAcceleration(plantest.segments()), 1.001 * config_accel);
+}
+
+// Approach, then retract and touch once the approach saw the switch; where
+// we ended up follows from what the hardware did not do once it triggered.
+TEST(PlannerTest, DriveToSwitchApproachRetractTouch) {
+  PlannerHarness plantest;
+  // The switch is 30mm away in negative direction; the approach stops there,
+  // the touch after half of its 2mm, back at the switch.
+  FakeMotorOperations::ProbeReport approach = { true, {} };
+  approach.skipped[AXIS_X] = -70 * 1000;
+  FakeMotorOperations::ProbeReport touch = { true, {} };
+  touch.skipped[AXIS_X] = -1000;
+  plantest.motor_ops()->probe_reports.push_back(approach);
+  plantest.motor_ops()->probe_reports.push_back(touch);
+  bool triggered = false;
+  const int steps = plantest.planner()->DriveToSwitch(AXIS_X, -100, 1, 10, 2,
+                                                      &triggered);
+  EXPECT_TRUE(triggered);
+  EXPECT_EQ(-30 * 1000, steps);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_EQ(4u, segments.size());
+  // The approach result is known before retract and touch are sent.
+  const std::vector<size_t> reported_after = { 2, 4 };
+  EXPECT_EQ(reported_after, plantest.motor_ops()->probe_reported_after);
+  // Accelerating approach; 100mm/s^2 to 10mm/s takes 0.5mm.
+  EXPECT_EQ(-500, segments[0].steps[AXIS_X]);
+  EXPECT_EQ(0, segments[0].v0);
+  EXPECT_EQ(10 * 1000, segments[0].v1);
+  EXPECT_EQ(-99500, segments[1].steps[AXIS_X]);
+  EXPECT_EQ(10 * 1000, segments[1].v0);
+  EXPECT_TRUE(segments[0].stop_on_probe && segments[1].stop_on_probe);
+  // Retract is a regular move, the touch probes again.
+  EXPECT_EQ(1000, segments[2].steps[AXIS_X]);
+  EXPECT_FALSE(segments[2].stop_on_probe);
+  EXPECT_EQ(-2000, segments[3].steps[AXIS_X]);
+  EXPECT_EQ(2 * 1000, segments[3].v0);
+  EXPECT_TRUE(segments[3].stop_on_probe);
+}
+
+// A switch that is never seen during the approach is not touched again.
+TEST(PlannerTest, DriveToSwitchNotTriggered) {
+  PlannerHarness plantest;
+  bool triggered = true;
+  const int steps = plantest.planner()->DriveToSwitch(AXIS_X, 100, 1, 10, 2,
+                                                      &triggered);
+  EXPECT_FALSE(triggered);
+  EXPECT_EQ(100 * 1000, steps);
+  EXPECT_EQ(2u, plantest.segments().size());
+}
+
+// Triggering at the very last step of a move leaves no steps skipped; it is
+// the hardware trigger state that counts.
+TEST(PlannerTest, DriveToSwitchTriggeredOnLastStep) {
+  PlannerHarness plantest;
+  FakeMotorOperations::ProbeReport last_step = { true, {} };
+  plantest.motor_ops()->probe_reports.push_back(last_step);
+  plantest.motor_ops()->probe_reports.push_back(last_step);
+  bool triggered = false;
+  const int steps = plantest.planner()->DriveToSwitch(AXIS_X, 100, 1, 10, 2,
+                                                      &triggered);
+  EXPECT_TRUE(triggered);
+  EXPECT_EQ(100 * 1000 + 1000, steps);  // Touch went all of its 2mm.
+  EXPECT_EQ(4u, plantest.segments().size());
+}
+
+// Each command of a move gets its steps for all motors, including the ones
+// that are mirrored copies of another.
+TEST(PlannerTest, MirroredMotorsGetStepsOfTheirAxis) {
+  MachineControlConfig config;
+  InitTestConfig(&config);
+  HardwareMapping hardware;
+  hardware.AddMotorMapping(AXIS_X, 1, false);
+  hardware.AddMotorMapping(AXIS_Y, 2, false);
+  hardware.AddMotorMapping(AXIS_Y, 3, true);   // Gantry: other side of Y.
+  hardware.AddMotorMapping(AXIS_Z, 5, false);
+  FakeMotorOperations motor_ops(config);
+  Planner planner(&config, &hardware, &motor_ops);
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  pos[AXIS_Y] = 20;
+  planner.Enqueue(pos, 10);
+  planner.BringPathToHalt();
+
+  ASSERT_EQ(3u, motor_ops.segments().size());
+  int x_steps = 0, y_steps = 0;
+  for (const LinearSegmentSteps &s : motor_ops.segments()) {
+    EXPECT_EQ(-s.steps[1], s.steps[2]);
+    EXPECT_EQ(0, s.steps[3]);
+    EXPECT_EQ(0, s.steps[4]);
+    x_steps += s.steps[0];
+    y_steps += s.steps[1];
+  }
+  EXPECT_EQ(10 * 1000, x_steps);
+  EXPECT_EQ(20 * 1000 * SPEED_STEP_FACTOR, y_steps);
+}
+
+// With a bed mesh, moves follow its height: a straight line across a tilted
+// bed is one move also going in Z, a bump in the middle needs more pieces.
+TEST(PlannerTest, BedMeshCompensatesZ) {
+  BedMesh mesh(0, 0, 100, 100, 3, 3);
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) mesh.set_height(col, row, 0.01 * col);
+  }
+  PlannerHarness tilted;
+  tilted.planner()->SetBedMesh(&mesh);
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  tilted.Enqueue(pos, 10);
+  int x_steps = 0, z_steps = 0;
+  for (const LinearSegmentSteps &s : tilted.segments()) {
+    x_steps += s.steps[AXIS_X];
+    z_steps += s.steps[AXIS_Z];
+  }
+  EXPECT_EQ(3u, tilted.segments().size());   // accel, travel, decel
+  EXPECT_EQ(100 * 1000, x_steps);
+  // Z has 16 times the steps/mm of X in the test config.
+  EXPECT_EQ(round(0.02 * 16 * 1000), z_steps);
+
+  mesh.set_height(1, 1, 0.5);
+  PlannerHarness bumpy;
+  bumpy.planner()->SetBedMesh(&mesh);
+  pos[AXIS_Y] = 100;
+  bumpy.Enqueue(pos, 10);
+  VerifyCommonExpectations(bumpy.segments(), bumpy.config());
+  int max_z = 0;
+  z_steps = 0;
+  for (const LinearSegmentSteps &s : bumpy.segments()) {
+    z_steps += s.steps[AXIS_Z];
+    max_z = std::max(max_z, z_steps);
+  }
+  EXPECT_GT(bumpy.segments().size(), 6u);
+  EXPECT_NEAR(0.5 * 16 * 1000, max_z, 0.01 * 16 * 1000);
+  EXPECT_EQ(round(0.02 * 16 * 1000), z_steps);
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
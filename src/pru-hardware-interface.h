@@ -21,6 +21,15 @@
 #define BEAGLEG_PRU_HARDWARE_INTERFACE_
 
 #include <cstddef>
+#include <stdint.h>
+
+// Memory shared with the I/O firmware on the second PRU. Same layout as the
+// IO_*_OFFSET in motor-interface-constants.h
+struct PruIOCommunication {
+  volatile uint32_t aux_bits;      // Aux outputs the PRU is to set.
+  volatile uint32_t input_bits;    // Raw level of the inputs, bit 0 = IN_1
+  volatile uint32_t sample_count;  // Incremented with each input sample.
+};
 
 // Pru hardware controls
 class PruHardwareInterface {
@@ -37,9 +46,24 @@ public:
   // Enable the PRU and start predetermined program.
   virtual bool StartExecution() = 0;
 
+  // Map the memory shared with the I/O firmware, load it into the second PRU
+  // and start it; it first sets the aux outputs to "aux_bits". Returns false
+  // if not supported; aux outputs and inputs are then accessed directly.
+  virtual bool StartIOProcessor(uint32_t aux_bits, PruIOCommunication **io) {
+    return false;
+  }
+
+  // Map the raster ring of RASTER_LEN u16 values in the shared RAM (see
+  // motor-interface-constants.h). Returns false if not supported.
+  virtual bool AllocateRasterMem(volatile uint16_t **raster) { return false; }
+
   // Wait for a beagleg-mapped event. Return number of events that have occured.
   virtual unsigned WaitEvent() = 0;
 
+  // Halt the PRU right away and wake up a WaitEvent() in another thread.
+  // The memory stays mapped until Shutdown().
+  virtual void Halt() {}
+
   // Halt the PRU
   virtual bool Shutdown() = 0;
 };
@@ -49,7 +73,10 @@ public:
   bool Init();
   bool AllocateSharedMem(void **pru_mmap, const size_t size);
   bool StartExecution();
+  bool StartIOProcessor(uint32_t aux_bits, PruIOCommunication **io);
+  bool AllocateRasterMem(volatile uint16_t **raster);
   unsigned WaitEvent();
+  void Halt();
   bool Shutdown();
 };
 
@@ -24,38 +24,104 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "common/logging.h"
+#include "common/trace.h"
 
 #include "generic-gpio.h"
 #include "pwm-timer.h"
 #include "hardware-mapping.h"
+#include "machine-metrics.h"
 #include "pru-hardware-interface.h"
 
 //#define DEBUG_QUEUE
 
+// Data RAM of one PRU on the AM335x.
+#define PRU_DATARAM_SIZE 8192
+
+// RAM shared by both PRUs: the PRU1 I/O values and the raster ring.
+#define PRU_SHARED_RAM_SIZE 12288
+
 // The communication with the PRU. We memory map the static RAM in the PRU
 // and write stuff into it from here. Mostly this is a ring-buffer with
 // commands to execute, but also configuration data, such as what to do when
 // an endswitch fires.
+#ifdef BEAGLEG_PRU_EXTENDED
+struct PRUCommunication {
+  union {
+    volatile struct QueueStatus status;
+    volatile uint32_t status_word;  // The same, to read it all at once.
+  };
+  volatile uint32_t wakeup_slot;  // PRU interrupts when done with this slot.
+  volatile uint32_t late_loops;   // Loops the PRU could not do in time.
+  volatile uint16_t override_target;  // Speed override; see constants.
+  volatile uint16_t override_speed;   // Speed the PRU is applying right now.
+  volatile uint32_t override_ramp;    // PRU: loops until next ramp step.
+  volatile uint32_t probe_switch;     // GPIO | PROBE_TRIGGER_HIGH
+  volatile uint32_t motion_pwm_register;  // Timer match register; 0: off.
+  volatile uint32_t motion_pwm_base;      // Match value for zero duty.
+  volatile uint32_t override_ramp_loops;  // Delay loops per ramp step.
+  volatile uint16_t override_scale;   // PRU: delay scale of override_speed.
+  volatile uint16_t probe_triggered;  // PRU sets it, host clears it.
+  volatile struct MotionSlot ring_buffer[QUEUE_LEN];
+  volatile uint16_t motion_pwm[QUEUE_LEN];  // Timer ticks added to the base.
+  volatile uint32_t raster_done;  // Raster ring index the PRU reads next.
+} __attribute__((packed));
+#else
+// The original firmware (motor-interface-pru.p) has 16 bit loop counters in
+// the slots; needs to match QueueHeader and TravelParameters there.
+struct MotionSlot16 {
+  uint8_t state;
+  uint8_t direction_bits;
+  uint16_t loops_accel;
+  uint16_t loops_travel;
+  uint16_t loops_decel;
+  uint16_t aux;
+  uint32_t accel_series_index;
+  uint32_t hires_accel_cycles;
+  uint32_t travel_delay_cycles;
+  uint32_t fractions[MOTION_MOTOR_COUNT];
+} __attribute__((packed));
+
 struct PRUCommunication {
-  volatile struct QueueStatus status;
-  volatile struct MotionSegment ring_buffer[QUEUE_LEN];
+  union {
+    volatile struct QueueStatus status;
+    volatile uint32_t status_word;  // The same, to read it all at once.
+  };
+  volatile struct MotionSlot16 ring_buffer[QUEUE_LEN];
 } __attribute__((packed));
+#endif
+
+static_assert(sizeof(PRUCommunication) <= PRU_DATARAM_SIZE,
+              "QUEUE_LEN too large for the PRU data RAM");
+static_assert(sizeof(PruIOCommunication) <= RASTER_SHARED_OFFSET,
+              "PRU1 I/O values overlap the raster ring");
+static_assert(RASTER_SHARED_OFFSET + RASTER_LEN * sizeof(uint16_t)
+              <= PRU_SHARED_RAM_SIZE,
+              "RASTER_LEN too large for the PRU shared RAM");
+
+// Consistent copy of the status the PRU keeps updating.
+static struct QueueStatus ReadQueueStatus(volatile const PRUCommunication *pru) {
+  const uint32_t status_word = pru->status_word;
+  struct QueueStatus status;
+  memcpy(&status, &status_word, sizeof(status));
+  return status;
+}
 
 #ifdef DEBUG_QUEUE
-static void DumpMotionSegment(volatile const struct MotionSegment *e,
-                              volatile struct PRUCommunication *pru_data) {
-  if (e->state == STATE_EXIT) {
-    Log_debug("enqueue[%02td]: EXIT", e - pru_data->ring_buffer);
+static void DumpMotionSegment(unsigned int slot, const MotionSegment &copy) {
+  if (copy.state == STATE_EXIT) {
+    Log_debug("enqueue[%02u]: EXIT", slot);
   } else {
-    MotionSegment copy = (MotionSegment&) *e;
     std::string line;
-    line = StringPrintf("enqueue[%02td]: dir:0x%02x s:(%5d + %5d + %5d) = %5d ",
-                        e - pru_data->ring_buffer, copy.direction_bits,
+    line = StringPrintf("enqueue[%02u]: dir:0x%02x s:(%5d + %5d + %5d) = %5d ",
+                        slot, copy.direction_bits,
                         copy.loops_accel, copy.loops_travel, copy.loops_decel,
                         copy.loops_accel + copy.loops_travel + copy.loops_decel);
 
@@ -83,57 +149,117 @@ static void DumpMotionSegment(volatile const struct MotionSegment *e,
 #endif
 
 // Store the required informations needed to backtrack the absolute position.
+// Written by the thread feeding the queue, read by whoever wants to know the
+// position: the sequence number tells readers if they got a consistent copy.
 struct HistorySegment {
-  HistorySegment() : fractions(), cumulative_loops(), direction_bits(0) {}
+  HistorySegment() : fractions(), cumulative_loops(), direction_bits(0),
+                     probe_pending(false), sequence(0) {}
   uint32_t fractions[MOTION_MOTOR_COUNT];
-  uint32_t cumulative_loops[MOTION_MOTOR_COUNT];
+  int32_t cumulative_loops[MOTION_MOTOR_COUNT];  // Position at end of segment.
   uint8_t direction_bits;
+  bool probe_pending;   // STATE_PROBE; not seen by GetProbeStepsSkipped() yet.
+  volatile uint32_t sequence;  // Odd while being updated.
 };
 
-void PRUMotionQueue::RegisterHistorySegment(const MotionSegment &element) {
-  const uint64_t max_fraction = 0xFFFFFFFF;
-  const unsigned int last_insert_index = (queue_pos_ - 1) % QUEUE_LEN;
+// Steps the PRU does in "loops" with the given fraction; like
+// SegmentMotorSteps(), without needing a division.
+static inline uint32_t LoopsToSteps(uint32_t fraction, uint64_t loops) {
+  return (loops * fraction + (1ULL << 31)) >> 32;
+}
+
+void PRUMotionQueue::RegisterHistorySegment(unsigned int slot,
+                                            const MotionSegment &element) {
   const struct HistorySegment &previous
-    = shadow_queue_[(last_insert_index - 1) % QUEUE_LEN];
+    = shadow_queue_[(slot + QUEUE_LEN - 1) % QUEUE_LEN];
 
-  const uint64_t total_loops
-    = element.loops_accel + element.loops_travel + element.loops_decel;
+  const uint64_t total_loops = (uint64_t) element.loops_accel
+    + element.loops_travel + element.loops_decel;
   const uint8_t direction_bits = element.direction_bits;
 
-  HistorySegment *new_slot = &shadow_queue_[last_insert_index];
-
-  // TODO: Motor operations already holds this information, we should wire it
-  // until here in order to avoid this redundant operation.
+  HistorySegment *new_slot = &shadow_queue_[slot];
+  new_slot->sequence = new_slot->sequence + 1;
+  __sync_synchronize();
   for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
-    const uint64_t fraction = element.fractions[i];
-    new_slot->fractions[i] = fraction;
-    const int sign = (direction_bits >> i) & 1 ? -1 : 1;
-    uint64_t loops = fraction * total_loops;
-    loops /= max_fraction;
+    const int32_t steps = LoopsToSteps(element.fractions[i], total_loops);
+    new_slot->fractions[i] = element.fractions[i];
     new_slot->cumulative_loops[i] = previous.cumulative_loops[i]
-                                    + sign * loops;
+      + (((direction_bits >> i) & 1) ? -steps : steps);
   }
-
-  new_slot->direction_bits = element.direction_bits;
+  new_slot->direction_bits = direction_bits;
+  new_slot->probe_pending = (element.state == STATE_PROBE);
+  __sync_synchronize();
+  new_slot->sequence = new_slot->sequence + 1;
 }
 
 void PRUMotionQueue::GetMotorsLoops(MotorsRegister *absolute_pos_loops) {
-  const uint64_t max_fraction = 0xFFFFFFFF;
-  const struct QueueStatus status = *(struct QueueStatus*) &pru_data_->status;
-  const struct HistorySegment &current = shadow_queue_[status.index];
+  // Lock-free: while we read, the PRU might finish the segment and the
+  // host re-use its history slot. If so, try again.
+  for (;;) {
+    const struct QueueStatus status = ReadQueueStatus(pru_data_);
+    const struct HistorySegment &current = shadow_queue_[status.index];
+    const uint32_t sequence = current.sequence;
+    if (sequence & 1) continue;  // Being written right now.
+    __sync_synchronize();
+
+    MotorsRegister result;
+    for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+      const int32_t remaining = LoopsToSteps(current.fractions[i],
+                                             status.counter);
+      result[i] = current.cumulative_loops[i]
+        - (((current.direction_bits >> i) & 1) ? -remaining : remaining);
+    }
 
-  const uint64_t counter = status.counter;
-  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
-    const int64_t sign = (current.direction_bits >> i) & 1 ? -1 : 1;
-    uint64_t loops = current.fractions[i];
-    loops *= counter;
-    loops /= max_fraction;
-    (*absolute_pos_loops)[i] = current.cumulative_loops[i] - sign * loops;
+    __sync_synchronize();
+    // As long as the PRU is still in the same slot, the host can't have
+    // touched its history.
+    const struct QueueStatus check = ReadQueueStatus(pru_data_);
+    if (current.sequence == sequence && check.index == status.index) {
+      *absolute_pos_loops = result;
+      return;
+    }
+  }
+}
+
+static_assert(offsetof(PruIOCommunication, aux_bits) == IO_AUX_BITS_OFFSET
+              && offsetof(PruIOCommunication, input_bits) == IO_INPUT_BITS_OFFSET
+              && offsetof(PruIOCommunication, sample_count) == IO_SAMPLE_COUNT_OFFSET,
+              "PruIOCommunication does not match the PRU1 firmware");
+
+#ifdef BEAGLEG_PRU_EXTENDED
+// We copy between host and PRU memory in 32 bit words: the compiler might
+// otherwise attempt to be overly clever and do unaligned accesses, and
+// word-sized stores are faster than byte-wise copying.
+// The first word contains the state; it is written last, this is what
+// publishes the segment to the busy-waiting PRU.
+#define SEGMENT_WORDS (MOTION_SLOT_SIZE / sizeof(uint32_t))
+static_assert(MOTION_SLOT_SIZE % sizeof(uint32_t) == 0
+              && sizeof(MotionSlot) == MOTION_SLOT_SIZE,
+              "MotionSlot needs to be a multiple of 32 bit");
+static_assert(sizeof(QueueStatus) == sizeof(uint32_t),
+              "Ring buffer needs to start word-aligned");
+
+void PRUMotionQueue::CopyToSlot(unsigned int slot,
+                                const MotionSegment &segment) {
+  uint32_t words[SEGMENT_WORDS];
+  memcpy(words, &segment, sizeof(words));
+  volatile uint32_t *dest = (volatile uint32_t*) &pru_data_->ring_buffer[slot];
+  for (unsigned int i = 1; i < SEGMENT_WORDS; ++i) {
+    dest[i] = words[i];
+  }
+  if (motion_pwm_ticks_) {
+    pru_data_->motion_pwm[slot] = MotionPWMTicks(segment.pwm);
   }
 }
 
+void PRUMotionQueue::PublishSlot(unsigned int slot,
+                                 const MotionSegment &segment) {
+  uint32_t header;
+  memcpy(&header, &segment, sizeof(header));
+  *(volatile uint32_t*) &pru_data_->ring_buffer[slot] = header;
+}
+#else
 // Stop gap for compiler attempting to be overly clever when copying between
-// host and PRU memory.
+// host and PRU memory; the slots are not word-aligned.
 static void unaligned_memcpy(volatile void *dest, const void *src, size_t size) {
   volatile char *d = (volatile char*) dest;
   const char *s = (char*) src;
@@ -143,38 +269,276 @@ static void unaligned_memcpy(volatile void *dest, const void *src, size_t size)
   }
 }
 
+void PRUMotionQueue::CopyToSlot(unsigned int slot,
+                                const MotionSegment &segment) {
+  // MAX_SEGMENT_LOOPS keeps these within 16 bits.
+  assert(segment.loops_accel <= 0xffff && segment.loops_travel <= 0xffff
+         && segment.loops_decel <= 0xffff);
+  struct MotionSlot16 element;
+  element.state = STATE_EMPTY;
+  element.direction_bits = segment.direction_bits;
+  element.loops_accel = segment.loops_accel;
+  element.loops_travel = segment.loops_travel;
+  element.loops_decel = segment.loops_decel;
+  element.aux = segment.aux;
+  element.accel_series_index = segment.accel_series_index;
+  element.hires_accel_cycles = segment.hires_accel_cycles;
+  element.travel_delay_cycles = segment.travel_delay_cycles;
+  memcpy(element.fractions, segment.fractions, sizeof(element.fractions));
+  // Everything but the state, which publishes it.
+  unaligned_memcpy((volatile uint8_t*) &pru_data_->ring_buffer[slot] + 1,
+                   (const uint8_t*) &element + 1, sizeof(element) - 1);
+}
+
+void PRUMotionQueue::PublishSlot(unsigned int slot,
+                                 const MotionSegment &segment) {
+  pru_data_->ring_buffer[slot].state = segment.state;
+}
+#endif
+
+uint16_t PRUMotionQueue::MotionPWMTicks(uint32_t pwm) const {
+  // Match values too close to the start or end of the period don't work.
+  uint32_t ticks = (uint64_t) pwm * motion_pwm_ticks_ / MOTION_PWM_MAX;
+  if (ticks < 3) ticks = 3;
+  if (ticks > motion_pwm_ticks_ - 2) ticks = motion_pwm_ticks_ - 2;
+  return ticks;
+}
+
 void PRUMotionQueue::Enqueue(MotionSegment *element) {
-  const uint8_t state_to_send = element->state;
-  assert(state_to_send != STATE_EMPTY);  // forgot to set proper state ?
-  // Initially, we copy everything with 'STATE_EMPTY', then flip the state
-  // to avoid a race condition while copying.
-  element->state = STATE_EMPTY;
-
-  queue_pos_ %= QUEUE_LEN;
-  while (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY) {
-    pru_interface_->WaitEvent();
+  EnqueueMany(element, 1);
+}
+
+int PRUMotionQueue::FillLevel() {
+  if (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY)
+    return QUEUE_LEN;
+  const unsigned int executing = pru_data_->status.index;
+  if (pru_data_->ring_buffer[executing].state == STATE_EMPTY)
+    return 0;
+  return (queue_pos_ + QUEUE_LEN - executing) % QUEUE_LEN;
+}
+
+void PRUMotionQueue::GetQueueStatus(QueueStatus *status, int *pending) {
+  *status = ReadQueueStatus(pru_data_);
+  *pending = FillLevel();
+}
+
+void PRUMotionQueue::EnqueueMany(MotionSegment *segments, int count) {
+  TraceScope trace(TRACE_MOTION_QUEUE_ENQUEUE, count);
+  // If the PRU is already done with everything we gave it, but the previous
+  // segment didn't end in a stop, we were too slow.
+  const unsigned int previous_slot = (queue_pos_ + QUEUE_LEN - 1) % QUEUE_LEN;
+  if (Metrics_moving()
+      && pru_data_->ring_buffer[previous_slot].state == STATE_EMPTY) {
+    Metrics_record_underrun();
   }
+  Metrics_record_enqueue(count, FillLevel());
+#ifdef BEAGLEG_PRU_EXTENDED
+  const uint32_t late_loops = pru_data_->late_loops;
+  if (late_loops != last_late_loops_) {
+    Metrics_record_late_loops(late_loops - last_late_loops_);
+    last_late_loops_ = late_loops;
+  }
+#endif
 
-  volatile MotionSegment *queue_element = &pru_data_->ring_buffer[queue_pos_++];
-  unaligned_memcpy(queue_element, element, sizeof(*queue_element));
+  int published = 0;
+  while (published < count && !aborted_) {
+    // Fill as many free slots as we can ... Filled slots only stop looking
+    // empty once published, so don't go around the ring a second time.
+    const unsigned int first_slot = queue_pos_;
+    int filled = published;
+    while (filled < count
+           && pru_data_->ring_buffer[queue_pos_].state == STATE_EMPTY
+           && (filled == published || queue_pos_ != first_slot)) {
+      assert(segments[filled].state != STATE_EMPTY);  // forgot to set state ?
+      CopyToSlot(queue_pos_, segments[filled]);
+      // Register the inserted motion segment in the shadow queue before
+      // the PRU can start executing it.
+      RegisterHistorySegment(queue_pos_, segments[filled]);
+      queue_pos_ = (queue_pos_ + 1) % QUEUE_LEN;
+      ++filled;
+    }
 
-  // Fully initialized. Tell busy-waiting PRU by flipping the state.
-  queue_element->state = state_to_send;
+    if (filled == published) {
+      // Queue full. Don't wake up for every single slot, but only once the
+      // PRU is down to the low-water mark; then refill in bulk.
+      const uint64_t wait_start = Trace_now_ns();
+      WaitSlotEmpty((queue_pos_ + QUEUE_LEN - low_water_mark_ - 1) % QUEUE_LEN);
+      Metrics_record_blocked(Trace_now_ns() - wait_start);
+      continue;
+    }
 
-  // Register the last inserted motion segment in the shadow queue.
-  RegisterHistorySegment(*element);
+    // ... then hand them over to the PRU by flipping the states in order.
+    unsigned int slot = first_slot;
+    for (/**/; published < filled; ++published) {
+      PublishSlot(slot, segments[published]);
 #ifdef DEBUG_QUEUE
-  DumpMotionSegment(queue_element, pru_data_);
+      DumpMotionSegment(slot, segments[published]);
 #endif
+      slot = (slot + 1) % QUEUE_LEN;
+    }
+  }
 }
 
-void PRUMotionQueue::WaitQueueEmpty() {
-  const unsigned int last_insert_index = (queue_pos_ - 1) % QUEUE_LEN;
-  while (pru_data_->ring_buffer[last_insert_index].state != STATE_EMPTY) {
+void PRUMotionQueue::WaitSlotEmpty(unsigned int slot) {
+  TraceScope trace(TRACE_MOTION_QUEUE_WAIT, slot);
+#ifdef BEAGLEG_PRU_EXTENDED
+  while (!aborted_ && pru_data_->ring_buffer[slot].state != STATE_EMPTY) {
+    pru_data_->wakeup_slot = slot;
+    // The PRU might have finished the slot before it saw our request, so we
+    // have to check again after the request is visible.
+    __sync_synchronize();
+    if (pru_data_->ring_buffer[slot].state == STATE_EMPTY)
+      break;
+    pru_interface_->WaitEvent();
+  }
+  pru_data_->wakeup_slot = NO_WAKEUP_SLOT;
+#else
+  // The original firmware signals every slot it finishes.
+  while (!aborted_ && pru_data_->ring_buffer[slot].state != STATE_EMPTY) {
     pru_interface_->WaitEvent();
   }
+#endif
+}
+
+void PRUMotionQueue::WaitQueueEmpty() {
+  WaitSlotEmpty((queue_pos_ + QUEUE_LEN - 1) % QUEUE_LEN);
+}
+
+bool PRUMotionQueue::IsFull(int slots) {
+  if (slots > QUEUE_LEN / 2) slots = QUEUE_LEN / 2;
+  if (slots < 1) slots = 1;
+  // The PRU empties the slots in order, so if the last one we'd need is
+  // free, all before it are.
+  const int last = (queue_pos_ + slots - 1) % QUEUE_LEN;
+  return pru_data_->ring_buffer[last].state != STATE_EMPTY;
+}
+
+#ifdef BEAGLEG_PRU_EXTENDED
+bool PRUMotionQueue::SetSpeedOverride(float factor) {
+  uint16_t speed = OVERRIDE_HOLD;
+  if (factor >= 1) speed = OVERRIDE_UNITY;
+  else if (factor > 0) {
+    const float units = roundf(factor * OVERRIDE_UNITY);
+    speed = (units < OVERRIDE_CREEP) ? OVERRIDE_CREEP : units;
+  }
+  pru_data_->override_target = speed;
+  return true;
+}
+
+void PRUMotionQueue::SetSpeedOverrideRamp(float stop_seconds) {
+  // One ramp step changes the speed by 1/OVERRIDE_UNITY.
+  const float loops = stop_seconds * TIMER_FREQUENCY / OVERRIDE_UNITY;
+  if (loops < 1) pru_data_->override_ramp_loops = 1;
+  else if (loops >= UINT32_MAX) pru_data_->override_ramp_loops = UINT32_MAX;
+  else pru_data_->override_ramp_loops = loops;
+}
+
+void PRUMotionQueue::SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {
+  pru_data_->probe_switch = gpio_def | (trigger_level ? PROBE_TRIGGER_HIGH : 0);
+}
+
+bool PRUMotionQueue::SetMotionPWMOutput(uint32_t gpio_def) {
+  uint32_t match_register, zero_duty_match, period_ticks;
+  if (!pwm_timer_get_match(gpio_def, &match_register, &zero_duty_match,
+                           &period_ticks)) {
+    return false;
+  }
+  if (period_ticks > 0xffff || period_ticks < 8) {
+    Log_error("Motion PWM: frequency out of range (%u timer ticks)",
+              period_ticks);
+    return false;
+  }
+  // Everything that is already in the queue starts with the lowest duty.
+  motion_pwm_ticks_ = period_ticks;
+  for (int i = 0; i < QUEUE_LEN; ++i) {
+    pru_data_->motion_pwm[i] = 3;
+  }
+  pru_data_->motion_pwm_base = zero_duty_match;
+  pru_data_->motion_pwm_register = match_register;
+  return true;
+}
+
+bool PRUMotionQueue::EnqueueRaster(MotionSegment *segment,
+                                   const uint16_t *pwm, int count) {
+  // The first value goes with the slot, the others into the raster ring.
+  const uint32_t ring_values = count - 1;
+  if (!motion_pwm_ticks_ || raster_ == NULL || count < 1
+      || ring_values > RASTER_LEN / 2 || segment->loops_travel < (uint32_t)count
+      || segment->loops_accel != 0 || segment->loops_decel != 0) {
+    return false;
+  }
+  // The PRU frees the ring as it goes; no event for that, so we poll.
+  const uint64_t wait_start = Trace_now_ns();
+  bool waited = false;
+  while (!aborted_ && RASTER_LEN - (raster_written_ - pru_data_->raster_done)
+         < ring_values) {
+    usleep(1000);
+    waited = true;
+  }
+  if (waited) Metrics_record_blocked(Trace_now_ns() - wait_start);
+
+  for (uint32_t i = 0; i < ring_values; ++i) {
+    raster_[(raster_written_ + i) & (RASTER_LEN - 1)]
+      = MotionPWMTicks(pwm[i + 1]);
+  }
+  segment->state = STATE_RASTER;
+  segment->pwm = pwm[0];
+  segment->accel_series_index = raster_written_;
+  // Advance exactly count - 1 times within the loops, the first time after
+  // 1/count of them.
+  segment->hires_accel_cycles
+    = (((uint64_t) count << 31) - 1) / segment->loops_travel;
+  raster_written_ += ring_values;
+  Enqueue(segment);
+  return true;
 }
 
+bool PRUMotionQueue::GetProbeStepsSkipped(MotorsRegister *skipped) {
+  skipped->zero();
+  const bool triggered = (pru_data_->probe_triggered != 0);
+  pru_data_->probe_triggered = 0;   // Probe segments run again.
+  // The PRU leaves the loops it did not do in the slot, in place of
+  // loops_accel. As the queue is empty, the slots are not re-used yet.
+  for (int slot = 0; slot < QUEUE_LEN; ++slot) {
+    HistorySegment *const history = &shadow_queue_[slot];
+    if (!history->probe_pending) continue;
+    history->probe_pending = false;
+    const uint32_t loops_left = pru_data_->ring_buffer[slot].loops_accel;
+    for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+      const int32_t steps = LoopsToSteps(history->fractions[i], loops_left);
+      (*skipped)[i] += ((history->direction_bits >> i) & 1) ? -steps : steps;
+    }
+  }
+
+  // All following positions build on the last segment; correct that.
+  HistorySegment *last = &shadow_queue_[(queue_pos_ + QUEUE_LEN - 1) % QUEUE_LEN];
+  last->sequence = last->sequence + 1;
+  __sync_synchronize();
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    last->cumulative_loops[i] -= (*skipped)[i];
+  }
+  __sync_synchronize();
+  last->sequence = last->sequence + 1;
+  return triggered;
+}
+#else
+// None of this in the original firmware.
+bool PRUMotionQueue::SetSpeedOverride(float factor) { return false; }
+void PRUMotionQueue::SetSpeedOverrideRamp(float stop_seconds) {}
+void PRUMotionQueue::SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {}
+bool PRUMotionQueue::SetMotionPWMOutput(uint32_t gpio_def) { return false; }
+
+bool PRUMotionQueue::EnqueueRaster(MotionSegment *segment,
+                                   const uint16_t *pwm, int count) {
+  return false;
+}
+
+bool PRUMotionQueue::GetProbeStepsSkipped(MotorsRegister *skipped) {
+  skipped->zero();
+  return false;
+}
+#endif
+
 void PRUMotionQueue::MotorEnable(bool on) {
   hardware_mapping_->EnableMotors(on);
 }
@@ -186,16 +550,28 @@ void PRUMotionQueue::Shutdown(bool flush_queue) {
     Enqueue(&end_element);
     WaitQueueEmpty();
   }
+  // The shared memory is gone after shutdown; back to direct GPIO access.
+  hardware_mapping_->SetIOProcessor(NULL);
   pru_interface_->Shutdown();
   MotorEnable(false);
 }
 
+void PRUMotionQueue::Abort() {
+  aborted_ = true;
+  __sync_synchronize();
+  pru_interface_->Halt();  // Wakes up WaitSlotEmpty() in another thread.
+}
+
 PRUMotionQueue::~PRUMotionQueue() { delete [] shadow_queue_; }
 
-PRUMotionQueue::PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru)
+PRUMotionQueue::PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru,
+                               int low_water_mark)
                                : hardware_mapping_(hw),
                                  pru_interface_(pru),
+                                 low_water_mark_(low_water_mark),
                                  shadow_queue_(new HistorySegment[QUEUE_LEN]) {
+  if (low_water_mark_ < 0) low_water_mark_ = 0;
+  if (low_water_mark_ > QUEUE_LEN - 1) low_water_mark_ = QUEUE_LEN - 1;
   const bool success = Init();
   // For now, we just assert-fail here, if things fail.
   // Typically hardware-doomed event anyway.
@@ -215,6 +591,31 @@ bool PRUMotionQueue::Init() {
     pru_data_->ring_buffer[i].state = STATE_EMPTY;
   }
   queue_pos_ = 0;
+  last_late_loops_ = 0;
+  aborted_ = false;
+  motion_pwm_ticks_ = 0;
+  raster_written_ = 0;
+  raster_ = NULL;
+#ifdef BEAGLEG_PRU_EXTENDED
+  pru_data_->wakeup_slot = NO_WAKEUP_SLOT;
+  pru_data_->override_target = OVERRIDE_UNITY;
+  pru_data_->override_speed = OVERRIDE_UNITY;
+  pru_data_->override_ramp = 0;
+  pru_data_->override_scale = OVERRIDE_UNITY;  // 1 << OVERRIDE_SHIFT
+  SetSpeedOverrideRamp(1.0);  // Until we know the acceleration.
+  pru_data_->probe_switch = GPIO_NOT_MAPPED;
+  pru_data_->probe_triggered = 0;
+  pru_data_->motion_pwm_register = 0;
+  pru_data_->raster_done = 0;
+  if (!pru_interface_->AllocateRasterMem(&raster_)) raster_ = NULL;
+#endif
+
+  // If available, aux outputs and inputs are handled by the second PRU.
+  PruIOCommunication *io = NULL;
+  if (pru_interface_->StartIOProcessor(hardware_mapping_->GetAuxBits(),
+                                       &io)) {
+    hardware_mapping_->SetIOProcessor(io);
+  }
 
   return pru_interface_->StartExecution();
 }
@@ -7,8 +7,12 @@
  */
 #include "motion-queue.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <vector>
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
@@ -19,22 +23,96 @@
 #include "motor-operations.h"
 #include "pru-hardware-interface.h"
 #include "hardware-mapping.h"
+#include "machine-metrics.h"
 #include "motor-interface-constants.h"
 
 // PRU-side mock implementation of the ring buffer.
+#ifdef BEAGLEG_PRU_EXTENDED
 struct MockPRUCommunication {
   struct QueueStatus status;
-  struct MotionSegment ring_buffer[QUEUE_LEN];
+  uint32_t wakeup_slot;
+  uint32_t late_loops;
+  uint16_t override_target;
+  uint16_t override_speed;
+  uint32_t override_ramp;
+  uint32_t probe_switch;
+  uint32_t motion_pwm_register;
+  uint32_t motion_pwm_base;
+  uint32_t override_ramp_loops;
+  uint16_t override_scale;
+  uint16_t probe_triggered;
+  struct MotionSlot ring_buffer[QUEUE_LEN];
+  uint16_t motion_pwm[QUEUE_LEN];
+  uint32_t raster_done;
+} __attribute__((packed));
+#else
+// The original firmware: 16 bit loop counters.
+struct MockMotionSlot {
+  uint8_t state;
+  uint8_t direction_bits;
+  uint16_t loops_accel;
+  uint16_t loops_travel;
+  uint16_t loops_decel;
+  uint16_t aux;
+  uint32_t accel_series_index;
+  uint32_t hires_accel_cycles;
+  uint32_t travel_delay_cycles;
+  uint32_t fractions[MOTION_MOTOR_COUNT];
 } __attribute__((packed));
 
+struct MockPRUCommunication {
+  struct QueueStatus status;
+  struct MockMotionSlot ring_buffer[QUEUE_LEN];
+} __attribute__((packed));
+#endif
+
 class MockPRUInterface : public PruHardwareInterface {
 public:
-  MockPRUInterface() { mmap = NULL; }
+  MockPRUInterface() : wait_count(0), has_io_processor(false), io(),
+                       held(false), waiting(false), halted(false),
+                       mmap(NULL), execution_pos(0) {}
   ~MockPRUInterface() { free(mmap); }
 
   bool Init() { return true; }
   bool StartExecution() { return true; }
-  unsigned WaitEvent() { return 1; }
+  bool StartIOProcessor(uint32_t aux_bits, PruIOCommunication **io_mem) {
+    io.aux_bits = aux_bits;  // What the I/O firmware sees when it starts.
+    *io_mem = &io;
+    return has_io_processor;
+  }
+  bool AllocateRasterMem(volatile uint16_t **raster_mem) {
+    *raster_mem = raster;
+    return true;
+  }
+
+  // The host only waits if it needs the PRU to progress: behave like the
+  // PRU executing segments until it reaches the requested wakeup slot.
+  // The original firmware signals every slot.
+  unsigned WaitEvent() {
+    ++wait_count;
+#ifdef BEAGLEG_PRU_EXTENDED
+    if (mmap->wakeup_slot >= QUEUE_LEN)
+      return 1;
+#endif
+    if (held) {  // Like a PRU on feed hold: nothing progresses until halted.
+      waiting = true;
+      while (!halted) usleep(1000);
+      return 1;
+    }
+    while (mmap->ring_buffer[execution_pos].state != STATE_EMPTY) {
+      executed_loops.push_back(mmap->ring_buffer[execution_pos].loops_accel);
+      mmap->ring_buffer[execution_pos].state = STATE_EMPTY;
+#ifdef BEAGLEG_PRU_EXTENDED
+      const bool is_wakeup = (execution_pos == mmap->wakeup_slot);
+#else
+      const bool is_wakeup = true;
+#endif
+      execution_pos = (execution_pos + 1) % QUEUE_LEN;
+      if (is_wakeup) break;
+    }
+    return 1;
+  }
+  void Halt() { halted = true; }
   bool Shutdown() { return true; }
 
   bool AllocateSharedMem(void **pru_mmap, const size_t size) {
@@ -53,8 +131,19 @@ public:
     }
   }
 
+  const struct MockPRUCommunication *memory() const { return mmap; }
+  int wait_count;  // Number of times the host had to wait for the PRU
+  std::vector<uint32_t> executed_loops;  // loops_accel of run segments.
+  bool has_io_processor;
+  PruIOCommunication io;
+  uint16_t raster[RASTER_LEN];
+  bool held;               // Don't execute anything in WaitEvent().
+  volatile bool waiting;   // Somebody is blocked in WaitEvent().
+  volatile bool halted;
+
 private:
   struct MockPRUCommunication *mmap;
+  unsigned int execution_pos;
 };
 
 // Check that on init, the initial position is 0.
@@ -79,8 +168,8 @@ TEST(RealtimePosition, zero_loops_edge) {
   //motor 0 +, motor 1 -, motor 2 -, 150 loops. fractions: /1 /3 /5
   static struct MotionSegment segment = {
     STATE_FILLED /*state*/, 0x00 | 1 << 1 | 1 << 2 /*direction bits*/,
-    0 /*loops accel*/, 150u /*loops travel*/, 0 /*loops decel*/,
-    0 /*aux*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*aux*/, 0 /*loops accel*/, 150u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
     0 /*travel_delay_cycles*/,
     { 0xFFFFFFFF, 0x55555555, 0x33333333, 0, 0, 0, 0, 0}/*fractions*/,
   };
@@ -113,8 +202,8 @@ TEST(RealtimePosition, hybrid_execution) {
   //motor 0 +, motor 1 -, motor 2 -, 150 loops. fractions: /1 /3 /5
   static struct MotionSegment segment1 = {
     STATE_FILLED /*state*/, 0x00 | 1 << 1 | 1 << 2 /*direction bits*/,
-    0 /*loops accel*/, 150u /*loops travel*/, 0 /*loops decel*/,
-    0 /*aux*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*aux*/, 0 /*loops accel*/, 150u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
     0 /*travel_delay_cycles*/,
     {0xFFFFFFFF, 0x55555555, 0x33333333, 0, 0, 0, 0, 0}/*fractions*/,
   };
@@ -122,8 +211,8 @@ TEST(RealtimePosition, hybrid_execution) {
   //motor 0 -, motor 1 +, motor 2 -, 15 loops. fractions: /1 /3 /5
   static struct MotionSegment segment2 = {
     STATE_FILLED /*state*/, 0x00 | 1 << 0 | 1 << 2 /*direction bits*/,
-    0 /*loops accel*/, 15u /*loops travel*/, 0 /*loops decel*/,
-    0 /*aux*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*aux*/, 0 /*loops accel*/, 15u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
     0 /*travel_delay_cycles*/,
     {0xFFFFFFFF, 0x55555555, 0x33333333, 0, 0, 0, 0, 0}/*fractions*/,
   };
@@ -166,8 +255,8 @@ TEST(RealtimePosition, queue_full) {
   //motor 0 +, motor 1 -, motor 2 -, 150 loops. fractions: /1 /3 /5
   static struct MotionSegment segment_forward = {
     STATE_FILLED /*state*/, 0x00 | 1 << 1 | 1 << 2 /*direction bits*/,
-    0 /*loops accel*/, 150u /*loops travel*/, 0 /*loops decel*/,
-    0 /*aux*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*aux*/, 0 /*loops accel*/, 150u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
     0 /*travel_delay_cycles*/,
     {0xFFFFFFFF, 0x55555555, 0x33333333, 0, 0, 0, 0, 0}/*fractions*/,
   };
@@ -175,8 +264,8 @@ TEST(RealtimePosition, queue_full) {
   //motor 0 -, motor 1 +, motor 2 +, 150 loops. fractions: /1 /3 /5
   static struct MotionSegment segment_reverse = {
     STATE_FILLED /*state*/, 0x00 | 1 << 0 /*direction bits*/,
-    0 /*loops accel*/, 150u /*loops travel*/, 0 /*loops decel*/,
-    0 /*aux*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*aux*/, 0 /*loops accel*/, 150u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
     0 /*travel_delay_cycles*/,
     {0xFFFFFFFF, 0x55555555, 0x33333333, 0, 0, 0, 0, 0}/*fractions*/,
   };
@@ -189,14 +278,21 @@ TEST(RealtimePosition, queue_full) {
   PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
 
   for (int i = 0; i < QUEUE_LEN; ++i) {
+    EXPECT_FALSE(motion_backend.IsFull());
+    EXPECT_EQ(i + 3 > QUEUE_LEN, motion_backend.IsFull(3));
+    // More than the queue holds: half of it needs to be free.
+    EXPECT_EQ(i > QUEUE_LEN / 2, motion_backend.IsFull(2 * QUEUE_LEN));
     motion_backend.Enqueue(&segment_forward);
     segment_forward.state = STATE_FILLED;
   }
+  EXPECT_TRUE(motion_backend.IsFull());  // The next Enqueue() would wait.
 
   pru_interface->SimRun(QUEUE_LEN - 1, 0);
+  EXPECT_FALSE(motion_backend.IsFull());
   motion_backend.GetMotorsLoops(&absolute_pos_loops);
 
-  expected = {2400, -800, -480, 0, 0, 0, 0, 0};
+  // Each segment moves (150, -50, -30)
+  expected = {150 * QUEUE_LEN, -50 * QUEUE_LEN, -30 * QUEUE_LEN, 0, 0, 0, 0, 0};
   EXPECT_THAT(expected, ::testing::ContainerEq(absolute_pos_loops));
 
   for (int i = 0; i < 3; ++i) {
@@ -207,7 +303,8 @@ TEST(RealtimePosition, queue_full) {
   pru_interface->SimRun(2, 0);
   motion_backend.GetMotorsLoops(&absolute_pos_loops);
 
-  expected = {1950, -650, -390, 0, 0, 0, 0, 0};
+  expected = {150 * QUEUE_LEN - 450, -50 * QUEUE_LEN + 150,
+              -30 * QUEUE_LEN + 90, 0, 0, 0, 0, 0};
   EXPECT_THAT(expected, ::testing::ContainerEq(absolute_pos_loops));
 
   // Simulate a stop, the pru awaits for the next slot to be filled.
@@ -228,6 +325,345 @@ TEST(RealtimePosition, queue_full) {
   delete hmap;
 }
 
+// Enqueueing a batch of segments is the same as enqueuing them one by one.
+TEST(RealtimePosition, batch_enqueue) {
+  //motor 0 +, motor 1 -, motor 2 -, 150 loops. fractions: /1 /3 /5
+  static const struct MotionSegment segment = {
+    STATE_FILLED /*state*/, 0x00 | 1 << 1 | 1 << 2 /*direction bits*/,
+    0 /*aux*/, 0 /*loops accel*/, 150u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*travel_delay_cycles*/,
+    {0xFFFFFFFF, 0x55555555, 0x33333333, 0, 0, 0, 0, 0}/*fractions*/,
+  };
+  struct MotionSegment batch[3] = { segment, segment, segment };
+
+  MotorsRegister absolute_pos_loops;
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+
+  motion_backend.EnqueueMany(batch, 3);
+  for (int i = 0; i < 3; ++i) {
+#ifdef BEAGLEG_PRU_EXTENDED
+    EXPECT_EQ(0, memcmp(&segment, &pru_interface->memory()->ring_buffer[i],
+                        MOTION_SLOT_SIZE));
+#else
+    const MockMotionSlot &slot = pru_interface->memory()->ring_buffer[i];
+    EXPECT_EQ(segment.state, slot.state);
+    EXPECT_EQ(segment.direction_bits, slot.direction_bits);
+    EXPECT_EQ(150, slot.loops_travel);
+    EXPECT_EQ(0, memcmp(segment.fractions, slot.fractions,
+                        sizeof(slot.fractions)));
+#endif
+  }
+  EXPECT_EQ(STATE_EMPTY, pru_interface->memory()->ring_buffer[3].state);
+
+  pru_interface->SimRun(2, 0);
+  motion_backend.GetMotorsLoops(&absolute_pos_loops);
+
+  const MotorsRegister expected = {450, -150, -90, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected, ::testing::ContainerEq(absolute_pos_loops));
+
+  delete pru_interface;
+  delete hmap;
+}
+
+// A batch larger than the queue is handed over in several rounds.
+TEST(PRUMotionQueue, batch_larger_than_queue) {
+  const int kCount = QUEUE_LEN + 5;
+  std::vector<MotionSegment> batch(kCount);
+  for (int i = 0; i < kCount; ++i) {
+    batch[i] = MotionSegment();
+    batch[i].state = STATE_FILLED;
+    batch[i].loops_accel = 1000 + i;
+  }
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  motion_backend.EnqueueMany(batch.data(), kCount);
+  EXPECT_GT(pru_interface->wait_count, 0);  // Had to wait for the PRU.
+  motion_backend.WaitQueueEmpty();
+
+  ASSERT_EQ(kCount, (int)pru_interface->executed_loops.size());
+  for (int i = 0; i < kCount; ++i) {
+    EXPECT_EQ(1000u + i, pru_interface->executed_loops[i]) << "segment " << i;
+  }
+  delete pru_interface;
+  delete hmap;
+}
+
+struct BatchToEnqueue {
+  PRUMotionQueue *queue;
+  std::vector<MotionSegment> segments;
+};
+
+static void *EnqueueBatch(void *arg) {
+  BatchToEnqueue *batch = (BatchToEnqueue*) arg;
+  batch->queue->EnqueueMany(batch->segments.data(), batch->segments.size());
+  return NULL;
+}
+
+// On a feed hold, the PRU frees no slots, so a full queue blocks whoever
+// enqueues. Abort() halts the PRU and releases them; nothing is enqueued
+// or waited for from then on.
+TEST(PRUMotionQueue, abort_releases_blocked_enqueue) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  pru_interface->held = true;
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+
+  BatchToEnqueue batch;
+  batch.queue = &motion_backend;
+  batch.segments.resize(QUEUE_LEN + 5);
+  for (size_t i = 0; i < batch.segments.size(); ++i) {
+    batch.segments[i] = MotionSegment();
+    batch.segments[i].state = STATE_FILLED;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, &EnqueueBatch, &batch);
+  while (!pru_interface->waiting) usleep(1000);
+
+  motion_backend.Abort();
+  pthread_join(thread, NULL);
+  EXPECT_TRUE(pru_interface->halted);
+
+  const int waits = pru_interface->wait_count;
+  MotionSegment segment = MotionSegment();
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  motion_backend.WaitQueueEmpty();
+  EXPECT_EQ(waits, pru_interface->wait_count);
+  EXPECT_TRUE(pru_interface->executed_loops.empty());
+
+  delete pru_interface;
+  delete hmap;
+}
+
+// A full queue is only refilled once the PRU reaches the low-water mark,
+// so the host only needs to wake up once for every low-water refill.
+static int WakeupsForEnqueue(int low_water_mark, int segment_count) {
+  static const struct MotionSegment segment = {
+    STATE_FILLED /*state*/, 0 /*direction bits*/,
+    0 /*aux*/, 0 /*loops accel*/, 150u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*travel_delay_cycles*/,
+    {0xFFFFFFFF, 0, 0, 0, 0, 0, 0, 0}/*fractions*/,
+  };
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface,
+                                low_water_mark);
+  for (int i = 0; i < segment_count; ++i) {
+    struct MotionSegment copy = segment;
+    motion_backend.Enqueue(&copy);
+  }
+  motion_backend.WaitQueueEmpty();
+#ifdef BEAGLEG_PRU_EXTENDED
+  EXPECT_EQ((uint32_t) NO_WAKEUP_SLOT, pru_interface->memory()->wakeup_slot);
+#endif
+  const int result = pru_interface->wait_count;
+  delete pru_interface;
+  delete hmap;
+  return result;
+}
+
+TEST(PRUMotionQueue, low_water_mark_wakeups) {
+#ifdef BEAGLEG_PRU_EXTENDED
+  // Waking up for every single slot that gets free.
+  EXPECT_EQ(10 * QUEUE_LEN + 1, WakeupsForEnqueue(QUEUE_LEN - 1, 11 * QUEUE_LEN));
+
+  // Refilling half the queue every time we wake up.
+  EXPECT_EQ(2 * 10 + 1, WakeupsForEnqueue(QUEUE_LEN / 2, 11 * QUEUE_LEN));
+#else
+  // The original firmware wakes us up for every slot it finishes, whatever
+  // the low-water mark.
+  EXPECT_EQ(11 * QUEUE_LEN, WakeupsForEnqueue(QUEUE_LEN - 1, 11 * QUEUE_LEN));
+  EXPECT_EQ(11 * QUEUE_LEN, WakeupsForEnqueue(QUEUE_LEN / 2, 11 * QUEUE_LEN));
+#endif
+}
+
+// Underruns are only counted if the queue runs dry while still moving.
+TEST(PRUMotionQueue, metrics_count_underruns) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  MotionQueueMotorOperations motor_ops(&motion_backend);
+  MachineMetrics before, after;
+  Metrics_get(&before);
+
+  LinearSegmentSteps stop = { 1000, 0, 0, {100} };
+  motor_ops.Enqueue(stop);
+  pru_interface->SimRun(0, 0);    // PRU done.
+  motor_ops.Enqueue(stop);        // Fine, we had stopped anyway.
+  Metrics_get(&after);
+  EXPECT_EQ(before.underruns, after.underruns);
+
+  LinearSegmentSteps keep_moving = { 1000, 1000, 0, {100} };
+  motor_ops.Enqueue(keep_moving);
+  pru_interface->SimRun(2, 0);    // PRU done, but should still be moving.
+  motor_ops.Enqueue(stop);
+  Metrics_get(&after);
+  EXPECT_EQ(before.underruns + 1, after.underruns);
+  EXPECT_EQ(before.segments + 4, after.segments);
+
+  delete pru_interface;
+  delete hmap;
+}
+
+#ifdef BEAGLEG_PRU_EXTENDED
+// Step loops the PRU could not do in time end up in the metrics.
+TEST(PRUMotionQueue, metrics_count_late_loops) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  MotionQueueMotorOperations motor_ops(&motion_backend);
+  MachineMetrics before, after;
+  Metrics_get(&before);
+
+  LinearSegmentSteps move = { 1000, 0, 0, {100} };
+  motor_ops.Enqueue(move);
+  pru_interface->SimRun(0, 0);
+  ((MockPRUCommunication*) pru_interface->memory())->late_loops = 42;
+  motor_ops.Enqueue(move);
+  motor_ops.Enqueue(move);  // Only counted once.
+  Metrics_get(&after);
+  EXPECT_EQ(before.late_loops + 42, after.late_loops);
+
+  delete pru_interface;
+  delete hmap;
+}
+
+// The speed override goes to the PRU in 1/OVERRIDE_UNITY of the planned
+// speed, never faster than planned; zero speed holds.
+TEST(PRUMotionQueue, speed_override_sets_target_speed) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  const MockPRUCommunication *pru = pru_interface->memory();
+  EXPECT_EQ(OVERRIDE_UNITY, pru->override_target);
+  EXPECT_EQ(OVERRIDE_UNITY, pru->override_speed);
+  EXPECT_EQ(1 << OVERRIDE_SHIFT, pru->override_scale);
+
+  motion_backend.SetSpeedOverride(0.5);
+  EXPECT_EQ(OVERRIDE_UNITY / 2, pru->override_target);
+  motion_backend.SetSpeedOverride(1.25);
+  EXPECT_EQ(OVERRIDE_UNITY, pru->override_target);
+  motion_backend.SetSpeedOverride(0.001);
+  EXPECT_EQ(OVERRIDE_CREEP, pru->override_target);
+  motion_backend.SetSpeedOverride(0);
+  EXPECT_EQ(OVERRIDE_HOLD, pru->override_target);
+  motion_backend.SetSpeedOverride(1);
+  EXPECT_EQ(OVERRIDE_UNITY, pru->override_target);
+
+  // Ramping from full speed to a stop takes OVERRIDE_UNITY ramp steps.
+  motion_backend.SetSpeedOverrideRamp(0.1);
+  EXPECT_EQ((uint32_t) (0.1 * TIMER_FREQUENCY / OVERRIDE_UNITY),
+            pru->override_ramp_loops);
+  motion_backend.SetSpeedOverrideRamp(0);  // No acceleration limit.
+  EXPECT_EQ(1u, pru->override_ramp_loops);
+
+  delete pru_interface;
+  delete hmap;
+}
+
+// The PRU reports the loops a probe segment did not do; these are taken
+// off the steps and the position.
+TEST(PRUMotionQueue, probe_steps_skipped) {
+  static struct MotionSegment segment = {
+    STATE_PROBE /*state*/, 1 << 1 /*direction bits*/,
+    0 /*aux*/, 0 /*loops accel*/, 100u /*loops travel*/,
+    0 /*loops decel*/, 0 /*accel_series_index*/, 0 /*hires_accel_cycles*/,
+    0 /*travel_delay_cycles*/,
+    { 0x80000000, 0x80000000, 0, 0, 0, 0, 0, 0}/*fractions*/,
+  };
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  motion_backend.SetProbeSwitch(IN_1_GPIO, true);
+  EXPECT_EQ((uint32_t) (IN_1_GPIO | PROBE_TRIGGER_HIGH),
+            pru_interface->memory()->probe_switch);
+
+  motion_backend.Enqueue(&segment);
+  segment.state = STATE_FILLED;   // Regular segments are not reported.
+  motion_backend.Enqueue(&segment);
+  // Switch triggered 40 loops into the first segment. The PRU leaves the
+  // loops it did not do in place of loops_accel and notes the trigger.
+  pru_interface->SimRun(1, 0);
+  MockPRUCommunication *pru = (MockPRUCommunication*) pru_interface->memory();
+  pru->ring_buffer[0].loops_accel = 60;
+  pru->ring_buffer[1].loops_accel = 17;
+  pru->probe_triggered = 1;
+
+  MotorsRegister skipped;
+  EXPECT_TRUE(motion_backend.GetProbeStepsSkipped(&skipped));
+  EXPECT_EQ(0, pru->probe_triggered);   // Probe segments run again.
+  const MotorsRegister expected_skipped = {30, -30, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected_skipped, ::testing::ContainerEq(skipped));
+
+  MotorsRegister position;
+  motion_backend.GetMotorsLoops(&position);
+  const MotorsRegister expected_position = {70, -70, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected_position, ::testing::ContainerEq(position));
+
+  // Only reported once.
+  EXPECT_FALSE(motion_backend.GetProbeStepsSkipped(&skipped));
+  EXPECT_THAT(MotorsRegister(), ::testing::ContainerEq(skipped));
+
+  delete pru_interface;
+  delete hmap;
+}
+#else
+// The original firmware has no real-time override and no motion PWM, so
+// callers fall back to what works without.
+TEST(PRUMotionQueue, original_firmware_without_extensions) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  EXPECT_FALSE(motion_backend.SetSpeedOverride(0));
+  EXPECT_FALSE(motion_backend.SetMotionPWMOutput(PWM_1_GPIO));
+  MotorsRegister skipped;
+  EXPECT_FALSE(motion_backend.GetProbeStepsSkipped(&skipped));
+  EXPECT_THAT(MotorsRegister(), ::testing::ContainerEq(skipped));
+  motion_backend.Shutdown(false);
+
+  delete pru_interface;
+  delete hmap;
+}
+#endif
+
+// With the I/O firmware on the second PRU, it takes over the aux outputs
+// from where they are.
+TEST(PRUMotionQueue, io_processor_starts_with_aux_bits) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  pru_interface->has_io_processor = true;
+  HardwareMapping *hmap = new HardwareMapping();
+  hmap->UpdateAuxBits(3, true);
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  EXPECT_EQ(1u << 2, pru_interface->io.aux_bits);
+  motion_backend.Shutdown(false);
+
+  delete pru_interface;
+  delete hmap;
+}
+
+// Without the motion PWM, there is nothing to modulate: raster lines are
+// refused, so that the caller sends separate segments.
+TEST(PRUMotionQueue, raster_needs_motion_pwm) {
+  MockPRUInterface *pru_interface = new MockPRUInterface();
+  HardwareMapping *hmap = new HardwareMapping();
+  PRUMotionQueue motion_backend(hmap, (PruHardwareInterface*) pru_interface);
+  struct MotionSegment segment = {};
+  segment.state = STATE_FILLED;
+  segment.loops_travel = 100;
+  const uint16_t pwm[] = { 100, 200, 300 };
+  EXPECT_FALSE(motion_backend.EnqueueRaster(&segment, pwm, 3));
+  EXPECT_EQ(STATE_EMPTY, pru_interface->memory()->ring_buffer[0].state);
+  motion_backend.Shutdown(false);
+
+  delete pru_interface;
+  delete hmap;
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
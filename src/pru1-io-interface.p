@@ -0,0 +1,136 @@
+;; -*- asm -*-
+;;
+;; (c) 2016 Henner Zeller <h.zeller@acm.org>
+;;
+;; This file is part of BeagleG. http://github.com/hzeller/beagleg
+;;
+;; BeagleG is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; BeagleG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+
+;;;;
+;;; I/O firmware for PRU1, used if compiled with BEAGLEG_PRU1_IO.
+;;; PRU0 then only generates steps. This one continuously
+;;;   - sets the aux outputs whenever the aux bits in shared RAM change
+;;;     (written by PRU0 with each segment, or the host for immediate updates).
+;;;   - samples the IN_1..IN_9 inputs at a fixed rate and publishes their
+;;;     raw levels in shared RAM; the host reads them from there instead of
+;;;     going through /dev/mem for every endstop test.
+;;; The layout of the shared RAM is described in motor-interface-constants.h
+;;;;
+
+#include "motor-interface-constants.h"
+
+.origin 0
+.entrypoint INIT
+
+;;; Set/Clr a GPIO pin based on 'bit' being set/clr in 'bits'
+;;; Uses:
+;;;   r4 : the base address of the gpio bank to set/clr the pin
+;;;   r5 : the bitmask to set/clr the gpio pin
+;;;   r6 : scratch
+.macro SetOutputGPIO
+.mparam bits, bit, gpio_def
+	MOV r4, (gpio_def & 0xfffff000)
+	QBEQ no_map, r4.w2, GPIO_NOT_MAPPED
+	MOV r5, 1 << (gpio_def & 0x1f)
+	QBBS set_gpio, bits, bit
+	MOV r6, GPIO_CLEARDATAOUT
+	QBA update_gpio
+set_gpio:
+	MOV r6, GPIO_SETDATAOUT
+update_gpio:
+	ADD r4, r4, r6
+	SBBO r5, r4, 0, 4
+no_map:
+.endm
+
+;;; Set 'bit' in 'bits' if the GPIO input is high.
+;;; Uses:
+;;;   r4 : the address of the DATAIN register of the gpio bank
+;;;   r5 : the bank input levels
+.macro ReadInputGPIO
+.mparam bits, bit, gpio_def
+	MOV r4, (gpio_def & 0xfffff000)
+	QBEQ no_input, r4.w2, GPIO_NOT_MAPPED
+	MOV r5, GPIO_DATAIN
+	ADD r4, r4, r5
+	LBBO r5, r4, 0, 4
+	QBBC no_input, r5, (gpio_def & 0x1f)
+	SET bits, bits, bit
+no_input:
+.endm
+
+INIT:
+	;; Clear STANDBY_INIT in SYSCFG register.
+	LBCO r0, C4, 4, 4
+	CLR r0, r0, 4
+	SBCO r0, C4, 4, 4
+
+	;; Registers
+	;; r1       delay loop
+	;; r3       aux bits to set / input bits sampled
+	;; scratch: r4..r6
+	;; r10      shared RAM address
+	;; r11      aux bits last set; all ones forces the first update.
+	;; r12      sample counter
+	MOV r10, IO_SHARED_RAM
+	MOV r11, 0xffffffff
+	MOV r12, 0
+
+IO_LOOP:
+	;; Only touch the outputs if the aux bits changed.
+	LBBO r3, r10, IO_AUX_BITS_OFFSET, 4
+	QBEQ SAMPLE_INPUTS, r3, r11
+	MOV r11, r3
+	CALL SetAuxOutputs
+
+SAMPLE_INPUTS:
+	ZERO &r3, 4
+	ReadInputGPIO r3, 0, IN_1_GPIO
+	ReadInputGPIO r3, 1, IN_2_GPIO
+	ReadInputGPIO r3, 2, IN_3_GPIO
+	ReadInputGPIO r3, 3, IN_4_GPIO
+	ReadInputGPIO r3, 4, IN_5_GPIO
+	ReadInputGPIO r3, 5, IN_6_GPIO
+	ReadInputGPIO r3, 6, IN_7_GPIO
+	ReadInputGPIO r3, 7, IN_8_GPIO
+	ReadInputGPIO r3, 8, IN_9_GPIO
+	SBBO r3, r10, IO_INPUT_BITS_OFFSET, 4
+	ADD r12, r12, 1
+	SBBO r12, r10, IO_SAMPLE_COUNT_OFFSET, 4
+
+	MOV r1, IO_SAMPLE_LOOPS
+IO_DELAY:
+	SUB r1, r1, 1                   ; two cycles per loop.
+	QBNE IO_DELAY, r1, 0
+	JMP IO_LOOP
+
+;;; Set the aux outputs based on the aux bits (r3) bit 0..15
+SetAuxOutputs:
+	SetOutputGPIO r3, 0, AUX_1_GPIO
+	SetOutputGPIO r3, 1, AUX_2_GPIO
+	SetOutputGPIO r3, 2, AUX_3_GPIO
+	SetOutputGPIO r3, 3, AUX_4_GPIO
+	SetOutputGPIO r3, 4, AUX_5_GPIO
+	SetOutputGPIO r3, 5, AUX_6_GPIO
+	SetOutputGPIO r3, 6, AUX_7_GPIO
+	SetOutputGPIO r3, 7, AUX_8_GPIO
+	SetOutputGPIO r3, 8, AUX_9_GPIO
+	SetOutputGPIO r3, 9, AUX_10_GPIO
+	SetOutputGPIO r3, 10, AUX_11_GPIO
+	SetOutputGPIO r3, 11, AUX_12_GPIO
+	SetOutputGPIO r3, 12, AUX_13_GPIO
+	SetOutputGPIO r3, 13, AUX_14_GPIO
+	SetOutputGPIO r3, 14, AUX_15_GPIO
+	SetOutputGPIO r3, 15, AUX_16_GPIO
+	RET
@@ -20,17 +20,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
 
 #include "common/logging.h"
 
 #include "pwm-timer.h"
-
-// Memory space mapped to the Clock Module registers
-#define CM_BASE                 0x44e00000
-#define CM_SIZE                 0x4000
+#include "register-map.h"
 
 // Clock Module Peripheral registers
 #define CM_PER_TIMER7_CLKCTRL   (0x000 + 0x7c)
@@ -38,9 +32,6 @@
 #define CM_PER_TIMER5_CLKCTRL   (0x000 + 0xec)
 #define CM_PER_TIMER6_CLKCTRL   (0x000 + 0xf0)
 
-#define IDLEST_MASK             (0x03 << 16)
-#define MODULEMODE_ENABLE       (0x02 << 0)
-
 // Clock Module PLL registers
 #define CLKSEL_TIMER7_CLK       (0x500 + 0x04)
 #define CLKSEL_TIMER4_CLK       (0x500 + 0x10)
@@ -164,6 +155,21 @@ void pwm_timer_set_duty(uint32_t gpio_def, float duty_cycle) {
   timer->duty_cycle = duty_cycle;
 }
 
+bool pwm_timer_get_match(uint32_t gpio_def, uint32_t *match_register,
+                         uint32_t *zero_duty_match, uint32_t *period_ticks) {
+  static const uint32_t timer_base[4] = { TIMER4_BASE, TIMER5_BASE,
+                                          TIMER6_BASE, TIMER7_BASE };
+  struct pwm_timer_data *timer = pwm_timer_get_data(gpio_def);
+  if (!timer || !timer->pwm_freq || timer->resolution < 4) return false;
+
+  pwm_timer_set_duty(gpio_def, 3.0 / timer->resolution);
+  pwm_timer_start(gpio_def, true);
+  *match_register = timer_base[timer - timers] + TMAR;
+  *zero_duty_match = TIMER_OVERFLOW - timer->resolution;
+  *period_ticks = timer->resolution;
+  return true;
+}
+
 static void pwm_timer_calc_resolution(struct pwm_timer_data *timer, int pwm_freq) {
   float pwm_period = 1.0 / pwm_freq;
   uint64_t resolution = 0;
@@ -210,80 +216,46 @@ void pwm_timer_set_freq(uint32_t gpio_def, int pwm_freq) {
   pwm_timer_calc_resolution(timer, pwm_freq);
 }
 
-static void pwm_timers_ena_clk(volatile uint32_t *cm, uint32_t reg, int timer) {
-  uint32_t val;
-
-  val = cm[reg/4];
-  if (val & IDLEST_MASK) {
-    Log_debug("Enabling TIMER%d clock", timer);
-    val |= MODULEMODE_ENABLE;
-    cm[reg/4] = val;
-    do {
-      val = cm[reg/4];
-    } while (val & IDLEST_MASK);
-  }
-}
-
-static volatile uint32_t *map_port(int fd, size_t length, off_t offset) {
-  return (volatile uint32_t*) mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-}
-
-static int pwm_timers_enable_clocks(int fd) {
-  volatile uint32_t *cm;
-
-  cm = map_port(fd, CM_SIZE, CM_BASE);
-  if (cm == MAP_FAILED) { perror("mmap() CM"); return 0; }
-
-  // Enable the timer clocks
-  pwm_timers_ena_clk(cm, CM_PER_TIMER4_CLKCTRL, 4);
-  pwm_timers_ena_clk(cm, CM_PER_TIMER5_CLKCTRL, 5);
-  pwm_timers_ena_clk(cm, CM_PER_TIMER6_CLKCTRL, 6);
-  pwm_timers_ena_clk(cm, CM_PER_TIMER7_CLKCTRL, 7);
+static bool pwm_timers_enable_clocks() {
+  if (!enable_module_clock(CM_PER_TIMER4_CLKCTRL, "TIMER4")
+      || !enable_module_clock(CM_PER_TIMER5_CLKCTRL, "TIMER5")
+      || !enable_module_clock(CM_PER_TIMER6_CLKCTRL, "TIMER6")
+      || !enable_module_clock(CM_PER_TIMER7_CLKCTRL, "TIMER7"))
+    return false;
 
   // Set all the timer input clocks to 24MHz
-  cm[CLKSEL_TIMER4_CLK/4] = CLKSEL_CLK_M_OSC;
-  cm[CLKSEL_TIMER5_CLK/4] = CLKSEL_CLK_M_OSC;
-  cm[CLKSEL_TIMER6_CLK/4] = CLKSEL_CLK_M_OSC;
-  cm[CLKSEL_TIMER7_CLK/4] = CLKSEL_CLK_M_OSC;
-
-  munmap((void*)cm, CM_SIZE);
-  return 1;
+  write_clock_module(CLKSEL_TIMER4_CLK, CLKSEL_CLK_M_OSC);
+  write_clock_module(CLKSEL_TIMER5_CLK, CLKSEL_CLK_M_OSC);
+  write_clock_module(CLKSEL_TIMER6_CLK, CLKSEL_CLK_M_OSC);
+  write_clock_module(CLKSEL_TIMER7_CLK, CLKSEL_CLK_M_OSC);
+  return true;
 }
 
 bool pwm_timers_map() {
-  bool ret = false;
-  int fd;
+  static const uint32_t timer_base[4] = {
+    TIMER4_BASE, TIMER5_BASE, TIMER6_BASE, TIMER7_BASE
+  };
 
   memset(timers, 0x00, sizeof(*timers));
 
-  fd = open("/dev/mem", O_RDWR);
-  if (fd == -1) { perror("open()"); return ret; }
+  if (!pwm_timers_enable_clocks())
+    return false;
 
-  if (!pwm_timers_enable_clocks(fd))    goto exit;
-
-  timers[0].regs = map_port(fd, TIMER_MMAP_SIZE, TIMER4_BASE);
-  if (timers[0].regs == MAP_FAILED) { perror("mmap() TIMER4"); goto exit; }
-  timers[1].regs = map_port(fd, TIMER_MMAP_SIZE, TIMER5_BASE);
-  if (timers[1].regs == MAP_FAILED) { perror("mmap() TIMER5"); goto exit; }
-  timers[2].regs = map_port(fd, TIMER_MMAP_SIZE, TIMER6_BASE);
-  if (timers[2].regs == MAP_FAILED) { perror("mmap() TIMER6"); goto exit; }
-  timers[3].regs = map_port(fd, TIMER_MMAP_SIZE, TIMER7_BASE);
-  if (timers[3].regs == MAP_FAILED) { perror("mmap() TIMER7"); goto exit; }
-
-  ret = true;
-
- exit:
-  close(fd);
-  if (!ret)
-    pwm_timers_unmap();
-  return ret;
+  for (int i = 0; i < 4; i++) {
+    timers[i].regs = map_registers(timer_base[i], TIMER_MMAP_SIZE);
+    if (timers[i].regs == NULL) {
+      pwm_timers_unmap();
+      return false;
+    }
+  }
+  return true;
 }
 
 void pwm_timers_unmap() {
   int i;
   for (i = 0; i < 4; i++) {
     struct pwm_timer_data *timer = &timers[i];
-    if (timer->regs) munmap((void*)timer->regs, TIMER_MMAP_SIZE);
+    unmap_registers(timer->regs, TIMER_MMAP_SIZE);
     timer->regs = NULL;
   }
 }
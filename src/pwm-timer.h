@@ -29,6 +29,14 @@ void pwm_timer_start(uint32_t gpio_def, bool start);
 void pwm_timer_set_duty(uint32_t gpio_def, float duty_cycle);
 void pwm_timer_set_freq(uint32_t gpio_def, int pwm_freq);
 
+// For a PWM output the PRU sets with each motion segment: start the timer
+// with the lowest duty cycle, and get the physical address of its match
+// register, the match value for a zero duty cycle and the number of timer
+// ticks in a PWM period (the duty cycle is proportional to the ticks added
+// to the zero duty match value). Returns false if not a mapped timer output.
+bool pwm_timer_get_match(uint32_t gpio_def, uint32_t *match_register,
+                         uint32_t *zero_duty_match, uint32_t *period_ticks);
+
 bool pwm_timers_map();
 void pwm_timers_unmap();
 
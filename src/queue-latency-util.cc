@@ -0,0 +1,266 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Stream constant speed segments to the PRU and see how close the host comes
+// to letting the queue run dry, optionally while other threads keep the CPU
+// or the network stack busy. Runs on the hardware; the motors stay disabled,
+// so only the step outputs toggle.
+//
+// Reports
+//  - slack: time of motion left in the queue each time we are about to
+//    enqueue; the minimum is what the host needed to react after waking up.
+//  - pickup: time from handing a segment to the queue until the PRU starts
+//    executing it. Observed by polling, so it has that granularity.
+//  - underruns and late loops, as counted in the machine metrics.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "common/logging.h"
+#include "common/trace.h"
+
+#include "hardware-mapping.h"
+#include "machine-metrics.h"
+#include "motion-queue.h"
+#include "motor-operations.h"
+#include "pru-hardware-interface.h"
+
+// Same as in motor-operations.cc
+#define LOOPS_PER_STEP (1 << 1)
+
+namespace {
+struct Stats {
+  Stats() : count(0), min(0), max(0), sum(0) {}
+  void Add(double value) {
+    if (count == 0 || value < min) min = value;
+    if (count == 0 || value > max) max = value;
+    sum += value;
+    ++count;
+  }
+  void Print(const char *name) const {
+    printf("%-8s %8.3f ms min %8.3f ms avg %8.3f ms max  (%ld samples)\n",
+           name, min, count ? sum / count : 0, max, count);
+  }
+  long count;
+  double min, max, sum;
+};
+
+volatile bool running = true;
+
+// Time a segment was handed to the queue, by slot. Zero: nothing pending.
+volatile uint64_t enqueue_ns[QUEUE_LEN];
+
+struct MonitorArgs {
+  PRUMotionQueue *queue;
+  int poll_us;
+  Stats pickup;
+};
+
+void *MonitorThread(void *arg) {
+  MonitorArgs *const args = (MonitorArgs*) arg;
+  unsigned int last_index = QUEUE_LEN - 1;  // PRU starts at slot 0.
+  while (running) {
+    QueueStatus status;
+    int pending;
+    args->queue->GetQueueStatus(&status, &pending);
+    const uint64_t now = Trace_now_ns();
+    // All slots the PRU got to since we last looked.
+    for (unsigned int slot = (last_index + 1) % QUEUE_LEN; /**/;
+         slot = (slot + 1) % QUEUE_LEN) {
+      const uint64_t start = enqueue_ns[slot];
+      if (start != 0 && now > start) {
+        args->pickup.Add((now - start) / 1e6);
+        enqueue_ns[slot] = 0;
+      }
+      if (slot == status.index) break;
+    }
+    last_index = status.index;
+    usleep(args->poll_us);
+  }
+  return NULL;
+}
+
+// Keeps a CPU busy, with a working set larger than the cache.
+void *CpuStressThread(void *) {
+  const size_t size = 1 << 20;
+  volatile char *buffer = (volatile char*) calloc(size, 1);
+  for (unsigned int i = 0; running; i += 64) {
+    buffer[i % size] += 1;
+  }
+  free((void*) buffer);
+  return NULL;
+}
+
+// Sends UDP packets to itself as fast as possible.
+void *NetworkStressThread(void *) {
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    perror("socket()");
+    return NULL;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;  // Any port; we find out which below.
+  socklen_t addr_len = sizeof(addr);
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+      || getsockname(fd, (struct sockaddr*) &addr, &addr_len) < 0) {
+    perror("bind()");
+    close(fd);
+    return NULL;
+  }
+  char packet[1400] = {};
+  while (running) {
+    sendto(fd, packet, sizeof(packet), 0,
+           (struct sockaddr*) &addr, sizeof(addr));
+    recv(fd, packet, sizeof(packet), 0);
+  }
+  close(fd);
+  return NULL;
+}
+}  // namespace
+
+static int usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [options]\n"
+          "Options:\n"
+          "\t-t <seconds>  : Time to run (Default: 10).\n"
+          "\t-d <ms>       : Duration of one segment (Default: 2).\n"
+          "\t-r <steps/s>  : Step rate (Default: 10000).\n"
+          "\t-l <segments> : Low water mark of the queue (Default: %d).\n"
+          "\t-c <threads>  : Threads to keep the CPU busy (Default: 0).\n"
+          "\t-n <threads>  : Threads sending UDP on loopback (Default: 0).\n"
+          "\t-p <us>       : Poll interval of the PRU status (Default: 50).\n"
+          "Needs to run as root.\n",
+          progname, QUEUE_LEN / 2);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  float seconds = 10;
+  float segment_ms = 2;
+  float rate = 10000;
+  int low_water_mark = QUEUE_LEN / 2;
+  int cpu_threads = 0;
+  int net_threads = 0;
+  int poll_us = 50;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:r:l:c:n:p:")) != -1) {
+    switch (opt) {
+    case 't': seconds = atof(optarg); break;
+    case 'd': segment_ms = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'l': low_water_mark = atoi(optarg); break;
+    case 'c': cpu_threads = atoi(optarg); break;
+    case 'n': net_threads = atoi(optarg); break;
+    case 'p': poll_us = atoi(optarg); break;
+    default: return usage(argv[0]);
+    }
+  }
+  const int steps = rate * segment_ms / 1000;
+  if (seconds <= 0 || steps <= 0 || steps * LOOPS_PER_STEP > MAX_SEGMENT_LOOPS
+      || low_water_mark < 0 || low_water_mark >= QUEUE_LEN
+      || cpu_threads < 0 || net_threads < 0 || poll_us < 0) {
+    fprintf(stderr, "Invalid parameters; a segment needs to have at least "
+            "one step, but not more than fits in one PRU segment.\n");
+    return usage(argv[0]);
+  }
+  segment_ms = 1000.0 * steps / rate;  // What we actually get.
+
+  Log_init("/dev/stderr");
+  HardwareMapping hardware_mapping;
+  if (!hardware_mapping.InitializeHardware())
+    return 1;
+  UioPrussInterface pru_interface;
+  PRUMotionQueue motion_queue(&hardware_mapping, &pru_interface,
+                              low_water_mark);
+  MotionQueueMotorOperations motor_ops(&motion_queue, 1e9);
+  motor_ops.MotorEnable(false);
+
+  std::vector<pthread_t> stress;
+  for (int i = 0; i < cpu_threads + net_threads; ++i) {
+    pthread_t thread;
+    pthread_create(&thread, NULL,
+                   i < cpu_threads ? CpuStressThread : NetworkStressThread,
+                   NULL);
+    stress.push_back(thread);
+  }
+  MonitorArgs monitor;
+  monitor.queue = &motion_queue;
+  monitor.poll_us = poll_us;
+  pthread_t monitor_thread;
+  pthread_create(&monitor_thread, NULL, MonitorThread, &monitor);
+
+  // Each Enqueue() results in exactly one segment in the queue, so we can
+  // follow which slot it lands in.
+  LinearSegmentSteps segment = { rate, rate, 0, {} };
+  segment.steps[0] = steps;
+  const float loops_per_segment = steps * LOOPS_PER_STEP;
+  Stats slack;
+  MachineMetrics before, after;
+  Metrics_get(&before);
+  const uint64_t end = Trace_now_ns() + (uint64_t)(seconds * 1e9);
+  unsigned int slot = 0;
+  for (long i = 0; Trace_now_ns() < end; ++i) {
+    QueueStatus status;
+    int pending;
+    motion_queue.GetQueueStatus(&status, &pending);
+    if (i > 0) {  // Nothing to lose before we started.
+      const float left = pending > 0
+        ? (pending - 1) + status.counter / loops_per_segment
+        : 0;
+      slack.Add(left * segment_ms);
+    }
+    enqueue_ns[slot] = Trace_now_ns();
+    __sync_synchronize();
+    motor_ops.Enqueue(segment);
+    slot = (slot + 1) % QUEUE_LEN;
+  }
+  // Come to a regular stop, so that this doesn't count as underrun.
+  segment.v1 = 0;
+  motor_ops.Enqueue(segment);
+  motor_ops.WaitQueueEmpty();
+  Metrics_get(&after);
+
+  running = false;
+  pthread_join(monitor_thread, NULL);
+  for (size_t i = 0; i < stress.size(); ++i) {
+    pthread_join(stress[i], NULL);
+  }
+  motion_queue.Shutdown(true);
+
+  printf("%d segments of %.3f ms, low water mark %d; "
+         "%d CPU and %d network stress threads\n",
+         (int) (after.segments - before.segments), segment_ms,
+         low_water_mark, cpu_threads, net_threads);
+  slack.Print("slack");
+  monitor.pickup.Print("pickup");
+  printf("underruns %lld, late loops %lld\n",
+         (long long) (after.underruns - before.underruns),
+         (long long) (after.late_loops - before.late_loops));
+  return after.underruns == before.underruns ? 0 : 1;
+}
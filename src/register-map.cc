@@ -0,0 +1,85 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+
+#include "register-map.h"
+
+// Memory space mapped to the Clock Module registers
+#define CM_BASE                 0x44e00000
+#define CM_SIZE                 0x4000
+
+#define IDLEST_MASK             (0x03 << 16)
+#define MODULEMODE_ENABLE       (0x02 << 0)
+
+static int devmem_fd = -1;
+static volatile uint32_t *cm = NULL;
+
+volatile uint32_t *map_registers(uint32_t base, size_t length) {
+  if (devmem_fd < 0) {
+    devmem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (devmem_fd < 0) {
+      Log_error("Can't open /dev/mem: %s", strerror(errno));
+      return NULL;
+    }
+  }
+  void *regs = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    devmem_fd, base);
+  if (regs == MAP_FAILED) {
+    Log_error("mmap() registers at 0x%08x: %s", base, strerror(errno));
+    return NULL;
+  }
+  return (volatile uint32_t*) regs;
+}
+
+void unmap_registers(volatile uint32_t *regs, size_t length) {
+  if (regs) munmap((void*)regs, length);
+}
+
+static bool map_clock_module() {
+  if (cm == NULL) cm = map_registers(CM_BASE, CM_SIZE);
+  return cm != NULL;
+}
+
+bool enable_module_clock(uint32_t clkctrl_reg, const char *name) {
+  if (!map_clock_module()) return false;
+  uint32_t val = cm[clkctrl_reg/4];
+  if (val & IDLEST_MASK) {
+    Log_debug("Enabling %s clock", name);
+    val |= MODULEMODE_ENABLE;
+    cm[clkctrl_reg/4] = val;
+    do {
+      val = cm[clkctrl_reg/4];
+    } while (val & IDLEST_MASK);
+  }
+  return true;
+}
+
+bool write_clock_module(uint32_t reg, uint32_t value) {
+  if (!map_clock_module()) return false;
+  cm[reg/4] = value;
+  return true;
+}
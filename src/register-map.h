@@ -0,0 +1,43 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REGISTER_MAP_H
+#define __REGISTER_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Access to the memory mapped peripheral registers through /dev/mem, shared
+// by the GPIO and the PWM timer code. The device is opened once; the
+// mappings stay valid until unmapped.
+
+// Map "length" bytes of registers at the physical address "base".
+// Returns NULL on failure.
+volatile uint32_t *map_registers(uint32_t base, size_t length);
+void unmap_registers(volatile uint32_t *regs, size_t length);
+
+// Enable the module clock with the given CLKCTRL register offset in the
+// Clock Module and wait until the module is out of idle. The "name" is for
+// debug logging. Returns false if the Clock Module can't be mapped.
+bool enable_module_clock(uint32_t clkctrl_reg, const char *name);
+
+// Write a Clock Module register, e.g. to select a clock source.
+bool write_clock_module(uint32_t reg, uint32_t value);
+
+#endif // __REGISTER_MAP_H
@@ -0,0 +1,306 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "segment-file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "common/logging.h"
+#include "config-parser.h"
+#include "gcode-machine-control.h"
+
+uint64_t SegmentFileKey(const void *data, size_t len, uint64_t seed) {
+  // FNV-1a. Not cryptographic, but good enough to detect changes.
+  const uint8_t *bytes = (const uint8_t *) data;
+  uint64_t hash = seed;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+uint64_t SegmentFileConfigKey(const ConfigParser &config_parser,
+                              const MachineControlConfig &config) {
+  const std::string &content = config_parser.content();
+  uint64_t key = SegmentFileKey(content.data(), content.size());
+  key = SegmentFileKey(&config.speed_factor, sizeof(config.speed_factor), key);
+  key = SegmentFileKey(&config.threshold_angle,
+                       sizeof(config.threshold_angle), key);
+  key = SegmentFileKey(&config.range_check, sizeof(config.range_check), key);
+  // Segments are cut to what the firmware of this build can do at once.
+  const uint32_t max_segment_loops = MAX_SEGMENT_LOOPS;
+  key = SegmentFileKey(&max_segment_loops, sizeof(max_segment_loops), key);
+  return key;
+}
+
+void SegmentMotorSteps(const MotionSegment &segment, MotorsRegister *steps) {
+  // The hardware adds the fraction every loop and emits a step whenever
+  // the top bit flips from 0 to 1.
+  const uint64_t loops = (uint64_t) segment.loops_accel + segment.loops_travel
+    + segment.loops_decel;
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    const int motor_steps = (loops * segment.fractions[i] + (1ULL << 31)) >> 32;
+    (*steps)[i] = (segment.direction_bits & (1 << i)) ? -motor_steps
+      : motor_steps;
+  }
+}
+
+RecordingMotionQueue::RecordingMotionQueue(MotionQueue *delegate)
+  : delegate_(delegate), recording_(false), recorded_raster_(false),
+    repeatable_(true) {
+}
+
+void RecordingMotionQueue::AccountPosition(const MotionSegment &segment) {
+  MotorsRegister steps;
+  SegmentMotorSteps(segment, &steps);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    position_[i] += steps[i];
+  }
+}
+
+void RecordingMotionQueue::Enqueue(MotionSegment *segment) {
+  if (segment->state != STATE_EXIT) {
+    AccountPosition(*segment);
+    if (recording_) recorded_.push_back(*segment);
+  }
+  delegate_->Enqueue(segment);  // Might modify segment; do this last.
+}
+
+void RecordingMotionQueue::EnqueueMany(MotionSegment *segments, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (segments[i].state == STATE_EXIT) continue;
+    AccountPosition(segments[i]);
+    if (recording_) recorded_.push_back(segments[i]);
+  }
+  delegate_->EnqueueMany(segments, count);
+}
+
+bool RecordingMotionQueue::EnqueueRaster(MotionSegment *segment,
+                                         const uint16_t *pwm, int count) {
+  const MotionSegment copy = *segment;
+  if (!delegate_->EnqueueRaster(segment, pwm, count))
+    return false;  // Caller sends individual segments instead.
+  AccountPosition(copy);
+  if (recording_) recorded_raster_ = true;
+  return true;
+}
+
+bool RecordingMotionQueue::GetProbeStepsSkipped(MotorsRegister *skipped) {
+  const bool triggered = delegate_->GetProbeStepsSkipped(skipped);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    position_[i] -= (*skipped)[i];
+  }
+  return triggered;
+}
+
+void RecordingMotionQueue::StartRecording() {
+  recorded_.clear();
+  recording_start_ = position_;
+  recording_ = true;
+  recorded_raster_ = false;
+  repeatable_ = true;
+}
+
+bool RecordingMotionQueue::StopRecording() {
+  recording_ = false;
+  return recording_start_ == position_ && !recorded_raster_ && repeatable_;
+}
+
+bool WriteSegmentFile(const char *filename, uint64_t key, uint64_t config_key,
+                      const MotorsRegister &start_position,
+                      const std::vector<MotionSegment> &segments) {
+  SegmentFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SEGMENT_FILE_MAGIC, sizeof(header.magic));
+  header.version = SEGMENT_FILE_VERSION;
+  header.segment_size = sizeof(MotionSegment);
+  header.key = key;
+  header.config_key = config_key;
+  header.segment_count = segments.size();
+
+  std::vector<SegmentFileCheckpoint> checkpoints;
+  MotorsRegister position = start_position;
+  MotorsRegister steps;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const MotionSegment &segment = segments[i];
+    if (checkpoints.empty()
+        || checkpoints.back().aux_bits != segment.aux
+        || i - checkpoints.back().segment_index
+        >= SEGMENT_FILE_CHECKPOINT_INTERVAL) {
+      SegmentFileCheckpoint checkpoint;
+      memset(&checkpoint, 0, sizeof(checkpoint));
+      checkpoint.segment_index = i;
+      checkpoint.aux_bits = segment.aux;
+      for (int m = 0; m < MOTION_MOTOR_COUNT; ++m) {
+        checkpoint.position[m] = position[m];
+      }
+      checkpoints.push_back(checkpoint);
+    }
+    SegmentMotorSteps(segment, &steps);
+    for (int m = 0; m < MOTION_MOTOR_COUNT; ++m) {
+      position[m] += steps[m];
+    }
+  }
+  header.checkpoint_count = checkpoints.size();
+  for (int m = 0; m < MOTION_MOTOR_COUNT; ++m) {
+    header.start_position[m] = start_position[m];
+    header.end_position[m] = position[m];
+  }
+
+  // Write to a temporary file first, so that concurrent readers never see
+  // a partial file.
+  const std::string tmp_name = std::string(filename) + ".tmp";
+  FILE *out = fopen(tmp_name.c_str(), "wb");
+  if (out == NULL) {
+    Log_error("Can't write segment file %s: %s", tmp_name.c_str(),
+              strerror(errno));
+    return false;
+  }
+  bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+  if (success && !segments.empty()) {
+    success = fwrite(&segments[0], sizeof(MotionSegment), segments.size(),
+                     out) == segments.size();
+  }
+  if (success && !checkpoints.empty()) {
+    success = fwrite(&checkpoints[0], sizeof(SegmentFileCheckpoint),
+                     checkpoints.size(), out) == checkpoints.size();
+  }
+  success &= (fclose(out) == 0);
+  if (success && rename(tmp_name.c_str(), filename) != 0) {
+    success = false;
+  }
+  if (!success) {
+    Log_error("Writing segment file %s failed: %s", filename, strerror(errno));
+    unlink(tmp_name.c_str());
+  }
+  return success;
+}
+
+SegmentFile::SegmentFile()
+  : data_(NULL), size_(0), header_(NULL), segments_(NULL), checkpoints_(NULL) {
+}
+
+SegmentFile::~SegmentFile() { Close(); }
+
+void SegmentFile::Close() {
+  if (data_) munmap(data_, size_);
+  data_ = NULL;
+  size_ = 0;
+  header_ = NULL;
+  segments_ = NULL;
+  checkpoints_ = NULL;
+}
+
+// The checkpoints need to cut the segments into consecutive chunks that
+// start at the first segment and are at most SEGMENT_FILE_CHECKPOINT_INTERVAL
+// long; replay relies on that.
+static bool ValidCheckpoints(const SegmentFileHeader *header,
+                             const SegmentFileCheckpoint *checkpoints) {
+  if (header->checkpoint_count == 0)
+    return header->segment_count == 0;
+  if (checkpoints[0].segment_index != 0)
+    return false;
+  for (uint32_t c = 1; c <= header->checkpoint_count; ++c) {
+    const uint32_t begin = checkpoints[c-1].segment_index;
+    const uint32_t end = (c < header->checkpoint_count)
+      ? checkpoints[c].segment_index
+      : header->segment_count;
+    if (end <= begin || end - begin > SEGMENT_FILE_CHECKPOINT_INTERVAL)
+      return false;
+  }
+  return true;
+}
+
+bool SegmentFile::Open(const char *filename) {
+  Close();
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;  // Typically: not there (yet).
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SegmentFileHeader)) {
+    close(fd);
+    return false;
+  }
+  // Private writable mapping: the queue might modify segments on Enqueue().
+  void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    Log_error("Can't mmap segment file %s: %s", filename, strerror(errno));
+    return false;
+  }
+  data_ = data;
+  size_ = st.st_size;
+
+  const SegmentFileHeader *header = (const SegmentFileHeader *) data;
+  const bool valid = (memcmp(header->magic, SEGMENT_FILE_MAGIC,
+                             sizeof(header->magic)) == 0
+                      && header->version == SEGMENT_FILE_VERSION
+                      && header->segment_size == sizeof(MotionSegment)
+                      && (size_ == (sizeof(SegmentFileHeader)
+                                    + (uint64_t) header->segment_count
+                                    * sizeof(MotionSegment)
+                                    + (uint64_t) header->checkpoint_count
+                                    * sizeof(SegmentFileCheckpoint))));
+  if (!valid) {
+    Close();
+    return false;
+  }
+  header_ = header;
+  segments_ = (MotionSegment *) (header + 1);
+  checkpoints_ = (const SegmentFileCheckpoint *) (segments_
+                                                  + header->segment_count);
+  if (!ValidCheckpoints(header_, checkpoints_)) {
+    Log_error("%s: broken checkpoint table.", filename);
+    Close();
+    return false;
+  }
+  madvise(data_, size_, MADV_SEQUENTIAL);
+  return true;
+}
+
+bool RecordingMotionQueue::WriteFile(const char *filename, uint64_t key,
+                                     uint64_t config_key) const {
+  return WriteSegmentFile(filename, key, config_key,
+                          recording_start_, recorded_);
+}
+
+bool RecordingMotionQueue::Replay(const char *filename, uint64_t key) {
+  SegmentFile file;
+  if (!file.Open(filename) || file.header().key != key)
+    return false;
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    if (file.header().start_position[i] != position_[i])
+      return false;
+  }
+  delegate_->EnqueueMany(file.segments(), file.header().segment_count);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    position_[i] = file.header().end_position[i];
+  }
+  return true;
+}
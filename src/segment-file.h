@@ -0,0 +1,193 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_SEGMENT_FILE_H_
+#define _BEAGLEG_SEGMENT_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "motion-queue.h"
+
+class ConfigParser;
+struct MachineControlConfig;
+
+// Files with a recorded stream of MotionSegments, as they were sent to the
+// hardware. Replaying such a file skips parsing and planning entirely.
+//
+// The file starts with a SegmentFileHeader, followed by the raw segments,
+// followed by the checkpoints. All values are stored little endian, the
+// native byte order of x86 as well as the BeagleBone, so files can be
+// created on a workstation and be replayed on the machine.
+#define SEGMENT_FILE_MAGIC   "BGSEGMNT"
+#define SEGMENT_FILE_VERSION 3
+
+// A checkpoint is inserted at least every so many segments.
+#define SEGMENT_FILE_CHECKPOINT_INTERVAL 1024
+
+struct SegmentFileHeader {
+  char magic[8];             // SEGMENT_FILE_MAGIC
+  uint32_t version;          // SEGMENT_FILE_VERSION
+  uint32_t segment_size;     // sizeof(MotionSegment)
+  uint64_t key;              // Identifies what the segments were created from.
+  uint64_t config_key;       // Configuration the segments were planned with.
+  int32_t start_position[MOTION_MOTOR_COUNT];  // Motor steps at start.
+  int32_t end_position[MOTION_MOTOR_COUNT];    // Motor steps at end.
+  uint32_t segment_count;
+  uint32_t checkpoint_count;
+};
+
+// Position and aux bits right before the segment with "segment_index" is
+// executed. There is a checkpoint at the first segment, whenever the
+// aux bits change and at least every SEGMENT_FILE_CHECKPOINT_INTERVAL.
+struct SegmentFileCheckpoint {
+  uint32_t segment_index;
+  uint16_t aux_bits;
+  uint16_t reserved;
+  int32_t position[MOTION_MOTOR_COUNT];
+};
+
+// Hash "len" bytes of "data" into a key for segment files. Call repeatedly
+// with the previous result as "seed" to combine multiple inputs.
+uint64_t SegmentFileKey(const void *data, size_t len,
+                        uint64_t seed = 0xcbf29ce484222325ULL);
+
+// Key of everything besides the GCode that influences planning: the
+// content of the configuration file and command line overrides.
+uint64_t SegmentFileConfigKey(const ConfigParser &config_parser,
+                              const MachineControlConfig &config);
+
+// Number of steps the given segment moves each motor. Negative for
+// motors moving backwards.
+void SegmentMotorSteps(const MotionSegment &segment, MotorsRegister *steps);
+
+// Write "segments" that start at "start_position" to "filename".
+// Returns true on success.
+bool WriteSegmentFile(const char *filename, uint64_t key, uint64_t config_key,
+                      const MotorsRegister &start_position,
+                      const std::vector<MotionSegment> &segments);
+
+// A segment file, mapped into memory.
+class SegmentFile {
+public:
+  SegmentFile();
+  ~SegmentFile();
+
+  // Map the given file. Returns false if it can't be read or is not a
+  // segment file of the expected version.
+  bool Open(const char *filename);
+
+  const SegmentFileHeader &header() const { return *header_; }
+
+  // The segments are a private copy-on-write mapping, so can be handed
+  // to a MotionQueue that modifies them.
+  MotionSegment *segments() const { return segments_; }
+  const SegmentFileCheckpoint *checkpoints() const { return checkpoints_; }
+
+private:
+  void Close();
+
+  void *data_;
+  size_t size_;
+  const SegmentFileHeader *header_;
+  MotionSegment *segments_;
+  const SegmentFileCheckpoint *checkpoints_;
+
+  SegmentFile(const SegmentFile&);             // No copy.
+  SegmentFile &operator=(const SegmentFile&);
+};
+
+// MotionQueue that passes all segments on to a delegate while keeping track
+// of the motor position they result in. For some stretch, segments can be
+// recorded and written to a segment file; such a file can later be replayed
+// into the delegate if it starts at the current position.
+class RecordingMotionQueue : public MotionQueue {
+public:
+  // Does not take ownership of "delegate".
+  explicit RecordingMotionQueue(MotionQueue *delegate);
+
+  virtual void Enqueue(MotionSegment *segment);
+  virtual void EnqueueMany(MotionSegment *segments, int count);
+  virtual void WaitQueueEmpty() { delegate_->WaitQueueEmpty(); }
+  virtual bool IsFull(int slots) { return delegate_->IsFull(slots); }
+  virtual void MotorEnable(bool on) { delegate_->MotorEnable(on); }
+  virtual void Shutdown(bool flush_queue) { delegate_->Shutdown(flush_queue); }
+  virtual void Abort() { delegate_->Abort(); }
+  virtual void GetMotorsLoops(MotorsRegister *absolute_pos_loops) {
+    delegate_->GetMotorsLoops(absolute_pos_loops);
+  }
+  virtual bool SetSpeedOverride(float factor) {
+    return delegate_->SetSpeedOverride(factor);
+  }
+  virtual void SetSpeedOverrideRamp(float stop_seconds) {
+    delegate_->SetSpeedOverrideRamp(stop_seconds);
+  }
+  virtual void SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {
+    delegate_->SetProbeSwitch(gpio_def, trigger_level);
+  }
+  virtual bool GetProbeStepsSkipped(MotorsRegister *skipped);
+  virtual bool SetMotionPWMOutput(uint32_t gpio_def) {
+    return delegate_->SetMotionPWMOutput(gpio_def);
+  }
+  // Passed on, but not recorded: segment files have no room for the pwm
+  // values. A recording that saw a raster can't be repeated.
+  virtual bool EnqueueRaster(MotionSegment *segment,
+                             const uint16_t *pwm, int count);
+
+  // Start recording segments from now on. Forgets previous recordings.
+  void StartRecording();
+
+  // Something happened outside of the motion queue while recording, such
+  // as a dwell or a spindle change; replaying the segments alone would skip
+  // it, so the recording can't be repeated.
+  void MarkNotRepeatable() { repeatable_ = false; }
+
+  // Stop recording. Returns true if the recorded segments end at the
+  // same position they started, contain no rasters and were not marked
+  // otherwise, so can be repeated any number of times.
+  bool StopRecording();
+
+  int recorded_count() const { return recorded_.size(); }
+
+  // Motor position in steps, as sum of all segments that passed through.
+  const MotorsRegister &position() const { return position_; }
+
+  // Write the recorded segments to "filename" with the given keys.
+  // Returns true on success.
+  bool WriteFile(const char *filename, uint64_t key, uint64_t config_key) const;
+
+  // Send the segments from the file to the delegate. Only does so if the
+  // file has the expected "key" and starts at the current position.
+  // Returns false if the file can't be used, without sending anything.
+  bool Replay(const char *filename, uint64_t key);
+
+private:
+  void AccountPosition(const MotionSegment &segment);
+
+  MotionQueue *const delegate_;
+  MotorsRegister position_;
+  bool recording_;
+  bool recorded_raster_;
+  bool repeatable_;
+  MotorsRegister recording_start_;
+  std::vector<MotionSegment> recorded_;
+};
+
+#endif  // _BEAGLEG_SEGMENT_FILE_H_
@@ -0,0 +1,263 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "segment-file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "motor-operations.h"
+
+// Motion queue that just collects what it gets.
+class CollectingMotionQueue : public MotionQueue {
+public:
+  void Enqueue(MotionSegment *segment) { segments.push_back(*segment); }
+  void WaitQueueEmpty() {}
+  void MotorEnable(bool on) {}
+  void Shutdown(bool flush_queue) {}
+  void GetMotorsLoops(MotorsRegister *absolute_pos_loops) {}
+  bool SetMotionPWMOutput(uint32_t gpio_def) {
+    pwm_gpio = gpio_def;
+    return true;
+  }
+  bool EnqueueRaster(MotionSegment *segment, const uint16_t *pwm, int count) {
+    rasters.push_back(*segment);
+    return true;
+  }
+
+  std::vector<MotionSegment> segments;
+  std::vector<MotionSegment> rasters;
+  uint32_t pwm_gpio = 0;
+};
+
+class TempFile {
+public:
+  TempFile() {
+    char name[] = "/tmp/segment-file_test.XXXXXX";
+    int fd = mkstemp(name);
+    close(fd);
+    filename_ = name;
+  }
+  ~TempFile() { unlink(filename_.c_str()); }
+  const char *filename() const { return filename_.c_str(); }
+
+private:
+  std::string filename_;
+};
+
+// Move motor 0 forward and back again.
+static void BackAndForth(MotorOperations *motor_ops, int steps) {
+  LinearSegmentSteps forth = { 0, 5000, 0, {steps, steps / 2} };
+  motor_ops->Enqueue(forth);
+  LinearSegmentSteps back = { 5000, 0, 0, {-steps, -steps / 2} };
+  motor_ops->Enqueue(back);
+}
+
+TEST(SegmentFile, PositionFollowsSegments) {
+  CollectingMotionQueue collector;
+  RecordingMotionQueue queue(&collector);
+  MotionQueueMotorOperations motor_ops(&queue);
+  LinearSegmentSteps move = { 1000, 1000, 0, {20000000, -777, 3} };
+  motor_ops.Enqueue(move);
+  EXPECT_GT((int)collector.segments.size(), 1);  // Split in multiple.
+  EXPECT_EQ(20000000, queue.position()[0]);
+  EXPECT_EQ(-777, queue.position()[1]);
+  EXPECT_EQ(3, queue.position()[2]);
+}
+
+TEST(SegmentFile, RecordAndReplay) {
+  TempFile tmp;
+  CollectingMotionQueue collector;
+  RecordingMotionQueue queue(&collector);
+  MotionQueueMotorOperations motor_ops(&queue);
+
+  queue.StartRecording();
+  BackAndForth(&motor_ops, 1234);
+  EXPECT_TRUE(queue.StopRecording());   // Back at start.
+  const std::vector<MotionSegment> original = collector.segments;
+  ASSERT_EQ((int)original.size(), queue.recorded_count());
+  EXPECT_TRUE(queue.WriteFile(tmp.filename(), 42, 7));
+
+  collector.segments.clear();
+  EXPECT_FALSE(queue.Replay(tmp.filename(), 43));  // Wrong key.
+  EXPECT_TRUE(collector.segments.empty());
+
+  EXPECT_TRUE(queue.Replay(tmp.filename(), 42));
+  ASSERT_EQ(original.size(), collector.segments.size());
+  for (size_t i = 0; i < original.size(); ++i) {
+    EXPECT_EQ(0, memcmp(&original[i], &collector.segments[i],
+                        sizeof(MotionSegment))) << i;
+  }
+}
+
+TEST(SegmentFile, ReplayOnlyAtRecordedStartPosition) {
+  TempFile tmp;
+  CollectingMotionQueue collector;
+  RecordingMotionQueue queue(&collector);
+  MotionQueueMotorOperations motor_ops(&queue);
+
+  queue.StartRecording();
+  BackAndForth(&motor_ops, 1000);
+  EXPECT_TRUE(queue.StopRecording());
+  EXPECT_TRUE(queue.WriteFile(tmp.filename(), 1, 7));
+
+  LinearSegmentSteps move = { 1000, 1000, 0, {10} };
+  motor_ops.Enqueue(move);
+  EXPECT_FALSE(queue.Replay(tmp.filename(), 1));
+
+  // Not returning to the start can't be simply repeated.
+  queue.StartRecording();
+  motor_ops.Enqueue(move);
+  EXPECT_FALSE(queue.StopRecording());
+}
+
+TEST(SegmentFile, RastersArePassedOnButNotRepeatable) {
+  CollectingMotionQueue collector;
+  RecordingMotionQueue queue(&collector);
+  MotionQueueMotorOperations motor_ops(&queue);
+
+  EXPECT_TRUE(queue.SetMotionPWMOutput(42));
+  EXPECT_EQ(42u, collector.pwm_gpio);
+
+  MotionSegment raster;
+  memset(&raster, 0, sizeof(raster));
+  raster.state = STATE_FILLED;
+  raster.loops_travel = 20;
+  raster.fractions[0] = 0x7fffffff;   // Ten steps.
+  const uint16_t pwm[] = { 0, 100, 200 };
+
+  queue.StartRecording();
+  EXPECT_TRUE(queue.EnqueueRaster(&raster, pwm, 3));
+  EXPECT_EQ(1u, collector.rasters.size());
+  EXPECT_EQ(10, queue.position()[0]);
+  LinearSegmentSteps back = { 1000, 1000, 0, {-10} };
+  motor_ops.Enqueue(back);
+  EXPECT_EQ(0, queue.position()[0]);
+  EXPECT_EQ(1, queue.recorded_count());   // Only the move back.
+  EXPECT_FALSE(queue.StopRecording());
+}
+
+// Anything that happened outside the queue while recording, like a dwell,
+// would be skipped by a replay.
+TEST(SegmentFile, MarkedRecordingIsNotRepeatable) {
+  CollectingMotionQueue collector;
+  RecordingMotionQueue queue(&collector);
+  MotionQueueMotorOperations motor_ops(&queue);
+
+  queue.StartRecording();
+  BackAndForth(&motor_ops, 1000);
+  queue.MarkNotRepeatable();
+  EXPECT_FALSE(queue.StopRecording());
+
+  queue.StartRecording();  // Forgets the mark.
+  BackAndForth(&motor_ops, 1000);
+  EXPECT_TRUE(queue.StopRecording());
+}
+
+TEST(SegmentFile, CheckpointsAtAuxChangesAndInterval) {
+  TempFile tmp;
+  std::vector<MotionSegment> segments(3 * SEGMENT_FILE_CHECKPOINT_INTERVAL);
+  for (size_t i = 0; i < segments.size(); ++i) {
+    memset(&segments[i], 0, sizeof(MotionSegment));
+    segments[i].state = STATE_FILLED;
+    segments[i].loops_travel = 2;
+    segments[i].fractions[0] = 0x7fffffff;   // One step per segment.
+    segments[i].aux = (i >= 10) ? 0x01 : 0x00;
+  }
+  MotorsRegister start;
+  start[0] = 100;
+  ASSERT_TRUE(WriteSegmentFile(tmp.filename(), 1, 2, start, segments));
+
+  SegmentFile file;
+  ASSERT_TRUE(file.Open(tmp.filename()));
+  const SegmentFileHeader &header = file.header();
+  EXPECT_EQ(2u, header.config_key);
+  EXPECT_EQ(segments.size(), header.segment_count);
+  EXPECT_EQ(100, header.start_position[0]);
+  EXPECT_EQ(100 + (int)segments.size(), header.end_position[0]);
+
+  // Start, aux change at 10, then every interval after that.
+  ASSERT_EQ(4u, header.checkpoint_count);
+  const SegmentFileCheckpoint *checkpoints = file.checkpoints();
+  EXPECT_EQ(0u, checkpoints[0].segment_index);
+  EXPECT_EQ(10u, checkpoints[1].segment_index);
+  EXPECT_EQ(0x01, checkpoints[1].aux_bits);
+  EXPECT_EQ(110, checkpoints[1].position[0]);
+  EXPECT_EQ(10u + SEGMENT_FILE_CHECKPOINT_INTERVAL,
+            checkpoints[2].segment_index);
+  EXPECT_EQ(0, memcmp(&segments[0], file.segments(),
+                      segments.size() * sizeof(MotionSegment)));
+}
+
+// Overwrite the segment_index of checkpoint "c" in the file.
+static void PatchCheckpointIndex(const char *filename, uint32_t c,
+                                 uint32_t segment_index) {
+  off_t offset;
+  {
+    SegmentFile file;
+    ASSERT_TRUE(file.Open(filename));
+    ASSERT_LT(c, file.header().checkpoint_count);
+    offset = sizeof(SegmentFileHeader)
+      + file.header().segment_count * sizeof(MotionSegment)
+      + c * sizeof(SegmentFileCheckpoint);
+  }
+  FILE *f = fopen(filename, "r+b");
+  ASSERT_TRUE(f != NULL);
+  fseek(f, offset, SEEK_SET);
+  fwrite(&segment_index, sizeof(segment_index), 1, f);
+  fclose(f);
+}
+
+TEST(SegmentFile, RejectBrokenCheckpointTable) {
+  std::vector<MotionSegment> segments(2 * SEGMENT_FILE_CHECKPOINT_INTERVAL);
+  for (size_t i = 0; i < segments.size(); ++i) {
+    memset(&segments[i], 0, sizeof(MotionSegment));
+    segments[i].state = STATE_FILLED;
+    segments[i].loops_travel = 2;
+  }
+  MotorsRegister start;
+  // Checkpoints at 0 and SEGMENT_FILE_CHECKPOINT_INTERVAL.
+  const uint32_t broken[][2] = {
+    { 0, 1 },   // Not starting at the first segment.
+    { 1, 0 },   // Not increasing.
+    { 1, 2 * SEGMENT_FILE_CHECKPOINT_INTERVAL },  // Beyond the segments.
+    { 1, SEGMENT_FILE_CHECKPOINT_INTERVAL + 1 },  // Gap too large.
+  };
+  for (const auto &b : broken) {
+    TempFile tmp;
+    ASSERT_TRUE(WriteSegmentFile(tmp.filename(), 1, 2, start, segments));
+    PatchCheckpointIndex(tmp.filename(), b[0], b[1]);
+    SegmentFile file;
+    EXPECT_FALSE(file.Open(tmp.filename())) << b[0] << ": " << b[1];
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
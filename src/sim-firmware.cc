@@ -161,10 +161,17 @@ static double euclid(double x, double y, double z) {
   return sqrt(x*x + y*y + z*z);
 }
 
-// This simulates what happens in the PRU. For testing purposes.
 void SimFirmwareQueue::Enqueue(MotionSegment *segment) {
   if (segment->state == STATE_EXIT)
     return;
+  if (format_ == FORMAT_GNUPLOT)
+    SimulateLoops(segment);
+  else
+    SimulatePhases(*segment);
+}
+
+// This simulates what happens in the PRU. For testing purposes.
+void SimFirmwareQueue::SimulateLoops(MotionSegment *segment) {
   // setting output direction according to segment->direction_bits;
 
   bzero(&state, sizeof(state));
@@ -179,9 +186,6 @@ void SimFirmwareQueue::Enqueue(MotionSegment *segment) {
                                       motor_speeds[Y_MOTOR],
                                       motor_speeds[Z_MOTOR]);
 
-#if JERK_EXPERIMENT
-  uint32_t jerk_index = 1;
-#endif
   bool is_first = true;
   uint32_t remainder = 0;
   const char *msg = "";
@@ -207,35 +211,7 @@ void SimFirmwareQueue::Enqueue(MotionSegment *segment) {
     // for display purposes.
     double hires_delay = 0;
 
-#if JERK_EXPERIMENT
-    if (segment->jerk_start > 0) {
-      if (is_first) {
-        msg = "# jerk";
-        fprintf(stderr, "jerk start: jerk-timer-cycles=%.3f\n",
-                segment->jerk_motion);
-        is_first = false;
-      }
-      // TODO: index 0 ?
-      // TODO: is it 2* ?
-      segment->jerk_motion -= 2*segment->jerk_motion / ((3 * jerk_index) + 1);
-      --segment->jerk_start;
-      ++jerk_index;
-      delay_loops = segment->jerk_motion;
-      hires_delay = segment->jerk_motion;
-      if (hires_delay < 0) {
-        fprintf(stderr, "Got less than 0 at index %d\n", jerk_index);
-        segment->jerk_start = 0;
-        hires_delay = delay_loops = 30000;
-      }
-      if (segment->jerk_start == 0) {
-        fprintf(stderr, "jerk end  : jerk-timer-cycles=%.3f\n",
-                segment->jerk_motion);
-        is_first = true;
-      }
-    }
-    else
-#endif
-      if (segment->loops_accel > 0) {
+    if (segment->loops_accel > 0) {
       if (is_first) {
         msg = "# accel.";
         fprintf(stderr, "SIM: Accel start _/ : accel-series-idx=%5u, "
@@ -319,23 +295,186 @@ void SimFirmwareQueue::Enqueue(MotionSegment *segment) {
   }
 }
 
-SimFirmwareQueue::SimFirmwareQueue(FILE *out, int relevant_motors)
+// Number of loops the acceleration series needs from index 0 to "index"
+// is proportional to sqrt(index), so the delay of the loop at "index" is
+// about scale * (sqrt(index + 1) - sqrt(index)). Returns "scale".
+static double SeriesScale(double delay_cycles, uint32_t index) {
+  return delay_cycles / (sqrt(index + 1.0) - sqrt((double) index));
+}
+
+// Instead of going through every loop, determine the time each phase
+// takes from the closed form of the acceleration series. Not exact to the
+// cycle like TimingMotionQueue, but close, and independent of the number
+// of loops.
+void SimFirmwareQueue::SimulatePhases(const MotionSegment &segment) {
+  double motor_speeds[MOTION_MOTOR_COUNT];
+  const double div = 1.0 * 2147483647u;   // Same as in SimulateLoops()
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    motor_speeds[i] = segment.fractions[i] / div;
+  }
+  const double euklid_factor = euclid(motor_speeds[X_MOTOR],
+                                      motor_speeds[Y_MOTOR],
+                                      motor_speeds[Z_MOTOR]);
+
+  const double hires_delay = 1.0 * segment.hires_accel_cycles
+    / (1 << DELAY_CYCLE_SHIFT);
+  uint32_t index = segment.accel_series_index;
+  double scale = SeriesScale(hires_delay, index);
+  uint64_t loops_done = 0;  // in this segment.
+
+  const struct {
+    char phase;
+    uint32_t loops;
+  } phases[] = {
+    { 'a', segment.loops_accel },
+    { 't', segment.loops_travel },
+    { 'd', segment.loops_decel },
+  };
+  for (const auto &p : phases) {
+    if (p.loops == 0) continue;
+    const double accel = 2.0 * TIMER_FREQUENCY * TIMER_FREQUENCY
+      / (scale * scale) / LOOPS_PER_STEP;
+    const int step = decimation_ > 0 ? decimation_ : p.loops;
+    for (uint64_t k = 0; /**/; k += step) {
+      if (k > p.loops) k = p.loops;   // Always end with the phase boundary.
+      double t_cycles, delay, a;
+      switch (p.phase) {
+      case 'a':
+        t_cycles = scale * (sqrt(1.0 * index + k) - sqrt(1.0 * index));
+        delay = scale * (sqrt(1.0 * index + k + 1) - sqrt(1.0 * index + k));
+        a = accel;
+        break;
+      case 't':
+        t_cycles = 1.0 * k * segment.travel_delay_cycles;
+        delay = segment.travel_delay_cycles;
+        a = 0;
+        break;
+      default: {
+        const double remaining = (index > k) ? index - k : 0;
+        t_cycles = scale * (sqrt(1.0 * index) - sqrt(remaining));
+        delay = scale * (sqrt(remaining + 1) - sqrt(remaining));
+        a = -accel;
+      }
+      }
+      int32_t steps[MOTION_MOTOR_COUNT];
+      for (int i = 0; i < relevant_motors_; ++i) {
+        // The step happens when the top bit of the accumulator flips to 1.
+        const int32_t s = ((loops_done + k) * segment.fractions[i]
+                           + (1ULL << 31)) >> 32;
+        steps[i] = steps_[i]
+          + (((1 << i) & segment.direction_bits) ? -s : s);
+      }
+      const double velocity = TIMER_FREQUENCY / (delay * LOOPS_PER_STEP);
+      WriteSample(time_ + t_cycles / TIMER_FREQUENCY, p.phase,
+                  euklid_factor * velocity, euklid_factor * a, steps);
+      if (k == p.loops) {
+        time_ += t_cycles / TIMER_FREQUENCY;
+        break;
+      }
+    }
+    loops_done += p.loops;
+    if (p.phase == 'a') index += p.loops;
+    if (p.phase == 'd') index = (index > p.loops) ? index - p.loops : 0;
+  }
+
+  for (int i = 0; i < relevant_motors_; ++i) {
+    const int32_t s = (loops_done * segment.fractions[i] + (1ULL << 31)) >> 32;
+    steps_[i] += ((1 << i) & segment.direction_bits) ? -s : s;
+  }
+}
+
+void SimFirmwareQueue::WriteSample(double time, char phase,
+                                   double speed, double accel,
+                                   const int32_t *steps) {
+  if (format_ == FORMAT_BINARY) {
+    const float speed_f = speed, accel_f = accel;
+    const uint8_t phase_byte = phase;
+    fwrite(&time, sizeof(time), 1, out_);
+    fwrite(&speed_f, sizeof(speed_f), 1, out_);
+    fwrite(&accel_f, sizeof(accel_f), 1, out_);
+    fwrite(&phase_byte, sizeof(phase_byte), 1, out_);
+    fwrite(steps, sizeof(int32_t), relevant_motors_, out_);
+    return;
+  }
+  fprintf(out_, "%.9f,%c,%.4f,%.4f", time, phase, speed, accel);
+  for (int i = 0; i < relevant_motors_; ++i) {
+    fprintf(out_, ",%d", steps[i]);
+  }
+  fputc('\n', out_);
+}
+
+SimFirmwareQueue::SimFirmwareQueue(FILE *out, int relevant_motors,
+                                   Format format, int decimation)
   : out_(out),
     relevant_motors_(relevant_motors < MOTION_MOTOR_COUNT
                      ? relevant_motors
                      : MOTION_MOTOR_COUNT),
-    averager_(new Averager()) {
-  // Total time; speed; acceleration; delay_loops. [steps walked for all motors].
-  printf("%12s %10s %12s %12s      ", "time", "timer-loop", "Euclid-speed", "Euclid-accel");
-  for (int i = 0; i < relevant_motors_; ++i) {
-    fprintf(out_, "%4s%d %9s%d %11s%d ",
-            "s", i,
-            "v", i,
-            "a", i);
+    format_(format), decimation_(decimation),
+    averager_(new Averager()), time_(0) {
+  bzero(steps_, sizeof(steps_));
+  switch (format_) {
+  case FORMAT_GNUPLOT:
+    // Total time; speed; acceleration; delay_loops. [steps walked for all motors].
+    fprintf(out_, "%12s %10s %12s %12s      ",
+            "time", "timer-loop", "Euclid-speed", "Euclid-accel");
+    for (int i = 0; i < relevant_motors_; ++i) {
+      fprintf(out_, "%4s%d %9s%d %11s%d ",
+              "s", i,
+              "v", i,
+              "a", i);
+    }
+    fprintf(out_, "\n");
+    break;
+  case FORMAT_CSV:
+    fprintf(out_, "time,phase,speed,accel");
+    for (int i = 0; i < relevant_motors_; ++i) {
+      fprintf(out_, ",steps_%d", i);
+    }
+    fprintf(out_, "\n");
+    break;
+  case FORMAT_BINARY:
+    break;
   }
-  fprintf(out_, "\n");
 }
 
 SimFirmwareQueue::~SimFirmwareQueue() {
   delete averager_;
 }
+
+// Same calculation as SimFirmwareQueue::Enqueue() or the PRU does. The
+// PRU corrects each delay for the cycles spent in its own computation,
+// so every loop takes exactly the number of timer cycles calculated.
+void TimingMotionQueue::Enqueue(MotionSegment *segment) {
+  if (segment->state == STATE_EXIT)
+    return;
+  ++segment_count_;
+
+  uint64_t cycles = 0;
+  uint32_t hires_cycles = segment->hires_accel_cycles;
+  uint32_t series_index = segment->accel_series_index;
+  uint32_t remainder = 0;
+
+  for (int i = segment->loops_accel; i > 0; --i) {
+    if (series_index != 0) {
+      const uint32_t divident = (hires_cycles << 1) + remainder;
+      const uint32_t divisor = (series_index << 2) + 1;
+      hires_cycles -= (divident / divisor);
+      remainder = divident % divisor;
+    }
+    ++series_index;
+    cycles += hires_cycles >> DELAY_CYCLE_SHIFT;
+  }
+
+  cycles += (uint64_t) segment->loops_travel * segment->travel_delay_cycles;
+
+  for (int i = segment->loops_decel; i > 0; --i) {
+    const uint32_t divident = (hires_cycles << 1) + remainder;
+    const uint32_t divisor = (series_index << 2) - 1;
+    hires_cycles += (divident / divisor);
+    remainder = divident % divisor;
+    --series_index;
+    cycles += hires_cycles >> DELAY_CYCLE_SHIFT;
+  }
+
+  total_time_ += 1.0 * cycles / TIMER_FREQUENCY;
+}
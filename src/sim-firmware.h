@@ -23,7 +23,25 @@
 
 class SimFirmwareQueue : public MotionQueue {
 public:
-  SimFirmwareQueue(FILE *out, int relevant_motors = MOTION_MOTOR_COUNT);
+  enum Format {
+    // Every loop simulated as the PRU does; columns for gnuplot (see below).
+    FORMAT_GNUPLOT,
+
+    // Fast: no loop-by-loop simulation, but times computed per phase
+    // (acceleration, travel, deceleration) of each segment. Samples at the
+    // phase boundaries and every "decimation" loops in between.
+    // CSV: time,phase,speed,accel,steps_0,steps_1... with speed and
+    // acceleration in the Euclidean space of the first three motors.
+    FORMAT_CSV,
+
+    // Same samples as FORMAT_CSV, as packed native-endian records:
+    // double time; float speed; float accel; uint8_t phase;
+    // int32_t steps[relevant_motors]. Phase is one of 'a', 't', 'd'.
+    FORMAT_BINARY,
+  };
+
+  SimFirmwareQueue(FILE *out, int relevant_motors = MOTION_MOTOR_COUNT,
+                   Format format = FORMAT_GNUPLOT, int decimation = 0);
   virtual ~SimFirmwareQueue();
 
   virtual void Enqueue(MotionSegment *segment);
@@ -35,7 +53,43 @@ public:
 private:
   class Averager;
 
+  void SimulateLoops(MotionSegment *segment);
+  void SimulatePhases(const MotionSegment &segment);
+  void WriteSample(double time, char phase, double speed, double accel,
+                   const int32_t *steps);
+
   FILE *const out_;
   const int relevant_motors_;
+  const Format format_;
+  const int decimation_;
   Averager *const averager_;
+
+  // Fast mode: where the previous segment ended.
+  double time_;
+  int32_t steps_[MOTION_MOTOR_COUNT];
+};
+
+// Motion queue that doesn't produce any output, but only adds up the time
+// the PRU would need to execute the segments it receives. It goes through
+// the same fixed-point acceleration series loop by loop, so it includes all
+// the rounding and segment splitting the real hardware sees.
+class TimingMotionQueue : public MotionQueue {
+public:
+  TimingMotionQueue() : total_time_(0), segment_count_(0) {}
+
+  virtual void Enqueue(MotionSegment *segment);
+  virtual void WaitQueueEmpty() {}
+  virtual void MotorEnable(bool on) {}
+  virtual void Shutdown(bool flush_queue) {}
+  virtual void GetMotorsLoops(MotorsRegister *absolute_pos_loops) {}
+
+  // Accumulated execution time of all segments, in seconds.
+  double total_time() const { return total_time_; }
+
+  // Number of segments sent to the hardware.
+  int segment_count() const { return segment_count_; }
+
+private:
+  double total_time_;
+  int segment_count_;
 };
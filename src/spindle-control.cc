@@ -25,10 +25,12 @@
 #include <termios.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "common/logging.h"
 #include "common/string-util.h"
 
+#include "adc.h"
 #include "config-parser.h"
 #include "hardware-mapping.h"
 
@@ -48,6 +50,11 @@ static const float kFreq = 1600;
 static const float kRampEpsilon = 0.1;
 static const int kRampDelayMs = 10;
 
+// Defaults for at-speed detection with RPM feedback.
+static const float kAtSpeedTolerance = 0.1;   // Within 10% of requested RPM.
+static const int kAtSpeedTimeoutMs = 10000;
+static const int kFeedbackPollMs = 10;
+
 static void sleep_ms(int ms) {
   if (ms <= 0) return;
   struct timespec req;
@@ -76,6 +83,10 @@ Spindle::Spindle() {
   freq_ = kFreq;
   on_duty_cycle_ = 0;
   off_duty_cycle_ = 0;
+  feedback_adc_channel_ = -1;
+  feedback_max_rpm_ = 0;
+  at_speed_tolerance_ = kAtSpeedTolerance;
+  at_speed_timeout_ms_ = kAtSpeedTimeoutMs;
 }
 
 class Spindle::ConfigReader : public ConfigParser::Reader {
@@ -103,6 +114,10 @@ public:
       ACCEPT_EXPR("freq",            &config_->freq_);
       ACCEPT_EXPR("off-duty-cycle",  &config_->off_duty_cycle_);
       ACCEPT_EXPR("on-duty-cycle",   &config_->on_duty_cycle_);
+      ACCEPT_VALUE("feedback-adc-channel",  Int, &config_->feedback_adc_channel_);
+      ACCEPT_VALUE("feedback-max-rpm",      Int, &config_->feedback_max_rpm_);
+      ACCEPT_EXPR("at-speed-tolerance",     &config_->at_speed_tolerance_);
+      ACCEPT_VALUE("at-speed-timeout-msec", Int, &config_->at_speed_timeout_ms_);
 
     }
     ReportError(line_no, StringPrintf("Unexpected configuration option '%s'",
@@ -124,7 +139,14 @@ private:
 
 bool Spindle::ConfigureFromFile(ConfigParser *parser) {
   Spindle::ConfigReader reader(this);
-  return parser->EmitConfigValues(&reader);
+  if (!parser->EmitConfigValues(&reader))
+    return false;
+  if (feedback_adc_channel_ >= ADC_NUM_CHANNELS) {
+    Log_error("[spindle] feedback-adc-channel %d out of range [0..%d]",
+              feedback_adc_channel_, ADC_NUM_CHANNELS - 1);
+    return false;
+  }
+  return true;
 }
 
 class Spindle::Impl {
@@ -138,12 +160,29 @@ public:
     is_off_ = true;
     is_ccw_ = false;
     duty_cycle_ = 0;
+    feedback_adc_channel_ = -1;
+    feedback_max_rpm_ = max_rpm;
+    at_speed_tolerance_ = kAtSpeedTolerance;
+    at_speed_timeout_ms_ = kAtSpeedTimeoutMs;
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    sequencer_running_ = false;
+    requested_ = done_ = 0;
+    request_on_ = request_ccw_ = false;
+    request_rpm_ = 0;
   }
 
-  virtual ~Impl() {}
+  // The sequencer needs to be stopped before, as it calls into the
+  // subclass.
+  virtual ~Impl() {
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
 
   virtual bool Init() { return true; }
 
+  // The actual spindle operations. They might take a while, so are called
+  // from the sequencer thread once it is started.
   virtual void On(bool ccw, int rpm) = 0;
   virtual void Off() = 0;
 
@@ -151,7 +190,78 @@ public:
     hardware_mapping_->UpdateAuxBitmap(out, is_on);
   }
 
+  void set_feedback(int adc_channel, int max_rpm, float tolerance,
+                    int timeout_ms) {
+    feedback_adc_channel_ = adc_channel;
+    if (max_rpm > 0) feedback_max_rpm_ = max_rpm;
+    at_speed_tolerance_ = tolerance;
+    at_speed_timeout_ms_ = timeout_ms;
+  }
+
+  bool StartSequencer() {
+    sequencer_running_ = true;
+    if (pthread_create(&sequencer_thread_, NULL, &SequencerThread, this) != 0) {
+      sequencer_running_ = false;
+      return false;
+    }
+    return true;
+  }
+
+  // Let the sequencer finish what is pending, then stop it.
+  void StopSequencer() {
+    if (!sequencer_running_) return;
+    pthread_mutex_lock(&mutex_);
+    sequencer_running_ = false;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(sequencer_thread_, NULL);
+  }
+
+  // Request a spindle state. If a previous request is still being worked
+  // on, only the latest of the ones that arrive meanwhile is done.
+  void Request(bool on, bool ccw, int rpm) {
+    if (!sequencer_running_) {
+      if (on) On(ccw, rpm); else Off();
+      return;
+    }
+    pthread_mutex_lock(&mutex_);
+    request_on_ = on;
+    request_ccw_ = ccw;
+    request_rpm_ = rpm;
+    ++requested_;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void WaitReady() {
+    pthread_mutex_lock(&mutex_);
+    while (done_ != requested_)
+      pthread_cond_wait(&cond_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
 protected:
+  // Wait for the spindle to be at speed after changing it. Without
+  // feedback, this is the on-delay when it was switched on.
+  void wait_at_speed(int rpm, bool was_off) {
+    if (feedback_adc_channel_ < 0) {
+      if (was_off && on_delay_ms_) sleep_ms(on_delay_ms_);
+      return;
+    }
+    const int target = std::min(rpm, max_rpm_);
+    wait_for_rpm(target,
+                 at_speed_tolerance_ * (target > 0 ? target : max_rpm_));
+  }
+
+  // Wait for the spindle to stop after switching it off.
+  void wait_stopped() {
+    if (feedback_adc_channel_ < 0) {
+      if (off_delay_ms_) sleep_ms(off_delay_ms_);
+      return;
+    }
+    wait_for_rpm(0, at_speed_tolerance_ * max_rpm_);
+  }
+
   HardwareMapping *hardware_mapping_;
 
   int max_rpm_;
@@ -166,6 +276,61 @@ protected:
   float freq_;
   float off_duty_cycle_;
   float on_duty_cycle_;
+
+private:
+  static void *SequencerThread(void *arg) {
+    ((Spindle::Impl*) arg)->RunSequencer();
+    return NULL;
+  }
+
+  void RunSequencer() {
+    pthread_mutex_lock(&mutex_);
+    for (;;) {
+      while (sequencer_running_ && done_ == requested_)
+        pthread_cond_wait(&cond_, &mutex_);
+      if (done_ == requested_)
+        break;  // Stopped and nothing left to do.
+      const unsigned int seq = requested_;
+      const bool on = request_on_;
+      const bool ccw = request_ccw_;
+      const int rpm = request_rpm_;
+      pthread_mutex_unlock(&mutex_);
+      if (on) On(ccw, rpm); else Off();
+      pthread_mutex_lock(&mutex_);
+      done_ = seq;
+      pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void wait_for_rpm(int rpm, float tolerance) {
+    int measured = -1;
+    for (int waited = 0; waited < at_speed_timeout_ms_;
+         waited += kFeedbackPollMs) {
+      const int raw = adc_read_cached(feedback_adc_channel_);
+      measured = (raw < 0) ? -1 : raw * feedback_max_rpm_ / 4095;
+      if (measured >= 0 && abs(measured - rpm) <= tolerance)
+        return;
+      sleep_ms(kFeedbackPollMs);
+    }
+    Log_error("Spindle: not at %d RPM after %dms (measured %d RPM)",
+              rpm, at_speed_timeout_ms_, measured);
+  }
+
+  int feedback_adc_channel_;
+  int feedback_max_rpm_;
+  float at_speed_tolerance_;
+  int at_speed_timeout_ms_;
+
+  pthread_t sequencer_thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  bool sequencer_running_;
+  unsigned int requested_;   // Sequence number of the last request.
+  unsigned int done_;        // .. and of the last one that is done.
+  bool request_on_;
+  bool request_ccw_;
+  int request_rpm_;
 };
 
 class ServoSpindle : public Spindle::Impl {
@@ -222,6 +387,7 @@ public:
 
   void On(bool ccw, int rpm) {
     // turn on spindle power if necessary
+    const bool was_off = is_off_;
     if (is_off_) {
       set_output_flags(HardwareMapping::OUT_SPINDLE, true);
       if (pwr_delay_ms_) sleep_ms(pwr_delay_ms_);
@@ -248,10 +414,8 @@ public:
     }
 
     // optionally delay before continuing
-    if (is_off_) {
-      if (on_delay_ms_) sleep_ms(on_delay_ms_);
-      is_off_ = false;
-    }
+    wait_at_speed(rpm, was_off);
+    is_off_ = false;
 
     Log_debug("PWMSpindle: on %s at %d RPM (duty_cycle: %f)",
               ccw ? "ccw" : "cw", (int)(max_rpm_ * duty_cycle_), duty_cycle_);
@@ -259,7 +423,7 @@ public:
 
   void Off() {
     ramp_down();
-    if (off_delay_ms_) sleep_ms(off_delay_ms_);
+    wait_stopped();
     set_output_flags(HardwareMapping::OUT_SPINDLE, false);
     is_off_ = true;
     Log_debug("PWMSpindle: off");
@@ -410,6 +574,7 @@ public:
   }
 
   void On(bool ccw, int rpm) {
+    const bool was_off = is_off_;
     if (is_off_) {
       set_output_flags(HardwareMapping::OUT_SPINDLE, true);
       if (pwr_delay_ms_) sleep_ms(pwr_delay_ms_);
@@ -425,10 +590,8 @@ public:
     command[2] = (speed >> 5) & 0x7f;
     send(command, sizeof(command));
 
-    if (is_off_) {
-      if (on_delay_ms_) sleep_ms(on_delay_ms_);
-      is_off_ = false;
-    }
+    wait_at_speed(rpm, was_off);
+    is_off_ = false;
 
     float duty_cycle = std::min((float)rpm / max_rpm_, 1.0f);
     Log_debug("PololuSMCSpindle: on %s at %d RPM (speed: %d)",
@@ -439,7 +602,7 @@ public:
     const unsigned char command = CMD_STOP_MOTOR;
     send(&command, 1);
 
-    if (off_delay_ms_) sleep_ms(off_delay_ms_);
+    wait_stopped();
     set_output_flags(HardwareMapping::OUT_SPINDLE, false);
     is_off_ = true;
     Log_debug("PololuSMCSpindle: off");
@@ -485,7 +648,17 @@ bool Spindle::Init(HardwareMapping *hardware_mapping) {
     return false;
   }
   Log_debug("  allow_ccw : %s", allow_ccw_ ? "yes" : "no");
-  return impl_->Init();
+  if (feedback_adc_channel_ >= 0) {
+    impl_->set_feedback(feedback_adc_channel_, feedback_max_rpm_,
+                        at_speed_tolerance_, at_speed_timeout_ms_);
+    Log_debug("  feedback  : ADC channel %d", feedback_adc_channel_);
+  }
+  return impl_->Init() && impl_->StartSequencer();
+}
+
+Spindle::~Spindle() {
+  if (impl_) impl_->StopSequencer();
+  delete impl_;
 }
 
 void Spindle::On(bool ccw, int rpm) {
@@ -494,9 +667,13 @@ void Spindle::On(bool ccw, int rpm) {
       return;
     }
 
-  if (impl_) impl_->On(ccw, rpm);
+  if (impl_) impl_->Request(true, ccw, rpm);
 }
 
 void Spindle::Off() {
-  if (impl_) impl_->Off();
+  if (impl_) impl_->Request(false, false, 0);
+}
+
+void Spindle::WaitReady() {
+  if (impl_) impl_->WaitReady();
 }
@@ -28,17 +28,23 @@ class ConfigParser;
 class Spindle {
 public:
   Spindle();
-  ~Spindle() {}
+  ~Spindle();  // Finishes a pending On()/Off() sequence.
 
    bool ConfigureFromFile(ConfigParser *parser);
 
    bool Init(HardwareMapping *hardware_mapping);
 
    // Turn spindle on clockwise (M3) or counterclockwise (M4) at speed (Sxx)
+   // These return right away; power delay, ramping and waiting for the
+   // spindle to come up to speed (or stop) happen in a background thread.
    void On(bool ccw, int rpm);
    // Turn spindle off (M5)
    void Off();
 
+   // Wait until the last On() or Off() is done, i.e. the spindle is at
+   // speed or stopped. Called before moves that need the spindle.
+   void WaitReady();
+
 // FIXME: why can't this be private?
   class Impl;
   Impl *impl_;
@@ -57,7 +63,12 @@ private:
   float freq_;
   float off_duty_cycle_;
   float on_duty_cycle_;
-  
+
+  // Optional RPM feedback on an ADC channel instead of fixed delays.
+  int feedback_adc_channel_;
+  int feedback_max_rpm_;
+  float at_speed_tolerance_;
+  int at_speed_timeout_ms_;
 };
 
 #endif  // BEAGLEG_SPINDLE_CONTROL_
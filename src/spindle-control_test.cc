@@ -0,0 +1,97 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spindle-control.h"
+
+#include <time.h>
+
+#include <gtest/gtest.h>
+
+#include "config-parser.h"
+#include "hardware-mapping.h"
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+class SpindleTest : public ::testing::Test {
+public:
+  void Configure(const char *config) {
+    ConfigParser parser;
+    parser.SetContent(config);
+    ASSERT_TRUE(hardware_.ConfigureFromFile(&parser));
+    ASSERT_TRUE(spindle_.ConfigureFromFile(&parser));
+    ASSERT_TRUE(spindle_.Init(&hardware_));
+  }
+
+protected:
+  HardwareMapping hardware_;
+  Spindle spindle_;
+};
+
+// The delays happen in the background; only WaitReady() waits for them.
+TEST_F(SpindleTest, DelaysDontBlockCaller) {
+  Configure("[aux-mapping]\n"
+            "aux_3 = spindle\n"
+            "[spindle]\n"
+            "pwr-delay-msec = 100\n"
+            "on-delay-msec = 100\n"
+            "off-delay-msec = 200\n");
+  const int64_t start = now_ms();
+  spindle_.On(false, 1000);
+  EXPECT_LT(now_ms() - start, 50);
+  spindle_.WaitReady();
+  EXPECT_GE(now_ms() - start, 200);
+  EXPECT_TRUE(hardware_.GetAuxBit(3));
+
+  const int64_t off_start = now_ms();
+  spindle_.Off();
+  EXPECT_LT(now_ms() - off_start, 50);
+  spindle_.WaitReady();
+  EXPECT_GE(now_ms() - off_start, 200);
+  EXPECT_FALSE(hardware_.GetAuxBit(3));
+}
+
+// Requests arriving while the spindle is busy are merged into the latest.
+TEST_F(SpindleTest, LatestRequestWins) {
+  Configure("[aux-mapping]\n"
+            "aux_3 = spindle\n"
+            "[spindle]\n"
+            "pwr-delay-msec = 100\n");
+  spindle_.On(false, 1000);
+  spindle_.Off();
+  spindle_.On(false, 2000);
+  spindle_.Off();
+  spindle_.WaitReady();
+  EXPECT_FALSE(hardware_.GetAuxBit(3));
+}
+
+TEST(SpindleConfigTest, RejectsInvalidFeedbackChannel) {
+  ConfigParser parser;
+  parser.SetContent("[spindle]\nfeedback-adc-channel = 9\n");
+  Spindle spindle;
+  EXPECT_FALSE(spindle.ConfigureFromFile(&parser));
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,118 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measure the step rate the PRU actually achieves, depending on the number
+// of motors stepping. Runs on the hardware; the motors stay disabled, so
+// only the step outputs toggle.
+// The result is a good value for max-step-frequency in the configuration.
+// Only the extended firmware (BEAGLEG_PRU_EXTENDED) reports late loops.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+#include "common/trace.h"
+
+#include "hardware-mapping.h"
+#include "machine-metrics.h"
+#include "motion-queue.h"
+#include "motor-operations.h"
+#include "pru-hardware-interface.h"
+
+static const float kRequestedRates[] = {
+  50e3, 100e3, 200e3, 300e3, 400e3, 500e3, 600e3, 800e3, 1e6, 1.5e6, 2e6
+};
+
+// Passes everything on to the PRU, but keeps the motors disabled:
+// MotorOperations would enable them with every move.
+class DisabledMotorsQueue : public MotionQueue {
+public:
+  explicit DisabledMotorsQueue(MotionQueue *delegate) : delegate_(delegate) {}
+
+  void Enqueue(MotionSegment *segment) { delegate_->Enqueue(segment); }
+  void EnqueueMany(MotionSegment *segments, int count) {
+    delegate_->EnqueueMany(segments, count);
+  }
+  void WaitQueueEmpty() { delegate_->WaitQueueEmpty(); }
+  void MotorEnable(bool on) { delegate_->MotorEnable(false); }
+  void Shutdown(bool flush_queue) { delegate_->Shutdown(flush_queue); }
+  void GetMotorsLoops(MotorsRegister *absolute_pos_loops) {
+    delegate_->GetMotorsLoops(absolute_pos_loops);
+  }
+
+private:
+  MotionQueue *const delegate_;
+};
+
+static int usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [<seconds-per-run>]\n"
+          "Sweeps step rates for 1..%d motors and prints the achieved rate.\n"
+          "Default: 0.5 seconds per run. Needs to run as root.\n",
+          progname, BEAGLEG_NUM_MOTORS);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) return usage(argv[0]);
+  const float seconds = (argc == 2) ? atof(argv[1]) : 0.5;
+  if (seconds <= 0) return usage(argv[0]);
+
+  Log_init("/dev/stderr");
+  HardwareMapping hardware_mapping;
+  if (!hardware_mapping.InitializeHardware())
+    return 1;
+  UioPrussInterface pru_interface;
+  PRUMotionQueue motion_queue(&hardware_mapping, &pru_interface);
+  DisabledMotorsQueue disabled_motors(&motion_queue);
+  // We want to see what the hardware does, so don't clip anything.
+  MotionQueueMotorOperations motor_ops(&disabled_motors, 1e9);
+  motor_ops.MotorEnable(false);
+
+  printf("%6s %12s %12s %10s\n",
+         "motors", "requested/s", "achieved/s", "late-loops");
+  for (int motors = 1; motors <= BEAGLEG_NUM_MOTORS; ++motors) {
+    float best = 0;
+    for (size_t i = 0; i < sizeof(kRequestedRates) / sizeof(float); ++i) {
+      const float rate = kRequestedRates[i];
+      LinearSegmentSteps segment = { rate, rate, 0, {} };
+      const int steps = rate * seconds;
+      for (int m = 0; m < motors; ++m) segment.steps[m] = steps;
+
+      MachineMetrics before, after;
+      Metrics_get(&before);
+      const uint64_t start = Trace_now_ns();
+      motor_ops.Enqueue(segment);
+      motor_ops.WaitQueueEmpty();
+      const double duration = (Trace_now_ns() - start) / 1e9;
+      Metrics_get(&after);
+
+      const float achieved = steps / duration;
+      printf("%6d %12.0f %12.0f %10lld\n", motors, rate, achieved,
+             (long long) (after.late_loops - before.late_loops));
+      // Within 1% of what we wanted.
+      if (achieved > 0.99 * rate && rate > best) best = rate;
+    }
+    printf("# %d motor%s: max-step-frequency = %.0f\n",
+           motors, motors > 1 ? "s" : "", best);
+  }
+
+  motion_queue.Shutdown(true);
+  return 0;
+}
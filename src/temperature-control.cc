@@ -0,0 +1,266 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "temperature-control.h"
+
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+
+#include "adc.h"
+#include "config-parser.h"
+#include "hardware-mapping.h"
+
+// Highest value of the 12 bit ADC.
+#define ADC_MAX 4095
+
+// Defaults for a common 100k thermistor with a 4.7k pullup.
+static const float kThermistorBeta = 3950;
+static const float kThermistorR25 = 100000;
+static const float kPullupResistor = 4700;
+
+// Conservative PID defaults; these need tuning for the actual heater.
+static const float kP = 0.05;   // Full power 20 degrees below target.
+static const float kI = 0.002;
+static const float kD = 0.2;
+static const float kRateHz = 10;
+static const float kMaxTemperature = 280;
+static const float kTolerance = 2;
+// Thermal runaway: at full power, the temperature has to rise that many
+// degrees within that many seconds. After reaching the target, it may not
+// drift further away than that.
+static const float kRunawayRise = 2;
+static const float kRunawaySeconds = 30;
+static const float kRunawayDrift = 15;
+
+TemperatureControl::TemperatureControl()
+  : adc_channel_(-1),
+    thermistor_beta_(kThermistorBeta), thermistor_r25_(kThermistorR25),
+    pullup_resistor_(kPullupResistor),
+    kp_(kP), ki_(kI), kd_(kD), rate_hz_(kRateHz), max_duty_cycle_(1.0),
+    max_temperature_(kMaxTemperature), tolerance_(kTolerance),
+    runaway_rise_(kRunawayRise), runaway_seconds_(kRunawaySeconds),
+    runaway_drift_(kRunawayDrift),
+    hardware_mapping_(NULL), running_(false),
+    target_(0), current_(NAN), runaway_(false),
+    integral_(0), last_measured_(NAN),
+    watched_target_(0), target_reached_(false),
+    watch_start_(0), watch_seconds_(-1) {
+}
+
+TemperatureControl::~TemperatureControl() {
+  if (running_) {
+    running_ = false;
+    pthread_join(thread_, NULL);
+    hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_HOTEND, 0);
+  }
+}
+
+class TemperatureControl::ConfigReader : public ConfigParser::Reader {
+public:
+  ConfigReader(TemperatureControl *config) : config_(config) {}
+
+  virtual bool SeenSection(int line_no, const std::string &section_name) {
+    return (section_name == "hotend");
+  }
+
+  virtual bool SeenNameValue(int line_no,
+                             const std::string &name,
+                             const std::string &value) {
+#define ACCEPT_VALUE(n, T, result) if (name != n) {} else return Parse##T(value, result)
+#define ACCEPT_EXPR(n, result) if (name != n) {} else return ParseFloatExpr(value, result)
+    ACCEPT_VALUE("adc-channel",       Int, &config_->adc_channel_);
+    ACCEPT_EXPR("thermistor-beta",    &config_->thermistor_beta_);
+    ACCEPT_EXPR("thermistor-r25",     &config_->thermistor_r25_);
+    ACCEPT_EXPR("pullup-resistor",    &config_->pullup_resistor_);
+    ACCEPT_EXPR("kp",                 &config_->kp_);
+    ACCEPT_EXPR("ki",                 &config_->ki_);
+    ACCEPT_EXPR("kd",                 &config_->kd_);
+    ACCEPT_EXPR("rate-hz",            &config_->rate_hz_);
+    ACCEPT_EXPR("max-duty-cycle",     &config_->max_duty_cycle_);
+    ACCEPT_EXPR("max-temperature",    &config_->max_temperature_);
+    ACCEPT_EXPR("tolerance",          &config_->tolerance_);
+    ACCEPT_EXPR("runaway-rise",       &config_->runaway_rise_);
+    ACCEPT_EXPR("runaway-seconds",    &config_->runaway_seconds_);
+    ACCEPT_EXPR("runaway-drift",      &config_->runaway_drift_);
+
+    ReportError(line_no, StringPrintf("Unexpected configuration option '%s'",
+                                      name.c_str()));
+#undef ACCEPT_EXPR
+#undef ACCEPT_VALUE
+    return false;
+  }
+
+  virtual void ReportError(int line_no, const std::string &msg) {
+    Log_error("Line %d: %s", line_no, msg.c_str());
+  }
+
+private:
+  TemperatureControl *const config_;
+};
+
+bool TemperatureControl::ConfigureFromFile(ConfigParser *parser) {
+  TemperatureControl::ConfigReader reader(this);
+  if (!parser->EmitConfigValues(&reader))
+    return false;
+  if (adc_channel_ >= ADC_NUM_CHANNELS) {
+    Log_error("[hotend] adc-channel %d out of range [0..%d]",
+              adc_channel_, ADC_NUM_CHANNELS - 1);
+    return false;
+  }
+  if (rate_hz_ <= 0 || max_duty_cycle_ > 1.0) {
+    Log_error("[hotend] rate-hz needs to be positive, max-duty-cycle <= 1");
+    return false;
+  }
+  if (runaway_rise_ <= 0 || runaway_seconds_ <= 0
+      || runaway_drift_ <= tolerance_) {
+    Log_error("[hotend] runaway-rise and runaway-seconds need to be "
+              "positive, runaway-drift larger than the tolerance");
+    return false;
+  }
+  return true;
+}
+
+bool TemperatureControl::Init(HardwareMapping *hardware_mapping) {
+  if (!is_configured()) return false;
+  hardware_mapping_ = hardware_mapping;
+  hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_HOTEND, 0);
+  running_ = true;
+  if (pthread_create(&thread_, NULL, &ControlThread, this) != 0) {
+    running_ = false;
+    return false;
+  }
+  Log_info("Hotend temperature control on ADC channel %d at %.0fHz",
+           adc_channel_, rate_hz_);
+  return true;
+}
+
+bool TemperatureControl::SetTarget(float celsius) {
+  if (celsius > max_temperature_) {
+    Log_error("Temperature %.1f above max-temperature %.1f",
+              celsius, max_temperature_);
+    return false;
+  }
+  target_ = celsius > 0 ? celsius : 0;
+  runaway_ = false;
+  return true;
+}
+
+bool TemperatureControl::IsAtTarget() const {
+  if (target_ <= 0) return true;
+  return fabsf(current_ - target_) <= tolerance_;  // false for NaN.
+}
+
+float TemperatureControl::ThermistorCelsius(int raw) const {
+  if (raw <= 0 || raw >= ADC_MAX)
+    return NAN;  // Shorted or open sensor.
+  // Thermistor between ADC input and ground, pullup to the reference.
+  const float resistance = pullup_resistor_ * raw / (ADC_MAX - raw);
+  const float kelvin = 1.0 / (1.0 / (273.15 + 25)
+                              + logf(resistance / thermistor_r25_)
+                              / thermistor_beta_);
+  return kelvin - 273.15;
+}
+
+float TemperatureControl::ControlStep(float measured) {
+  current_ = measured;
+  const float target = target_;
+  if (target != watched_target_) {
+    watched_target_ = target;
+    target_reached_ = false;
+    watch_seconds_ = -1;
+  }
+  if (target <= 0 || runaway_ || isnan(measured)
+      || measured > max_temperature_) {
+    // Off, or the sensor doesn't tell us anything sensible: safe state.
+    integral_ = 0;
+    last_measured_ = measured;
+    watch_seconds_ = -1;
+    return 0;
+  }
+  const float dt = 1.0 / rate_hz_;
+  const float error = target - measured;
+  // Derivative on the measurement, so that target changes don't kick.
+  const float derivative = isnan(last_measured_)
+    ? 0 : -(measured - last_measured_) / dt;
+  last_measured_ = measured;
+
+  // Only integrate as long as it contributes within the output range, so
+  // it does not wind up while heating up from cold.
+  integral_ += error * dt;
+  if (ki_ > 0) {
+    if (ki_ * integral_ > max_duty_cycle_) integral_ = max_duty_cycle_ / ki_;
+    if (integral_ < 0) integral_ = 0;
+  }
+  float duty = kp_ * error + ki_ * integral_ + kd_ * derivative;
+  if (duty < 0) duty = 0;
+  if (duty > max_duty_cycle_) duty = max_duty_cycle_;
+
+  if (fabsf(error) <= tolerance_) target_reached_ = true;
+  if (target_reached_ && fabsf(error) > runaway_drift_) {
+    Log_error("Thermal runaway: hotend at %.1f, drifted away from its "
+              "target %.1f. Heater off.", measured, target);
+    return RunawayStop();
+  }
+  if (duty < max_duty_cycle_) {
+    watch_seconds_ = -1;
+  } else if (watch_seconds_ < 0 || measured >= watch_start_ + runaway_rise_) {
+    watch_start_ = measured;  // (Re-)start watching the rise from here.
+    watch_seconds_ = 0;
+  } else if ((watch_seconds_ += dt) > runaway_seconds_) {
+    Log_error("Thermal runaway: hotend did not heat up by %.1f degrees in "
+              "%.0f seconds at full power (at %.1f). Heater off.",
+              runaway_rise_, runaway_seconds_, measured);
+    return RunawayStop();
+  }
+  return duty;
+}
+
+float TemperatureControl::RunawayStop() {
+  runaway_ = true;
+  integral_ = 0;
+  watch_seconds_ = -1;
+  return 0;
+}
+
+void *TemperatureControl::ControlThread(void *arg) {
+  ((TemperatureControl*) arg)->RunControlLoop();
+  return NULL;
+}
+
+void TemperatureControl::RunControlLoop() {
+  const long interval_ns = 1e9 / rate_hz_;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (running_) {
+    const float measured = ThermistorCelsius(adc_read_cached(adc_channel_));
+    hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_HOTEND,
+                                    ControlStep(measured));
+    next.tv_nsec += interval_ns;
+    while (next.tv_nsec >= 1000000000) {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+           == EINTR) {}
+  }
+}
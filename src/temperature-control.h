@@ -0,0 +1,112 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEAGLEG_TEMPERATURE_CONTROL_
+#define BEAGLEG_TEMPERATURE_CONTROL_
+
+#include <pthread.h>
+
+class HardwareMapping;
+class ConfigParser;
+
+// Closed loop control of the hotend temperature: a PID loop in its own
+// thread reads the temperature of a thermistor on an ADC channel and drives
+// the 'hotend' PWM output. Configured in the [hotend] section.
+class TemperatureControl {
+public:
+  TemperatureControl();
+  ~TemperatureControl();  // Stops the control loop and switches heater off.
+
+  bool ConfigureFromFile(ConfigParser *parser);
+
+  // An ADC channel for the thermistor is configured.
+  bool is_configured() const { return adc_channel_ >= 0; }
+
+  // Start the control loop. Returns false if not configured.
+  bool Init(HardwareMapping *hardware_mapping);
+
+  // Set target temperature in Celsius. Zero switches the heater off.
+  // Returns false if above the configured max-temperature. Clears a
+  // thermal runaway.
+  bool SetTarget(float celsius);
+  float target() const { return target_; }
+
+  // Last measured temperature. NaN if the sensor can't be read.
+  float current() const { return current_; }
+
+  // If the temperature is within the configured tolerance of the target.
+  // Always true if the heater is off.
+  bool IsAtTarget() const;
+
+  // The temperature did not follow the heater: it did not rise while heating
+  // at full power, or it drifted away from the target after reaching it.
+  // Probably a loose thermistor or a broken heater; the heater stays off
+  // until a new target is set.
+  bool runaway() const { return runaway_; }
+
+  // Temperature for the raw 12 bit ADC value of the thermistor voltage
+  // divider. NaN for values that indicate an open or shorted sensor.
+  float ThermistorCelsius(int raw) const;
+
+  // One iteration of the control loop with the given measured temperature.
+  // Returns the new duty cycle of the heater. Called by the control thread;
+  // public for testing.
+  float ControlStep(float measured_celsius);
+
+private:
+  class ConfigReader;
+  static void *ControlThread(void *arg);
+  void RunControlLoop();
+  float RunawayStop();  // Switch off after a thermal runaway; returns duty.
+
+  // Configuration
+  int adc_channel_;
+  float thermistor_beta_;
+  float thermistor_r25_;
+  float pullup_resistor_;
+  float kp_, ki_, kd_;
+  float rate_hz_;
+  float max_duty_cycle_;
+  float max_temperature_;
+  float tolerance_;
+  float runaway_rise_;
+  float runaway_seconds_;
+  float runaway_drift_;
+
+  HardwareMapping *hardware_mapping_;
+  pthread_t thread_;
+  volatile bool running_;
+
+  // Written by the gcode thread, read by the control thread and vice versa.
+  volatile float target_;
+  volatile float current_;
+  volatile bool runaway_;
+
+  // Control state.
+  float integral_;
+  float last_measured_;
+
+  // Thermal runaway detection state.
+  float watched_target_;  // Target the state below is for.
+  bool target_reached_;
+  float watch_start_;     // Temperature when heating at full power started.
+  float watch_seconds_;   // Time since; negative if not at full power.
+};
+
+#endif  // BEAGLEG_TEMPERATURE_CONTROL_
@@ -0,0 +1,178 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "temperature-control.h"
+
+#include <math.h>
+
+#include <gtest/gtest.h>
+
+#include "config-parser.h"
+
+TEST(TemperatureControlTest, Thermistor) {
+  TemperatureControl control;
+  // 100k thermistor, 4.7k pullup: at 25 degrees, both are at 100k.
+  const int raw_25 = roundf(4095 * 100000.0 / (100000 + 4700));
+  EXPECT_NEAR(25, control.ThermistorCelsius(raw_25), 0.1);
+  // Less resistance and voltage when hot.
+  EXPECT_GT(control.ThermistorCelsius(100), 200);
+  EXPECT_TRUE(isnan(control.ThermistorCelsius(0)));     // Shorted.
+  EXPECT_TRUE(isnan(control.ThermistorCelsius(4095)));  // Open.
+}
+
+TEST(TemperatureControlTest, Configuration) {
+  ConfigParser parser;
+  parser.SetContent("[hotend]\n"
+                    "adc-channel = 2\n"
+                    "max-temperature = 250\n");
+  TemperatureControl control;
+  EXPECT_FALSE(control.is_configured());
+  EXPECT_TRUE(control.ConfigureFromFile(&parser));
+  EXPECT_TRUE(control.is_configured());
+  EXPECT_TRUE(control.SetTarget(240));
+  EXPECT_FALSE(control.SetTarget(260));
+  EXPECT_EQ(240, control.target());
+
+  parser.SetContent("[hotend]\nadc-channel = 8\n");
+  TemperatureControl out_of_range;
+  EXPECT_FALSE(out_of_range.ConfigureFromFile(&parser));
+}
+
+static const float kAmbient = 20;
+static const float kHeaterWatts = 40;
+static const float kJoulePerDegree = 10;
+static const float kLossWattPerDegree = 0.15;
+
+// A hotend that heats with the duty cycle and loses heat to the ambient.
+// Steps at the default control rate of 10Hz.
+class SimulatedHotend {
+public:
+  SimulatedHotend() : temperature(kAmbient) {}
+  void Step(float duty) {
+    const float dt = 0.1;
+    temperature += dt * (kHeaterWatts * duty
+                         - kLossWattPerDegree * (temperature - kAmbient))
+      / kJoulePerDegree;
+  }
+  float temperature;
+};
+
+// Heat up a simulated hotend and see that it settles at the target.
+TEST(TemperatureControlTest, ReachesAndHoldsTarget) {
+  TemperatureControl control;
+  SimulatedHotend hotend;
+  float &temperature = hotend.temperature;
+  EXPECT_TRUE(control.IsAtTarget());  // Off
+  EXPECT_EQ(0, control.ControlStep(temperature));
+  control.SetTarget(200);
+  EXPECT_FALSE(control.IsAtTarget());
+  float max_seen = 0;
+  for (int i = 0; i < 3000; ++i) {  // 5 minutes.
+    const float duty = control.ControlStep(temperature);
+    ASSERT_GE(duty, 0);
+    ASSERT_LE(duty, 1);
+    hotend.Step(duty);
+    if (temperature > max_seen) max_seen = temperature;
+  }
+  EXPECT_NEAR(200, temperature, 1);
+  EXPECT_LT(max_seen, 210);  // Not too much overshoot.
+  control.ControlStep(temperature);
+  EXPECT_TRUE(control.IsAtTarget());
+  EXPECT_FALSE(control.runaway());
+
+  // A broken sensor switches off the heater.
+  EXPECT_EQ(0, control.ControlStep(NAN));
+  EXPECT_FALSE(control.IsAtTarget());
+
+  control.SetTarget(0);
+  EXPECT_EQ(0, control.ControlStep(temperature));
+}
+
+// The thermistor fell off: heating at full power doesn't change what it
+// reads. After 30 seconds, the heater is switched off.
+TEST(TemperatureControlTest, RunawayNoRiseAtFullPower) {
+  TemperatureControl control;
+  control.SetTarget(200);
+  for (int i = 0; i < 300; ++i) {  // 30 seconds at 10Hz.
+    ASSERT_EQ(1.0, control.ControlStep(25)) << i;
+  }
+  EXPECT_EQ(0, control.ControlStep(25));
+  EXPECT_TRUE(control.runaway());
+  EXPECT_FALSE(control.IsAtTarget());
+  EXPECT_EQ(0, control.ControlStep(25));  // Stays off.
+
+  // Until a new target is set.
+  control.SetTarget(200);
+  EXPECT_FALSE(control.runaway());
+  EXPECT_EQ(1.0, control.ControlStep(25));
+}
+
+// Once at the target, the temperature suddenly reads a lot lower, e.g. as
+// the thermistor came loose. The heater must not go on full blast.
+TEST(TemperatureControlTest, RunawayDriftFromReachedTarget) {
+  TemperatureControl control;
+  SimulatedHotend hotend;
+  control.SetTarget(200);
+  for (int i = 0; i < 3000; ++i) {
+    hotend.Step(control.ControlStep(hotend.temperature));
+  }
+  ASSERT_TRUE(control.IsAtTarget());
+  ASSERT_FALSE(control.runaway());
+
+  // Still fine within the drift limit of 15 degrees.
+  EXPECT_GT(control.ControlStep(190), 0);
+  EXPECT_FALSE(control.runaway());
+  EXPECT_EQ(0, control.ControlStep(180));
+  EXPECT_TRUE(control.runaway());
+
+  // A new, lower target is not a drift.
+  control.SetTarget(100);
+  for (int i = 0; i < 100; ++i) control.ControlStep(180);
+  EXPECT_FALSE(control.runaway());
+}
+
+TEST(TemperatureControlTest, RunawayConfiguration) {
+  ConfigParser parser;
+  parser.SetContent("[hotend]\n"
+                    "adc-channel = 2\n"
+                    "runaway-rise = 5\n"
+                    "runaway-seconds = 2\n");
+  TemperatureControl control;
+  EXPECT_TRUE(control.ConfigureFromFile(&parser));
+  control.SetTarget(200);
+  float temperature = 20;
+  for (int i = 0; i < 100; ++i) {  // Rising 6 degrees every 2 seconds is ok.
+    temperature += 0.3;
+    ASSERT_EQ(1.0, control.ControlStep(temperature)) << i;
+  }
+  for (int i = 0; i < 100 && !control.runaway(); ++i) {
+    temperature += 0.2;           // Too slow.
+    control.ControlStep(temperature);
+  }
+  EXPECT_TRUE(control.runaway());
+
+  parser.SetContent("[hotend]\nadc-channel = 2\nrunaway-drift = 1\n");
+  TemperatureControl below_tolerance;
+  EXPECT_FALSE(below_tolerance.ConfigureFromFile(&parser));
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
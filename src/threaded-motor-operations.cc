@@ -0,0 +1,182 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "threaded-motor-operations.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include "common/logging.h"
+
+ThreadedMotorOperations::ThreadedMotorOperations(MotorOperations *delegate,
+                                                 int cpu, int rt_priority)
+  : delegate_(delegate), aborted_(false),
+    pixels_(new uint8_t[kPixelBufferSize]), pixels_written_(0),
+    pixels_freed_(0) {
+  sem_init(&done_, 0, 0);
+  sem_init(&pixels_done_, 0, 0);
+  pthread_create(&thread_, NULL, &RunThread, this);
+
+  // Set up while we're still here, as we might drop privileges soon.
+  if (cpu >= 0) {
+    cpu_set_t cpu_mask;
+    CPU_ZERO(&cpu_mask);
+    CPU_SET(cpu, &cpu_mask);
+    const int err = pthread_setaffinity_np(thread_, sizeof(cpu_mask), &cpu_mask);
+    if (err != 0) {
+      Log_error("Can't pin motor thread to CPU %d: %s", cpu, strerror(err));
+    }
+  }
+  if (rt_priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = rt_priority;
+    const int err = pthread_setschedparam(thread_, SCHED_FIFO, &param);
+    if (err != 0) {
+      Log_error("Can't set motor thread to realtime priority %d: %s",
+                rt_priority, strerror(err));
+    }
+  }
+}
+
+ThreadedMotorOperations::~ThreadedMotorOperations() {
+  Command exit_command = {};
+  exit_command.type = CMD_EXIT;
+  queue_.Push(exit_command);
+  pthread_join(thread_, NULL);
+  sem_destroy(&done_);
+  sem_destroy(&pixels_done_);
+  delete [] pixels_;
+}
+
+void ThreadedMotorOperations::Abort() {
+  aborted_ = true;
+  __sync_synchronize();
+}
+
+void ThreadedMotorOperations::Enqueue(const LinearSegmentSteps &segment) {
+  Command command = {};
+  command.type = CMD_ENQUEUE;
+  command.segment = segment;
+  queue_.Push(command);
+}
+
+void ThreadedMotorOperations::EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                                               const LinearSegmentSteps &travel,
+                                               const LinearSegmentSteps &decel) {
+  Command command = {};
+  command.type = CMD_ENQUEUE_TRAPEZOID;
+  command.accel = accel;
+  command.segment = travel;
+  command.decel = decel;
+  queue_.Push(command);
+}
+
+void ThreadedMotorOperations::EnqueueRaster(const LinearSegmentSteps &segment,
+                                            const uint8_t *pixels, int count) {
+  if (count > kPixelBufferSize) {
+    // Longer than G-code lines can be; send it as separate moves.
+    MotorOperations::EnqueueRaster(segment, pixels, count);
+    return;
+  }
+  // The pixels need to be contiguous; if they don't fit before the end of
+  // the ring, we skip what's left there.
+  uint32_t offset = pixels_written_ % kPixelBufferSize;
+  int bytes = count;
+  if (offset + count > (uint32_t) kPixelBufferSize) {
+    bytes += kPixelBufferSize - offset;
+    offset = 0;
+  }
+  while (kPixelBufferSize - (pixels_written_ - pixels_freed_)
+         < (uint32_t) bytes) {
+    while (sem_wait(&pixels_done_) != 0 && errno == EINTR)
+      ;
+  }
+  memcpy(pixels_ + offset, pixels, count);
+  pixels_written_ += bytes;
+
+  Command command = {};
+  command.type = CMD_ENQUEUE_RASTER;
+  command.segment = segment;
+  command.pixels = pixels_ + offset;
+  command.count = count;
+  command.pixel_bytes = bytes;
+  queue_.Push(command);
+}
+
+void ThreadedMotorOperations::MotorEnable(bool on) {
+  Command command = {};
+  command.type = CMD_MOTOR_ENABLE;
+  command.enable = on;
+  SendAndWait(command);
+}
+
+void ThreadedMotorOperations::WaitQueueEmpty() {
+  Command command = {};
+  command.type = CMD_WAIT_EMPTY;
+  SendAndWait(command);
+}
+
+void ThreadedMotorOperations::SendAndWait(const Command &command) {
+  queue_.Push(command);
+  while (sem_wait(&done_) != 0 && errno == EINTR)
+    ;
+}
+
+void *ThreadedMotorOperations::RunThread(void *self) {
+  reinterpret_cast<ThreadedMotorOperations*>(self)->Run();
+  return NULL;
+}
+
+void ThreadedMotorOperations::Run() {
+  Command command;
+  for (;;) {
+    queue_.Pop(&command);
+    switch (command.type) {
+    case CMD_ENQUEUE:
+      if (!aborted_) delegate_->Enqueue(command.segment);
+      break;
+    case CMD_ENQUEUE_TRAPEZOID:
+      if (!aborted_) {
+        delegate_->EnqueueTrapezoid(command.accel, command.segment,
+                                    command.decel);
+      }
+      break;
+    case CMD_ENQUEUE_RASTER:
+      if (!aborted_) {
+        delegate_->EnqueueRaster(command.segment, command.pixels,
+                                 command.count);
+      }
+      __sync_fetch_and_add(&pixels_freed_, command.pixel_bytes);
+      sem_post(&pixels_done_);
+      break;
+    case CMD_MOTOR_ENABLE:
+      delegate_->MotorEnable(command.enable);
+      sem_post(&done_);
+      break;
+    case CMD_WAIT_EMPTY:
+      if (!aborted_) delegate_->WaitQueueEmpty();
+      sem_post(&done_);
+      break;
+    case CMD_EXIT:
+      return;
+    }
+  }
+}
@@ -0,0 +1,129 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_THREADED_MOTOR_OPERATIONS_H_
+#define _BEAGLEG_THREADED_MOTOR_OPERATIONS_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "common/spsc-queue.h"
+#include "motor-operations.h"
+
+// MotorOperations that forwards all operations to a delegate that is executed
+// in a separate motor thread.
+//
+// Feeding the motion queue blocks whenever the hardware queue is full; with
+// this, the parsing and planning thread can continue (up to the capacity of
+// the queue between these threads), so a slow bit of parsing doesn't starve
+// motion and a full motion queue doesn't stall reading new commands.
+class ThreadedMotorOperations : public MotorOperations {
+public:
+  // Start motor thread feeding "delegate". If "cpu" is >= 0, the thread is
+  // pinned to that CPU. With "rt_priority" > 0, it runs with SCHED_FIFO with
+  // that priority (typically requires to run as root).
+  ThreadedMotorOperations(MotorOperations *delegate,
+                          int cpu = -1, int rt_priority = 0);
+
+  // Finishes all pending operations (none after Abort()) and stops the
+  // thread.
+  ~ThreadedMotorOperations();
+
+  // Drop the operations still waiting for the motor thread, and everything
+  // enqueued from now on. For an immediate stop, together with
+  // MotionQueue::Abort(), which releases the motor thread if it is blocked
+  // on a full hardware queue.
+  void Abort();
+
+  void Enqueue(const LinearSegmentSteps &segment);
+  void EnqueueTrapezoid(const LinearSegmentSteps &accel,
+                        const LinearSegmentSteps &travel,
+                        const LinearSegmentSteps &decel);
+  void EnqueueRaster(const LinearSegmentSteps &segment,
+                     const uint8_t *pixels, int count);
+
+  // These are synchronous: return once the delegate has finished them.
+  void MotorEnable(bool on);
+  void WaitQueueEmpty();
+
+  // Only our own queue: as long as there is room, enqueuing doesn't block,
+  // no matter how full the delegate is.
+  bool QueueFull(int operations = 1) {
+    const int half = queue_.capacity() / 2;
+    return queue_.free_slots() < (operations < half ? operations : half);
+  }
+
+  // Passed on directly, so that it takes effect before whatever is still
+  // waiting in our queue.
+  bool SetSpeedOverride(float factor) {
+    return delegate_->SetSpeedOverride(factor);
+  }
+  void SetSpeedOverrideRamp(float stop_seconds) {
+    delegate_->SetSpeedOverrideRamp(stop_seconds);
+  }
+
+  // Only allowed with no probing moves pending, so no need to go through
+  // our queue either.
+  void SetProbeSwitch(uint32_t gpio_def, bool trigger_level) {
+    delegate_->SetProbeSwitch(gpio_def, trigger_level);
+  }
+  bool GetProbeStepsSkipped(int skipped[BEAGLEG_NUM_MOTORS]) {
+    return delegate_->GetProbeStepsSkipped(skipped);
+  }
+  // Set up once before anything is queued.
+  bool SetMotionPWMOutput(uint32_t gpio_def) {
+    return delegate_->SetMotionPWMOutput(gpio_def);
+  }
+
+private:
+  enum CommandType { CMD_ENQUEUE, CMD_ENQUEUE_TRAPEZOID, CMD_ENQUEUE_RASTER,
+                     CMD_MOTOR_ENABLE, CMD_WAIT_EMPTY, CMD_EXIT };
+  struct Command {
+    CommandType type;
+    bool enable;
+    LinearSegmentSteps segment;     // CMD_ENQUEUE; travel of trapezoid.
+    LinearSegmentSteps accel;       // CMD_ENQUEUE_TRAPEZOID
+    LinearSegmentSteps decel;
+    const uint8_t *pixels;          // CMD_ENQUEUE_RASTER; in pixels_.
+    int count;
+    int pixel_bytes;                // Of pixels_ to free once done.
+  };
+
+  // Room for a few raster lines of the longest G-code line.
+  static const int kPixelBufferSize = 1 << 16;
+
+  static void *RunThread(void *self);
+  void Run();
+  void SendAndWait(const Command &command);
+
+  MotorOperations *const delegate_;
+  SpscQueue<Command, 256> queue_;
+  sem_t done_;         // Posted once a synchronous command is finished.
+  pthread_t thread_;
+  volatile bool aborted_;
+
+  // Copies of the pixels of queued raster lines, as the caller's might be
+  // gone by the time the motor thread gets to them. A ring that the motor
+  // thread frees in order, so we don't need to allocate for each line.
+  uint8_t *const pixels_;
+  uint32_t pixels_written_;         // Only accessed by the producer.
+  volatile uint32_t pixels_freed_;  // Only changed by the motor thread.
+  sem_t pixels_done_;               // Posted whenever pixels got freed.
+};
+
+#endif  // _BEAGLEG_THREADED_MOTOR_OPERATIONS_H_
@@ -0,0 +1,176 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "threaded-motor-operations.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+
+// Records what it receives; slow, like a full hardware queue.
+class SlowMotorOperations : public MotorOperations {
+public:
+  SlowMotorOperations() : caller_thread_ok_(true), enabled_(false) {
+    main_thread_ = pthread_self();
+  }
+
+  void Enqueue(const LinearSegmentSteps &segment) {
+    CheckThread();
+    usleep(100);
+    received_.push_back(segment.steps[0]);
+  }
+  void EnqueueRaster(const LinearSegmentSteps &segment,
+                     const uint8_t *pixels, int count) {
+    CheckThread();
+    received_.push_back(segment.steps[0]);
+    pixels_.push_back(std::vector<uint8_t>(pixels, pixels + count));
+  }
+  void MotorEnable(bool on) { CheckThread(); enabled_ = on; }
+  void WaitQueueEmpty() { CheckThread(); usleep(1000); }
+
+  // Only to be looked at when the motor thread is idle.
+  const std::vector<int> &received() const { return received_; }
+  const std::vector<std::vector<uint8_t> > &pixels() const { return pixels_; }
+  bool enabled() const { return enabled_; }
+  bool caller_thread_ok() const { return caller_thread_ok_; }
+
+private:
+  void CheckThread() {
+    caller_thread_ok_ &= !pthread_equal(main_thread_, pthread_self());
+  }
+
+  pthread_t main_thread_;
+  bool caller_thread_ok_;
+  bool enabled_;
+  std::vector<int> received_;
+  std::vector<std::vector<uint8_t> > pixels_;
+};
+
+// Blocks in the first Enqueue() until released.
+class BlockingMotorOperations : public MotorOperations {
+public:
+  BlockingMotorOperations() : blocked(false), released(false), received(0) {}
+  void Enqueue(const LinearSegmentSteps &segment) {
+    blocked = true;
+    while (!released) usleep(1000);
+    ++received;
+  }
+  void MotorEnable(bool on) {}
+  void WaitQueueEmpty() {}
+
+  volatile bool blocked;
+  volatile bool released;
+  volatile int received;
+};
+
+static LinearSegmentSteps MakeSegment(int steps) {
+  LinearSegmentSteps segment = {};
+  segment.v0 = segment.v1 = 1000;
+  segment.steps[0] = steps;
+  return segment;
+}
+
+TEST(ThreadedMotorOperations, OperationsArriveInOrderInOtherThread) {
+  SlowMotorOperations slow_ops;
+  ThreadedMotorOperations threaded(&slow_ops);
+  // More than fits in the queue between the threads.
+  const int kCount = 1000;
+  for (int i = 0; i < kCount; ++i) {
+    threaded.Enqueue(MakeSegment(i));
+  }
+  threaded.WaitQueueEmpty();  // Synchronous: all have arrived.
+
+  ASSERT_EQ(kCount, (int)slow_ops.received().size());
+  for (int i = 0; i < kCount; ++i) {
+    EXPECT_EQ(i, slow_ops.received()[i]);
+  }
+  EXPECT_TRUE(slow_ops.caller_thread_ok());
+}
+
+TEST(ThreadedMotorOperations, MotorEnableIsSynchronous) {
+  SlowMotorOperations slow_ops;
+  ThreadedMotorOperations threaded(&slow_ops);
+  threaded.Enqueue(MakeSegment(42));
+  threaded.MotorEnable(true);
+  EXPECT_TRUE(slow_ops.enabled());
+  ASSERT_EQ(1, (int)slow_ops.received().size());  // Comes before enable.
+  threaded.MotorEnable(false);
+  EXPECT_FALSE(slow_ops.enabled());
+}
+
+TEST(ThreadedMotorOperations, ShutdownFlushesPendingSegments) {
+  SlowMotorOperations slow_ops;
+  {
+    ThreadedMotorOperations threaded(&slow_ops);
+    for (int i = 0; i < 100; ++i) {
+      threaded.Enqueue(MakeSegment(i));
+    }
+  }
+  EXPECT_EQ(100, (int)slow_ops.received().size());
+}
+
+TEST(ThreadedMotorOperations, AbortDropsPendingSegments) {
+  BlockingMotorOperations blocking_ops;
+  {
+    ThreadedMotorOperations threaded(&blocking_ops);
+    for (int i = 0; i < 100; ++i) {
+      threaded.Enqueue(MakeSegment(i));
+    }
+    while (!blocking_ops.blocked) usleep(1000);
+    threaded.Abort();
+    threaded.Enqueue(MakeSegment(100));
+    blocking_ops.released = true;
+  }
+  EXPECT_EQ(1, blocking_ops.received);  // Only the one already started.
+}
+
+// More raster lines than fit the pixel buffer at once: the caller's pixels
+// are copied and arrive intact, also across the end of the buffer.
+TEST(ThreadedMotorOperations, RasterPixelsCopied) {
+  SlowMotorOperations slow_ops;
+  ThreadedMotorOperations threaded(&slow_ops);
+  const int kLines = 100;
+  const int kPixels = 3000;
+  uint8_t pixels[kPixels];
+  for (int i = 0; i < kLines; ++i) {
+    for (int p = 0; p < kPixels; ++p) pixels[p] = i + p;
+    threaded.EnqueueRaster(MakeSegment(i), pixels, kPixels - i);
+  }
+  threaded.WaitQueueEmpty();
+
+  ASSERT_EQ(kLines, (int)slow_ops.pixels().size());
+  for (int i = 0; i < kLines; ++i) {
+    const std::vector<uint8_t> &line = slow_ops.pixels()[i];
+    ASSERT_EQ(kPixels - i, (int)line.size());
+    for (int p = 0; p < kPixels - i; ++p) {
+      ASSERT_EQ((uint8_t) (i + p), line[p]) << "line " << i << " pixel " << p;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
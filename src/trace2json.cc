@@ -0,0 +1,66 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Convert a trace dump of machine-control --trace into the Chrome trace
+// event format, that can be loaded in chrome://tracing or ui.perfetto.dev
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "common/logging.h"
+#include "common/trace.h"
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s <trace-dump> [<output.json>]\n"
+          "Without output file, writes to stdout.\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3)
+    return usage(argv[0]);
+
+  Log_init("/dev/stderr");
+  std::vector<TraceEvent> events;
+  if (!Trace_read_dump(argv[1], &events))
+    return 1;
+
+  FILE *out = (argc == 3) ? fopen(argv[2], "w") : stdout;
+  if (out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  // Timestamps relative to the first event, in microseconds.
+  const uint64_t start_ns = events.empty() ? 0 : events[0].begin_ns;
+  fprintf(out, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < events.size(); ++i) {
+    const TraceEvent &e = events[i];
+    fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%d}}%s\n",
+            Trace_stage_name(e.stage), e.thread,
+            (e.begin_ns - start_ns) / 1000.0, e.duration_ns / 1000.0,
+            e.arg, (i + 1 < events.size()) ? "," : "");
+  }
+  fprintf(out, "],\"displayTimeUnit\":\"ms\"}\n");
+  if (out != stdout) fclose(out);
+  fprintf(stderr, "%d events.\n", (int)events.size());
+  return 0;
+}
@@ -33,8 +33,20 @@
 
 #include "common/logging.h"
 
+#include "motor-interface-constants.h"
+
+#ifdef BEAGLEG_PRU_EXTENDED
+// Generated PRU code from motor-interface-pru-extended.p
+#include "motor-interface-pru-extended_bin.h"
+#else
 // Generated PRU code from motor-interface-pru.p
 #include "motor-interface-pru_bin.h"
+#endif
+
+#ifdef BEAGLEG_PRU1_IO
+// Generated PRU code from pru1-io-interface.p
+#include "pru1-io-interface_bin.h"
+#endif
 
 // Target PRU
 #define PRU_NUM 0
@@ -79,14 +91,53 @@ bool UioPrussInterface::StartExecution() {
   return true;
 }
 
+bool UioPrussInterface::StartIOProcessor(uint32_t aux_bits,
+                                         PruIOCommunication **io) {
+#ifdef BEAGLEG_PRU1_IO
+  prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, (void **) io);
+  if (*io == NULL) {
+    Log_error("Couldn't map PRU shared memory.\n");
+    return false;
+  }
+  bzero(*io, sizeof(**io));
+  // Before it runs: the first thing it does is setting all aux outputs.
+  (*io)->aux_bits = aux_bits;
+  prussdrv_pru_write_memory(PRUSS0_PRU1_IRAM, 0, PRU1code, sizeof(PRU1code));
+  prussdrv_pru_enable(1);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool UioPrussInterface::AllocateRasterMem(volatile uint16_t **raster) {
+  void *shared_ram = NULL;
+  prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &shared_ram);
+  if (shared_ram == NULL) {
+    Log_error("Couldn't map PRU shared memory.\n");
+    return false;
+  }
+  *raster = (volatile uint16_t *)((uint8_t *)shared_ram + RASTER_SHARED_OFFSET);
+  return true;
+}
+
 unsigned UioPrussInterface::WaitEvent() {
   const unsigned num_events = prussdrv_pru_wait_event(PRU_EVTOUT_0);
   prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU_ARM_INTERRUPT);
   return num_events;
 }
 
+void UioPrussInterface::Halt() {
+  prussdrv_pru_disable(PRU_NUM);
+  // The PRU won't signal anymore; raise its event ourselves.
+  prussdrv_pru_send_event(PRU_ARM_INTERRUPT);
+}
+
 bool UioPrussInterface::Shutdown() {
   prussdrv_pru_disable(PRU_NUM);
+#ifdef BEAGLEG_PRU1_IO
+  prussdrv_pru_disable(1);
+#endif
   prussdrv_exit();
   return true;
 }